@@ -218,6 +218,20 @@ DIError DiskEntry::CopyData(A2FileDescr* pOpenFile, FILE* outfp, ConvertEOL conv
     SET_PROGRESS_BEGIN();
     pOpenFile->SetProgressUpdater(DiskArchive::ProgressCallback, srcLen, NULL);
 
+    /*
+     * If there's no conversion to do, let DiskImg copy it straight to the
+     * output file, skipping our buffer when the blocks are contiguous.
+     */
+    if (conv == kConvertEOLOff && convHA == kConvertHAOff) {
+        fflush(outfp);
+        dierr = pOpenFile->ExtractTo(fileno(outfp));
+        if (dierr != kDIErrNone) {
+            pMsg->Format(L"File copy failed: %hs",
+                DiskImgLib::DIStrError(dierr));
+        }
+        goto bail;
+    }
+
     /*
      * Loop until all data copied.
      */
@@ -930,12 +944,77 @@ CString DiskArchive::Reload()
 
     (void) fpPrimaryDiskFS->Flush(DiskImg::kFlushFastOnly);
 
+    /*
+     * Pick up anything written without going through the DiskFS, e.g. by
+     * the sector editor.  If the DiskFS can't follow the changes, it's
+     * out of date, so scan the image again.
+     */
+    CString errMsg;
+    DIError dierr = fpPrimaryDiskFS->Refresh();
+
     DeleteEntries();        // a GenericArchive operation
 
+    if (dierr != kDIErrNone) {
+        LOGI("DiskFS refresh failed: %hs, rescanning",
+            DiskImgLib::DIStrError(dierr));
+        dierr = Rescan();
+        if (dierr != kDIErrNone) {
+            errMsg.Format(L"Unable to read the disk image again: %hs.  The"
+                          L" file list may be out of date; reopen the image.",
+                DiskImgLib::DIStrError(dierr));
+        }
+    }
+
     if (LoadContents() != 0)
         return "Disk image reload failed.";
 
-    return "";
+    return errMsg;
+}
+
+DIError DiskArchive::Rescan(void)
+{
+    DIError dierr;
+    DiskFS* pNewDiskFS;
+
+    pNewDiskFS = fDiskImg.OpenAppropriateDiskFS();
+    if (pNewDiskFS == NULL)
+        return kDIErrInternal;
+    pNewDiskFS->SetScanForSubVolumes(DiskFS::kScanSubEnabled);
+
+    {
+        MainWindow* pMain = GET_MAIN_WINDOW();
+        ProgressCounterDialog* pProgress;
+
+        pProgress = new ProgressCounterDialog;
+        pProgress->Create(L"Examining contents, please wait...", pMain);
+        pProgress->SetCounterFormat(L"Scanning...");
+        pProgress->CenterWindow();
+        CWaitCursor waitc;
+
+        pMain->SetProgressCounterDialog(pProgress);
+        fDiskImg.SetScanProgressCallback(ScanProgressCallback, this);
+
+        dierr = pNewDiskFS->Initialize(&fDiskImg, DiskFS::kInitFull);
+
+        fDiskImg.SetScanProgressCallback(NULL, NULL);
+        pMain->SetProgressCounterDialog(NULL);
+        pProgress->DestroyWindow();
+    }
+
+    if (dierr != kDIErrNone) {
+        /* keep the one we had; it's stale, but it's something */
+        delete pNewDiskFS;
+        return dierr;
+    }
+
+    delete fpPrimaryDiskFS;
+    fpPrimaryDiskFS = pNewDiskFS;
+
+    /* same as Open */
+    if (fpPrimaryDiskFS->GetFSDamaged())
+        fIsReadOnly = true;
+
+    return kDIErrNone;
 }
 
 int DiskArchive::InternalReload(CWnd* pMsgWnd)
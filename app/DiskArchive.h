@@ -158,6 +158,9 @@ public:
      * do it at all.  We do it to keep the "dirty" flag clear when nothing is
      * really dirty, and we do it here because almost all of our functions call
      * "reload" after making changes, which makes it convenient to call from here.
+     *
+     * If the DiskFS can't catch up with changes made behind its back, the
+     * image is scanned again.
      */
     virtual CString Reload(void) override;
 
@@ -305,6 +308,14 @@ private:
      */
     int InternalReload(CWnd* pMsgWnd);
 
+    /*
+     * Replace the primary DiskFS with a fresh scan of the image, for when
+     * it can't refresh itself.  Everything written so far is in fDiskImg,
+     * so the file doesn't need to be reopened.  The old DiskFS is kept if
+     * the scan fails.  Any DiskEntry objects must be gone already.
+     */
+    DIError Rescan(void);
+
     /*
      * Compare DiskEntry display names in descending order (Z-A).
      */
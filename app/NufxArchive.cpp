@@ -1255,6 +1255,9 @@ void NufxArchive::AddPrep(CWnd* pMsgWnd, const AddFilesDialog* pAddOpts)
     else
         NuSetValue(fpArchive, kNuValueHandleExisting, kNuMaybeOverwrite);
 
+    /* compress on all CPUs when the adds are flushed */
+    NuSetValue(fpArchive, kNuValueCompressThreads, 0);
+
     NuSetErrorHandler(fpArchive, BulkAddErrorHandler);
     NuSetExtraData(fpArchive, this);
 }
@@ -1263,6 +1266,7 @@ void NufxArchive::AddFinish(void)
 {
     NuSetErrorHandler(fpArchive, NULL);
     NuSetValue(fpArchive, kNuValueHandleExisting, kNuMaybeOverwrite);
+    NuSetValue(fpArchive, kNuValueCompressThreads, 1);
     fpMsgWnd = NULL;
     fpAddOpts = NULL;
     //fBulkProgress = false;
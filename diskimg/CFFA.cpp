@@ -489,36 +489,35 @@ DIError DiskFSCFFA::Initialize(void)
  *
  * We don't handle the volume specially unless it's at least 32MB, which
  * means there are at least 2 partitions.
+ *
+ * The volumes are opened (possibly several at once), then added to the
+ * list in order.
  */
 DIError DiskFSCFFA::FindSubVolumes(void)
 {
     DIError dierr;
-    long startBlock, blocksLeft;
+    PartitionJob jobs[kMaxVolumes];
+    long startBlock, blocksLeft, fsNumBlocks;
+    int i, numJobs = 0;
 
     startBlock = 0;
     blocksLeft = fpImg->GetNumBlocks();
 
     if (fpImg->GetFSFormat() == DiskImg::kFormatCFFA4) {
         LOGI(" CFFA opening 4+2 volumes");
-        dierr = AddVolumeSeries(0, 4, kEarlyVolExpectedSize, /*ref*/startBlock,
-                /*ref*/blocksLeft);
-        if (dierr != kDIErrNone)
-            goto bail;
+        AddVolumeSeries(4, kEarlyVolExpectedSize, /*ref*/startBlock,
+            /*ref*/blocksLeft, jobs, /*ref*/numJobs);
 
         LOGI(" CFFA after first 4, startBlock=%ld blocksLeft=%ld",
             startBlock, blocksLeft);
         if (blocksLeft > 0) {
-            dierr = AddVolumeSeries(4, 2, kOneGB, /*ref*/startBlock,
-                    /*ref*/blocksLeft);
-            if (dierr != kDIErrNone)
-                goto bail;
+            AddVolumeSeries(2, kOneGB, /*ref*/startBlock,
+                /*ref*/blocksLeft, jobs, /*ref*/numJobs);
         }
     } else if (fpImg->GetFSFormat() == DiskImg::kFormatCFFA8) {
         LOGI(" CFFA opening 8 volumes");
-        dierr = AddVolumeSeries(0, 8, kEarlyVolExpectedSize, /*ref*/startBlock,
-            /*ref*/blocksLeft);
-        if (dierr != kDIErrNone)
-            goto bail;
+        AddVolumeSeries(8, kEarlyVolExpectedSize, /*ref*/startBlock,
+            /*ref*/blocksLeft, jobs, /*ref*/numJobs);
     } else {
         assert(false);
         return kDIErrInternal;
@@ -528,64 +527,82 @@ DIError DiskFSCFFA::FindSubVolumes(void)
         LOGI("  CFFA ignoring leftover %ld blocks", blocksLeft);
     }
 
-bail:
-    return dierr;
-}
-
-/*
- * Add a series of equal-sized volumes.
- *
- * Updates "startBlock" and "totalBlocksLeft".
- */
-DIError DiskFSCFFA::AddVolumeSeries(int start, int count, long blocksPerVolume,
-    long& startBlock, long& totalBlocksLeft)
-{
-    DIError dierr = kDIErrNone;
-    DiskFS* pNewFS = NULL;
-    DiskImg* pNewImg = NULL;
-    long maxBlocks, fsNumBlocks;
-    bool scanOnly = false;
-
-    /* used by volume copier, to avoid deep scan */
-    if (GetScanForSubVolumes() == kScanSubContainerOnly)
-        scanOnly = true;
+    dierr = OpenPartitions(jobs, numJobs);
+    if (dierr != kDIErrNone)
+        goto bail;
 
-    for (int i = start; i < start+count; i++) {
-        maxBlocks = blocksPerVolume;
-        if (maxBlocks > totalBlocksLeft)
-            maxBlocks = totalBlocksLeft;
+    for (i = 0; i < numJobs; i++) {
+        if (jobs[i].dierr != kDIErrNone) {
+            DiskFS* pNewFS = NULL;
+            DiskImg* pNewImg = NULL;
 
-        dierr = OpenSubVolume(fpImg, startBlock, maxBlocks, scanOnly,
-                    &pNewImg, &pNewFS);
-        if (dierr != kDIErrNone) {
-            if (dierr == kDIErrCancelled)
-                goto bail;
             LOGI(" CFFA failed opening sub-volume %d (not formatted?)", i);
             /* create a fake one to represent the partition */
-            dierr = CreatePlaceholder(startBlock, maxBlocks, NULL, NULL,
-                        &pNewImg, &pNewFS);
+            dierr = CreatePlaceholder(jobs[i].startBlock, jobs[i].numBlocks,
+                        NULL, NULL, &pNewImg, &pNewFS);
             if (dierr == kDIErrNone) {
                 AddSubVolumeToList(pNewImg, pNewFS);
             } else {
                 LOGI("  CFFA unable to create placeholder (%ld, %ld) (err=%d)",
-                    startBlock, maxBlocks, dierr);
-                goto bail;
+                    jobs[i].startBlock, jobs[i].numBlocks, dierr);
+                break;
             }
         } else {
-            fsNumBlocks = pNewFS->GetFSNumBlocks();
-            if (fsNumBlocks < 2 || fsNumBlocks > blocksPerVolume) {
+            fsNumBlocks = jobs[i].pNewFS->GetFSNumBlocks();
+            if (fsNumBlocks < 2 || fsNumBlocks > jobs[i].numBlocks) {
                 LOGI(" CFFA WARNING: FSNumBlocks #%d reported as %ld",
                     i, fsNumBlocks);
             }
-            AddSubVolumeToList(pNewImg, pNewFS);
+            AddSubVolumeToList(jobs[i].pNewImg, jobs[i].pNewFS);
         }
+    }
+
+    /* anything we didn't get to */
+    for ( ; i < numJobs; i++) {
+        delete jobs[i].pNewFS;
+        delete jobs[i].pNewImg;
+    }
+
+bail:
+    return dierr;
+}
+
+/*
+ * Add a series of equal-sized volumes to the list of jobs.
+ *
+ * Updates "startBlock", "totalBlocksLeft", and "numJobs".
+ */
+void DiskFSCFFA::AddVolumeSeries(int count, long blocksPerVolume,
+    long& startBlock, long& totalBlocksLeft, PartitionJob* pJobs,
+    int& numJobs)
+{
+    long maxBlocks;
+
+    for (int i = 0; i < count && numJobs < kMaxVolumes; i++) {
+        maxBlocks = blocksPerVolume;
+        if (maxBlocks > totalBlocksLeft)
+            maxBlocks = totalBlocksLeft;
+
+        pJobs[numJobs].startBlock = startBlock;
+        pJobs[numJobs].numBlocks = maxBlocks;
+        pJobs[numJobs].pCookie = NULL;
+        numJobs++;
 
         startBlock += maxBlocks;
         totalBlocksLeft -= maxBlocks;
         if (!totalBlocksLeft)
             break;          // all done
     }
+}
 
-bail:
-    return dierr;
+/*
+ * Open one volume.  This may be called on a worker thread.
+ */
+DIError DiskFSCFFA::OpenPartition(PartitionJob* pJob)
+{
+    /* used by volume copier, to avoid deep scan */
+    bool scanOnly = (GetScanForSubVolumes() == kScanSubContainerOnly);
+
+    return OpenSubVolume(fpImg, pJob->startBlock, pJob->numBlocks, scanOnly,
+                &pJob->pNewImg, &pJob->pNewFS);
 }
@@ -218,7 +218,7 @@ DIError DiskFSCPM::ReadCatalog(void)
                 fDirEntry[i].userNumber);
         }
 
-        pFile = new A2FileCPM(this, fDirEntry);
+        pFile = new (this) A2FileCPM(this, fDirEntry);
         FormatName(pFile->fFileName, (char*)fDirEntry[i].fileName);
         pFile->fReadOnly = fDirEntry[i].readOnly;
         pFile->fDirIdx = i;
@@ -8,6 +8,7 @@
  */
 #include "StdAfx.h"
 #include "DiskImgPriv.h"
+#include <thread>
 
 
 /*
@@ -118,3 +119,140 @@ bail:
     }
     return dierr;
 }
+
+
+/*
+ * Open and scan a set of partitions.
+ *
+ * Each job is handed to OpenPartition().  If we're allowed more than one
+ * thread, the jobs are run on worker threads, and this thread waits for
+ * them while passing their progress updates on to the scan progress
+ * callback.  (The callback may be driving a dialog, and shouldn't be
+ * called from other threads.)
+ *
+ * The partitions all read through GFDGFD views of our data GFD, which use
+ * positional reads, so they don't step on each other.  We don't touch the
+ * GFD ourselves while the workers are running.
+ *
+ * Nothing is added to the sub-volume list; the caller does that, in
+ * partition order, so the results don't depend on how the threads were
+ * scheduled.  A failure in one partition is left in its "dierr".  If the
+ * progress callback asks us to stop, everything is thrown away and we
+ * return kDIErrCancelled.
+ */
+DIError DiskFSContainer::OpenPartitions(PartitionJob* pJobs, int numJobs)
+{
+    DIError dierr = kDIErrNone;
+    std::thread* threads = NULL;
+    int numThreads, nextJob, i;
+
+    for (i = 0; i < numJobs; i++) {
+        pJobs[i].pNewImg = NULL;
+        pJobs[i].pNewFS = NULL;
+        pJobs[i].dierr = kDIErrNone;
+    }
+
+    numThreads = (int) GetParameter(kParm_SubVolumeThreads);
+    if (numThreads <= 0) {
+        numThreads = (int) std::thread::hardware_concurrency();
+        if (numThreads > kMaxPartitionThreads)
+            numThreads = kMaxPartitionThreads;
+    }
+    if (numThreads > numJobs)
+        numThreads = numJobs;
+
+    if (numThreads <= 1) {
+        /* do them all here */
+        for (i = 0; i < numJobs; i++) {
+            pJobs[i].dierr = OpenPartition(&pJobs[i]);
+            if (pJobs[i].dierr == kDIErrCancelled) {
+                dierr = kDIErrCancelled;
+                goto bail;
+            }
+        }
+        goto bail;
+    }
+
+    LOGI(" %s opening %d partitions on %d threads", GetDebugName(),
+        numJobs, numThreads);
+
+    {
+        ScanRelay relay;
+        char msg[sizeof(relay.fMsg)];
+        int count;
+
+        nextJob = 0;
+        relay.fNumActive = numThreads;
+        fpImg->fpScanRelay = &relay;
+
+        threads = new std::thread[numThreads];
+        for (i = 0; i < numThreads; i++) {
+            threads[i] = std::thread(PartitionWorker, this, pJobs, numJobs,
+                            &nextJob, &relay);
+        }
+
+        std::unique_lock<std::mutex> lock(relay.fLock);
+        while (relay.fNumActive > 0 || relay.fPending) {
+            if (!relay.fPending) {
+                relay.fCond.wait(lock);
+                continue;
+            }
+
+            relay.fPending = false;
+            if (relay.fCancelled)
+                continue;       // just waiting for the workers to stop
+            strcpy(msg, relay.fMsg);
+            count = relay.fCount;
+            lock.unlock();
+            bool cont = fpImg->SendScanProgress(msg, count);
+            lock.lock();
+            if (!cont)
+                relay.fCancelled = true;
+        }
+        if (relay.fCancelled)
+            dierr = kDIErrCancelled;
+        lock.unlock();
+
+        for (i = 0; i < numThreads; i++)
+            threads[i].join();
+        delete[] threads;
+        fpImg->fpScanRelay = NULL;
+    }
+
+    for (i = 0; i < numJobs; i++) {
+        if (pJobs[i].dierr == kDIErrCancelled)
+            dierr = kDIErrCancelled;
+    }
+
+bail:
+    if (dierr != kDIErrNone) {
+        for (i = 0; i < numJobs; i++) {
+            delete pJobs[i].pNewFS;
+            delete pJobs[i].pNewImg;
+            pJobs[i].pNewFS = NULL;
+            pJobs[i].pNewImg = NULL;
+        }
+    }
+    return dierr;
+}
+
+/*
+ * Worker thread for OpenPartitions.  Grabs jobs until they're gone or
+ * we've been cancelled.
+ */
+/*static*/ void DiskFSContainer::PartitionWorker(DiskFSContainer* pContainer,
+    PartitionJob* pJobs, int numJobs, int* pNextJob, ScanRelay* pRelay)
+{
+    std::unique_lock<std::mutex> lock(pRelay->fLock);
+
+    while (!pRelay->fCancelled && *pNextJob < numJobs) {
+        PartitionJob* pJob = &pJobs[(*pNextJob)++];
+
+        lock.unlock();
+        pJob->dierr = pContainer->OpenPartition(pJob);
+        lock.lock();
+    }
+
+    pRelay->fNumActive--;
+    pRelay->fCond.notify_one();
+}
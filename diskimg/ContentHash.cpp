@@ -0,0 +1,314 @@
+/*
+ * CiderPress
+ * Copyright (C) 2009 by CiderPress authors.  All Rights Reserved.
+ * See the file LICENSE for distribution terms.
+ */
+/*
+ * Content hashing for blocks, files, and disk images.
+ *
+ * The hash function follows the structure of XXH64: four 64-bit lanes
+ * consume 32-byte stripes, then the lanes are merged, the tail is mixed
+ * in, and the result is run through an avalanche step.  Disk blocks are
+ * always a multiple of 32 bytes, so the stripe loop does nearly all of
+ * the work.
+ */
+#include "StdAfx.h"
+#include "DiskImgPriv.h"
+
+static const uint64_t kPrime1 = 0x9e3779b185ebca87ULL;
+static const uint64_t kPrime2 = 0xc2b2ae3d27d4eb4fULL;
+static const uint64_t kPrime3 = 0x165667b19e3779f9ULL;
+static const uint64_t kPrime4 = 0x85ebca77c2b2ae63ULL;
+static const uint64_t kPrime5 = 0x27d4eb2f165667c5ULL;
+
+/* number of blocks we read at a time when hashing a block image */
+static const int kHashReadBlocks = 64;
+/* size of the pieces we read when hashing a file */
+static const int kHashFileBufSize = 65536;
+
+static inline uint64_t Rotl64(uint64_t val, int bits)
+{
+    return (val << bits) | (val >> (64 - bits));
+}
+
+static inline uint64_t Read64LE(const uint8_t* ptr)
+{
+    return (uint64_t) GetLongLE(ptr) | (uint64_t) GetLongLE(ptr + 4) << 32;
+}
+
+static inline uint64_t HashRound(uint64_t acc, uint64_t input)
+{
+    acc += input * kPrime2;
+    acc = Rotl64(acc, 31);
+    return acc * kPrime1;
+}
+
+static inline uint64_t HashMergeRound(uint64_t acc, uint64_t val)
+{
+    acc ^= HashRound(0, val);
+    return acc * kPrime1 + kPrime4;
+}
+
+/*
+ * Compute the hash of a buffer.
+ */
+/*static*/ uint64_t ContentHash::Hash64(const void* buf, size_t len,
+    uint64_t seed)
+{
+    const uint8_t* ptr = (const uint8_t*) buf;
+    const uint8_t* end = ptr + len;
+    uint64_t hash;
+
+    if (len >= 32) {
+        const uint8_t* limit = end - 32;
+        uint64_t v1 = seed + kPrime1 + kPrime2;
+        uint64_t v2 = seed + kPrime2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - kPrime1;
+
+        do {
+            v1 = HashRound(v1, Read64LE(ptr));
+            v2 = HashRound(v2, Read64LE(ptr + 8));
+            v3 = HashRound(v3, Read64LE(ptr + 16));
+            v4 = HashRound(v4, Read64LE(ptr + 24));
+            ptr += 32;
+        } while (ptr <= limit);
+
+        hash = Rotl64(v1, 1) + Rotl64(v2, 7) + Rotl64(v3, 12) +
+                Rotl64(v4, 18);
+        hash = HashMergeRound(hash, v1);
+        hash = HashMergeRound(hash, v2);
+        hash = HashMergeRound(hash, v3);
+        hash = HashMergeRound(hash, v4);
+    } else {
+        hash = seed + kPrime5;
+    }
+
+    hash += (uint64_t) len;
+
+    while (ptr + 8 <= end) {
+        hash ^= HashRound(0, Read64LE(ptr));
+        hash = Rotl64(hash, 27) * kPrime1 + kPrime4;
+        ptr += 8;
+    }
+    if (ptr + 4 <= end) {
+        hash ^= (uint64_t) GetLongLE(ptr) * kPrime1;
+        hash = Rotl64(hash, 23) * kPrime2 + kPrime3;
+        ptr += 4;
+    }
+    while (ptr < end) {
+        hash ^= (*ptr) * kPrime5;
+        hash = Rotl64(hash, 11) * kPrime1;
+        ptr++;
+    }
+
+    hash ^= hash >> 33;
+    hash *= kPrime2;
+    hash ^= hash >> 29;
+    hash *= kPrime3;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+/*
+ * Hash a single chunk.  The chunk size is used as the seed so that a
+ * 256-byte sector never matches a 512-byte block, and the value reserved
+ * for unreadable chunks is never produced.
+ */
+static inline uint64_t HashChunk(const uint8_t* buf, int chunkSize)
+{
+    uint64_t hash = ContentHash::Hash64(buf, chunkSize, chunkSize);
+    if (hash == ContentHash::kUnreadableChunk)
+        hash++;
+    return hash;
+}
+
+/*
+ * Figure out how we're going to walk through the image.  We want to use
+ * the filesystem's natural unit, so a DOS 3.3 disk is hashed as sectors
+ * and a ProDOS disk as blocks, regardless of how the image file is
+ * ordered.
+ */
+/*static*/ long ContentHash::GetChunkCount(const DiskImg* pImg,
+    int* pChunkSize)
+{
+    if (pImg->GetHasBlocks() && (pImg->ShowAsBlocks() ||
+        !pImg->GetHasSectors()))
+    {
+        *pChunkSize = kBlockSize;
+        return pImg->GetNumBlocks();
+    } else if (pImg->GetHasSectors()) {
+        *pChunkSize = kSectorSize;
+        return pImg->GetNumTracks() * pImg->GetNumSectPerTrack();
+    } else {
+        *pChunkSize = 0;
+        return 0;
+    }
+}
+
+/*
+ * Hash all blocks or sectors of a disk image.
+ *
+ * Blocks are read in large groups.  If a group read fails (e.g. because of
+ * a bad block in a 3.5" nibble image), we go back and read the group one
+ * block at a time so only the damaged blocks are lost.
+ */
+/*static*/ DIError ContentHash::HashChunks(DiskImg* pImg, uint64_t* hashBuf,
+    long count, long* pUnreadable)
+{
+    DIError dierr = kDIErrNone;
+    uint8_t* buf = NULL;
+    long unreadable = 0;
+    int chunkSize;
+    long numChunks;
+
+    numChunks = GetChunkCount(pImg, &chunkSize);
+    if (numChunks == 0)
+        return kDIErrUnsupportedAccess;
+    if (count < numChunks)
+        return kDIErrInvalidArg;
+
+    if (chunkSize == kBlockSize) {
+        buf = new uint8_t[kHashReadBlocks * kBlockSize];
+        if (buf == NULL)
+            return kDIErrMalloc;
+
+        for (long block = 0; block < numChunks; block += kHashReadBlocks) {
+            int numBlocks = kHashReadBlocks;
+            if (block + numBlocks > numChunks)
+                numBlocks = (int) (numChunks - block);
+
+            if (pImg->ReadBlocks(block, numBlocks, buf) == kDIErrNone) {
+                for (int i = 0; i < numBlocks; i++)
+                    hashBuf[block + i] = HashChunk(buf + i * kBlockSize,
+                                            kBlockSize);
+            } else {
+                for (int i = 0; i < numBlocks; i++) {
+                    if (pImg->ReadBlock(block + i, buf) == kDIErrNone) {
+                        hashBuf[block + i] = HashChunk(buf, kBlockSize);
+                    } else {
+                        hashBuf[block + i] = kUnreadableChunk;
+                        unreadable++;
+                    }
+                }
+            }
+        }
+    } else {
+        long numTracks = pImg->GetNumTracks();
+        int numSects = pImg->GetNumSectPerTrack();
+
+        buf = new uint8_t[kSectorSize];
+        if (buf == NULL)
+            return kDIErrMalloc;
+
+        for (long track = 0; track < numTracks; track++) {
+            for (int sector = 0; sector < numSects; sector++) {
+                long idx = track * numSects + sector;
+                if (pImg->ReadTrackSector(track, sector, buf) == kDIErrNone) {
+                    hashBuf[idx] = HashChunk(buf, kSectorSize);
+                } else {
+                    hashBuf[idx] = kUnreadableChunk;
+                    unreadable++;
+                }
+            }
+        }
+    }
+
+    if (unreadable != 0) {
+        LOGI(" ContentHash: %ld of %ld chunks unreadable",
+            unreadable, numChunks);
+    }
+    if (pUnreadable != NULL)
+        *pUnreadable = unreadable;
+
+    delete[] buf;
+    return dierr;
+}
+
+/*
+ * Return the hash of an all-zero chunk.  Freshly-formatted disks are
+ * mostly zeroes, so callers generally want to ignore these.
+ */
+/*static*/ uint64_t ContentHash::GetZeroChunkHash(int chunkSize)
+{
+    uint8_t zeroes[kBlockSize];
+
+    assert(chunkSize > 0 && chunkSize <= kBlockSize);
+    memset(zeroes, 0, chunkSize);
+    return HashChunk(zeroes, chunkSize);
+}
+
+/*
+ * Compute a hash for the whole image from the per-chunk hashes.  We
+ * serialize the values as little-endian so the result doesn't depend on
+ * the host.
+ */
+/*static*/ uint64_t ContentHash::HashImage(const uint64_t* hashBuf,
+    long count)
+{
+    uint8_t buf[256 * 8];
+    uint64_t hash = (uint64_t) count;
+
+    while (count > 0) {
+        int num = count > 256 ? 256 : (int) count;
+        for (int i = 0; i < num; i++) {
+            PutLongLE(buf + i * 8, (uint32_t) hashBuf[i]);
+            PutLongLE(buf + i * 8 + 4, (uint32_t) (hashBuf[i] >> 32));
+        }
+        hash = Hash64(buf, num * 8, hash);
+        hashBuf += num;
+        count -= num;
+    }
+    return hash;
+}
+
+/*
+ * Hash one fork of a file.  The file is read in fixed-size pieces, each
+ * of which is hashed with the previous result as the seed.
+ */
+/*static*/ DIError ContentHash::HashFile(A2File* pFile, bool rsrcFork,
+    uint64_t* pHash, di_off_t* pLength)
+{
+    DIError dierr;
+    A2FileDescr* pOpenFile = NULL;
+    uint8_t* buf = NULL;
+    uint64_t hash = 0;
+    di_off_t total = 0;
+
+    dierr = pFile->Open(&pOpenFile, true, rsrcFork);
+    if (dierr != kDIErrNone)
+        return dierr;
+
+    buf = new uint8_t[kHashFileBufSize];
+    if (buf == NULL) {
+        dierr = kDIErrMalloc;
+        goto bail;
+    }
+
+    while (true) {
+        size_t actual = 0;
+
+        dierr = pOpenFile->Read(buf, kHashFileBufSize, &actual);
+        if (dierr == kDIErrEOF) {
+            dierr = kDIErrNone;
+            break;
+        }
+        if (dierr != kDIErrNone)
+            goto bail;
+        if (actual == 0)
+            break;
+
+        hash = Hash64(buf, actual, hash);
+        total += actual;
+        if (actual < (size_t) kHashFileBufSize)
+            break;
+    }
+
+    *pHash = hash;
+    *pLength = total;
+
+bail:
+    delete[] buf;
+    pOpenFile->Close();
+    return dierr;
+}
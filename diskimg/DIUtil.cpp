@@ -195,6 +195,27 @@ DIError DiskImgLib::WriteLongBE(GenericFD* pGFD, uint32_t val)
     return pGFD->Write(&buf, 1);
 }
 
+/*
+ * Write a buffer to a host file descriptor, continuing after short writes.
+ */
+DIError DiskImgLib::WriteHostFd(int fd, const uint8_t* buf, size_t length)
+{
+    while (length > 0) {
+        long actual = (long) ::write(fd, buf, (unsigned int) length);
+        if (actual < 0) {
+            if (errno == EINTR)
+                continue;
+            DIError dierr = ErrnoOrGeneric();
+            LOGI(" Write of %lu to fd %d failed (err=%d)",
+                (unsigned long) length, fd, dierr);
+            return dierr;
+        }
+        buf += actual;
+        length -= actual;
+    }
+    return kDIErrNone;
+}
+
 
 /*
  * Find the filename component of a local pathname.  Uses the fssep passed
@@ -306,6 +327,92 @@ char* DiskImgLib::StrcpyNew(const char* str)
     return newStr;
 }
 
+/*
+ * The C library keeps its time zone state in globals.  With TZ unset,
+ * glibc's mktime() re-reads the zone on every call, freeing the old data
+ * while localtime_r() in another thread may be using it.  glibc holds a
+ * lock of its own, but ThreadSanitizer can't see that one, so all of our
+ * time conversions go through this lock instead.
+ */
+static std::mutex gTimeLock;
+
+/*
+ * Like localtime(), but the result goes into "pTm" instead of a static
+ * buffer.  Returns "pTm" on success, NULL on failure.
+ */
+struct tm* DiskImgLib::LocalTime(const time_t* pWhen, struct tm* pTm)
+{
+    std::lock_guard<std::mutex> lock(gTimeLock);
+#ifdef _WIN32
+    if (localtime_s(pTm, pWhen) != 0)
+        return NULL;
+    return pTm;
+#else
+    return localtime_r(pWhen, pTm);
+#endif
+}
+
+/*
+ * Like gmtime(), but the result goes into "pTm".
+ */
+struct tm* DiskImgLib::GmTime(const time_t* pWhen, struct tm* pTm)
+{
+    std::lock_guard<std::mutex> lock(gTimeLock);
+#ifdef _WIN32
+    if (gmtime_s(pTm, pWhen) != 0)
+        return NULL;
+    return pTm;
+#else
+    return gmtime_r(pWhen, pTm);
+#endif
+}
+
+/*
+ * Like ctime(), but the result goes into "buf", which must be at least
+ * kCTimeBufLen bytes long.  Returns NULL if the date can't be converted.
+ */
+const char* DiskImgLib::FormatCTime(const time_t* pWhen, char* buf)
+{
+    std::lock_guard<std::mutex> lock(gTimeLock);
+#ifdef _WIN32
+    if (ctime_s(buf, kCTimeBufLen, pWhen) != 0)
+        return NULL;
+    return buf;
+#else
+    return ctime_r(pWhen, buf);
+#endif
+}
+
+/*
+ * Like mktime(), but serialized with the other time functions.
+ */
+time_t DiskImgLib::MakeTime(struct tm* pTm)
+{
+    std::lock_guard<std::mutex> lock(gTimeLock);
+    return mktime(pTm);
+}
+
+/*
+ * Compute the difference between local time and UTC, in seconds, with
+ * the current DST setting.  Used for HFS dates, which are local.
+ */
+long DiskImgLib::LocalTimeOffset(void)
+{
+    struct tm tmWhen;
+    time_t when;
+    int isDst;
+
+    when = time(NULL);
+    isDst = 0;
+    if (LocalTime(&when, &tmWhen) != NULL)
+        isDst = tmWhen.tm_isdst;
+
+    if (GmTime(&when, &tmWhen) == NULL)
+        return 0;
+    tmWhen.tm_isdst = isDst;
+    return (long) (when - MakeTime(&tmWhen));
+}
+
 
 #ifdef _WIN32
 /*
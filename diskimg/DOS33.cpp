@@ -12,6 +12,7 @@
  */
 #include "StdAfx.h"
 #include "DiskImgPriv.h"
+#include <vector>
 
 
 /*
@@ -221,17 +222,19 @@ DIError DiskFSDOS33::Initialize(InitMode initMode)
     if (dierr != kDIErrNone)
         goto bail;
 
-    /* run through and get file lengths and data offsets */
-    dierr = GetFileLengths();
-    if (dierr != kDIErrNone)
+    if (initMode == kInitCatalogOnly) {
+        /* lengths are computed per-file on request, the rest all at once */
+        A2FileDOS* pFile = (A2FileDOS*) GetNextFile(NULL);
+        while (pFile != NULL) {
+            pFile->fLengthDeferred = true;
+            pFile = (A2FileDOS*) GetNextFile(pFile);
+        }
+        LOGI(" DOS - catalogOnly set, deferring file scan");
+        SetInitDeferred(true);
         goto bail;
+    }
 
-    /* mark DOS tracks appropriately */
-    FixVolumeUsageMap();
-
-    fDiskIsGood = CheckDiskIsGood();
-
-    fVolumeUsage.Dump();
+    dierr = DoDeferredInit();
 
 //  A2File* pFile;
 //  pFile = GetNextFile(NULL);
@@ -244,6 +247,29 @@ bail:
     return dierr;
 }
 
+/*
+ * Compute the file lengths, fill out the volume usage map, and check the
+ * disk for damage.  Called from Initialize, or later if the volume was
+ * opened with kInitCatalogOnly.
+ */
+DIError DiskFSDOS33::DoDeferredInit(void)
+{
+    DIError dierr;
+
+    /* run through and get file lengths and data offsets */
+    dierr = GetFileLengths();
+    if (dierr != kDIErrNone)
+        return dierr;
+
+    /* mark DOS tracks appropriately */
+    FixVolumeUsageMap();
+
+    fDiskIsGood = CheckDiskIsGood();
+
+    fVolumeUsage.Dump();
+    return kDIErrNone;
+}
+
 /*
  * Read some fields from the disk Volume Table of Contents.
  */
@@ -811,7 +837,7 @@ DIError DiskFSDOS33::ProcessCatalogSector(int catTrack, int catSect,
 
     for (i = 0; i < kCatalogEntriesPerSect; i++) {
         if (pEntry[0x00] != kEntryUnused && pEntry[0x00] != kEntryDeleted) {
-            pFile = new A2FileDOS(this);
+            pFile = new (this) A2FileDOS(this);
 
             pFile->SetQuality(A2File::kQualityGood);
 
@@ -976,44 +1002,57 @@ bail:
 DIError DiskFSDOS33::GetFileLengths(void)
 {
     A2FileDOS* pFile;
-    TrackSector* tsList = NULL;
-    TrackSector* indexList = NULL;
-    int tsCount;
-    int indexCount;
 
     pFile = (A2FileDOS*) GetNextFile(NULL);
     while (pFile != NULL) {
-        DIError dierr;
-        dierr = pFile->LoadTSList(&tsList, &tsCount, &indexList, &indexCount);
+        GetFileLength(pFile, true);
+        pFile = (A2FileDOS*) GetNextFile(pFile);
+    }
+
+    return kDIErrNone;
+}
+
+/*
+ * Load the T/S list for one file and compute its length.  If "markUsage"
+ * is set, the sectors are marked in the VolumeUsage object.
+ *
+ * Problems are recorded in the file's quality.
+ */
+void DiskFSDOS33::GetFileLength(A2FileDOS* pFile, bool markUsage)
+{
+    TrackSector* tsList = NULL;
+    TrackSector* indexList = NULL;
+    int tsCount = 0;
+    int indexCount = 0;
+    DIError dierr;
+
+    pFile->fLengthDeferred = false;
+
+    dierr = pFile->LoadTSList(&tsList, &tsCount, &indexList, &indexCount);
+    if (dierr != kDIErrNone) {
+        LOGI("DOS failed loading TS list for '%s'",
+            pFile->GetPathName());
+        pFile->SetQuality(A2File::kQualityDamaged);
+    } else {
+        if (markUsage)
+            MarkFileUsage(pFile, tsList, tsCount, indexList, indexCount);
+        dierr = ComputeLength(pFile, tsList, tsCount);
         if (dierr != kDIErrNone) {
-            LOGI("DOS failed loading TS list for '%s'",
+            LOGI("DOS unable to get length for '%s'",
                 pFile->GetPathName());
             pFile->SetQuality(A2File::kQualityDamaged);
-        } else {
-            MarkFileUsage(pFile, tsList, tsCount, indexList, indexCount);
-            dierr = ComputeLength(pFile, tsList, tsCount);
-            if (dierr != kDIErrNone) {
-                LOGI("DOS unable to get length for '%s'",
-                    pFile->GetPathName());
-                pFile->SetQuality(A2File::kQualityDamaged);
-            }
-        }
-
-        if (pFile->fLengthInSectors != indexCount + tsCount) {
-            LOGI("DOS NOTE: file '%s' has len-in-sect=%d but actual=%d",
-                pFile->GetPathName(), pFile->fLengthInSectors,
-                indexCount + tsCount);
-            // expected on sparse random-access text files
         }
+    }
 
-        delete[] tsList;
-        delete[] indexList;
-        tsList = indexList = NULL;
-
-        pFile = (A2FileDOS*) GetNextFile(pFile);
+    if (pFile->fLengthInSectors != indexCount + tsCount) {
+        LOGI("DOS NOTE: file '%s' has len-in-sect=%d but actual=%d",
+            pFile->GetPathName(), pFile->fLengthInSectors,
+            indexCount + tsCount);
+        // expected on sparse random-access text files
     }
 
-    return kDIErrNone;
+    delete[] tsList;
+    delete[] indexList;
 }
 
 /*
@@ -1663,7 +1702,7 @@ DIError DiskFSDOS33::CreateFile(const CreateParms* pParms,  A2File** ppNewFile)
 
     if (fpImg->GetReadOnly())
         return kDIErrAccessDenied;
-    if (!fDiskIsGood)
+    if (GetFSDamaged())
         return kDIErrBadDiskImage;
 
     assert(pParms != NULL);
@@ -1747,7 +1786,7 @@ DIError DiskFSDOS33::CreateFile(const CreateParms* pParms,  A2File** ppNewFile)
     /*
      * Create a new entry for our file list.
      */
-    pNewFile = new A2FileDOS(this);
+    pNewFile = new (this) A2FileDOS(this);
     if (pNewFile == NULL) {
         dierr = kDIErrMalloc;
         goto bail;
@@ -2011,7 +2050,7 @@ DIError DiskFSDOS33::DeleteFile(A2File* pGenericFile)
 
     if (fpImg->GetReadOnly())
         return kDIErrAccessDenied;
-    if (!fDiskIsGood)
+    if (GetFSDamaged())
         return kDIErrBadDiskImage;
     if (pGenericFile->IsFileOpen())
         return kDIErrFileOpen;
@@ -2117,7 +2156,7 @@ DIError DiskFSDOS33::RenameFile(A2File* pGenericFile, const char* newName)
         return kDIErrInvalidArg;
     if (fpImg->GetReadOnly())
         return kDIErrAccessDenied;
-    if (!fDiskIsGood)
+    if (GetFSDamaged())
         return kDIErrBadDiskImage;
 
     LOGI(" DOS renaming '%s' to '%s'", pFile->GetPathName(), newName);
@@ -2180,6 +2219,9 @@ DIError DiskFSDOS33::SetFileInfo(A2File* pGenericFile, uint32_t fileType,
         return kDIErrInvalidArg;
     if (fpImg->GetReadOnly())
         return kDIErrAccessDenied;
+    dierr = CompleteDeferredInit();
+    if (dierr != kDIErrNone)
+        return dierr;
 
     LOGI("DOS SetFileInfo '%s' type=0x%02x aux=0x%04x access=0x%02x",
         pFile->GetPathName(), fileType, auxType, accessFlags);
@@ -2384,10 +2426,25 @@ A2FileDOS::A2FileDOS(DiskFS* pDiskFS) : A2File(pDiskFS)
     fDataOffset = 0;
     fLength = -1;
     fSparseLength = -1;
+    fLengthDeferred = false;
 
     fpOpenFile = NULL;
 }
 
+/*
+ * Compute the length of this file if the volume was opened with
+ * kInitCatalogOnly and we haven't done it yet.  Listing a catalog only
+ * costs the T/S list and first sector of the files whose length is asked
+ * for.
+ */
+void A2FileDOS::LoadDeferredInfo(void) const
+{
+    if (fLengthDeferred) {
+        DiskFSDOS33* pDiskFS = (DiskFSDOS33*) fpDiskFS;
+        pDiskFS->GetFileLength(const_cast<A2FileDOS*>(this), false);
+    }
+}
+
 /*
  * Destructor.  Make sure an "open" file gets "closed".
  */
@@ -2568,6 +2625,8 @@ DIError A2FileDOS::Open(A2FileDescr** ppOpenFile, bool readOnly,
     DIError dierr = kDIErrNone;
     A2FDDOS* pOpenFile = NULL;
 
+    LoadDeferredInfo();
+
     if (!readOnly) {
         if (fpDiskFS->GetDiskImg()->GetReadOnly())
             return kDIErrAccessDenied;
@@ -2970,161 +3029,260 @@ DIError A2FDDOS::Read(void* buf, size_t len, size_t* pActual)
     return dierr;
 }
 
+/*
+ * State for a file that's being filled in by a series of Write calls.
+ */
+struct A2FDDOS::WriteState {
+    WriteState(void) : sctLen(0), failed(false) {}
+
+    uint8_t     sct[kSctSize];          // data not yet written to disk
+    int         sctLen;
+    std::vector<TrackSector> data;      // data sectors
+    std::vector<TrackSector> index;     // T/S list sectors
+    bool        failed;                 // give the sectors back on Close
+};
+
+A2FDDOS::~A2FDDOS(void)
+{
+    delete fpWriteState;
+    delete[] fTSList;
+    delete[] fIndexList;
+    //fTSList = fIndexList = NULL;
+}
+
 /*
  * Write data at the current offset.
  *
- * For simplicity, we assume that we're writing a brand-new file in one
- * shot.  As it happens, that's all we're currently required to do, so even
- * if we wrote a more sophisticated function it wouldn't get exercised.
- * Because of the way we write, there's no way to mimic the behavior of
- * random-access text file allocation, so that isn't supported.
+ * We only append to a brand-new file, but it can be done with any number
+ * of calls.  Data sectors are allocated and written as the data arrives.
+ * The T/S lists and the catalog entry are filled in by Close.  Because of
+ * the way we write, there's no way to mimic the behavior of random-access
+ * text file allocation, so that isn't supported.
  *
  * The data in "buf" should *not* include the 2-4 bytes of header present
  * on A/I/B files.  That's already factored in.
  *
- * Modifies fOpenEOF, fOpenSectorsUsed, and sets fModified.
+ * The VTOC is saved at the end of every call, so it always accounts for
+ * the sectors we've written.  If a call fails or is cancelled, the file is
+ * left empty, and the sectors are released when it's closed.
+ *
+ * Modifies fOpenEOF and fOffset.  Close sets fOpenSectorsUsed and
+ * fModified.
  */
 DIError A2FDDOS::Write(const void* buf, size_t len, size_t* pActual)
 {
     DIError dierr = kDIErrNone;
     A2FileDOS* pFile = (A2FileDOS*) fpFile;
     DiskFSDOS33* pDiskFS = (DiskFSDOS33*) fpFile->GetDiskFS();
-    uint8_t sctBuf[kSctSize];
+    const uint8_t* ptr = (const uint8_t*) buf;
+    size_t remaining = len;
 
     LOGD("   DOS Write len=%lu %s", (unsigned long) len, pFile->GetPathName());
 
-    if (len >= 0x01000000) {    // 16MB
+    if (fOpenEOF + (di_off_t) len >= 0x01000000) {  // 16MB
         assert(false);
         return kDIErrInvalidArg;
     }
-    assert(fOffset == 0);       // big simplifying assumption
-    assert(fOpenEOF == 0);      // another one
-    assert(fTSCount == 0);      // must hold for our newly-created files
-    assert(fIndexCount == 1);   // must hold for our newly-created files
-    assert(fOpenSectorsUsed == fTSCount + fIndexCount);
-    assert(buf != NULL);
-
-    long actualLen = (long) len + pFile->fDataOffset;
-    long numSectors = (actualLen + kSctSize -1) / kSctSize;
-    TrackSector firstIndex;
-    int i;
+    assert(buf != NULL || len == 0);
 
     /*
      * Nothing to do for zero-length write; don't even set fModified.  Note,
      * however, that a zero-length 'B' file is actually 4 bytes long, and
      * must have a data block allocated.
      */
-    if (actualLen == 0)
-        goto bail;
-    assert(numSectors > 0);
+    if (len == 0 && (fpWriteState != NULL || pFile->fDataOffset == 0))
+        return kDIErrNone;
+
+    if (fpWriteState == NULL) {
+        /* we only append to new files */
+        if (fOffset != 0 || fOpenEOF != 0 || fTSCount != 0 ||
+            fIndexCount != 1)
+        {
+            assert(false);
+            return kDIErrInvalidArg;
+        }
+        assert(fOpenSectorsUsed == fTSCount + fIndexCount);
+    } else if (fpWriteState->failed) {
+        return kDIErrNotReady;
+    }
+    if (fOffset != fOpenEOF) {
+        assert(false);      // no seeking around while writing
+        return kDIErrInvalidArg;
+    }
 
     dierr = pDiskFS->LoadVolBitmap();
     if (dierr != kDIErrNone)
-        goto bail;
+        return dierr;
 
-    /*
-     * Start by allocating a full T/S list.  The existing T/S list is
-     * empty, but we do have one T/S index sector to fill before we
-     * allocate any others.
-     *
-     * Since we determined above that there was nothing interesting in
-     * our T/S list, we just grab the one allocated block, throw out
-     * the lists, and reallocate them.
-     */
-    firstIndex = fIndexList[0];
-    delete[] fTSList;
-    delete[] fIndexList;
-    fTSList = fIndexList = NULL;
+    if (fpWriteState == NULL) {
+        dierr = StartWrite();
+        if (dierr != kDIErrNone)
+            goto bail;
+    }
 
-    fTSCount = numSectors;
-    fTSList = new TrackSector[fTSCount];
-    fIndexCount = (numSectors + kMaxTSPairs -1) / kMaxTSPairs;
-    assert(fIndexCount > 0);
-    fIndexList = new TrackSector[fIndexCount];
-    if (fTSList == NULL || fIndexList == NULL) {
-        dierr = kDIErrMalloc;
-        goto bail;
+    while (remaining > 0) {
+        WriteState* pState = fpWriteState;
+
+        if (pState->sctLen == 0 && remaining >= (size_t) kSctSize) {
+            /* write directly from input */
+            dierr = WriteSector(ptr);
+            if (dierr != kDIErrNone)
+                goto bail;
+            ptr += kSctSize;
+            remaining -= kSctSize;
+        } else {
+            size_t copyLen = kSctSize - pState->sctLen;
+            if (copyLen > remaining)
+                copyLen = remaining;
+            memcpy(pState->sct + pState->sctLen, ptr, copyLen);
+            pState->sctLen += (int) copyLen;
+            ptr += copyLen;
+            remaining -= copyLen;
+
+            if (pState->sctLen == kSctSize) {
+                dierr = WriteSector(pState->sct);
+                if (dierr != kDIErrNone)
+                    goto bail;
+                pState->sctLen = 0;
+            }
+        }
     }
 
-    /*
-     * Allocate all of the index sectors.  In theory we should to this along
-     * with the file sectors, so that the index and file sectors are
-     * interspersed with the data, but in practice 99% of the file have
-     * only one or two index blocks.  By grouping them together we improve
-     * the performance for emulators and CiderPress.
-     */
-    fIndexList[0] = firstIndex;
-    for (i = 1; i < fIndexCount; i++) {
-        TrackSector allocTS;
+    dierr = pDiskFS->SaveVolBitmap();
+    if (dierr != kDIErrNone)
+        goto bail;
 
-        dierr = pDiskFS->AllocSector(&allocTS);
-        if (dierr != kDIErrNone)
-            goto bail;
-        fIndexList[i] = allocTS;
+    fOpenEOF += len;
+    fOffset += len;
+    if (pActual != NULL)
+        *pActual = len;
+
+    if (!UpdateProgress(fOffset))
+        dierr = kDIErrCancelled;
+
+bail:
+    pDiskFS->FreeVolBitmap();
+    if (dierr != kDIErrNone && fpWriteState != NULL)
+        fpWriteState->failed = true;
+    return dierr;
+}
+
+/*
+ * Set up the write state.  The file's first T/S list sector was allocated
+ * when the file was created.
+ *
+ * If we know how big the file will be, allocate all of the T/S list
+ * sectors now.  In theory they should be interspersed with the data, but
+ * in practice 99% of files have only one or two of them.  By grouping them
+ * together we improve the performance for emulators and CiderPress.
+ *
+ * The VTOC must be loaded.
+ */
+DIError A2FDDOS::StartWrite(void)
+{
+    DIError dierr;
+    A2FileDOS* pFile = (A2FileDOS*) fpFile;
+    DiskFSDOS33* pDiskFS = (DiskFSDOS33*) fpFile->GetDiskFS();
+    WriteState* pState;
+
+    fpWriteState = pState = new WriteState;
+    pState->index.push_back(fIndexList[0]);
+
+    /* leave room for the A/I/B header; Close fills it in */
+    assert(pFile->fDataOffset < kSctSize);
+    memset(pState->sct, 0, sizeof(pState->sct));
+    pState->sctLen = pFile->fDataOffset;
+
+    if (fSizeHint >= 0) {
+        long numSectors =
+            (long) ((fSizeHint + pFile->fDataOffset + kSctSize-1) / kSctSize);
+        long indexCount = (numSectors + kMaxTSPairs-1) / kMaxTSPairs;
+
+        while ((long) pState->index.size() < indexCount) {
+            TrackSector allocTS;
+
+            dierr = pDiskFS->AllocSector(&allocTS);
+            if (dierr != kDIErrNone)
+                return dierr;
+            pState->index.push_back(allocTS);
+        }
     }
-    /*
-     * Allocate the data sectors.
-     */
-    for (i = 0; i < fTSCount; i++) {
-        TrackSector allocTS;
 
+    return kDIErrNone;
+}
+
+/*
+ * Allocate the next data sector, and a T/S list sector to hold it if
+ * needed, and write "sctBuf" into it.
+ */
+DIError A2FDDOS::WriteSector(const uint8_t* sctBuf)
+{
+    DIError dierr;
+    DiskFSDOS33* pDiskFS = (DiskFSDOS33*) fpFile->GetDiskFS();
+    WriteState* pState = fpWriteState;
+    size_t indexIdx = pState->data.size() / kMaxTSPairs;
+    TrackSector allocTS;
+
+    while (pState->index.size() <= indexIdx) {
         dierr = pDiskFS->AllocSector(&allocTS);
         if (dierr != kDIErrNone)
-            goto bail;
-        fTSList[i] = allocTS;
+            return dierr;
+        pState->index.push_back(allocTS);
     }
 
-    /*
-     * Write the sectors into the T/S list.
-     */
-    const uint8_t* curPtr;
-    int sectorIdx;
-
-    curPtr = (const uint8_t*) buf;
-    sectorIdx = 0;
-
-    if (pFile->fDataOffset > 0) {
-        /* handle first sector specially */
-        assert(pFile->fDataOffset < kSctSize);
-        int dataInFirstSct = kSctSize - pFile->fDataOffset;
-        if (dataInFirstSct > actualLen - pFile->fDataOffset)
-            dataInFirstSct = actualLen - pFile->fDataOffset;
-
-        // dataInFirstSct could be zero (== len)
-        memset(sctBuf, 0, sizeof(sctBuf));
-        memcpy(sctBuf + pFile->fDataOffset, curPtr,
-            dataInFirstSct);
-        dierr = pDiskFS->GetDiskImg()->WriteTrackSector(fTSList[sectorIdx].track,
-                    fTSList[sectorIdx].sector, sctBuf);
+    dierr = pDiskFS->AllocSector(&allocTS);
+    if (dierr != kDIErrNone)
+        return dierr;
+    pState->data.push_back(allocTS);
+
+    return pDiskFS->GetDiskImg()->WriteTrackSector(allocTS.track,
+                allocTS.sector, sctBuf);
+}
+
+/*
+ * Finish a file that was written with Write: write the last sector and
+ * fill out the T/S list sectors.
+ *
+ * Sets fOpenSectorsUsed and fModified; Close takes it from there.
+ */
+DIError A2FDDOS::FinishWrite(void)
+{
+    DIError dierr;
+    DiskFSDOS33* pDiskFS = (DiskFSDOS33*) fpFile->GetDiskFS();
+    WriteState* pState = fpWriteState;
+    uint8_t sctBuf[kSctSize];
+    int i;
+
+    dierr = pDiskFS->LoadVolBitmap();
+    if (dierr != kDIErrNone)
+        return dierr;
+
+    if (pState->sctLen > 0) {
+        memset(pState->sct + pState->sctLen, 0, kSctSize - pState->sctLen);
+        dierr = WriteSector(pState->sct);
         if (dierr != kDIErrNone)
             goto bail;
-
-        sectorIdx++;
-        actualLen -= dataInFirstSct + pFile->fDataOffset;
-        curPtr += dataInFirstSct;
+        pState->sctLen = 0;
     }
-    while (actualLen > 0) {
-        if (actualLen >= kSctSize) {
-            /* write directly from input */
-            dierr = pDiskFS->GetDiskImg()->WriteTrackSector(fTSList[sectorIdx].track,
-                fTSList[sectorIdx].sector, curPtr);
-            if (dierr != kDIErrNone)
-                goto bail;
-        } else {
-            /* make a copy of the partial buffer */
-            memset(sctBuf, 0, sizeof(sctBuf));
-            memcpy(sctBuf, curPtr, actualLen);
-            dierr = pDiskFS->GetDiskImg()->WriteTrackSector(fTSList[sectorIdx].track,
-                fTSList[sectorIdx].sector, sctBuf);
-            if (dierr != kDIErrNone)
-                goto bail;
-        }
+    assert(!pState->data.empty());
 
-        sectorIdx++;
-        actualLen -= kSctSize;  // goes negative; that's fine
-        curPtr += kSctSize;
+    /* the size hint may have been too big */
+    while (pState->index.size() > 1 &&
+        (pState->index.size()-1) * kMaxTSPairs >= pState->data.size())
+    {
+        pDiskFS->SetSectorUseEntry(pState->index.back().track,
+            pState->index.back().sector, false);
+        pState->index.pop_back();
     }
-    assert(sectorIdx == fTSCount);
+
+    delete[] fTSList;
+    delete[] fIndexList;
+    fTSCount = (int) pState->data.size();
+    fTSList = new TrackSector[fTSCount];
+    memcpy(fTSList, &pState->data[0], fTSCount * sizeof(TrackSector));
+    fIndexCount = (int) pState->index.size();
+    fIndexList = new TrackSector[fIndexCount];
+    memcpy(fIndexList, &pState->index[0], fIndexCount * sizeof(TrackSector));
 
     /*
      * Fill out the T/S list sectors.  Failure here presents a potential
@@ -3172,20 +3330,53 @@ DIError A2FDDOS::Write(const void* buf, size_t len, size_t* pActual)
         goto bail;
     }
 
-    /* finish up */
     fOpenSectorsUsed = fIndexCount + fTSCount;
-    fOpenEOF = len;
-    fOffset += len;
     fModified = true;
 
-    if (!UpdateProgress(fOffset))
-        dierr = kDIErrCancelled;
-
 bail:
     pDiskFS->FreeVolBitmap();
     return dierr;
 }
 
+/*
+ * Release the sectors allocated by a series of Write calls that didn't
+ * work out.  The first T/S list sector stays with the file, which is
+ * still empty as far as the catalog is concerned.
+ */
+void A2FDDOS::AbandonWrite(void)
+{
+    DiskFSDOS33* pDiskFS = (DiskFSDOS33*) fpFile->GetDiskFS();
+    WriteState* pState = fpWriteState;
+
+    LOGI(" DOS releasing sectors from incomplete write of '%s'",
+        fpFile->GetPathName());
+    if (pDiskFS->LoadVolBitmap() != kDIErrNone)
+        return;
+
+    for (size_t i = 0; i < pState->data.size(); i++) {
+        pDiskFS->SetSectorUseEntry(pState->data[i].track,
+            pState->data[i].sector, false);
+    }
+    for (size_t i = 1; i < pState->index.size(); i++) {
+        pDiskFS->SetSectorUseEntry(pState->index[i].track,
+            pState->index[i].sector, false);
+    }
+
+    (void) pDiskFS->SaveVolBitmap();
+    pDiskFS->FreeVolBitmap();
+
+    /* put back the state the file was created with */
+    TrackSector firstIndex = pState->index[0];
+    delete[] fTSList;
+    delete[] fIndexList;
+    fTSList = NULL;
+    fTSCount = 0;
+    fIndexList = new TrackSector[1];
+    fIndexList[0] = firstIndex;
+    fIndexCount = 1;
+    fOpenEOF = fOffset = 0;
+}
+
 /*
  * Seek to the specified offset.
  */
@@ -3234,11 +3425,8 @@ di_off_t A2FDDOS::Tell(void)
  *
  * If the file was modified, we need to update the sector usage count in
  * the catalog track, and possibly a length word in the first sector of
- * the file (for A/I/B).
- *
- * Given the current "write all at once" implementation of Write, we could
- * have handled the length word back when initially writing the data, but
- * someday we may fix that and I don't want to have to rewrite this part.
+ * the file (for A/I/B).  If it was being written, we also need to finish
+ * off the T/S lists.
  *
  * Most applications don't check the value of "Close", or call it from a
  * destructor, so we call CloseDescr whether we succeed or not.
@@ -3247,6 +3435,17 @@ DIError A2FDDOS::Close(void)
 {
     DIError dierr = kDIErrNone;
 
+    if (fpWriteState != NULL) {
+        if (!fpWriteState->failed)
+            dierr = FinishWrite();
+        if (fpWriteState->failed || dierr != kDIErrNone)
+            AbandonWrite();
+        delete fpWriteState;
+        fpWriteState = NULL;
+        if (dierr != kDIErrNone)
+            goto bail;
+    }
+
     if (fModified) {
         DiskFSDOS33* pDiskFS = (DiskFSDOS33*) fpFile->GetDiskFS();
         A2FileDOS* pFile = (A2FileDOS*) fpFile;
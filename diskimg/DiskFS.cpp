@@ -8,6 +8,9 @@
  */
 #include "StdAfx.h"
 #include "DiskImgPriv.h"
+#include <vector>
+#include <map>
+#include <algorithm>
 
 
 /*
@@ -45,6 +48,285 @@ void A2File::ResetQuality(void)
     fFileQuality = kQualityGood;
 }
 
+/*
+ * Allocate storage for an A2File from the DiskFS's arena.
+ *
+ * The DiskFS pointer is stashed in front of the object, so operator delete
+ * can find the arena without looking at the (destroyed) object.
+ */
+/*static*/ void* A2File::operator new(size_t size, DiskFS* pDiskFS)
+{
+    char* ptr = (char*) pDiskFS->ArenaAlloc(size + DiskFS::kArenaAlign,
+                    DiskFS::kArenaAlign);
+    *(DiskFS**) ptr = pDiskFS;
+    return ptr + DiskFS::kArenaAlign;
+}
+
+/*
+ * Only called if the constructor throws.
+ */
+/*static*/ void A2File::operator delete(void* ptr, DiskFS* pDiskFS)
+{
+    // we don't know the size, so the storage stays in the arena
+}
+
+/*
+ * Give the storage back to the arena.  "size" is the size of the actual
+ * sub-class, since A2File has a virtual destructor.
+ */
+/*static*/ void A2File::operator delete(void* ptr, size_t size)
+{
+    char* start = (char*) ptr - DiskFS::kArenaAlign;
+    DiskFS* pDiskFS = *(DiskFS**) start;
+    pDiskFS->ArenaFree(start, size + DiskFS::kArenaAlign);
+}
+
+/*
+ * Get storage for a path name.  Renames are common enough that we don't
+ * want to leave the old name behind in the arena each time.
+ *
+ * The size of the buffer is kept in front of the string, since a shorter
+ * name may have been stored in it since.
+ */
+char* A2File::AllocPathName(char* oldName, size_t len) const
+{
+    uint32_t cap;
+    char* ptr;
+
+    if (oldName != NULL) {
+        memcpy(&cap, oldName - sizeof(cap), sizeof(cap));
+        if (cap >= len)
+            return oldName;
+        fpDiskFS->ArenaFree(oldName - sizeof(cap), sizeof(cap) + cap);
+    }
+
+    cap = (uint32_t) len;
+    ptr = (char*) fpDiskFS->ArenaAlloc(sizeof(cap) + cap, 1);
+    memcpy(ptr, &cap, sizeof(cap));
+    return ptr + sizeof(cap);
+}
+
+/*
+ * Release a path name when its file is deleted.
+ */
+void A2File::FreePathName(char* name) const
+{
+    uint32_t cap;
+
+    if (name == NULL)
+        return;
+    memcpy(&cap, name - sizeof(cap), sizeof(cap));
+    fpDiskFS->ArenaFree(name - sizeof(cap), sizeof(cap) + cap);
+}
+
+/*
+ * Copy one fork of the file to a host file descriptor.
+ */
+DIError A2File::ExtractTo(int fd, bool rsrcFork, di_off_t* pActual)
+{
+    A2FileDescr* pOpenFile = NULL;
+    DIError dierr;
+
+    dierr = Open(&pOpenFile, true, rsrcFork);
+    if (dierr != kDIErrNone)
+        return dierr;
+    dierr = pOpenFile->ExtractTo(fd, pActual);
+    pOpenFile->Close();
+    return dierr;
+}
+
+
+/*
+ * ===========================================================================
+ *      A2FileDescr
+ * ===========================================================================
+ */
+
+/* big enough that the per-call overhead doesn't matter */
+static const int kExtractBufSize = 256 * 1024;
+
+/*
+ * Have the kernel copy "length" bytes at "srcOffset" in "srcFd" to the
+ * current position in "dstFd".  copy_file_range can share or reflink
+ * blocks on some filesystems, but only works between regular files;
+ * sendfile handles pipes and sockets too.
+ *
+ * Returns the number of bytes copied.  This is short (maybe zero) if the
+ * kernel can't do it all, e.g. when writing to a terminal; the caller
+ * copies the rest.
+ */
+static di_off_t KernelCopy(int srcFd, di_off_t srcOffset, int dstFd,
+    di_off_t length)
+{
+    di_off_t copied = 0;
+
+#ifdef HAVE_COPY_FILE_RANGE
+    while (copied < length) {
+        loff_t inOffset = srcOffset + copied;
+        ssize_t actual = copy_file_range(srcFd, &inOffset, dstFd, NULL,
+                            (size_t) (length - copied), 0);
+        if (actual < 0 && errno == EINTR)
+            continue;
+        if (actual <= 0)
+            break;      // EXDEV, EINVAL, ENOSYS...
+        copied += actual;
+    }
+#endif
+#ifdef HAVE_SENDFILE
+    while (copied < length) {
+        off_t inOffset = srcOffset + copied;
+        ssize_t actual = sendfile(dstFd, srcFd, &inOffset,
+                            (size_t) (length - copied));
+        if (actual < 0 && errno == EINTR)
+            continue;
+        if (actual <= 0)
+            break;
+        copied += actual;
+    }
+#endif
+
+    return copied;
+}
+
+/*
+ * Copy "length" bytes from a run of "numBlocks" blocks starting at
+ * "block" to a host file.  A zero "block" means the run is sparse.
+ */
+static DIError CopyBlockRun(DiskImg* pDiskImg, long block, long numBlocks,
+    di_off_t length, int fd, uint8_t* buf)
+{
+    const long kBufBlocks = kExtractBufSize / kBlockSize;
+    di_off_t done = 0;
+    int srcFd;
+    di_off_t srcOffset;
+    DIError dierr;
+
+    if (block != 0 &&
+        pDiskImg->GetBlockHostRange(block, numBlocks, &srcFd, &srcOffset))
+    {
+        done = KernelCopy(srcFd, srcOffset, fd, length);
+    }
+
+    /* whatever the kernel didn't do */
+    while (done < length) {
+        long first = (long) (done / kBlockSize);
+        long skip = (long) (done % kBlockSize);
+        long count = numBlocks - first;
+        if (count > kBufBlocks)
+            count = kBufBlocks;
+
+        if (block == 0) {
+            memset(buf, 0, count * kBlockSize);
+        } else {
+            dierr = pDiskImg->ReadBlocks(block + first, count, buf);
+            if (dierr != kDIErrNone)
+                return dierr;
+        }
+
+        di_off_t chunk = count * kBlockSize - skip;
+        if (chunk > length - done)
+            chunk = length - done;
+        dierr = WriteHostFd(fd, buf + skip, (size_t) chunk);
+        if (dierr != kDIErrNone)
+            return dierr;
+        done += chunk;
+    }
+
+    return kDIErrNone;
+}
+
+/*
+ * Copy the whole fork to a host file descriptor.
+ *
+ * With a block map, we walk the list and copy each run of contiguous (or
+ * sparse) blocks in one go.  Without one, we fall back on Read, with a
+ * buffer big enough to keep the per-call costs down.
+ */
+DIError A2FileDescr::ExtractTo(int fd, di_off_t* pActual)
+{
+    DiskImg* pDiskImg = fpFile->GetDiskFS()->GetDiskImg();
+    uint8_t* buf = NULL;
+    di_off_t length, offset;
+    DIError dierr;
+
+    dierr = Seek(0, kSeekEnd);
+    if (dierr != kDIErrNone)
+        return dierr;
+    length = Tell();
+    dierr = Rewind();
+    if (dierr != kDIErrNone)
+        return dierr;
+
+    buf = new uint8_t[kExtractBufSize];
+    offset = 0;
+
+    if (HasBlockMap() && pDiskImg->GetHasBlocks()) {
+        long blockCount = GetBlockCount();
+
+        while (offset < length) {
+            long idx = (long) (offset / kBlockSize);
+            long maxRun = (long) ((length - offset + kBlockSize - 1) / kBlockSize);
+            long block = 0;
+            long runBlocks;
+
+            if (idx < blockCount) {
+                dierr = GetStorage(idx, &block);
+                if (dierr != kDIErrNone)
+                    goto bail;
+            }
+            for (runBlocks = 1; runBlocks < maxRun; runBlocks++) {
+                long next = 0;
+                if (idx + runBlocks < blockCount &&
+                    GetStorage(idx + runBlocks, &next) != kDIErrNone)
+                {
+                    break;
+                }
+                if (block == 0 ? next != 0 : next != block + runBlocks)
+                    break;
+            }
+
+            di_off_t runLen = (di_off_t) runBlocks * kBlockSize;
+            if (runLen > length - offset)
+                runLen = length - offset;
+            dierr = CopyBlockRun(pDiskImg, block, runBlocks, runLen, fd, buf);
+            if (dierr != kDIErrNone)
+                goto bail;
+
+            offset += runLen;
+            if (!UpdateProgress(offset)) {
+                dierr = kDIErrCancelled;
+                goto bail;
+            }
+        }
+
+        /* leave the position where Read would have */
+        dierr = Seek(length, kSeekSet);
+        if (dierr != kDIErrNone)
+            goto bail;
+    } else {
+        while (offset < length) {
+            size_t chunk = kExtractBufSize;
+            if ((di_off_t) chunk > length - offset)
+                chunk = (size_t) (length - offset);
+
+            dierr = Read(buf, chunk);
+            if (dierr != kDIErrNone)
+                goto bail;
+            dierr = WriteHostFd(fd, buf, chunk);
+            if (dierr != kDIErrNone)
+                goto bail;
+            offset += chunk;
+        }
+    }
+
+    if (pActual != NULL)
+        *pActual = length;
+
+bail:
+    delete[] buf;
+    return dierr;
+}
+
 
 /*
  * ===========================================================================
@@ -59,6 +341,9 @@ void A2File::ResetQuality(void)
  */
 void DiskFS::SetDiskImg(DiskImg* pImg)
 {
+    if (pImg != NULL)
+        fRefreshGen = pImg->GetWriteGeneration();
+
     if (pImg == NULL && fpImg == NULL) {
         LOGI("SetDiskImg: no-op (both NULL)");
         return;
@@ -74,6 +359,29 @@ void DiskFS::SetDiskImg(DiskImg* pImg)
     fpImg = pImg;
 }
 
+/*
+ * Do the work that Initialize skipped when kInitCatalogOnly was used.
+ *
+ * The flag is cleared first, so the sub-class can use accessors that
+ * would otherwise bring us back here.
+ */
+DIError DiskFS::CompleteDeferredInit(void)
+{
+    DIError dierr;
+
+    if (!fInitDeferred)
+        return kDIErrNone;
+    fInitDeferred = false;
+
+    LOGI("DiskFS completing deferred init");
+    DiskImgStats::PhaseTimer timer(fpImg->GetStats(),
+        DiskImgStats::kPhaseDiskFSInit);
+    dierr = DoDeferredInit();
+    if (dierr != kDIErrNone)
+        LOGW("DiskFS deferred init failed: %s", DIStrError(dierr));
+    return dierr;
+}
+
 /*
  * Flush changes to disk.
  */
@@ -99,6 +407,45 @@ DIError DiskFS::Flush(DiskImg::FlushMode mode)
     return fpImg->FlushImage(mode);
 }
 
+/*
+ * Pick up changes made to the disk image by somebody else.
+ */
+DIError DiskFS::Refresh(void)
+{
+    SubVolume* pSubVol = GetNextSubVolume(NULL);
+    DIError dierr;
+
+    while (pSubVol != NULL) {
+        dierr = pSubVol->GetDiskFS()->Refresh();   // recurse
+        if (dierr != kDIErrNone)
+            return dierr;
+
+        pSubVol = GetNextSubVolume(pSubVol);
+    }
+
+    assert(fpImg != NULL);
+
+    /* other DiskFS on this image keep their own place */
+    uint32_t refreshGen = fpImg->GetWriteGeneration();
+    dierr = DoRefresh();
+    if (dierr == kDIErrNone)
+        fRefreshGen = refreshGen;
+    return dierr;
+}
+
+/*
+ * Default refresh: fine if nothing was written, otherwise the caller has
+ * to start over.
+ */
+DIError DiskFS::DoRefresh(void)
+{
+    if (!GetAnyWritten())
+        return kDIErrNone;
+
+    LOGI("DiskFS can't refresh after writes, rescan needed");
+    return kDIErrNotSupported;
+}
+
 /*
  * Set the "read only" flag on our DiskImg and those of our sub-volumes.
  */
@@ -122,6 +469,28 @@ void DiskFS::SetAllReadOnly(bool val)
     }
 }
 
+/*
+ * Create several files, one at a time.  Filesystems that can do better
+ * when adding lots of files at once override this.
+ */
+DIError DiskFS::CreateFiles(const CreateParms* pParmsList, int count,
+    A2File** ppNewFiles)
+{
+    DIError dierr = kDIErrNone;
+    int idx;
+
+    for (idx = 0; idx < count; idx++)
+        ppNewFiles[idx] = NULL;
+
+    for (idx = 0; idx < count; idx++) {
+        dierr = CreateFile(&pParmsList[idx], &ppNewFiles[idx]);
+        if (dierr != kDIErrNone)
+            break;
+    }
+
+    return dierr;
+}
+
 
 /*
  * The file list looks something like this:
@@ -153,6 +522,166 @@ void DiskFS::SetAllReadOnly(bool val)
  * for ensuring that the Write command doesn't run over the next file.
  */
 
+/*
+ * Storage for the file list.
+ *
+ * Every A2File on the volume, and every path name string, is carved out of
+ * a handful of chunks that are thrown away together in DeleteFileList.
+ * Scanning a big ProDOS or HFS volume otherwise means a pair of heap
+ * allocations per file, and a pass over the heap to free them again.
+ *
+ * A DiskFS can stay open through a long editing session, so storage for
+ * files that are deleted, and for names that are replaced, goes on a free
+ * list sorted by size.  Alloc takes from there first.
+ *
+ * "index" holds the list in order, so it can be walked without chasing
+ * the next pointers.  It's updated whenever the list changes, so that the
+ * const accessors never have to touch it.
+ */
+struct DiskFS::FileArena {
+    enum {
+        kMinChunk = 8192,
+        kMaxChunk = 256 * 1024,
+    };
+
+    FileArena(void) : pCur(NULL), avail(0), nextChunkSize(kMinChunk),
+        discarding(false)
+        {}
+    ~FileArena(void) {
+        for (size_t i = 0; i < chunks.size(); i++)
+            delete[] chunks[i];
+    }
+
+    void* Alloc(size_t size, size_t align);
+    void Free(void* ptr, size_t size);
+    void IndexInsert(A2File* pFile);
+    void IndexRemove(A2File* pFile);
+
+    std::vector<char*>  chunks;
+    char*       pCur;               // next free byte in current chunk
+    size_t      avail;              // bytes left in current chunk
+    size_t      nextChunkSize;
+    bool        discarding;         // DeleteFileList is emptying us out
+
+    std::map<size_t, std::vector<char*> > freeLists;
+
+    std::vector<A2File*> index;
+};
+
+/*
+ * Allocate "size" bytes.  "align" must be a power of 2 no larger than
+ * kArenaAlign.
+ *
+ * Freed storage is reused if there's a piece that's big enough, but not
+ * more than twice as big.  Otherwise we bump-allocate from the current
+ * chunk.  Chunks start small, so a DOS 3.3 disk doesn't tie up a lot of
+ * memory, and double in size as the list grows.
+ */
+void* DiskFS::FileArena::Alloc(size_t size, size_t align)
+{
+    assert(align != 0 && (align & (align - 1)) == 0 && align <= kArenaAlign);
+
+    for (auto it = freeLists.lower_bound(size);
+        it != freeLists.end() && it->first <= size * 2; ++it)
+    {
+        std::vector<char*>& list = it->second;
+        char* ptr = list.back();
+        if (((uintptr_t) ptr & (align - 1)) != 0)
+            continue;
+        list.pop_back();
+        if (list.empty())
+            freeLists.erase(it);
+        return ptr;
+    }
+
+    size_t pad = (size_t) (-(intptr_t) pCur) & (align - 1);
+    if (pCur == NULL || pad + size > avail) {
+        size_t chunkSize = nextChunkSize;
+        if (nextChunkSize < kMaxChunk)
+            nextChunkSize *= 2;
+        if (chunkSize < size)
+            chunkSize = size;
+
+        // operator new[] storage is suitably aligned for anything
+        char* pChunk = new char[chunkSize];
+        chunks.push_back(pChunk);
+        pCur = pChunk;
+        avail = chunkSize;
+        pad = 0;
+    }
+
+    void* ptr = pCur + pad;
+    pCur += pad + size;
+    avail -= pad + size;
+    return ptr;
+}
+
+/*
+ * Put "size" bytes at "ptr" on the free list.  Not worth doing when the
+ * whole arena is about to go.
+ */
+void DiskFS::FileArena::Free(void* ptr, size_t size)
+{
+    if (discarding)
+        return;
+    freeLists[size].push_back((char*) ptr);
+}
+
+/*
+ * Add a file that was just linked into the list to the index, in front of
+ * whatever follows it.
+ */
+void DiskFS::FileArena::IndexInsert(A2File* pFile)
+{
+    A2File* pNext = pFile->GetNext();
+
+    if (pNext == NULL) {
+        index.push_back(pFile);
+    } else {
+        auto it = std::find(index.begin(), index.end(), pNext);
+        assert(it != index.end());
+        index.insert(it, pFile);
+    }
+}
+
+/*
+ * Remove a file from the index.
+ */
+void DiskFS::FileArena::IndexRemove(A2File* pFile)
+{
+    auto it = std::find(index.begin(), index.end(), pFile);
+    assert(it != index.end());
+    if (it != index.end())
+        index.erase(it);
+}
+
+/*
+ * Get the file arena, creating it if necessary.
+ */
+DiskFS::FileArena* DiskFS::GetFileArena(void)
+{
+    if (fpFileArena == NULL)
+        fpFileArena = new FileArena;
+    return fpFileArena;
+}
+
+/*
+ * Allocate storage for an A2File or a path name.
+ */
+void* DiskFS::ArenaAlloc(size_t size, size_t align)
+{
+    return GetFileArena()->Alloc(size, align);
+}
+
+/*
+ * Return storage from ArenaAlloc.
+ */
+void DiskFS::ArenaFree(void* ptr, size_t size)
+{
+    assert(fpFileArena != NULL);
+    fpFileArena->Free(ptr, size);
+}
+
 /*
  * Add a file to the end of our list.
  */
@@ -168,6 +697,8 @@ void DiskFS::AddFileToList(A2File* pFile)
         fpA2Tail->SetNext(pFile);
         fpA2Tail = pFile;
     }
+
+    GetFileArena()->index.push_back(pFile);
 }
 
 /*
@@ -194,11 +725,14 @@ void DiskFS::InsertFileInList(A2File* pFile, A2File* pPrev)
     if (fpA2Head == NULL) {
         assert(pPrev == NULL);
         fpA2Head = fpA2Tail = pFile;
+        GetFileArena()->IndexInsert(pFile);
         return;
     } else if (pPrev == NULL) {
         // create two entries on DOS disk, delete first, add new file
         pFile->SetNext(fpA2Head);
+        fpA2Head->SetPrev(pFile);
         fpA2Head = pFile;
+        GetFileArena()->IndexInsert(pFile);
         return;
     }
 
@@ -213,7 +747,13 @@ void DiskFS::InsertFileInList(A2File* pFile, A2File* pPrev)
     }
 
     pFile->SetNext(pPrev->GetNext());
+    pFile->SetPrev(pPrev);
+    if (pFile->GetNext() != NULL)
+        pFile->GetNext()->SetPrev(pFile);
+    else
+        fpA2Tail = pFile;
     pPrev->SetNext(pFile);
+    GetFileArena()->IndexInsert(pFile);
 }
 
 /*
@@ -256,9 +796,16 @@ A2File* DiskFS::SkipSubdir(A2File* pSubdir)
  */
 void DiskFS::DeleteFileFromList(A2File* pFile)
 {
+    assert(fpFileArena != NULL);
+    fpFileArena->IndexRemove(pFile);
+
     if (fpA2Head == pFile) {
         /* delete the head of the list */
         fpA2Head = fpA2Head->GetNext();
+        if (fpA2Head != NULL)
+            fpA2Head->SetPrev(NULL);
+        else
+            fpA2Tail = NULL;
         delete pFile;
     } else {
         A2File* pCur = fpA2Head;
@@ -268,6 +815,10 @@ void DiskFS::DeleteFileFromList(A2File* pFile)
                 A2File* pNextNext = pCur->GetNext()->GetNext();
                 delete pCur->GetNext();
                 pCur->SetNext(pNextNext);
+                if (pNextNext != NULL)
+                    pNextNext->SetPrev(pCur);
+                else
+                    fpA2Tail = pCur;
                 break;
             }
             pCur = pCur->GetNext();
@@ -280,6 +831,28 @@ void DiskFS::DeleteFileFromList(A2File* pFile)
     }
 }
 
+/*
+ * Rebuild the list from an array of files, in order.  Used after a
+ * refresh, when entries have come and gone all over the place.
+ */
+void DiskFS::RelinkFileList(A2File** ppFiles, long count)
+{
+    A2File* pPrev = NULL;
+
+    for (long i = 0; i < count; i++) {
+        ppFiles[i]->SetPrev(pPrev);
+        if (pPrev != NULL)
+            pPrev->SetNext(ppFiles[i]);
+        pPrev = ppFiles[i];
+    }
+    if (pPrev != NULL)
+        pPrev->SetNext(NULL);
+    fpA2Head = (count != 0) ? ppFiles[0] : NULL;
+    fpA2Tail = pPrev;
+
+    GetFileArena()->index.assign(ppFiles, ppFiles + count);
+}
+
 
 /*
  * Access the "next" pointer.
@@ -297,37 +870,48 @@ A2File* DiskFS::GetNextFile(A2File* pFile) const
 
 /*
  * Return the #of elements in the linear file list.
- *
- * Right now the only code that calls this is the disk info panel in
- * CiderPress, so we don't need it to be efficient.
  */
 long DiskFS::GetFileCount(void) const
 {
-    long count = 0;
-
-    A2File* pFile = fpA2Head;
-    while (pFile != NULL) {
-        count++;
-        pFile = pFile->GetNext();
-    }
+    if (fpFileArena == NULL)
+        return 0;
+    return (long) fpFileArena->index.size();
+}
 
-    return count;
+/*
+ * Return the file at position "idx" in the list.
+ */
+A2File* DiskFS::GetFileByIndex(long idx) const
+{
+    if (idx < 0 || idx >= GetFileCount())
+        return NULL;
+    return fpFileArena->index[idx];
 }
 
 /*
  * Delete all entries in the list.
+ *
+ * The destructors run one at a time, but the storage goes back in a few
+ * big pieces when the arena is discarded.
  */
 void DiskFS::DeleteFileList(void)
 {
     A2File* pFile;
     A2File* pNext;
 
+    if (fpFileArena != NULL)
+        fpFileArena->discarding = true;
+
     pFile = fpA2Head;
     while (pFile != NULL) {
         pNext = pFile->GetNext();
         delete pFile;
         pFile = pNext;
     }
+    fpA2Head = fpA2Tail = NULL;
+
+    delete fpFileArena;
+    fpFileArena = NULL;
 }
 
 /*
@@ -356,17 +940,14 @@ void DiskFS::DumpFileList(void)
  */
 A2File* DiskFS::GetFileByName(const char* fileName, StringCompareFunc func)
 {
-    A2File* pFile;
-
     if (func == NULL)
         func = ::strcasecmp;
 
-    pFile = GetNextFile(NULL);
-    while (pFile != NULL) {
+    long count = GetFileCount();
+    for (long idx = 0; idx < count; idx++) {
+        A2File* pFile = GetFileByIndex(idx);
         if ((*func)(pFile->GetPathName(), fileName) == 0)
             return pFile;
-
-        pFile = GetNextFile(pFile);
     }
 
     return NULL;
@@ -526,12 +1107,12 @@ void DiskFS::ScanForDamagedFiles(bool* pDamaged, bool* pSuspicious)
 
     *pDamaged = *pSuspicious = false;
 
-    pFile = GetNextFile(NULL);
-    while (pFile != NULL) {
+    long count = GetFileCount();
+    for (long idx = 0; idx < count; idx++) {
+        pFile = GetFileByIndex(idx);
         if (pFile->GetQuality() == A2File::kQualityDamaged)
             *pDamaged = true;
         if (pFile->GetQuality() != A2File::kQualityGood)
             *pSuspicious = true;
-        pFile = GetNextFile(pFile);
     }
 }
@@ -10,6 +10,8 @@
 #include "StdAfx.h"
 #include "DiskImgPriv.h"
 #include "TwoImg.h"
+#include <vector>
+#include <algorithm>
 
 
 /*
@@ -187,6 +189,10 @@ DiskImg::DiskImg(void)
     fFileSysOrder = kSectorOrderUnknown;
     fSectorPairing = false;
     fSectorPairOffset = -1;
+    fReadBlockFunc = &DiskImg::ReadBlockGeneric;
+    fWriteBlockFunc = &DiskImg::WriteBlockGeneric;
+    fLinearBlocks = false;
+    fpBlockSkew = NULL;
 
     fpOuterGFD = NULL;
     fpWrapperGFD = NULL;
@@ -215,6 +221,7 @@ DiskImg::DiskImg(void)
     fScanCount = 0;
     fScanMsg[0] = '\0';
     fScanLastMsgWhen = 0;
+    fpScanRelay = NULL;
 
     /*
      * Create a working copy of the nibble descr table.  We want to leave
@@ -238,7 +245,13 @@ DiskImg::DiskImg(void)
 
     fNotes = NULL;
     fpBadBlockMap = NULL;
+    fpBlockWriteGen = NULL;
+    fNumWriteGenBlocks = 0;
+    fWriteGen = 1;
+    fWriteGenSeen = false;
+    fLastWriteGen = fUntrackedGen = 0;
     fDiskFSRefCnt = 0;
+    fpStats = NULL;
 }
 
 /*
@@ -254,6 +267,8 @@ DiskImg::~DiskImg(void)
     delete[] fNibbleTrackBuf;
     delete[] fNotes;
     delete fpBadBlockMap;
+    delete[] fpBlockWriteGen;
+    delete fpStats;
 
     /* normally these will be closed, but perhaps not if something failed */
     if (fpOuterGFD != NULL)
@@ -271,6 +286,21 @@ DiskImg::~DiskImg(void)
 }
 
 
+/*
+ * Enable or disable stats collection.  Turning it off discards anything
+ * collected so far.
+ */
+void DiskImg::SetStatsEnabled(bool val)
+{
+    if (val && fpStats == NULL) {
+        fpStats = new DiskImgStats;
+    } else if (!val) {
+        delete fpStats;
+        fpStats = NULL;
+    }
+}
+
+
 /*
  * Set the nibble descr pointer.
  */
@@ -307,12 +337,15 @@ const char* A2File::GetRawFileName(size_t* size) const { // get unmodified file
  * Open a volume or a file on disk.
  *
  * For Windows, we need to handle logical/physical volumes specially.  If
- * the filename matches the appropriate pattern, use a different GFD.
+ * the filename matches the appropriate pattern, use a different GFD.  On
+ * Linux, block devices (e.g. a CF card in a USB reader) get a GFD that does
+ * direct I/O with readahead.
  */
 DIError DiskImg::OpenImage(const char* pathName, char fssep, bool readOnly)
 {
     DIError dierr = kDIErrNone;
     bool isWinDevice = false;
+    bool isBlockDevice = false;
 
     if (fpDataGFD != NULL) {
         LOGI(" DI already open!");
@@ -344,6 +377,9 @@ DIError DiskImg::OpenImage(const char* pathName, char fssep, bool readOnly)
         isWinDevice = true;     // ASPI volume ("ASPI:x:y:z\")
     }
 #endif
+#ifdef HAVE_BLOCK_DEVICE
+    isBlockDevice = GFDBlockDevice::IsBlockDevice(pathName);
+#endif
 
     if (isWinDevice) {
 #ifdef _WIN32
@@ -360,6 +396,21 @@ DIError DiskImg::OpenImage(const char* pathName, char fssep, bool readOnly)
         dierr = AnalyzeImageFile("CPDevice.cp-win-vol", '\0');
         if (dierr != kDIErrNone)
             goto bail;
+#endif
+    } else if (isBlockDevice) {
+#ifdef HAVE_BLOCK_DEVICE
+        GFDBlockDevice* pGFDBlockDevice = new GFDBlockDevice;
+
+        dierr = pGFDBlockDevice->Open(pathName, fReadOnly);
+        if (dierr != kDIErrNone) {
+            delete pGFDBlockDevice;
+            goto bail;
+        }
+
+        fpWrapperGFD = pGFDBlockDevice;
+        dierr = AnalyzeImageFile(pathName, fssep);
+        if (dierr != kDIErrNone)
+            goto bail;
 #endif
     } else {
         GFDFile* pGFDFile = new GFDFile;
@@ -476,6 +527,8 @@ DIError DiskImg::OpenImage(DiskImg* pParent, long firstBlock, long numBlocks)
 
     fpDataGFD = pGFDGFD;
     assert(fpWrapperGFD == NULL);
+    if (pParent->fpStats != NULL)
+        SetStatsEnabled(true);
 
     /*
      * This replaces the call to "analyze image file" because we know we
@@ -530,6 +583,8 @@ DIError DiskImg::OpenImage(DiskImg* pParent, long firstTrack, long firstSector,
     
     fpDataGFD = pGFDGFD;
     assert(fpWrapperGFD == NULL);
+    if (pParent->fpStats != NULL)
+        SetStatsEnabled(true);
 
     /*
      * This replaces the call to "analyze image file" because we know we
@@ -560,6 +615,7 @@ void DiskImg::SetPairedSectors(bool enable, int idx)
     if (enable) {
         assert(idx == 0 || idx == 1);
     }
+    SelectBlockAccess();
 }
 
 /*
@@ -875,8 +931,12 @@ DIError DiskImg::AnalyzeImageFile(const char* pathName, char fssep)
     /* finish up outer wrapper stuff */
     if (fOuterFormat != kOuterFormatNone) {
         GenericFD* pNewGFD = NULL;
-        dierr = fpOuterWrapper->Load(fpWrapperGFD, fOuterLength, fReadOnly,
-                    &fWrappedLength, &pNewGFD);
+        {
+            DiskImgStats::PhaseTimer timer(fpStats,
+                DiskImgStats::kPhaseOuterWrapper);
+            dierr = fpOuterWrapper->Load(fpWrapperGFD, fOuterLength,
+                        fReadOnly, &fWrappedLength, &pNewGFD);
+        }
         if (dierr != kDIErrNone) {
             LOGI("  DW outer prep failed");
             /* extensions are "reliable", so failure is unavoidable */
@@ -1108,6 +1168,8 @@ gotit: ;
     }
     if (fpImageWrapper != NULL) {
         assert(fpDataGFD == NULL);
+        DiskImgStats::PhaseTimer timer(fpStats,
+            DiskImgStats::kPhaseImageWrapper);
         dierr = fpImageWrapper->Prep(fpWrapperGFD, fWrappedLength, fReadOnly,
                     &fLength, &fPhysical, &fOrder, &fDOSVolumeNum,
                     &fpBadBlockMap, &fpDataGFD);
@@ -1240,7 +1302,11 @@ DIError DiskImg::AnalyzeImage(void)
          * working with a TrackStar or FDI image.
          */
         DIError dierr;
-        dierr = AnalyzeNibbleData();    // sets nibbleDescr and DOS vol num
+        {
+            DiskImgStats::PhaseTimer timer(fpStats,
+                DiskImgStats::kPhaseNibbleAnalysis);
+            dierr = AnalyzeNibbleData();    // sets nibbleDescr and DOS vol num
+        }
         if (dierr == kDIErrNone) {
             assert(fpNibbleDescr != NULL);
             fNumSectPerTrack = fpNibbleDescr->numSectors;
@@ -1330,24 +1396,26 @@ DIError DiskImg::AnalyzeImage(void)
  */
 void DiskImg::AnalyzeImageFS(void)
 {
+    DiskImgStats::PhaseTimer timer(fpStats, DiskImgStats::kPhaseFSProbe);
+
     /*
      * In some circumstances it would be useful to have a set describing
      * what filesystems we might expect to find, e.g. we're not likely to
      * encounter RDOS embedded in a CF card.
      */
-    if (DiskFSMacPart::TestFS(this, &fOrder, &fFormat, DiskFS::kLeniencyNot) == kDIErrNone)
+    if (ProbeFS(DiskFSMacPart::TestFS(this, &fOrder, &fFormat, DiskFS::kLeniencyNot)))
     {
         assert(fFormat == kFormatMacPart);
         LOGI(" DI found MacPart, order=%d", fOrder);
-    } else if (DiskFSMicroDrive::TestFS(this, &fOrder, &fFormat, DiskFS::kLeniencyNot) == kDIErrNone)
+    } else if (ProbeFS(DiskFSMicroDrive::TestFS(this, &fOrder, &fFormat, DiskFS::kLeniencyNot)))
     {
         assert(fFormat == kFormatMicroDrive);
         LOGI(" DI found MicroDrive, order=%d", fOrder);
-    } else if (DiskFSFocusDrive::TestFS(this, &fOrder, &fFormat, DiskFS::kLeniencyNot) == kDIErrNone)
+    } else if (ProbeFS(DiskFSFocusDrive::TestFS(this, &fOrder, &fFormat, DiskFS::kLeniencyNot)))
     {
         assert(fFormat == kFormatFocusDrive);
         LOGI(" DI found FocusDrive, order=%d", fOrder);
-    } else if (DiskFSCFFA::TestFS(this, &fOrder, &fFormat, DiskFS::kLeniencyNot) == kDIErrNone)
+    } else if (ProbeFS(DiskFSCFFA::TestFS(this, &fOrder, &fFormat, DiskFS::kLeniencyNot)))
     {
         // The CFFA format doesn't have a partition map, but we do insist
         // on finding multiple volumes.  It needs to come after MicroDrive,
@@ -1356,7 +1424,7 @@ void DiskImg::AnalyzeImageFS(void)
         // out the blocks.
         assert(fFormat == kFormatCFFA4 || fFormat == kFormatCFFA8);
         LOGI(" DI found CFFA, order=%d", fOrder);
-    } else if (DiskFSFAT::TestFS(this, &fOrder, &fFormat, DiskFS::kLeniencyNot) == kDIErrNone)
+    } else if (ProbeFS(DiskFSFAT::TestFS(this, &fOrder, &fFormat, DiskFS::kLeniencyNot)))
     {
         // This is really just a trap to catch CFFA cards that were formatted
         // for ProDOS and then re-formatted for MSDOS.  As such it needs to
@@ -1364,54 +1432,54 @@ void DiskImg::AnalyzeImageFS(void)
         // and can be overridden, so it's pretty safe.
         assert(fFormat == kFormatMSDOS);
         LOGI(" DI found MSDOS, order=%d", fOrder);
-    } else if (DiskFSDOS33::TestFS(this, &fOrder, &fFormat, DiskFS::kLeniencyNot) == kDIErrNone)
+    } else if (ProbeFS(DiskFSDOS33::TestFS(this, &fOrder, &fFormat, DiskFS::kLeniencyNot)))
     {
         assert(fFormat == kFormatDOS32 || fFormat == kFormatDOS33);
         LOGI(" DI found DOS3.x, order=%d", fOrder);
         if (fNumSectPerTrack == 13)
             fFormat = kFormatDOS32;
-    } else if (DiskFSUNIDOS::TestWideFS(this, &fOrder, &fFormat, DiskFS::kLeniencyNot) == kDIErrNone)
+    } else if (ProbeFS(DiskFSUNIDOS::TestWideFS(this, &fOrder, &fFormat, DiskFS::kLeniencyNot)))
     {
         // Should only succeed on 400K embedded chunks.
         assert(fFormat == kFormatDOS33);
         fNumSectPerTrack = 32;
         fNumTracks /= 2;
         LOGI(" DI found 'wide' DOS3.3, order=%d", fOrder);
-    } else if (DiskFSUNIDOS::TestFS(this, &fOrder, &fFormat, DiskFS::kLeniencyNot) == kDIErrNone)
+    } else if (ProbeFS(DiskFSUNIDOS::TestFS(this, &fOrder, &fFormat, DiskFS::kLeniencyNot)))
     {
         assert(fFormat == kFormatUNIDOS);
         fNumSectPerTrack = 32;
         fNumTracks /= 2;
         LOGI(" DI found UNIDOS, order=%d", fOrder);
-    } else if (DiskFSOzDOS::TestFS(this, &fOrder, &fFormat, DiskFS::kLeniencyNot) == kDIErrNone)
+    } else if (ProbeFS(DiskFSOzDOS::TestFS(this, &fOrder, &fFormat, DiskFS::kLeniencyNot)))
     {
         assert(fFormat == kFormatOzDOS);
         fNumSectPerTrack = 32;
         fNumTracks /= 2;
         LOGI(" DI found OzDOS, order=%d", fOrder);
-    } else if (DiskFSProDOS::TestFS(this, &fOrder, &fFormat, DiskFS::kLeniencyNot) == kDIErrNone)
+    } else if (ProbeFS(DiskFSProDOS::TestFS(this, &fOrder, &fFormat, DiskFS::kLeniencyNot)))
     {
         assert(fFormat == kFormatProDOS);
         LOGI(" DI found ProDOS, order=%d", fOrder);
-    } else if (DiskFSPascal::TestFS(this, &fOrder, &fFormat, DiskFS::kLeniencyNot) == kDIErrNone)
+    } else if (ProbeFS(DiskFSPascal::TestFS(this, &fOrder, &fFormat, DiskFS::kLeniencyNot)))
     {
         assert(fFormat == kFormatPascal);
         LOGI(" DI found Pascal, order=%d", fOrder);
-    } else if (DiskFSCPM::TestFS(this, &fOrder, &fFormat, DiskFS::kLeniencyNot) == kDIErrNone)
+    } else if (ProbeFS(DiskFSCPM::TestFS(this, &fOrder, &fFormat, DiskFS::kLeniencyNot)))
     {
         assert(fFormat == kFormatCPM);
         LOGI(" DI found CP/M, order=%d", fOrder);
-    } else if (DiskFSRDOS::TestFS(this, &fOrder, &fFormat, DiskFS::kLeniencyNot) == kDIErrNone)
+    } else if (ProbeFS(DiskFSRDOS::TestFS(this, &fOrder, &fFormat, DiskFS::kLeniencyNot)))
     {
         assert(fFormat == kFormatRDOS33 ||
                fFormat == kFormatRDOS32 ||
                fFormat == kFormatRDOS3);
         LOGI(" DI found RDOS 3.3, order=%d", fOrder);
-    } else if (DiskFSHFS::TestFS(this, &fOrder, &fFormat, DiskFS::kLeniencyNot) == kDIErrNone)
+    } else if (ProbeFS(DiskFSHFS::TestFS(this, &fOrder, &fFormat, DiskFS::kLeniencyNot)))
     {
         assert(fFormat == kFormatMacHFS);
         LOGI(" DI found HFS, order=%d", fOrder);
-    } else if (DiskFSGutenberg::TestFS(this, &fOrder, &fFormat, DiskFS::kLeniencyNot) == kDIErrNone)
+    } else if (ProbeFS(DiskFSGutenberg::TestFS(this, &fOrder, &fFormat, DiskFS::kLeniencyNot)))
     {
         assert(fFormat == kFormatGutenberg);
         LOGI(" DI found Gutenberg, order=%d", fOrder);
@@ -1422,6 +1490,7 @@ void DiskImg::AnalyzeImageFS(void)
     }
 
     fFileSysOrder = CalcFSSectorOrder();
+    SelectBlockAccess();
 }
 
 
@@ -1548,6 +1617,7 @@ DIError DiskImg::OverrideFormat(PhysicalFormat physical, FSFormat format,
     fFormat = format;
     fOrder = newOrder;
     fFileSysOrder = CalcFSSectorOrder();
+    SelectBlockAccess();
 
     LOGI(" DI override accepted");
 
@@ -1762,16 +1832,16 @@ void DiskImg::SetScanProgressCallback(ScanProgressCallback func, void* cookie)
  */
 bool DiskImg::UpdateScanProgress(const char* newStr)
 {
-    ScanProgressCallback func = fpScanProgressCallback;
     DiskImg* pImg = this;
     bool result = true;
 
     /* search up the tree to find a progress updater */
-    while (func == NULL) {
+    while (pImg->fpScanProgressCallback == NULL) {
         pImg = pImg->fpParentImg;
         if (pImg == NULL)
             return result;      // none defined, bail out
-        func = pImg->fpScanProgressCallback;
+        if (pImg->fpScanRelay != NULL)
+            break;
     }
 
     time_t now = time(NULL);
@@ -1780,22 +1850,46 @@ bool DiskImg::UpdateScanProgress(const char* newStr)
         fScanCount++;
         //if ((fScanCount % 100) == 0)
         if (fScanLastMsgWhen != now) {
-            result = (*func)(fScanProgressCookie,
-                        fScanMsg, fScanCount);
+            result = SendScanProgress(fScanMsg, fScanCount);
             fScanLastMsgWhen = now;
         }
     } else {
         fScanCount = 0;
         strncpy(fScanMsg, newStr, sizeof(fScanMsg));
         fScanMsg[sizeof(fScanMsg)-1] = '\0';
-        result = (*func)(fScanProgressCookie, fScanMsg,
-                    fScanCount);
+        result = SendScanProgress(fScanMsg, fScanCount);
         fScanLastMsgWhen = now;
     }
 
     return result;
 }
 
+/*
+ * Hand a progress message to the nearest callback up the tree.
+ *
+ * If a container above us is opening its sub-volumes on worker threads,
+ * we're probably on one of them, and the callback (which may be driving a
+ * dialog) shouldn't be called from here.  Post the message to the
+ * container's relay instead.  The relay on "this" is ignored, because
+ * that's what the waiting thread uses to pass messages along.
+ */
+bool DiskImg::SendScanProgress(const char* msg, int count)
+{
+    DiskImg* pImg = this;
+
+    while (true) {
+        if (pImg != this && pImg->fpScanRelay != NULL)
+            return pImg->fpScanRelay->Post(msg, count);
+        if (pImg->fpScanProgressCallback != NULL) {
+            return (*pImg->fpScanProgressCallback)(pImg->fScanProgressCookie,
+                        msg, count);
+        }
+        pImg = pImg->fpParentImg;
+        if (pImg == NULL)
+            return true;
+    }
+}
+
 
 /*
  * ==========================================================================
@@ -1803,6 +1897,67 @@ bool DiskImg::UpdateScanProgress(const char* newStr)
  * ==========================================================================
  */
 
+/*
+ * Sector order conversions, indexed by SectorOrder.  "Physical" (which is
+ * also what Copy ][+ uses) is the identity mapping, and so is "unknown",
+ * which we should never see here.
+ */
+static constexpr uint8_t kOrderToRaw[DiskImg::kSectorOrderMax][16] = {
+    /* unknown */
+    { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 },
+    /* ProDOS */
+    { 0, 2, 4, 6, 8, 10, 12, 14, 1, 3, 5, 7, 9, 11, 13, 15 },
+    /* DOS */
+    { 0, 13, 11, 9, 7, 5, 3, 1, 14, 12, 10, 8, 6, 4, 2, 15 },
+    /* CP/M */
+    { 0, 3, 6, 9, 12, 15, 2, 5, 8, 11, 14, 1, 4, 7, 10, 13 },
+    /* physical */
+    { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 },
+};
+static constexpr uint8_t kRawToOrder[DiskImg::kSectorOrderMax][16] = {
+    /* unknown */
+    { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 },
+    /* ProDOS */
+    { 0, 8, 1, 9, 2, 10, 3, 11, 4, 12, 5, 13, 6, 14, 7, 15 },
+    /* DOS */
+    { 0, 7, 14, 6, 13, 5, 12, 4, 11, 3, 10, 2, 9, 1, 8, 15 },
+    /* CP/M */
+    { 0, 11, 6, 1, 12, 7, 2, 13, 8, 3, 14, 9, 4, 15, 10, 5 },
+    /* physical */
+    { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 },
+};
+
+/*
+ * Where sector "sector" of a filesystem in "fsOrder" lives in an image
+ * in "imageOrder": convert to a raw sector number, then to the image's.
+ */
+static constexpr uint8_t SkewEntry(int imageOrder, int fsOrder, int sector)
+{
+    return kRawToOrder[imageOrder][kOrderToRaw[fsOrder][sector]];
+}
+
+/*
+ * The composed mapping for every (imageOrder, fsOrder) pair, worked out
+ * by the compiler.
+ */
+#define SKEW_ROW(img, fs) {                                             \
+    SkewEntry(img, fs, 0),  SkewEntry(img, fs, 1),  SkewEntry(img, fs, 2),  \
+    SkewEntry(img, fs, 3),  SkewEntry(img, fs, 4),  SkewEntry(img, fs, 5),  \
+    SkewEntry(img, fs, 6),  SkewEntry(img, fs, 7),  SkewEntry(img, fs, 8),  \
+    SkewEntry(img, fs, 9),  SkewEntry(img, fs, 10), SkewEntry(img, fs, 11), \
+    SkewEntry(img, fs, 12), SkewEntry(img, fs, 13), SkewEntry(img, fs, 14), \
+    SkewEntry(img, fs, 15) }
+#define SKEW_IMG(img) { SKEW_ROW(img, 0), SKEW_ROW(img, 1), SKEW_ROW(img, 2), \
+    SKEW_ROW(img, 3), SKEW_ROW(img, 4) }
+static_assert(DiskImg::kSectorOrderMax == 5, "update kSectorSkew");
+static constexpr uint8_t
+    kSectorSkew[DiskImg::kSectorOrderMax][DiskImg::kSectorOrderMax][16] =
+{
+    SKEW_IMG(0), SKEW_IMG(1), SKEW_IMG(2), SKEW_IMG(3), SKEW_IMG(4)
+};
+#undef SKEW_IMG
+#undef SKEW_ROW
+
 /*
  * Handle sector order conversions.
  */
@@ -1812,29 +1967,6 @@ DIError DiskImg::CalcSectorAndOffset(long track, int sector, SectorOrder imageOr
     if (!fHasSectors)
         return kDIErrUnsupportedAccess;
 
-    /*
-     * Sector order conversions.  No table is needed for Copy ][+ format,
-     * which is equivalent to "physical".
-     */
-    static const int raw2dos[16] = {
-        0, 7, 14, 6, 13, 5, 12, 4, 11, 3, 10, 2, 9, 1, 8, 15
-    };
-    static const int dos2raw[16] = {
-        0, 13, 11, 9, 7, 5, 3, 1, 14, 12, 10, 8, 6, 4, 2, 15
-    };
-    static const int raw2prodos[16] = {
-        0, 8, 1, 9, 2, 10, 3, 11, 4, 12, 5, 13, 6, 14, 7, 15
-    };
-    static const int prodos2raw[16] = {
-        0, 2, 4, 6, 8, 10, 12, 14, 1, 3, 5, 7, 9, 11, 13, 15
-    };
-    static const int raw2cpm[16] = {
-        0, 11, 6, 1, 12, 7, 2, 13, 8, 3, 14, 9, 4, 15, 10, 5
-    };
-    static const int cpm2raw[16] = {
-        0, 3, 6, 9, 12, 15, 2, 5, 8, 11, 14, 1, 4, 7, 10, 13
-    };
-
     if (track < 0 || track >= fNumTracks) {
         LOGI(" DI read invalid track %ld", track);
         return kDIErrInvalidTrack;
@@ -1876,49 +2008,16 @@ DIError DiskImg::CalcSectorAndOffset(long track, int sector, SectorOrder imageOr
         }
         assert(sector >= 0 && sector < 16);
 
-        /* convert request to "raw" sector number */
-        switch (fsOrder) {
-        case kSectorOrderProDOS:
-            newSector = prodos2raw[sector];
-            break;
-        case kSectorOrderDOS:
-            newSector = dos2raw[sector];
-            break;
-        case kSectorOrderCPM:
-            newSector = cpm2raw[sector];
-            break;
-        case kSectorOrderPhysical:  // used for Copy ][+
-            newSector = sector;
-            break;
-        case kSectorOrderUnknown:
-            // should never happen; fall through to "default"
-        default:
-            assert(false);
-            newSector = sector;
-            break;
-        }
-
-        /* convert "raw" request to the image's ordering */
-        switch (imageOrder) {
-        case kSectorOrderProDOS:
-            newSector = raw2prodos[newSector];
-            break;
-        case kSectorOrderDOS:
-            newSector = raw2dos[newSector];
-            break;
-        case kSectorOrderCPM:
-            newSector = raw2cpm[newSector];
-            break;
-        case kSectorOrderPhysical:
-            //newSector = newSector;
-            break;
-        case kSectorOrderUnknown:
-            // should never happen; fall through to "default"
-        default:
-            assert(false);
-            //newSector = newSector;
-            break;
+        /* convert request to the image's ordering */
+        assert(fsOrder > kSectorOrderUnknown && fsOrder < kSectorOrderMax);
+        assert(imageOrder > kSectorOrderUnknown &&
+               imageOrder < kSectorOrderMax);
+        if ((unsigned) fsOrder >= kSectorOrderMax ||
+            (unsigned) imageOrder >= kSectorOrderMax)
+        {
+            return kDIErrInternal;
         }
+        newSector = kSectorSkew[imageOrder][fsOrder][sector];
 
         if (imageOrder == fsOrder) {
             assert(sector == newSector);
@@ -2018,6 +2117,7 @@ DIError DiskImg::ReadTrackSectorSwapped(long track, int sector, void* buf,
         dierr = kDIErrInternal;
     }
 
+    AddStat(DiskImgStats::kCounterSectorsRead, 1);
     return dierr;
 }
 
@@ -2040,6 +2140,12 @@ DIError DiskImg::WriteTrackSector(long track, int sector, const void* buf)
     if (fReadOnly)
         return kDIErrAccessDenied;
 
+    /* charge the write to the block that holds the sector */
+    if (fHasBlocks && (fNumSectPerTrack & 0x01) == 0)
+        NoteBlocksWritten(track * (fNumSectPerTrack / 2) + sector / 2, 1);
+    else
+        NoteUntrackedWrite();
+
 #if 0   // Pre-d13
     if (fNumSectPerTrack == 13) {
         /* no sector skewing possible for 13-sector disks */
@@ -2093,6 +2199,8 @@ DIError DiskImg::ReadBlockSwapped(long block, void* buf, SectorOrder imageOrder,
     DIError dierr;
     long track, blkInTrk;
 
+    AddStat(DiskImgStats::kCounterBlocksRead, 1);
+
     /* if we have a bad block map, check it */
     if (CheckForBadBlocks(block, 1)) {
         dierr = kDIErrReadFailed;
@@ -2125,6 +2233,110 @@ bail:
     return dierr;
 }
 
+/*
+ * Choose the ReadBlock/WriteBlock implementation.  Call this whenever
+ * fOrder, fFileSysOrder, or the sector pairing changes.
+ *
+ * Linear images (e.g. ProDOS blocks in a ".po") go straight to the file.
+ * Ordinary 16-sector images whose order doesn't match the filesystem
+ * (a ".do" holding ProDOS, say) look up both halves of the block in a
+ * skew table.  Anything else (nibble images, 13- or 32-sector disks,
+ * OzDOS sector pairing) takes the general route through
+ * ReadTrackSectorSwapped.
+ */
+void DiskImg::SelectBlockAccess(void)
+{
+    fLinearBlocks = IsLinearBlocks(fOrder, fFileSysOrder);
+    fpBlockSkew = NULL;
+
+    if (fHasBlocks && (!fHasSectors || fLinearBlocks)) {
+        if (fOrder != fFileSysOrder) {
+            LOGI(" DI NOTE: linear block access on non-sector (%d/%d)",
+                fOrder, fFileSysOrder);
+        }
+        fReadBlockFunc = &DiskImg::ReadBlockLinear;
+        fWriteBlockFunc = &DiskImg::WriteBlockLinear;
+    } else if (fHasBlocks && IsSectorFormat(fPhysical) &&
+        fNumSectPerTrack == 16 && !fSectorPairing &&
+        fOrder > kSectorOrderUnknown && fOrder < kSectorOrderMax &&
+        fFileSysOrder > kSectorOrderUnknown && fFileSysOrder < kSectorOrderMax)
+    {
+        fpBlockSkew = kSectorSkew[fOrder][fFileSysOrder];
+        fReadBlockFunc = &DiskImg::ReadBlockSkewed;
+        fWriteBlockFunc = &DiskImg::WriteBlockSkewed;
+    } else {
+        fReadBlockFunc = &DiskImg::ReadBlockGeneric;
+        fWriteBlockFunc = &DiskImg::WriteBlockGeneric;
+    }
+}
+
+/*
+ * Argument checks shared by the block I/O functions.
+ */
+DIError DiskImg::CheckBlockArgs(long block, const void* buf) const
+{
+    if (!fHasBlocks)
+        return kDIErrUnsupportedAccess;
+    if (block < 0 || block >= fNumBlocks)
+        return kDIErrInvalidBlock;
+    if (buf == NULL)
+        return kDIErrInvalidArg;
+    return kDIErrNone;
+}
+
+/*
+ * ReadBlock for anything SelectBlockAccess doesn't have a faster way to
+ * handle.
+ */
+DIError DiskImg::ReadBlockGeneric(long block, void* buf)
+{
+    return ReadBlockSwapped(block, buf, fOrder, fFileSysOrder);
+}
+
+/*
+ * ReadBlock for images laid out as linear blocks.
+ */
+DIError DiskImg::ReadBlockLinear(long block, void* buf)
+{
+    DIError dierr = CheckBlockArgs(block, buf);
+    if (dierr != kDIErrNone)
+        return dierr;
+
+    AddStat(DiskImgStats::kCounterBlocksRead, 1);
+    if (CheckForBadBlocks(block, 1))
+        return kDIErrReadFailed;
+    return CopyBytesOut(buf, (di_off_t) block * kBlockSize, kBlockSize);
+}
+
+/*
+ * ReadBlock for 16-sector images that need sector skewing.  Each block
+ * is two sectors on the same track.
+ */
+DIError DiskImg::ReadBlockSkewed(long block, void* buf)
+{
+    DIError dierr = CheckBlockArgs(block, buf);
+    if (dierr != kDIErrNone)
+        return dierr;
+
+    AddStat(DiskImgStats::kCounterBlocksRead, 1);
+    if (CheckForBadBlocks(block, 1))
+        return kDIErrReadFailed;
+    if ((block >> 3) >= fNumTracks)
+        return kDIErrInvalidTrack;      // partial track at the end
+
+    di_off_t trackOffset = (di_off_t) (block >> 3) * 16 * kSectorSize;
+    int sector = (block & 0x07) * 2;
+    assert(trackOffset + 16 * kSectorSize <= fLength);
+
+    AddStat(DiskImgStats::kCounterSectorsRead, 2);
+    dierr = CopyBytesOut(buf,
+                trackOffset + fpBlockSkew[sector] * kSectorSize, kSectorSize);
+    if (dierr != kDIErrNone)
+        return dierr;
+    return CopyBytesOut((char*)buf + kSectorSize,
+                trackOffset + fpBlockSkew[sector+1] * kSectorSize, kSectorSize);
+}
+
 /*
  * Read multiple blocks.
  *
@@ -2152,7 +2364,7 @@ DIError DiskImg::ReadBlocks(long startBlock, int numBlocks, void* buf)
         goto bail;
     }
 
-    if (!IsLinearBlocks(fOrder, fFileSysOrder)) {
+    if (!fLinearBlocks) {
         /*
          * This isn't a collection of linear blocks, so we need to read it one
          * block at a time with sector swapping.  This almost certainly means
@@ -2173,6 +2385,7 @@ DIError DiskImg::ReadBlocks(long startBlock, int numBlocks, void* buf)
         if (startBlock == 0) {
             LOGI(" ReadBlocks: doing big linear reads");
         }
+        AddStat(DiskImgStats::kCounterBlocksRead, numBlocks);
         dierr = CopyBytesOut(buf,
                     (di_off_t) startBlock * kBlockSize, numBlocks * kBlockSize);
     }
@@ -2181,6 +2394,91 @@ bail:
     return dierr;
 }
 
+/*
+ * Find a run of blocks in the host file, so A2FileDescr::ExtractTo can
+ * have the kernel copy them.  This only works when ReadBlock would go
+ * straight to the file; anything with sector skew, nibbles, or bad blocks
+ * has to be read the usual way.
+ *
+ * Counts as a read of the blocks, since the caller is about to do one.
+ */
+bool DiskImg::GetBlockHostRange(long startBlock, long numBlocks, int* pFd,
+    di_off_t* pHostOffset)
+{
+    if (fpDataGFD == NULL || fReadBlockFunc != &DiskImg::ReadBlockLinear)
+        return false;
+    if (startBlock < 0 || numBlocks <= 0 ||
+        startBlock + numBlocks > GetNumBlocks())
+    {
+        return false;
+    }
+    if (CheckForBadBlocks(startBlock, numBlocks))
+        return false;
+
+    if (!fpDataGFD->GetHostRange((di_off_t) startBlock * kBlockSize,
+            (di_off_t) numBlocks * kBlockSize, pFd, pHostOffset))
+    {
+        return false;
+    }
+    AddStat(DiskImgStats::kCounterBlocksRead, numBlocks);
+    return true;
+}
+
+/*
+ * Tell the data GFD that we're about to read a bunch of blocks, so it can
+ * start fetching them while the filesystem code chews on what it already
+ * has.  The blocks don't need to be in order; we sort them and merge
+ * adjacent ones into runs.
+ *
+ * Skewed 16-sector images prefetch the whole track.  Anything that doesn't
+ * map blocks straight onto the file (nibble images, for example) is
+ * already in memory, so we don't bother.
+ */
+void DiskImg::PrefetchBlocks(const long* blocks, int count)
+{
+    const di_off_t kMaxRun = 256 * 1024;
+    std::vector<di_off_t> offsets;
+    di_off_t unit;
+
+    if (fpDataGFD == NULL || !fHasBlocks || blocks == NULL || count <= 0)
+        return;
+
+    if (fReadBlockFunc == &DiskImg::ReadBlockLinear)
+        unit = kBlockSize;
+    else if (fReadBlockFunc == &DiskImg::ReadBlockSkewed)
+        unit = 16 * kSectorSize;
+    else
+        return;
+
+    AddStat(DiskImgStats::kCounterBlocksPrefetched, count);
+    offsets.reserve(count);
+    for (int i = 0; i < count; i++) {
+        long block = blocks[i];
+        if (block < 0 || block >= fNumBlocks)
+            continue;
+        if (unit == kBlockSize)
+            offsets.push_back((di_off_t) block * kBlockSize);
+        else if ((block >> 3) < fNumTracks)
+            offsets.push_back((di_off_t) (block >> 3) * unit);
+    }
+    if (offsets.empty())
+        return;
+    std::sort(offsets.begin(), offsets.end());
+
+    di_off_t runStart = offsets[0];
+    di_off_t runEnd = runStart + unit;
+    for (size_t i = 1; i < offsets.size(); i++) {
+        if (offsets[i] <= runEnd && runEnd - runStart < kMaxRun) {
+            runEnd = offsets[i] + unit;     // adjacent or repeated
+            continue;
+        }
+        fpDataGFD->Prefetch(runStart, runEnd - runStart);
+        runStart = offsets[i];
+        runEnd = runStart + unit;
+    }
+    fpDataGFD->Prefetch(runStart, runEnd - runStart);
+}
+
 /*
  * Check to see if any blocks in a range of blocks show up in the bad
  * block map.  This is primarily useful for 3.5" disk images converted
@@ -2204,12 +2502,78 @@ bool DiskImg::CheckForBadBlocks(long startBlock, int numBlocks)
 }
 
 /*
- * Write a block of data to a DiskImg.
+ * Remember that some blocks are being written.  The map is allocated on
+ * first use, so images that are only read don't pay for it.
+ */
+void DiskImg::NoteBlocksWritten(long startBlock, long count)
+{
+    if (fReadOnly || startBlock < 0 || count <= 0)
+        return;     // the write is going to fail anyway
+
+    if (fpBlockWriteGen == NULL) {
+        if (fNumBlocks <= 0) {
+            NoteUntrackedWrite();
+            return;
+        }
+        fpBlockWriteGen = new uint32_t[fNumBlocks]();
+        fNumWriteGenBlocks = fNumBlocks;
+    }
+    if (startBlock + count > fNumWriteGenBlocks) {
+        NoteUntrackedWrite();
+        return;
+    }
+
+    StartWriteGeneration();
+    for (long i = startBlock; i < startBlock + count; i++)
+        fpBlockWriteGen[i] = fWriteGen;
+}
+
+/*
+ * Note a write we can't pin to particular blocks.
+ */
+void DiskImg::NoteUntrackedWrite(void)
+{
+    StartWriteGeneration();
+    fUntrackedGen = fWriteGen;
+}
+
+void DiskImg::SetUntrackedWrites(void)
+{
+    NoteUntrackedWrite();
+}
+
+/*
+ * Returns "true" if the block has been written since "sinceGen".
+ */
+bool DiskImg::GetBlockWritten(long block, uint32_t sinceGen) const
+{
+    if (fpBlockWriteGen == NULL || block < 0 || block >= fNumWriteGenBlocks)
+        return false;
+    return fpBlockWriteGen[block] > sinceGen;
+}
+
+/*
+ * Find the next block written since "sinceGen".
+ */
+long DiskImg::GetNextWrittenBlock(long block, uint32_t sinceGen) const
+{
+    if (fpBlockWriteGen == NULL || fLastWriteGen <= sinceGen)
+        return -1;
+    for (block++; block < fNumWriteGenBlocks; block++) {
+        if (fpBlockWriteGen[block] > sinceGen)
+            return block;
+    }
+    return -1;
+}
+
+/*
+ * Write a block of data to a DiskImg.  This is the general-purpose
+ * version of WriteBlock; see SelectBlockAccess.
  *
  * Returns immediately when a block write fails.  Does not try to write all
  * blocks before returning failure.
  */
-DIError DiskImg::WriteBlock(long block, const void* buf)
+DIError DiskImg::WriteBlockGeneric(long block, const void* buf)
 {
     if (!fHasBlocks)
         return kDIErrUnsupportedAccess;
@@ -2245,6 +2609,45 @@ DIError DiskImg::WriteBlock(long block, const void* buf)
     return dierr;
 }
 
+/*
+ * WriteBlock for images laid out as linear blocks.
+ */
+DIError DiskImg::WriteBlockLinear(long block, const void* buf)
+{
+    DIError dierr = CheckBlockArgs(block, buf);
+    if (dierr != kDIErrNone)
+        return dierr;
+    if (fReadOnly)
+        return kDIErrAccessDenied;
+
+    return CopyBytesIn(buf, (di_off_t) block * kBlockSize, kBlockSize);
+}
+
+/*
+ * WriteBlock for 16-sector images that need sector skewing.
+ */
+DIError DiskImg::WriteBlockSkewed(long block, const void* buf)
+{
+    DIError dierr = CheckBlockArgs(block, buf);
+    if (dierr != kDIErrNone)
+        return dierr;
+    if (fReadOnly)
+        return kDIErrAccessDenied;
+    if ((block >> 3) >= fNumTracks)
+        return kDIErrInvalidTrack;      // partial track at the end
+
+    di_off_t trackOffset = (di_off_t) (block >> 3) * 16 * kSectorSize;
+    int sector = (block & 0x07) * 2;
+    assert(trackOffset + 16 * kSectorSize <= fLength);
+
+    dierr = CopyBytesIn(buf,
+                trackOffset + fpBlockSkew[sector] * kSectorSize, kSectorSize);
+    if (dierr != kDIErrNone)
+        return dierr;
+    return CopyBytesIn((const char*)buf + kSectorSize,
+                trackOffset + fpBlockSkew[sector+1] * kSectorSize, kSectorSize);
+}
+
 /*
  * Write multiple blocks.
  */
@@ -2262,7 +2665,7 @@ DIError DiskImg::WriteBlocks(long startBlock, int numBlocks, const void* buf)
         return kDIErrInvalidArg;
     }
 
-    if (!IsLinearBlocks(fOrder, fFileSysOrder)) {
+    if (!fLinearBlocks) {
         /*
          * This isn't a collection of linear blocks, so we need to write it
          * one block at a time with sector swapping.  This almost certainly
@@ -2283,6 +2686,7 @@ DIError DiskImg::WriteBlocks(long startBlock, int numBlocks, const void* buf)
         if (startBlock == 0) {
             LOGI(" WriteBlocks: doing big linear writes");
         }
+        NoteBlocksWritten(startBlock, numBlocks);
         dierr = CopyBytesIn(buf,
                     (di_off_t) startBlock * kBlockSize, numBlocks * kBlockSize);
     }
@@ -2295,19 +2699,18 @@ bail:
 /*
  * Copy a chunk of bytes out of the disk image.
  *
+ * This uses a positional read, so it doesn't disturb (or depend on) the
+ * file position of the data GFD.
+ *
  * (This is the lowest-level read routine in this class.)
  */
 DIError DiskImg::CopyBytesOut(void* buf, di_off_t offset, int size) const
 {
     DIError dierr;
 
-    dierr = fpDataGFD->Seek(offset, kSeekSet);
-    if (dierr != kDIErrNone) {
-        LOGI(" DI seek off=%ld failed (err=%d)", (long) offset, dierr);
-        return dierr;
-    }
-
-    dierr = fpDataGFD->Read(buf, size);
+    AddStat(DiskImgStats::kCounterSeeks, 1);
+    AddStat(DiskImgStats::kCounterBytesRead, size);
+    dierr = fpDataGFD->ReadAt(offset, buf, size);
     if (dierr != kDIErrNone) {
         LOGI(" DI read off=%ld size=%d failed (err=%d)",
             (long) offset, size, dierr);
@@ -2334,13 +2737,7 @@ DIError DiskImg::CopyBytesIn(const void* buf, di_off_t offset, int size)
     }
     assert(fpDataGFD != NULL);   // somebody closed the image?
 
-    dierr = fpDataGFD->Seek(offset, kSeekSet);
-    if (dierr != kDIErrNone) {
-        LOGI(" DI seek off=%ld failed (err=%d)", (long) offset, dierr);
-        return dierr;
-    }
-
-    dierr = fpDataGFD->Write(buf, size);
+    dierr = fpDataGFD->WriteAt(offset, buf, size);
     if (dierr != kDIErrNone) {
         LOGI(" DI write off=%ld size=%d failed (err=%d)",
             (long) offset, size, dierr);
@@ -2470,6 +2867,7 @@ DIError DiskImg::CreateImageCommon(const char* pathName, const char* storageName
     assert(fHasBlocks || fHasSectors || fHasNibbles);
 
     fFileSysOrder = CalcFSSectorOrder();
+    SelectBlockAccess();
     fReadOnly = false;
     fDirty = true;
 
@@ -3317,19 +3715,12 @@ const char* DiskImgLib::DIStrError(DIError dierr)
     }
 
     /*
-     * BUG: this should be set up as per-thread storage in an MT environment.
-     * I would be more inclined to worry about this if I was expecting
-     * to hit "default:".  So long as valid values are passed in, and the
-     * switch statement is kept up to date, we should never have cause
-     * to return this.
-     *
-     * An easier solution, should this present a problem for someone, would
-     * be to have the function return NULL or "unknown error" when the
-     * error value isn't recognized.  I'd recommend leaving it as-is for
-     * debug builds, though, as it's helpful to know *which* error is not
-     * recognized.
+     * Unrecognized values are formatted into per-thread storage, so this
+     * is safe to call from multiple threads.  So long as valid values are
+     * passed in, and the switch statement is kept up to date, we should
+     * never have cause to use it.
      */
-    static char defaultMsg[32];
+    static thread_local char defaultMsg[32];
 
     switch (dierr) {
     case kDIErrNone:
@@ -3475,7 +3866,7 @@ const char* DiskImgLib::DIStrError(DIError dierr)
         return "NufxLib initialization failed";
 
     default:
-        sprintf(defaultMsg, "(error=%d)", dierr);
+        snprintf(defaultMsg, sizeof(defaultMsg), "(error=%d)", dierr);
         return defaultMsg;
     }
 }
@@ -18,6 +18,23 @@
  * simultaneously is bound to end in disaster.  Simultaneous access to
  * different objects will work, though modifying the same disk image
  * file from multiple objects will lead to unpredictable results.
+ *
+ * The library-global state is safe to use from multiple threads:
+ *  - Global::AppInit may be called from any thread, any number of times;
+ *    the initialization happens exactly once, and every caller sees the
+ *    result of that one call.
+ *  - The debug message handler may be changed at any time.  Messages
+ *    already in flight may still go to the previous handler, so the
+ *    handler itself must be safe to call from multiple threads.
+ *  - The nibble tables and other static data are constant.
+ *  - DIStrError returns static strings or per-thread storage.
+ *  - Date conversions share the C library's time zone state, so the
+ *    library serializes its own calls to localtime_r(), mktime() and
+ *    friends.  Applications calling them from other threads should do
+ *    the same, or set TZ before starting any threads.
+ *  - libhfs keeps its volume state in the volume and its error string
+ *    per-thread.  Its only other global, the time zone offset, is set
+ *    once by AppInit.  HFS volumes may be scanned concurrently too.
  */
 #ifndef DISKIMG_DISKIMG_H
 #define DISKIMG_DISKIMG_H
@@ -184,6 +201,7 @@ class ImageWrapper;
 class CircularBufferAccess;
 class ASPI;
 class LinearBitmap;
+class ScanRelay;
 
 
 /*
@@ -201,7 +219,7 @@ public:
     // return the DiskImg version number
     static void GetVersion(int32_t* pMajor, int32_t* pMinor, int32_t* pBug);
 
-    static bool GetAppInitCalled(void) { return fAppInitCalled; }
+    static bool GetAppInitCalled(void);
     static bool GetHasSPTI(void);
     static bool GetHasASPI(void);
 
@@ -210,9 +228,8 @@ public:
     // shortcut for fpASPI->GetVersion()
     static unsigned long GetASPIVersion(void);
 
-    // pointer to the debug message handler
+    // pointer to the debug message handler; must be thread-safe
     typedef void (*DebugMsgHandler)(const char* file, int line, const char* msg);
-    static DebugMsgHandler gDebugMsgHandler;
 
     static DebugMsgHandler SetDebugMsgHandler(DebugMsgHandler handler);
     static void PrintDebugMsg(const char* file, int line, const char* fmt, ...)
@@ -226,8 +243,8 @@ private:
     Global(void) {}
     ~Global(void) {}
 
-    // make sure app calls AppInit
-    static bool fAppInitCalled;
+    // does the actual work for AppInit
+    static void AppInitOnce(void);
 
     static ASPI*    fpASPI;
 };
@@ -235,6 +252,106 @@ private:
 extern bool gAllowWritePhys0;   // ugh -- see Win32BlockIO.cpp
 
 
+/*
+ * Timers and counters collected while a DiskImg is opened and scanned.
+ *
+ * Collection is off by default.  Call DiskImg::SetStatsEnabled(true) before
+ * opening the image; when disabled, the instrumented code only pays for a
+ * NULL pointer test.  Embedded images (sub-volumes) collect their own
+ * stats if their parent does.
+ *
+ * Times are in microseconds, measured with a monotonic clock.  Phases can
+ * nest (e.g. a sub-volume's DiskFS init happens inside its parent's), so
+ * the phase times don't necessarily add up to the total.
+ */
+class DISKIMG_API DiskImgStats {
+public:
+    DiskImgStats(void) { Reset(); }
+    ~DiskImgStats(void) {}
+
+    typedef enum Phase {
+        kPhaseOuterWrapper = 0,     // OuterWrapper::Load (gzip, zip)
+        kPhaseImageWrapper,         // ImageWrapper::Prep (2MG, NuFX, ...)
+        kPhaseNibbleAnalysis,       // AnalyzeNibbleData
+        kPhaseFSProbe,              // AnalyzeImageFS (all TestFS calls)
+        kPhaseDiskFSInit,           // DiskFS::Initialize
+        kPhaseMAX                   // must be last
+    } Phase;
+    typedef enum Counter {
+        kCounterBlocksRead = 0,     // 512-byte blocks requested
+        kCounterSectorsRead,        // 256-byte sectors, incl. for blocks
+        kCounterNibbleTracksRead,   // nibble tracks loaded
+        kCounterBytesRead,          // bytes read from the data GFD
+        kCounterSeeks,              // positioned reads of the data GFD
+        kCounterFSProbes,           // filesystem TestFS calls
+        kCounterBlocksPrefetched,   // blocks passed to PrefetchBlocks
+        kCounterMAX                 // must be last
+    } Counter;
+
+    void Reset(void);
+
+    // total time spent in a phase, and the #of times it was entered
+    uint64_t GetPhaseMicros(Phase phase) const {
+        assert(phase >= 0 && phase < kPhaseMAX);
+        return fPhaseMicros[phase];
+    }
+    long GetPhaseCount(Phase phase) const {
+        assert(phase >= 0 && phase < kPhaseMAX);
+        return fPhaseCount[phase];
+    }
+    uint64_t GetCounter(Counter counter) const {
+        assert(counter >= 0 && counter < kCounterMAX);
+        return fCounter[counter];
+    }
+
+    void AddPhaseMicros(Phase phase, uint64_t micros) {
+        assert(phase >= 0 && phase < kPhaseMAX);
+        fPhaseMicros[phase] += micros;
+        fPhaseCount[phase]++;
+    }
+    void Add(Counter counter, uint64_t val) {
+        assert(counter >= 0 && counter < kCounterMAX);
+        fCounter[counter] += val;
+    }
+
+    // short identifiers, suitable for use as JSON keys
+    static const char* ToString(Phase phase);
+    static const char* ToString(Counter counter);
+
+    // monotonic clock, in microseconds
+    static uint64_t GetMonotonicMicros(void);
+
+    /*
+     * Time a phase for the lifetime of this object.  Does nothing if
+     * "pStats" is NULL.
+     */
+    class PhaseTimer {
+    public:
+        PhaseTimer(DiskImgStats* pStats, Phase phase) :
+            fpStats(pStats), fPhase(phase),
+            fStartWhen(pStats != NULL ? GetMonotonicMicros() : 0)
+            {}
+        ~PhaseTimer(void) {
+            if (fpStats != NULL)
+                fpStats->AddPhaseMicros(fPhase,
+                    GetMonotonicMicros() - fStartWhen);
+        }
+    private:
+        DiskImgStats*   fpStats;
+        Phase           fPhase;
+        uint64_t        fStartWhen;
+
+        PhaseTimer& operator=(const PhaseTimer&);
+        PhaseTimer(const PhaseTimer&);
+    };
+
+private:
+    uint64_t    fPhaseMicros[kPhaseMAX];
+    long        fPhaseCount[kPhaseMAX];
+    uint64_t    fCounter[kCounterMAX];
+};
+
+
 /*
  * Disk I/O class, roughly equivalent to a GS/OS disk device driver.
  *
@@ -269,6 +386,9 @@ extern bool gAllowWritePhys0;   // ugh -- see Win32BlockIO.cpp
  */
 class DISKIMG_API DiskImg {
 public:
+    friend class DiskFSContainer;
+    friend class TestHooks;         // for the test programs
+
     // create DiskImg object
     DiskImg(void);
     virtual ~DiskImg(void);
@@ -509,19 +629,56 @@ public:
 
     // read a 512-byte block
     virtual DIError ReadBlock(long block, void* buf) {
-        return ReadBlockSwapped(block, buf, fOrder, fFileSysOrder);
+        return (this->*fReadBlockFunc)(block, buf);
     }
     DIError ReadBlockSwapped(long block, void* buf, SectorOrder imageOrder,
                 SectorOrder fsOrder);
     // read multiple blocks
     virtual DIError ReadBlocks(long startBlock, int numBlocks, void* buf);
+    // if the blocks are stored as-is in a host file, get its descriptor
+    //  and the offset of the first one (see GenericFD::GetHostRange)
+    bool GetBlockHostRange(long startBlock, long numBlocks, int* pFd,
+        di_off_t* pHostOffset);
+    // hint that these blocks will be read soon (in any order)
+    void PrefetchBlocks(const long* blocks, int count);
     // check our virtual bad block map
     bool CheckForBadBlocks(long startBlock, int numBlocks);
     // write a 512-byte block
-    virtual DIError WriteBlock(long block, const void* buf);
+    virtual DIError WriteBlock(long block, const void* buf) {
+        NoteBlocksWritten(block, 1);
+        return (this->*fWriteBlockFunc)(block, buf);
+    }
     // write multiple blocks
     virtual DIError WriteBlocks(long startBlock, int numBlocks, const void* buf);
 
+    /*
+     * Blocks written since some point in time.  Every block remembers the
+     * write generation it was last written in.  A DiskFS grabs the current
+     * generation with GetWriteGeneration when it scans the volume, and
+     * DiskFS::Refresh later asks which blocks were written after that, so
+     * several DiskFS can share one image and each catch up on its own.
+     * Sector writes count against the block holding the sector.  Nibble
+     * track writes can't be pinned down, so they're reported by
+     * GetUntrackedWrites instead.
+     */
+    uint32_t GetWriteGeneration(void) {
+        fWriteGenSeen = true;
+        return fWriteGen;
+    }
+    bool GetAnyWritten(uint32_t sinceGen) const {
+        return fLastWriteGen > sinceGen;
+    }
+    bool GetUntrackedWrites(uint32_t sinceGen) const {
+        return fUntrackedGen > sinceGen;
+    }
+    // the image may have been changed behind our back, e.g. by another
+    //  program; the next Refresh looks at everything
+    void SetUntrackedWrites(void);
+    bool GetBlockWritten(long block, uint32_t sinceGen) const;
+    // returns the next block after "block" (start with -1) written since
+    //  "sinceGen", or -1
+    long GetNextWrittenBlock(long block, uint32_t sinceGen) const;
+
     // read an entire nibblized track
     virtual DIError ReadNibbleTrack(long track, uint8_t* buf,
         long* pTrackLen);
@@ -558,6 +715,11 @@ public:
     // must be set before image is opened or created
     void SetNuFXCompressionType(int val) { fNuFXCompressType = val; }
 
+    // enable collection of timing stats; must be set before image is opened
+    void SetStatsEnabled(bool val);
+    // get the stats; returns NULL if collection isn't enabled
+    DiskImgStats* GetStats(void) const { return fpStats; }
+
     /*
      * Set up a progress callback to use when scanning a disk volume.  Pass
      * NULL for "func" to disable.
@@ -628,14 +790,18 @@ public:
         kNibbleDescrMAX             // must be last
     };
     static const NibbleDescr* GetStdNibbleDescr(StdNibbleDescr idx);
-    // call this once, at DLL initialization time
-    static void CalcNibbleInvTables(void);
+    // sanity-check the constant nibble tables (debug builds only)
+    static void CheckNibbleInvTables(void);
     // calculate block number from cyl/head/sect on 3.5" disk
     static int CylHeadSect35ToBlock(int cyl, int head, int sect);
     // unpack nibble data from a 3.5" disk track
     static DIError UnpackNibbleTrack35(const uint8_t* nibbleBuf,
         long nibbleLen, uint8_t* outputBuf, int cyl, int head,
         LinearBitmap* pBadBlockMap);
+    // unpack several 3.5" tracks, starting from cyl 0 head 0, in parallel
+    static DIError UnpackNibbleTracks35(const uint8_t* nibbleBufs,
+        const long* nibbleLens, long bufStride, int numTracks,
+        uint8_t* outputBuf, LinearBitmap* pBadBlockMap, int numThreads = 0);
     // compute the #of sectors per track for cylinder N (0-79)
     static int SectorsPerTrack35(int cylinder);
 
@@ -697,6 +863,18 @@ private:
     bool            fSectorPairing;
     int             fSectorPairOffset;  // which image (should be 0 or 1)
 
+    /*
+     * ReadBlock/WriteBlock go through these, which SelectBlockAccess sets
+     * whenever the orders are (re-)established, so the common cases don't
+     * have to work out the mapping on every call.
+     */
+    typedef DIError (DiskImg::*ReadBlockFunc)(long block, void* buf);
+    typedef DIError (DiskImg::*WriteBlockFunc)(long block, const void* buf);
+    ReadBlockFunc   fReadBlockFunc;
+    WriteBlockFunc  fWriteBlockFunc;
+    bool            fLinearBlocks;  // IsLinearBlocks(fOrder, fFileSysOrder)
+    const uint8_t*  fpBlockSkew;    // fs sector -> image sector, for blocks
+
     /*
      * Internal state.
      */
@@ -732,8 +910,22 @@ private:
 
     LinearBitmap*   fpBadBlockMap;  // used for 3.5" nibble images
 
+    /*
+     * The generation only moves on when a write follows a call to
+     * GetWriteGeneration, so it counts refreshes rather than writes, and
+     * won't wrap around.
+     */
+    uint32_t*       fpBlockWriteGen;    // per block; NULL if none written
+    long            fNumWriteGenBlocks;
+    uint32_t        fWriteGen;          // generation of the next write
+    bool            fWriteGenSeen;      // somebody has fWriteGen
+    uint32_t        fLastWriteGen;      // generation of the latest write
+    uint32_t        fUntrackedGen;      // ...of the latest untracked write
+
     int             fDiskFSRefCnt;  // #of DiskFS objects pointing at us
 
+    DiskImgStats*   fpStats;        // NULL unless stats are enabled
+
     /*
      * NibbleDescr entries.  There are several standard ones, and we want
      * to allow applications to define additional ones.
@@ -752,7 +944,27 @@ private:
     //DIError FormatBlocks(GenericFD* pGFD) const;
 
     DIError CopyBytesOut(void* buf, di_off_t offset, int size) const;
+    // add to a stats counter, if stats are enabled
+    void AddStat(DiskImgStats::Counter counter, uint64_t val) const {
+        if (fpStats != NULL)
+            fpStats->Add(counter, val);
+    }
+    // count a filesystem probe; returns "true" if it found something
+    bool ProbeFS(DIError dierr) const {
+        AddStat(DiskImgStats::kCounterFSProbes, 1);
+        return dierr == kDIErrNone;
+    }
     DIError CopyBytesIn(const void* buf, di_off_t offset, int size);
+    // record writes for GetNextWrittenBlock et al.
+    void NoteBlocksWritten(long startBlock, long count);
+    void NoteUntrackedWrite(void);
+    void StartWriteGeneration(void) {
+        if (fWriteGenSeen) {
+            fWriteGen++;
+            fWriteGenSeen = false;
+        }
+        fLastWriteGen = fWriteGen;
+    }
     DIError AnalyzeImageFile(const char* pathName, char fssep);
     // Figure out the sector ordering for this filesystem, so we can decide
     //  how the sectors need to be re-arranged when we're reading them.
@@ -761,6 +973,15 @@ private:
     DIError CalcSectorAndOffset(long track, int sector, SectorOrder ImageOrder,
         SectorOrder fsOrder, di_off_t* pOffset, int* pNewSector);
     inline bool IsLinearBlocks(SectorOrder imageOrder, SectorOrder fsOrder);
+    // Pick the ReadBlock/WriteBlock implementation for the current orders.
+    void SelectBlockAccess(void);
+    DIError CheckBlockArgs(long block, const void* buf) const;
+    DIError ReadBlockGeneric(long block, void* buf);
+    DIError ReadBlockLinear(long block, void* buf);
+    DIError ReadBlockSkewed(long block, void* buf);
+    DIError WriteBlockGeneric(long block, const void* buf);
+    DIError WriteBlockLinear(long block, const void* buf);
+    DIError WriteBlockSkewed(long block, const void* buf);
 
     /*
      * Progress update during the filesystem scan.  This only exists in the
@@ -774,6 +995,14 @@ private:
     char        fScanMsg[128];
     time_t      fScanLastMsgWhen;
 
+    /*
+     * Set while a container on this image is opening its sub-volumes on
+     * worker threads.  Progress updates from below are posted here, and
+     * the thread waiting on the workers passes them to the callback.
+     */
+    ScanRelay*  fpScanRelay;
+    bool SendScanProgress(const char* msg, int count);
+
    /*
      * 5.25" nibble image access.
      */
@@ -832,14 +1061,23 @@ private:
         uint8_t* sctBuf, const NibbleDescr* pNibbleDescr);
     void EncodeNibbleData(const CircularBufferAccess& buffer, int idx,
         const uint8_t* sctBuf, const NibbleDescr* pNibbleDescr) const;
-    DIError DecodeNibble62(const CircularBufferAccess& buffer, int idx,
+    static DIError DecodeNibble62(const CircularBufferAccess& buffer, int idx,
         uint8_t* sctBuf, const NibbleDescr* pNibbleDescr);
-    void EncodeNibble62(const CircularBufferAccess& buffer, int idx,
-        const uint8_t* sctBuf, const NibbleDescr* pNibbleDescr) const;
-    DIError DecodeNibble53(const CircularBufferAccess& buffer, int idx,
+    static void EncodeNibble62(const CircularBufferAccess& buffer, int idx,
+        const uint8_t* sctBuf, const NibbleDescr* pNibbleDescr);
+    static DIError DecodeNibble53(const CircularBufferAccess& buffer, int idx,
         uint8_t* sctBuf, const NibbleDescr* pNibbleDescr);
-    void EncodeNibble53(const CircularBufferAccess& buffer, int idx,
-        const uint8_t* sctBuf, const NibbleDescr* pNibbleDescr) const;
+    static void EncodeNibble53(const CircularBufferAccess& buffer, int idx,
+        const uint8_t* sctBuf, const NibbleDescr* pNibbleDescr);
+    // byte-at-a-time versions; used for odd cases and for testing
+    static DIError DecodeNibble62Ref(const CircularBufferAccess& buffer,
+        int idx, uint8_t* sctBuf, const NibbleDescr* pNibbleDescr);
+    static void EncodeNibble62Ref(const CircularBufferAccess& buffer, int idx,
+        const uint8_t* sctBuf, const NibbleDescr* pNibbleDescr);
+    static DIError DecodeNibble53Ref(const CircularBufferAccess& buffer,
+        int idx, uint8_t* sctBuf, const NibbleDescr* pNibbleDescr);
+    static void EncodeNibble53Ref(const CircularBufferAccess& buffer, int idx,
+        const uint8_t* sctBuf, const NibbleDescr* pNibbleDescr);
     int TestNibbleTrack(int track, const NibbleDescr* pNibbleDescr, int* pVol);
     DIError AnalyzeNibbleData(void);
     inline uint8_t Conv44(uint16_t val, bool first) const {
@@ -855,9 +1093,17 @@ private:
     /*
      * 3.5" nibble access
      */
-    static int FindNextSector35(const CircularBufferAccess& buffer, int start,
-        int cyl, int head, int* pSector);
-    static bool DecodeNibbleSector35(const CircularBufferAccess& buffer,
+    static int FindNextSector35(const uint8_t* trackBuf, int trackLen,
+        int start, int cyl, int head, int* pSector);
+    static bool DecodeNibbleSector35(const uint8_t* trackBuf, int start,
+        uint8_t* sectorBuf, uint8_t* readChecksum, uint8_t* calcChecksum);
+    // byte-at-a-time versions; used for testing
+    static DIError UnpackNibbleTrack35Ref(const uint8_t* nibbleBuf,
+        long nibbleLen, uint8_t* outputBuf, int cyl, int head,
+        LinearBitmap* pBadBlockMap);
+    static int FindNextSector35Ref(const CircularBufferAccess& buffer,
+        int start, int cyl, int head, int* pSector);
+    static bool DecodeNibbleSector35Ref(const CircularBufferAccess& buffer,
         int start, uint8_t* sectorBuf, uint8_t* readChecksum,
         uint8_t* calcChecksum);
     static bool UnpackChecksum35(const CircularBufferAccess& buffer,
@@ -866,10 +1112,10 @@ private:
         uint8_t* outBuf);
 
     /* static data tables */
-    static uint8_t kDiskBytes53[32];
-    static uint8_t kDiskBytes62[64];
-    static uint8_t kInvDiskBytes53[256];
-    static uint8_t kInvDiskBytes62[256];
+    static const uint8_t kDiskBytes53[32];
+    static const uint8_t kDiskBytes62[64];
+    static const uint8_t kInvDiskBytes53[256];
+    static const uint8_t kInvDiskBytes62[256];
     enum { kInvInvalidValue = 0xff };
 
 private:    // some C++ stuff to block behavior we don't support
@@ -926,9 +1172,10 @@ public:
      * convenience we're just using 512-byte blocks (it's up to the CP/M
      * code to set two "chunks" per block).
      *
-     * NOTE: the current DOS/ProDOS/Pascal code is sloppy when it comes to
-     * keeping this structure up to date.  HFS doesn't use it at all.  This
-     * has always been a low-priority feature.
+     * NOTE: the current DOS and Pascal code is sloppy when it comes to
+     * keeping this structure up to date after files are changed.  ProDOS
+     * keeps it current.  HFS doesn't use it at all.  This has always been
+     * a low-priority feature.
      */
     class DISKIMG_API VolumeUsage {
     public:
@@ -1093,13 +1340,19 @@ public:
 
     DiskFS(void) {
         fpA2Head = fpA2Tail = NULL;
+        fpFileArena = NULL;
         fpSubVolumeHead = fpSubVolumeTail = NULL;
         fpImg = NULL;
         fScanForSubVolumes = kScanSubDisabled;
+        fInitDeferred = false;
+        fRefreshGen = 0;
 
         fParmTable[kParm_CreateUnique] = 0;
         fParmTable[kParmProDOS_AllowLowerCase] = 1;
         fParmTable[kParmProDOS_AllocSparse] = 1;
+        fParmTable[kParmProDOS_ListCacheKB] = 1024;
+        fParmTable[kParmHFS_CacheSize] = 0;
+        fParmTable[kParm_SubVolumeThreads] = 0;
     }
     virtual ~DiskFS(void) {
         DeleteSubVolumeList();
@@ -1140,12 +1393,30 @@ public:
      * always do the full scan; this is an optimization.)  Guaranteed to
      * set the volume name and volume block/sector count.
      *
+     * "catalogOnly" reads the directories, but puts off the volume usage
+     * map, the damage checks, the sub-volume scan, and anything else that
+     * requires walking through every file's block or T/S lists.  The
+     * deferred work is done by CompleteDeferredInit(), which is called
+     * automatically by accessors that need the results (GetVolumeUsageMap,
+     * GetFSDamaged, A2File::GetQuality, sparse lengths, and write
+     * operations).  Filesystems that don't support it do a full scan.
+     *
      * If a progress callback is set up, this can return with a "cancelled"
      * result, which should not be treated as a failure.
      */
-    typedef enum { kInitUnknown = 0, kInitHeaderOnly, kInitFull } InitMode;
+    typedef enum {
+        kInitUnknown = 0, kInitHeaderOnly, kInitFull, kInitCatalogOnly
+    } InitMode;
     virtual DIError Initialize(DiskImg* pImg, InitMode initMode) = 0;
 
+    /*
+     * Finish the work skipped by kInitCatalogOnly.  Does nothing if the
+     * volume was fully initialized.  Sub-volumes aren't visible until
+     * this has been called.
+     */
+    DIError CompleteDeferredInit(void);
+    bool GetInitDeferred(void) const { return fInitDeferred; }
+
     /*
      * Format the disk with the appropriate filesystem, creating all filesystem
      * structures and (when appropriate) boot blocks.
@@ -1201,6 +1472,18 @@ public:
     virtual DIError CreateFile(const CreateParms* pParms, A2File** ppNewFile)
         { return kDIErrNotSupported; }
 
+    /*
+     * Create "count" files, as if by calling CreateFile on each entry in
+     * order.  If one fails, we stop there and return the error; the files
+     * created before it are still there.  "ppNewFiles" gets a pointer for
+     * each entry, or NULL if it wasn't created.
+     *
+     * This is much faster than CreateFile when adding lots of files to the
+     * same directory.
+     */
+    virtual DIError CreateFiles(const CreateParms* pParmsList, int count,
+        A2File** ppNewFiles);
+
     /*
      * Delete a file from the disk.
      */
@@ -1264,6 +1547,12 @@ public:
     // Get a count of the files and directories on this disk.
     long GetFileCount(void) const;
 
+    // Get a file by its position in the list, from 0 to GetFileCount()-1.
+    //  Returns NULL if "idx" is out of range.  Walking the list this way
+    //  is cheaper than GetNextFile on big volumes.  The index is updated
+    //  as files are created and deleted, so this doesn't modify anything.
+    A2File* GetFileByIndex(long idx) const;
+
     /*
      * Find a file by case-insensitive pathname.  Assumes fssep=':'.  The
      * compare function can be overridden for systems like HFS, where "case
@@ -1302,6 +1591,8 @@ public:
      * const to keep non-DiskFS classes from altering the map.
      */
     const VolumeUsage* GetVolumeUsageMap(void) {
+        if (fInitDeferred)
+            (void) CompleteDeferredInit();
         if (fVolumeUsage.GetInitialized())
             return &fVolumeUsage;
         else
@@ -1315,6 +1606,21 @@ public:
     virtual DIError GetFreeSpaceCount(long* pTotalUnits, long* pFreeUnits,
         int* pUnitSize) const = 0;
 
+    /*
+     * Statistics for filesystems that keep a block cache of their own
+     * (currently just HFS).  Everything else reads through DiskImg, and
+     * returns kDIErrNotSupported.
+     */
+    typedef struct CacheStats {
+        long        size;           // cache capacity, in blocks
+        uint64_t    hits;           // blocks found in the cache
+        uint64_t    misses;         // blocks that had to be read
+        uint64_t    evictions;      // cached blocks dropped to make room
+        uint64_t    bypassed;       // bulk file reads that skipped the cache
+    } CacheStats;
+    virtual DIError GetCacheStats(CacheStats* pStats) const
+        { return kDIErrNotSupported; }
+
 
     /*
      * Get the next volume in the list.  Start by passing in NULL to get the
@@ -1335,9 +1641,13 @@ public:
         kParmUnknown = 0,
 
         kParm_CreateUnique = 1,             // make new filenames unique
+        kParm_SubVolumeThreads = 2,         // partitions opened at once; 0=auto
 
         kParmProDOS_AllowLowerCase = 10,    // allow lower case and spaces
         kParmProDOS_AllocSparse = 11,       // don't store empty blocks
+        kParmProDOS_ListCacheKB = 12,       // scanned block lists; 0=none
+
+        kParmHFS_CacheSize = 20,            // libhfs cache blocks; 0=default
 
         kParmMax        // must be last entry
     } DiskFSParameter;
@@ -1365,6 +1675,30 @@ public:
      */
     DIError Flush(DiskImg::FlushMode mode);
 
+    /*
+     * Bring the file list, volume usage map, and free space count up to
+     * date with blocks written to the disk image since the volume was
+     * scanned or last refreshed.  Changes made through this DiskFS are
+     * already reflected, so this matters when something else writes to
+     * the same DiskImg (another DiskFS, a sector editor).  Filesystems
+     * that support it only re-read the directories whose blocks were
+     * written; see DiskImg::GetNextWrittenBlock.
+     *
+     * A2File pointers remain valid unless the file was removed, or its
+     * directory entry now describes a different file.  The order and
+     * indices of entries in the file list may change.
+     *
+     * Returns kDIErrNotSupported if the filesystem can't follow the
+     * changes.  Only ProDOS can follow writes; the others fail after any
+     * write at all.  Sub-volumes are refreshed first.
+     *
+     * On failure the DiskFS is left as it was (ProDOS doesn't apply any
+     * of the changes unless it can apply them all), but it no longer
+     * matches the image.  The caller must discard it and scan the image
+     * again, with a new DiskFS from OpenAppropriateDiskFS.
+     */
+    DIError Refresh(void);
+
     /*
      * Set the read-only flag on our DiskImg and those of our subvolumes.
      * Used to ensure that a DiskFS with un-flushed data can be deleted
@@ -1378,9 +1712,25 @@ public:
 protected:
     /*
      * Set the DiskImg pointer.  Updates the reference count in DiskImg.
+     * Writes to the image from here on are what Refresh catches up with.
      */
     void SetDiskImg(DiskImg* pImg);
 
+    // blocks written to the image since the scan or the last Refresh, for
+    //  DoRefresh; see DiskImg::GetNextWrittenBlock
+    bool GetAnyWritten(void) const {
+        return fpImg->GetAnyWritten(fRefreshGen);
+    }
+    bool GetUntrackedWrites(void) const {
+        return fpImg->GetUntrackedWrites(fRefreshGen);
+    }
+    bool GetBlockWritten(long block) const {
+        return fpImg->GetBlockWritten(block, fRefreshGen);
+    }
+    long GetNextWrittenBlock(long block) const {
+        return fpImg->GetNextWrittenBlock(block, fRefreshGen);
+    }
+
     // once added, we own the pDiskImg and the pDiskFS (DO NOT pass the
     //  same DiskImg or DiskFS in more than once!).  Note this copies the
     //  fParmTable and other stuff (fScanForSubVolumes) from parent to child.
@@ -1391,10 +1741,33 @@ protected:
     void InsertFileInList(A2File* pFile, A2File* pPrev);
     // delete an entry
     void DeleteFileFromList(A2File* pFile);
+    // put the list in the order given; files not in the array are dropped
+    //  from the list but not deleted
+    void RelinkFileList(A2File** ppFiles, long count);
 
     // scan for damaged or suspicious files
     void ScanForDamagedFiles(bool* pDamaged, bool* pSuspicious);
 
+    /*
+     * Sub-classes that support kInitCatalogOnly set fInitDeferred at the
+     * end of Initialize, and do the rest of the work here.
+     */
+    virtual DIError DoDeferredInit(void) { return kDIErrNone; }
+    void SetInitDeferred(bool val) { fInitDeferred = val; }
+
+    /*
+     * Update our state after blocks were written by somebody else.  The
+     * default implementation can't, so it just reports whether anything
+     * was written.
+     */
+    virtual DIError DoRefresh(void);
+
+    // for const accessors that depend on the deferred work
+    void CheckDeferredInit(void) const {
+        if (fInitDeferred)
+            (void) const_cast<DiskFS*>(this)->CompleteDeferredInit();
+    }
+
     // pointer to the DiskImg structure underlying this filesystem
     DiskImg*    fpImg;
 
@@ -1403,15 +1776,29 @@ protected:
 
 
 private:
+    friend class A2File;            // for ArenaAlloc
+    struct FileArena;
+
+    enum { kArenaAlign = 16 };      // enough for any A2File sub-class
+
     A2File* SkipSubdir(A2File* pSubdir);
     void CopyInheritables(DiskFS* pNewFS);
     void DeleteFileList(void);
     void DeleteSubVolumeList(void);
 
+    // allocate storage for an A2File or path name; freed by DeleteFileList
+    void* ArenaAlloc(size_t size, size_t align);
+    // return storage to the arena for reuse
+    void ArenaFree(void* ptr, size_t size);
+    FileArena* GetFileArena(void);
+
     long fParmTable[kParmMax];          // for DiskFSParameter
+    bool fInitDeferred;                 // DoDeferredInit still pending
+    uint32_t fRefreshGen;               // DiskImg write generation we've seen
 
     A2File*     fpA2Head;
     A2File*     fpA2Tail;
+    FileArena*  fpFileArena;            // storage and index for file list
     SubVolume*  fpSubVolumeHead;
     SubVolume*  fpSubVolumeTail;
 
@@ -1456,6 +1843,16 @@ public:
     }
     virtual ~A2File(void) {}
 
+    /*
+     * A2File objects live in their DiskFS's file arena, and the storage is
+     * released all at once when the DiskFS discards its file list.  Create
+     * them with "new (pDiskFS) A2FileXXX(pDiskFS)".  Deleting one puts the
+     * storage on the arena's free list, for the next file that's created.
+     */
+    static void* operator new(size_t size, DiskFS* pDiskFS);
+    static void operator delete(void* ptr, DiskFS* pDiskFS);
+    static void operator delete(void* ptr, size_t size);
+
     /*
      * All Apple II files have certain characteristics, of which ProDOS
      * is roughly a superset.  (Yes, you can have HFS on a IIgs, but
@@ -1508,6 +1905,12 @@ public:
     virtual DIError Open(A2FileDescr** ppOpenFile, bool readOnly,
         bool rsrcFork = false) = 0;
 
+    /*
+     * Copy one fork to a host file descriptor: open it, call
+     * A2FileDescr::ExtractTo, and close it.
+     */
+    DIError ExtractTo(int fd, bool rsrcFork = false, di_off_t* pActual = NULL);
+
     /*
      * This is called by the A2FileDescr object when somebody invokes Close().
      * The A2File object should remove the A2FileDescr from its list of open
@@ -1541,7 +1944,12 @@ public:
         kQualitySuspicious,
         kQualityDamaged,
     } FileQuality;
-    virtual FileQuality GetQuality(void) const { return fFileQuality; }
+    virtual FileQuality GetQuality(void) const {
+        LoadDeferredInfo();
+        return fFileQuality;
+    }
+    // quality as determined so far; doesn't force deferred work
+    FileQuality GetKnownQuality(void) const { return fFileQuality; }
     virtual void SetQuality(FileQuality quality);
     virtual void ResetQuality(void);
 
@@ -1551,6 +1959,22 @@ protected:
     DiskFS*     fpDiskFS;
     virtual void SetParent(A2File* pParent) { /* do nothing */ }
 
+    // get storage for a path name from the DiskFS arena, reusing "oldName"
+    //  if it's big enough; "oldName" goes back to the arena if it isn't
+    char* AllocPathName(char* oldName, size_t len) const;
+    // give storage from AllocPathName back to the arena (NULL is okay)
+    void FreePathName(char* name) const;
+
+    /*
+     * Called by accessors whose values aren't known until the deferred
+     * part of a kInitCatalogOnly scan is done.  Sub-classes can override
+     * this to fill in just this file.
+     */
+    virtual void LoadDeferredInfo(void) const {
+        if (fpDiskFS->GetInitDeferred())
+            (void) fpDiskFS->CompleteDeferredInit();
+    }
+
 private:
     A2File* GetPrev(void) const { return fpPrev; }
     void SetPrev(A2File* pFile) { fpPrev = pFile; }
@@ -1604,6 +2028,32 @@ public:
 
     virtual DIError Rewind(void) { return Seek(0, kSeekSet); }
 
+    /*
+     * Files are created empty and then filled with one or more sequential
+     * Write calls; Close finishes the job.  If the final length is known,
+     * pass it here before the first Write so the filesystem can lay the
+     * file out contiguously.  It's only a hint: writing more or less than
+     * this is fine.
+     */
+    virtual void SetSizeHint(di_off_t /*size*/) {}
+
+    /*
+     * Returns true if GetStorage(blockIdx) describes the open fork's data
+     * exactly: entry N holds bytes N*512 through N*512+511, a zero entry
+     * is a sparse block, and anything past GetBlockCount (up to the EOF)
+     * is sparse too.
+     */
+    virtual bool HasBlockMap(void) const { return false; }
+
+    /*
+     * Copy the whole fork to a host file descriptor, at the descriptor's
+     * current position.  If the fork has a block map and the image keeps
+     * its blocks as-is in a host file, runs of contiguous blocks are
+     * copied by the kernel without passing through our buffers.  Anything
+     * else is read in large chunks.  The file position ends up at EOF.
+     */
+    DIError ExtractTo(int fd, di_off_t* pActual = NULL);
+
     A2File* GetFile(void) const { return fpFile; }
 
     /*
@@ -1681,6 +2131,335 @@ private:
     void*               fProgressUpdateState;
 };
 
+
+/*
+ * Content hashing, used to find duplicated blocks, files, and whole disk
+ * images across large collections.
+ *
+ * The hash is a fast non-cryptographic 64-bit hash (patterned after XXH64).
+ * Collisions are unlikely but possible, so anything that needs certainty
+ * should compare the data itself.  Values are computed on little-endian
+ * representations, so they're stable across hosts.
+ *
+ * This class is just a namespace clumper.  Do not instantiate.
+ */
+class DISKIMG_API ContentHash {
+public:
+    // hash value stored for chunks that couldn't be read
+    static const uint64_t kUnreadableChunk = 0;
+
+    // Hash a buffer.  Pass the previous result in as "seed" to chain
+    // multiple buffers together.
+    static uint64_t Hash64(const void* buf, size_t len, uint64_t seed = 0);
+
+    // Return the number of chunks HashChunks will produce, and the size
+    // of each chunk (kBlockSize or kSectorSize).  Returns 0 if the image
+    // has neither blocks nor sectors (e.g. unreadable nibble image).
+    static long GetChunkCount(const DiskImg* pImg, int* pChunkSize);
+
+    // Hash every block or sector of the image, in filesystem order, into
+    // "hashBuf", which must hold GetChunkCount() entries.  Chunks that
+    // can't be read get kUnreadableChunk; the count of those is returned
+    // in "*pUnreadable" if it's non-NULL.
+    static DIError HashChunks(DiskImg* pImg, uint64_t* hashBuf, long count,
+        long* pUnreadable);
+
+    // Hash value of a chunk filled with zeroes.
+    static uint64_t GetZeroChunkHash(int chunkSize);
+
+    // Combine the output of HashChunks into a value for the whole image.
+    static uint64_t HashImage(const uint64_t* hashBuf, long count);
+
+    // Hash the contents of one fork of a file.  The length of the fork is
+    // returned in "*pLength".
+    static DIError HashFile(A2File* pFile, bool rsrcFork, uint64_t* pHash,
+        di_off_t* pLength);
+
+private:
+    // no instantiation allowed
+    ContentHash(void) {}
+    ~ContentHash(void) {}
+};
+
+/*
+ * Reader for the simple Apple II file archive formats: Binary II (.bny,
+ * .bqy, .bxy), AppleLink Compression Utility (.acu), and AppleSingle.
+ *
+ * The archive is read in a single forward pass, with large buffered
+ * reads, so it works on pipes as well as files.  Iterate() calls back
+ * once per file, in archive order.  From inside that callback, ReadFork()
+ * streams the contents of a fork to a data callback.  Data that isn't
+ * compressed is handed to the data callback straight out of the read
+ * buffer, without being copied.  Anything the callback doesn't read is
+ * skipped.
+ *
+ * BuildIndex() makes one pass and keeps a copy of every entry, after
+ * which ReadIndexedFork() can read them in any order.  That requires a
+ * seekable file.
+ *
+ * Binary II and ACU archives only have data forks.  An AppleSingle file
+ * holds exactly one file, which may have both forks.  If an AppleSingle
+ * file puts metadata after the forks, reading the forks from a pipe can
+ * fail with kDIErrNotSupported, because we'd have to go backward.
+ */
+class DISKIMG_API FileArchive {
+public:
+    FileArchive(void);
+    ~FileArchive(void);
+
+    typedef enum Format {
+        kFormatUnknown = 0,
+        kFormatBinaryII,
+        kFormatACU,
+        kFormatAppleSingle,
+    } Format;
+
+    typedef enum Compression {
+        kCompressionNone = 0,
+        kCompressionSqueeze,
+        kCompressionUnknown,
+    } Compression;
+
+    /*
+     * One file in the archive.  Offsets are from the start of the archive.
+     */
+    typedef struct Entry {
+        const char* pathName;       // Mac OS Roman
+        char        fssep;          // '/', or ':' for AppleSingle
+        uint32_t    fileType;       // may be an HFS type for AppleSingle
+        uint32_t    auxType;
+        uint16_t    access;
+        uint8_t     storageType;
+        time_t      createWhen;
+        time_t      modWhen;
+        bool        isDirectory;
+        Compression compression;    // applies to the data fork
+
+        di_off_t    dataOffset;     // -1 if there's no data fork
+        di_off_t    dataStoredLen;  // length of data fork in the archive
+        di_off_t    dataLen;        // expanded length; -1 if not known
+        di_off_t    rsrcOffset;     // -1 if there's no resource fork
+        di_off_t    rsrcLen;
+    } Entry;
+
+    // Called once per entry.  Return kDIErrNone to keep going; anything
+    // else stops the iteration, and is returned by Iterate().
+    typedef DIError (*EntryCallback)(FileArchive* pArchive,
+        const Entry* pEntry, void* cookie);
+
+    // Receives fork contents a piece at a time.  "buf" is only valid
+    // during the call.  Anything but kDIErrNone stops the read.
+    typedef DIError (*DataCallback)(const uint8_t* buf, size_t len,
+        void* cookie);
+
+    // Open an archive file, and figure out what kind it is.
+    DIError Open(const char* pathName);
+    // Same, but read from an open stream, e.g. stdin.  The stream doesn't
+    // need to be seekable, and isn't closed by Close().  "name" is used
+    // for AppleSingle files that don't store a file name, and may be NULL.
+    DIError OpenStream(FILE* fp, const char* name);
+    void Close(void);
+
+    Format GetFormat(void) const { return fFormat; }
+    static const char* GetFormatName(Format format);
+
+    // Walk through the archive.  Seekable archives can be walked more
+    // than once.
+    DIError Iterate(EntryCallback func, void* cookie);
+    // Read one fork of the current entry.  Only valid inside the
+    // Iterate() callback.
+    DIError ReadFork(bool rsrcFork, DataCallback func, void* cookie);
+
+    // Collect all of the entries, for random access.
+    DIError BuildIndex(void);
+    long GetEntryCount(void) const { return fIndexCount; }
+    const Entry* GetEntry(long idx) const;
+    DIError ReadIndexedFork(long idx, bool rsrcFork, DataCallback func,
+        void* cookie);
+
+private:
+    FileArchive& operator=(const FileArchive&);
+    FileArchive(const FileArchive&);
+
+    enum {
+        kReadBufSize = 256 * 1024,  // how much we ask fread() for
+        kOutBufSize = 32 * 1024,    // expanded data goes out in this size
+        kMaxPathLen = 1024,         // longest name we'll accept
+    };
+
+    DIError OpenCommon(void);
+
+    /* buffered input */
+    di_off_t GetPosn(void) const { return fBufStart + fBufPos; }
+    size_t Available(void) const { return fBufLen - fBufPos; }
+    DIError FillBuffer(size_t want);
+    DIError SeekTo(di_off_t posn);
+    DIError CopyStored(di_off_t len, DataCallback func, void* cookie);
+    DIError ReadForkData(const Entry* pEntry, bool rsrcFork,
+        DataCallback func, void* cookie);
+
+    /* per-format parsers */
+    DIError IterateBinaryII(EntryCallback func, void* cookie);
+    DIError IterateACU(EntryCallback func, void* cookie);
+    DIError IterateAppleSingle(EntryCallback func, void* cookie);
+    DIError CallEntryCallback(EntryCallback func, void* cookie);
+
+    /* SQueeze expansion */
+    DIError UnSqueeze(di_off_t storedLen, bool fullSqHeader,
+        DataCallback func, void* cookie);
+    inline DIError SqGetByte(di_off_t endPosn, uint8_t* pVal);
+
+    static DIError IndexCallback(FileArchive* pArchive, const Entry* pEntry,
+        void* cookie);
+    void FreeIndex(void);
+
+    FILE*       fFp;
+    bool        fOwnFp;             // close fFp when we're done?
+    bool        fSeekable;
+    char*       fName;              // archive name, for AppleSingle
+    Format      fFormat;
+    di_off_t    fStartPosn;         // where the archive starts in fFp
+
+    uint8_t*    fBuf;               // read buffer
+    di_off_t    fBufStart;          // archive offset of fBuf[0]
+    size_t      fBufPos;            // next unread byte
+    size_t      fBufLen;            // bytes valid in fBuf
+    uint8_t*    fOutBuf;            // for expanded data
+
+    Entry       fCurEntry;          // entry being handed to the callback
+    bool        fInCallback;
+    char        fPathBuf[kMaxPathLen + 1];
+
+    Entry*      fIndex;
+    long        fIndexCount;
+    long        fIndexAlloc;
+};
+
+/*
+ * Extract every file on a volume into a directory tree on the host.
+ *
+ * The file list is planned up front: host directories are created, and
+ * the forks are sorted by the first block they occupy, so the volume is
+ * read from front to back instead of in catalog order.  The calling
+ * thread does all of the reading, because DiskImg isn't thread-safe.
+ * Whole forks are handed to a pool of worker threads, which do the text
+ * conversion and create, write, and label the host files.  The amount
+ * of file data waiting for the workers is limited; forks too big to fit,
+ * which don't need conversion, are copied by the reading thread with
+ * A2FileDescr::ExtractTo.
+ *
+ * Names are made safe for the host with NuLib2-style "%xx" escapes.  The
+ * file type can be kept as a "#xxyyyy" suffix on the name (with 'r'
+ * added for resource forks), or in the "user.com.apple.FinderInfo"
+ * extended attribute, with the resource fork in
+ * "user.com.apple.ResourceFork".  Otherwise, resource forks are written
+ * with "_rsrc_" on the end of the name.  Modification dates are set on
+ * files and directories.
+ *
+ * Sub-volumes are extracted into directories named after them.
+ */
+class DISKIMG_API VolumeExtractor {
+public:
+    VolumeExtractor(void);
+    ~VolumeExtractor(void);
+
+    typedef enum ConvertEOL {
+        kConvertEOLOff = 0,     // write the data as-is
+        kConvertEOLOn,          // change CR, LF, and CRLF to the host's EOL
+        kConvertEOLAuto,        // convert TXT, SRC, and TEXT files
+    } ConvertEOL;
+    typedef enum ConvertHighASCII {
+        kConvertHAOff = 0,
+        kConvertHAOn,           // strip the high bit when converting EOL
+        kConvertHAAuto,         // ...if every character has it set
+    } ConvertHighASCII;
+    typedef enum Preserve {
+        kPreserveNone = 0,
+        kPreserveSuffix,        // "#xxyyyy" on the end of the name
+        kPreserveXattr,         // extended attributes; suffix if we can't
+    } Preserve;
+
+    // Called once for each fork or directory that couldn't be extracted.
+    // Calls may come from any of our threads, but never at the same time.
+    typedef void (*ErrorCallback)(const A2File* pFile, bool rsrcFork,
+        const char* hostPath, DIError dierr, void* cookie);
+
+    // 0 picks a number based on the CPU count; 1 does everything on the
+    // calling thread.
+    void SetNumThreads(int numThreads) { fNumThreads = numThreads; }
+    void SetConvertEOL(ConvertEOL conv) { fConvertEOL = conv; }
+    void SetConvertHighASCII(ConvertHighASCII conv) { fConvertHA = conv; }
+    void SetPreserve(Preserve preserve) { fPreserve = preserve; }
+    // Read files in the order they appear on the disk (the default), or
+    // in the order the DiskFS lists them.
+    void SetDiskOrder(bool diskOrder) { fDiskOrder = diskOrder; }
+    void SetSubVolumes(bool subVolumes) { fSubVolumes = subVolumes; }
+    // Most file data we'll hold in memory for the workers.
+    void SetQueueLimit(size_t limit) { fQueueLimit = limit; }
+    void SetErrorCallback(ErrorCallback func, void* cookie) {
+        fErrorFunc = func;
+        fErrorCookie = cookie;
+    }
+
+    // Extract everything in "pDiskFS" into "hostDir", which is created if
+    // it doesn't exist.  Existing files are overwritten.  Failures on
+    // individual files are passed to the error callback and counted;
+    // they don't stop the extraction, and don't change the return value.
+    DIError Extract(DiskFS* pDiskFS, const char* hostDir);
+
+    // Results of the last Extract.
+    long GetNumForks(void) const { return fNumForks; }
+    long GetNumDirs(void) const { return fNumDirs; }
+    long GetNumFailed(void) const { return fNumFailed; }
+    di_off_t GetNumBytes(void) const { return fNumBytes; }
+
+private:
+    VolumeExtractor& operator=(const VolumeExtractor&);
+    VolumeExtractor(const VolumeExtractor&);
+
+    enum {
+        kMaxThreads = 16,
+        kDefaultQueueLimit = 64 * 1024 * 1024,
+    };
+
+    struct Job;
+    struct JobList;
+    struct DirList;
+    struct WorkQueue;
+
+    DIError ExtractVolume(DiskFS* pDiskFS, const char* hostDir);
+    void PlanVolume(DiskFS* pDiskFS, const char* hostDir, JobList* pJobs);
+    static bool CompareJobs(const Job* pJob1, const Job* pJob2);
+    void ReadJob(Job* pJob);
+    void WriteJob(Job* pJob);
+    DIError StreamJob(Job* pJob, A2FileDescr* pOpenFile);
+    DIError WriteHostFile(const Job* pJob, const uint8_t* buf, size_t len);
+    DIError SetFinderInfo(const Job* pJob);
+    bool WantEOLConversion(const A2File* pFile, bool rsrcFork) const;
+    void FinishJob(const Job* pJob, DIError dierr);
+    void ReportFailure(const A2File* pFile, bool rsrcFork,
+        const char* hostPath, DIError dierr);
+    static void Worker(VolumeExtractor* pExtractor);
+
+    int                 fNumThreads;
+    ConvertEOL          fConvertEOL;
+    ConvertHighASCII    fConvertHA;
+    Preserve            fPreserve;
+    bool                fDiskOrder;
+    bool                fSubVolumes;
+    size_t              fQueueLimit;
+    ErrorCallback       fErrorFunc;
+    void*               fErrorCookie;
+
+    WorkQueue*          fpQueue;        // NULL when there are no workers
+    DirList*            fpDirs;         // dates to set when we're done
+
+    long                fNumForks;
+    long                fNumDirs;
+    long                fNumFailed;
+    di_off_t            fNumBytes;
+};
+
 }   // namespace DiskImgLib
 
 #endif /*DISKIMG_DISKIMG_H*/
@@ -630,7 +630,8 @@ private:
 
 class WrapperFDI : public ImageWrapper {
 public:
-    WrapperFDI(void) : fHeaderBuf(), fImageTracks(0), fStorageName(NULL) {}
+    WrapperFDI(void) : fHeaderBuf(), fImageTracks(0), fStorageName(NULL),
+        fRandState(0) {}
     virtual ~WrapperFDI(void) {}
 
     static DIError Test(GenericFD* pGFD, di_off_t wrappedLength);
@@ -788,6 +789,7 @@ private:
 
     int     fImageTracks;
     char*   fStorageName;
+    int     fRandState;     // MyRand() state
 
 
     /*
@@ -921,11 +923,38 @@ public:
     virtual ~DiskFSContainer(void) {}
 
 protected:
+    /*
+     * One partition for OpenPartitions().  The container fills in the
+     * location and "pCookie"; OpenPartition() fills in the rest.
+     */
+    typedef struct PartitionJob {
+        long        startBlock;
+        long        numBlocks;
+        const void* pCookie;        // container-specific, e.g. map entry
+        DiskImg*    pNewImg;
+        DiskFS*     pNewFS;
+        DIError     dierr;
+    } PartitionJob;
+
     virtual const char* GetDebugName(void) = 0;
     virtual DIError CreatePlaceholder(long startBlock, long numBlocks,
         const char* partName, const char* partType,
         DiskImg** ppNewImg, DiskFS** ppNewFS);
     virtual void SetVolumeUsageMap(void);
+
+    // Open and scan a set of partitions, several at a time.  They are NOT
+    //  added to the sub-volume list; the caller does that, in order.
+    DIError OpenPartitions(PartitionJob* pJobs, int numJobs);
+    // Open and scan one partition.  Called by OpenPartitions, possibly on
+    //  a worker thread, so it must not change anything in "this".
+    virtual DIError OpenPartition(PartitionJob* pJob) {
+        return kDIErrNotSupported;
+    }
+
+private:
+    enum { kMaxPartitionThreads = 8 };
+    static void PartitionWorker(DiskFSContainer* pContainer,
+        PartitionJob* pJobs, int numJobs, int* pNextJob, ScanRelay* pRelay);
 };
 
 /*
@@ -945,6 +974,8 @@ public:
 
     virtual DIError Initialize(DiskImg* pImg, InitMode initMode) override {
         SetDiskImg(pImg);
+        DiskImgStats::PhaseTimer timer(pImg->GetStats(),
+            DiskImgStats::kPhaseDiskFSInit);
         return Initialize();
     }
 
@@ -982,6 +1013,8 @@ public:
 
     virtual DIError Initialize(DiskImg* pImg, InitMode initMode) override {
         SetDiskImg(pImg);
+        DiskImgStats::PhaseTimer timer(pImg->GetStats(),
+            DiskImgStats::kPhaseDiskFSInit);
         return Initialize();
     }
 
@@ -1016,6 +1049,8 @@ public:
 
     virtual DIError Initialize(DiskImg* pImg, InitMode initMode) override {
         SetDiskImg(pImg);
+        DiskImgStats::PhaseTimer timer(pImg->GetStats(),
+            DiskImgStats::kPhaseDiskFSInit);
         return Initialize();
     }
 
@@ -1035,15 +1070,18 @@ private:
         DiskImg::FSFormat* pFormatFound);
     static DIError OpenSubVolume(DiskImg* pImg, long startBlock,
         long numBlocks, bool scanOnly, DiskImg** ppNewImg, DiskFS** ppNewFS);
+    virtual DIError OpenPartition(PartitionJob* pJob) override;
     DIError Initialize(void);
     DIError FindSubVolumes(void);
-    DIError AddVolumeSeries(int start, int count, long blocksPerVolume,
-        long& startBlock, long& totalBlocksLeft);
+    void AddVolumeSeries(int count, long blocksPerVolume,
+        long& startBlock, long& totalBlocksLeft, PartitionJob* pJobs,
+        int& numJobs);
 
     enum {
         kMinInterestingBlocks = 65536 + 1024,       // less than this, ignore
         kEarlyVolExpectedSize = 65536,              // 32MB in 512-byte blocks
         kOneGB = 1024*1024*(1024/512),              // 1GB in 512-byte blocks
+        kMaxVolumes = 8,                            // 4+2 or 8
     };
 };
 
@@ -1064,6 +1102,8 @@ public:
 
     virtual DIError Initialize(DiskImg* pImg, InitMode initMode) override {
         SetDiskImg(pImg);
+        DiskImgStats::PhaseTimer timer(pImg->GetStats(),
+            DiskImgStats::kPhaseDiskFSInit);
         return Initialize();
     }
 
@@ -1089,7 +1129,7 @@ private:
     static void DumpPartitionMap(long block, const PartitionMap* pMap);
 
     static DIError TestImage(DiskImg* pImg, DiskImg::SectorOrder imageOrder);
-    DIError OpenSubVolume(const PartitionMap* pMap);
+    virtual DIError OpenPartition(PartitionJob* pJob) override;
     DIError Initialize(void);
     DIError FindSubVolumes(void);
 
@@ -1117,6 +1157,8 @@ public:
 
     virtual DIError Initialize(DiskImg* pImg, InitMode initMode) override {
         SetDiskImg(pImg);
+        DiskImgStats::PhaseTimer timer(pImg->GetStats(),
+            DiskImgStats::kPhaseDiskFSInit);
         return Initialize();
     }
 
@@ -1138,8 +1180,8 @@ private:
     static void DumpPartitionMap(const PartitionMap* pMap);
 
     static DIError TestImage(DiskImg* pImg, DiskImg::SectorOrder imageOrder);
-    DIError OpenSubVolume(long startBlock, long numBlocks);
-    DIError OpenVol(int idx, long startBlock, long numBlocks);
+    virtual DIError OpenPartition(PartitionJob* pJob) override;
+    DIError AddVol(int idx, PartitionJob* pJob);
     DIError Initialize(void);
     DIError FindSubVolumes(void);
 
@@ -1166,6 +1208,8 @@ public:
 
     virtual DIError Initialize(DiskImg* pImg, InitMode initMode) override {
         SetDiskImg(pImg);
+        DiskImgStats::PhaseTimer timer(pImg->GetStats(),
+            DiskImgStats::kPhaseDiskFSInit);
         return Initialize();
     }
 
@@ -1187,10 +1231,8 @@ private:
     static void DumpPartitionMap(const PartitionMap* pMap);
 
     static DIError TestImage(DiskImg* pImg, DiskImg::SectorOrder imageOrder);
-    DIError OpenSubVolume(long startBlock, long numBlocks,
-        const char* name);
-    DIError OpenVol(int idx, long startBlock, long numBlocks,
-        const char* name);
+    virtual DIError OpenPartition(PartitionJob* pJob) override;
+    DIError AddVol(int idx, PartitionJob* pJob);
     DIError Initialize(void);
     DIError FindSubVolumes(void);
 
@@ -1235,6 +1277,8 @@ public:
 
     virtual DIError Initialize(DiskImg* pImg, InitMode initMode) override {
         SetDiskImg(pImg);
+        DiskImgStats::PhaseTimer timer(pImg->GetStats(),
+            DiskImgStats::kPhaseDiskFSInit);
         return Initialize(initMode);
     }
     virtual DIError Format(DiskImg* pDiskImg, const char* volName) override;
@@ -1247,7 +1291,10 @@ public:
         return fDiskVolumeName+3;
     }
     virtual bool GetReadWriteSupported(void) const override { return true; }
-    virtual bool GetFSDamaged(void) const override { return !fDiskIsGood; }
+    virtual bool GetFSDamaged(void) const override {
+        CheckDeferredInit();
+        return !fDiskIsGood;
+    }
     virtual DIError GetFreeSpaceCount(long* pTotalUnits, long* pFreeUnits,
         int* pUnitSize) const override;
     virtual DIError NormalizePath(const char* path, char fssep,
@@ -1285,6 +1332,10 @@ public:
     } TrackSector;
 
     friend class A2FDDOS;   // for Write
+    friend class A2FileDOS; // for GetFileLength
+
+protected:
+    virtual DIError DoDeferredInit(void) override;
 
 private:
     DIError Initialize(InitMode initMode);
@@ -1298,6 +1349,7 @@ private:
     DIError ProcessCatalogSector(int catTrack, int catSect,
         const uint8_t* sctBuf);
     DIError GetFileLengths(void);
+    void GetFileLength(A2FileDOS* pFile, bool markUsage);
     DIError ComputeLength(A2FileDOS* pFile, const TrackSector* tsList,
         int tsCount);
     DIError TrimLastSectorUp(A2FileDOS* pFile, TrackSector lastTS);
@@ -1380,13 +1432,11 @@ public:
         fOffset(0),
         fOpenEOF(0),
         fOpenSectorsUsed(0),
-        fModified(false)
+        fModified(false),
+        fSizeHint(-1),
+        fpWriteState(NULL)
     {}
-    virtual ~A2FDDOS(void) {
-        delete[] fTSList;
-        delete[] fIndexList;
-        //fTSList = fIndexList = NULL;
-    }
+    virtual ~A2FDDOS(void);
 
     //typedef DiskFSDOS33::TrackSector TrackSector;
 
@@ -1397,6 +1447,7 @@ public:
     virtual DIError Seek(di_off_t offset, DIWhence whence) override;
     virtual di_off_t Tell(void) override;
     virtual DIError Close(void) override;
+    virtual void SetSizeHint(di_off_t size) override { fSizeHint = size; }
 
     virtual long GetSectorCount(void) const override;
     virtual long GetBlockCount(void) const override;
@@ -1406,6 +1457,12 @@ public:
 
 private:
     typedef DiskFSDOS33::TrackSector TrackSector;
+    struct WriteState;
+
+    DIError StartWrite(void);
+    DIError WriteSector(const uint8_t* sctBuf);
+    DIError FinishWrite(void);
+    void AbandonWrite(void);
 
     TrackSector*    fTSList;            // T/S entries for data sectors
     int             fTSCount;
@@ -1417,6 +1474,9 @@ private:
     long            fOpenSectorsUsed;   // how many sectors it occupies
     bool            fModified;          // if modified, update stuff on Close
 
+    di_off_t        fSizeHint;          // expected length, or -1
+    WriteState*     fpWriteState;       // non-NULL while Write calls arrive
+
     void DumpTSList(void) const;
 };
 
@@ -1463,12 +1523,21 @@ public:
     virtual const char* GetRawFileName(size_t* size = NULL) const override;
     virtual char GetFssep(void) const override { return '\0'; }
     virtual uint32_t GetFileType(void) const override;
-    virtual uint32_t GetAuxType(void) const override { return fAuxType; }
+    virtual uint32_t GetAuxType(void) const override {
+        LoadDeferredInfo();
+        return fAuxType;
+    }
     virtual uint32_t GetAccess(void) const override;
     virtual time_t GetCreateWhen(void) const override { return 0; }
     virtual time_t GetModWhen(void) const override { return 0; }
-    virtual di_off_t GetDataLength(void) const override { return fLength; }
-    virtual di_off_t GetDataSparseLength(void) const override { return fSparseLength; }
+    virtual di_off_t GetDataLength(void) const override {
+        LoadDeferredInfo();
+        return fLength;
+    }
+    virtual di_off_t GetDataSparseLength(void) const override {
+        LoadDeferredInfo();
+        return fSparseLength;
+    }
     virtual di_off_t GetRsrcLength(void) const override { return -1; }
     virtual di_off_t GetRsrcSparseLength(void) const override { return -1; }
 
@@ -1486,6 +1555,9 @@ public:
     friend class DiskFSDOS33;
     friend class A2FDDOS;
 
+protected:
+    virtual void LoadDeferredInfo(void) const override;
+
 private:
     typedef DiskFSDOS33::TrackSector TrackSector;
 
@@ -1511,6 +1583,7 @@ private:
     uint16_t    fDataOffset;        // 0/2/4, for 'A'/'B'/'I' with embedded len
     di_off_t    fLength;            // file length, in bytes
     di_off_t    fSparseLength;      // file length, factoring sparse out
+    bool        fLengthDeferred;    // above not yet computed (catalogOnly)
 
     void FixFilename(void);
 
@@ -1564,21 +1637,23 @@ public:
         fTotalBlocks(0),
         fVolDirFileCount(0),
         fBlockUseMap(NULL),
+        fBlockUseMapSaved(NULL),
+        fAllocScanStart(0),
+        fFreeBlocks(-1),
+        fpListCache(NULL),
+        fpDirBlocks(NULL),
         fDiskIsGood(false),
         fEarlyDamage(false)
     {}
-    virtual ~DiskFSProDOS(void) {
-        if (fBlockUseMap != NULL) {
-            assert(false);  // unexpected
-            delete[] fBlockUseMap;
-        }
-    }
+    virtual ~DiskFSProDOS(void);
 
     static DIError TestFS(DiskImg* pImg, DiskImg::SectorOrder* pOrder,
         DiskImg::FSFormat* pFormat, FSLeniency leniency);
 
     virtual DIError Initialize(DiskImg* pImg, InitMode initMode) override {
         SetDiskImg(pImg);
+        DiskImgStats::PhaseTimer timer(pImg->GetStats(),
+            DiskImgStats::kPhaseDiskFSInit);
         return Initialize(initMode);
     }
     virtual DIError Format(DiskImg* pDiskImg, const char* volName) override;
@@ -1586,6 +1661,8 @@ public:
         char* normalizedBuf, int* pNormalizedBufLen) override;
     virtual DIError CreateFile(const CreateParms* pParms,
         A2File** ppNewFile) override;
+    virtual DIError CreateFiles(const CreateParms* pParmsList, int count,
+        A2File** ppNewFiles) override;
     virtual DIError DeleteFile(A2File* pFile) override;
     virtual DIError RenameFile(A2File* pFile, const char* newName) override;
     virtual DIError SetFileInfo(A2File* pFile, uint32_t fileType,
@@ -1602,7 +1679,10 @@ public:
     virtual const char* GetVolumeID(void) const override { return fVolumeID; }
     virtual const char* GetBareVolumeName(void) const override { return fVolumeName; }
     virtual bool GetReadWriteSupported(void) const override { return true; }
-    virtual bool GetFSDamaged(void) const override { return !fDiskIsGood; }
+    virtual bool GetFSDamaged(void) const override {
+        CheckDeferredInit();
+        return !fDiskIsGood;
+    }
     virtual long GetFSNumBlocks(void) const override { return fTotalBlocks; }
     virtual DIError GetFreeSpaceCount(long* pTotalUnits, long* pFreeUnits,
         int* pUnitSize) const override;
@@ -1617,9 +1697,21 @@ public:
         char* lowerNameNoTerm, uint16_t lcFlags, bool fromAppleWorks);
 
     friend class A2FDProDOS;
+    friend class A2FileProDOS;
+
+protected:
+    virtual DIError DoDeferredInit(void) override;
+    virtual DIError DoRefresh(void) override;
 
 private:
     struct DirHeader;
+    struct BatchDir;
+    struct CreateBatch;
+    struct BlockListCache;
+    struct DirBlockMap;
+    struct RefreshedEntry;
+    struct RefreshedDir;
+    struct RefreshState;
 
     enum { kMaxExtensionLen = 4 };  // used when normalizing; ".gif" is 4
 
@@ -1629,10 +1721,12 @@ private:
     void SetVolumeID(void);
     void DumpVolHeader(void);
     DIError ScanVolBitmap(void);
+    void MarkVolBitmap(void);
     DIError LoadVolBitmap(void);
     DIError SaveVolBitmap(void);
     void FreeVolBitmap(void);
     long AllocBlock(void);
+    long AllocBlockRun(long count);
     int GetNumBitmapBlocks(void) const {
         /* use fTotalBlocks rather than GetNumBlocks() */
         assert(fTotalBlocks > 0);
@@ -1644,6 +1738,8 @@ private:
     bool GetBlockUseEntry(long block) const;
     void SetBlockUseEntry(long block, bool inUse);
     bool ScanForExtraEntries(void) const;
+    void SyncBlockUsage(bool saved);
+    void NoteBlockPurpose(long block, VolumeUsage::ChunkPurpose purpose);
 
     void SetBlockUsage(long block, VolumeUsage::ChunkPurpose purpose);
     DIError GetDirHeader(const uint8_t* blkBuf, DirHeader* pHeader);
@@ -1652,16 +1748,41 @@ private:
     DIError SlurpEntries(A2File* pParent, const DirHeader* pHeader,
         const uint8_t* blkBuf, bool skipFirst, int* pCount,
         const char* basePath, uint16_t thisBlock, int depth);
+    DIError AddDirEntry(A2File* pParent, const uint8_t* entryBuf,
+        const char* basePath, uint16_t thisBlock, int idx, int depth);
+    A2FileProDOS* NewDirEntryFile(A2File* pParent, const uint8_t* entryBuf,
+        const char* basePath, uint16_t thisBlock, int idx);
     DIError ReadExtendedInfo(A2FileProDOS* pFile);
-    DIError ScanFileUsage(void);
+    DIError ScanFileUsage(bool useCache);
     void ScanBlockList(long blockCount, uint16_t* blockList,
         long indexCount, uint16_t* indexList, long* pSparseCount);
+    bool GetCachedBlockList(int storageType, uint16_t keyBlock, long eof,
+        long* pBlockCount, uint16_t** pBlockList,
+        long* pIndexBlockCount, uint16_t** pIndexBlockList);
+    void CacheBlockList(int storageType, uint16_t keyBlock, long eof,
+        long blockCount, const uint16_t* blockList,
+        long indexCount, const uint16_t* indexList);
+    void ForgetBlockList(uint16_t keyBlock);
     DIError ScanForSubVolumes(void);
     DIError FindSubVolume(long blockStart, long blockCount,
         DiskImg** ppDiskImg, DiskFS** ppDiskFS);
     void MarkSubVolumeBlocks(long block, long count);
 
     A2File* FindFileByKeyBlock(A2File* pStart, uint16_t keyBlock);
+    DirBlockMap* GetDirBlockMap(void);
+    static void UnpackVolumeName(const uint8_t* blkBuf, char* volName);
+    DIError ReadRefreshedDir(RefreshState* pState, A2FileProDOS* pOldDir,
+        uint16_t dirBlock, int depth, RefreshedDir* pDir);
+    bool CheckRefreshedEntry(RefreshState* pState, A2FileProDOS* pFile,
+        RefreshedEntry* pEnt);
+    void ReadNewEntry(RefreshState* pState, int depth, RefreshedEntry* pEnt);
+    DIError CreateRefreshedFiles(RefreshState* pState, A2File* pDir,
+        const RefreshedDir* pRefreshed);
+    void ApplyRefreshedEntry(RefreshState* pState,
+        const RefreshedEntry* pEnt);
+    void RefreshVolHeader(const uint8_t* blkBuf);
+    void RefreshVolumeUsage(void);
+    void OrderRefreshedFiles(RefreshState* pState, A2File* pDir);
     DIError AllocInitialFileStorage(const CreateParms* pParms,
         const char* upperName, uint16_t dirBlock, int dirEntrySlot,
         long* pKeyBlock, int* pBlocksUsed, int* pNewEOF);
@@ -1670,14 +1791,14 @@ private:
         char** pNormalizedPath);
     void UpperCaseName(char* upperName, const char* name);
     bool CheckDiskIsGood(void);
-    DIError AllocDirEntry(A2FileDescr* pOpenSubdir, uint8_t** ppDir,
-        long* pDirLen, uint8_t** ppDirEntry, uint16_t* pDirKeyBlock,
-        int* pDirEntrySlot, uint16_t* pDirBlock);
+    DIError BatchCreate(CreateBatch* pBatch, const CreateParms* pParms,
+        A2FileProDOS** ppNewFile);
+    DIError BatchOpenDir(CreateBatch* pBatch, const char* basePath,
+        BatchDir** ppBatchDir);
+    DIError BatchAllocEntry(BatchDir* pBatchDir, long* pOffset);
+    DIError BatchCommit(CreateBatch* pBatch);
     uint8_t* GetPrevDirEntry(uint8_t* buf, uint8_t* ptr);
-    DIError MakeFileNameUnique(const uint8_t* dirBuf, long dirLen,
-        char* fileName);
-    bool NameExistsInDir(const uint8_t* dirBuf, long dirLen,
-        const char* fileName);
+    DIError MakeFileNameUnique(const BatchDir* pBatchDir, char* fileName);
 
     DIError FreeBlocks(long blockCount, uint16_t* blockList);
     DIError RegeneratePathName(A2FileProDOS* pFile);
@@ -1710,6 +1831,37 @@ private:
      */
     uint8_t*        fBlockUseMap;
 
+    /*
+     * The block use map as it was when loaded or last saved.  Comparing
+     * against it tells us which blocks changed hands, so the volume usage
+     * map and the free block count can be kept current without a rescan.
+     */
+    uint8_t*        fBlockUseMapSaved;
+
+    /*
+     * Offset in fBlockUseMap where AllocBlock starts looking.  Everything
+     * before this is known to be in use, so creating lots of files doesn't
+     * mean scanning the whole map for every block.
+     */
+    int             fAllocScanStart;
+
+    /* number of free blocks in the volume bitmap, or -1 if not known */
+    long            fFreeBlocks;
+
+    /*
+     * Block and index lists for each fork, saved by ScanFileUsage so that
+     * opening a file doesn't have to read its index blocks again.  Entries
+     * are dropped when a fork's storage changes.
+     */
+    BlockListCache* fpListCache;
+
+    /*
+     * The blocks that make up each directory, so Refresh can tell which
+     * directories were written.  Filled in by the scan and kept current
+     * as directories grow or go away.
+     */
+    DirBlockMap*    fpDirBlocks;
+
     /*
      * Set this if the disk is "perfect".  If it's not, we disallow write
      * access for safety reasons.
@@ -1736,12 +1888,11 @@ public:
         fOpenBlocksUsed(0),
         fOpenStorageType(0),
         fOpenRsrcFork(false),
-        fOffset(0)
+        fOffset(0),
+        fSizeHint(-1),
+        fpWriteState(NULL)
     {}
-    virtual ~A2FDProDOS(void) {
-        delete[] fBlockList;
-        fBlockList = NULL;
-    }
+    virtual ~A2FDProDOS(void);
 
     friend class A2FileProDOS;
 
@@ -1751,18 +1902,30 @@ public:
     virtual DIError Seek(di_off_t offset, DIWhence whence) override;
     virtual di_off_t Tell(void) override;
     virtual DIError Close(void) override;
+    virtual void SetSizeHint(di_off_t size) override { fSizeHint = size; }
 
     virtual long GetSectorCount(void) const override;
     virtual long GetBlockCount(void) const override;
     virtual DIError GetStorage(long sectorIdx, long* pTrack,
         long* pSector) const override;
     virtual DIError GetStorage(long blockIdx, long* pBlock) const override;
+    virtual bool HasBlockMap(void) const override {
+        return fpWriteState == NULL;    // not while the list is growing
+    }
 
     void DumpBlockList(void) const;
 
 private:
+    struct WriteState;
+
     bool IsEmptyBlock(const uint8_t* blk);
     DIError WriteDirectory(const void* buf, size_t len, size_t* pActual);
+    DIError StartWrite(void);
+    DIError PutDataBlock(const uint8_t* blk);
+    DIError AddDataBlock(const uint8_t* blk, bool empty);
+    long AllocWriteBlock(void);
+    DIError FinishWrite(void);
+    void AbandonWrite(void);
 
     /* state for open files */
     bool            fModified;
@@ -1773,6 +1936,9 @@ private:
     int             fOpenStorageType;
     bool            fOpenRsrcFork;      // is this the resource fork?
     di_off_t        fOffset;            // current file offset
+
+    di_off_t        fSizeHint;          // expected length, or -1
+    WriteState*     fpWriteState;       // non-NULL while Write calls arrive
 };
 
 /*
@@ -1792,7 +1958,7 @@ public:
     {}
     virtual ~A2FileProDOS(void) {
         delete fpOpenFile;
-        delete[] fPathName;
+        FreePathName(fPathName);
     }
 
     typedef DiskFSProDOS::ProDate ProDate;
@@ -1863,8 +2029,9 @@ public:
     virtual uint32_t GetAccess(void) const override { return fDirEntry.access; }
     virtual time_t GetCreateWhen(void) const override;
     virtual time_t GetModWhen(void) const override;
+    /* the lengths come from the directory, so don't force a full scan */
     virtual di_off_t GetDataLength(void) const override {
-        if (GetQuality() == kQualityDamaged)
+        if (GetKnownQuality() == kQualityDamaged)
             return 0;
         if (fDirEntry.storageType == kStorageExtended)
             return fExtData.eof;
@@ -1873,7 +2040,7 @@ public:
     }
     virtual di_off_t GetRsrcLength(void) const override {
         if (fDirEntry.storageType == kStorageExtended) {
-            if (GetQuality() == kQualityDamaged)
+            if (GetKnownQuality() == kQualityDamaged)
                 return 0;
             else
                 return fExtRsrc.eof;
@@ -1957,6 +2124,8 @@ public:
     DIError LoadDirectoryBlockList(uint16_t keyBlock,
         long eof, long* pBlockCount, uint16_t** pBlockList);
 
+    DIError ValidateBlockList(const uint16_t* list, long count);
+
     /* fork lengths without sparseness */
     di_off_t        fSparseDataEof;
     di_off_t        fSparseRsrcEof;
@@ -1964,9 +2133,8 @@ public:
 private:
     DIError LoadIndexBlock(uint16_t block, uint16_t* list,
         int maxCount);
-    DIError ValidateBlockList(const uint16_t* list, long count);
 
-    char*           fPathName;      // full pathname to file on this volume
+    char*           fPathName;      // full pathname; in DiskFS arena
 
     A2FDProDOS*     fpOpenFile;     // only one fork can be open at a time
     A2File*         fpParent;
@@ -2016,6 +2184,8 @@ public:
 
     virtual DIError Initialize(DiskImg* pImg, InitMode initMode) override {
         SetDiskImg(pImg);
+        DiskImgStats::PhaseTimer timer(pImg->GetStats(),
+            DiskImgStats::kPhaseDiskFSInit);
         return Initialize();
     }
     virtual DIError Format(DiskImg* pDiskImg, const char* volName) override;
@@ -2130,6 +2300,9 @@ public:
     virtual DIError GetStorage(long sectorIdx, long* pTrack,
         long* pSector) const override;
     virtual DIError GetStorage(long blockIdx, long* pBlock) const override;
+    virtual bool HasBlockMap(void) const override {
+        return !fModified;      // files are contiguous once they're written
+    }
 
 private:
     di_off_t        fOffset;            // where we are
@@ -2259,6 +2432,8 @@ public:
 
     virtual DIError Initialize(DiskImg* pImg, InitMode initMode) override {
         SetDiskImg(pImg);
+        DiskImgStats::PhaseTimer timer(pImg->GetStats(),
+            DiskImgStats::kPhaseDiskFSInit);
         return Initialize();
     }
 
@@ -2471,6 +2646,8 @@ public:
 
     virtual DIError Initialize(DiskImg* pImg, InitMode initMode) override {
         SetDiskImg(pImg);
+        DiskImgStats::PhaseTimer timer(pImg->GetStats(),
+            DiskImgStats::kPhaseDiskFSInit);
         return Initialize();
     }
 
@@ -2654,6 +2831,8 @@ public:
 
     virtual DIError Initialize(DiskImg* pImg, InitMode initMode) override {
         SetDiskImg(pImg);
+        DiskImgStats::PhaseTimer timer(pImg->GetStats(),
+            DiskImgStats::kPhaseDiskFSInit);
         return Initialize(initMode);
     }
 
@@ -2687,6 +2866,8 @@ public:
         int* pUnitSize) const override;
 
 #ifndef EXCISE_GPL_CODE
+    virtual DIError GetCacheStats(CacheStats* pStats) const override;
+
     hfsvol* GetHfsVol(void) const { return fHfsVol; }
 #endif
 
@@ -2725,11 +2906,19 @@ private:
     DIError LoadVolHeader(void);
     void SetVolumeID(void);
     void DumpVolHeader(void);
+    void PrefetchMetadata(void);
     void SetVolumeUsageMap(void);
 
 #ifdef EXCISE_GPL_CODE
     void CreateFakeFile(void);
 #else
+    struct SweepEntry;          // fwd
+    struct SweepState;          // fwd
+    DIError SweepCatalog(A2File* pVolumeDir);
+    static int SweepCallback(void* vState, const hfsdirent* dirEntry);
+    static int CompareSweepEntries(const void* vp1, const void* vp2);
+    DIError AddSweptFiles(SweepState* pState, A2File* pParent,
+        uint32_t dirID, const char* basePath, int depth);
     DIError RecursiveDirAdd(A2File* pParent, const char* basePath, int depth);
     //void Sanitize(uint8_t* str);
     DIError DoNormalizePath(const char* path, char fssep,
@@ -2823,6 +3012,8 @@ public:
         fCreateWhen(0),
         fModWhen(0),
         fAccess(0),
+        fCNID(0),
+        fParentCNID(0),
         fpOpenFile(NULL)
     {
 #ifdef EXCISE_GPL_CODE
@@ -2834,7 +3025,7 @@ public:
     }
     virtual ~A2FileHFS(void) {
         delete fpOpenFile;
-        delete[] fPathName;
+        FreePathName(fPathName);
 #ifdef EXCISE_GPL_CODE
         delete[] fFakeFileBuf;
 #else
@@ -2903,12 +3094,14 @@ public:
     uint32_t        fType;
     uint32_t        fCreator;
     char            fFileName[kMaxFileName+1];
-    char*           fPathName;
+    char*           fPathName;      // in DiskFS arena
     di_off_t        fDataLength;
     di_off_t        fRsrcLength;
     time_t          fCreateWhen;
     time_t          fModWhen;
     uint32_t        fAccess;
+    uint32_t        fCNID;          // catalog node ID
+    uint32_t        fParentCNID;    // CNID of the directory we're in
 
 private:
 #ifdef EXCISE_GPL_CODE
@@ -2954,6 +3147,8 @@ public:
 
     virtual DIError Initialize(DiskImg* pImg, InitMode initMode) override {
         SetDiskImg(pImg);
+        DiskImgStats::PhaseTimer timer(pImg->GetStats(),
+            DiskImgStats::kPhaseDiskFSInit);
         return Initialize(initMode);
     }
 
@@ -3178,6 +3373,8 @@ public:
 
     virtual DIError Initialize(DiskImg* pImg, InitMode initMode) override {
         SetDiskImg(pImg);
+        DiskImgStats::PhaseTimer timer(pImg->GetStats(),
+            DiskImgStats::kPhaseDiskFSInit);
         return Initialize();
     }
 
@@ -14,6 +14,8 @@
 #include "DiskImgDetail.h"
 #include <errno.h>
 #include <assert.h>
+#include <mutex>
+#include <condition_variable>
 // "GenericFD.h" included at end
 
 using namespace DiskImgLib;     // make life easy for all internal code
@@ -59,6 +61,18 @@ const char* FilenameOnly(const char* pathname, char fssep);
 const char* FindExtension(const char* pathname, char fssep);
 char* StrcpyNew(const char* str);
 
+/*
+ * Reentrant wrappers for the C library time functions, which return
+ * pointers to static buffers or share time zone state.  "buf" for
+ * FormatCTime must hold at least kCTimeBufLen bytes.
+ */
+struct tm* LocalTime(const time_t* pWhen, struct tm* pTm);
+time_t MakeTime(struct tm* pTm);
+long LocalTimeOffset(void);
+struct tm* GmTime(const time_t* pWhen, struct tm* pTm);
+enum { kCTimeBufLen = 26 };
+const char* FormatCTime(const time_t* pWhen, char* buf);
+
 /* get/set integer values out of a memory buffer */
 uint16_t GetShortLE(const uint8_t* buf);
 uint32_t GetLongLE(const uint8_t* buf);
@@ -80,6 +94,9 @@ DIError WriteLongLE(GenericFD* pGFD, uint32_t val);
 DIError WriteShortBE(GenericFD* pGFD, uint16_t val);
 DIError WriteLongBE(GenericFD* pGFD, uint32_t val);
 
+/* write all of a buffer to a host file */
+DIError WriteHostFd(int fd, const uint8_t* buf, size_t length);
+
 #ifdef _WIN32
 /* Windows helpers */
 DIError LastErrorToDIError(void);
@@ -117,11 +134,46 @@ public:
         return fBuf[idx];
     }
 
-    //uint8_t* GetPointer(int idx) const {
-    //    while (idx >= fLen)
-    //        idx -= fLen;
-    //    return &fBuf[idx];
-    //}
+    /*
+     * Get a pointer to "len" bytes starting at "idx", or NULL if the
+     * span wraps around the end of the buffer.
+     */
+    uint8_t* GetSpan(int idx, int len) const {
+        idx = Normalize(idx);
+        if (idx + len > fLen)
+            return NULL;
+        return &fBuf[idx];
+    }
+
+    /*
+     * Copy "len" bytes out of / into the buffer, starting at "idx".  The
+     * wrap is handled once per pass through the buffer rather than once
+     * per byte.
+     */
+    void CopyOut(int idx, uint8_t* dst, int len) const {
+        idx = Normalize(idx);
+        while (len > 0) {
+            int chunk = fLen - idx;
+            if (chunk > len)
+                chunk = len;
+            memcpy(dst, &fBuf[idx], chunk);
+            dst += chunk;
+            len -= chunk;
+            idx = 0;
+        }
+    }
+    void CopyIn(int idx, const uint8_t* src, int len) const {
+        idx = Normalize(idx);
+        while (len > 0) {
+            int chunk = fLen - idx;
+            if (chunk > len)
+                chunk = len;
+            memcpy(&fBuf[idx], src, chunk);
+            src += chunk;
+            len -= chunk;
+            idx = 0;
+        }
+    }
 
     int Normalize(int idx) const {
         while (idx >= fLen)
@@ -332,12 +384,72 @@ public:
         fBits[bit >> 3] |= 1 << (bit & 0x07);
     }
 
+    int GetNumBits(void) const { return fNumBits; }
+
+    /*
+     * Find the first set bit after bit N.  Pass in -1 to start at the
+     * beginning.  Returns -1 when there aren't any more.
+     */
+    int FindNextSet(int bit) const {
+        for (bit++; bit < fNumBits; bit++) {
+            if ((bit & 0x07) == 0) {
+                /* skip empty bytes */
+                while (bit < fNumBits && fBits[bit >> 3] == 0)
+                    bit += 8;
+                if (bit >= fNumBits)
+                    break;
+            }
+            if (IsSet(bit))
+                return bit;
+        }
+        return -1;
+    }
+
 private:
     uint8_t*    fBits;
     int         fNumBits;
 };
 
 
+/*
+ * Progress updates from sub-volumes that are being opened on worker
+ * threads.  The workers post their latest message here; the thread that
+ * started them waits on "fCond" and hands the message to the real scan
+ * progress callback.  Only the most recent message is kept, which is all
+ * a progress display wants anyway.
+ */
+class ScanRelay {
+public:
+    ScanRelay(void) : fCount(0), fPending(false), fCancelled(false),
+        fNumActive(0)
+    {
+        fMsg[0] = '\0';
+    }
+
+    /*
+     * Post a message.  Returns "false" if the callback has asked us to
+     * stop, just like the callback would.
+     */
+    bool Post(const char* msg, int count) {
+        std::lock_guard<std::mutex> lock(fLock);
+        strncpy(fMsg, msg, sizeof(fMsg));
+        fMsg[sizeof(fMsg)-1] = '\0';
+        fCount = count;
+        fPending = true;
+        fCond.notify_one();
+        return !fCancelled;
+    }
+
+    std::mutex              fLock;
+    std::condition_variable fCond;  // new message, or a worker finished
+    char        fMsg[128];
+    int         fCount;
+    bool        fPending;           // fMsg hasn't been passed on yet
+    bool        fCancelled;         // callback returned false
+    int         fNumActive;         // worker threads still running
+};
+
+
 }   // namespace DiskImgLib
 
 /*
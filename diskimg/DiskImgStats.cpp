@@ -0,0 +1,67 @@
+/*
+ * CiderPress
+ * Copyright (C) 2009 by CiderPress authors.  All Rights Reserved.
+ * See the file LICENSE for distribution terms.
+ */
+/*
+ * Timers and counters for DiskImg open and scan.
+ */
+#include "StdAfx.h"
+#include "DiskImgPriv.h"
+#include <chrono>
+
+/*
+ * Clear all timers and counters.
+ */
+void DiskImgStats::Reset(void)
+{
+    memset(fPhaseMicros, 0, sizeof(fPhaseMicros));
+    memset(fPhaseCount, 0, sizeof(fPhaseCount));
+    memset(fCounter, 0, sizeof(fCounter));
+}
+
+/*
+ * Get the current value of the monotonic clock.  The starting point is
+ * arbitrary, so this is only useful for computing intervals.
+ */
+/*static*/ uint64_t DiskImgStats::GetMonotonicMicros(void)
+{
+    return (uint64_t) std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/*
+ * Get a short name for a phase.
+ */
+/*static*/ const char* DiskImgStats::ToString(Phase phase)
+{
+    switch (phase) {
+    case kPhaseOuterWrapper:        return "outerWrapper";
+    case kPhaseImageWrapper:        return "imageWrapper";
+    case kPhaseNibbleAnalysis:      return "nibbleAnalysis";
+    case kPhaseFSProbe:             return "fsProbe";
+    case kPhaseDiskFSInit:          return "diskFSInit";
+    default:
+        assert(false);
+        return "unknown";
+    }
+}
+
+/*
+ * Get a short name for a counter.
+ */
+/*static*/ const char* DiskImgStats::ToString(Counter counter)
+{
+    switch (counter) {
+    case kCounterBlocksRead:        return "blocksRead";
+    case kCounterSectorsRead:       return "sectorsRead";
+    case kCounterNibbleTracksRead:  return "nibbleTracksRead";
+    case kCounterBytesRead:         return "bytesRead";
+    case kCounterSeeks:             return "seeks";
+    case kCounterFSProbes:          return "fsProbes";
+    case kCounterBlocksPrefetched:  return "blocksPrefetched";
+    default:
+        assert(false);
+        return "unknown";
+    }
+}
@@ -339,7 +339,7 @@ void DiskFSFAT::CreateFakeFile(void)
         (double) capacity / 2048.0);
     buf[sizeof(buf) - 1] = '\0';
 
-    pFile = new A2FileFAT(this);
+    pFile = new (this) A2FileFAT(this);
     pFile->SetFakeFile(buf, strlen(buf));
     strcpy(pFile->fFileName, "(not supported)");
 
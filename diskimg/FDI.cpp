@@ -225,17 +225,35 @@ DIError WrapperFDI::UnpackDisk35(GenericFD* pGFD, GenericFD* pNewGFD, int numCyl
     int numHeads, LinearBitmap* pBadBlockMap)
 {
     DIError dierr = kDIErrNone;
-    uint8_t nibbleBuf[kNibbleBufLen];
+    uint8_t* nibbleBufs = NULL;
+    long* nibbleLens = NULL;
     uint8_t* inputBuf = NULL;
-    uint8_t outputBuf[kMaxSectors35 * kBlockSize];    // 6KB
+    uint8_t* outputBuf = NULL;
     int inputBufLen = -1;
     int badTracks = 0;
+    int numTracks = numCyls * numHeads;
+    long outputLen = 0;
     int trk, type, length256;
-    long nibbleLen;
     bool result;
 
     assert(numHeads == 2);
 
+    /*
+     * The pulse streams have to be decoded in order, because the decoder's
+     * pseudo-random state carries over from one track to the next.  The
+     * GCR decoding doesn't care, so we collect all of the nibble tracks
+     * and unpack them together at the end.
+     */
+    nibbleBufs = new uint8_t[numTracks * kNibbleBufLen];    // 1.6MB
+    nibbleLens = new long[numTracks];
+    for (trk = 0; trk < numTracks; trk++)
+        outputLen += kBlockSize * DiskImg::SectorsPerTrack35(trk / numHeads);
+    outputBuf = new uint8_t[outputLen];
+    if (nibbleBufs == NULL || nibbleLens == NULL || outputBuf == NULL) {
+        dierr = kDIErrMalloc;
+        goto bail;
+    }
+
     dierr = pGFD->Seek(kMinHeaderLen, kSeekSet);
     if (dierr != kDIErrNone) {
         LOGI("FDI: track seek failed (offset=%d)", kMinHeaderLen);
@@ -244,7 +262,10 @@ DIError WrapperFDI::UnpackDisk35(GenericFD* pGFD, GenericFD* pNewGFD, int numCyl
 
     pNewGFD->Rewind();
 
-    for (trk = 0; trk < numCyls * numHeads; trk++) {
+    for (trk = 0; trk < numTracks; trk++) {
+        uint8_t* nibbleBuf = nibbleBufs + trk * kNibbleBufLen;
+        long nibbleLen;
+
         GetTrackInfo(trk, &type, &length256);
         LOGI("%2d.%d: t=0x%02x l=%d (%d)", trk / numHeads, trk % numHeads,
             type, length256, length256 * 256);
@@ -274,7 +295,7 @@ DIError WrapperFDI::UnpackDisk35(GenericFD* pGFD, GenericFD* pNewGFD, int numCyl
         case 0x00:
             /* blank track */
             badTracks++;
-            memset(nibbleBuf, 0xff, sizeof(nibbleBuf));
+            memset(nibbleBuf, 0xff, kNibbleBufLen);
             nibbleLen = kTrackLenNb2525;
             break;
         case 0x80:
@@ -288,7 +309,7 @@ DIError WrapperFDI::UnpackDisk35(GenericFD* pGFD, GenericFD* pNewGFD, int numCyl
             if (!result) {
                 /* something failed in the decoder; fake it */
                 badTracks++;
-                memset(nibbleBuf, 0xff, sizeof(nibbleBuf));
+                memset(nibbleBuf, 0xff, kNibbleBufLen);
                 nibbleLen = kTrackLenNb2525;
             } 
             if (nibbleLen > kNibbleBufLen) {
@@ -317,24 +338,27 @@ DIError WrapperFDI::UnpackDisk35(GenericFD* pGFD, GenericFD* pNewGFD, int numCyl
             goto bail;
         */
 
-        dierr = DiskImg::UnpackNibbleTrack35(nibbleBuf, nibbleLen, outputBuf,
-                    trk / numHeads, trk % numHeads, pBadBlockMap);
-        if (dierr != kDIErrNone)
-            goto bail;
-
-        dierr = pNewGFD->Write(outputBuf,
-                    kBlockSize * DiskImg::SectorsPerTrack35(trk / numHeads));
-        if (dierr != kDIErrNone) {
-            LOGI("FDI: failed writing disk blocks (%d * %d)",
-                kBlockSize, DiskImg::SectorsPerTrack35(trk / numHeads));
-            goto bail;
-        }
+        nibbleLens[trk] = nibbleLen;
     }
 
     //fNibbleTrackInfo.numTracks = numCyls * numHeads;
 
+    dierr = DiskImg::UnpackNibbleTracks35(nibbleBufs, nibbleLens,
+                kNibbleBufLen, numTracks, outputBuf, pBadBlockMap);
+    if (dierr != kDIErrNone)
+        goto bail;
+
+    dierr = pNewGFD->Write(outputBuf, outputLen);
+    if (dierr != kDIErrNone) {
+        LOGI("FDI: failed writing disk blocks (%ld bytes)", outputLen);
+        goto bail;
+    }
+
 bail:
     delete[] inputBuf;
+    delete[] nibbleBufs;
+    delete[] nibbleLens;
+    delete[] outputBuf;
     return dierr;
 }
 
@@ -1070,14 +1094,13 @@ int WrapperFDI::MyRand(void)
 {
     const int kNumStates = 31;
     const int kQuantum = RAND_MAX / (kNumStates+1);
-    static int state = 0;
     int retVal;
 
-    state++;
-    if (state == kNumStates)
-        state = 0;
+    fRandState++;
+    if (fRandState == kNumStates)
+        fRandState = 0;
 
-    retVal = (kQuantum * state) + (kQuantum / 2);
+    retVal = (kQuantum * fRandState) + (kQuantum / 2);
     assert(retVal >= 0 && retVal <= RAND_MAX);
     return retVal;
 }
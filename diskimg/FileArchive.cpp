@@ -0,0 +1,1092 @@
+/*
+ * CiderPress
+ * Copyright (C) 2009 by CiderPress authors.  All Rights Reserved.
+ * Copyright (C) 2007 by faddenSoft, LLC.  All Rights Reserved.
+ * See the file LICENSE for distribution terms.
+ */
+/*
+ * Streaming reader for Binary II, ACU, and AppleSingle archives.
+ *
+ * The format details were adapted from the Windows app's BnyArchive,
+ * AcuArchive, and AppleSingleArchive classes, which in turn came from
+ * NuLib2.  Those read each header with a handful of small fread() calls;
+ * here everything is parsed out of a big read buffer.
+ */
+#include "StdAfx.h"
+#include "DiskImgPriv.h"
+
+#ifdef HAVE_FSEEKO
+# define FSeek64    fseeko
+# define FTell64    ftello
+#else
+# define FSeek64    _fseeki64
+# define FTell64    _ftelli64
+#endif
+
+/* Binary II */
+static const int kBNYBlockSize = 128;
+static const int kBNYMaxFileName = 64;
+static const int kBNYFileTypeDir = 0x0f;
+
+/* ACU */
+static const int kACUMasterHeaderLen = 20;
+static const int kACUEntryHeaderLen = 54;
+static const int kACUCompNone = 0;
+static const int kACUCompSqueeze = 3;
+
+/* AppleSingle */
+static const uint32_t kASMagic = 0x00051600;
+static const uint32_t kASVersion1 = 0x00010000;
+static const uint32_t kASVersion2 = 0x00020000;
+static const int kASHomeFileSystemLen = 16;
+static const int kASHeaderLen = 4 + 4 + kASHomeFileSystemLen + 2;
+static const int kASTOCEntryLen = 4 + 4 + 4;
+enum {
+    kASIdDataFork = 1,
+    kASIdResourceFork = 2,
+    kASIdRealName = 3,
+    kASIdFileInfo = 7,              // version 1 only
+    kASIdFinderInfo = 9,
+    kASIdProDOSFileInfo = 11,       // version 2 only
+};
+
+/* SQueeze */
+static const uint16_t kSQMagic = 0xff76;
+static const int kSQRLEDelim = 0x90;
+static const int kSQEOFToken = 256;
+static const int kSQNumVals = 257;
+
+
+/*
+ * ===========================================================================
+ *      FileArchive
+ * ===========================================================================
+ */
+
+FileArchive::FileArchive(void) :
+    fFp(NULL),
+    fOwnFp(false),
+    fSeekable(false),
+    fName(NULL),
+    fFormat(kFormatUnknown),
+    fStartPosn(0),
+    fBuf(NULL),
+    fBufStart(0),
+    fBufPos(0),
+    fBufLen(0),
+    fOutBuf(NULL),
+    fInCallback(false),
+    fIndex(NULL),
+    fIndexCount(0),
+    fIndexAlloc(0)
+{
+    memset(&fCurEntry, 0, sizeof(fCurEntry));
+    fPathBuf[0] = '\0';
+}
+
+FileArchive::~FileArchive(void)
+{
+    Close();
+}
+
+void FileArchive::Close(void)
+{
+    if (fOwnFp && fFp != NULL)
+        fclose(fFp);
+    fFp = NULL;
+    fOwnFp = false;
+    delete[] fName;
+    fName = NULL;
+    delete[] fBuf;
+    fBuf = NULL;
+    delete[] fOutBuf;
+    fOutBuf = NULL;
+    fBufStart = 0;
+    fBufPos = fBufLen = 0;
+    fFormat = kFormatUnknown;
+    FreeIndex();
+}
+
+/*static*/ const char* FileArchive::GetFormatName(Format format)
+{
+    switch (format) {
+    case kFormatBinaryII:       return "Binary II";
+    case kFormatACU:            return "ACU";
+    case kFormatAppleSingle:    return "AppleSingle";
+    default:                    return "unknown";
+    }
+}
+
+DIError FileArchive::Open(const char* pathName)
+{
+    if (fFp != NULL)
+        return kDIErrAlreadyOpen;
+    if (pathName == NULL)
+        return kDIErrInvalidArg;
+
+    errno = 0;
+    fFp = fopen(pathName, "rb");
+    if (fFp == NULL) {
+        if (errno == ENOENT)
+            return kDIErrFileNotFound;
+        return ErrnoOrGeneric();
+    }
+    fOwnFp = true;
+    fName = StrcpyNew(pathName);
+
+    DIError dierr = OpenCommon();
+    if (dierr != kDIErrNone)
+        Close();
+    return dierr;
+}
+
+DIError FileArchive::OpenStream(FILE* fp, const char* name)
+{
+    if (fFp != NULL)
+        return kDIErrAlreadyOpen;
+    if (fp == NULL)
+        return kDIErrInvalidArg;
+
+    fFp = fp;
+    fOwnFp = false;
+    if (name != NULL)
+        fName = StrcpyNew(name);
+
+    DIError dierr = OpenCommon();
+    if (dierr != kDIErrNone)
+        Close();
+    return dierr;
+}
+
+/*
+ * Set up the buffers and identify the archive from its first few bytes.
+ */
+DIError FileArchive::OpenCommon(void)
+{
+    DIError dierr;
+    const uint8_t* buf;
+    size_t avail;
+
+    /* pipes can't seek, and ftell fails on them */
+    fStartPosn = FTell64(fFp);
+    fSeekable = (fStartPosn >= 0 && FSeek64(fFp, fStartPosn, SEEK_SET) == 0);
+    if (!fSeekable)
+        fStartPosn = 0;
+
+    fBuf = new uint8_t[kReadBufSize];
+    fOutBuf = new uint8_t[kOutBufSize];
+    if (fBuf == NULL || fOutBuf == NULL)
+        return kDIErrMalloc;
+    fBufStart = fStartPosn;
+    fBufPos = fBufLen = 0;
+
+    dierr = FillBuffer(kBNYBlockSize);
+    if (dierr != kDIErrNone && dierr != kDIErrEOF)
+        return dierr;
+    buf = fBuf;
+    avail = Available();
+
+    if (avail >= (size_t) kASHeaderLen &&
+        (GetLongBE(buf) == kASMagic || GetLongLE(buf) == kASMagic))
+    {
+        fFormat = kFormatAppleSingle;
+    } else if (avail >= (size_t) kBNYBlockSize &&
+        buf[0] == 0x0a && buf[1] == 0x47 && buf[2] == 0x4c && buf[18] == 0x02)
+    {
+        fFormat = kFormatBinaryII;
+    } else if (avail >= (size_t) kACUMasterHeaderLen &&
+        GetShortLE(buf) != 0 && GetShortLE(buf + 2) == 1 &&
+        memcmp(buf + 4, "fZink", 5) == 0)
+    {
+        fFormat = kFormatACU;
+    } else {
+        return kDIErrUnrecognizedFileFmt;
+    }
+
+    LOGD("FileArchive: found %s archive%s", GetFormatName(fFormat),
+        fSeekable ? "" : " (streaming)");
+    return kDIErrNone;
+}
+
+/*
+ * Make sure at least "want" bytes are sitting in the buffer, reading more
+ * if necessary.  Whatever's left is slid to the front first.
+ *
+ * Returns kDIErrEOF if the archive ends first; whatever was available is
+ * still in the buffer.
+ */
+DIError FileArchive::FillBuffer(size_t want)
+{
+    assert(want <= kReadBufSize);
+
+    if (Available() >= want)
+        return kDIErrNone;
+
+    if (fBufPos != 0) {
+        memmove(fBuf, fBuf + fBufPos, fBufLen - fBufPos);
+        fBufStart += fBufPos;
+        fBufLen -= fBufPos;
+        fBufPos = 0;
+    }
+
+    while (fBufLen < want) {
+        size_t actual = fread(fBuf + fBufLen, 1, kReadBufSize - fBufLen, fFp);
+        fBufLen += actual;
+        if (actual == 0) {
+            if (ferror(fFp)) {
+                LOGW("FileArchive: read failed at %lld",
+                    (long long) (fBufStart + fBufLen));
+                return kDIErrReadFailed;
+            }
+            return kDIErrEOF;
+        }
+    }
+
+    return kDIErrNone;
+}
+
+/*
+ * Move to an absolute position in the archive.
+ *
+ * Moving forward on a pipe reads and discards data.  Moving backward is
+ * only possible within the current buffer, or on a seekable file.
+ */
+DIError FileArchive::SeekTo(di_off_t posn)
+{
+    DIError dierr;
+
+    if (posn >= fBufStart && posn <= fBufStart + (di_off_t) fBufLen) {
+        fBufPos = (size_t) (posn - fBufStart);
+        return kDIErrNone;
+    }
+
+    if (fSeekable) {
+        if (FSeek64(fFp, posn, SEEK_SET) != 0)
+            return kDIErrGenericIO;
+        fBufStart = posn;
+        fBufPos = fBufLen = 0;
+        return kDIErrNone;
+    }
+
+    if (posn < fBufStart) {
+        LOGI("FileArchive: can't seek back to %lld on a stream",
+            (long long) posn);
+        return kDIErrNotSupported;
+    }
+
+    while (GetPosn() < posn) {
+        di_off_t remaining;
+
+        fBufPos = fBufLen;
+        remaining = posn - GetPosn();
+        if (remaining > kReadBufSize)
+            remaining = kReadBufSize;
+        dierr = FillBuffer((size_t) remaining);
+        if (dierr != kDIErrNone && (dierr != kDIErrEOF || Available() == 0))
+            return dierr;
+        if (Available() >= (size_t) (posn - GetPosn()))
+            fBufPos += (size_t) (posn - GetPosn());
+        else
+            fBufPos = fBufLen;
+    }
+
+    return kDIErrNone;
+}
+
+/*
+ * Hand "len" bytes at the current position to the data callback, straight
+ * out of the read buffer.
+ */
+DIError FileArchive::CopyStored(di_off_t len, DataCallback func, void* cookie)
+{
+    DIError dierr;
+
+    while (len > 0) {
+        size_t want = len > kReadBufSize ? kReadBufSize : (size_t) len;
+        size_t chunk;
+
+        dierr = FillBuffer(want);
+        if (dierr == kDIErrEOF) {
+            if (Available() == 0)
+                return kDIErrDataUnderrun;
+        } else if (dierr != kDIErrNone) {
+            return dierr;
+        }
+
+        chunk = Available() < want ? Available() : want;
+        dierr = (*func)(fBuf + fBufPos, chunk, cookie);
+        fBufPos += chunk;
+        if (dierr != kDIErrNone)
+            return dierr;
+        len -= chunk;
+    }
+
+    return kDIErrNone;
+}
+
+DIError FileArchive::ReadFork(bool rsrcFork, DataCallback func, void* cookie)
+{
+    if (!fInCallback)
+        return kDIErrInvalidArg;
+    return ReadForkData(&fCurEntry, rsrcFork, func, cookie);
+}
+
+DIError FileArchive::ReadForkData(const Entry* pEntry, bool rsrcFork,
+    DataCallback func, void* cookie)
+{
+    DIError dierr;
+
+    if (func == NULL)
+        return kDIErrInvalidArg;
+
+    if (rsrcFork) {
+        if (pEntry->rsrcOffset < 0)
+            return kDIErrForkNotFound;
+        dierr = SeekTo(pEntry->rsrcOffset);
+        if (dierr != kDIErrNone)
+            return dierr;
+        return CopyStored(pEntry->rsrcLen, func, cookie);
+    }
+
+    if (pEntry->dataOffset < 0)
+        return kDIErrForkNotFound;
+    dierr = SeekTo(pEntry->dataOffset);
+    if (dierr != kDIErrNone)
+        return dierr;
+
+    switch (pEntry->compression) {
+    case kCompressionNone:
+        return CopyStored(pEntry->dataLen, func, cookie);
+    case kCompressionSqueeze:
+        /* Binary II squeezes whole files, ACU leaves the SQ header off */
+        return UnSqueeze(pEntry->dataStoredLen, fFormat == kFormatBinaryII,
+                    func, cookie);
+    default:
+        return kDIErrUnsupportedCompression;
+    }
+}
+
+DIError FileArchive::Iterate(EntryCallback func, void* cookie)
+{
+    DIError dierr;
+
+    if (fFp == NULL || func == NULL || fInCallback)
+        return kDIErrInvalidArg;
+
+    dierr = SeekTo(fStartPosn);
+    if (dierr != kDIErrNone)
+        return dierr;
+
+    switch (fFormat) {
+    case kFormatBinaryII:       return IterateBinaryII(func, cookie);
+    case kFormatACU:            return IterateACU(func, cookie);
+    case kFormatAppleSingle:    return IterateAppleSingle(func, cookie);
+    default:
+        assert(false);
+        return kDIErrInternal;
+    }
+}
+
+/*
+ * Hand fCurEntry to the caller.
+ */
+DIError FileArchive::CallEntryCallback(EntryCallback func, void* cookie)
+{
+    DIError dierr;
+
+    fCurEntry.pathName = fPathBuf;
+    fInCallback = true;
+    dierr = (*func)(this, &fCurEntry, cookie);
+    fInCallback = false;
+    return dierr;
+}
+
+/*
+ * Binary II is a series of 128-byte headers, each followed by the file
+ * contents padded out to a multiple of 128 bytes.  See the File Type Note
+ * for $e0/8000.
+ */
+DIError FileArchive::IterateBinaryII(EntryCallback func, void* cookie)
+{
+    DIError dierr = kDIErrNone;
+    int toFollow = 1;
+    bool first = true;
+
+    while (toFollow) {
+        const uint8_t* raw;
+        uint32_t eof, realEOF;
+        int len;
+
+        dierr = FillBuffer(kBNYBlockSize);
+        if (dierr != kDIErrNone) {
+            LOGI("BNY: failed reading header at %lld",
+                (long long) GetPosn());
+            if (dierr == kDIErrEOF)
+                dierr = kDIErrBadArchiveStruct;
+            break;
+        }
+        raw = fBuf + fBufPos;
+        if (raw[0] != 0x0a || raw[1] != 0x47 || raw[2] != 0x4c ||
+            raw[18] != 0x02)
+        {
+            LOGI("BNY: bad header at %lld", (long long) GetPosn());
+            dierr = kDIErrBadArchiveStruct;
+            break;
+        }
+
+        memset(&fCurEntry, 0, sizeof(fCurEntry));
+        fCurEntry.fssep = '/';
+        fCurEntry.access = raw[3] | raw[111] << 8;
+        fCurEntry.fileType = raw[4] | raw[112] << 8;
+        fCurEntry.auxType = raw[5] | raw[6] << 8 | raw[109] << 16 |
+            raw[110] << 24;
+        fCurEntry.storageType = raw[7];
+        fCurEntry.modWhen = A2FileProDOS::ConvertProDate(
+            GetShortLE(&raw[10]) | (uint32_t) GetShortLE(&raw[12]) << 16);
+        fCurEntry.createWhen = A2FileProDOS::ConvertProDate(
+            GetShortLE(&raw[14]) | (uint32_t) GetShortLE(&raw[16]) << 16);
+        eof = raw[20] | raw[21] << 8 | raw[22] << 16 | (uint32_t) raw[116] << 24;
+
+        len = raw[23];
+        if (len > kBNYMaxFileName) {
+            LOGI("BNY: invalid filename length %d", len);
+            dierr = kDIErrBadArchiveStruct;
+            break;
+        }
+        /* names aren't allowed to start with '/' */
+        while (len > 0 && raw[24] == '/') {
+            raw++;
+            len--;
+        }
+        memcpy(fPathBuf, &raw[24], len);
+        fPathBuf[len] = '\0';
+        raw = fBuf + fBufPos;
+        if (len == 0) {
+            dierr = kDIErrBadArchiveStruct;
+            break;
+        }
+
+        if (!first && raw[127] != toFollow - 1) {
+            LOGI("BNY: WARNING: filesToFollow %d, expected %d",
+                raw[127], toFollow - 1);
+        }
+        toFollow = raw[127];
+        first = false;
+
+        /*
+         * NuLib and "unblu.c" compared against file type 15 (DIR), so we do
+         * too.  Directories are given an EOF but don't have any content.
+         */
+        fCurEntry.isDirectory = (fCurEntry.fileType == kBNYFileTypeDir);
+        realEOF = fCurEntry.isDirectory ? 0 : eof;
+        fBufPos += kBNYBlockSize;
+
+        fCurEntry.dataOffset = GetPosn();
+        fCurEntry.dataStoredLen =
+            ((realEOF + kBNYBlockSize - 1) / kBNYBlockSize) * kBNYBlockSize;
+        fCurEntry.dataLen = realEOF;
+        fCurEntry.rsrcOffset = -1;
+
+        /* peek at the data to see if it was squeezed */
+        if (realEOF >= 2) {
+            dierr = FillBuffer(2);
+            if (dierr != kDIErrNone && dierr != kDIErrEOF)
+                break;
+            if (Available() >= 2 &&
+                GetShortLE(fBuf + fBufPos) == kSQMagic)
+            {
+                size_t nameLen = strlen(fPathBuf);
+
+                fCurEntry.compression = kCompressionSqueeze;
+                fCurEntry.dataLen = -1;
+                if (nameLen > 3 &&
+                    strcasecmp(fPathBuf + nameLen - 3, ".qq") == 0)
+                {
+                    fPathBuf[nameLen - 3] = '\0';
+                }
+            }
+        }
+
+        dierr = CallEntryCallback(func, cookie);
+        if (dierr != kDIErrNone)
+            break;
+
+        /* the last file is allowed to be short on padding */
+        if (toFollow) {
+            dierr = SeekTo(fCurEntry.dataOffset + fCurEntry.dataStoredLen);
+            if (dierr != kDIErrNone)
+                break;
+        }
+    }
+
+    return dierr;
+}
+
+/*
+ * ACU archives have a 20-byte master header, then a 54-byte header and
+ * filename in front of each file's data.  Many of the fields are still a
+ * mystery.
+ */
+DIError FileArchive::IterateACU(EntryCallback func, void* cookie)
+{
+    DIError dierr;
+    long numEntries;
+
+    dierr = FillBuffer(kACUMasterHeaderLen);
+    if (dierr != kDIErrNone)
+        return dierr == kDIErrEOF ? kDIErrBadArchiveStruct : dierr;
+    numEntries = GetShortLE(fBuf + fBufPos);
+    fBufPos += kACUMasterHeaderLen;
+
+    LOGD("ACU: %ld entries", numEntries);
+
+    while (numEntries--) {
+        const uint8_t* buf;
+        int compressionType, nameLen;
+
+        dierr = FillBuffer(kACUEntryHeaderLen);
+        if (dierr != kDIErrNone)
+            return dierr == kDIErrEOF ? kDIErrBadArchiveStruct : dierr;
+        buf = fBuf + fBufPos;
+
+        memset(&fCurEntry, 0, sizeof(fCurEntry));
+        fCurEntry.fssep = '/';
+        compressionType = buf[0x01];
+        fCurEntry.dataStoredLen = GetLongLE(&buf[0x12]);
+        fCurEntry.access = GetShortLE(&buf[0x16]);
+        fCurEntry.fileType = GetShortLE(&buf[0x18]);
+        fCurEntry.auxType = GetShortLE(&buf[0x1a]);
+        fCurEntry.storageType = buf[0x20];
+        fCurEntry.dataLen = GetLongLE(&buf[0x26]);
+        fCurEntry.modWhen = A2FileProDOS::ConvertProDate(
+            GetShortLE(&buf[0x2a]) | (uint32_t) GetShortLE(&buf[0x2c]) << 16);
+        fCurEntry.createWhen = A2FileProDOS::ConvertProDate(
+            GetShortLE(&buf[0x2e]) | (uint32_t) GetShortLE(&buf[0x30]) << 16);
+        nameLen = GetShortLE(&buf[0x32]);
+        fBufPos += kACUEntryHeaderLen;
+
+        if (nameLen == 0 || nameLen > kMaxPathLen) {
+            LOGI("ACU: bad filename length %d", nameLen);
+            return kDIErrBadArchiveStruct;
+        }
+        dierr = FillBuffer(nameLen);
+        if (dierr != kDIErrNone)
+            return dierr == kDIErrEOF ? kDIErrBadArchiveStruct : dierr;
+        memcpy(fPathBuf, fBuf + fBufPos, nameLen);
+        fPathBuf[nameLen] = '\0';
+        fBufPos += nameLen;
+
+        fCurEntry.isDirectory = (fCurEntry.storageType == 0x0d);
+        fCurEntry.dataOffset = GetPosn();
+        fCurEntry.rsrcOffset = -1;
+        if (compressionType == kACUCompNone) {
+            fCurEntry.compression = kCompressionNone;
+            if (fCurEntry.dataLen > fCurEntry.dataStoredLen)
+                fCurEntry.dataLen = fCurEntry.dataStoredLen;
+        } else if (compressionType == kACUCompSqueeze) {
+            fCurEntry.compression = kCompressionSqueeze;
+        } else {
+            LOGI("ACU: unknown compression type %d on '%s'",
+                compressionType, fPathBuf);
+            fCurEntry.compression = kCompressionUnknown;
+        }
+
+        dierr = CallEntryCallback(func, cookie);
+        if (dierr != kDIErrNone)
+            return dierr;
+
+        dierr = SeekTo(fCurEntry.dataOffset + fCurEntry.dataStoredLen);
+        if (dierr != kDIErrNone)
+            return dierr;
+    }
+
+    return kDIErrNone;
+}
+
+/*
+ * Sort TOC entries by file offset.
+ */
+static int CompareTOCOffsets(const void* vp1, const void* vp2)
+{
+    const uint32_t* pToc1 = (const uint32_t*) vp1;
+    const uint32_t* pToc2 = (const uint32_t*) vp2;
+
+    if (pToc1[1] < pToc2[1])
+        return -1;
+    else if (pToc1[1] > pToc2[1])
+        return 1;
+    return 0;
+}
+
+/*
+ * AppleSingle has a header and a table of contents, which points at
+ * chunks anywhere in the file.  We read the chunks we care about in file
+ * order, so a stream only needs to move forward.
+ */
+DIError FileArchive::IterateAppleSingle(EntryCallback func, void* cookie)
+{
+    DIError dierr;
+    uint32_t (*toc)[3] = NULL;      // entryId, offset, length
+    uint32_t (*pToc)[3];
+    uint32_t version;
+    char homeFileSystem[kASHomeFileSystemLen + 1];
+    bool bigEndian, haveName = false, haveProDOSInfo = false;
+    uint32_t finderType = 0, finderCreator = 0;
+    bool haveFinderInfo = false;
+    uint64_t maxPosn = 0;
+    long numEntries;
+
+    dierr = FillBuffer(kASHeaderLen);
+    if (dierr != kDIErrNone)
+        return dierr == kDIErrEOF ? kDIErrBadArchiveStruct : dierr;
+
+    /* spec says big-endian, but Mac OS X writes little-endian */
+    bigEndian = (fBuf[fBufPos + 1] == 0x05);
+    if (bigEndian) {
+        version = GetLongBE(fBuf + fBufPos + 4);
+        numEntries = GetShortBE(fBuf + fBufPos + 8 + kASHomeFileSystemLen);
+    } else {
+        version = GetLongLE(fBuf + fBufPos + 4);
+        numEntries = GetShortLE(fBuf + fBufPos + 8 + kASHomeFileSystemLen);
+    }
+    memcpy(homeFileSystem, fBuf + fBufPos + 8, kASHomeFileSystemLen);
+    homeFileSystem[kASHomeFileSystemLen] = '\0';
+    fBufPos += kASHeaderLen;
+
+    if (version != kASVersion1 && version != kASVersion2) {
+        LOGI("AS: unrecognized version 0x%08x", version);
+        return kDIErrUnsupportedFileFmt;
+    }
+
+    toc = new uint32_t[numEntries > 0 ? numEntries : 1][3];
+    if (toc == NULL)
+        return kDIErrMalloc;
+    for (long i = 0; i < numEntries; i++) {
+        dierr = FillBuffer(kASTOCEntryLen);
+        if (dierr != kDIErrNone) {
+            if (dierr == kDIErrEOF)
+                dierr = kDIErrBadArchiveStruct;
+            goto bail;
+        }
+        for (int j = 0; j < 3; j++) {
+            const uint8_t* ptr = fBuf + fBufPos + j * 4;
+            toc[i][j] = bigEndian ? GetLongBE(ptr) : GetLongLE(ptr);
+        }
+        fBufPos += kASTOCEntryLen;
+
+        if (maxPosn < (uint64_t) toc[i][1] + toc[i][2])
+            maxPosn = (uint64_t) toc[i][1] + toc[i][2];
+    }
+    qsort(toc, numEntries, sizeof(toc[0]), CompareTOCOffsets);
+
+    /* make sure the file is big enough to hold everything */
+    if (fSeekable) {
+        di_off_t readPosn = fBufStart + fBufLen;
+        di_off_t fileLen;
+
+        if (FSeek64(fFp, 0, SEEK_END) != 0 || (fileLen = FTell64(fFp)) < 0 ||
+            FSeek64(fFp, readPosn, SEEK_SET) != 0)
+        {
+            dierr = kDIErrGenericIO;
+            goto bail;
+        }
+        if (maxPosn > (uint64_t) (fileLen - fStartPosn)) {
+            LOGW("AS: max=%llu, file len is only %lld",
+                (unsigned long long) maxPosn,
+                (long long) (fileLen - fStartPosn));
+            dierr = kDIErrBadArchiveStruct;
+            goto bail;
+        }
+    }
+
+    memset(&fCurEntry, 0, sizeof(fCurEntry));
+    fCurEntry.fssep = ':';
+    fCurEntry.dataOffset = fCurEntry.rsrcOffset = -1;
+
+    for (pToc = toc; pToc < toc + numEntries; pToc++) {
+        uint32_t entryId = (*pToc)[0];
+        uint32_t length = (*pToc)[2];
+        di_off_t offset = fStartPosn + (*pToc)[1];
+        const uint8_t* buf;
+
+        switch (entryId) {
+        case kASIdDataFork:
+            if (fCurEntry.dataOffset >= 0) {
+                LOGW("AS: found two data forks");
+                dierr = kDIErrBadArchiveStruct;
+                goto bail;
+            }
+            fCurEntry.dataOffset = offset;
+            fCurEntry.dataStoredLen = fCurEntry.dataLen = length;
+            continue;
+        case kASIdResourceFork:
+            if (fCurEntry.rsrcOffset >= 0) {
+                LOGW("AS: found two rsrc forks");
+                dierr = kDIErrBadArchiveStruct;
+                goto bail;
+            }
+            fCurEntry.rsrcOffset = offset;
+            fCurEntry.rsrcLen = length;
+            continue;
+        case kASIdRealName:
+            if (length > kMaxPathLen) {
+                LOGW("AS: ignoring excessively long filename (%u)", length);
+                continue;
+            }
+            break;
+        case kASIdFileInfo:
+            if (strcmp(homeFileSystem, "ProDOS          ") != 0 ||
+                length != 16)
+            {
+                continue;
+            }
+            break;
+        case kASIdFinderInfo:
+            if (length != 32)
+                continue;
+            break;
+        case kASIdProDOSFileInfo:
+            if (length != 8)
+                continue;
+            break;
+        default:
+            /* not interested */
+            continue;
+        }
+
+        dierr = SeekTo(offset);
+        if (dierr == kDIErrNone)
+            dierr = FillBuffer(length);
+        if (dierr != kDIErrNone) {
+            if (dierr == kDIErrEOF)
+                dierr = kDIErrBadArchiveStruct;
+            goto bail;
+        }
+        buf = fBuf + fBufPos;
+
+        switch (entryId) {
+        case kASIdRealName:
+            /* v1 is Mac OS Roman, v2 is UTF-8; we don't convert either */
+            memcpy(fPathBuf, buf, length);
+            fPathBuf[length] = '\0';
+            haveName = (length != 0);
+            break;
+        case kASIdFileInfo:
+            fCurEntry.createWhen = A2FileProDOS::ConvertProDate(bigEndian ?
+                GetShortBE(buf) | (uint32_t) GetShortBE(buf + 2) << 16 :
+                GetShortLE(buf) | (uint32_t) GetShortLE(buf + 2) << 16);
+            fCurEntry.modWhen = A2FileProDOS::ConvertProDate(bigEndian ?
+                GetShortBE(buf + 4) | (uint32_t) GetShortBE(buf + 6) << 16 :
+                GetShortLE(buf + 4) | (uint32_t) GetShortLE(buf + 6) << 16);
+            buf += 8;
+            /* fall through -- the rest is laid out like ProDOS File Info */
+        case kASIdProDOSFileInfo:
+            fCurEntry.access = bigEndian ? GetShortBE(buf) : GetShortLE(buf);
+            fCurEntry.fileType =
+                bigEndian ? GetShortBE(buf + 2) : GetShortLE(buf + 2);
+            fCurEntry.auxType =
+                bigEndian ? GetLongBE(buf + 4) : GetLongLE(buf + 4);
+            haveProDOSInfo = true;
+            break;
+        case kASIdFinderInfo:
+            /* these are big-endian even on Mac OS X */
+            finderType = GetLongBE(buf);
+            finderCreator = GetLongBE(buf + 4);
+            haveFinderInfo = true;
+            break;
+        default:
+            assert(false);
+            break;
+        }
+        fBufPos += length;
+    }
+
+    /* ProDOS info takes precedence over Finder info */
+    if (haveFinderInfo && !haveProDOSInfo) {
+        const uint32_t kPdosType = 0x70646f73;      // 'pdos'
+        if (finderCreator == kPdosType && (finderType >> 24) == 'p') {
+            fCurEntry.fileType = (finderType >> 16) & 0xff;
+            fCurEntry.auxType = finderType & 0xffff;
+        } else {
+            fCurEntry.fileType = finderType;
+            fCurEntry.auxType = finderCreator;
+        }
+    }
+
+    /*
+     * If there wasn't a file name, use the AppleSingle file's name, minus
+     * any ".as" extension.
+     */
+    if (!haveName) {
+        const char* name = "UNTITLED";
+        size_t len;
+
+        if (fName != NULL && fName[0] != '\0') {
+            name = FilenameOnly(fName, '/');
+#ifdef _WIN32
+            name = FilenameOnly(name, '\\');
+#endif
+        }
+        len = strlen(name);
+        if (len > kMaxPathLen)
+            len = kMaxPathLen;
+        memcpy(fPathBuf, name, len);
+        fPathBuf[len] = '\0';
+        if (len > 3 && strcasecmp(fPathBuf + len - 3, ".as") == 0)
+            fPathBuf[len - 3] = '\0';
+    }
+
+    dierr = CallEntryCallback(func, cookie);
+
+bail:
+    delete[] toc;
+    return dierr;
+}
+
+
+/*
+ * ===========================================================================
+ *      SQueeze expansion
+ * ===========================================================================
+ */
+
+/*
+ * Get the next byte of compressed data, which must come before "endPosn".
+ */
+inline DIError FileArchive::SqGetByte(di_off_t endPosn, uint8_t* pVal)
+{
+    if (fBufPos == fBufLen) {
+        if (GetPosn() >= endPosn)
+            return kDIErrBadCompressedData;
+        DIError dierr = FillBuffer(1);
+        if (dierr != kDIErrNone)
+            return dierr == kDIErrEOF ? kDIErrBadCompressedData : dierr;
+    }
+    if (GetPosn() >= endPosn)
+        return kDIErrBadCompressedData;
+    *pVal = fBuf[fBufPos++];
+    return kDIErrNone;
+}
+
+/*
+ * Expand SQueeze (RLE + Huffman) data at the current position.  Binary II
+ * files have the full SQ header, with a magic number, checksum, and the
+ * original file name; ACU just has the tree.
+ *
+ * There's a stop symbol, so we don't need to know the expanded length.
+ * Adapted from the Windows app's Squeeze.cpp, which came from NufxLib.
+ */
+DIError FileArchive::UnSqueeze(di_off_t storedLen, bool fullSqHeader,
+    DataCallback func, void* cookie)
+{
+    DIError dierr = kDIErrNone;
+    di_off_t endPosn = GetPosn() + storedLen;
+    int16_t decTree[kSQNumVals - 1][2];
+    uint16_t fileChecksum = 0, checksum = 0;
+    int nodeCount, bits = 0, bitPosn = 7;
+    bool inrep = false;
+    uint8_t lastc = 0;
+    size_t outLen = 0;
+    uint8_t lo, hi;
+
+#define SQ_GET(var) \
+    do { dierr = SqGetByte(endPosn, &(var)); \
+        if (dierr != kDIErrNone) goto bail; } while (0)
+
+    if (fullSqHeader) {
+        SQ_GET(lo);
+        SQ_GET(hi);
+        if ((lo | hi << 8) != kSQMagic) {
+            LOGI("SQ: bad magic number");
+            dierr = kDIErrBadCompressedData;
+            goto bail;
+        }
+        SQ_GET(lo);
+        SQ_GET(hi);
+        fileChecksum = lo | hi << 8;
+
+        /* skip over the original file name */
+        do {
+            SQ_GET(lo);
+        } while (lo != '\0');
+    }
+
+    SQ_GET(lo);
+    SQ_GET(hi);
+    nodeCount = (int16_t) (lo | hi << 8);
+    if (nodeCount < 0 || nodeCount >= kSQNumVals) {
+        LOGI("SQ: invalid decode tree (%d nodes)", nodeCount);
+        dierr = kDIErrBadCompressedData;
+        goto bail;
+    }
+
+    /* an empty tree only happens on an empty file */
+    decTree[0][0] = decTree[0][1] = -(kSQEOFToken + 1);
+
+    /*
+     * Positive values are indices of other nodes, negative values are
+     * literals (+1 because "negative zero" doesn't work well).  Make sure
+     * the tree can't send us off into the weeds.
+     */
+    for (int i = 0; i < nodeCount; i++) {
+        for (int j = 0; j < 2; j++) {
+            int child;
+
+            SQ_GET(lo);
+            SQ_GET(hi);
+            child = (int16_t) (lo | hi << 8);
+            if (child >= nodeCount || child < -kSQNumVals) {
+                LOGI("SQ: bad node %d in decode tree", child);
+                dierr = kDIErrBadCompressedData;
+                goto bail;
+            }
+            decTree[i][j] = (int16_t) child;
+        }
+    }
+
+    /*
+     * Huffman-decode the input, and feed that into an RLE expander.
+     */
+    while (true) {
+        int val = 0;
+        int count;
+
+        do {
+            if (++bitPosn > 7) {
+                uint8_t byte;
+                SQ_GET(byte);
+                bits = byte;
+                bitPosn = 0;
+            } else {
+                bits >>= 1;
+            }
+            val = decTree[val][bits & 1];
+        } while (val >= 0);
+        val = -(val + 1);
+
+        if (val == kSQEOFToken)
+            break;
+
+        if (inrep) {
+            /*
+             * Last char was the RLE delimiter, so this is a count.  The
+             * first occurrence of the char was already emitted.
+             */
+            if (val == 0) {
+                /* just an escaped RLE delimiter */
+                lastc = kSQRLEDelim;
+                count = 1;
+            } else {
+                count = val - 1;
+            }
+            inrep = false;
+        } else if (val == kSQRLEDelim) {
+            /* catch the count the next time around */
+            inrep = true;
+            continue;
+        } else {
+            lastc = (uint8_t) val;
+            count = 1;
+        }
+
+        while (count--) {
+            if (outLen == kOutBufSize) {
+                dierr = (*func)(fOutBuf, outLen, cookie);
+                if (dierr != kDIErrNone)
+                    goto bail;
+                outLen = 0;
+            }
+            fOutBuf[outLen++] = lastc;
+            checksum += lastc;
+        }
+    }
+
+#undef SQ_GET
+
+    if (inrep) {
+        LOGI("SQ: got stop symbol when run length expected");
+        dierr = kDIErrBadCompressedData;
+        goto bail;
+    }
+    if (outLen != 0) {
+        dierr = (*func)(fOutBuf, outLen, cookie);
+        if (dierr != kDIErrNone)
+            goto bail;
+    }
+
+    if (fullSqHeader && checksum != fileChecksum) {
+        LOGI("SQ: expected checksum 0x%04x, got 0x%04x",
+            fileChecksum, checksum);
+        dierr = kDIErrBadChecksum;
+        goto bail;
+    }
+
+bail:
+    return dierr;
+}
+
+
+/*
+ * ===========================================================================
+ *      Entry index
+ * ===========================================================================
+ */
+
+/*static*/ DIError FileArchive::IndexCallback(FileArchive* pArchive,
+    const Entry* pEntry, void* cookie)
+{
+    if (pArchive->fIndexCount == pArchive->fIndexAlloc) {
+        long newAlloc = pArchive->fIndexAlloc ? pArchive->fIndexAlloc * 2 : 64;
+        Entry* newIndex = new Entry[newAlloc];
+        if (newIndex == NULL)
+            return kDIErrMalloc;
+        if (pArchive->fIndexCount != 0) {
+            memcpy(newIndex, pArchive->fIndex,
+                pArchive->fIndexCount * sizeof(Entry));
+        }
+        delete[] pArchive->fIndex;
+        pArchive->fIndex = newIndex;
+        pArchive->fIndexAlloc = newAlloc;
+    }
+
+    Entry* pCopy = &pArchive->fIndex[pArchive->fIndexCount];
+    *pCopy = *pEntry;
+    pCopy->pathName = StrcpyNew(pEntry->pathName);
+    pArchive->fIndexCount++;
+    return kDIErrNone;
+}
+
+void FileArchive::FreeIndex(void)
+{
+    for (long i = 0; i < fIndexCount; i++)
+        delete[] fIndex[i].pathName;
+    delete[] fIndex;
+    fIndex = NULL;
+    fIndexCount = fIndexAlloc = 0;
+}
+
+DIError FileArchive::BuildIndex(void)
+{
+    DIError dierr;
+
+    FreeIndex();
+    dierr = Iterate(IndexCallback, NULL);
+    if (dierr != kDIErrNone)
+        FreeIndex();
+    return dierr;
+}
+
+const FileArchive::Entry* FileArchive::GetEntry(long idx) const
+{
+    if (idx < 0 || idx >= fIndexCount)
+        return NULL;
+    return &fIndex[idx];
+}
+
+DIError FileArchive::ReadIndexedFork(long idx, bool rsrcFork,
+    DataCallback func, void* cookie)
+{
+    if (idx < 0 || idx >= fIndexCount || fInCallback)
+        return kDIErrInvalidIndex;
+    return ReadForkData(&fIndex[idx], rsrcFork, func, cookie);
+}
@@ -131,15 +131,18 @@ bail:
 }
 
 /*
- * Open up a sub-volume.
+ * Open up a sub-volume.  This may be called on a worker thread.
+ *
+ * "pJob->numBlocks" has already been trimmed to fit by FindSubVolumes.
  */
-DIError DiskFSFocusDrive::OpenSubVolume(long startBlock, long numBlocks,
-    const char* name)
+DIError DiskFSFocusDrive::OpenPartition(PartitionJob* pJob)
 {
     DIError dierr = kDIErrNone;
     DiskFS* pNewFS = NULL;
     DiskImg* pNewImg = NULL;
-    //bool tweaked = false;
+    long startBlock = pJob->startBlock;
+    long numBlocks = pJob->numBlocks;
+    const char* name = (const char*) pJob->pCookie;
 
     LOGI("Adding %ld +%ld", startBlock, numBlocks);
 
@@ -148,15 +151,6 @@ DIError DiskFSFocusDrive::OpenSubVolume(long startBlock, long numBlocks,
             startBlock, fpImg->GetNumBlocks());
         return kDIErrBadPartition;
     }
-    if (startBlock + numBlocks > fpImg->GetNumBlocks()) {
-        LOGI("FocusDrive partition too large (%ld vs %ld avail)",
-            numBlocks, fpImg->GetNumBlocks() - startBlock);
-        fpImg->AddNote(DiskImg::kNoteInfo,
-            "Reduced partition from %ld blocks to %ld.\n",
-            numBlocks, fpImg->GetNumBlocks() - startBlock);
-        numBlocks = fpImg->GetNumBlocks() - startBlock;
-        //tweaked = true;
-    }
 
     pNewImg = new DiskImg;
     if (pNewImg == NULL) {
@@ -229,8 +223,9 @@ DIError DiskFSFocusDrive::OpenSubVolume(long startBlock, long numBlocks,
         goto bail;
     }
 
-    /* add it to the list */
-    AddSubVolumeToList(pNewImg, pNewFS);
+    /* hand it back; FindSubVolumes adds it to the list */
+    pJob->pNewImg = pNewImg;
+    pJob->pNewFS = pNewFS;
     pNewImg = NULL;
     pNewFS = NULL;
 
@@ -288,6 +283,9 @@ DIError DiskFSFocusDrive::Initialize(void)
 
 /*
  * Find the various sub-volumes and open them.
+ *
+ * The partitions are opened (possibly several at once), then added to the
+ * list in table order.
  */
 DIError DiskFSFocusDrive::FindSubVolumes(void)
 {
@@ -295,7 +293,8 @@ DIError DiskFSFocusDrive::FindSubVolumes(void)
     uint8_t buf[kBlkSize];
     uint8_t nameBuf[kBlkSize*2];
     PartitionMap map;
-    int i;
+    PartitionJob jobs[kMaxPartitions];
+    int i, numJobs;
 
     dierr = fpImg->ReadBlock(kPartMapBlock, buf);
     if (dierr != kDIErrNone)
@@ -309,11 +308,42 @@ DIError DiskFSFocusDrive::FindSubVolumes(void)
     UnpackPartitionMap(buf, nameBuf, &map);
     DumpPartitionMap(&map);
 
-    for (i = 0; i < map.partCount; i++) {
-        dierr = OpenVol(i, map.entry[i].startBlock, map.entry[i].blockCount,
-                    (const char*)map.entry[i].name);
+    numJobs = map.partCount;
+    if (numJobs > kMaxPartitions)
+        numJobs = kMaxPartitions;
+    for (i = 0; i < numJobs; i++) {
+        long startBlock = map.entry[i].startBlock;
+        long numBlocks = map.entry[i].blockCount;
+
+        jobs[i].startBlock = startBlock;
+        jobs[i].numBlocks = numBlocks;
+        jobs[i].pCookie = map.entry[i].name;
+        if (startBlock <= fpImg->GetNumBlocks() &&
+            startBlock + numBlocks > fpImg->GetNumBlocks())
+        {
+            LOGI("FocusDrive partition too large (%ld vs %ld avail)",
+                numBlocks, fpImg->GetNumBlocks() - startBlock);
+            fpImg->AddNote(DiskImg::kNoteInfo,
+                "Reduced partition from %ld blocks to %ld.\n",
+                numBlocks, fpImg->GetNumBlocks() - startBlock);
+            jobs[i].numBlocks = fpImg->GetNumBlocks() - startBlock;
+        }
+    }
+
+    dierr = OpenPartitions(jobs, numJobs);
+    if (dierr != kDIErrNone)
+        goto bail;
+
+    for (i = 0; i < numJobs; i++) {
+        dierr = AddVol(i, &jobs[i]);
         if (dierr != kDIErrNone)
-            goto bail;
+            break;
+    }
+
+    /* anything we didn't get to */
+    for ( ; i < numJobs; i++) {
+        delete jobs[i].pNewFS;
+        delete jobs[i].pNewImg;
     }
 
 bail:
@@ -321,24 +351,23 @@ bail:
 }
 
 /*
- * Open the volume.  If it fails, open a placeholder instead.  (If *that*
- * fails, return with an error.)
+ * Add an opened volume to the list.  If it failed to open, add a
+ * placeholder instead.  (If *that* fails, return with an error.)
  */
-DIError DiskFSFocusDrive::OpenVol(int idx, long startBlock, long numBlocks,
-    const char* name)
+DIError DiskFSFocusDrive::AddVol(int idx, PartitionJob* pJob)
 {
     DIError dierr;
 
-    dierr = OpenSubVolume(startBlock, numBlocks, name);
-    if (dierr != kDIErrNone) {
-        if (dierr == kDIErrCancelled)
-            goto bail;
+    dierr = pJob->dierr;
+    if (dierr == kDIErrNone) {
+        AddSubVolumeToList(pJob->pNewImg, pJob->pNewFS);
+    } else {
         DiskFS* pNewFS = NULL;
         DiskImg* pNewImg = NULL;
 
         LOGI(" FocusDrive failed opening sub-volume %d", idx);
-        dierr = CreatePlaceholder(startBlock, numBlocks, name, NULL,
-                    &pNewImg, &pNewFS);
+        dierr = CreatePlaceholder(pJob->startBlock, pJob->numBlocks,
+                    (const char*) pJob->pCookie, NULL, &pNewImg, &pNewFS);
         if (dierr == kDIErrNone) {
             AddSubVolumeToList(pNewImg, pNewFS);
         } else {
@@ -348,6 +377,5 @@ DIError DiskFSFocusDrive::OpenVol(int idx, long startBlock, long numBlocks,
         }
     }
 
-bail:
     return dierr;
 }
@@ -8,6 +8,7 @@
  */
 #include "StdAfx.h"
 #include "DiskImgPriv.h"
+#include <thread>
 
 /*
  * ===========================================================================
@@ -68,6 +69,40 @@ bail:
     return dierr;
 }
 
+/*
+ * Read "length" bytes starting at "offset".  The file position is left
+ * wherever the read put it, but nobody sharing the GFD through ReadAt or
+ * WriteAt should care.
+ *
+ * Sub-classes with a way to do this without seeking should override it.
+ */
+DIError GenericFD::ReadAt(di_off_t offset, void* buf, size_t length,
+    size_t* pActual)
+{
+    std::lock_guard<std::mutex> lock(fPositionLock);
+    DIError dierr;
+
+    dierr = Seek(offset, kSeekSet);
+    if (dierr != kDIErrNone)
+        return dierr;
+    return Read(buf, length, pActual);
+}
+
+/*
+ * Write "length" bytes starting at "offset".
+ */
+DIError GenericFD::WriteAt(di_off_t offset, const void* buf, size_t length,
+    size_t* pActual)
+{
+    std::lock_guard<std::mutex> lock(fPositionLock);
+    DIError dierr;
+
+    dierr = Seek(offset, kSeekSet);
+    if (dierr != kDIErrNone)
+        return dierr;
+    return Write(buf, length, pActual);
+}
+
 
 /*
  * ===========================================================================
@@ -127,6 +162,7 @@ DIError GFDFile::Read(void* buf, size_t length, size_t* pActual)
 
     if (fFp == NULL)
         return kDIErrNotReady;
+    fStdioUsed = true;
     actual = ::fread(buf, 1, length, fFp);
     if (actual == 0) {
         if (feof(fFp))
@@ -161,6 +197,7 @@ DIError GFDFile::Write(const void* buf, size_t length, size_t* pActual)
     if (fReadOnly)
         return kDIErrAccessDenied;
     assert(pActual == NULL);     // not handling this yet
+    fStdioUsed = true;
     if (::fwrite(buf, length, 1, fFp) != 1) {
         dierr = ErrnoOrGeneric();
         LOGW("  GDFile Write failed on %lu bytes (err=%d)",
@@ -179,6 +216,7 @@ DIError GFDFile::Seek(di_off_t offset, DIWhence whence)
     if (fFp == NULL)
         return kDIErrNotReady;
     //assert(offset <= kAlmostTwoGB);
+    fStdioUsed = true;
     //if (::fseek(fFp, (long) offset, whence) != 0) {
     if (::fseeko(fFp, offset, whence) != 0) {
         dierr = ErrnoOrGeneric();
@@ -232,9 +270,30 @@ DIError GFDFile::Close(void)
     LOGI("  GFDFile closing '%s'", fPathName);
     fclose(fFp);
     fFp = NULL;
+    fStdioUsed = false;
     return kDIErrNone;
 }
 
+/*
+ * Get the file descriptor for pread/pwrite.  If the stdio calls have been
+ * used, flush the FILE first, so that pending writes reach the file and
+ * buffered reads don't go stale when we write around them.  The stdio
+ * file position is preserved.
+ */
+int GFDFile::GetSyncedFd(void)
+{
+    if (fFp == NULL)
+        return -1;
+    if (fStdioUsed) {
+        std::lock_guard<std::mutex> lock(fPositionLock);
+        if (fStdioUsed) {
+            fflush(fFp);
+            fStdioUsed = false;
+        }
+    }
+    return fileno(fFp);
+}
+
 #else /*HAVE_FSEEKO*/
 
 DIError GFDFile::Open(const char* filename, bool readOnly)
@@ -397,6 +456,116 @@ DIError GFDFile::Close(void)
 }
 #endif /*HAVE_FSEEKO else*/
 
+#ifdef HAVE_PREAD
+/*
+ * Positional read, using pread().  Doesn't touch the file position, so
+ * no locking is needed.
+ */
+DIError GFDFile::ReadAt(di_off_t offset, void* buf, size_t length,
+    size_t* pActual)
+{
+    DIError dierr;
+    ssize_t actual;
+#ifdef HAVE_FSEEKO
+    int fd = GetSyncedFd();
+#else
+    int fd = fFd;
+#endif
+
+    if (fd < 0)
+        return kDIErrNotReady;
+    actual = ::pread(fd, buf, length, offset);
+    if (actual == 0)
+        return kDIErrEOF;
+    if (actual < 0) {
+        dierr = ErrnoOrGeneric();
+        LOGW("  GDFile ReadAt failed on %lu bytes (err=%d)",
+            (unsigned long) length, dierr);
+        return dierr;
+    }
+
+    if (pActual == NULL) {
+        if (actual != (ssize_t) length) {
+            LOGI("  GDFile ReadAt partial (wanted=%lu actual=%ld)",
+                (unsigned long) length, (long) actual);
+            return kDIErrReadFailed;
+        }
+    } else {
+        *pActual = actual;
+    }
+    return kDIErrNone;
+}
+
+/*
+ * Positional write, using pwrite().
+ */
+DIError GFDFile::WriteAt(di_off_t offset, const void* buf, size_t length,
+    size_t* pActual)
+{
+    DIError dierr;
+    ssize_t actual;
+#ifdef HAVE_FSEEKO
+    int fd = GetSyncedFd();
+#else
+    int fd = fFd;
+#endif
+
+    if (fd < 0)
+        return kDIErrNotReady;
+    if (fReadOnly)
+        return kDIErrAccessDenied;
+    assert(pActual == NULL);     // not handling partial writes yet
+    actual = ::pwrite(fd, buf, length, offset);
+    if (actual != (ssize_t) length) {
+        dierr = ErrnoOrGeneric();
+        LOGI("  GDFile WriteAt failed on %lu bytes (actual=%ld err=%d)",
+            (unsigned long) length, (long) actual, dierr);
+        return dierr;
+    }
+    return kDIErrNone;
+}
+
+/*
+ * The file holds the data as-is, so just hand back the descriptor, once
+ * anything stdio is holding has been written.
+ */
+bool GFDFile::GetHostRange(di_off_t offset, di_off_t length, int* pFd,
+    di_off_t* pHostOffset)
+{
+#ifdef HAVE_FSEEKO
+    int fd = GetSyncedFd();
+#else
+    int fd = fFd;
+#endif
+
+    if (fd < 0 || offset < 0 || length < 0)
+        return false;
+    *pFd = fd;
+    *pHostOffset = offset;
+    return true;
+}
+#endif /*HAVE_PREAD*/
+
+#ifdef HAVE_POSIX_FADVISE
+/*
+ * Ask the kernel to start reading the range into the page cache.  It
+ * queues the reads and returns, so on a network filesystem the round
+ * trips overlap with whatever we do next.
+ */
+void GFDFile::Prefetch(di_off_t offset, di_off_t length)
+{
+#ifdef HAVE_FSEEKO
+    int fd = (fFp != NULL) ? fileno(fFp) : -1;
+#else
+    int fd = fFd;
+#endif
+
+    if (fd < 0 || offset < 0 || length <= 0)
+        return;
+    (void) posix_fadvise(fd, offset, length, POSIX_FADV_WILLNEED);
+}
+#endif /*HAVE_POSIX_FADVISE*/
+
 
 /*
  * ===========================================================================
@@ -551,6 +720,58 @@ DIError GFDBuffer::Seek(di_off_t offset, DIWhence whence)
     return kDIErrNone;
 }
 
+/*
+ * Positional read.  This is just a memcpy, so it's safe to do from
+ * several threads at once.
+ */
+DIError GFDBuffer::ReadAt(di_off_t offset, void* buf, size_t length,
+    size_t* pActual)
+{
+    if (fBuffer == NULL)
+        return kDIErrNotReady;
+    if (length == 0 || offset < 0)
+        return kDIErrInvalidArg;
+
+    if (offset + (long)length > fLength) {
+        if (pActual == NULL) {
+            LOGW("  GFDBuffer underrrun off=%ld len=%lu flen=%ld",
+                (long) offset, (unsigned long) length, (long) fLength);
+            return kDIErrDataUnderrun;
+        }
+        if (offset >= fLength) {
+            *pActual = 0;
+            return kDIErrEOF;
+        }
+        length = (size_t) (fLength - offset);
+    }
+    if (pActual != NULL)
+        *pActual = length;
+
+    memcpy(buf, (const char*)fBuffer + offset, length);
+    return kDIErrNone;
+}
+
+/*
+ * Positional write.  Writes that would expand the buffer go through the
+ * regular Write call; those reallocate the buffer, so they mustn't happen
+ * while other threads are reading.
+ */
+DIError GFDBuffer::WriteAt(di_off_t offset, const void* buf, size_t length,
+    size_t* pActual)
+{
+    if (fBuffer == NULL)
+        return kDIErrNotReady;
+    if (offset < 0)
+        return kDIErrInvalidArg;
+    assert(pActual == NULL);     // not handling this yet
+
+    if (offset + (long)length > fLength)
+        return GenericFD::WriteAt(offset, buf, length, pActual);
+
+    memcpy((char*)fBuffer + offset, buf, length);
+    return kDIErrNone;
+}
+
 di_off_t GFDBuffer::Tell(void)
 {
     if (fBuffer == NULL)
@@ -864,3 +1085,760 @@ DIError GFDWinVolume::Close(void)
     return kDIErrNone;
 }
 #endif /*_WIN32*/
+
+
+#ifdef HAVE_BLOCK_DEVICE
+/*
+ * ===========================================================================
+ *      GFDBlockDevice
+ * ===========================================================================
+ */
+
+/*
+ * Open a block device or a regular file.
+ *
+ * O_DIRECT transfers must be a multiple of the device's logical sector
+ * size.  The tracks are aligned, so only the last one can be short; if the
+ * device doesn't end on a sector boundary (e.g. a .2mg file with its
+ * 64-byte header), we just go through the page cache instead.  We don't
+ * know the sector size of a regular file's filesystem, so we assume the
+ * worst (kBufAlign).
+ */
+DIError GFDBlockDevice::Open(const char* deviceName, bool readOnly)
+{
+    DIError dierr = kDIErrNone;
+    int flags = readOnly ? O_RDONLY : O_RDWR;
+    struct stat sb;
+    int i;
+
+    if (fFd >= 0)
+        return kDIErrAlreadyOpen;
+    if (deviceName == NULL)
+        return kDIErrInvalidArg;
+    if (deviceName[0] == '\0')
+        return kDIErrInvalidArg;
+
+    delete[] fPathName;
+    fPathName = new char[strlen(deviceName) +1];
+    strcpy(fPathName, deviceName);
+
+    fFd = open(deviceName, flags | O_DIRECT, 0);
+    if (fFd >= 0) {
+        fDirectIO = true;
+    } else if (errno == EINVAL) {
+        // some filesystems (e.g. tmpfs) don't do O_DIRECT
+        fFd = open(deviceName, flags, 0);
+        fDirectIO = false;
+    }
+    if (fFd < 0) {
+        if (errno == EACCES)
+            dierr = kDIErrAccessDenied;
+        else
+            dierr = ErrnoOrGeneric();
+        LOGW("  GFDBlockDevice Open failed opening '%s', ro=%d (err=%d)",
+            deviceName, readOnly, dierr);
+        goto bail;
+    }
+
+    if (fstat(fFd, &sb) != 0) {
+        dierr = ErrnoOrGeneric();
+        LOGW("  GFDBlockDevice fstat failed (err=%d)", dierr);
+        goto bail;
+    }
+    if (S_ISBLK(sb.st_mode)) {
+        uint64_t size64 = 0;
+        int sectorSize = 0;
+
+        if (ioctl(fFd, BLKGETSIZE64, &size64) != 0) {
+            dierr = ErrnoOrGeneric();
+            LOGW("  GFDBlockDevice BLKGETSIZE64 failed (err=%d)", dierr);
+            goto bail;
+        }
+        if (ioctl(fFd, BLKSSZGET, &sectorSize) != 0 || sectorSize <= 0)
+            sectorSize = 512;
+        fDeviceEOF = (di_off_t) size64;
+        fSectorSize = sectorSize;
+    } else if (S_ISREG(sb.st_mode)) {
+        fDeviceEOF = sb.st_size;
+        fSectorSize = kBufAlign;
+    } else {
+        LOGW("  GFDBlockDevice '%s' is not a block device or file",
+            deviceName);
+        dierr = kDIErrNotSupported;
+        goto bail;
+    }
+
+    if (fDirectIO && (fSectorSize > kBufAlign ||
+        (fDeviceEOF % fSectorSize) != 0))
+    {
+        DropDirectIO();
+    }
+
+    for (i = 0; i < kNumTracks; i++) {
+        void* buf;
+        if (posix_memalign(&buf, kBufAlign, kTrackSize) != 0) {
+            dierr = kDIErrMalloc;
+            goto bail;
+        }
+        fTracks[i].buf = (uint8_t*) buf;
+        fTracks[i].start = -1;
+        fTracks[i].length = 0;
+        fTracks[i].dirty = false;
+        fTracks[i].lastUse = 0;
+    }
+    for (i = 0; i < kNumPrefetchThreads; i++) {
+        void* buf;
+        if (posix_memalign(&buf, kBufAlign, kTrackSize) != 0) {
+            dierr = kDIErrMalloc;
+            goto bail;
+        }
+        fPrefetchBufs[i] = (uint8_t*) buf;
+        fPrefetchInFlight[i] = -1;
+    }
+    fUseCounter = 0;
+    fCurrentOffset = 0;
+    fReadOnly = readOnly;
+
+    LOGI("  GFDBlockDevice: '%s' is %.2fMB, sector size %d, direct=%d",
+        deviceName, fDeviceEOF / (1024.0 * 1024.0), fSectorSize,
+        (bool) fDirectIO);
+
+bail:
+    if (dierr != kDIErrNone)
+        Close();
+    return dierr;
+}
+
+/*
+ * Does "pathName" refer to a block device (/dev/sdb, /dev/loop0)?
+ */
+/*static*/ bool GFDBlockDevice::IsBlockDevice(const char* pathName)
+{
+    struct stat sb;
+
+    if (pathName == NULL || stat(pathName, &sb) != 0)
+        return false;
+    return S_ISBLK(sb.st_mode);
+}
+
+/*
+ * Switch to buffered I/O.  Linux lets us clear O_DIRECT on an open fd.
+ */
+void GFDBlockDevice::DropDirectIO(void)
+{
+    int flags = fcntl(fFd, F_GETFL);
+
+    if (flags != -1)
+        (void) fcntl(fFd, F_SETFL, flags & ~O_DIRECT);
+    fDirectIO = false;
+}
+
+/*
+ * Read or write one track.  The buffer, the start, and (when O_DIRECT is
+ * in use) the length are all suitably aligned.  If the device rejects the
+ * transfer anyway, we drop O_DIRECT and try again.
+ *
+ * This doesn't touch the cache, so the prefetch threads call it without
+ * holding fCacheLock.
+ */
+DIError GFDBlockDevice::TransferTrackBuf(di_off_t start, int length,
+    uint8_t* buf, bool doWrite)
+{
+    DIError dierr;
+    size_t done = 0;
+
+    assert(start >= 0);
+    assert((start & (kTrackSize - 1)) == 0);
+
+    while (done < (size_t) length) {
+        ssize_t actual;
+
+        if (doWrite)
+            actual = ::pwrite(fFd, buf + done, length - done, start + done);
+        else
+            actual = ::pread(fFd, buf + done, length - done, start + done);
+        if (actual < 0 && errno == EINTR)
+            continue;
+        if (actual < 0 && errno == EINVAL && fDirectIO) {
+            LOGI("  GFDBlockDevice: O_DIRECT transfer rejected, dropping it");
+            DropDirectIO();
+            continue;
+        }
+        if (actual <= 0) {
+            if (actual == 0)
+                dierr = doWrite ? kDIErrWriteFailed : kDIErrReadFailed;
+            else
+                dierr = ErrnoOrGeneric();
+            LOGI("  GFDBlockDevice %s failed at %lld+%lu (err=%d)",
+                doWrite ? "write" : "read", (long long) start,
+                (unsigned long) done, dierr);
+            return dierr;
+        }
+        done += actual;
+    }
+    return kDIErrNone;
+}
+
+/*
+ * Read or write one cached track.
+ *
+ * Call with fCacheLock held.
+ */
+DIError GFDBlockDevice::TransferTrack(CachedTrack* pTrack, bool doWrite)
+{
+    return TransferTrackBuf(pTrack->start, pTrack->length, pTrack->buf,
+                doWrite);
+}
+
+/*
+ * Find a track in the cache, without counting it as a use.
+ *
+ * Call with fCacheLock held.
+ */
+GFDBlockDevice::CachedTrack* GFDBlockDevice::FindTrack(di_off_t trackStart)
+{
+    for (int i = 0; i < kNumTracks; i++) {
+        if (fTracks[i].start == trackStart)
+            return &fTracks[i];
+    }
+    return NULL;
+}
+
+/*
+ * Is the track waiting to be prefetched, or being read right now?
+ *
+ * Call with fCacheLock held.
+ */
+bool GFDBlockDevice::IsPrefetchPending(di_off_t trackStart) const
+{
+    for (int i = 0; i < kNumPrefetchThreads; i++) {
+        if (fPrefetchInFlight[i] == trackStart)
+            return true;
+    }
+    for (size_t i = 0; i < fPrefetchQueue.size(); i++) {
+        if (fPrefetchQueue[i] == trackStart)
+            return true;
+    }
+    return false;
+}
+
+/*
+ * Find the track that starts at "trackStart", reading it in if necessary.
+ * The least recently used track is evicted, which means writing it back
+ * if it's dirty.  If the caller is about to overwrite the entire track,
+ * we don't bother reading it.
+ *
+ * If a prefetch thread is reading the track, we wait for it.  If it's
+ * still in the prefetch queue, we take it out and read it ourselves.
+ *
+ * Call with "lock" (on fCacheLock) held.
+ */
+DIError GFDBlockDevice::GetTrack(std::unique_lock<std::mutex>& lock,
+    di_off_t trackStart, bool willOverwrite, CachedTrack** ppTrack)
+{
+    DIError dierr;
+    CachedTrack* pVictim = NULL;
+    int i;
+
+    while (true) {
+        CachedTrack* pTrack = FindTrack(trackStart);
+        if (pTrack != NULL) {
+            pTrack->lastUse = ++fUseCounter;
+            *ppTrack = pTrack;
+            return kDIErrNone;
+        }
+
+        bool inFlight = false;
+        for (i = 0; i < kNumPrefetchThreads; i++) {
+            if (fPrefetchInFlight[i] == trackStart)
+                inFlight = true;
+        }
+        if (!inFlight)
+            break;
+        fPrefetchDone.wait(lock);
+    }
+
+    for (std::deque<di_off_t>::iterator it = fPrefetchQueue.begin();
+        it != fPrefetchQueue.end(); ++it)
+    {
+        if (*it == trackStart) {
+            fPrefetchQueue.erase(it);
+            break;
+        }
+    }
+
+    for (i = 0; i < kNumTracks; i++) {
+        CachedTrack* pTrack = &fTracks[i];
+        if (pVictim == NULL || pTrack->lastUse < pVictim->lastUse)
+            pVictim = pTrack;
+    }
+
+    if (pVictim->dirty) {
+        dierr = TransferTrack(pVictim, true);
+        if (dierr != kDIErrNone)
+            return dierr;
+        pVictim->dirty = false;
+    }
+
+    pVictim->start = trackStart;
+    if (fDeviceEOF - trackStart < kTrackSize)
+        pVictim->length = (int) (fDeviceEOF - trackStart);
+    else
+        pVictim->length = kTrackSize;
+    if (!willOverwrite) {
+        dierr = TransferTrack(pVictim, false);
+        if (dierr != kDIErrNone) {
+            pVictim->start = -1;
+            pVictim->lastUse = 0;
+            return dierr;
+        }
+    }
+    pVictim->lastUse = ++fUseCounter;
+    *ppTrack = pVictim;
+    return kDIErrNone;
+}
+
+/*
+ * Write all dirty tracks, in ascending order, so the device sees one
+ * sequential pass.
+ *
+ * Call with fCacheLock held.
+ */
+DIError GFDBlockDevice::WriteDirtyTracks(void)
+{
+    DIError dierr;
+
+    while (true) {
+        CachedTrack* pNext = NULL;
+        for (int i = 0; i < kNumTracks; i++) {
+            if (fTracks[i].dirty &&
+                (pNext == NULL || fTracks[i].start < pNext->start))
+            {
+                pNext = &fTracks[i];
+            }
+        }
+        if (pNext == NULL)
+            break;
+
+        dierr = TransferTrack(pNext, true);
+        if (dierr != kDIErrNone)
+            return dierr;
+        pNext->dirty = false;
+    }
+    return kDIErrNone;
+}
+
+DIError GFDBlockDevice::ReadAt(di_off_t offset, void* buf, size_t length,
+    size_t* pActual)
+{
+    DIError dierr = kDIErrNone;
+    uint8_t* outp = (uint8_t*) buf;
+    size_t remaining;
+
+    if (fFd < 0)
+        return kDIErrNotReady;
+    if (offset < 0)
+        return kDIErrInvalidArg;
+
+    // don't allow reading past the end of the device
+    if (offset + (di_off_t) length > fDeviceEOF) {
+        if (pActual == NULL)
+            return kDIErrDataUnderrun;
+        length = offset < fDeviceEOF ? (size_t) (fDeviceEOF - offset) : 0;
+    }
+
+    std::unique_lock<std::mutex> lock(fCacheLock);
+    remaining = length;
+    while (remaining != 0) {
+        di_off_t trackStart = offset & ~((di_off_t) kTrackSize - 1);
+        int trackOffset = (int) (offset - trackStart);
+        CachedTrack* pTrack;
+        size_t thisCount;
+
+        dierr = GetTrack(lock, trackStart, false, &pTrack);
+        if (dierr != kDIErrNone)
+            return dierr;
+
+        thisCount = pTrack->length - trackOffset;
+        if (thisCount > remaining)
+            thisCount = remaining;
+        memcpy(outp, pTrack->buf + trackOffset, thisCount);
+
+        outp += thisCount;
+        offset += thisCount;
+        remaining -= thisCount;
+    }
+
+    if (pActual != NULL)
+        *pActual = length;
+    return kDIErrNone;
+}
+
+DIError GFDBlockDevice::WriteAt(di_off_t offset, const void* buf,
+    size_t length, size_t* pActual)
+{
+    DIError dierr = kDIErrNone;
+    const uint8_t* inp = (const uint8_t*) buf;
+    size_t remaining;
+
+    if (fFd < 0)
+        return kDIErrNotReady;
+    if (fReadOnly)
+        return kDIErrAccessDenied;
+    if (offset < 0)
+        return kDIErrInvalidArg;
+
+    // don't allow writing past the end of the device
+    if (offset + (di_off_t) length > fDeviceEOF) {
+        if (pActual == NULL)
+            return kDIErrDataOverrun;
+        length = offset < fDeviceEOF ? (size_t) (fDeviceEOF - offset) : 0;
+    }
+
+    std::unique_lock<std::mutex> lock(fCacheLock);
+    remaining = length;
+    while (remaining != 0) {
+        di_off_t trackStart = offset & ~((di_off_t) kTrackSize - 1);
+        int trackOffset = (int) (offset - trackStart);
+        di_off_t trackLen = fDeviceEOF - trackStart;
+        CachedTrack* pTrack;
+        size_t thisCount;
+
+        if (trackLen > kTrackSize)
+            trackLen = kTrackSize;
+        dierr = GetTrack(lock, trackStart,
+                    trackOffset == 0 && (di_off_t) remaining >= trackLen,
+                    &pTrack);
+        if (dierr != kDIErrNone)
+            return dierr;
+
+        thisCount = pTrack->length - trackOffset;
+        if (thisCount > remaining)
+            thisCount = remaining;
+        memcpy(pTrack->buf + trackOffset, inp, thisCount);
+        pTrack->dirty = true;
+
+        inp += thisCount;
+        offset += thisCount;
+        remaining -= thisCount;
+    }
+
+    if (pActual != NULL)
+        *pActual = length;
+    return kDIErrNone;
+}
+
+/*
+ * Queue up the tracks in the range for the prefetch threads, starting the
+ * threads if this is the first time.  We only keep a few tracks queued;
+ * any more would just push out what the reader is working on.
+ */
+void GFDBlockDevice::Prefetch(di_off_t offset, di_off_t length)
+{
+    bool added = false;
+
+    if (fFd < 0 || offset < 0 || length <= 0 || offset >= fDeviceEOF)
+        return;
+    if (offset + length > fDeviceEOF)
+        length = fDeviceEOF - offset;
+
+    std::lock_guard<std::mutex> lock(fCacheLock);
+    for (di_off_t trackStart = offset & ~((di_off_t) kTrackSize - 1);
+        trackStart < offset + length; trackStart += kTrackSize)
+    {
+        if ((int) fPrefetchQueue.size() >= kMaxPrefetchQueue)
+            break;
+        if (FindTrack(trackStart) != NULL || IsPrefetchPending(trackStart))
+            continue;
+        fPrefetchQueue.push_back(trackStart);
+        added = true;
+    }
+    if (!added)
+        return;
+
+    if (!fPrefetchStarted) {
+        for (int i = 0; i < kNumPrefetchThreads; i++) {
+            fPrefetchThreads[i] =
+                std::thread(&GFDBlockDevice::PrefetchThread, this, i);
+        }
+        fPrefetchStarted = true;
+    }
+    fPrefetchCond.notify_all();
+}
+
+/*
+ * Prefetch thread.  Reads a queued track into our spare buffer, then
+ * swaps it with the least recently used clean track in the cache.  If
+ * everything is dirty, the data is dropped.
+ *
+ * Nobody else can load the track while we're reading it (GetTrack waits
+ * for us), so it can't be changed out from under us.
+ */
+void GFDBlockDevice::PrefetchThread(int idx)
+{
+    std::unique_lock<std::mutex> lock(fCacheLock);
+
+    while (true) {
+        while (!fPrefetchStop && fPrefetchQueue.empty())
+            fPrefetchCond.wait(lock);
+        if (fPrefetchStop)
+            break;
+
+        di_off_t trackStart = fPrefetchQueue.front();
+        fPrefetchQueue.pop_front();
+        if (FindTrack(trackStart) != NULL)
+            continue;
+
+        int length = kTrackSize;
+        if (fDeviceEOF - trackStart < kTrackSize)
+            length = (int) (fDeviceEOF - trackStart);
+
+        fPrefetchInFlight[idx] = trackStart;
+        lock.unlock();
+        DIError dierr = TransferTrackBuf(trackStart, length,
+                            fPrefetchBufs[idx], false);
+        lock.lock();
+        fPrefetchInFlight[idx] = -1;
+
+        if (dierr == kDIErrNone) {
+            CachedTrack* pVictim = NULL;
+            for (int i = 0; i < kNumTracks; i++) {
+                CachedTrack* pTrack = &fTracks[i];
+                if (!pTrack->dirty &&
+                    (pVictim == NULL || pTrack->lastUse < pVictim->lastUse))
+                {
+                    pVictim = pTrack;
+                }
+            }
+            if (pVictim != NULL) {
+                uint8_t* tmp = pVictim->buf;
+                pVictim->buf = fPrefetchBufs[idx];
+                fPrefetchBufs[idx] = tmp;
+                pVictim->start = trackStart;
+                pVictim->length = length;
+                pVictim->lastUse = ++fUseCounter;
+            }
+        }
+        fPrefetchDone.notify_all();
+    }
+}
+
+/*
+ * Shut down the prefetch threads.  Anything still queued is dropped.
+ */
+void GFDBlockDevice::StopPrefetch(void)
+{
+    if (!fPrefetchStarted)
+        return;
+
+    {
+        std::lock_guard<std::mutex> lock(fCacheLock);
+        fPrefetchStop = true;
+        fPrefetchQueue.clear();
+    }
+    fPrefetchCond.notify_all();
+    for (int i = 0; i < kNumPrefetchThreads; i++)
+        fPrefetchThreads[i].join();
+
+    fPrefetchStop = false;
+    fPrefetchStarted = false;
+}
+
+DIError GFDBlockDevice::Read(void* buf, size_t length, size_t* pActual)
+{
+    DIError dierr;
+
+    dierr = ReadAt(fCurrentOffset, buf, length, pActual);
+    if (dierr == kDIErrNone)
+        fCurrentOffset += (pActual != NULL) ? *pActual : length;
+    return dierr;
+}
+
+DIError GFDBlockDevice::Write(const void* buf, size_t length, size_t* pActual)
+{
+    DIError dierr;
+
+    dierr = WriteAt(fCurrentOffset, buf, length, pActual);
+    if (dierr == kDIErrNone)
+        fCurrentOffset += (pActual != NULL) ? *pActual : length;
+    return dierr;
+}
+
+DIError GFDBlockDevice::Seek(di_off_t offset, DIWhence whence)
+{
+    if (fFd < 0)
+        return kDIErrNotReady;
+
+    switch (whence) {
+    case kSeekSet:
+        if (offset < 0 || offset > fDeviceEOF)
+            return kDIErrInvalidArg;
+        fCurrentOffset = offset;
+        break;
+    case kSeekEnd:
+        if (offset > 0 || offset < -fDeviceEOF)
+            return kDIErrInvalidArg;
+        fCurrentOffset = fDeviceEOF + offset;
+        break;
+    case kSeekCur:
+        if (offset < -fCurrentOffset ||
+            offset > (fDeviceEOF - fCurrentOffset))
+        {
+            return kDIErrInvalidArg;
+        }
+        fCurrentOffset += offset;
+        break;
+    default:
+        assert(false);
+        return kDIErrInvalidArg;
+    }
+
+    assert(fCurrentOffset >= 0 && fCurrentOffset <= fDeviceEOF);
+    return kDIErrNone;
+}
+
+di_off_t GFDBlockDevice::Tell(void)
+{
+    if (fFd < 0)
+        return (di_off_t) -1;
+    return fCurrentOffset;
+}
+
+/*
+ * Push the dirty tracks out, then make sure the device has them.  Removable
+ * cards tend to get yanked out right after we say we're done.
+ */
+DIError GFDBlockDevice::Flush(void)
+{
+    DIError dierr;
+
+    if (fFd < 0)
+        return kDIErrNotReady;
+    if (fReadOnly)
+        return kDIErrNone;
+
+    {
+        std::lock_guard<std::mutex> lock(fCacheLock);
+        dierr = WriteDirtyTracks();
+    }
+    if (dierr != kDIErrNone)
+        return dierr;
+
+    if (fsync(fFd) != 0) {
+        dierr = ErrnoOrGeneric();
+        LOGI("  GFDBlockDevice fsync failed (err=%d)", dierr);
+        return dierr;
+    }
+    return kDIErrNone;
+}
+
+/*
+ * Close the device, writing anything that's still in the cache.
+ */
+DIError GFDBlockDevice::Close(void)
+{
+    DIError dierr = kDIErrNone;
+
+    StopPrefetch();
+    if (fFd >= 0) {
+        LOGI("  GFDBlockDevice closing '%s'", fPathName);
+        dierr = Flush();
+        ::close(fFd);
+        fFd = -1;
+    } else {
+        dierr = kDIErrNotReady;
+    }
+
+    for (int i = 0; i < kNumTracks; i++) {
+        free(fTracks[i].buf);
+        fTracks[i].buf = NULL;
+        fTracks[i].start = -1;
+        fTracks[i].dirty = false;
+        fTracks[i].lastUse = 0;
+    }
+    for (int i = 0; i < kNumPrefetchThreads; i++) {
+        free(fPrefetchBufs[i]);
+        fPrefetchBufs[i] = NULL;
+        fPrefetchInFlight[i] = -1;
+    }
+    fDirectIO = false;
+    return dierr;
+}
+
+#endif /*HAVE_BLOCK_DEVICE*/
+
+
+/*
+ * ===========================================================================
+ *      GFDGFD
+ * ===========================================================================
+ */
+
+DIError GFDGFD::Read(void* buf, size_t length, size_t* pActual)
+{
+    DIError dierr;
+
+    dierr = ReadAt(fCurrentOffset, buf, length, pActual);
+    if (dierr == kDIErrNone)
+        fCurrentOffset += (pActual != NULL) ? *pActual : length;
+    return dierr;
+}
+
+DIError GFDGFD::Write(const void* buf, size_t length, size_t* pActual)
+{
+    DIError dierr;
+
+    dierr = WriteAt(fCurrentOffset, buf, length, pActual);
+    if (dierr == kDIErrNone)
+        fCurrentOffset += (pActual != NULL) ? *pActual : length;
+    return dierr;
+}
+
+/*
+ * Seeking relative to the end asks the underlying GFD where its end is,
+ * which moves its file position.  That's fine for the single-threaded
+ * callers that do it (image creation and flushing).
+ */
+DIError GFDGFD::Seek(di_off_t offset, DIWhence whence)
+{
+    DIError dierr;
+    di_off_t newOffset;
+
+    if (fpGFD == NULL)
+        return kDIErrNotReady;
+
+    switch (whence) {
+    case kSeekSet:
+        newOffset = offset;
+        break;
+    case kSeekCur:
+        newOffset = fCurrentOffset + offset;
+        break;
+    case kSeekEnd:
+        dierr = fpGFD->Seek(0, kSeekEnd);
+        if (dierr != kDIErrNone)
+            return dierr;
+        newOffset = fpGFD->Tell() - fOffset + offset;
+        break;
+    default:
+        assert(false);
+        return kDIErrInvalidArg;
+    }
+
+    if (newOffset < 0)
+        return kDIErrInvalidArg;
+    fCurrentOffset = newOffset;
+    return kDIErrNone;
+}
+
+DIError GFDGFD::Truncate(void)
+{
+    DIError dierr;
+
+    if (fpGFD == NULL)
+        return kDIErrNotReady;
+    dierr = fpGFD->Seek(fOffset + fCurrentOffset, kSeekSet);
+    if (dierr != kDIErrNone)
+        return dierr;
+    return fpGFD->Truncate();
+}
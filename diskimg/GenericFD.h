@@ -10,6 +10,13 @@
 #define DISKIMG_GENERICFD_H
 
 #include "Win32BlockIO.h"
+#include <mutex>
+#include <atomic>
+#ifdef HAVE_BLOCK_DEVICE
+# include <thread>
+# include <deque>
+# include <condition_variable>
+#endif
 
 namespace DiskImgLib {
 
@@ -117,6 +124,40 @@ public:
 
     virtual bool GetReadOnly(void) const { return fReadOnly; }
 
+    /*
+     * Read or write at a specific offset, without moving the file position.
+     * These may be called from several threads at once (e.g. by GFDGFD
+     * views of different partitions), but don't mix them with the regular
+     * Seek/Read/Write calls from other threads.
+     *
+     * The default implementation seeks and transfers while holding a lock,
+     * so it does move the file position.  Sub-classes that can do better
+     * (pread, memcpy) override it.
+     */
+    virtual DIError ReadAt(di_off_t offset, void* buf, size_t length,
+        size_t* pActual = NULL);
+    virtual DIError WriteAt(di_off_t offset, const void* buf, size_t length,
+        size_t* pActual = NULL);
+
+    /*
+     * Hint that "length" bytes at "offset" will be read soon.  Sub-classes
+     * that can start the reads in the background do so; nothing waits for
+     * them, and errors are ignored (the real read will report them).
+     */
+    virtual void Prefetch(di_off_t offset, di_off_t length) {}
+
+    /*
+     * If the "length" bytes at "offset" are stored as-is in a host file,
+     * return its descriptor and the matching offset in it, so the kernel
+     * can copy them (copy_file_range, sendfile).  Anything we're holding
+     * in buffers is written out first.  The descriptor still belongs to
+     * the GFD.  Returns false for memory buffers, and for devices with a
+     * cache of their own.
+     */
+    virtual bool GetHostRange(di_off_t offset, di_off_t length, int* pFd,
+        di_off_t* pHostOffset)
+        { return false; }
+
     /*
     typedef enum {
         kGFDTypeUnknown = 0,
@@ -140,12 +181,13 @@ protected:
     GenericFD(const GenericFD&);
 
     bool        fReadOnly;      // set when file is opened
+    std::mutex  fPositionLock;  // held by default ReadAt/WriteAt
 };
 
 class GFDFile : public GenericFD {
 public:
 #ifdef HAVE_FSEEKO
-    GFDFile(void) : fPathName(NULL), fFp(NULL) {}
+    GFDFile(void) : fPathName(NULL), fFp(NULL), fStdioUsed(false) {}
 #else
     GFDFile(void) : fPathName(NULL), fFd(-1) {}
 #endif
@@ -162,11 +204,28 @@ public:
     virtual DIError Close(void);
     virtual const char* GetPathName(void) const { return fPathName; }
 
+#ifdef HAVE_PREAD
+    virtual DIError ReadAt(di_off_t offset, void* buf, size_t length,
+        size_t* pActual = NULL);
+    virtual DIError WriteAt(di_off_t offset, const void* buf, size_t length,
+        size_t* pActual = NULL);
+    virtual bool GetHostRange(di_off_t offset, di_off_t length, int* pFd,
+        di_off_t* pHostOffset);
+#endif
+#ifdef HAVE_POSIX_FADVISE
+    virtual void Prefetch(di_off_t offset, di_off_t length);
+#endif
+
 private:
     char*       fPathName;
 
 #ifdef HAVE_FSEEKO
+    int GetSyncedFd(void);
+
     FILE*       fFp;
+    // set when stdio may be holding buffered data that pread/pwrite
+    // can't see
+    std::atomic<bool> fStdioUsed;
 #else
     int         fFd;
 #endif
@@ -205,6 +264,127 @@ private:
 };
 #endif
 
+#ifdef HAVE_BLOCK_DEVICE
+/*
+ * Raw access to a block device, such as a CF or SD card in a USB reader.
+ * Also works on regular files, which is handy for testing.
+ *
+ * We try to open the device with O_DIRECT, so that imaging an 8GB card
+ * doesn't push everything else out of the page cache.  That requires
+ * aligned buffers, offsets, and lengths, so all I/O goes through a small
+ * cache of aligned "tracks".  A miss reads the whole track, which gives us
+ * readahead for free.  Writes stay in the cache until the track is evicted
+ * or Flush is called.
+ *
+ * ReadAt and WriteAt lock the cache, so they can be called from several
+ * threads at once.
+ *
+ * Prefetch hands tracks to a couple of background threads, which read them
+ * into spare buffers and swap them into the cache.  A reader that misses
+ * on a track being prefetched waits for it rather than reading it again.
+ */
+class GFDBlockDevice : public GenericFD {
+public:
+    GFDBlockDevice(void) :
+        fPathName(NULL),
+        fFd(-1),
+        fDirectIO(false),
+        fDeviceEOF(-1),
+        fSectorSize(0),
+        fCurrentOffset(0),
+        fUseCounter(0),
+        fPrefetchStop(false),
+        fPrefetchStarted(false)
+    {
+        for (int i = 0; i < kNumTracks; i++) {
+            fTracks[i].start = -1;
+            fTracks[i].length = 0;
+            fTracks[i].dirty = false;
+            fTracks[i].lastUse = 0;
+            fTracks[i].buf = NULL;
+        }
+        for (int i = 0; i < kNumPrefetchThreads; i++) {
+            fPrefetchBufs[i] = NULL;
+            fPrefetchInFlight[i] = -1;
+        }
+    }
+    virtual ~GFDBlockDevice(void) { Close(); delete[] fPathName; }
+
+    virtual DIError Open(const char* deviceName, bool readOnly);
+    virtual DIError Read(void* buf, size_t length,
+        size_t* pActual = NULL);
+    virtual DIError Write(const void* buf, size_t length,
+        size_t* pActual = NULL);
+    virtual DIError Seek(di_off_t offset, DIWhence whence);
+    virtual di_off_t Tell(void);
+    virtual DIError Truncate(void) { return kDIErrNotSupported; }
+    virtual DIError Close(void);
+    virtual const char* GetPathName(void) const { return fPathName; }
+
+    // Write dirty tracks and ask the device to commit them.
+    virtual DIError Flush(void);
+
+    virtual DIError ReadAt(di_off_t offset, void* buf, size_t length,
+        size_t* pActual = NULL);
+    virtual DIError WriteAt(di_off_t offset, const void* buf, size_t length,
+        size_t* pActual = NULL);
+    virtual void Prefetch(di_off_t offset, di_off_t length);
+
+    // Does "pathName" name a block device?
+    static bool IsBlockDevice(const char* pathName);
+
+    // Did we get O_DIRECT?  (Not all filesystems support it.)
+    bool GetDirectIO(void) const { return fDirectIO; }
+
+private:
+    enum {
+        kTrackSize = 64 * 1024,     // unit of readahead; must be power of 2
+        kNumTracks = 16,
+        kBufAlign = 4096,           // enough for any O_DIRECT device
+        kNumPrefetchThreads = 2,
+        kMaxPrefetchQueue = kNumTracks / 2, // leave room for the reader
+    };
+    typedef struct CachedTrack {
+        di_off_t    start;          // -1 if empty
+        int         length;         // short for the last track on the device
+        bool        dirty;
+        unsigned long lastUse;
+        uint8_t*    buf;            // kTrackSize bytes, kBufAlign-aligned
+    } CachedTrack;
+
+    DIError GetTrack(std::unique_lock<std::mutex>& lock, di_off_t trackStart,
+        bool willOverwrite, CachedTrack** ppTrack);
+    DIError TransferTrack(CachedTrack* pTrack, bool doWrite);
+    DIError TransferTrackBuf(di_off_t start, int length, uint8_t* buf,
+        bool doWrite);
+    DIError WriteDirtyTracks(void);
+    void DropDirectIO(void);
+    CachedTrack* FindTrack(di_off_t trackStart);
+    bool IsPrefetchPending(di_off_t trackStart) const;
+    void PrefetchThread(int idx);
+    void StopPrefetch(void);
+
+    char*       fPathName;
+    int         fFd;
+    std::atomic<bool> fDirectIO;    // prefetch threads may clear it
+    di_off_t    fDeviceEOF;
+    int         fSectorSize;    // O_DIRECT transfer alignment
+    di_off_t    fCurrentOffset;
+    unsigned long fUseCounter;
+    std::mutex  fCacheLock;     // guards everything below
+    CachedTrack fTracks[kNumTracks];
+
+    std::condition_variable fPrefetchCond;  // work for the threads
+    std::condition_variable fPrefetchDone;  // a prefetch read finished
+    std::deque<di_off_t> fPrefetchQueue;
+    std::thread fPrefetchThreads[kNumPrefetchThreads];
+    uint8_t*    fPrefetchBufs[kNumPrefetchThreads];
+    di_off_t    fPrefetchInFlight[kNumPrefetchThreads];   // -1 if idle
+    bool        fPrefetchStop;
+    bool        fPrefetchStarted;
+};
+#endif
+
 class GFDBuffer : public GenericFD {
 public:
     GFDBuffer(void) :
@@ -241,6 +421,11 @@ public:
     virtual DIError Close(void);
     virtual const char* GetPathName(void) const { return NULL; }
 
+    virtual DIError ReadAt(di_off_t offset, void* buf, size_t length,
+        size_t* pActual = NULL);
+    virtual DIError WriteAt(di_off_t offset, const void* buf, size_t length,
+        size_t* pActual = NULL);
+
     // Back door; try not to use this.
     void* GetBuffer(void) const { return fBuffer; }
 
@@ -275,10 +460,14 @@ private:
 };
 #endif
 
-/* pass all requests straight through to another GFD (with offset bias) */
+/*
+ * Pass all requests through to another GFD, with an offset bias.  We keep
+ * our own file position and use positional reads and writes on the other
+ * GFD, so sibling views don't disturb each other.
+ */
 class GFDGFD : public GenericFD {
 public:
-    GFDGFD(void) : fpGFD(NULL), fOffset(0) {}
+    GFDGFD(void) : fpGFD(NULL), fOffset(0), fCurrentOffset(0) {}
     virtual ~GFDGFD(void) { Close(); }
 
     virtual DIError Open(GenericFD* pGFD, di_off_t offset, bool readOnly) {
@@ -289,28 +478,18 @@ public:
         fpGFD = pGFD;
         fOffset = offset;
         fReadOnly = readOnly;
-        Seek(0, kSeekSet);
+        fCurrentOffset = 0;
         return kDIErrNone;
     }
     virtual DIError Read(void* buf, size_t length,
-        size_t* pActual = NULL)
-    {
-        return fpGFD->Read(buf, length, pActual);
-    }
+        size_t* pActual = NULL);
     virtual DIError Write(const void* buf, size_t length,
-        size_t* pActual = NULL)
-    {
-        return fpGFD->Write(buf, length, pActual);
-    }
-    virtual DIError Seek(di_off_t offset, DIWhence whence) {
-        return fpGFD->Seek(offset + fOffset, whence);
-    }
+        size_t* pActual = NULL);
+    virtual DIError Seek(di_off_t offset, DIWhence whence);
     virtual di_off_t Tell(void) {
-        return fpGFD->Tell() -fOffset;
-    }
-    virtual DIError Truncate(void) {
-        return fpGFD->Truncate();
+        return fCurrentOffset;
     }
+    virtual DIError Truncate(void);
     virtual DIError Close(void) {
         /* do NOT close underlying descriptor */
         fpGFD = NULL;
@@ -318,9 +497,34 @@ public:
     }
     virtual const char* GetPathName(void) const { return fpGFD->GetPathName(); }
 
+    virtual DIError ReadAt(di_off_t offset, void* buf, size_t length,
+        size_t* pActual = NULL) {
+        if (fpGFD == NULL)
+            return kDIErrNotReady;
+        return fpGFD->ReadAt(fOffset + offset, buf, length, pActual);
+    }
+    virtual DIError WriteAt(di_off_t offset, const void* buf, size_t length,
+        size_t* pActual = NULL) {
+        if (fpGFD == NULL)
+            return kDIErrNotReady;
+        return fpGFD->WriteAt(fOffset + offset, buf, length, pActual);
+    }
+    virtual bool GetHostRange(di_off_t offset, di_off_t length, int* pFd,
+        di_off_t* pHostOffset) {
+        if (fpGFD == NULL)
+            return false;
+        return fpGFD->GetHostRange(fOffset + offset, length, pFd,
+                    pHostOffset);
+    }
+    virtual void Prefetch(di_off_t offset, di_off_t length) {
+        if (fpGFD != NULL)
+            fpGFD->Prefetch(fOffset + offset, length);
+    }
+
 private:
     GenericFD*  fpGFD;
     di_off_t    fOffset;
+    di_off_t    fCurrentOffset; // relative to fOffset
 };
 
 };  // namespace DiskImgLib
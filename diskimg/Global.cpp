@@ -9,8 +9,24 @@
 #include "StdAfx.h"
 #include "DiskImgPriv.h"
 #include "ASPI.h"
+#include <atomic>
+#include <mutex>
 
-/*static*/ bool Global::fAppInitCalled = false;
+/*
+ * One-time init state.  AppInit can be called from several threads at
+ * once (e.g. by independent components of a multithreaded app), so we
+ * use std::call_once to make sure exactly one of them does the work and
+ * the rest wait for it to finish.
+ */
+static std::once_flag gAppInitOnce;
+static std::atomic<bool> gAppInitCalled(false);
+static DIError gAppInitResult = kDIErrNone;
+
+/*
+ * Pointer to debug message handler function.  This can be changed while
+ * other threads are printing messages.
+ */
+static std::atomic<Global::DebugMsgHandler> gDebugMsgHandler(NULL);
 
 /*static*/ ASPI* Global::fpASPI = NULL;
 
@@ -20,16 +36,34 @@ const char* DiskImgLib::kASPIDev = "ASPI:";
 
 /*
  * Perform one-time DLL initialization.
+ *
+ * Safe to call from multiple threads.  Calls after the first return the
+ * result of the first.
  */
 /*static*/ DIError Global::AppInit(void)
 {
-    NuError nerr;
-    int32_t major, minor, bug;
-
-    if (fAppInitCalled) {
+    if (gAppInitCalled.load()) {
         LOGW("DiskImg AppInit already called");
-        return kDIErrNone;
     }
+    std::call_once(gAppInitOnce, AppInitOnce);
+    return gAppInitResult;
+}
+
+/*
+ * Returns "true" once AppInit has completed.
+ */
+/*static*/ bool Global::GetAppInitCalled(void)
+{
+    return gAppInitCalled.load();
+}
+
+/*
+ * Do the actual one-time init.  The result is left in gAppInitResult.
+ */
+/*static*/ void Global::AppInitOnce(void)
+{
+    NuError nerr;
+    int32_t major, minor, bug;
 
     LOGI("Initializing DiskImg library v%d.%d.%d",
         kDiskImgVersionMajor, kDiskImgVersionMinor, kDiskImgVersionBug);
@@ -55,19 +89,37 @@ const char* DiskImgLib::kASPIDev = "ASPI:";
     nerr = NuGetVersion(&major, &minor, &bug, NULL, NULL);
     if (nerr != kNuErrNone) {
         LOGE("Unable to get version number from NufxLib.");
-        return kDIErrNufxLibInitFailed;
+        gAppInitResult = kDIErrNufxLibInitFailed;
+        return;
     }
 
     if (major != kNuVersionMajor || minor < kNuVersionMinor) {
         LOGE("Unexpected NufxLib version %d.%d.%d",
                 major, minor, bug);
-        return kDIErrNufxLibInitFailed;
+        gAppInitResult = kDIErrNufxLibInitFailed;
+        return;
     }
 
     /*
-     * Do one-time init over in the DiskImg class.
+     * The nibble tables are constant, but make sure they agree.
      */
-    DiskImg::CalcNibbleInvTables();
+    DiskImg::CheckNibbleInvTables();
+
+    /*
+     * Load the C library's time zone info now, while we're still (probably)
+     * single-threaded.  localtime_r() and mktime() are reentrant, but they
+     * set up the time zone state lazily, so get that out of the way.  (Our
+     * own calls are serialized anyway; see LocalTime and MakeTime.)
+     */
+#ifdef _WIN32
+    _tzset();
+#else
+    tzset();
+#endif
+#ifndef EXCISE_GPL_CODE
+    /* work out libhfs's time zone offset once, here, under our lock */
+    hfs_settzdiff(LocalTimeOffset());
+#endif
 
 #if defined(HAVE_WINDOWS_CDROM) && defined(WANT_ASPI)
     if (kAlwaysTryASPI || IsWin9x()) {
@@ -80,9 +132,8 @@ const char* DiskImgLib::kASPIDev = "ASPI:";
 #endif
     LOGD("DiskImg HasSPTI=%d HasASPI=%d", GetHasSPTI(), GetHasASPI());
 
-    fAppInitCalled = true;
-
-    return kDIErrNone;
+    gAppInitResult = kDIErrNone;
+    gAppInitCalled.store(true);
 }
 
 /*
@@ -135,21 +186,12 @@ const char* DiskImgLib::kASPIDev = "ASPI:";
 }
 
 
-/*
- * Pointer to debug message handler function.
- */
-/*static*/ Global::DebugMsgHandler Global::gDebugMsgHandler = NULL;
-
 /*
  * Change the debug message handler.  The previous handler is returned.
  */
 Global::DebugMsgHandler Global::SetDebugMsgHandler(DebugMsgHandler handler)
 {
-    DebugMsgHandler oldHandler;
-
-    oldHandler = gDebugMsgHandler;
-    gDebugMsgHandler = handler;
-    return oldHandler;
+    return gDebugMsgHandler.exchange(handler);
 }
 
 /*
@@ -160,7 +202,9 @@ Global::DebugMsgHandler Global::SetDebugMsgHandler(DebugMsgHandler handler)
  */
 /*static*/ void Global::PrintDebugMsg(const char* file, int line, const char* fmt, ...)
 {
-    if (gDebugMsgHandler == NULL) {
+    DebugMsgHandler handler = gDebugMsgHandler.load();
+
+    if (handler == NULL) {
         /*
          * This can happen if the app decides to bail with an exit()
          * call.  I'm not sure what's zapping the pointer.
@@ -187,5 +231,5 @@ Global::DebugMsgHandler Global::SetDebugMsgHandler(DebugMsgHandler handler)
 
     buf[sizeof(buf)-1] = '\0';
 
-    (*gDebugMsgHandler)(file, line, buf);
+    (*handler)(file, line, buf);
 }
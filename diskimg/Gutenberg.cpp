@@ -307,7 +307,7 @@ DIError DiskFSGutenberg::ProcessCatalogSector(int catTrack, int catSect,
         if (pEntry[0x0c] != kEntryDeleted && pEntry[0x0d] != kEntryDeleted &&
             pEntry[0x00] != 0xa0 && pEntry[0x00] != 0x00)
         {
-            pFile = new A2FileGutenberg(this);
+            pFile = new (this) A2FileGutenberg(this);
 
             pFile->SetQuality(A2File::kQualityGood);
 
@@ -20,6 +20,7 @@
  */
 #include "StdAfx.h"
 #include "DiskImgPriv.h"
+#include <vector>
 
 
 /*
@@ -84,6 +85,17 @@ typedef struct DiskFSHFS::MasterDirBlock {
 
 //}; // namespace DiskImgLib
 
+/*
+ * Extract an extent record (three extent descriptors).
+ */
+static void UnpackExtDataRec(ExtDataRec* pRec, const uint8_t* buf)
+{
+    for (int i = 0; i < 3; i++) {
+        pRec->extDescriptor[i].xdrStABN = GetShortBE(&buf[i * 4]);
+        pRec->extDescriptor[i].xdrNumABlks = GetShortBE(&buf[i * 4 + 2]);
+    }
+}
+
 /*
  * Extract fields from a Master Directory Block.
  */
@@ -117,9 +129,9 @@ typedef struct DiskFSHFS::MasterDirBlock {
     pMDB->drVBMCSize = GetShortBE(&buf[0x7e]);
     pMDB->drCtlCSize = GetShortBE(&buf[0x80]);
     pMDB->drXTFlSize = GetLongBE(&buf[0x82]);
-    //UnpackExtDataRec(&pMDB->drXTExtRec, &buf[0x86]);  // 12 bytes
+    UnpackExtDataRec(&pMDB->drXTExtRec, &buf[0x86]);    // 12 bytes
     pMDB->drCTFlSize = GetLongBE(&buf[0x92]);
-    //UnpackExtDataRec(&pMDB->drXTExtRec, &buf[0x96]);
+    UnpackExtDataRec(&pMDB->drCTExtRec, &buf[0x96]);
     // next field at 0xa2
 }
 
@@ -216,23 +228,7 @@ DIError DiskFSHFS::LoadVolHeader(void)
     uint8_t blkBuf[kBlkSize];
 
     if (fLocalTimeOffset == -1) {
-        struct tm* ptm;
-        struct tm tmWhen;
-        time_t when;
-        int isDst;
-
-        when = time(NULL);
-        isDst = localtime(&when)->tm_isdst;
-
-        ptm = gmtime(&when);
-        if (ptm != NULL) {
-            tmWhen = *ptm;  // make a copy -- static buffers in time functions
-            tmWhen.tm_isdst = isDst;
-
-            fLocalTimeOffset = (long) (when - mktime(&tmWhen));
-        } else
-            fLocalTimeOffset = 0;
-
+        fLocalTimeOffset = LocalTimeOffset();
         LOGI(" HFS computed local time offset = %.3f hours",
             fLocalTimeOffset / 3600.0);
     }
@@ -283,7 +279,7 @@ DIError DiskFSHFS::LoadVolHeader(void)
      * must come first in the file list.
      */
     A2FileHFS* pFile;
-    pFile = new A2FileHFS(this);
+    pFile = new (this) A2FileHFS(this);
     if (pFile == NULL) {
         dierr = kDIErrMalloc;
         goto bail;
@@ -351,10 +347,53 @@ void DiskFSHFS::DumpVolHeader(void)
     LOGI("  num directories=%d, num files=%d",
         fNumDirectories, fNumFiles);
     time_t when;
+    char timeBuf[kCTimeBufLen];
     when = (time_t) (fCreatedDateTime - kDateTimeOffset - fLocalTimeOffset);
-    LOGI("  cre date=0x%08x %.24s", fCreatedDateTime, ctime(&when));
+    LOGI("  cre date=0x%08x %.24s", fCreatedDateTime,
+        FormatCTime(&when, timeBuf));
     when = (time_t) (fModifiedDateTime - kDateTimeOffset - fLocalTimeOffset);
-    LOGI("  mod date=0x%08x %.24s", fModifiedDateTime, ctime(&when));
+    LOGI("  mod date=0x%08x %.24s", fModifiedDateTime,
+        FormatCTime(&when, timeBuf));
+}
+
+/*
+ * Ask for the volume bitmap and the first extents of the extents overflow
+ * and catalog files.  The catalog sweep walks the leaf nodes from one end
+ * to the other, so on a big CD-ROM image this gets most of what it needs
+ * moving before libhfs asks for the first node.
+ */
+void DiskFSHFS::PrefetchMetadata(void)
+{
+    const long kMaxPrefetch = 16384;    // 8MB
+    MasterDirBlock mdb;
+    uint8_t blkBuf[kBlkSize];
+    std::vector<long> blocks;
+
+    if (fpImg->ReadBlock(kMasterDirBlock, blkBuf) != kDIErrNone)
+        return;
+    UnpackMDB(blkBuf, &mdb);
+
+    long blocksPerAlloc = mdb.drAlBlkSiz / kBlkSize;
+    long bitmapBlocks = (mdb.drNmAlBlks + kBlkSize * 8 - 1) / (kBlkSize * 8);
+    for (long i = 0; i < bitmapBlocks; i++)
+        blocks.push_back(mdb.drVBMSt + i);
+
+    const ExtDataRec* recs[2] = { &mdb.drXTExtRec, &mdb.drCTExtRec };
+    for (int r = 0; r < 2; r++) {
+        for (int i = 0; i < 3; i++) {
+            const ExtDescriptor& ext = recs[r]->extDescriptor[i];
+            long first = mdb.drAlBlSt + ext.xdrStABN * blocksPerAlloc;
+            long count = ext.xdrNumABlks * blocksPerAlloc;
+            for (long j = 0; j < count &&
+                (long) blocks.size() < kMaxPrefetch; j++)
+            {
+                blocks.push_back(first + j);
+            }
+        }
+    }
+
+    if (!blocks.empty())
+        fpImg->PrefetchBlocks(&blocks[0], (int) blocks.size());
 }
 
 
@@ -382,6 +421,8 @@ DIError DiskFSHFS::Initialize(InitMode initMode)
         goto bail;
     }
 
+    PrefetchMetadata();
+
     sprintf(msg, "Scanning %s", fVolumeName);
     if (!fpImg->UpdateScanProgress(msg)) {
         LOGI(" HFS cancelled by user");
@@ -405,11 +446,39 @@ DIError DiskFSHFS::Initialize(InitMode initMode)
         return kDIErrGeneric;
     }
 
+    /*
+     * The default cache is 64KB, which is plenty for floppies but gets
+     * thrashed by catalog and extents lookups on big CD-ROM images.  Let
+     * the application ask for something larger.
+     */
+    if (GetParameter(kParmHFS_CacheSize) != 0) {
+        long cacheSize = GetParameter(kParmHFS_CacheSize);
+        if (cacheSize < 0)
+            cacheSize = 0;      // negative means "no cache"
+        if (hfs_setcachesize(fHfsVol, (unsigned int) cacheSize) != 0) {
+            LOGW(" HFS unable to set cache size to %ld: %s",
+                cacheSize, hfs_error);
+        } else {
+            LOGD(" HFS cache size set to %ld blocks", cacheSize);
+        }
+    }
+
     /* volume dir is guaranteed to come first; if not, we need a lookup func */
     A2FileHFS* pVolumeDir;
     pVolumeDir = (A2FileHFS*) GetNextFile(NULL);
 
-    dierr = RecursiveDirAdd(pVolumeDir, ":", 0);
+    /*
+     * Read the whole catalog in one pass.  If the catalog is damaged in a
+     * way that stops the sweep before we've added anything, try walking
+     * the tree one directory at a time, which may get further.
+     */
+    dierr = SweepCatalog(pVolumeDir);
+    if (dierr != kDIErrNone && dierr != kDIErrCancelled &&
+        GetNextFile(pVolumeDir) == NULL)
+    {
+        LOGI(" HFS catalog sweep failed, trying directory walk");
+        dierr = RecursiveDirAdd(pVolumeDir, ":", 0);
+    }
     if (dierr != kDIErrNone)
         goto bail;
 
@@ -500,8 +569,213 @@ DIError DiskFSHFS::GetFreeSpaceCount(long* pTotalUnits, long* pFreeUnits,
     return kDIErrNone;
 }
 
+/*
+ * Report libhfs block cache activity.
+ */
+DIError DiskFSHFS::GetCacheStats(CacheStats* pStats) const
+{
+    hfscachestats stats;
+
+    if (fHfsVol == NULL || hfs_cachestats(fHfsVol, &stats) != 0)
+        return kDIErrNotReady;
+
+    pStats->size = stats.size;
+    pStats->hits = stats.hits;
+    pStats->misses = stats.misses;
+    pStats->evictions = stats.evictions;
+    pStats->bypassed = stats.bypassed;
+    return kDIErrNone;
+}
+
+/*
+ * One file or directory found by the catalog sweep.
+ */
+struct DiskFSHFS::SweepEntry {
+    uint32_t    parentID;       // CNID of parent directory
+    long        seq;            // position in sweep, for a stable sort
+    A2FileHFS*  pFile;          // set to NULL once it's in the file list
+};
+
+/*
+ * State shared between SweepCatalog() and the libhfs callback.
+ */
+struct DiskFSHFS::SweepState {
+    DiskFSHFS*  pDiskFS;
+    SweepEntry* entries;
+    long        count;
+    long        alloc;
+    bool        cancelled;
+};
+
+/*
+ * Sort sweep entries by parent CNID, then by name.  This is the catalog
+ * key order, which is what hfs_readdir() would give us.
+ */
+/*static*/ int DiskFSHFS::CompareSweepEntries(const void* vp1, const void* vp2)
+{
+    const SweepEntry* pEntry1 = (const SweepEntry*) vp1;
+    const SweepEntry* pEntry2 = (const SweepEntry*) vp2;
+
+    if (pEntry1->parentID != pEntry2->parentID)
+        return pEntry1->parentID < pEntry2->parentID ? -1 : 1;
+    int cmp = CompareMacFileNames(pEntry1->pFile->fFileName,
+                pEntry2->pFile->fFileName);
+    if (cmp != 0)
+        return cmp;
+    if (pEntry1->seq != pEntry2->seq)
+        return pEntry1->seq < pEntry2->seq ? -1 : 1;
+    return 0;
+}
+
+/*
+ * Build the file list from a single sequential pass over the catalog
+ * B*-tree leaf nodes, instead of opening every directory by name.
+ *
+ * The sweep visits nodes in the order they appear in the catalog file,
+ * so the contents of a directory may come before the directory itself.
+ * We gather everything up, sort it into catalog key order, and then add
+ * it to the file list depth-first, which gives the same order as
+ * RecursiveDirAdd().  Entries that can't be reached from the root
+ * directory are discarded, as they would be by a directory walk.
+ */
+DIError DiskFSHFS::SweepCatalog(A2File* pVolumeDir)
+{
+    DIError dierr = kDIErrNone;
+    SweepState state;
+    long idx, orphans;
+
+    state.pDiskFS = this;
+    state.entries = NULL;
+    state.count = state.alloc = 0;
+    state.cancelled = false;
+
+    if (hfs_sweepcat(fHfsVol, SweepCallback, &state) != 0) {
+        if (state.cancelled) {
+            LOGI(" HFS cancelled by user");
+            dierr = kDIErrCancelled;
+        } else {
+            LOGI(" HFS catalog sweep failed after %ld entries: %s",
+                state.count, hfs_error);
+            dierr = kDIErrBadDirectory;
+        }
+        goto bail;
+    }
+
+    qsort(state.entries, state.count, sizeof(SweepEntry), CompareSweepEntries);
+
+    dierr = AddSweptFiles(&state, pVolumeDir, HFS_CNID_ROOTDIR, "", 0);
+
+bail:
+    orphans = 0;
+    for (idx = 0; idx < state.count; idx++) {
+        if (state.entries[idx].pFile != NULL) {
+            delete state.entries[idx].pFile;
+            orphans++;
+        }
+    }
+    if (orphans != 0 && dierr == kDIErrNone) {
+        LOGI(" HFS ignoring %ld catalog entries not reachable from root",
+            orphans);
+    }
+    delete[] state.entries;
+    return dierr;
+}
+
+/*
+ * Called by libhfs for every file and directory in the catalog.  Returns
+ * nonzero to stop the sweep.
+ */
+/*static*/ int DiskFSHFS::SweepCallback(void* vState, const hfsdirent* dirEntry)
+{
+    SweepState* pState = (SweepState*) vState;
+
+    /* the root directory is already in the list as the volume dir */
+    if (dirEntry->parid == HFS_CNID_ROOTPAR)
+        return 0;
+
+    if (pState->count == pState->alloc) {
+        long newAlloc = pState->alloc ? pState->alloc * 2 : 256;
+        SweepEntry* newEntries = new SweepEntry[newAlloc];
+        if (newEntries == NULL)
+            return -1;
+        if (pState->count != 0) {
+            memcpy(newEntries, pState->entries,
+                pState->count * sizeof(SweepEntry));
+        }
+        delete[] pState->entries;
+        pState->entries = newEntries;
+        pState->alloc = newAlloc;
+    }
+
+    A2FileHFS* pFile = new (pState->pDiskFS) A2FileHFS(pState->pDiskFS);
+    pFile->InitEntry(dirEntry);
+
+    SweepEntry* pEntry = &pState->entries[pState->count];
+    pEntry->parentID = pFile->fParentCNID;
+    pEntry->seq = pState->count;
+    pEntry->pFile = pFile;
+    pState->count++;
+
+    if (!pState->pDiskFS->fpImg->UpdateScanProgress(NULL)) {
+        pState->cancelled = true;
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Add the swept entries for directory "dirID" to the file list, recursing
+ * into subdirectories.  The entries must already be sorted.
+ */
+DIError DiskFSHFS::AddSweptFiles(SweepState* pState, A2File* pParent,
+    uint32_t dirID, const char* basePath, int depth)
+{
+    DIError dierr = kDIErrNone;
+    long lo, hi, mid, idx;
+
+    /* if we get too deep, assume it's a loop */
+    if (depth > kMaxDirectoryDepth)
+        return kDIErrDirectoryLoop;
+
+    /* find the first entry in this directory */
+    lo = 0;
+    hi = pState->count;
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if (pState->entries[mid].parentID < dirID)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    for (idx = lo; idx < pState->count &&
+        pState->entries[idx].parentID == dirID; idx++)
+    {
+        A2FileHFS* pFile = pState->entries[idx].pFile;
+        if (pFile == NULL)
+            continue;       // already added; damaged catalog?
+        pState->entries[idx].pFile = NULL;
+
+        pFile->SetPathName(basePath, pFile->fFileName);
+        pFile->SetParent(pParent);
+        AddFileToList(pFile);
+
+        if (pFile->fIsDir) {
+            dierr = AddSweptFiles(pState, pFile, pFile->fCNID,
+                        pFile->GetPathName(), depth+1);
+            if (dierr != kDIErrNone)
+                break;
+        }
+    }
+
+    return dierr;
+}
+
 /*
  * Recursively traverse the filesystem.
+ *
+ * This is the old way of building the file list.  It opens every directory
+ * by pathname, so it's much slower than SweepCatalog() on large volumes.
  */
 DIError DiskFSHFS::RecursiveDirAdd(A2File* pParent, const char* basePath, int depth)
 {
@@ -542,7 +816,7 @@ DIError DiskFSHFS::RecursiveDirAdd(A2File* pParent, const char* basePath, int de
     while (hfs_readdir(dir, &dirEntry) != -1) {
         A2FileHFS* pFile;
 
-        pFile = new A2FileHFS(this);
+        pFile = new (this) A2FileHFS(this);
 
         pFile->InitEntry(&dirEntry);
 
@@ -622,6 +896,9 @@ void A2FileHFS::InitEntry(const hfsdirent* dirEntry)
      */
     fCreateWhen = dirEntry->crdate;
     fModWhen = dirEntry->mddate;
+
+    fCNID = dirEntry->cnid;
+    fParentCNID = dirEntry->parid;
 }
 
 /*
@@ -1217,7 +1494,7 @@ DIError DiskFSHFS::CreateFile(const CreateParms* pParms, A2File** ppNewFile)
      *
      * Create a new entry and set the structure fields.
      */
-    pNewFile = new A2FileHFS(this);
+    pNewFile = new (this) A2FileHFS(this);
     pNewFile->InitEntry(&dirEnt);
     pNewFile->SetPathName(basePath == NULL ? "" : basePath, pNewFile->fFileName);
     pNewFile->SetParent(pSubdir);
@@ -1716,15 +1993,13 @@ uint32_t A2FileHFS::GetAuxType(void) const
 void A2FileHFS::SetPathName(const char* basePath, const char* fileName)
 {
     assert(basePath != NULL && fileName != NULL);
-    if (fPathName != NULL)
-        delete[] fPathName;
 
     // strip leading ':' (but treat ":" specially for volume dir entry)
     if (basePath[0] == ':' && basePath[1] != '\0')
         basePath++;
 
     int baseLen = strlen(basePath);
-    fPathName = new char[baseLen + 1 + strlen(fileName)+1];
+    fPathName = AllocPathName(fPathName, baseLen + 1 + strlen(fileName)+1);
     strcpy(fPathName, basePath);
     if (baseLen != 0 &&
         !(baseLen == 1 && basePath[0] == ':'))
@@ -1802,6 +2077,9 @@ char* A2FileHFS::GetLibHFSPathName(void) const
 /*
  * Open a file through libhfs.
  *
+ * We normally open files by CNID, which avoids resolving the pathname one
+ * directory at a time.  If that fails we fall back on the pathname.
+ *
  * libhfs wants filenames to begin with ':' unless they start with the
  * name of the volume.  This is the opposite of the convention followed
  * by the rest of CiderPress (and most of the civilized world), so instead
@@ -1820,14 +2098,24 @@ DIError A2FileHFS::Open(A2FileDescr** ppOpenFile, bool readOnly,
     //if (rsrcFork && fRsrcLength < 0)
     //  return kDIErrForkNotFound;
 
-    nameBuf = GetLibHFSPathName();
-
     DiskFSHFS* pDiskFS = (DiskFSHFS*) GetDiskFS();
-    pHfsFile = hfs_open(pDiskFS->GetHfsVol(), nameBuf);
+    pHfsFile = NULL;
+    if (fCNID != 0) {
+        pHfsFile = hfs_openbyid(pDiskFS->GetHfsVol(), fCNID, fParentCNID,
+                    fFileName);
+        if (pHfsFile == NULL) {
+            LOGI(" HFS hfs_openbyid(%u, '%s') failed: %s",
+                fCNID, fFileName, hfs_error);
+        }
+    }
     if (pHfsFile == NULL) {
-        LOGI(" HFS hfs_open(%s) failed: %s", nameBuf, hfs_error);
-        dierr = kDIErrGeneric;  // better value might be in errno
-        goto bail;
+        nameBuf = GetLibHFSPathName();
+        pHfsFile = hfs_open(pDiskFS->GetHfsVol(), nameBuf);
+        if (pHfsFile == NULL) {
+            LOGI(" HFS hfs_open(%s) failed: %s", nameBuf, hfs_error);
+            dierr = kDIErrGeneric;  // better value might be in errno
+            goto bail;
+        }
     }
     hfs_setfork(pHfsFile, rsrcFork ? 1 : 0);
 
@@ -2097,13 +2385,14 @@ void DiskFSHFS::CreateFakeFile(void)
     char dateBuf[32];
     long capacity;
     const char* timeStr;
+    char timeBuf[kCTimeBufLen];
 
     capacity = (fAllocationBlockSize / kBlkSize) * fNumAllocationBlocks;
 
     /* get the mod time, format it, and remove the trailing '\n' */
     time_t when =
         (time_t) (fModifiedDateTime - kDateTimeOffset - fLocalTimeOffset);
-    timeStr = ctime(&when);
+    timeStr = FormatCTime(&when, timeBuf);
     if (timeStr == NULL) {
         LOGI("Invalid date %ld (orig=%ld)", when, fModifiedDateTime);
         strcpy(dateBuf, "<no date>");
@@ -2122,7 +2411,7 @@ void DiskFSHFS::CreateFakeFile(void)
         fNumDirectories,
         dateBuf);
 
-    pFile = new A2FileHFS(this);
+    pFile = new (this) A2FileHFS(this);
     pFile->fIsDir = false;
     pFile->fIsVolumeDir = false;
     pFile->fType = 0;
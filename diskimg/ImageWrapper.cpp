@@ -760,12 +760,13 @@ bail:
  */
 void WrapperNuFX::UNIXTimeToDateTime(const time_t* pWhen, NuDateTime *pDateTime)
 {
+    struct tm tmbuf;
     struct tm* ptm;
 
     assert(pWhen != NULL);
     assert(pDateTime != NULL);
 
-    ptm = localtime(pWhen);
+    ptm = LocalTime(pWhen, &tmbuf);
     pDateTime->second = ptm->tm_sec;
     pDateTime->minute = ptm->tm_min;
     pDateTime->hour = ptm->tm_hour;
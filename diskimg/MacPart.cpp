@@ -244,19 +244,21 @@ bail:
 
 
 /*
- * Open up a sub-volume.
+ * Open up a sub-volume.  This may be called on a worker thread.
+ *
+ * "pJob->numBlocks" has already been trimmed to fit by FindSubVolumes.
  */
-DIError DiskFSMacPart::OpenSubVolume(const PartitionMap* pMap)
+DIError DiskFSMacPart::OpenPartition(PartitionJob* pJob)
 {
     DIError dierr = kDIErrNone;
     DiskFS* pNewFS = NULL;
     DiskImg* pNewImg = NULL;
+    const PartitionMap* pMap = (const PartitionMap*) pJob->pCookie;
     long startBlock, numBlocks;
-    bool tweaked = false;
 
     assert(pMap != NULL);
-    startBlock = pMap->pmPyPartStart;
-    numBlocks = pMap->pmPartBlkCnt;
+    startBlock = pJob->startBlock;
+    numBlocks = pJob->numBlocks;
 
     LOGI("Adding '%s' (%s) %ld +%ld",
         pMap->pmPartName, pMap->pmParType, startBlock, numBlocks);
@@ -266,16 +268,6 @@ DIError DiskFSMacPart::OpenSubVolume(const PartitionMap* pMap)
             startBlock, fpImg->GetNumBlocks());
         return kDIErrBadPartition;
     }
-    if (startBlock + numBlocks > fpImg->GetNumBlocks()) {
-        LOGI("MacPart partition too large (%ld vs %ld avail)",
-            numBlocks, fpImg->GetNumBlocks() - startBlock);
-        fpImg->AddNote(DiskImg::kNoteInfo,
-            "Reduced partition '%s' (%s) from %ld blocks to %ld.\n",
-            pMap->pmPartName, pMap->pmParType, numBlocks,
-            fpImg->GetNumBlocks() - startBlock);
-        numBlocks = fpImg->GetNumBlocks() - startBlock;
-        tweaked = true;
-    }
 
     pNewImg = new DiskImg;
     if (pNewImg == NULL) {
@@ -283,19 +275,6 @@ DIError DiskFSMacPart::OpenSubVolume(const PartitionMap* pMap)
         goto bail;
     }
 
-    /*
-     * If "tweaked" is true, we want to make the volume read-only, so that the
-     * volume copier doesn't stomp on it (on the off chance we've got it
-     * wrong).  However, that won't stop the volume copier from stomping on
-     * the entire thing, so we really need to change *all* members of the
-     * diskimg tree to be read-only.  This seems counter-productive though.
-     *
-     * So far the only actual occurrence of tweakedness was from the first
-     * Apple "develop" CD-ROM, which had a bad Apple_Extra partition on the
-     * end.
-     */
-    (void) tweaked;
-
     dierr = pNewImg->OpenImage(fpImg, startBlock, numBlocks);
     if (dierr != kDIErrNone) {
         LOGI(" MacPartSub: OpenImage(%ld,%ld) failed (err=%d)",
@@ -362,8 +341,9 @@ DIError DiskFSMacPart::OpenSubVolume(const PartitionMap* pMap)
         goto bail;
     }
 
-    /* add it to the list */
-    AddSubVolumeToList(pNewImg, pNewFS);
+    /* hand it back; FindSubVolumes adds it to the list */
+    pJob->pNewImg = pNewImg;
+    pJob->pNewFS = pNewFS;
     pNewImg = NULL;
     pNewFS = NULL;
 
@@ -422,49 +402,118 @@ DIError DiskFSMacPart::Initialize(void)
  *
  * Because the partitions are explicitly typed, we don't need to probe
  * their contents.  But we do anyway.
+ *
+ * The whole map is read first, then the partitions are opened (possibly
+ * several at once), then they're added to the list in map order.
  */
 DIError DiskFSMacPart::FindSubVolumes(void)
 {
     DIError dierr = kDIErrNone;
     uint8_t buf[kBlkSize];
-    PartitionMap map;
-    int i, numMapBlocks;
+    PartitionMap* maps = NULL;
+    PartitionJob* jobs = NULL;
+    int i, numMapBlocks = 0;
 
     dierr = fpImg->ReadBlock(kPartMapStart, buf);
     if (dierr != kDIErrNone)
         goto bail;
-    UnpackPartitionMap(buf, &map);
-    numMapBlocks = map.pmMapBlkCnt;
+    numMapBlocks = (int) GetLongBE(&buf[0x04]);     // pmMapBlkCnt
+    if (numMapBlocks <= 0 || numMapBlocks > 256) {
+        LOGI(" MacPart unreasonable pmMapBlkCnt value %d", numMapBlocks);
+        numMapBlocks = 0;
+        dierr = kDIErrBadPartition;
+        goto bail;
+    }
+
+    maps = new PartitionMap[numMapBlocks];
+    jobs = new PartitionJob[numMapBlocks];
+    if (maps == NULL || jobs == NULL) {
+        dierr = kDIErrMalloc;
+        goto bail;
+    }
+    for (i = 0; i < numMapBlocks; i++) {
+        jobs[i].pNewImg = NULL;
+        jobs[i].pNewFS = NULL;
+    }
 
     for (i = 0; i < numMapBlocks; i++) {
+        const PartitionMap* pMap = &maps[i];
+
         if (i != 0) {
             dierr = fpImg->ReadBlock(kPartMapStart+i, buf);
             if (dierr != kDIErrNone)
                 goto bail;
-            UnpackPartitionMap(buf, &map);
         }
-        DumpPartitionMap(kPartMapStart+i, &map);
+        UnpackPartitionMap(buf, &maps[i]);
+        DumpPartitionMap(kPartMapStart+i, pMap);
+
+        jobs[i].startBlock = pMap->pmPyPartStart;
+        jobs[i].numBlocks = pMap->pmPartBlkCnt;
+        jobs[i].pCookie = pMap;
+
+        /*
+         * If the partition runs off the end, trim it.  We'd like to make
+         * the trimmed volume read-only, so that the volume copier doesn't
+         * stomp on it (on the off chance we've got it wrong).  However,
+         * that won't stop the volume copier from stomping on the entire
+         * thing, so we really need to change *all* members of the diskimg
+         * tree to be read-only.  This seems counter-productive though.
+         *
+         * So far the only actual occurrence of this was from the first
+         * Apple "develop" CD-ROM, which had a bad Apple_Extra partition on
+         * the end.
+         */
+        if (jobs[i].startBlock <= fpImg->GetNumBlocks() &&
+            jobs[i].startBlock + jobs[i].numBlocks > fpImg->GetNumBlocks())
+        {
+            long avail = fpImg->GetNumBlocks() - jobs[i].startBlock;
+            LOGI("MacPart partition too large (%ld vs %ld avail)",
+                jobs[i].numBlocks, avail);
+            fpImg->AddNote(DiskImg::kNoteInfo,
+                "Reduced partition '%s' (%s) from %ld blocks to %ld.\n",
+                pMap->pmPartName, pMap->pmParType, jobs[i].numBlocks, avail);
+            jobs[i].numBlocks = avail;
+        }
+    }
 
-        dierr = OpenSubVolume(&map);
-        if (dierr != kDIErrNone) {
-            if (dierr == kDIErrCancelled)
-                goto bail;
-            DiskFS* pNewFS = NULL;
-            DiskImg* pNewImg = NULL;
-            LOGI(" MacPart failed opening sub-volume %d", i);
-            dierr = CreatePlaceholder(map.pmPyPartStart, map.pmPartBlkCnt,
-                (const char*)map.pmPartName, (const char*)map.pmParType,
-                &pNewImg, &pNewFS);
-            if (dierr == kDIErrNone) {
-                AddSubVolumeToList(pNewImg, pNewFS);
-            } else {
-                LOGI("  MacPart unable to create placeholder (err=%d)",
-                    dierr);
-                break;  // something's wrong -- bail out with error
-            }
+    dierr = OpenPartitions(jobs, numMapBlocks);
+    if (dierr != kDIErrNone)
+        goto bail;
+
+    for (i = 0; i < numMapBlocks; i++) {
+        const PartitionMap* pMap = &maps[i];
+
+        if (jobs[i].dierr == kDIErrNone) {
+            AddSubVolumeToList(jobs[i].pNewImg, jobs[i].pNewFS);
+            jobs[i].pNewImg = NULL;
+            jobs[i].pNewFS = NULL;
+            continue;
+        }
+
+        DiskFS* pNewFS = NULL;
+        DiskImg* pNewImg = NULL;
+        LOGI(" MacPart failed opening sub-volume %d", i);
+        dierr = CreatePlaceholder(jobs[i].startBlock, jobs[i].numBlocks,
+            (const char*)pMap->pmPartName, (const char*)pMap->pmParType,
+            &pNewImg, &pNewFS);
+        if (dierr == kDIErrNone) {
+            AddSubVolumeToList(pNewImg, pNewFS);
+        } else {
+            LOGI("  MacPart unable to create placeholder (err=%d)",
+                dierr);
+            break;  // something's wrong -- bail out with error
         }
     }
 
 bail:
+    if (jobs != NULL) {
+        /* anything we didn't get to */
+        for (i = 0; i < numMapBlocks; i++) {
+            delete jobs[i].pNewFS;
+            delete jobs[i].pNewImg;
+        }
+    }
+    delete[] jobs;
+    delete[] maps;
     return dierr;
 }
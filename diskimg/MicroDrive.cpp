@@ -174,14 +174,17 @@ bail:
 
 
 /*
- * Open up a sub-volume.
+ * Open up a sub-volume.  This may be called on a worker thread.
+ *
+ * "pJob->numBlocks" has already been trimmed to fit by FindSubVolumes.
  */
-DIError DiskFSMicroDrive::OpenSubVolume(long startBlock, long numBlocks)
+DIError DiskFSMicroDrive::OpenPartition(PartitionJob* pJob)
 {
     DIError dierr = kDIErrNone;
     DiskFS* pNewFS = NULL;
     DiskImg* pNewImg = NULL;
-    //bool tweaked = false;
+    long startBlock = pJob->startBlock;
+    long numBlocks = pJob->numBlocks;
 
     LOGI("Adding %ld +%ld", startBlock, numBlocks);
 
@@ -190,15 +193,6 @@ DIError DiskFSMicroDrive::OpenSubVolume(long startBlock, long numBlocks)
             startBlock, fpImg->GetNumBlocks());
         return kDIErrBadPartition;
     }
-    if (startBlock + numBlocks > fpImg->GetNumBlocks()) {
-        LOGI("MicroDrive partition too large (%ld vs %ld avail)",
-            numBlocks, fpImg->GetNumBlocks() - startBlock);
-        fpImg->AddNote(DiskImg::kNoteInfo,
-            "Reduced partition from %ld blocks to %ld.\n",
-            numBlocks, fpImg->GetNumBlocks() - startBlock);
-        numBlocks = fpImg->GetNumBlocks() - startBlock;
-        //tweaked = true;
-    }
 
     pNewImg = new DiskImg;
     if (pNewImg == NULL) {
@@ -272,8 +266,9 @@ DIError DiskFSMicroDrive::OpenSubVolume(long startBlock, long numBlocks)
         goto bail;
     }
 
-    /* add it to the list */
-    AddSubVolumeToList(pNewImg, pNewFS);
+    /* hand it back; FindSubVolumes adds it to the list */
+    pJob->pNewImg = pNewImg;
+    pJob->pNewFS = pNewFS;
     pNewImg = NULL;
     pNewFS = NULL;
 
@@ -331,13 +326,18 @@ DIError DiskFSMicroDrive::Initialize(void)
 
 /*
  * Find the various sub-volumes and open them.
+ *
+ * The partitions are opened (possibly several at once), then added to the
+ * list in table order.
  */
 DIError DiskFSMicroDrive::FindSubVolumes(void)
 {
     DIError dierr = kDIErrNone;
     uint8_t buf[kBlkSize];
     PartitionMap map;
-    int i;
+    PartitionJob jobs[kMaxNumParts * 2];
+    int partIdx[kMaxNumParts * 2];
+    int i, numJobs = 0;
 
     dierr = fpImg->ReadBlock(kPartMapBlock, buf);
     if (dierr != kDIErrNone)
@@ -346,19 +346,50 @@ DIError DiskFSMicroDrive::FindSubVolumes(void)
     DumpPartitionMap(&map);
 
     /* first part of the table */
-    for (i = 0; i < map.numPart1; i++) {
-        dierr = OpenVol(i,
-                            map.partitionStart1[i], map.partitionLength1[i]);
-        if (dierr != kDIErrNone)
-            goto bail;
+    for (i = 0; i < map.numPart1 && i < kMaxNumParts; i++) {
+        jobs[numJobs].startBlock = map.partitionStart1[i];
+        jobs[numJobs].numBlocks = map.partitionLength1[i];
+        partIdx[numJobs++] = i;
     }
 
     /* second part of the table */
-    for (i = 0; i < map.numPart2; i++) {
-        dierr = OpenVol(i + kMaxNumParts,
-                            map.partitionStart2[i], map.partitionLength2[i]);
+    for (i = 0; i < map.numPart2 && i < kMaxNumParts; i++) {
+        jobs[numJobs].startBlock = map.partitionStart2[i];
+        jobs[numJobs].numBlocks = map.partitionLength2[i];
+        partIdx[numJobs++] = i + kMaxNumParts;
+    }
+
+    for (i = 0; i < numJobs; i++) {
+        long startBlock = jobs[i].startBlock;
+        long numBlocks = jobs[i].numBlocks;
+
+        jobs[i].pCookie = NULL;
+        if (startBlock <= fpImg->GetNumBlocks() &&
+            startBlock + numBlocks > fpImg->GetNumBlocks())
+        {
+            LOGI("MicroDrive partition too large (%ld vs %ld avail)",
+                numBlocks, fpImg->GetNumBlocks() - startBlock);
+            fpImg->AddNote(DiskImg::kNoteInfo,
+                "Reduced partition from %ld blocks to %ld.\n",
+                numBlocks, fpImg->GetNumBlocks() - startBlock);
+            jobs[i].numBlocks = fpImg->GetNumBlocks() - startBlock;
+        }
+    }
+
+    dierr = OpenPartitions(jobs, numJobs);
+    if (dierr != kDIErrNone)
+        goto bail;
+
+    for (i = 0; i < numJobs; i++) {
+        dierr = AddVol(partIdx[i], &jobs[i]);
         if (dierr != kDIErrNone)
-            goto bail;
+            break;
+    }
+
+    /* anything we didn't get to */
+    for ( ; i < numJobs; i++) {
+        delete jobs[i].pNewFS;
+        delete jobs[i].pNewImg;
     }
 
 bail:
@@ -366,23 +397,23 @@ bail:
 }
 
 /*
- * Open the volume.  If it fails, open a placeholder instead.  (If *that*
- * fails, return with an error.)
+ * Add an opened volume to the list.  If it failed to open, add a
+ * placeholder instead.  (If *that* fails, return with an error.)
  */
-DIError DiskFSMicroDrive::OpenVol(int idx, long startBlock, long numBlocks)
+DIError DiskFSMicroDrive::AddVol(int idx, PartitionJob* pJob)
 {
     DIError dierr;
 
-    dierr = OpenSubVolume(startBlock, numBlocks);
-    if (dierr != kDIErrNone) {
-        if (dierr == kDIErrCancelled)
-            goto bail;
+    dierr = pJob->dierr;
+    if (dierr == kDIErrNone) {
+        AddSubVolumeToList(pJob->pNewImg, pJob->pNewFS);
+    } else {
         DiskFS* pNewFS = NULL;
         DiskImg* pNewImg = NULL;
 
         LOGW(" MicroDrive failed opening sub-volume %d", idx);
-        dierr = CreatePlaceholder(startBlock, numBlocks, NULL, NULL,
-                    &pNewImg, &pNewFS);
+        dierr = CreatePlaceholder(pJob->startBlock, pJob->numBlocks, NULL,
+                    NULL, &pNewImg, &pNewFS);
         if (dierr == kDIErrNone) {
             AddSubVolumeToList(pNewImg, pNewFS);
         } else {
@@ -392,6 +423,5 @@ DIError DiskFSMicroDrive::OpenVol(int idx, long startBlock, long numBlocks)
         }
     }
 
-bail:
     return dierr;
 }
@@ -19,13 +19,13 @@
  * ===========================================================================
  */
 
-/*static*/ uint8_t DiskImg::kDiskBytes53[32] = {
+/*static*/ const uint8_t DiskImg::kDiskBytes53[32] = {
     0xab, 0xad, 0xae, 0xaf, 0xb5, 0xb6, 0xb7, 0xba,
     0xbb, 0xbd, 0xbe, 0xbf, 0xd6, 0xd7, 0xda, 0xdb,
     0xdd, 0xde, 0xdf, 0xea, 0xeb, 0xed, 0xee, 0xef,
     0xf5, 0xf6, 0xf7, 0xfa, 0xfb, 0xfd, 0xfe, 0xff
 };
-/*static*/ uint8_t DiskImg::kDiskBytes62[64] = {
+/*static*/ const uint8_t DiskImg::kDiskBytes62[64] = {
     0x96, 0x97, 0x9a, 0x9b, 0x9d, 0x9e, 0x9f, 0xa6,
     0xa7, 0xab, 0xac, 0xad, 0xae, 0xaf, 0xb2, 0xb3,
     0xb4, 0xb5, 0xb6, 0xb7, 0xb9, 0xba, 0xbb, 0xbc,
@@ -35,29 +35,110 @@
     0xed, 0xee, 0xef, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6,
     0xf7, 0xf9, 0xfa, 0xfb, 0xfc, 0xfd, 0xfe, 0xff
 };
-/*static*/ uint8_t DiskImg::kInvDiskBytes53[256]; // all values are 0-31
-/*static*/ uint8_t DiskImg::kInvDiskBytes62[256]; // all values are 0-63
 
 /*
- * Compute tables to convert disk bytes back to values.
- *
- * Should be called once, at DLL initialization time.
+ * Tables to convert disk bytes back to values.  Invalid disk bytes map to
+ * kInvInvalidValue.  These are constant so that any number of threads can
+ * decode nibble images without coordinating.
+ */
+/*static*/ const uint8_t DiskImg::kInvDiskBytes53[256] = {
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,     // 0x00
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,     // 0x08
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,     // 0x10
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,     // 0x18
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,     // 0x20
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,     // 0x28
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,     // 0x30
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,     // 0x38
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,     // 0x40
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,     // 0x48
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,     // 0x50
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,     // 0x58
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,     // 0x60
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,     // 0x68
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,     // 0x70
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,     // 0x78
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,     // 0x80
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,     // 0x88
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,     // 0x90
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,     // 0x98
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,     // 0xa0
+    0xff, 0xff, 0xff, 0x00, 0xff, 0x01, 0x02, 0x03,     // 0xa8
+    0xff, 0xff, 0xff, 0xff, 0xff, 0x04, 0x05, 0x06,     // 0xb0
+    0xff, 0xff, 0x07, 0x08, 0xff, 0x09, 0x0a, 0x0b,     // 0xb8
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,     // 0xc0
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,     // 0xc8
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x0c, 0x0d,     // 0xd0
+    0xff, 0xff, 0x0e, 0x0f, 0xff, 0x10, 0x11, 0x12,     // 0xd8
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,     // 0xe0
+    0xff, 0xff, 0x13, 0x14, 0xff, 0x15, 0x16, 0x17,     // 0xe8
+    0xff, 0xff, 0xff, 0xff, 0xff, 0x18, 0x19, 0x1a,     // 0xf0
+    0xff, 0xff, 0x1b, 0x1c, 0xff, 0x1d, 0x1e, 0x1f      // 0xf8
+};
+/*static*/ const uint8_t DiskImg::kInvDiskBytes62[256] = {
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,     // 0x00
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,     // 0x08
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,     // 0x10
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,     // 0x18
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,     // 0x20
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,     // 0x28
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,     // 0x30
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,     // 0x38
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,     // 0x40
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,     // 0x48
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,     // 0x50
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,     // 0x58
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,     // 0x60
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,     // 0x68
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,     // 0x70
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,     // 0x78
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,     // 0x80
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,     // 0x88
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x00, 0x01,     // 0x90
+    0xff, 0xff, 0x02, 0x03, 0xff, 0x04, 0x05, 0x06,     // 0x98
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x07, 0x08,     // 0xa0
+    0xff, 0xff, 0xff, 0x09, 0x0a, 0x0b, 0x0c, 0x0d,     // 0xa8
+    0xff, 0xff, 0x0e, 0x0f, 0x10, 0x11, 0x12, 0x13,     // 0xb0
+    0xff, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0x1a,     // 0xb8
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,     // 0xc0
+    0xff, 0xff, 0xff, 0x1b, 0xff, 0x1c, 0x1d, 0x1e,     // 0xc8
+    0xff, 0xff, 0xff, 0x1f, 0xff, 0xff, 0x20, 0x21,     // 0xd0
+    0xff, 0x22, 0x23, 0x24, 0x25, 0x26, 0x27, 0x28,     // 0xd8
+    0xff, 0xff, 0xff, 0xff, 0xff, 0x29, 0x2a, 0x2b,     // 0xe0
+    0xff, 0x2c, 0x2d, 0x2e, 0x2f, 0x30, 0x31, 0x32,     // 0xe8
+    0xff, 0xff, 0x33, 0x34, 0x35, 0x36, 0x37, 0x38,     // 0xf0
+    0xff, 0x39, 0x3a, 0x3b, 0x3c, 0x3d, 0x3e, 0x3f      // 0xf8
+};
+
+/*
+ * Verify that the inverse tables agree with the forward tables.  This
+ * used to compute the inverse tables; now it's just a sanity check, run
+ * once at DLL initialization time in debug builds.
  */
-/*static*/ void DiskImg::CalcNibbleInvTables(void)
+/*static*/ void DiskImg::CheckNibbleInvTables(void)
 {
+#ifdef _DEBUG
     unsigned int i;
+    int count;
 
-    memset(kInvDiskBytes53, kInvInvalidValue, sizeof(kInvDiskBytes53));
-    for (i = 0; i < sizeof(kDiskBytes53); i++) {
-        assert(kDiskBytes53[i] >= 0x96);
-        kInvDiskBytes53[kDiskBytes53[i]] = i;
+    count = 0;
+    for (i = 0; i < sizeof(kInvDiskBytes53); i++) {
+        if (kInvDiskBytes53[i] != kInvInvalidValue) {
+            assert(kDiskBytes53[kInvDiskBytes53[i]] == i);
+            count++;
+        }
     }
+    assert(count == sizeof(kDiskBytes53));
 
-    memset(kInvDiskBytes62, kInvInvalidValue, sizeof(kInvDiskBytes62));
-    for (i = 0; i < sizeof(kDiskBytes62); i++) {
-        assert(kDiskBytes62[i] >= 0x96);
-        kInvDiskBytes62[kDiskBytes62[i]] = i;
+    count = 0;
+    for (i = 0; i < sizeof(kInvDiskBytes62); i++) {
+        if (kInvDiskBytes62[i] != kInvInvalidValue) {
+            assert(kDiskBytes62[kInvDiskBytes62[i]] == i);
+            count++;
+        }
     }
+    assert(count == sizeof(kDiskBytes62));
+#endif
 }
 
 /*
@@ -227,11 +308,281 @@ void DiskImg::EncodeNibbleData(const CircularBufferAccess& buffer, int idx,
     }
 }
 
+/*
+ * Load and store 8 bytes as a little-endian 64-bit value.  Compilers turn
+ * these into a single move on little-endian hosts.
+ */
+static inline uint64_t Load64LE(const uint8_t* ptr)
+{
+    return (uint64_t) ptr[0] | (uint64_t) ptr[1] << 8 |
+        (uint64_t) ptr[2] << 16 | (uint64_t) ptr[3] << 24 |
+        (uint64_t) ptr[4] << 32 | (uint64_t) ptr[5] << 40 |
+        (uint64_t) ptr[6] << 48 | (uint64_t) ptr[7] << 56;
+}
+static inline void Store64LE(uint8_t* ptr, uint64_t val)
+{
+    for (int i = 0; i < 8; i++) {
+        ptr[i] = (uint8_t) val;
+        val >>= 8;
+    }
+}
+
+/*
+ * Replace each byte in "buf" with the XOR of the seed, itself, and all
+ * preceding bytes.  This is the running checksum the 6&2 and 5&3 decoders
+ * maintain.  Working on eight bytes at a time cuts the serial dependency
+ * chain from one step per byte to one step per word.
+ *
+ * "len" must be a multiple of 8.
+ */
+static void PrefixXor(uint8_t* buf, int len, uint8_t seed)
+{
+    const uint64_t kSpread = 0x0101010101010101ULL;
+    uint64_t carry = seed * kSpread;
+
+    assert((len & 0x07) == 0);
+    for (int i = 0; i < len; i += 8) {
+        uint64_t val = Load64LE(buf + i);
+        val ^= val << 8;
+        val ^= val << 16;
+        val ^= val << 32;
+        val ^= carry;
+        Store64LE(buf + i, val);
+        carry = (val >> 56) * kSpread;
+    }
+}
+
+/* swap bits 0/1, 2/3, and 4/5 of a 6-bit value */
+static inline uint8_t SwapBitPairs(uint8_t val)
+{
+    return ((val & 0x15) << 1) | ((val >> 1) & 0x15);
+}
+
 /*
  * Decode 6&2 encoding.
+ *
+ * The 343 disk bytes are pulled out of the track in one piece, translated
+ * with a table, and run through PrefixXor to recover the checksum chain.
+ * After that every output byte can be computed independently.  If we find
+ * an invalid disk byte we hand off to the reference implementation, so
+ * the partially-decoded output matches exactly.
  */
-DIError DiskImg::DecodeNibble62(const CircularBufferAccess& buffer, int idx,
-    uint8_t* sctBuf, const NibbleDescr* pNibbleDescr)
+/*static*/ DIError DiskImg::DecodeNibble62(const CircularBufferAccess& buffer,
+    int idx, uint8_t* sctBuf, const NibbleDescr* pNibbleDescr)
+{
+    uint8_t raw[kDataSize62];
+    uint8_t vals[(kDataSize62 + 7) & ~7];
+    uint8_t twos[kChunkSize62 * 3];
+    const uint8_t* src;
+    uint8_t bad = 0;
+    int i;
+
+    src = buffer.GetSpan(idx, kDataSize62);
+    if (src == NULL) {
+        buffer.CopyOut(idx, raw, kDataSize62);
+        src = raw;
+    }
+
+    for (i = 0; i < kDataSize62; i++) {
+        vals[i] = kInvDiskBytes62[src[i]];
+        bad |= vals[i];
+    }
+    if (bad >= sizeof(kDiskBytes62))
+        return DecodeNibble62Ref(buffer, idx, sctBuf, pNibbleDescr);
+    for ( ; i < (int) sizeof(vals); i++)
+        vals[i] = 0;
+
+    PrefixXor(vals, sizeof(vals), pNibbleDescr->dataChecksumSeed);
+
+    for (i = 0; i < kChunkSize62; i++) {
+        uint8_t swapped = SwapBitPairs(vals[i]);
+        twos[i] = swapped & 0x03;
+        twos[i + kChunkSize62] = (swapped >> 2) & 0x03;
+        twos[i + kChunkSize62*2] = swapped >> 4;
+    }
+    for (i = 0; i < 256; i++)
+        sctBuf[i] = (uint8_t) (vals[kChunkSize62 + i] << 2) | twos[i];
+
+    /* the running checksum after the 343rd byte should be zero */
+    if (pNibbleDescr->dataVerifyChecksum && vals[kDataSize62-1] != 0) {
+        LOGI("    NIB bad data checksum");
+        return kDIErrBadChecksum;
+    }
+    return kDIErrNone;
+}
+
+/*
+ * Encode 6&2 encoding.
+ *
+ * Each disk byte depends only on two adjacent values, so we build the
+ * whole field in a linear buffer and copy it into the track at the end.
+ */
+/*static*/ void DiskImg::EncodeNibble62(const CircularBufferAccess& buffer,
+    int idx, const uint8_t* sctBuf, const NibbleDescr* pNibbleDescr)
+{
+    uint8_t vals[kDataSize62 + 1];
+    uint8_t out[kDataSize62];
+    uint8_t* dst;
+    int i;
+
+    /*
+     * vals[0] is the seed, followed by the 86 "twos" values in the order
+     * they're written (i.e. reversed), the 256 top bits, and a zero that
+     * turns the last disk byte into the checksum.
+     */
+    vals[0] = pNibbleDescr->dataChecksumSeed;
+    for (i = 0; i < kChunkSize62; i++) {
+        uint8_t twos = SwapBitPairs(sctBuf[i] & 0x03) |
+            SwapBitPairs(sctBuf[i + kChunkSize62] & 0x03) << 2;
+        if (i + kChunkSize62*2 < 256)
+            twos |= SwapBitPairs(sctBuf[i + kChunkSize62*2] & 0x03) << 4;
+        vals[1 + i] = twos;
+    }
+    for (i = 0; i < 256; i++)
+        vals[kChunkSize62 + 1 + i] = sctBuf[i] >> 2;
+    vals[kDataSize62] = 0;
+
+    dst = buffer.GetSpan(idx, kDataSize62);
+    if (dst == NULL)
+        dst = out;
+    for (i = 0; i < kDataSize62; i++) {
+        assert((vals[i] ^ vals[i+1]) < sizeof(kDiskBytes62));
+        dst[i] = kDiskBytes62[vals[i] ^ vals[i+1]];
+    }
+    if (dst == out)
+        buffer.CopyIn(idx, out, kDataSize62);
+}
+
+/*
+ * Decode 5&3 encoding.
+ *
+ * Same approach as DecodeNibble62.  Unlike 6&2, nothing is written to
+ * "sctBuf" if the checksum doesn't match.
+ */
+/*static*/ DIError DiskImg::DecodeNibble53(const CircularBufferAccess& buffer,
+    int idx, uint8_t* sctBuf, const NibbleDescr* pNibbleDescr)
+{
+    uint8_t raw[kDataSize53];
+    uint8_t vals[(kDataSize53 + 7) & ~7];
+    const uint8_t* src;
+    const uint8_t* base;
+    uint8_t bad = 0;
+    int i;
+
+    src = buffer.GetSpan(idx, kDataSize53);
+    if (src == NULL) {
+        buffer.CopyOut(idx, raw, kDataSize53);
+        src = raw;
+    }
+
+    for (i = 0; i < kDataSize53; i++) {
+        vals[i] = kInvDiskBytes53[src[i]];
+        bad |= vals[i];
+    }
+    if (bad >= sizeof(kDiskBytes53))
+        return DecodeNibble53Ref(buffer, idx, sctBuf, pNibbleDescr);
+    for ( ; i < (int) sizeof(vals); i++)
+        vals[i] = 0;
+
+    PrefixXor(vals, sizeof(vals), pNibbleDescr->dataChecksumSeed);
+
+    if (pNibbleDescr->dataVerifyChecksum && vals[kDataSize53-1] != 0) {
+        LOGI("    NIB bad data checksum (0x%02x)", vals[kDataSize53-1]);
+        return kDIErrBadChecksum;
+    }
+
+    /*
+     * The "threes" were written in reverse order, so threes[n] is found at
+     * vals[kThreeSize-1 - n].  The top five bits follow.
+     */
+    base = vals + kThreeSize;
+    uint8_t* bufPtr = sctBuf;
+    for (i = kChunkSize53-1; i >= 0; i--) {
+        int three1, three2, three3, three4, three5;
+
+        three1 = vals[kThreeSize-1 - i];
+        three2 = vals[kThreeSize-1 - (kChunkSize53 + i)];
+        three3 = vals[kThreeSize-1 - (kChunkSize53*2 + i)];
+        three4 = (three1 & 0x02) << 1 | (three2 & 0x02) | (three3 & 0x02) >> 1;
+        three5 = (three1 & 0x01) << 2 | (three2 & 0x01) << 1 | (three3 & 0x01);
+
+        *bufPtr++ = (uint8_t) (base[i] << 3) | ((three1 >> 2) & 0x07);
+        *bufPtr++ = (uint8_t) (base[kChunkSize53 + i] << 3) |
+            ((three2 >> 2) & 0x07);
+        *bufPtr++ = (uint8_t) (base[kChunkSize53*2 + i] << 3) |
+            ((three3 >> 2) & 0x07);
+        *bufPtr++ = (uint8_t) (base[kChunkSize53*3 + i] << 3) |
+            (three4 & 0x07);
+        *bufPtr++ = (uint8_t) (base[kChunkSize53*4 + i] << 3) |
+            (three5 & 0x07);
+    }
+    assert(bufPtr == sctBuf + 255);
+    *bufPtr = (uint8_t) (base[255] << 3) | (vals[0] & 0x07);
+
+    return kDIErrNone;
+}
+
+/*
+ * Encode 5&3 encoding.
+ */
+/*static*/ void DiskImg::EncodeNibble53(const CircularBufferAccess& buffer,
+    int idx, const uint8_t* sctBuf, const NibbleDescr* pNibbleDescr)
+{
+    uint8_t vals[kDataSize53 + 1];
+    uint8_t out[kDataSize53];
+    uint8_t* top;
+    uint8_t* dst;
+    int i, chunk;
+
+    /*
+     * Same layout as EncodeNibble62: seed, the "threes" in reverse order,
+     * the top five bits, and a trailing zero for the checksum.  threes[n]
+     * goes in vals[kThreeSize - n].
+     */
+    vals[0] = pNibbleDescr->dataChecksumSeed;
+    top = vals + kThreeSize + 1;
+    for (chunk = kChunkSize53-1; chunk >= 0; chunk--) {
+        int three1, three2, three3, three4, three5;
+
+        three1 = *sctBuf++;
+        three2 = *sctBuf++;
+        three3 = *sctBuf++;
+        three4 = *sctBuf++;
+        three5 = *sctBuf++;
+
+        top[chunk] = three1 >> 3;
+        top[chunk + kChunkSize53*1] = three2 >> 3;
+        top[chunk + kChunkSize53*2] = three3 >> 3;
+        top[chunk + kChunkSize53*3] = three4 >> 3;
+        top[chunk + kChunkSize53*4] = three5 >> 3;
+
+        vals[kThreeSize - chunk] =
+            (three1 & 0x07) << 2 | (three4 & 0x04) >> 1 | (three5 & 0x04) >> 2;
+        vals[kThreeSize - (chunk + kChunkSize53*1)] =
+            (three2 & 0x07) << 2 | (three4 & 0x02) | (three5 & 0x02) >> 1;
+        vals[kThreeSize - (chunk + kChunkSize53*2)] =
+            (three3 & 0x07) << 2 | (three4 & 0x01) << 1 | (three5 & 0x01);
+    }
+    top[255] = *sctBuf >> 3;
+    vals[1] = *sctBuf & 0x07;
+    vals[kDataSize53] = 0;
+
+    dst = buffer.GetSpan(idx, kDataSize53);
+    if (dst == NULL)
+        dst = out;
+    for (i = 0; i < kDataSize53; i++) {
+        assert((vals[i] ^ vals[i+1]) < sizeof(kDiskBytes53));
+        dst[i] = kDiskBytes53[vals[i] ^ vals[i+1]];
+    }
+    if (dst == out)
+        buffer.CopyIn(idx, out, kDataSize53);
+}
+
+/*
+ * Decode 6&2 encoding, one byte at a time.
+ */
+/*static*/ DIError DiskImg::DecodeNibble62Ref(const CircularBufferAccess& buffer,
+    int idx, uint8_t* sctBuf, const NibbleDescr* pNibbleDescr)
 {
     uint8_t twos[kChunkSize62 * 3];   // 258
     int chksum = pNibbleDescr->dataChecksumSeed;
@@ -286,10 +637,10 @@ DIError DiskImg::DecodeNibble62(const CircularBufferAccess& buffer, int idx,
 }
 
 /*
- * Encode 6&2 encoding.
+ * Encode 6&2 encoding, one byte at a time.
  */
-void DiskImg::EncodeNibble62(const CircularBufferAccess& buffer, int idx,
-    const uint8_t* sctBuf, const NibbleDescr* pNibbleDescr) const
+/*static*/ void DiskImg::EncodeNibble62Ref(const CircularBufferAccess& buffer,
+    int idx, const uint8_t* sctBuf, const NibbleDescr* pNibbleDescr)
 {
     uint8_t top[256];
     uint8_t twos[kChunkSize62];
@@ -329,10 +680,10 @@ void DiskImg::EncodeNibble62(const CircularBufferAccess& buffer, int idx,
 }
 
 /*
- * Decode 5&3 encoding.
+ * Decode 5&3 encoding, one byte at a time.
  */
-DIError DiskImg::DecodeNibble53(const CircularBufferAccess& buffer, int idx,
-    uint8_t* sctBuf, const NibbleDescr* pNibbleDescr)
+/*static*/ DIError DiskImg::DecodeNibble53Ref(const CircularBufferAccess& buffer,
+    int idx, uint8_t* sctBuf, const NibbleDescr* pNibbleDescr)
 {
     uint8_t base[256];
     uint8_t threes[kThreeSize];
@@ -412,10 +763,10 @@ DIError DiskImg::DecodeNibble53(const CircularBufferAccess& buffer, int idx,
 }
 
 /*
- * Encode 5&3 encoding.
+ * Encode 5&3 encoding, one byte at a time.
  */
-void DiskImg::EncodeNibble53(const CircularBufferAccess& buffer, int idx,
-    const uint8_t* sctBuf, const NibbleDescr* pNibbleDescr) const
+/*static*/ void DiskImg::EncodeNibble53Ref(const CircularBufferAccess& buffer,
+    int idx, const uint8_t* sctBuf, const NibbleDescr* pNibbleDescr)
 {
     uint8_t top[kChunkSize53 * 5 +1];     // (255 / 0xff) +1
     uint8_t threes[kChunkSize53 * 3 +1];  // (153 / 0x99) +1
@@ -584,6 +935,7 @@ DIError DiskImg::LoadNibbleTrack(long track, long* pTrackLen)
     dierr = CopyBytesOut(fNibbleTrackBuf, offset, *pTrackLen);
     if (dierr != kDIErrNone)
         return dierr;
+    AddStat(DiskImgStats::kCounterNibbleTracksRead, 1);
 
     fNibbleTrackLoaded = track;
 
@@ -857,6 +1209,7 @@ DIError DiskImg::WriteNibbleTrack(long track, const uint8_t* buf, long trackLen)
         memset(fNibbleTrackBuf, 0xff, oldTrackLen);
     memcpy(fNibbleTrackBuf, buf, trackLen);
     fpImageWrapper->SetNibbleTrackLength(track, trackLen);
+    NoteUntrackedWrite();       // no telling what sectors changed
 
     dierr = SaveNibbleTrack();
     if (dierr != kDIErrNone) {
@@ -18,6 +18,8 @@
  */
 #include "StdAfx.h"
 #include "DiskImgPriv.h"
+#include <thread>
+#include <atomic>
 
 /*
 Physical sector layout:
@@ -54,6 +56,9 @@ const int kChunkSize35 = 175;       // ceil(524 / 3)
 const int kOffsetToChecksum = 699;
 const int kNibblizedOutputLen = (kOffsetToChecksum + 4);
 const int kMaxDataReach = 48;       // should only be 6 bytes */
+const int kAddrFieldLen = 10;       // prolog through epilog
+const int kTrackOverhang35 = 1024;  // addr + data reach + data field, padded
+const int kMaxUnpackThreads35 = 8;
 
 enum {
     kAddrProlog0 = 0xd5,
@@ -101,14 +106,400 @@ enum {
     return block;
 }
 
+/*
+ * Copy a nibble track into "trackBuf", followed by the first
+ * kTrackOverhang35 bytes of the track again, so that a sector that wraps
+ * around the end can be read without bounds checks.  Very short tracks
+ * are repeated as many times as it takes.
+ *
+ * "trackBuf" must hold nibbleLen + kTrackOverhang35 bytes.
+ */
+static void LinearizeTrack35(const uint8_t* nibbleBuf, long nibbleLen,
+    uint8_t* trackBuf)
+{
+    long total = nibbleLen + kTrackOverhang35;
+    long done = 0;
+
+    while (done < total) {
+        long chunk = nibbleLen;
+        if (chunk > total - done)
+            chunk = total - done;
+        memcpy(trackBuf + done, nibbleBuf, chunk);
+        done += chunk;
+    }
+}
+
 /*
  * Unpack a nibble track.
  *
  * "outputBuf" must be able to hold 512 * 12 sectors of decoded sector data.
+ *
+ * The track is copied into a linear buffer first (see LinearizeTrack35),
+ * which lets the sector search and the decoder read it directly.  This
+ * must produce exactly what UnpackNibbleTrack35Ref does.
  */
 /*static*/ DIError DiskImg::UnpackNibbleTrack35(const uint8_t* nibbleBuf,
     long nibbleLen, uint8_t* outputBuf, int cyl, int head,
     LinearBitmap* pBadBlockMap)
+{
+    bool foundSector[kMaxSectorsPerTrack];
+    uint8_t sectorBuf[kSectorSize35];
+    uint8_t readSum[kDataChecksumLen];
+    uint8_t calcSum[kDataChecksumLen];
+    uint8_t* trackBuf;
+    int i;
+
+    assert(nibbleLen > 0);
+    trackBuf = new uint8_t[nibbleLen + kTrackOverhang35];
+    if (trackBuf == NULL)
+        return kDIErrMalloc;
+    LinearizeTrack35(nibbleBuf, nibbleLen, trackBuf);
+
+    memset(&foundSector, 0, sizeof(foundSector));
+
+    i = 0;
+    while (i < nibbleLen) {
+        int sector;
+
+        i = FindNextSector35(trackBuf, nibbleLen, i, cyl, head, &sector);
+        if (i < 0)
+            break;
+
+        assert(sector >= 0 && sector < SectorsPerTrack35(cyl));
+        if (foundSector[sector]) {
+            LOGI("Nib35: WARNING: found two copies of sect %d on cyl=%d head=%d",
+                sector, cyl, head);
+        } else if (DecodeNibbleSector35(trackBuf, i, sectorBuf, readSum,
+                    calcSum))
+        {
+            foundSector[sector] = true;
+            memcpy(outputBuf + kBlockSize * sector,
+                sectorBuf + kTagBytesLen, kBlockSize);
+
+            if (calcSum[0] != readSum[0] ||
+                calcSum[1] != readSum[1] ||
+                calcSum[2] != readSum[2])
+            {
+                LOGI("Nib35: checksum mismatch: 0x%06x vs. 0x%06x",
+                    calcSum[0] << 16 | calcSum[1] << 8 | calcSum[2],
+                    readSum[0] << 16 | readSum[1] << 8 | readSum[2]);
+                LOGI("Nib35:  marking cyl=%d head=%d sect=%d (block=%d)",
+                    cyl, head, sector,
+                    CylHeadSect35ToBlock(cyl, head, sector));
+                pBadBlockMap->Set(CylHeadSect35ToBlock(cyl, head, sector));
+            }
+        }
+    }
+
+    for (i = SectorsPerTrack35(cyl)-1; i >= 0; i--) {
+        if (!foundSector[i]) {
+            LOGI("Nib35: didn't find cyl=%d head=%d sect=%d (block=%d)",
+                cyl, head, i, CylHeadSect35ToBlock(cyl, head, i));
+            pBadBlockMap->Set(CylHeadSect35ToBlock(cyl, head, i));
+        }
+    }
+
+    delete[] trackBuf;
+    return kDIErrNone;
+}
+
+/*
+ * Returns the offset of the next sector, or -1 if we went off the end.
+ *
+ * "trackBuf" is a linearized track (see LinearizeTrack35) holding
+ * "trackLen" nibbles.
+ */
+/*static*/ int DiskImg::FindNextSector35(const uint8_t* trackBuf, int trackLen,
+    int start, int cyl, int head, int* pSector)
+{
+    const uint8_t* ptr = trackBuf + start;
+    const uint8_t* end = trackBuf + trackLen;
+
+    for ( ; ptr < end; ptr++) {
+        ptr = (const uint8_t*) memchr(ptr, kAddrProlog0, end - ptr);
+        if (ptr == NULL)
+            break;
+        if (ptr[1] != kAddrProlog1 || ptr[2] != kAddrProlog2)
+            continue;
+
+        /* decode the address field */
+        int trackNum, sectNum, side, format, checksum;
+
+        trackNum = kInvDiskBytes62[ptr[3]];
+        sectNum = kInvDiskBytes62[ptr[4]];
+        side = kInvDiskBytes62[ptr[5]];
+        format = kInvDiskBytes62[ptr[6]];
+        checksum = kInvDiskBytes62[ptr[7]];
+        if ((trackNum | sectNum | side | format | checksum) ==
+            kInvInvalidValue)
+        {
+            LOGI("Nib35: garbled address header found");
+            continue;
+        }
+        if (side != ((head * 0x20) | (cyl >> 6))) {
+            LOGI("Nib35: unexpected value for side: %d on cyl=%d head=%d",
+                side, cyl, head);
+        }
+        if (sectNum >= SectorsPerTrack35(cyl)) {
+            LOGI("Nib35: invalid value for sector: %d (cyl=%d)",
+                sectNum, cyl);
+            continue;
+        }
+        if (checksum != (trackNum ^ sectNum ^ side ^ format)) {
+            LOGI("Nib35: unexpected checksum: 0x%02x vs. 0x%02x",
+                checksum, trackNum ^ sectNum ^ side ^ format);
+            continue;
+        }
+        if (ptr[8] != kAddrEpilog0 || ptr[9] != kAddrEpilog1) {
+            LOGI("Nib35: invalid address epilog");
+        }
+
+        *pSector = sectNum;
+        return (int) (ptr - trackBuf) + kAddrFieldLen;
+    }
+
+    return -1;
+}
+
+/*
+ * Unpack a 524-byte sector from a linearized 3.5" track.  Arguments and
+ * results are the same as for DecodeNibbleSector35Ref.
+ *
+ * The whole 699-byte field goes through the inverse table in one pass,
+ * with the results ORed together to spot invalid disk bytes.  Then the
+ * bytes are reassembled and run through the checksum in a single loop,
+ * without the three intermediate arrays.
+ */
+/*static*/ bool DiskImg::DecodeNibbleSector35(const uint8_t* trackBuf,
+    int start, uint8_t* sectorBuf, uint8_t* readChecksum,
+    uint8_t* calcChecksum)
+{
+    const int kMaxDataReach35 = 48;       // keep in sync with Ref version
+    uint8_t vals[kChunkSize35 * 4];
+    const uint8_t* src;
+    const uint8_t* pv;
+    unsigned int chk0, chk1, chk2;
+    uint8_t val, bad, twos, nib0, nib1, nib2;
+    int i, off;
+
+    for (off = start; off < start + kMaxDataReach35; off++) {
+        if (trackBuf[off] == kDataProlog0 &&
+            trackBuf[off+1] == kDataProlog1 &&
+            trackBuf[off+2] == kDataProlog2)
+        {
+            break;
+        }
+    }
+    if (off == start + kMaxDataReach35) {
+        LOGI("nib25: could not find start of data field");
+        return false;
+    }
+    start = off + 4;    // 3 prolog bytes + sector number
+
+    src = trackBuf + start;
+    bad = 0;
+    for (i = 0; i < kOffsetToChecksum; i++) {
+        vals[i] = kInvDiskBytes62[src[i]];
+        bad |= vals[i];
+    }
+    vals[kOffsetToChecksum] = 0;        // missing final part2 byte
+
+    if (bad >= sizeof(kDiskBytes62)) {
+        /* report it the way the Ref version would */
+        for (i = 0; vals[i] != kInvInvalidValue; i++)
+            ;
+        off = start + (i & ~3) + 4;
+        if (off > start + kOffsetToChecksum)
+            off = start + kOffsetToChecksum;
+        LOGI("Nib25: found invalid disk byte in sector data at %d",
+            off - start);
+        LOGI("       (one of 0x%02x 0x%02x 0x%02x 0x%02x)",
+            trackBuf[off-4], trackBuf[off-3], trackBuf[off-2],
+            trackBuf[off-1]);
+        return false;
+    }
+
+    /*
+     * Same checksum as the Ref version, but the carries are added in
+     * rather than tested.  The branches are taken at random, and
+     * mispredicting them was most of the cost.  chk0's carry out of
+     * the add at the bottom of the loop is dropped, as before.
+     */
+    chk0 = chk1 = chk2 = 0;
+    pv = vals;
+    for (i = 0; i < kChunkSize35; i++, pv += 4) {
+        unsigned int carry;
+
+        twos = pv[0];
+
+        chk0 &= 0xff;
+        carry = chk0 >> 7;
+        chk0 = ((chk0 << 1) | carry) & 0xff;
+
+        val = (pv[1] | ((twos << 2) & 0xc0)) ^ chk0;
+        chk2 += val + carry;
+        *sectorBuf++ = val;
+
+        val = (pv[2] | ((twos << 4) & 0xc0)) ^ chk2;
+        chk1 += val + (chk2 >> 8);
+        chk2 &= 0xff;
+        *sectorBuf++ = val;
+
+        if (i == kChunkSize35-1)
+            break;
+
+        val = (pv[3] | ((twos << 6) & 0xc0)) ^ chk1;
+        chk0 += val + (chk1 >> 8);
+        chk1 &= 0xff;
+        *sectorBuf++ = val;
+    }
+
+    calcChecksum[0] = chk0;
+    calcChecksum[1] = chk1;
+    calcChecksum[2] = chk2;
+
+    src = trackBuf + start + kOffsetToChecksum;
+    twos = kInvDiskBytes62[src[0]];
+    nib2 = kInvDiskBytes62[src[1]];
+    nib1 = kInvDiskBytes62[src[2]];
+    nib0 = kInvDiskBytes62[src[3]];
+    if ((twos | nib0 | nib1 | nib2) == kInvInvalidValue) {
+        LOGI("nib25: found invalid disk byte in checksum");
+        LOGI("Nib35: failure reading checksum");
+        readChecksum[0] = calcChecksum[0] ^ 0xff;   // force a failure
+        return false;
+    }
+    readChecksum[0] = nib0 | ((twos << 6) & 0xc0);
+    readChecksum[1] = nib1 | ((twos << 4) & 0xc0);
+    readChecksum[2] = nib2 | ((twos << 2) & 0xc0);
+
+    if (src[4] != kDataEpilog0 || src[5] != kDataEpilog1) {
+        LOGI("nib25: WARNING: data epilog not found");
+        // allow it, if the checksum matches
+    }
+
+    return true;
+}
+
+/*
+ * Worker for UnpackNibbleTracks35.  Takes tracks until there aren't any
+ * left.
+ */
+struct UnpackTracks35State {
+    const uint8_t*  nibbleBufs;
+    const long*     nibbleLens;
+    long            bufStride;
+    int             numTracks;
+    uint8_t*        outputBuf;
+    std::atomic<int> nextTrack;
+};
+
+static void UnpackTracks35Worker(UnpackTracks35State* pState,
+    LinearBitmap* pBadBlockMap, DIError* pErr)
+{
+    int trk;
+
+    while ((trk = pState->nextTrack++) < pState->numTracks) {
+        int cyl = trk / 2;
+        int head = trk % 2;
+        DIError dierr;
+
+        dierr = DiskImg::UnpackNibbleTrack35(
+                    pState->nibbleBufs + trk * pState->bufStride,
+                    pState->nibbleLens[trk],
+                    pState->outputBuf +
+                        DiskImg::CylHeadSect35ToBlock(cyl, head, 0) * kBlockSize,
+                    cyl, head, pBadBlockMap);
+        if (dierr != kDIErrNone && *pErr == kDIErrNone)
+            *pErr = dierr;
+    }
+}
+
+/*
+ * Unpack a series of 3.5" tracks, starting at cylinder 0 head 0, into
+ * consecutive blocks of "outputBuf".  The nibbles for track N are at
+ * nibbleBufs + N * bufStride, and there are nibbleLens[N] of them.
+ *
+ * The tracks don't depend on each other, so they're handed out to a few
+ * threads.  Each thread marks bad blocks in a map of its own, because
+ * LinearBitmap isn't safe to share, and the maps are merged at the end.
+ * The output doesn't depend on the number of threads.  Pass 0 for
+ * "numThreads" to pick a number based on the CPU count.
+ */
+/*static*/ DIError DiskImg::UnpackNibbleTracks35(const uint8_t* nibbleBufs,
+    const long* nibbleLens, long bufStride, int numTracks,
+    uint8_t* outputBuf, LinearBitmap* pBadBlockMap, int numThreads)
+{
+    DIError dierr = kDIErrNone;
+    UnpackTracks35State state;
+    std::thread* threads = NULL;
+    LinearBitmap** badMaps = NULL;
+    DIError* errs = NULL;
+    int numBlocks, lastCyl, i;
+
+    assert(numTracks > 0 && numTracks <= kCylindersPerDisk * kHeadsPerCylinder);
+
+    state.nibbleBufs = nibbleBufs;
+    state.nibbleLens = nibbleLens;
+    state.bufStride = bufStride;
+    state.numTracks = numTracks;
+    state.outputBuf = outputBuf;
+    state.nextTrack = 0;
+
+    if (numThreads <= 0) {
+        numThreads = (int) std::thread::hardware_concurrency();
+        if (numThreads > kMaxUnpackThreads35)
+            numThreads = kMaxUnpackThreads35;
+    }
+    if (numThreads > numTracks)
+        numThreads = numTracks;
+
+    if (numThreads <= 1) {
+        UnpackTracks35Worker(&state, pBadBlockMap, &dierr);
+        return dierr;
+    }
+
+    lastCyl = (numTracks - 1) / 2;
+    numBlocks = CylHeadSect35ToBlock(lastCyl, (numTracks - 1) % 2, 0) +
+                SectorsPerTrack35(lastCyl);
+
+    threads = new std::thread[numThreads];
+    badMaps = new LinearBitmap*[numThreads];
+    errs = new DIError[numThreads];
+    for (i = 0; i < numThreads; i++) {
+        badMaps[i] = new LinearBitmap(numBlocks);
+        errs[i] = kDIErrNone;
+        threads[i] = std::thread(UnpackTracks35Worker, &state, badMaps[i],
+                        &errs[i]);
+    }
+
+    for (i = 0; i < numThreads; i++) {
+        threads[i].join();
+        for (int block = 0; block < numBlocks; block++) {
+            if (badMaps[i]->IsSet(block))
+                pBadBlockMap->Set(block);
+        }
+        if (errs[i] != kDIErrNone && dierr == kDIErrNone)
+            dierr = errs[i];
+        delete badMaps[i];
+    }
+
+    delete[] threads;
+    delete[] badMaps;
+    delete[] errs;
+    return dierr;
+}
+
+/*
+ * Unpack a nibble track.
+ *
+ * "outputBuf" must be able to hold 512 * 12 sectors of decoded sector data.
+ *
+ * This is the original byte-at-a-time version, kept for testing.
+ */
+/*static*/ DIError DiskImg::UnpackNibbleTrack35Ref(const uint8_t* nibbleBuf,
+    long nibbleLen, uint8_t* outputBuf, int cyl, int head,
+    LinearBitmap* pBadBlockMap)
 {
     CircularBufferAccess buffer(nibbleBuf, nibbleLen);
     bool foundSector[kMaxSectorsPerTrack];
@@ -123,7 +514,7 @@ enum {
     while (i < nibbleLen) {
         int sector;
 
-        i = FindNextSector35(buffer, i, cyl, head, &sector);
+        i = FindNextSector35Ref(buffer, i, cyl, head, &sector);
         if (i < 0)
             break;
 
@@ -133,7 +524,8 @@ enum {
                 sector, cyl, head);
         } else {
             memset(sectorBuf, 0xa9, sizeof(sectorBuf));
-            if (DecodeNibbleSector35(buffer, i, sectorBuf, readSum, calcSum))
+            if (DecodeNibbleSector35Ref(buffer, i, sectorBuf, readSum,
+                    calcSum))
             {
                 /* successfully decoded sector, copy data & verify checksum */
                 foundSector[sector] = true;
@@ -186,7 +578,7 @@ enum {
 /*
  * Returns the offset of the next sector, or -1 if we went off the end.
  */
-/*static*/ int DiskImg::FindNextSector35(const CircularBufferAccess& buffer,
+/*static*/ int DiskImg::FindNextSector35Ref(const CircularBufferAccess& buffer,
     int start, int cyl, int head, int* pSector)
 {
     int end = buffer.GetSize();
@@ -271,7 +663,7 @@ enum {
  * not return false on a checksum mismatch -- it's up to the caller to
  * verify the checksum if desired.
  */
-/*static*/ bool DiskImg::DecodeNibbleSector35(const CircularBufferAccess& buffer,
+/*static*/ bool DiskImg::DecodeNibbleSector35Ref(const CircularBufferAccess& buffer,
     int start, uint8_t* sectorBuf, uint8_t* readChecksum,
     uint8_t* calcChecksum)
 {
@@ -965,13 +965,14 @@ void OuterZip::DOSTime(time_t when, uint16_t* pDate, uint16_t* pTime)
 
     *pDate = *pTime = 0;
 
+    struct tm tmbuf;
     struct tm* ptm;
 
     /* round up to an even number of seconds */
     even = (time_t)(((unsigned long)(when) + 1) & (~1));
 
     /* expand */
-    ptm = localtime(&even);
+    ptm = LocalTime(&even, &tmbuf);
 
     int year;
     year = ptm->tm_year;
@@ -205,6 +205,7 @@ void DiskFSPascal::SetVolumeID(void)
 void DiskFSPascal::DumpVolHeader(void)
 {
     time_t access, dateSet;
+    char timeBuf[kCTimeBufLen];
 
     LOGI(" Pascal volume header for '%s'", fVolumeName);
     LOGI("   startBlock=%d nextBlock=%d",
@@ -214,8 +215,8 @@ void DiskFSPascal::DumpVolHeader(void)
 
     access = A2FilePascal::ConvertPascalDate(fAccessWhen);
     dateSet = A2FilePascal::ConvertPascalDate(fDateSetWhen);
-    LOGI("   -->access %.24s", ctime(&access));
-    LOGI("   -->dateSet %.24s", ctime(&dateSet));
+    LOGI("   -->access %.24s", FormatCTime(&access, timeBuf));
+    LOGI("   -->dateSet %.24s", FormatCTime(&dateSet, timeBuf));
 
     //LOGI("Unconvert access=0x%04x dateSet=0x%04x",
     //  A2FilePascal::ConvertPascalDate(access),
@@ -235,6 +236,7 @@ DIError DiskFSPascal::LoadCatalog(void)
 {
     DIError dierr = kDIErrNone;
     uint8_t* dirPtr;
+    long blocks[kHugeDir];
     int block, numBlocks;
 
     assert(fDirectory == NULL);
@@ -251,6 +253,10 @@ DIError DiskFSPascal::LoadCatalog(void)
         goto bail;
     }
 
+    for (int i = 0; i < numBlocks; i++)
+        blocks[i] = kVolHeaderBlock + i;
+    fpImg->PrefetchBlocks(blocks, numBlocks);
+
     block = kVolHeaderBlock;
     dirPtr = fDirectory;
     while (numBlocks--) {
@@ -324,7 +330,7 @@ DIError DiskFSPascal::ProcessCatalog(void)
 
     dirPtr = fDirectory + kDirectoryEntryLen;       // skip vol dir entry
     for (i = 0; i < fNumFiles; i++) {
-        pFile = new A2FilePascal(this);
+        pFile = new (this) A2FilePascal(this);
 
         pFile->fStartBlock = GetShortLE(&dirPtr[0x00]);
         pFile->fNextBlock = GetShortLE(&dirPtr[0x02]);
@@ -956,7 +962,7 @@ DIError DiskFSPascal::CreateFile(const CreateParms* pParms, A2File** ppNewFile)
      * Make a new entry.
      */
     time_t now;
-    pNewFile = new A2FilePascal(this);
+    pNewFile = new (this) A2FilePascal(this);
     if (pNewFile == NULL) {
         dierr = kDIErrMalloc;
         goto bail;
@@ -1479,7 +1485,7 @@ uint32_t A2FilePascal::GetFileType(void) const
     tmbuf.tm_wday = 0;
     tmbuf.tm_yday = 0;
     tmbuf.tm_isdst = -1;        // let it figure DST and time zone
-    when = mktime(&tmbuf);
+    when = MakeTime(&tmbuf);
 
     if (when == (time_t) -1)
         when = 0;
@@ -1494,12 +1500,13 @@ uint32_t A2FilePascal::GetFileType(void) const
 /*static*/ A2FilePascal::PascalDate A2FilePascal::ConvertPascalDate(time_t unixDate)
 {
     uint32_t date, year;
+    struct tm tmbuf;
     struct tm* ptm;
 
     if (unixDate == 0 || unixDate == -1 || unixDate == -2)
         return 0;
 
-    ptm = localtime(&unixDate);
+    ptm = LocalTime(&unixDate, &tmbuf);
     if (ptm == NULL)
         return 0;       // must've been invalid or unspecified
 
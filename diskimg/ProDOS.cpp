@@ -8,11 +8,14 @@
  *
  * We currently only allow one fork to be open at a time, and each file may
  * only be opened once.
- *
- * BUG: does not keep VolumeUsage up to date.
  */
 #include "StdAfx.h"
 #include "DiskImgPriv.h"
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <unordered_set>
+#include <algorithm>
 
 // disable Y2K+ dates when testing w/ProSel-16 vol rep (newer ProSel is OK)
 //#define OLD_PRODOS_DATES
@@ -60,6 +63,14 @@ typedef struct DiskFSProDOS::DirHeader {
     uint8_t     parentEntryLength;
 } DirHeader;
 
+/*
+ * The blocks in each directory, in the order they're chained together.
+ * The volume directory is keyed by the magic volume dir entry.
+ */
+struct DiskFSProDOS::DirBlockMap {
+    std::unordered_map<A2File*, std::vector<uint16_t> > dirs;
+};
+
 
 /*
  * See if this looks like a ProDOS volume.
@@ -175,6 +186,12 @@ DIError DiskFSProDOS::Initialize(InitMode initMode)
         goto bail;
     }
 
+    if (initMode == kInitCatalogOnly) {
+        LOGI(" ProDOS - catalogOnly set, deferring file scan");
+        SetInitDeferred(true);
+        goto bail;
+    }
+
     sprintf(msg, "Processing %s", fVolumeName);
     if (!fpImg->UpdateScanProgress(msg)) {
         LOGI(" ProDOS cancelled by user");
@@ -182,14 +199,36 @@ DIError DiskFSProDOS::Initialize(InitMode initMode)
         goto bail;
     }
 
-    dierr = ScanFileUsage();
+    dierr = DoDeferredInit();
+
+//  A2File* pFile;
+//  pFile = GetNextFile(NULL);
+//  while (pFile != NULL) {
+//      pFile->Dump();
+//      pFile = GetNextFile(pFile);
+//  }
+
+bail:
+    return dierr;
+}
+
+/*
+ * Walk through every file's block list to fill out the volume usage map
+ * and the sparse lengths, check the disk for damage, and look for
+ * embedded volumes.  Called from Initialize, or later if the volume was
+ * opened with kInitCatalogOnly.
+ */
+DIError DiskFSProDOS::DoDeferredInit(void)
+{
+    DIError dierr;
+
+    dierr = ScanFileUsage(false);
     if (dierr != kDIErrNone) {
         if (dierr == kDIErrCancelled)
-            goto bail;
+            return dierr;
 
         /* this might not be fatal; just means that *some* files are bad */
         LOGI("WARNING: ScanFileUsage returned err=%d", dierr);
-        dierr = kDIErrNone;
         fpImg->AddNote(DiskImg::kNoteWarning,
             "Some errors were encountered while scanning files.");
         fEarlyDamage = true;    // make sure we know it's damaged
@@ -203,15 +242,7 @@ DIError DiskFSProDOS::Initialize(InitMode initMode)
     if (fpImg->GetNumBlocks() <= 1600)
         fVolumeUsage.Dump();
 
-//  A2File* pFile;
-//  pFile = GetNextFile(NULL);
-//  while (pFile != NULL) {
-//      pFile->Dump();
-//      pFile = GetNextFile(pFile);
-//  }
-
-bail:
-    return dierr;
+    return kDIErrNone;
 }
 
 /*
@@ -220,6 +251,33 @@ bail:
  * The "test" function verified certain things, e.g. the storage type
  * is $f and the volume name length is nonzero.
  */
+/*
+ * Get the volume name out of the volume directory header block.
+ */
+/*static*/ void DiskFSProDOS::UnpackVolumeName(const uint8_t* blkBuf,
+    char* volName)
+{
+    int nameLen = blkBuf[0x04] & 0x0f;
+    memcpy(volName, &blkBuf[0x05], nameLen);
+    volName[nameLen] = '\0';
+
+    if (blkBuf[0x1b] & 0x80) {
+        /*
+         * Handle lower-case conversion; see GS/OS tech note #8.  Unlike
+         * filenames, volume names are not allowed to contain spaces.  If
+         * they try it we just ignore them.
+         *
+         * Technote 8 doesn't actually talk about volume names.  By
+         * experimentation the field was discovered at offset 0x1a from
+         * the start of the block, which is marked as "reserved" in Beneath
+         * Apple ProDOS.
+         */
+        uint16_t lcFlags = GetShortLE(&blkBuf[0x1a]);
+
+        GenerateLowerCaseName(volName, volName, lcFlags, false);
+    }
+}
+
 DIError DiskFSProDOS::LoadVolHeader(void)
 {
     DIError dierr = kDIErrNone;
@@ -233,8 +291,7 @@ DIError DiskFSProDOS::LoadVolHeader(void)
     //fPrevBlock = GetShortLE(&blkBuf[0x00]);
     //fNextBlock = GetShortLE(&blkBuf[0x02]);
     nameLen = blkBuf[0x04] & 0x0f;
-    memcpy(fVolumeName, &blkBuf[0x05], nameLen);
-    fVolumeName[nameLen] = '\0';
+    UnpackVolumeName(blkBuf, fVolumeName);
     // 0x14-15 reserved
     // undocumented: GS/OS writes the modification date to 0x16-19
     fModWhen = GetLongLE(&blkBuf[0x16]);
@@ -257,22 +314,6 @@ DIError DiskFSProDOS::LoadVolHeader(void)
     fBitMapPointer = GetShortLE(&blkBuf[0x27]);
     fTotalBlocks = GetShortLE(&blkBuf[0x29]);
 
-    if (blkBuf[0x1b] & 0x80) {
-        /*
-         * Handle lower-case conversion; see GS/OS tech note #8.  Unlike
-         * filenames, volume names are not allowed to contain spaces.  If
-         * they try it we just ignore them.
-         *
-         * Technote 8 doesn't actually talk about volume names.  By
-         * experimentation the field was discovered at offset 0x1a from
-         * the start of the block, which is marked as "reserved" in Beneath
-         * Apple ProDOS.
-         */
-        uint16_t lcFlags = GetShortLE(&blkBuf[0x1a]);
-
-        GenerateLowerCaseName(fVolumeName, fVolumeName, lcFlags, false);
-    }
-
     if (fTotalBlocks <= kVolHeaderBlock) {
         /* incr to min; don't use max, or bitmap count may be too large */
         LOGI(" ProDOS found tiny fTotalBlocks (%d), increasing to minimum",
@@ -335,7 +376,7 @@ DIError DiskFSProDOS::LoadVolHeader(void)
      * directory.  Here, we synthesize them from the volume dir header.
      */
     A2FileProDOS* pFile;
-    pFile = new A2FileProDOS(this);
+    pFile = new (this) A2FileProDOS(this);
     if (pFile == NULL) {
         dierr = kDIErrMalloc;
         goto bail;
@@ -441,7 +482,8 @@ void DiskFSProDOS::DumpVolHeader(void)
 
     time_t when;
     when = A2FileProDOS::ConvertProDate(fCreateWhen);
-    LOGI("  CreateWhen is %.24s", ctime(&when));
+    char timeBuf[kCTimeBufLen];
+    LOGI("  CreateWhen is %.24s", FormatCTime(&when, timeBuf));
 
     //LOGI("  prev=%d next=%d bitmap=%d total=%d",
     //  fPrevBlock, fNextBlock, fBitMapPointer, fTotalBlocks);
@@ -478,6 +520,14 @@ DIError DiskFSProDOS::LoadVolBitmap(void)
     fBlockUseMap = new uint8_t[kBlkSize * numBlocks];
     if (fBlockUseMap == NULL)
         return kDIErrMalloc;
+    fAllocScanStart = 0;
+
+    {
+        std::vector<long> blocks(numBlocks);
+        for (int i = 0; i < numBlocks; i++)
+            blocks[i] = bitBlock + i;
+        fpImg->PrefetchBlocks(&blocks[0], numBlocks);
+    }
 
     while (numBlocks--) {
         dierr = fpImg->ReadBlock(bitBlock + numBlocks,
@@ -489,6 +539,11 @@ DIError DiskFSProDOS::LoadVolBitmap(void)
         }
     }
 
+    numBlocks = GetNumBitmapBlocks();
+    delete[] fBlockUseMapSaved;
+    fBlockUseMapSaved = new uint8_t[kBlkSize * numBlocks];
+    memcpy(fBlockUseMapSaved, fBlockUseMap, kBlkSize * numBlocks);
+
     return kDIErrNone;
 }
 
@@ -519,6 +574,7 @@ DIError DiskFSProDOS::SaveVolBitmap(void)
             return dierr;
     }
 
+    SyncBlockUsage(true);
     return kDIErrNone;
 }
 
@@ -529,8 +585,13 @@ DIError DiskFSProDOS::SaveVolBitmap(void)
  */
 void DiskFSProDOS::FreeVolBitmap(void)
 {
+    if (fBlockUseMap != NULL && fBlockUseMapSaved != NULL)
+        SyncBlockUsage(false);
+
     delete[] fBlockUseMap;
     fBlockUseMap = NULL;
+    delete[] fBlockUseMapSaved;
+    fBlockUseMapSaved = NULL;
 }
 
 /*
@@ -547,6 +608,18 @@ DIError DiskFSProDOS::ScanVolBitmap(void)
         return dierr;
     }
 
+    MarkVolBitmap();
+
+    FreeVolBitmap();
+    return dierr;
+}
+
+/*
+ * Mark the system blocks, and the blocks the loaded volume bitmap says are
+ * in use, in the VolumeUsage map.  Updates the free block count.
+ */
+void DiskFSProDOS::MarkVolBitmap(void)
+{
     assert(fBlockUseMap != NULL);
 
     /* mark the boot blocks as system */
@@ -559,12 +632,14 @@ DIError DiskFSProDOS::ScanVolBitmap(void)
         SetBlockUsage(fBitMapPointer + i -1, VolumeUsage::kChunkPurposeSystem);
 
     /*
-     * Set the "isMarkedUsed" flag in VolumeUsage for all used blocks.
+     * Set the "isMarkedUsed" flag in VolumeUsage for all used blocks, and
+     * count up the free ones.
      */
     VolumeUsage::ChunkState cstate;
 
     long block = 0;
     long numBytes = (fTotalBlocks + 7) / 8;
+    fFreeBlocks = 0;
     for (i = 0; i < numBytes; i++) {
         uint8_t val = fBlockUseMap[i];
 
@@ -578,6 +653,8 @@ DIError DiskFSProDOS::ScanVolBitmap(void)
                 }
                 cstate.isMarkedUsed = true;
                 fVolumeUsage.SetChunkState(block, &cstate);
+            } else {
+                fFreeBlocks++;
             }
             val <<= 1;
             block++;
@@ -588,9 +665,6 @@ DIError DiskFSProDOS::ScanVolBitmap(void)
         if (block >= fTotalBlocks)
             break;
     }
-
-    FreeVolBitmap();
-    return dierr;
 }
 
 /*
@@ -664,10 +738,100 @@ void DiskFSProDOS::SetBlockUseEntry(long block, bool inUse)
 
     offset = block / 8;
     mask = 0x80 >> (block & 0x07);
-    if (!inUse)
+    if (!inUse) {
         fBlockUseMap[offset] |= mask;
-    else
+        if (offset < fAllocScanStart)
+            fAllocScanStart = offset;
+    } else {
         fBlockUseMap[offset] &= ~mask;
+    }
+}
+
+/*
+ * Compare the block use map with the copy from the last load or save, and
+ * bring the volume usage map and the free block count up to date.
+ *
+ * If "saved" is set, the map was just written to disk, so the changes are
+ * real.  Newly-allocated blocks that NoteBlockPurpose didn't describe are
+ * assumed to hold file data.  If "saved" isn't set, the changes are being
+ * thrown away, so we put the usage map back the way it was.  (Blocks that
+ * were being freed come back as file data, which is the best guess we
+ * have.)
+ */
+void DiskFSProDOS::SyncBlockUsage(bool saved)
+{
+    assert(fBlockUseMap != NULL && fBlockUseMapSaved != NULL);
+
+    bool haveUsage = fVolumeUsage.GetInitialized();
+    long numBytes = (fTotalBlocks + 7) / 8;
+    for (long i = 0; i < numBytes; i++) {
+        uint8_t diff = fBlockUseMap[i] ^ fBlockUseMapSaved[i];
+        if (diff == 0)
+            continue;
+
+        for (int j = 0; j < 8; j++) {
+            uint8_t mask = 0x80 >> j;
+            long block = i * 8 + j;
+            if (!(diff & mask) || block >= fTotalBlocks)
+                continue;
+
+            bool nowUsed = (fBlockUseMap[i] & mask) == 0;
+            if (saved && fFreeBlocks >= 0)
+                fFreeBlocks += nowUsed ? -1 : 1;
+
+            VolumeUsage::ChunkState cstate;
+            if (!haveUsage ||
+                fVolumeUsage.GetChunkState(block, &cstate) != kDIErrNone)
+            {
+                continue;
+            }
+            if (saved) {
+                cstate.isMarkedUsed = nowUsed;
+                if (!nowUsed) {
+                    cstate.isUsed = false;
+                    cstate.purpose = VolumeUsage::kChunkPurposeUnknown;
+                } else if (!cstate.isUsed && !GetInitDeferred()) {
+                    cstate.isUsed = true;
+                    cstate.purpose = VolumeUsage::kChunkPurposeUserData;
+                }
+            } else if (nowUsed) {
+                /* allocation abandoned */
+                if (!cstate.isMarkedUsed) {
+                    cstate.isUsed = false;
+                    cstate.purpose = VolumeUsage::kChunkPurposeUnknown;
+                }
+            } else {
+                /* release abandoned */
+                cstate.isMarkedUsed = true;
+                if (!cstate.isUsed && !GetInitDeferred()) {
+                    cstate.isUsed = true;
+                    cstate.purpose = VolumeUsage::kChunkPurposeUserData;
+                }
+            }
+            fVolumeUsage.SetChunkState(block, &cstate);
+        }
+    }
+
+    if (saved)
+        memcpy(fBlockUseMapSaved, fBlockUseMap, numBytes);
+}
+
+/*
+ * Record what a newly-allocated (or newly-repurposed) block is for.  If
+ * the allocation is abandoned rather than saved, SyncBlockUsage takes the
+ * mark back off.
+ */
+void DiskFSProDOS::NoteBlockPurpose(long block, VolumeUsage::ChunkPurpose purpose)
+{
+    VolumeUsage::ChunkState cstate;
+
+    if (!fVolumeUsage.GetInitialized() || GetInitDeferred())
+        return;
+    if (fVolumeUsage.GetChunkState(block, &cstate) != kDIErrNone)
+        return;
+    cstate.isUsed = true;
+    cstate.purpose = purpose;
+    fVolumeUsage.SetChunkState(block, &cstate);
 }
 
 /*
@@ -729,8 +893,9 @@ long DiskFSProDOS::AllocBlock(void)
     int offset;
     int maxOffset = (fTotalBlocks + 7) / 8;
 
-    for (offset = 0; offset < maxOffset; offset++) {
+    for (offset = fAllocScanStart; offset < maxOffset; offset++) {
         if (fBlockUseMap[offset] != 0) {
+            fAllocScanStart = offset;
             /* got one, figure out which */
             int subBlock = 0;
             uint8_t uch = fBlockUseMap[offset];
@@ -755,29 +920,82 @@ long DiskFSProDOS::AllocBlock(void)
 }
 
 /*
- * Tally up the number of free blocks.
+ * Allocate "count" consecutive blocks, using the first free run that's
+ * long enough.
+ *
+ * Only touches the in-memory copy.
+ *
+ * Returns the first block number on success or -1 if there's no run that
+ * long.
+ */
+long DiskFSProDOS::AllocBlockRun(long count)
+{
+    assert(fBlockUseMap != NULL);
+    assert(count > 0);
+
+    long runStart = -1;
+    long block = fAllocScanStart * 8;
+    if (block < kVolHeaderBlock)
+        block = kVolHeaderBlock;
+
+    while (block < fTotalBlocks) {
+        if ((block & 0x07) == 0 && fBlockUseMap[block / 8] == 0) {
+            /* eight blocks in a row in use, skip them */
+            runStart = -1;
+            block += 8;
+            continue;
+        }
+
+        if (GetBlockUseEntry(block)) {
+            runStart = -1;
+        } else {
+            if (runStart < 0)
+                runStart = block;
+            if (block - runStart + 1 == count) {
+                for (long i = runStart; i <= block; i++)
+                    SetBlockUseEntry(i, true);
+                return runStart;
+            }
+        }
+        block++;
+    }
+
+    return -1;
+}
+
+/*
+ * Report the number of free blocks.
+ *
+ * The count is taken when the volume bitmap is scanned, and kept up to
+ * date as blocks are allocated and freed.  If we don't have one yet, we
+ * tally it up from the bitmap.
  */
 DIError DiskFSProDOS::GetFreeSpaceCount(long* pTotalUnits, long* pFreeUnits,
     int* pUnitSize) const
 {
-    DIError dierr;
-    long block, freeBlocks;
-    freeBlocks = 0;
+    if (fFreeBlocks < 0) {
+        DiskFSProDOS* pThis = const_cast<DiskFSProDOS*>(this);
+        DIError dierr;
+        long block, freeBlocks;
+        freeBlocks = 0;
 
-    dierr = const_cast<DiskFSProDOS*>(this)->LoadVolBitmap();
-    if (dierr != kDIErrNone)
-        return dierr;
+        dierr = pThis->LoadVolBitmap();
+        if (dierr != kDIErrNone)
+            return dierr;
 
-    for (block = 0; block < fTotalBlocks; block++) {
-        if (!GetBlockUseEntry(block))
-            freeBlocks++;
+        for (block = 0; block < fTotalBlocks; block++) {
+            if (!GetBlockUseEntry(block))
+                freeBlocks++;
+        }
+
+        pThis->FreeVolBitmap();
+        pThis->fFreeBlocks = freeBlocks;
     }
 
     *pTotalUnits = fTotalBlocks;
-    *pFreeUnits = freeBlocks;
+    *pFreeUnits = fFreeBlocks;
     *pUnitSize = kBlockSize;
 
-    const_cast<DiskFSProDOS*>(this)->FreeVolBitmap();
     return kDIErrNone;
 }
 
@@ -801,6 +1019,37 @@ void DiskFSProDOS::SetBlockUsage(long block, VolumeUsage::ChunkPurpose purpose)
     fVolumeUsage.SetChunkState(block, &cstate);
 }
 
+/*
+ * Tell the DiskImg where the entries in this directory block will send us
+ * next: the key blocks of subdirectories, and the key blocks of extended
+ * files (ReadExtendedInfo reads those right away).  They can be on their
+ * way in while we set up the entries.
+ */
+static void PrefetchDirEntries(DiskImg* pImg, const uint8_t* blkBuf,
+    int entryLength, int entriesPerBlock, bool skipFirst)
+{
+    long blocks[kBlkSize / 4];
+    int count = 0;
+    const uint8_t* entryBuf = &blkBuf[0x04];
+
+    if (skipFirst) {
+        entriesPerBlock--;
+        entryBuf += entryLength;
+    }
+    for ( ; entriesPerBlock > 0 && entryBuf + 0x13 <= blkBuf + kBlkSize &&
+            count < (int) NELEM(blocks);
+        entriesPerBlock--, entryBuf += entryLength)
+    {
+        int storageType = (entryBuf[0x00] & 0xf0) >> 4;
+        if (storageType == A2FileProDOS::kStorageDirectory ||
+            storageType == A2FileProDOS::kStorageExtended)
+        {
+            blocks[count++] = GetShortLE(&entryBuf[0x11]);
+        }
+    }
+    pImg->PrefetchBlocks(blocks, count);
+}
+
 /*
  * Pass in the number of the first block of the directory.
  *
@@ -833,10 +1082,15 @@ DIError DiskFSProDOS::RecursiveDirAdd(A2File* pParent, uint16_t dirBlock,
     foundCount = 0;
     first = true;
 
+    std::vector<uint16_t>* pChain;
+    pChain = &GetDirBlockMap()->dirs[pParent];
+    pChain->clear();
+
     while (dirBlock && iterations < kMaxCatalogIterations) {
         dierr = fpImg->ReadBlock(dirBlock, blkBuf);
         if (dierr != kDIErrNone)
             goto bail;
+        pChain->push_back(dirBlock);
         if (pParent->IsVolumeDirectory())
             SetBlockUsage(dirBlock, VolumeUsage::kChunkPurposeVolumeDir);
         else
@@ -850,6 +1104,8 @@ DIError DiskFSProDOS::RecursiveDirAdd(A2File* pParent, uint16_t dirBlock,
             numEntries = header.fileCount;
             //LOGI("  ProDOS got dir header numEntries = %d", numEntries);
         }
+        PrefetchDirEntries(fpImg, blkBuf, header.entryLength,
+            header.entriesPerBlock, first);
 
         /* slurp the entries out of this block */
         dierr = SlurpEntries(pParent, &header, blkBuf, first, &foundCount,
@@ -898,7 +1154,6 @@ DIError DiskFSProDOS::SlurpEntries(A2File* pParent, const DirHeader* pHeader,
     DIError dierr = kDIErrNone;
     int entriesThisBlock = pHeader->entriesPerBlock;
     const uint8_t* entryBuf;
-    A2FileProDOS* pFile;
 
     int idx = 0;
     entryBuf = &blkBuf[0x04];
@@ -921,61 +1176,98 @@ DIError DiskFSProDOS::SlurpEntries(A2File* pParent, const DirHeader* pHeader,
             continue;
         }
 
-        pFile = new A2FileProDOS(this);
-        if (pFile == NULL) {
-            dierr = kDIErrMalloc;
+        (*pCount)++;
+        dierr = AddDirEntry(pParent, entryBuf, basePath, thisBlock, idx,
+                    depth);
+        if (dierr != kDIErrNone)
             goto bail;
-        }
+    }
+
+bail:
+    return dierr;
+}
+
+/*
+ * Create the file for one directory entry, without adding it to the list.
+ * Returns NULL if we run out of memory.
+ */
+A2FileProDOS* DiskFSProDOS::NewDirEntryFile(A2File* pParent,
+    const uint8_t* entryBuf, const char* basePath, uint16_t thisBlock, int idx)
+{
+    A2FileProDOS* pFile;
+
+    pFile = new (this) A2FileProDOS(this);
+    if (pFile == NULL)
+        return NULL;
+
+    A2FileProDOS::DirEntry* pEntry;
+    pEntry = &pFile->fDirEntry;
+    A2FileProDOS::InitDirEntry(pEntry, entryBuf);
+
+    pFile->SetParent(pParent);
+    pFile->fParentDirBlock = thisBlock;
+    pFile->fParentDirIdx = idx;
+
+    pFile->SetPathName(basePath, pEntry->fileName);
+
+    if (pEntry->keyPointer <= kVolHeaderBlock) {
+        LOGI("ProDOS invalid key pointer %d on '%s'",
+            pEntry->keyPointer, pFile->GetPathName());
+        pFile->SetQuality(A2File::kQualityDamaged);
+    }
+
+    return pFile;
+}
 
-        A2FileProDOS::DirEntry* pEntry;
-        pEntry = &pFile->fDirEntry;
-        A2FileProDOS::InitDirEntry(pEntry, entryBuf);
+/*
+ * Create a file for one directory entry and add it to the end of the list.
+ * If it's a directory, its contents are added after it.
+ */
+DIError DiskFSProDOS::AddDirEntry(A2File* pParent, const uint8_t* entryBuf,
+    const char* basePath, uint16_t thisBlock, int idx, int depth)
+{
+    DIError dierr = kDIErrNone;
+    A2FileProDOS* pFile;
 
-        pFile->SetParent(pParent);
-        pFile->fParentDirBlock = thisBlock;
-        pFile->fParentDirIdx = idx;
+    pFile = NewDirEntryFile(pParent, entryBuf, basePath, thisBlock, idx);
+    if (pFile == NULL)
+        return kDIErrMalloc;
 
-        pFile->SetPathName(basePath, pEntry->fileName);
+    A2FileProDOS::DirEntry* pEntry;
+    pEntry = &pFile->fDirEntry;
 
-        if (pEntry->keyPointer <= kVolHeaderBlock) {
-            LOGI("ProDOS invalid key pointer %d on '%s'",
-                pEntry->keyPointer, pFile->GetPathName());
+    if (pEntry->keyPointer > kVolHeaderBlock &&
+        pEntry->storageType == A2FileProDOS::kStorageExtended)
+    {
+        dierr = ReadExtendedInfo(pFile);
+        if (dierr != kDIErrNone) {
             pFile->SetQuality(A2File::kQualityDamaged);
-        } else
-        if (pEntry->storageType == A2FileProDOS::kStorageExtended) {
-            dierr = ReadExtendedInfo(pFile);
-            if (dierr != kDIErrNone) {
-                pFile->SetQuality(A2File::kQualityDamaged);
-                dierr = kDIErrNone;
-            }
+            dierr = kDIErrNone;
         }
+    }
 
-        //pFile->Dump();
-        AddFileToList(pFile);
-        (*pCount)++;
+    //pFile->Dump();
+    AddFileToList(pFile);
 
-        if (!fpImg->UpdateScanProgress(NULL)) {
-            LOGI(" ProDOS cancelled by user");
-            dierr = kDIErrCancelled;
-            goto bail;
-        }
+    if (!fpImg->UpdateScanProgress(NULL)) {
+        LOGI(" ProDOS cancelled by user");
+        return kDIErrCancelled;
+    }
 
-        if (pEntry->storageType == A2FileProDOS::kStorageDirectory) {
-            // don't need to check for kStorageVolumeDirHeader here
-            dierr = RecursiveDirAdd(pFile, pEntry->keyPointer,
-                        pFile->GetPathName(), depth+1);
-            if (dierr != kDIErrNone) {
-                if (dierr == kDIErrCancelled)
-                    goto bail;
+    if (pEntry->storageType == A2FileProDOS::kStorageDirectory) {
+        // don't need to check for kStorageVolumeDirHeader here
+        dierr = RecursiveDirAdd(pFile, pEntry->keyPointer,
+                    pFile->GetPathName(), depth+1);
+        if (dierr != kDIErrNone) {
+            if (dierr == kDIErrCancelled)
+                return dierr;
 
-                /* mark subdir as damaged and keep going */
-                pFile->SetQuality(A2File::kQualityDamaged);
-                dierr = kDIErrNone;
-            }
+            /* mark subdir as damaged and keep going */
+            pFile->SetQuality(A2File::kQualityDamaged);
+            dierr = kDIErrNone;
         }
     }
 
-bail:
     return dierr;
 }
 
@@ -1020,65 +1312,332 @@ DIError DiskFSProDOS::GetDirHeader(const uint8_t* blkBuf, DirHeader* pHeader)
 }
 
 /*
- * Read the information from the key block of an extended file.
+ * Pull the fork descriptions out of an extended file's key block.
  *
  * There's some "HFS Finder information" stuffed into the key block
  * right after the data fork info, but I'm planning to ignore that.
  */
+static DIError UnpackExtendedInfo(const uint8_t* blkBuf,
+    A2FileProDOS::ExtendedInfo* pData, A2FileProDOS::ExtendedInfo* pRsrc)
+{
+    pData->storageType = blkBuf[0x0000] & 0x0f;
+    pData->keyBlock = GetShortLE(&blkBuf[0x0001]);
+    pData->blocksUsed = GetShortLE(&blkBuf[0x0003]);
+    pData->eof = GetLongLE(&blkBuf[0x0005]);
+    pData->eof &= 0x00ffffff;
+
+    pRsrc->storageType = blkBuf[0x0100] & 0x0f;
+    pRsrc->keyBlock = GetShortLE(&blkBuf[0x0101]);
+    pRsrc->blocksUsed = GetShortLE(&blkBuf[0x0103]);
+    pRsrc->eof = GetLongLE(&blkBuf[0x0105]);
+    pRsrc->eof &= 0x00ffffff;
+
+    if (pData->keyBlock <= kVolHeaderBlock ||
+        pRsrc->keyBlock <= kVolHeaderBlock)
+    {
+        LOGI(" ProDOS found bad extended key blocks %d/%d",
+            pData->keyBlock, pRsrc->keyBlock);
+        return kDIErrBadFile;
+    }
+    return kDIErrNone;
+}
+
+/*
+ * Read the information from the key block of an extended file.
+ */
 DIError DiskFSProDOS::ReadExtendedInfo(A2FileProDOS* pFile)
 {
-    DIError dierr = kDIErrNone;
+    DIError dierr;
     uint8_t blkBuf[kBlkSize];
 
     dierr = fpImg->ReadBlock(pFile->fDirEntry.keyPointer, blkBuf);
     if (dierr != kDIErrNone) {
         LOGI(" ProDOS ReadExtendedInfo: unable to read key block %d",
             pFile->fDirEntry.keyPointer);
-        goto bail;
+        return dierr;
     }
 
-    pFile->fExtData.storageType = blkBuf[0x0000] & 0x0f;
-    pFile->fExtData.keyBlock = GetShortLE(&blkBuf[0x0001]);
-    pFile->fExtData.blocksUsed = GetShortLE(&blkBuf[0x0003]);
-    pFile->fExtData.eof = GetLongLE(&blkBuf[0x0005]);
-    pFile->fExtData.eof &= 0x00ffffff;
-
-    pFile->fExtRsrc.storageType = blkBuf[0x0100] & 0x0f;
-    pFile->fExtRsrc.keyBlock = GetShortLE(&blkBuf[0x0101]);
-    pFile->fExtRsrc.blocksUsed = GetShortLE(&blkBuf[0x0103]);
-    pFile->fExtRsrc.eof = GetLongLE(&blkBuf[0x0105]);
-    pFile->fExtRsrc.eof &= 0x00ffffff;
+    return UnpackExtendedInfo(blkBuf, &pFile->fExtData, &pFile->fExtRsrc);
+}
 
-    if (pFile->fExtData.keyBlock <= kVolHeaderBlock ||
-        pFile->fExtRsrc.keyBlock <= kVolHeaderBlock)
-    {
-        LOGI(" ProDOS ReadExtendedInfo: found bad extended key blocks %d/%d",
-            pFile->fExtData.keyBlock, pFile->fExtRsrc.keyBlock);
-        return kDIErrBadFile;
+/*
+ * Saved block lists, keyed by the key block of the fork.  The lists are
+ * packed into one array; an entry holds the offset of its block list,
+ * with the index list right behind it.  Space from dropped entries is
+ * reclaimed by compacting the array when it fills up.
+ */
+struct DiskFSProDOS::BlockListCache {
+    struct Entry {
+        uint8_t     storageType;
+        uint32_t    eof;
+        size_t      offset;
+        uint16_t    blockCount;
+        uint16_t    indexCount;
+    };
+
+    BlockListCache(size_t maxEnt) : maxEntries(maxEnt), liveCount(0)
+        {}
+
+    void Compact(void) {
+        std::vector<uint16_t> newArena;
+        newArena.reserve(liveCount);
+        for (auto it = entries.begin(); it != entries.end(); ++it) {
+            Entry& ent = it->second;
+            size_t len = ent.blockCount + ent.indexCount;
+            size_t newOffset = newArena.size();
+            newArena.insert(newArena.end(), arena.begin() + ent.offset,
+                arena.begin() + ent.offset + len);
+            ent.offset = newOffset;
+        }
+        arena.swap(newArena);
     }
 
-bail:
-    return dierr;
-}
+    std::unordered_map<uint16_t, Entry> entries;
+    std::vector<uint16_t> arena;
+    size_t      maxEntries;     // limit on arena size
+    size_t      liveCount;      // #of arena entries that are in use
+};
 
 /*
- * Scan all of the files on the disk, reading their block usage into the
- * volume usage map.  This is important for detecting damage, and makes
- * later accesses easier.
- *
- * As a side-effect, we set the "sparse" length for the file.
+ * One fork for ScanFileUsage to look at.
  */
-DIError DiskFSProDOS::ScanFileUsage(void)
-{
-    DIError dierr = kDIErrNone;
-    A2FileProDOS* pFile;
-    long blockCount, indexCount, sparseCount;
-    uint16_t* blockList = NULL;
-    uint16_t* indexList = NULL;
+struct ScanFork {
+    A2FileProDOS*   pFile;
+    bool            isRsrc;
+    int             storageType;
+    uint16_t        keyBlock;
+    long            eof;
+    bool            failed;
+    bool            cached;             // lists came from the cache
+    std::vector<uint16_t> blockList;
+    std::vector<uint16_t> indexList;    // master index block comes first
+};
+
+/*
+ * An index block, or master index block, that ScanFileUsage needs to read.
+ */
+struct ScanIndexRead {
+    uint16_t        block;
+    bool            isMaster;
+    size_t          forkIdx;
+    long            listOffset;         // where the entries go in the list
+    long            count;              // #of block list entries covered
+
+    bool operator<(const ScanIndexRead& other) const {
+        return block < other.block;
+    }
+};
+
+/*
+ * Set up a ScanFork for one fork of a file.  Seedlings are filled in
+ * right away; anything with index blocks gets a read request.
+ */
+static void AddScanFork(std::vector<ScanFork>* pForks,
+    std::vector<ScanIndexRead>* pReads, A2FileProDOS* pFile, bool isRsrc,
+    int storageType, uint16_t keyBlock, long eof)
+{
+    ScanFork fork;
+    long count;
+
+    fork.pFile = pFile;
+    fork.isRsrc = isRsrc;
+    fork.storageType = storageType;
+    fork.keyBlock = keyBlock;
+    fork.eof = eof;
+    fork.failed = false;
+    fork.cached = false;
+
+    if (!A2FileProDOS::IsRegularFile(storageType)) {
+        /*
+         * We can get here if somebody puts a bad storage type inside the
+         * extended key block of a forked file.
+         */
+        LOGI(" ProDOS unexpected storageType %d in '%s'",
+            storageType, pFile->GetPathName());
+        fork.failed = true;
+        pForks->push_back(fork);
+        return;
+    }
+
+    assert(eof < 1024*1024*16);
+    count = (eof + kBlkSize -1) / kBlkSize;
+    if (count == 0)
+        count = 1;
+    /* zero-fill to take care of trailing sparse entries */
+    fork.blockList.assign(count, 0);
+
+    if (storageType == A2FileProDOS::kStorageSeedling) {
+        fork.blockList[0] = keyBlock;
+    } else {
+        ScanIndexRead req;
+        req.block = keyBlock;
+        req.isMaster = (storageType == A2FileProDOS::kStorageTree);
+        req.forkIdx = pForks->size();
+        req.listOffset = 0;
+        req.count = count;
+        pReads->push_back(req);
+        fork.indexList.push_back(keyBlock);
+    }
+
+    pForks->push_back(fork);
+}
+
+/*
+ * Read a set of index blocks, filling in the block lists.  Master index
+ * blocks add their index blocks to "pNextReads".
+ *
+ * The blocks are read in sorted order, and runs of adjacent blocks are
+ * read together.  If a run can't be read, we retry it one block at a time
+ * so that only the forks with bad blocks fail.
+ */
+static void ReadScanIndexBlocks(DiskImg* pImg,
+    std::vector<ScanIndexRead>* pReads, std::vector<ScanFork>* pForks,
+    std::vector<ScanIndexRead>* pNextReads)
+{
+    const long kMaxRun = 16;
+    const size_t kPrefetchWindow = 64;
+    std::vector<ScanIndexRead>& reads = *pReads;
+    uint8_t runBuf[kBlkSize * kMaxRun];
+    uint8_t blkBuf[kBlkSize];
+    long prefetchList[kPrefetchWindow];
+    long numBlocks = pImg->GetNumBlocks();
+    size_t start, end, prefetchEnd = 0;
+
+    std::sort(reads.begin(), reads.end());
+
+    for (start = 0; start < reads.size(); start = end) {
+        long first = reads[start].block;
+        long last = first;
+
+        /*
+         * Keep the next window's worth of blocks on the way in.  We top
+         * it up halfway through, so the reads never catch up.
+         */
+        if (start + kPrefetchWindow / 2 >= prefetchEnd &&
+            prefetchEnd < reads.size())
+        {
+            int count = 0;
+            if (prefetchEnd < start)
+                prefetchEnd = start;
+            while (prefetchEnd < reads.size() && count < (int) kPrefetchWindow)
+                prefetchList[count++] = reads[prefetchEnd++].block;
+            pImg->PrefetchBlocks(prefetchList, count);
+        }
+
+        if (first == 0 || first >= numBlocks) {
+            LOGI(" ProDOS index block %ld out of range", first);
+            (*pForks)[reads[start].forkIdx].failed = true;
+            end = start + 1;
+            continue;
+        }
+
+        /* extend the run over adjacent (or repeated) blocks */
+        for (end = start + 1; end < reads.size(); end++) {
+            long block = reads[end].block;
+            if (block == last)
+                continue;
+            if (block != last + 1 || block >= numBlocks ||
+                block - first >= kMaxRun)
+            {
+                break;
+            }
+            last = block;
+        }
+
+        bool runOkay = (pImg->ReadBlocks(first, (int) (last - first + 1),
+                            runBuf) == kDIErrNone);
+
+        for (size_t i = start; i < end; i++) {
+            const ScanIndexRead& req = reads[i];
+            ScanFork& fork = (*pForks)[req.forkIdx];
+            const uint8_t* blk = runBuf + (req.block - first) * kBlkSize;
+
+            if (fork.failed)
+                continue;
+            if (!runOkay) {
+                if (pImg->ReadBlock(req.block, blkBuf) != kDIErrNone) {
+                    fork.failed = true;
+                    continue;
+                }
+                blk = blkBuf;
+            }
+
+            if (req.isMaster) {
+                long countDown = req.count;
+                long offset = req.listOffset;
+                int idx = 0;
+
+                while (countDown) {
+                    long blockCount = countDown;
+                    if (blockCount > A2FileProDOS::kMaxBlocksPerIndex)
+                        blockCount = A2FileProDOS::kMaxBlocksPerIndex;
+                    uint16_t idxBlock =
+                        blk[idx] | (uint16_t) blk[idx+256] << 8;
+
+                    /* zero means fully sparse, list is already zeroed */
+                    fork.indexList.push_back(idxBlock);
+                    if (idxBlock != 0) {
+                        ScanIndexRead next;
+                        next.block = idxBlock;
+                        next.isMaster = false;
+                        next.forkIdx = req.forkIdx;
+                        next.listOffset = offset;
+                        next.count = blockCount;
+                        pNextReads->push_back(next);
+                    }
+
+                    idx++;
+                    offset += blockCount;
+                    countDown -= blockCount;
+                }
+            } else {
+                long maxCount = req.count;
+                if (maxCount > A2FileProDOS::kMaxBlocksPerIndex)
+                    maxCount = A2FileProDOS::kMaxBlocksPerIndex;
+                uint16_t* list = &fork.blockList[req.listOffset];
+                for (long j = 0; j < maxCount; j++)
+                    *list++ = blk[j] | (uint16_t) blk[j+256] << 8;
+            }
+        }
+    }
+
+    reads.clear();
+}
+
+/*
+ * Scan all of the files on the disk, reading their block usage into the
+ * volume usage map.  This is important for detecting damage, and makes
+ * later accesses easier.
+ *
+ * Rather than loading each fork's block list in turn, we gather up all of
+ * the index blocks for the whole volume and read them in block order, one
+ * level at a time.  The lists are then kept in the block list cache, so
+ * opening the files later doesn't require reading the index blocks again.
+ *
+ * As a side-effect, we set the "sparse" length for the file.
+ *
+ * If "useCache" is set, forks whose lists are already in the cache don't
+ * have their index blocks read again.  This is for Refresh, which drops
+ * anything that might be stale before calling here.  Refresh has already
+ * changed the file list by then, so the scan can't be cancelled.
+ */
+DIError DiskFSProDOS::ScanFileUsage(bool useCache)
+{
+    DIError dierr = kDIErrNone;
+    std::vector<ScanFork> forks;
+    std::vector<ScanIndexRead> reads, nextReads;
+    A2FileProDOS* pFile;
+    long sparseCount;
+
+    /* start over with the cache */
+    if (!useCache) {
+        delete fpListCache;
+        fpListCache = NULL;
+    }
 
     pFile = (A2FileProDOS*) GetNextFile(NULL);
     while (pFile != NULL) {
-        if (!fpImg->UpdateScanProgress(NULL)) {
+        if (!useCache && !fpImg->UpdateScanProgress(NULL)) {
             LOGI(" ProDOS cancelled by user");
             dierr = kDIErrCancelled;
             goto bail;
@@ -1089,100 +1648,126 @@ DIError DiskFSProDOS::ScanFileUsage(void)
             goto skip;
 
         if (pFile->fDirEntry.storageType == A2FileProDOS::kStorageExtended) {
-            /* resource fork */
-            if (!A2FileProDOS::IsRegularFile(pFile->fExtRsrc.storageType)) {
-                /* not expecting to find a directory here, but it happens */
-                dierr = kDIErrBadFile;
-            } else {
-                dierr = pFile->LoadBlockList(pFile->fExtRsrc.storageType,
-                            pFile->fExtRsrc.keyBlock, pFile->fExtRsrc.eof,
-                            &blockCount, &blockList, &indexCount, &indexList);
-            }
-            if (dierr != kDIErrNone) {
-                LOGI(" ProDOS skipping scan rsrc '%s'",
-                    pFile->fDirEntry.fileName);
-                pFile->SetQuality(A2File::kQualityDamaged);
-                goto skip;
-            }
-            ScanBlockList(blockCount, blockList, indexCount, indexList,
-                &sparseCount);
-            pFile->fSparseRsrcEof =
-                        (di_off_t) pFile->fExtRsrc.eof - sparseCount * kBlkSize;
-            //LOGI(" SparseCount %d rsrcEof %d '%s'",
-            //  sparseCount, pFile->fSparseRsrcEof, pFile->fDirEntry.fileName);
-            delete[] blockList;
-            blockList = NULL;
-            delete[] indexList;
-            indexList = NULL;
-
-            /* data fork */
-            if (!A2FileProDOS::IsRegularFile(pFile->fExtRsrc.storageType)) {
-                dierr = kDIErrBadFile;
-            } else {
-                dierr = pFile->LoadBlockList(pFile->fExtData.storageType,
-                            pFile->fExtData.keyBlock, pFile->fExtData.eof,
-                            &blockCount, &blockList, &indexCount, &indexList);
-            }
-            if (dierr != kDIErrNone) {
-                LOGI(" ProDOS skipping scan data '%s'",
-                    pFile->fDirEntry.fileName);
-                pFile->SetQuality(A2File::kQualityDamaged);
-                goto skip;
-            }
-            ScanBlockList(blockCount, blockList, indexCount, indexList,
-                &sparseCount);
-            pFile->fSparseDataEof =
-                        (di_off_t) pFile->fExtData.eof - sparseCount * kBlkSize;
-            //LOGI(" SparseCount %ld dataEof %ld -> %lld '%s'",
-            //    sparseCount, pFile->fExtData.eof, pFile->fSparseDataEof,
-            //    pFile->fDirEntry.fileName);
-            delete[] blockList;
-            blockList = NULL;
-            delete[] indexList;
-            indexList = NULL;
-
-            /* mark the extended key block as in-use */
-            SetBlockUsage(pFile->fDirEntry.keyPointer,
-                VolumeUsage::kChunkPurposeFileStruct);
+            /* resource fork first, then data fork */
+            AddScanFork(&forks, &reads, pFile, true,
+                pFile->fExtRsrc.storageType, pFile->fExtRsrc.keyBlock,
+                pFile->fExtRsrc.eof);
+            AddScanFork(&forks, &reads, pFile, false,
+                pFile->fExtData.storageType, pFile->fExtData.keyBlock,
+                pFile->fExtData.eof);
         } else if (pFile->fDirEntry.storageType == A2FileProDOS::kStorageDirectory ||
                    pFile->fDirEntry.storageType == A2FileProDOS::kStorageVolumeDirHeader)
         {
             /* we already got these during the recursive descent */
             /* (could do them here if we used "fake" directory entry
                 for volume dir to lead off the recursion) */
-            goto skip;
         } else if (pFile->fDirEntry.storageType == A2FileProDOS::kStorageSeedling ||
                    pFile->fDirEntry.storageType == A2FileProDOS::kStorageSapling ||
                    pFile->fDirEntry.storageType == A2FileProDOS::kStorageTree)
         {
             /* standard file */
-            dierr = pFile->LoadBlockList(pFile->fDirEntry.storageType,
-                        pFile->fDirEntry.keyPointer, pFile->fDirEntry.eof,
-                        &blockCount, &blockList, &indexCount, &indexList);
-            if (dierr != kDIErrNone) {
-                LOGI(" ProDOS skipping scan '%s'",
-                    pFile->fDirEntry.fileName);
-                pFile->SetQuality(A2File::kQualityDamaged);
-                goto skip;
-            }
-            ScanBlockList(blockCount, blockList, indexCount, indexList,
-                &sparseCount);
-            pFile->fSparseDataEof =
-                        (di_off_t) pFile->fDirEntry.eof - sparseCount * kBlkSize;
-            //LOGI(" +++ sparseCount=%ld blockCount=%ld sparseDataEof=%lld '%s'",
-            //    sparseCount, blockCount, pFile->fSparseDataEof,
-            //    pFile->fDirEntry.fileName);
-
-            delete[] blockList;
-            blockList = NULL;
-            delete[] indexList;
-            indexList = NULL;
+            AddScanFork(&forks, &reads, pFile, false,
+                pFile->fDirEntry.storageType, pFile->fDirEntry.keyPointer,
+                pFile->fDirEntry.eof);
         } else {
             LOGI(" ProDOS found weird storage type %d on '%s', ignoring",
                 pFile->fDirEntry.storageType, pFile->fDirEntry.fileName);
             pFile->SetQuality(A2File::kQualityDamaged);
         }
 
+skip:
+        pFile = (A2FileProDOS*) GetNextFile(pFile);
+    }
+
+    /*
+     * Pull what we can out of the cache, and drop those forks' reads.
+     */
+    if (useCache && fpListCache != NULL) {
+        for (size_t i = 0; i < forks.size(); i++) {
+            ScanFork& fork = forks[i];
+            long blockCount, indexCount;
+            uint16_t* blockList;
+            uint16_t* indexList;
+
+            if (fork.failed || fork.indexList.empty())
+                continue;
+            if (!GetCachedBlockList(fork.storageType, fork.keyBlock, fork.eof,
+                    &blockCount, &blockList, &indexCount, &indexList))
+            {
+                continue;
+            }
+            fork.blockList.assign(blockList, blockList + blockCount);
+            fork.indexList.assign(indexList, indexList + indexCount);
+            fork.cached = true;
+            delete[] blockList;
+            delete[] indexList;
+        }
+
+        size_t numReads = 0;
+        for (size_t i = 0; i < reads.size(); i++) {
+            if (!forks[reads[i].forkIdx].cached)
+                reads[numReads++] = reads[i];
+        }
+        reads.resize(numReads);
+    }
+
+    /*
+     * Read the sapling index blocks and tree master index blocks, then
+     * the index blocks the masters pointed at.
+     */
+    ReadScanIndexBlocks(fpImg, &reads, &forks, &nextReads);
+    ReadScanIndexBlocks(fpImg, &nextReads, &forks, &reads);
+    assert(reads.empty());
+
+    for (size_t i = 0; i < forks.size(); i++) {
+        ScanFork& fork = forks[i];
+        pFile = fork.pFile;
+
+        /* if the rsrc fork was bad, don't bother with the data fork */
+        if (pFile->GetQuality() == A2File::kQualityDamaged)
+            continue;
+
+        long blockCount = (long) fork.blockList.size();
+        long indexCount = (long) fork.indexList.size();
+        uint16_t* blockList = blockCount ? &fork.blockList[0] : NULL;
+        uint16_t* indexList = indexCount ? &fork.indexList[0] : NULL;
+
+        if (fork.failed ||
+            pFile->ValidateBlockList(blockList, blockCount) != kDIErrNone)
+        {
+            if (pFile->fDirEntry.storageType != A2FileProDOS::kStorageExtended) {
+                LOGI(" ProDOS skipping scan '%s'", pFile->fDirEntry.fileName);
+            } else {
+                LOGI(" ProDOS skipping scan %s '%s'",
+                    fork.isRsrc ? "rsrc" : "data", pFile->fDirEntry.fileName);
+            }
+            pFile->SetQuality(A2File::kQualityDamaged);
+            continue;
+        }
+
+        ScanBlockList(blockCount, blockList, indexCount, indexList,
+            &sparseCount);
+        if (fork.isRsrc) {
+            pFile->fSparseRsrcEof = (di_off_t) fork.eof - sparseCount * kBlkSize;
+        } else {
+            pFile->fSparseDataEof = (di_off_t) fork.eof - sparseCount * kBlkSize;
+        }
+        //LOGI(" +++ sparseCount=%ld blockCount=%ld eof=%ld '%s'",
+        //    sparseCount, blockCount, fork.eof, pFile->fDirEntry.fileName);
+
+        if (!fork.cached) {
+            CacheBlockList(fork.storageType, fork.keyBlock, fork.eof,
+                blockCount, blockList, indexCount, indexList);
+        }
+
+        if (pFile->fDirEntry.storageType == A2FileProDOS::kStorageExtended &&
+            !fork.isRsrc)
+        {
+            /* both forks are good, mark the extended key block as in-use */
+            SetBlockUsage(pFile->fDirEntry.keyPointer,
+                VolumeUsage::kChunkPurposeFileStruct);
+        }
+
         /*
          * A completely empty file written as zero blocks (as opposed to simply
          * having its EOF extended, e.g. "sparse seedlings") will have zero data
@@ -1190,15 +1775,10 @@ DIError DiskFSProDOS::ScanFileUsage(void)
          * result in a slightly negative "sparse length", which we trim to zero
          * here.
          */
-        //if (stricmp(pFile->fDirEntry.fileName, "EMPTY.SPARSE.R") == 0)
-        //  LOGI("wahoo");
         if (pFile->fSparseDataEof < 0)
             pFile->fSparseDataEof = 0;
         if (pFile->fSparseRsrcEof < 0)
             pFile->fSparseRsrcEof = 0;
-
-skip:
-        pFile = (A2FileProDOS*) GetNextFile(pFile);
     }
 
     dierr = kDIErrNone;
@@ -1235,6 +1815,126 @@ void DiskFSProDOS::ScanBlockList(long blockCount, uint16_t* blockList,
     }
 }
 
+DiskFSProDOS::~DiskFSProDOS(void)
+{
+    if (fBlockUseMap != NULL) {
+        assert(false);  // unexpected
+        delete[] fBlockUseMap;
+    }
+    delete[] fBlockUseMapSaved;
+    delete fpListCache;
+    delete fpDirBlocks;
+}
+
+/*
+ * Get a copy of a fork's block list, and optionally its index block list,
+ * from the cache.  The lists are in the same form LoadBlockList produces.
+ *
+ * Returns "true" if the lists were found.  The caller must delete[] the
+ * lists.
+ */
+bool DiskFSProDOS::GetCachedBlockList(int storageType, uint16_t keyBlock,
+    long eof, long* pBlockCount, uint16_t** pBlockList,
+    long* pIndexBlockCount, uint16_t** pIndexBlockList)
+{
+    if (fpListCache == NULL)
+        return false;
+
+    auto it = fpListCache->entries.find(keyBlock);
+    if (it == fpListCache->entries.end())
+        return false;
+
+    const BlockListCache::Entry& ent = it->second;
+    if (ent.storageType != storageType || ent.eof != (uint32_t) eof) {
+        LOGW("ProDOS stale block list for key block %u", keyBlock);
+        return false;
+    }
+
+    const uint16_t* src = &fpListCache->arena[ent.offset];
+    uint16_t* list = new uint16_t[ent.blockCount + 1];
+    memcpy(list, src, ent.blockCount * sizeof(uint16_t));
+    list[ent.blockCount] = A2FileProDOS::kInvalidBlockNum;  // overrun check
+    *pBlockCount = ent.blockCount;
+    *pBlockList = list;
+
+    if (pIndexBlockList != NULL) {
+        assert(pIndexBlockCount != NULL);
+        *pIndexBlockCount = ent.indexCount;
+        if (ent.indexCount == 0) {
+            *pIndexBlockList = NULL;
+        } else {
+            *pIndexBlockList = new uint16_t[ent.indexCount];
+            memcpy(*pIndexBlockList, src + ent.blockCount,
+                ent.indexCount * sizeof(uint16_t));
+        }
+    }
+    return true;
+}
+
+/*
+ * Save a fork's block and index lists.
+ *
+ * Seedlings aren't worth saving, since their block list is just the key
+ * block.  If the cache is full even after compaction, the lists aren't
+ * saved, and the file will read its index blocks when it's opened.  The
+ * size limit comes from kParmProDOS_ListCacheKB.
+ */
+void DiskFSProDOS::CacheBlockList(int storageType, uint16_t keyBlock,
+    long eof, long blockCount, const uint16_t* blockList,
+    long indexCount, const uint16_t* indexList)
+{
+    if (storageType == A2FileProDOS::kStorageSeedling)
+        return;
+
+    if (fpListCache == NULL) {
+        long maxKB = GetParameter(kParmProDOS_ListCacheKB);
+        if (maxKB <= 0)
+            return;
+        fpListCache = new BlockListCache(maxKB * 1024 / sizeof(uint16_t));
+    }
+
+    ForgetBlockList(keyBlock);
+
+    BlockListCache* pCache = fpListCache;
+    size_t len = blockCount + indexCount;
+    if (pCache->arena.size() + len > pCache->maxEntries) {
+        if (pCache->liveCount + len > pCache->maxEntries)
+            return;     // no room
+        pCache->Compact();
+    }
+
+    BlockListCache::Entry ent;
+    ent.storageType = (uint8_t) storageType;
+    ent.eof = (uint32_t) eof;
+    ent.offset = pCache->arena.size();
+    ent.blockCount = (uint16_t) blockCount;
+    ent.indexCount = (uint16_t) indexCount;
+    pCache->arena.insert(pCache->arena.end(), blockList, blockList + blockCount);
+    if (indexCount != 0) {
+        pCache->arena.insert(pCache->arena.end(), indexList,
+            indexList + indexCount);
+    }
+    pCache->entries[keyBlock] = ent;
+    pCache->liveCount += len;
+}
+
+/*
+ * Drop the saved lists for the fork with the specified key block.  Call
+ * this whenever a fork's storage changes.
+ */
+void DiskFSProDOS::ForgetBlockList(uint16_t keyBlock)
+{
+    if (fpListCache == NULL)
+        return;
+
+    auto it = fpListCache->entries.find(keyBlock);
+    if (it != fpListCache->entries.end()) {
+        fpListCache->liveCount -=
+            it->second.blockCount + it->second.indexCount;
+        fpListCache->entries.erase(it);
+    }
+}
+
 /*
  * ProDOS disks may contain other filesystems.  The typical DOS-in-ProDOS
  * strategy involves marking a bunch of blocks at the end of the disc as
@@ -1475,49 +2175,818 @@ void DiskFSProDOS::MarkSubVolumeBlocks(long block, long count)
 }
 
 /*
- * Put a ProDOS filesystem image on the specified DiskImg.
+ * One directory entry, as read during a refresh.  Nothing is changed until
+ * every directory has been read, so the entry waits here until then.
  */
-DIError DiskFSProDOS::Format(DiskImg* pDiskImg, const char* volName)
-{
-    DIError dierr = kDIErrNone;
-    const bool allowLowerCase = (GetParameter(kParmProDOS_AllowLowerCase) != 0);
-    uint8_t blkBuf[kBlkSize];
-    long formatBlocks;
+struct DiskFSProDOS::RefreshedEntry {
+    RefreshedEntry(void) : dirBlock(0), dirIdx(0), pOldFile(NULL),
+        changed(false), haveExtInfo(false), extFailed(false), newDir(-1),
+        newDirBad(false)
+        {
+            memset(entryBuf, 0, sizeof(entryBuf));
+            memset(&extData, 0, sizeof(extData));
+            memset(&extRsrc, 0, sizeof(extRsrc));
+        }
 
-    if (!IsValidVolumeName(volName))
-        return kDIErrInvalidArg;
+    uint16_t    dirBlock;           // where the entry lives
+    int         dirIdx;
+    uint8_t     entryBuf[kEntryLength];
+    A2FileProDOS* pOldFile;         // file the entry still describes, or NULL
+    bool        changed;            // pOldFile's storage changed
+    bool        haveExtInfo;        // extData/extRsrc came from the key block
+    bool        extFailed;          // ...which was bad or unreadable
+    A2FileProDOS::ExtendedInfo extData;
+    A2FileProDOS::ExtendedInfo extRsrc;
+    long        newDir;             // new directory: RefreshState::newDirs idx
+    bool        newDirBad;          // ...which couldn't all be read
+};
 
-    /* set fpImg so calls that rely on it will work; we un-set it later */
-    assert(fpImg == NULL);
-    SetDiskImg(pDiskImg);
+/*
+ * The blocks and entries of one directory, as read during a refresh.
+ */
+struct DiskFSProDOS::RefreshedDir {
+    std::vector<uint16_t> chain;
+    std::vector<RefreshedEntry> entries;
+};
 
-    LOGI(" ProDOS formatting disk image");
+/*
+ * Working state for DoRefresh.
+ */
+struct DiskFSProDOS::RefreshState {
+    RefreshState(void) : allDirty(false), storageChanged(false),
+        namesChanged(false), haveVolHeader(false), bitmapLoaded(false),
+        freeBlocks(-1)
+        {}
+
+    bool        allDirty;           // untracked writes, so check everything
+    bool        storageChanged;     // volume usage must be rebuilt
+    bool        namesChanged;       // some path names must be regenerated
+    bool        haveVolHeader;      // volHeader holds the volume dir header
+    bool        bitmapLoaded;       // we loaded fBlockUseMap
+    long        freeBlocks;         // new free count, or -1 if unchanged
+    uint8_t     volHeader[kBlkSize];
+
+    /* contents of each directory, in file list order */
+    std::unordered_map<A2File*, std::vector<A2File*> > children;
+    /* the directories we read again */
+    std::unordered_map<A2File*, RefreshedDir> rereadDirs;
+    /* contents of new directories, found while reading the others */
+    std::vector<RefreshedDir> newDirs;
+    /* files whose entries are gone, or now describe some other file */
+    std::unordered_set<A2File*> removed;
+    /* files whose names changed */
+    std::unordered_set<A2File*> renamed;
+    /* files made for new entries; not in the list until the end */
+    std::vector<A2File*> created;
+    /* contents of the reread and new directories, in directory order */
+    std::unordered_map<A2File*, std::vector<A2File*> > dirContents;
+    /* the file list, rebuilt */
+    std::vector<A2File*> newOrder;
+};
 
-    /* write ProDOS blocks */
-    dierr = fpImg->OverrideFormat(fpImg->GetPhysicalFormat(),
-                DiskImg::kFormatGenericProDOSOrd, fpImg->GetSectorOrder());
-    if (dierr != kDIErrNone)
-        goto bail;
+/*
+ * Compare the fork descriptions from two extended key blocks.
+ */
+static bool SameExtendedInfo(const A2FileProDOS::ExtendedInfo& info1,
+    const A2FileProDOS::ExtendedInfo& info2)
+{
+    return (info1.storageType == info2.storageType &&
+            info1.keyBlock == info2.keyBlock &&
+            info1.blocksUsed == info2.blocksUsed &&
+            info1.eof == info2.eof);
+}
 
-    formatBlocks = pDiskImg->GetNumBlocks();
-    if (formatBlocks > 65536) {
-        LOGI(" ProDOS: rejecting format req blocks=%ld", formatBlocks);
-        assert(false);
-        return kDIErrInvalidArg;
+/*
+ * Pick up changes made to the volume by somebody else.
+ *
+ * Only the directories with a block in the DiskImg's written-block map are
+ * read again.  Entries are matched with the files we already have by their
+ * position in the directory.  If an entry still has the same key block,
+ * and is still a directory (or still isn't), the file is updated in place,
+ * so A2File pointers held by the application stay good.  Anything else is
+ * treated as a deletion followed by a creation.  If blocks changed hands,
+ * the volume usage map is rebuilt, using the block list cache for the
+ * files that didn't change.
+ *
+ * This happens in two passes.  The first reads every directory that
+ * changed, the volume header, and the bitmap, and checks that we can follow
+ * the changes, without touching the file list.  Only if all of that works
+ * does the second pass apply the changes, and it doesn't read anything that
+ * can fail.  So if we return an error, the file list is just as it was.
+ * (The block list cache may have been dropped, but it'll be rebuilt.)
+ *
+ * Changes we can't follow, like a new volume size or bitmap location, or
+ * a directory we can't read, return kDIErrNotSupported.  The full scan is
+ * better at sorting out damage.
+ */
+DIError DiskFSProDOS::DoRefresh(void)
+{
+    DIError dierr = kDIErrNone;
+    RefreshState state;
+    VolumeUsage::ChunkState cstate;
+    A2File* pFile;
+    bool bitmapWritten = false;
+    bool dropCache;
+    long block;
+
+    if (!GetAnyWritten())
+        return kDIErrNone;
+    if (fpDirBlocks == NULL || GetNextFile(NULL) == NULL) {
+        /* header-only scan, we never saw the directories */
+        return kDIErrNotSupported;
     }
-    if (formatBlocks == 65536) {
-        LOGI(" ProDOS: trimming FS size from 65536 to 65535");
-        formatBlocks = 65535;
+
+    /* don't pull files out from under an open descriptor */
+    for (pFile = GetNextFile(NULL); pFile != NULL; pFile = GetNextFile(pFile)) {
+        if (pFile->IsFileOpen())
+            return kDIErrFileOpen;
     }
 
+    state.allDirty = GetUntrackedWrites();
+
     /*
-     * We should now zero out the disk blocks, but on a 32MB volume that can
-     * take a little while.  The blocks are zeroed for us when a disk is
-     * created, so this is really only needed if we're re-formatting an
-     * existing disk.  CiderPress currently doesn't do that, so we're going
-     * to skip it here.
+     * See what kinds of blocks were written.  If an index block changed,
+     * the saved block lists can't be trusted.
      */
-//  dierr = fpImg->ZeroImage();
+    dropCache = state.allDirty;
+    for (block = GetNextWrittenBlock(-1); block >= 0;
+        block = GetNextWrittenBlock(block))
+    {
+        if (block >= fBitMapPointer &&
+            block < fBitMapPointer + GetNumBitmapBlocks())
+        {
+            bitmapWritten = true;
+        }
+        if (fVolumeUsage.GetChunkState(block, &cstate) == kDIErrNone &&
+            cstate.isUsed &&
+            (cstate.purpose == VolumeUsage::kChunkPurposeFileStruct ||
+             cstate.purpose == VolumeUsage::kChunkPurposeConflict))
+        {
+            dropCache = true;
+        }
+    }
+    if (dropCache) {
+        delete fpListCache;
+        fpListCache = NULL;
+    }
+
+    /*
+     * First pass: read the directories that were written.  Parents come
+     * before their children in the list, so by the time we get to a
+     * subdirectory we know whether it's still there.
+     */
+    std::vector<A2FileProDOS*> dirs;
+    for (pFile = GetNextFile(NULL); pFile != NULL; pFile = GetNextFile(pFile)) {
+        if (pFile->GetParent() != NULL)
+            state.children[pFile->GetParent()].push_back(pFile);
+        if (pFile->IsDirectory())
+            dirs.push_back((A2FileProDOS*) pFile);
+    }
+
+    for (size_t i = 0; i < dirs.size(); i++) {
+        A2FileProDOS* pDir = dirs[i];
+        A2File* pAncestor;
+        int depth = 0;
+
+        for (pAncestor = pDir; pAncestor != NULL;
+            pAncestor = pAncestor->GetParent())
+        {
+            if (state.removed.count(pAncestor) != 0)
+                break;
+            if (pAncestor != pDir)
+                depth++;
+        }
+        if (pAncestor != NULL)
+            continue;       // it's gone
+
+        bool written = state.allDirty;
+        if (!written) {
+            std::unordered_map<A2File*, std::vector<uint16_t> >::const_iterator
+                iter = fpDirBlocks->dirs.find(pDir);
+            if (iter == fpDirBlocks->dirs.end()) {
+                written = true;
+            } else {
+                for (size_t j = 0; j < iter->second.size(); j++) {
+                    if (GetBlockWritten(iter->second[j])) {
+                        written = true;
+                        break;
+                    }
+                }
+            }
+        }
+        if (!written)
+            continue;
+
+        LOGD(" ProDOS refreshing dir '%s'", pDir->GetPathName());
+        dierr = ReadRefreshedDir(&state, pDir,
+                    pDir->IsVolumeDirectory() ?
+                        (uint16_t) kVolHeaderBlock : pDir->fDirEntry.keyPointer,
+                    depth, &state.rereadDirs[pDir]);
+        if (dierr != kDIErrNone)
+            goto bail;
+    }
+
+    /*
+     * If the bitmap was written, get a new free block count, and see if
+     * it still agrees with the usage map.  Keep it around if the usage map
+     * has to be rebuilt.
+     */
+    if (bitmapWritten || state.allDirty || state.storageChanged) {
+        dierr = LoadVolBitmap();
+        if (dierr != kDIErrNone)
+            goto bail;
+        state.bitmapLoaded = true;
+    }
+    if (bitmapWritten || state.allDirty) {
+        long freeBlocks = 0;
+
+        for (block = 0; block < fTotalBlocks; block++) {
+            bool inUse = GetBlockUseEntry(block);
+            if (!inUse)
+                freeBlocks++;
+            if (!state.storageChanged &&
+                fVolumeUsage.GetChunkState(block, &cstate) == kDIErrNone &&
+                cstate.isMarkedUsed != inUse)
+            {
+                state.storageChanged = true;
+            }
+        }
+        state.freeBlocks = freeBlocks;
+    }
+
+    /*
+     * Make the files for the new entries.  They aren't in the list yet, so
+     * if we run out of memory we can still back out.
+     */
+    {
+        std::unordered_map<A2File*, RefreshedDir>::const_iterator iter;
+        for (iter = state.rereadDirs.begin(); iter != state.rereadDirs.end();
+            ++iter)
+        {
+            dierr = CreateRefreshedFiles(&state, iter->first, &iter->second);
+            if (dierr != kDIErrNone)
+                goto bail;
+        }
+    }
+
+    /*
+     * Second pass: nothing below can fail.  Update the files we kept, and
+     * the volume header.
+     */
+    {
+        std::unordered_map<A2File*, RefreshedDir>::iterator iter;
+        for (iter = state.rereadDirs.begin(); iter != state.rereadDirs.end();
+            ++iter)
+        {
+            const std::vector<RefreshedEntry>& entries = iter->second.entries;
+            for (size_t i = 0; i < entries.size(); i++) {
+                if (entries[i].pOldFile != NULL)
+                    ApplyRefreshedEntry(&state, &entries[i]);
+            }
+            GetDirBlockMap()->dirs[iter->first].swap(iter->second.chain);
+        }
+    }
+    if (state.haveVolHeader)
+        RefreshVolHeader(state.volHeader);
+
+    /*
+     * Put the list back together, parents first and everything else in
+     * directory order.  Whatever doesn't make it in is gone.
+     */
+    state.children.clear();
+    for (pFile = GetNextFile(NULL); pFile != NULL; pFile = GetNextFile(pFile)) {
+        if (pFile->GetParent() != NULL && state.removed.count(pFile) == 0)
+            state.children[pFile->GetParent()].push_back(pFile);
+    }
+    {
+        A2FileProDOS* pVolDir = (A2FileProDOS*) GetNextFile(NULL);
+        std::unordered_set<A2File*> keep;
+        std::vector<A2File*> gone;
+
+        state.newOrder.push_back(pVolDir);
+        OrderRefreshedFiles(&state, pVolDir);
+
+        keep.insert(state.newOrder.begin(), state.newOrder.end());
+        for (pFile = GetNextFile(NULL); pFile != NULL;
+            pFile = GetNextFile(pFile))
+        {
+            if (keep.count(pFile) == 0)
+                gone.push_back(pFile);
+        }
+
+        RelinkFileList(&state.newOrder[0], (long) state.newOrder.size());
+        state.created.clear();      // they're ours now
+
+        for (size_t i = 0; i < gone.size(); i++) {
+            A2FileProDOS* pGone = (A2FileProDOS*) gone[i];
+
+            LOGD(" ProDOS refresh: '%s' is gone", pGone->GetPathName());
+            fpDirBlocks->dirs.erase(pGone);
+            if (pGone->fDirEntry.storageType == A2FileProDOS::kStorageExtended) {
+                ForgetBlockList(pGone->fExtData.keyBlock);
+                ForgetBlockList(pGone->fExtRsrc.keyBlock);
+            } else {
+                ForgetBlockList(pGone->fDirEntry.keyPointer);
+            }
+            delete pGone;
+        }
+        LOGI(" ProDOS refresh: %ld files, %d gone", (long) state.newOrder.size(),
+            (int) gone.size());
+    }
+
+    /* fix the path names under anything that was renamed */
+    if (state.namesChanged) {
+        for (size_t i = 1; i < state.newOrder.size(); i++) {
+            A2FileProDOS* pCur = (A2FileProDOS*) state.newOrder[i];
+            A2File* pAncestor;
+
+            for (pAncestor = pCur; pAncestor != NULL &&
+                !pAncestor->IsVolumeDirectory();
+                pAncestor = pAncestor->GetParent())
+            {
+                if (state.renamed.count(pAncestor) != 0) {
+                    RegeneratePathName(pCur);
+                    break;
+                }
+            }
+        }
+    }
+
+    if (state.freeBlocks >= 0)
+        fFreeBlocks = state.freeBlocks;
+    if (state.storageChanged)
+        RefreshVolumeUsage();
+
+bail:
+    /* files we made but never got to use */
+    for (size_t i = 0; i < state.created.size(); i++) {
+        fpDirBlocks->dirs.erase(state.created[i]);
+        delete state.created[i];
+    }
+    if (state.bitmapLoaded)
+        FreeVolBitmap();
+    if (dierr != kDIErrNone) {
+        LOGI(" ProDOS refresh failed (err=%d), nothing changed, rescan needed",
+            dierr);
+        dierr = kDIErrNotSupported;
+    }
+    return dierr;
+}
+
+/*
+ * Read a directory again, without changing anything.  Each entry is matched
+ * with the file in "pOldDir" that's in the same slot, if that's still the
+ * same file.  New subdirectories are read too.
+ *
+ * "pOldDir" is NULL for a new directory.
+ */
+DIError DiskFSProDOS::ReadRefreshedDir(RefreshState* pState,
+    A2FileProDOS* pOldDir, uint16_t dirBlock, int depth, RefreshedDir* pDir)
+{
+    DIError dierr = kDIErrNone;
+    uint8_t blkBuf[kBlkSize];
+    DirHeader header;
+    std::unordered_map<uint32_t, A2FileProDOS*> bySlot;
+    std::unordered_set<A2File*> kept;
+    bool first = true;
+
+    if (depth > kMaxDirectoryDepth)
+        return kDIErrDirectoryLoop;
+
+    if (pOldDir != NULL) {
+        const std::vector<A2File*>& oldFiles = pState->children[pOldDir];
+        for (size_t i = 0; i < oldFiles.size(); i++) {
+            A2FileProDOS* pOld = (A2FileProDOS*) oldFiles[i];
+            bySlot[(uint32_t) pOld->fParentDirBlock << 8 | pOld->fParentDirIdx] =
+                pOld;
+        }
+    }
+
+    while (dirBlock != 0) {
+        if (dirBlock < kVolHeaderBlock || dirBlock >= fpImg->GetNumBlocks() ||
+            pDir->chain.size() >= (size_t) kMaxCatalogIterations)
+        {
+            LOGI(" ProDOS refresh: bad directory link %u", dirBlock);
+            return kDIErrBadDirectory;
+        }
+        dierr = fpImg->ReadBlock(dirBlock, blkBuf);
+        if (dierr != kDIErrNone)
+            return dierr;
+        pDir->chain.push_back(dirBlock);
+
+        if (first) {
+            dierr = GetDirHeader(blkBuf, &header);
+            if (dierr != kDIErrNone)
+                return dierr;
+            if (pOldDir != NULL && pOldDir->IsVolumeDirectory()) {
+                /* we can follow a new name or dates, but not a new size */
+                if (GetShortLE(&blkBuf[0x27]) != fBitMapPointer ||
+                    GetShortLE(&blkBuf[0x29]) != fTotalBlocks)
+                {
+                    LOGI(" ProDOS refresh: volume size or bitmap location changed");
+                    return kDIErrNotSupported;
+                }
+                memcpy(pState->volHeader, blkBuf, kBlkSize);
+                pState->haveVolHeader = true;
+            }
+        }
+        PrefetchDirEntries(fpImg, blkBuf, header.entryLength,
+            header.entriesPerBlock, first);
+
+        const uint8_t* entryBuf = &blkBuf[0x04];
+        int entriesThisBlock = header.entriesPerBlock;
+        int idx = 0;
+        if (first) {
+            entriesThisBlock--;
+            entryBuf += header.entryLength;
+            idx++;
+        }
+        for ( ; entriesThisBlock > 0;
+            entriesThisBlock--, idx++, entryBuf += header.entryLength)
+        {
+            if (entryBuf >= blkBuf + kBlkSize)
+                return kDIErrBadDirectory;
+            if ((entryBuf[0x00] & 0xf0) == A2FileProDOS::kStorageDeleted)
+                continue;
+
+            RefreshedEntry ent;
+            ent.dirBlock = dirBlock;
+            ent.dirIdx = idx;
+            memcpy(ent.entryBuf, entryBuf,
+                std::min((size_t) kEntryLength,
+                    (size_t) (blkBuf + kBlkSize - entryBuf)));
+
+            std::unordered_map<uint32_t, A2FileProDOS*>::const_iterator iter =
+                bySlot.find((uint32_t) dirBlock << 8 | idx);
+            if (iter != bySlot.end() &&
+                CheckRefreshedEntry(pState, iter->second, &ent))
+            {
+                kept.insert(iter->second);
+            } else {
+                /* new file, or a different file in the old one's place */
+                ReadNewEntry(pState, depth, &ent);
+                pState->storageChanged = true;
+            }
+            pDir->entries.push_back(ent);
+        }
+
+        dirBlock = GetShortLE(&blkBuf[0x02]);
+        first = false;
+    }
+
+    /* anything we didn't see again is gone */
+    if (pOldDir != NULL) {
+        const std::vector<A2File*>& oldFiles = pState->children[pOldDir];
+        for (size_t i = 0; i < oldFiles.size(); i++) {
+            if (kept.count(oldFiles[i]) == 0) {
+                pState->removed.insert(oldFiles[i]);
+                pState->storageChanged = true;
+            }
+        }
+    }
+
+    return kDIErrNone;
+}
+
+/*
+ * See if a directory entry still describes the same file: the same key
+ * block, and still a directory (or still not).  If so, note whether its
+ * storage changed, reading the key block of an extended file if needed.
+ *
+ * Returns "false" if it's a different file.
+ */
+bool DiskFSProDOS::CheckRefreshedEntry(RefreshState* pState,
+    A2FileProDOS* pFile, RefreshedEntry* pEnt)
+{
+    A2FileProDOS::DirEntry newEntry;
+    const A2FileProDOS::DirEntry* pOldEntry = &pFile->fDirEntry;
+
+    A2FileProDOS::InitDirEntry(&newEntry, pEnt->entryBuf);
+    if (newEntry.keyPointer != pOldEntry->keyPointer ||
+        (newEntry.storageType == A2FileProDOS::kStorageDirectory) !=
+        (pOldEntry->storageType == A2FileProDOS::kStorageDirectory))
+    {
+        return false;
+    }
+
+    pEnt->pOldFile = pFile;
+    pEnt->changed = (newEntry.storageType != pOldEntry->storageType ||
+                     newEntry.eof != pOldEntry->eof ||
+                     newEntry.blocksUsed != pOldEntry->blocksUsed);
+
+    /* the fork details live in the key block, which may have changed too */
+    if (newEntry.storageType == A2FileProDOS::kStorageExtended &&
+        (pEnt->changed || pState->allDirty ||
+         GetBlockWritten(newEntry.keyPointer)))
+    {
+        uint8_t blkBuf[kBlkSize];
+
+        /* if we can't read it, keep what we had */
+        pEnt->extData = pFile->fExtData;
+        pEnt->extRsrc = pFile->fExtRsrc;
+        pEnt->haveExtInfo = true;
+        if (fpImg->ReadBlock(newEntry.keyPointer, blkBuf) != kDIErrNone ||
+            UnpackExtendedInfo(blkBuf, &pEnt->extData, &pEnt->extRsrc) !=
+                kDIErrNone)
+        {
+            pEnt->extFailed = true;
+        }
+        if (pOldEntry->storageType != A2FileProDOS::kStorageExtended ||
+            !SameExtendedInfo(pFile->fExtData, pEnt->extData) ||
+            !SameExtendedInfo(pFile->fExtRsrc, pEnt->extRsrc))
+        {
+            pEnt->changed = true;
+        }
+    }
+
+    if (pEnt->changed)
+        pState->storageChanged = true;
+    return true;
+}
+
+/*
+ * Read what a new file needs from the disk: the key block of an extended
+ * file, or the contents of a directory.  Problems just mark the file as
+ * damaged, the way the full scan does.
+ */
+void DiskFSProDOS::ReadNewEntry(RefreshState* pState, int depth,
+    RefreshedEntry* pEnt)
+{
+    A2FileProDOS::DirEntry newEntry;
+
+    A2FileProDOS::InitDirEntry(&newEntry, pEnt->entryBuf);
+    if (newEntry.keyPointer <= kVolHeaderBlock)
+        return;     // NewDirEntryFile will mark it damaged
+
+    if (newEntry.storageType == A2FileProDOS::kStorageExtended) {
+        uint8_t blkBuf[kBlkSize];
+
+        pEnt->haveExtInfo = true;
+        if (fpImg->ReadBlock(newEntry.keyPointer, blkBuf) != kDIErrNone ||
+            UnpackExtendedInfo(blkBuf, &pEnt->extData, &pEnt->extRsrc) !=
+                kDIErrNone)
+        {
+            pEnt->extFailed = true;
+        }
+    } else if (newEntry.storageType == A2FileProDOS::kStorageDirectory) {
+        RefreshedDir newDir;
+
+        if (ReadRefreshedDir(pState, NULL, newEntry.keyPointer, depth+1,
+                &newDir) != kDIErrNone)
+        {
+            pEnt->newDirBad = true;
+        }
+        pEnt->newDir = (long) pState->newDirs.size();
+        pState->newDirs.push_back(newDir);
+    }
+}
+
+/*
+ * Make files for the new entries in a directory we read again, and in any
+ * new directories under them.  The files aren't added to the list.
+ */
+DIError DiskFSProDOS::CreateRefreshedFiles(RefreshState* pState, A2File* pDir,
+    const RefreshedDir* pRefreshed)
+{
+    DIError dierr;
+    const char* basePath = pDir->IsVolumeDirectory() ? "" : pDir->GetPathName();
+    std::vector<A2File*>& contents = pState->dirContents[pDir];
+
+    for (size_t i = 0; i < pRefreshed->entries.size(); i++) {
+        const RefreshedEntry& ent = pRefreshed->entries[i];
+
+        if (ent.pOldFile != NULL) {
+            contents.push_back(ent.pOldFile);
+            continue;
+        }
+
+        A2FileProDOS* pFile = NewDirEntryFile(pDir, ent.entryBuf, basePath,
+                                ent.dirBlock, ent.dirIdx);
+        if (pFile == NULL)
+            return kDIErrMalloc;
+        pState->created.push_back(pFile);
+        contents.push_back(pFile);
+        LOGD(" ProDOS refresh: found '%s'", pFile->GetPathName());
+
+        if (ent.haveExtInfo) {
+            pFile->fExtData = ent.extData;
+            pFile->fExtRsrc = ent.extRsrc;
+        }
+        if (ent.extFailed || ent.newDirBad)
+            pFile->SetQuality(A2File::kQualityDamaged);
+
+        if (ent.newDir >= 0) {
+            const RefreshedDir* pNewDir = &pState->newDirs[ent.newDir];
+
+            GetDirBlockMap()->dirs[pFile] = pNewDir->chain;
+            dierr = CreateRefreshedFiles(pState, pFile, pNewDir);
+            if (dierr != kDIErrNone)
+                return dierr;
+        }
+    }
+
+    return kDIErrNone;
+}
+
+/*
+ * Update a file we kept from its new directory entry.
+ */
+void DiskFSProDOS::ApplyRefreshedEntry(RefreshState* pState,
+    const RefreshedEntry* pEnt)
+{
+    A2FileProDOS* pFile = pEnt->pOldFile;
+    A2FileProDOS::DirEntry* pOldEntry = &pFile->fDirEntry;
+    A2FileProDOS::DirEntry newEntry;
+
+    A2FileProDOS::InitDirEntry(&newEntry, pEnt->entryBuf);
+
+    if (strcmp(newEntry.fileName, pOldEntry->fileName) != 0) {
+        pState->renamed.insert(pFile);
+        pState->namesChanged = true;
+    }
+    if (pEnt->changed) {
+        if (pOldEntry->storageType == A2FileProDOS::kStorageExtended) {
+            ForgetBlockList(pFile->fExtData.keyBlock);
+            ForgetBlockList(pFile->fExtRsrc.keyBlock);
+        } else {
+            ForgetBlockList(pOldEntry->keyPointer);
+        }
+    }
+    *pOldEntry = newEntry;
+
+    if (pEnt->haveExtInfo) {
+        pFile->fExtData = pEnt->extData;
+        pFile->fExtRsrc = pEnt->extRsrc;
+    }
+    if (pEnt->changed) {
+        /* start over, like a new file; ScanFileUsage will fill these in */
+        LOGD(" ProDOS refresh: '%s' changed", pFile->GetPathName());
+        pFile->ResetQuality();
+        pFile->fSparseDataEof = pFile->fSparseRsrcEof = 0;
+        if (newEntry.storageType != A2FileProDOS::kStorageExtended) {
+            memset(&pFile->fExtData, 0, sizeof(pFile->fExtData));
+            memset(&pFile->fExtRsrc, 0, sizeof(pFile->fExtRsrc));
+        }
+    }
+    if (pEnt->extFailed)
+        pFile->SetQuality(A2File::kQualityDamaged);
+}
+
+/*
+ * Pick up changes to the volume directory header.  ReadRefreshedDir has
+ * already checked that the volume size and bitmap location are the same.
+ */
+void DiskFSProDOS::RefreshVolHeader(const uint8_t* blkBuf)
+{
+    A2FileProDOS* pVolDir = (A2FileProDOS*) GetNextFile(NULL);
+    A2FileProDOS::DirEntry* pEntry = &pVolDir->fDirEntry;
+    char volName[kMaxVolumeName+1];
+
+    fModWhen = GetLongLE(&blkBuf[0x16]);
+    fCreateWhen = GetLongLE(&blkBuf[0x1c]);
+    fAccess = blkBuf[0x22];
+    fVolDirFileCount = GetShortLE(&blkBuf[0x25]);
+
+    pEntry->createWhen = fCreateWhen;
+    pEntry->version = blkBuf[0x20];
+    pEntry->minVersion = blkBuf[0x21];
+    pEntry->access = fAccess;
+    pEntry->modWhen = fModWhen;
+
+    UnpackVolumeName(blkBuf, volName);
+    if (strcmp(volName, fVolumeName) != 0) {
+        LOGI(" ProDOS refresh: volume renamed to '%s'", volName);
+        strcpy(fVolumeName, volName);
+        SetVolumeID();
+        strcpy(pEntry->fileName, fVolumeName);
+        pVolDir->SetPathName(":", fVolumeName);
+    }
+}
+
+/*
+ * Add the contents of a directory to the rebuilt file list, recursing into
+ * subdirectories.
+ */
+void DiskFSProDOS::OrderRefreshedFiles(RefreshState* pState, A2File* pDir)
+{
+    std::unordered_map<A2File*, std::vector<A2File*> >::const_iterator iter;
+
+    /* directories we read are in directory order; the rest as before */
+    iter = pState->dirContents.find(pDir);
+    if (iter == pState->dirContents.end()) {
+        iter = pState->children.find(pDir);
+        if (iter == pState->children.end())
+            return;     // empty
+    }
+
+    const std::vector<A2File*>& files = iter->second;
+    for (size_t i = 0; i < files.size(); i++) {
+        pState->newOrder.push_back(files[i]);
+        if (files[i]->IsDirectory())
+            OrderRefreshedFiles(pState, files[i]);
+    }
+}
+
+/*
+ * Rebuild the volume usage map from scratch, the same way the initial scan
+ * builds it, using the volume bitmap DoRefresh loaded.  Files whose block
+ * lists are still in the cache don't have their index blocks read again.
+ */
+void DiskFSProDOS::RefreshVolumeUsage(void)
+{
+    DIError dierr;
+    VolumeUsage::ChunkState cstate;
+    std::vector<long> embedded;
+    long block;
+
+    /* sub-volumes don't go anywhere, so hang on to their blocks */
+    if (GetNextSubVolume(NULL) != NULL) {
+        for (block = 0; block < fVolumeUsage.GetNumChunks(); block++) {
+            if (fVolumeUsage.GetChunkState(block, &cstate) == kDIErrNone &&
+                cstate.isUsed &&
+                cstate.purpose == VolumeUsage::kChunkPurposeEmbedded)
+            {
+                embedded.push_back(block);
+            }
+        }
+    }
+
+    fVolumeUsage.Create(fpImg->GetNumBlocks());
+    MarkVolBitmap();
+
+    for (A2File* pFile = GetNextFile(NULL); pFile != NULL;
+        pFile = GetNextFile(pFile))
+    {
+        if (!pFile->IsDirectory())
+            continue;
+        std::unordered_map<A2File*, std::vector<uint16_t> >::const_iterator
+            iter = fpDirBlocks->dirs.find(pFile);
+        if (iter == fpDirBlocks->dirs.end())
+            continue;
+
+        VolumeUsage::ChunkPurpose purpose = pFile->IsVolumeDirectory() ?
+            VolumeUsage::kChunkPurposeVolumeDir :
+            VolumeUsage::kChunkPurposeSubdir;
+        for (size_t i = 0; i < iter->second.size(); i++)
+            SetBlockUsage(iter->second[i], purpose);
+    }
+
+    if (!GetInitDeferred()) {
+        dierr = ScanFileUsage(true);
+        if (dierr != kDIErrNone) {
+            /* just means some files are bad */
+            LOGI(" ProDOS refresh: ScanFileUsage returned err=%d", dierr);
+        }
+    }
+
+    for (size_t i = 0; i < embedded.size(); i++)
+        SetBlockUsage(embedded[i], VolumeUsage::kChunkPurposeEmbedded);
+}
+
+/*
+ * Put a ProDOS filesystem image on the specified DiskImg.
+ */
+DIError DiskFSProDOS::Format(DiskImg* pDiskImg, const char* volName)
+{
+    DIError dierr = kDIErrNone;
+    const bool allowLowerCase = (GetParameter(kParmProDOS_AllowLowerCase) != 0);
+    uint8_t blkBuf[kBlkSize];
+    long formatBlocks;
+
+    if (!IsValidVolumeName(volName))
+        return kDIErrInvalidArg;
+
+    /* set fpImg so calls that rely on it will work; we un-set it later */
+    assert(fpImg == NULL);
+    SetDiskImg(pDiskImg);
+
+    LOGI(" ProDOS formatting disk image");
+
+    /* write ProDOS blocks */
+    dierr = fpImg->OverrideFormat(fpImg->GetPhysicalFormat(),
+                DiskImg::kFormatGenericProDOSOrd, fpImg->GetSectorOrder());
+    if (dierr != kDIErrNone)
+        goto bail;
+
+    formatBlocks = pDiskImg->GetNumBlocks();
+    if (formatBlocks > 65536) {
+        LOGI(" ProDOS: rejecting format req blocks=%ld", formatBlocks);
+        assert(false);
+        return kDIErrInvalidArg;
+    }
+    if (formatBlocks == 65536) {
+        LOGI(" ProDOS: trimming FS size from 65536 to 65535");
+        formatBlocks = 65535;
+    }
+
+    /*
+     * We should now zero out the disk blocks, but on a 32MB volume that can
+     * take a little while.  The blocks are zeroed for us when a disk is
+     * created, so this is really only needed if we're re-formatting an
+     * existing disk.  CiderPress currently doesn't do that, so we're going
+     * to skip it here.
+     */
+//  dierr = fpImg->ZeroImage();
     LOGI(" ProDOS  (not zeroing blocks)");
 
     /*
@@ -1748,74 +3217,213 @@ DIError DiskFSProDOS::WriteBootBlocks(void)
         LOGI(" WriteBootBlocks: block0 write failed (err=%d)", dierr);
         return dierr;
     }
-    dierr = fpImg->WriteBlock(1, block1);
-    if (dierr != kDIErrNone) {
-        LOGI(" WriteBootBlocks: block1 write failed (err=%d)", dierr);
-        return dierr;
+    dierr = fpImg->WriteBlock(1, block1);
+    if (dierr != kDIErrNone) {
+        LOGI(" WriteBootBlocks: block1 write failed (err=%d)", dierr);
+        return dierr;
+    }
+
+    return kDIErrNone;
+}
+
+/*
+ * Create a new, empty file.  There are three different kinds of files we
+ * need to be able to handle:
+ *  (1) Standard file.  Create the directory entry and an empty "seedling"
+ *    file with one block allocated.  It does not appear that "sparse"
+ *    allocation applies to seedlings.
+ *  (2) Extended file.  Create the directory entry, the extended key block,
+ *    and allocate one seedling block for each fork.
+ *  (3) Subdirectory.  Allocate a block for the subdir and fill in the
+ *    details in the subdir header.
+ *
+ * In all cases we need to add a new directory entry as well.
+ *
+ * This is just a batch of one; see CreateFiles.
+ *
+ * NOTE: if we detect an empty directory holder, "*ppNewFile" does NOT
+ * end up pointing at a file.
+ *
+ * NOTE: kParm_CreateUnique does *not* apply to creating subdirectories.
+ */
+DIError DiskFSProDOS::CreateFile(const CreateParms* pParms, A2File** ppNewFile)
+{
+    return CreateFiles(pParms, 1, ppNewFile);
+}
+
+/*
+ * A directory we're adding files to.  The whole thing is held in memory,
+ * along with a hash of the names in use and a list of the empty entries,
+ * so adding lots of files doesn't mean re-reading and re-scanning the
+ * directory for each one.
+ */
+struct DiskFSProDOS::BatchDir {
+    BatchDir(void) : pDir(NULL), pOpenDir(NULL), buf(NULL), len(0),
+        bufSize(0), nextFree(0), dirty(false)
+        {}
+    ~BatchDir(void) {
+        if (pOpenDir != NULL)
+            pOpenDir->Close();
+        delete[] buf;
+    }
+
+    A2FileProDOS*   pDir;
+    A2FileDescr*    pOpenDir;
+    uint8_t*        buf;            // the entire directory
+    long            len;
+    long            bufSize;        // room in "buf"; grows by doubling
+    std::vector<uint16_t> blocks;   // disk block for each 512 bytes of "buf"
+    std::vector<long> freeSlots;    // offsets of empty entries, ascending
+    size_t          nextFree;       // index of first unused "freeSlots" item
+    std::unordered_set<std::string> names;  // upper-case names in use
+    bool            dirty;          // needs to be written
+};
+
+/*
+ * State for one CreateFiles call.  Directories are opened as they're
+ * needed, and stay open until the batch is done.
+ *
+ * New files don't go into the DiskFS file list until the directories
+ * have been written, so if something goes wrong before then we can just
+ * throw them away.
+ */
+struct DiskFSProDOS::CreateBatch {
+    ~CreateBatch(void) {
+        /* close the dirs first; some of them may be in "newFiles" */
+        for (size_t i = 0; i < dirs.size(); i++)
+            delete dirs[i];
+        for (size_t i = 0; i < newFiles.size(); i++)
+            delete newFiles[i];
+    }
+
+    std::vector<BatchDir*> dirs;    // in the order they were opened
+    std::unordered_map<std::string, BatchDir*> dirsByPath;
+    std::unordered_map<std::string, A2FileProDOS*> newDirsByPath;
+    std::vector<A2FileProDOS*> newFiles;    // in the order created
+    std::vector<uint16_t> prevKeyBlocks;    // key block of the entry before
+                                            //  each new file, or 0 if first
+};
+
+/*
+ * Make a key for looking up a directory by its normalized pathname.
+ * ProDOS names are case-insensitive, and ' ' is the lower-case '.'.
+ */
+static std::string DirPathKey(const char* path)
+{
+    std::string key(path);
+
+    for (size_t i = 0; i < key.size(); i++) {
+        if (key[i] == ' ')
+            key[i] = '.';
+        else
+            key[i] = toupper(key[i]);
+    }
+    return key;
+}
+
+/*
+ * Create several files at once.  The entries are created in order, with
+ * the same rules as CreateFile, and missing subdirectories are created
+ * along the way.
+ *
+ * Each directory we add to is read once and kept in memory, names are
+ * checked against a hash, and blocks come from one pass over the volume
+ * bitmap.  The directories and the bitmap are written once, at the end.
+ * Adding N files to a directory used to mean reading and scanning the
+ * whole directory N times.
+ *
+ * By not flushing the updated block usage map and the updated directory
+ * block(s) until we're done, we can abort our changes at any time if we
+ * encounter a damaged sector or run out of disk space.  If an entry fails,
+ * we stop there: the entries before it are still created, and the failing
+ * entry and everything after it are left NULL in "ppNewFiles".
+ */
+DIError DiskFSProDOS::CreateFiles(const CreateParms* pParmsList, int count,
+    A2File** ppNewFiles)
+{
+    DIError dierr = kDIErrNone;
+    DIError commitErr;
+    CreateBatch batch;
+    std::vector<A2FileProDOS*> created(count, (A2FileProDOS*) NULL);
+    int idx;
+
+    assert(pParmsList != NULL || count == 0);
+    assert(ppNewFiles != NULL || count == 0);
+    for (idx = 0; idx < count; idx++)
+        ppNewFiles[idx] = NULL;
+
+    if (fpImg->GetReadOnly())
+        return kDIErrAccessDenied;
+    if (GetFSDamaged())
+        return kDIErrBadDiskImage;
+    if (count == 0)
+        return kDIErrNone;
+
+    /*
+     * Load the block usage map into memory.  All changes, until the batch
+     * is committed, are made to the in-memory copy and can be "undone" by
+     * simply throwing the temporary map away.
+     */
+    dierr = LoadVolBitmap();
+    if (dierr != kDIErrNone)
+        return dierr;
+
+    for (idx = 0; idx < count; idx++) {
+        dierr = BatchCreate(&batch, &pParmsList[idx], &created[idx]);
+        if (dierr != kDIErrNone) {
+            LOGI(" ProDOS CreateFiles stopped at %d of %d ('%s'): %s",
+                idx, count, pParmsList[idx].pathName, DIStrError(dierr));
+            break;
+        }
+    }
+
+    /* write out whatever we managed to create */
+    commitErr = BatchCommit(&batch);
+    if (commitErr != kDIErrNone) {
+        dierr = commitErr;
+        goto bail;
     }
 
-    return kDIErrNone;
+    while (idx--)
+        ppNewFiles[idx] = created[idx];
+
+bail:
+    FreeVolBitmap();
+    return dierr;
 }
 
 /*
- * Create a new, empty file.  There are three different kinds of files we
- * need to be able to handle:
- *  (1) Standard file.  Create the directory entry and an empty "seedling"
- *    file with one block allocated.  It does not appear that "sparse"
- *    allocation applies to seedlings.
- *  (2) Extended file.  Create the directory entry, the extended key block,
- *    and allocate one seedling block for each fork.
- *  (3) Subdirectory.  Allocate a block for the subdir and fill in the
- *    details in the subdir header.
- *
- * In all cases we need to add a new directory entry as well.
- *
- * By not flushing the updated block usage map and the updated directory
- * block(s) until we're done, we can abort our changes at any time if we
- * encounter a damaged sector or run out of disk space.  We do need to be
- * careful when updating our internal copies of things like file storage
- * types and lengths, updating them only after everything else has
- * succeeded.
- *
- * NOTE: if we detect an empty directory holder, "*ppNewFile" does NOT
- * end up pointing at a file.
+ * Create one file as part of a batch.  The volume bitmap must be loaded.
  *
- * NOTE: kParm_CreateUnique does *not* apply to creating subdirectories.
+ * On failure, the batch is left as it was, except that directories may
+ * have been opened, extended, or created along the way.
  */
-DIError DiskFSProDOS::CreateFile(const CreateParms* pParms, A2File** ppNewFile)
+DIError DiskFSProDOS::BatchCreate(CreateBatch* pBatch,
+    const CreateParms* pParms, A2FileProDOS** ppNewFile)
 {
     DIError dierr = kDIErrNone;
     char* normalizedPath = NULL;
-    char* basePath = NULL;
-    char* fileName = NULL;
-    A2FileProDOS* pSubdir = NULL;
-    A2FileDescr* pOpenSubdir = NULL;
+    const char* fileName;
+    BatchDir* pBatchDir = NULL;
     A2FileProDOS* pNewFile = NULL;
-    uint8_t* subdirBuf = NULL;
     const bool allowLowerCase = (GetParameter(kParmProDOS_AllowLowerCase) != 0);
     const bool createUnique = (GetParameter(kParm_CreateUnique) != 0);
     char upperName[A2FileProDOS::kMaxFileName+1];
     char lowerName[A2FileProDOS::kMaxFileName+1];
 
-    if (fpImg->GetReadOnly())
-        return kDIErrAccessDenied;
-    if (!fDiskIsGood)
-        return kDIErrBadDiskImage;
-
     assert(pParms != NULL);
     assert(pParms->pathName != NULL);
     assert(pParms->storageType == A2FileProDOS::kStorageSeedling ||
            pParms->storageType == A2FileProDOS::kStorageExtended ||
            pParms->storageType == A2FileProDOS::kStorageDirectory);
     // kStorageVolumeDirHeader not allowed -- that's created by Format
-    LOGI(" ProDOS ---v--- CreateFile '%s'", pParms->pathName);
+    LOGD(" ProDOS ---v--- CreateFile '%s'", pParms->pathName);
     *ppNewFile = NULL;
 
     /*
      * Normalize the pathname so that all components are ProDOS-safe
      * and separated by ':'.
      */
-    assert(pParms->pathName != NULL);
     dierr = DoNormalizePath(pParms->pathName, pParms->fssep,
                 &normalizedPath);
     if (dierr != kDIErrNone)
@@ -1823,35 +3431,246 @@ DIError DiskFSProDOS::CreateFile(const CreateParms* pParms, A2File** ppNewFile)
     assert(normalizedPath != NULL);
 
     /*
-     * Split the base path and filename apart.
+     * Split the base path and filename apart, and get the directory.  If
+     * it doesn't exist, it's created.
      */
     char* cp;
     cp = strrchr(normalizedPath, A2FileProDOS::kFssep);
     if (cp == NULL) {
-        assert(basePath == NULL);
         fileName = normalizedPath;
+        dierr = BatchOpenDir(pBatch, NULL, &pBatchDir);
     } else {
-        fileName = new char[strlen(cp+1) +1];
-        strcpy(fileName, cp+1);
         *cp = '\0';
-        basePath = normalizedPath;
+        fileName = cp+1;
+        dierr = BatchOpenDir(pBatch, normalizedPath, &pBatchDir);
     }
-    normalizedPath = NULL;   // either fileName or basePath points here now
+    if (dierr != kDIErrNone)
+        goto bail;
+    assert(pBatchDir != NULL);
 
-    assert(fileName != NULL);
-    //LOGI(" ProDOS normalized to '%s':'%s'",
-    //  basePath == NULL ? "" : basePath, fileName);
+    /*
+     * Create a copy of the filename with everything in upper case and spaces
+     * changed to periods, and make sure it's not in use.
+     *
+     * If requested, make the name unique within the directory by appending
+     * digits until it doesn't match any others.
+     */
+    UpperCaseName(upperName, fileName);
+    if (createUnique &&
+        pParms->storageType != A2FileProDOS::kStorageDirectory)
+    {
+        dierr = MakeFileNameUnique(pBatchDir, upperName);
+        if (dierr != kDIErrNone)
+            goto bail;
+    } else if (pBatchDir->names.count(upperName) != 0) {
+        if (pParms->storageType == A2FileProDOS::kStorageDirectory)
+            dierr = kDIErrDirectoryExists;
+        else
+            dierr = kDIErrFileExists;
+        goto bail;
+    }
+
+    /*
+     * Grab a directory entry, then allocate file storage and initialize:
+     *  - For directory, a single block with the directory header.
+     *  - For seedling, an empty block.
+     *  - For extended, an extended key block entry and two empty blocks.
+     */
+    long slotOffset;
+    dierr = BatchAllocEntry(pBatchDir, &slotOffset);
+    if (dierr != kDIErrNone)
+        goto bail;
+
+    uint8_t* dirEntryPtr;
+    uint16_t dirBlock, dirKeyBlock;
+    int dirEntrySlot;
+    dirEntryPtr = pBatchDir->buf + slotOffset;
+    dirBlock = pBatchDir->blocks[slotOffset / kBlkSize];
+    dirKeyBlock = pBatchDir->pDir->fDirEntry.keyPointer;
+    dirEntrySlot = ((slotOffset % kBlkSize) - 4) / kEntryLength +1;
+    assert(dirEntrySlot >= 1 && dirEntrySlot <= kEntriesPerBlock);
+
+    long keyBlock;
+    int blocksUsed;
+    int newEOF;
+    keyBlock = -1;
+    blocksUsed = newEOF = -1;
+
+    dierr = AllocInitialFileStorage(pParms, upperName, dirBlock,
+                dirEntrySlot, &keyBlock, &blocksUsed, &newEOF);
+    if (dierr != kDIErrNone) {
+        pBatchDir->nextFree--;      // entry wasn't touched; give it back
+        goto bail;
+    }
+
+    assert(blocksUsed > 0);
+    assert(keyBlock > 0);
+    assert(newEOF >= 0);
+
+    /*
+     * Fill out the newly-created directory entry pointed to by "dirEntryPtr".
+     *
+     * ProDOS filenames are always stored in upper case.  ProDOS 8 v1.8 and
+     * later allow lower-case names with '.' converting to ' '.  We optionally
+     * set the flags here, using the original file name to decide which parts
+     * are lower case.  (Some parts of the original may have been stomped
+     * when the name was made unique, so we need to watch for that.)
+     */
+    dirEntryPtr[0x00] = (uint8_t)((pParms->storageType << 4) | strlen(upperName));
+    strncpy((char*) &dirEntryPtr[0x01], upperName, A2FileProDOS::kMaxFileName);
+    if (pParms->fileType >= 0 && pParms->fileType <= 0xff)
+        dirEntryPtr[0x10] = (uint8_t) pParms->fileType;
+    else
+        dirEntryPtr[0x10] = 0;      // HFS long type?
+    PutShortLE(&dirEntryPtr[0x11], (uint16_t) keyBlock);
+    PutShortLE(&dirEntryPtr[0x13], blocksUsed);
+    PutShortLE(&dirEntryPtr[0x15], newEOF);
+    dirEntryPtr[0x17] = 0;      // high byte of EOF
+    PutLongLE(&dirEntryPtr[0x18], A2FileProDOS::ConvertProDate(pParms->createWhen));
+    if (allowLowerCase) {
+        uint16_t lcBits;
+        lcBits = GenerateLowerCaseBits(upperName, fileName, false);
+        GenerateLowerCaseName(upperName, lowerName, lcBits, false);
+        lowerName[strlen(upperName)] = '\0';
+
+        PutShortLE(&dirEntryPtr[0x1c], lcBits);
+    } else {
+        strcpy(lowerName, upperName);
+        PutShortLE(&dirEntryPtr[0x1c], 0);  // version, min_version
+    }
+    dirEntryPtr[0x1e] = pParms->access;
+    if (pParms->auxType >= 0 && pParms->auxType <= 0xffff)
+        PutShortLE(&dirEntryPtr[0x1f], (uint16_t) pParms->auxType);
+    else
+        PutShortLE(&dirEntryPtr[0x1f], 0);
+    PutLongLE(&dirEntryPtr[0x21], A2FileProDOS::ConvertProDate(pParms->modWhen));
+    PutShortLE(&dirEntryPtr[0x25], dirKeyBlock);
+
+    /*
+     * Create an A2File entry for this.  The calls below will re-process
+     * some of what we just created, which is slightly inefficient but
+     * helps guarantee that we aren't creating bogus data structures that
+     * won't match what we see when the disk is reloaded.
+     */
+    pNewFile = new (this) A2FileProDOS(this);
+
+    A2FileProDOS::DirEntry* pEntry;
+    pEntry = &pNewFile->fDirEntry;
+
+    A2FileProDOS::InitDirEntry(pEntry, dirEntryPtr);
+
+    pNewFile->fParentDirBlock = dirBlock;
+    pNewFile->fParentDirIdx = dirEntrySlot-1;
+    pNewFile->fSparseDataEof = 0;
+    pNewFile->fSparseRsrcEof = 0;
+
+    /*
+     * Get the properly-cased filename for the file list.  We already have
+     * a name in "lowerName", but it doesn't take AppleWorks aux type
+     * case stuff into account.  If necessary, deal with it now.
+     *
+     * The directory's pathname is built from the names actually on the
+     * disk, which is what we want in the file list.
+     */
+    if (A2FileProDOS::UsesAppleWorksAuxType(pNewFile->fDirEntry.fileType)) {
+        DiskFSProDOS::GenerateLowerCaseName(pNewFile->fDirEntry.fileName,
+            lowerName, pNewFile->fDirEntry.auxType, true);
+    }
+    if (pBatchDir->pDir->IsVolumeDirectory())
+        pNewFile->SetPathName("", lowerName);
+    else
+        pNewFile->SetPathName(pBatchDir->pDir->GetPathName(), lowerName);
+
+    if (pEntry->storageType == A2FileProDOS::kStorageExtended) {
+        dierr = ReadExtendedInfo(pNewFile);
+        if (dierr != kDIErrNone) {
+            LOGI(" ProDOS GLITCH: readback of extended block failed!");
+            memset(dirEntryPtr, 0, kEntryLength);
+            pBatchDir->nextFree--;
+            goto bail;
+        }
+    }
+
+    pNewFile->SetParent(pBatchDir->pDir);
 
     /*
-     * Open the base path.  If it doesn't exist, create it recursively.
+     * The entry is in use.  Update the file count in the header.
      */
-    if (basePath != NULL) {
-        LOGI(" ProDOS  Creating '%s' in '%s'", fileName, basePath);
-        /* open the named subdir, creating it if it doesn't exist */
-        pSubdir = (A2FileProDOS*)GetFileByName(basePath);
-        if (pSubdir == NULL) {
+    uint16_t fileCount;
+    fileCount = GetShortLE(&pBatchDir->buf[0x25]);
+    PutShortLE(&pBatchDir->buf[0x25], fileCount+1);
+    pBatchDir->names.insert(upperName);
+    pBatchDir->dirty = true;
+
+    /*
+     * Remember the entry before this one, so we know where the file goes
+     * in the file list.  The entry allocator always returns the first
+     * available, so the previous entry is valid (or is the header).
+     */
+    uint8_t* prevDirEntryPtr;
+    uint16_t prevKeyBlock;
+    prevDirEntryPtr = GetPrevDirEntry(pBatchDir->buf, dirEntryPtr);
+    if (prevDirEntryPtr == NULL) {
+        prevKeyBlock = 0;
+    } else {
+        assert((prevDirEntryPtr[0x00] & 0xf0) != 0);        // verify storage type
+        prevKeyBlock = GetShortLE(&prevDirEntryPtr[0x11]);
+    }
+
+    pBatch->newFiles.push_back(pNewFile);
+    pBatch->prevKeyBlocks.push_back(prevKeyBlock);
+    if (pEntry->storageType == A2FileProDOS::kStorageDirectory)
+        pBatch->newDirsByPath[DirPathKey(pNewFile->GetPathName())] = pNewFile;
+
+    *ppNewFile = pNewFile;
+    pNewFile = NULL;
+
+bail:
+    delete pNewFile;
+    delete[] normalizedPath;
+    LOGD(" ProDOS ---^--- CreateFile '%s' DONE", pParms->pathName);
+    return dierr;
+}
+
+/*
+ * Find the directory for "basePath" in the batch, opening and loading it if
+ * this is the first time we've seen it.  If it doesn't exist, create it
+ * (and any missing parents) as part of the batch.
+ *
+ * "basePath" is a normalized ProDOS path, or NULL for the volume directory.
+ */
+DIError DiskFSProDOS::BatchOpenDir(CreateBatch* pBatch, const char* basePath,
+    BatchDir** ppBatchDir)
+{
+    DIError dierr = kDIErrNone;
+    BatchDir* pBatchDir = NULL;
+    A2FileProDOS* pDir;
+    std::string key;
+
+    if (basePath != NULL)
+        key = DirPathKey(basePath);
+    std::unordered_map<std::string, BatchDir*>::const_iterator iter =
+        pBatch->dirsByPath.find(key);
+    if (iter != pBatch->dirsByPath.end()) {
+        *ppBatchDir = iter->second;
+        return kDIErrNone;
+    }
+
+    if (basePath == NULL) {
+        /* volume dir must be first in the list */
+        pDir = (A2FileProDOS*) GetNextFile(NULL);
+        assert(pDir != NULL);
+        assert(pDir->IsVolumeDirectory());
+    } else {
+        std::unordered_map<std::string, A2FileProDOS*>::const_iterator
+            newIter = pBatch->newDirsByPath.find(key);
+        if (newIter != pBatch->newDirsByPath.end())
+            pDir = newIter->second;
+        else
+            pDir = (A2FileProDOS*) GetFileByName(basePath);
+
+        if (pDir == NULL) {
             LOGI("  ProDOS  Creating subdir '%s'", basePath);
-            A2File* pNewSub;
             CreateParms newDirParms;
             newDirParms.pathName = basePath;
             newDirParms.fssep = A2FileProDOS::kFssep;
@@ -1860,318 +3679,293 @@ DIError DiskFSProDOS::CreateFile(const CreateParms* pParms, A2File** ppNewFile)
             newDirParms.auxType = 0;
             newDirParms.access = 0xe3;  // unlocked, backup bit set
             newDirParms.createWhen = newDirParms.modWhen = time(NULL);
-            dierr = this->CreateFile(&newDirParms, &pNewSub);
+            dierr = BatchCreate(pBatch, &newDirParms, &pDir);
             if (dierr != kDIErrNone)
                 goto bail;
-            assert(pNewSub != NULL);
-
-            pSubdir = (A2FileProDOS*) pNewSub;
-        }
-
-        /*
-         * And now the annoying part.  We need to reconstruct basePath out
-         * of the filenames actually present, rather than relying on the
-         * argument passed in.  That's because some directories might have
-         * lower-case flags and some might not, and we do case-insensitive
-         * comparisons.  It's not crucial for our inner workings, but the
-         * linear file list in the DiskFS should have accurate strings.
-         * (It'll work just fine, but the display might show the wrong values
-         * for parent directories until they reload the disk.)
-         *
-         * On the bright side, we know exactly how long the string needs
-         * to be, so we can just stomp on it in place.  Assuming, of course,
-         * that the filename created matches up with what the filename
-         * normalizer came up with, which we can guarantee since (a) everybody
-         * uses the same normalizer and (b) the "uniqueify" stuff doesn't
-         * kick in for subdirs because we wouldn't be creating a new subdir
-         * if it didn't already exist.
-         *
-         * This is essentially the same as RegeneratePathName(), but that's
-         * meant for a situation where the filename already exists.
-         */
-        A2FileProDOS* pBaseDir = pSubdir;
-        int basePathLen = strlen(basePath);
-        while (!pBaseDir->IsVolumeDirectory()) {
-            const char* fixedName = pBaseDir->GetFileName();
-            int fixedLen = strlen(fixedName);
-            if (fixedLen > basePathLen) {
-                assert(false);
-                break;
-            }
-            assert(basePathLen == fixedLen ||
-                   *(basePath + (basePathLen-fixedLen-1)) == kDIFssep);
-            memcpy(basePath + (basePathLen-fixedLen), fixedName, fixedLen);
-            basePathLen -= fixedLen+1;
-
-            pBaseDir = (A2FileProDOS*) pBaseDir->GetParent();
-            assert(pBaseDir != NULL);
+            assert(pDir != NULL);
         }
-        // check the math
-        if (pSubdir->IsVolumeDirectory())
-            assert(basePathLen == 0);
-        else
-            assert(basePathLen == -1);
-    } else {
-        /* open the volume directory */
-        LOGI(" ProDOS  Creating '%s' in volume dir", fileName);
-        /* volume dir must be first in the list */
-        pSubdir = (A2FileProDOS*) GetNextFile(NULL);
-        assert(pSubdir != NULL);
-        assert(pSubdir->IsVolumeDirectory());
-    }
-    if (pSubdir == NULL) {
-        LOGI(" ProDOS Unable to open subdir '%s'", basePath);
-        dierr = kDIErrFileNotFound;
-        goto bail;
     }
 
     /*
-     * Load the block usage map into memory.  All changes, to the end of this
-     * function, are made to the in-memory copy and can be "undone" by simply
-     * throwing the temporary map away.
+     * Load the directory into memory.
      */
-    dierr = LoadVolBitmap();
+    pBatchDir = new BatchDir;
+    pBatchDir->pDir = pDir;
+    dierr = pDir->Open(&pBatchDir->pOpenDir, false);
     if (dierr != kDIErrNone)
-        return dierr;
+        goto bail;
 
-    /*
-     * Load the subdir or volume dir into memory, and alloc a new directory
-     * entry.
-     */
-    dierr = pSubdir->Open(&pOpenSubdir, false);
-    if (dierr != kDIErrNone)
+    pBatchDir->len = (long) pDir->GetDataLength();
+    if (pBatchDir->len < kBlkSize || (pBatchDir->len % kBlkSize) != 0) {
+        LOGI(" ProDOS GLITCH: funky dir EOF %ld (quality=%d)",
+            pBatchDir->len, pDir->GetQuality());
+        dierr = kDIErrBadFile;
         goto bail;
+    }
+    pBatchDir->bufSize = pBatchDir->len;
+    pBatchDir->buf = new uint8_t[pBatchDir->bufSize];
 
-    uint8_t* dirEntryPtr;
-    long dirLen;
-    uint16_t dirBlock, dirKeyBlock;
-    int dirEntrySlot;
-    dierr = AllocDirEntry(pOpenSubdir, &subdirBuf, &dirLen, &dirEntryPtr,
-                &dirKeyBlock, &dirEntrySlot, &dirBlock);
+    dierr = pBatchDir->pOpenDir->Read(pBatchDir->buf, pBatchDir->len);
     if (dierr != kDIErrNone)
         goto bail;
 
-    assert(subdirBuf != NULL);
-    assert(dirLen > 0);
-    assert(dirKeyBlock > 0);
-    assert(dirEntrySlot >= 0);
-    assert(dirBlock > 0);
-
-    /*
-     * Create a copy of the filename with everything in upper case and spaces
-     * changed to periods.
-     */
-    UpperCaseName(upperName, fileName);
-
-    /*
-     * Make the name unique within the current directory.  This requires
-     * appending digits until the name doesn't match any others.
-     *
-     * The filename buffer ("upperName") must be able to hold kMaxFileName+1
-     * chars.  It will be modified in place.
-     */
-    if (createUnique &&
-        pParms->storageType != A2FileProDOS::kStorageDirectory)
+    if (pBatchDir->buf[0x23] != kEntryLength ||
+        pBatchDir->buf[0x24] != kEntriesPerBlock)
     {
-        MakeFileNameUnique(subdirBuf, dirLen, upperName);
-    } else {
-        /* check to see if it already exists */
-        if (NameExistsInDir(subdirBuf, dirLen, upperName)) {
-            if (pParms->storageType == A2FileProDOS::kStorageDirectory)
-                dierr = kDIErrDirectoryExists;
-            else
-                dierr = kDIErrFileExists;
-            goto bail;
-        }
+        LOGI(" ProDOS GLITCH: funky entries per block %d",
+            pBatchDir->buf[0x24]);
+        dierr = kDIErrBadDirectory;
+        goto bail;
     }
 
     /*
-     * Allocate file storage and initialize:
-     *  - For directory, a single block with the directory header.
-     *  - For seedling, an empty block.
-     *  - For extended, an extended key block entry and two empty blocks.
+     * Note where each block lives, and run through the entries to gather
+     * the names in use and the empty slots.
      */
-    long keyBlock;
-    int blocksUsed;
-    int newEOF;
-    keyBlock = -1;
-    blocksUsed = newEOF = -1;
+    int blockIdx, entryIdx;
+    for (blockIdx = 0; blockIdx < pBatchDir->len / kBlkSize; blockIdx++) {
+        long block;
+        dierr = pBatchDir->pOpenDir->GetStorage(blockIdx, &block);
+        if (dierr != kDIErrNone)
+            goto bail;
+        pBatchDir->blocks.push_back((uint16_t) block);
+
+        long offset = kBlkSize * blockIdx + 4;  // skip 4 bytes of prev/next
+        for (entryIdx = 0; entryIdx < kEntriesPerBlock;
+                                        entryIdx++, offset += kEntryLength)
+        {
+            /* skip directory header */
+            if (blockIdx == 0 && entryIdx == 0)
+                continue;
+
+            const uint8_t* pDirEntry = pBatchDir->buf + offset;
+            if ((pDirEntry[0x00] & 0xf0) == 0) {
+                pBatchDir->freeSlots.push_back(offset);
+            } else {
+                pBatchDir->names.insert(std::string((const char*) &pDirEntry[0x01],
+                    pDirEntry[0x00] & 0x0f));
+            }
+        }
+    }
+    LOGD(" ProDOS  loaded dir '%s': %d names, %d empty slots",
+        pDir->GetPathName(), (int) pBatchDir->names.size(),
+        (int) pBatchDir->freeSlots.size());
 
-    dierr = AllocInitialFileStorage(pParms, upperName, dirBlock,
-                dirEntrySlot, &keyBlock, &blocksUsed, &newEOF);
-    if (dierr != kDIErrNone)
-        goto bail;
+    pBatch->dirs.push_back(pBatchDir);
+    pBatch->dirsByPath[key] = pBatchDir;
+    *ppBatchDir = pBatchDir;
+    pBatchDir = NULL;
 
-    assert(blocksUsed > 0);
-    assert(keyBlock > 0);
-    assert(newEOF >= 0);
+bail:
+    delete pBatchDir;
+    return dierr;
+}
 
-    /*
-     * Fill out the newly-created directory entry pointed to by "dirEntryPtr".
-     *
-     * ProDOS filenames are always stored in upper case.  ProDOS 8 v1.8 and
-     * later allow lower-case names with '.' converting to ' '.  We optionally
-     * set the flags here, using the original file name to decide which parts
-     * are lower case.  (Some parts of the original may have been stomped
-     * when the name was made unique, so we need to watch for that.)
-     */
-    dirEntryPtr[0x00] = (uint8_t)((pParms->storageType << 4) | strlen(upperName));
-    strncpy((char*) &dirEntryPtr[0x01], upperName, A2FileProDOS::kMaxFileName);
-    if (pParms->fileType >= 0 && pParms->fileType <= 0xff)
-        dirEntryPtr[0x10] = (uint8_t) pParms->fileType;
-    else
-        dirEntryPtr[0x10] = 0;      // HFS long type?
-    PutShortLE(&dirEntryPtr[0x11], (uint16_t) keyBlock);
-    PutShortLE(&dirEntryPtr[0x13], blocksUsed);
-    PutShortLE(&dirEntryPtr[0x15], newEOF);
-    dirEntryPtr[0x17] = 0;      // high byte of EOF
-    PutLongLE(&dirEntryPtr[0x18], A2FileProDOS::ConvertProDate(pParms->createWhen));
-    if (allowLowerCase) {
-        uint16_t lcBits;
-        lcBits = GenerateLowerCaseBits(upperName, fileName, false);
-        GenerateLowerCaseName(upperName, lowerName, lcBits, false);
-        lowerName[strlen(upperName)] = '\0';
+/*
+ * Allocate a new entry in a batch directory, returning its offset in the
+ * buffer.  We always hand out the first empty entry.  If the directory is
+ * full, and it's not the volume dir, we extend it by one block.
+ *
+ * This just allocates the space; it does not fill in any details.  If we
+ * have to extend the directory, the "prev/next" fields are filled in, and a
+ * block is allocated from the in-memory bitmap.
+ */
+DIError DiskFSProDOS::BatchAllocEntry(BatchDir* pBatchDir, long* pOffset)
+{
+    if (pBatchDir->nextFree < pBatchDir->freeSlots.size()) {
+        *pOffset = pBatchDir->freeSlots[pBatchDir->nextFree++];
+        assert(pBatchDir->buf[*pOffset] == 0x00);
+        return kDIErrNone;
+    }
 
-        PutShortLE(&dirEntryPtr[0x1c], lcBits);
-    } else {
-        strcpy(lowerName, upperName);
-        PutShortLE(&dirEntryPtr[0x1c], 0);  // version, min_version
+    uint8_t* buf = pBatchDir->buf;
+    if (((buf[0x04] & 0xf0) >> 4) == A2FileProDOS::kStorageVolumeDirHeader) {
+        /* can't extend the volume dir */
+        return kDIErrVolumeDirFull;
     }
-    dirEntryPtr[0x1e] = pParms->access;
-    if (pParms->auxType >= 0 && pParms->auxType <= 0xffff)
-        PutShortLE(&dirEntryPtr[0x1f], (uint16_t) pParms->auxType);
-    else
-        PutShortLE(&dirEntryPtr[0x1f], 0);
-    PutLongLE(&dirEntryPtr[0x21], A2FileProDOS::ConvertProDate(pParms->modWhen));
-    PutShortLE(&dirEntryPtr[0x25], dirKeyBlock);
+
+    LOGI(" ProDOS ran out of directory space, adding another block");
 
     /*
-     * Write updated directory.  If this succeeds, we can no longer undo
-     * what we have done by simply bailing.  If this fails partway through,
-     * we might have a corrupted disk, so it's best to ensure that it's not
-     * going to fail before we call.
-     *
-     * Assuming this isn't a nibble image with I/O errors, the only way we
-     * can really fail is by running out of disk space.  The block has been
-     * pre-allocated, so this should always work.
+     * Request an unused block from the system.  Point the "next" pointer
+     * in the last block at it, so that when we go to write this dir
+     * we will know where to put it.
      */
-    dierr = pOpenSubdir->Write(subdirBuf, dirLen);
-    if (dierr != kDIErrNone) {
-        LOGI(" ProDOS directory write failed (dirLen=%ld)", dirLen);
-        goto bail;
+    uint8_t* pBlock = buf + pBatchDir->len - kBlkSize;
+    if (pBlock[0x02] != 0) {
+        LOGI(" ProDOS GLITCH: adding to block with nonzero next ptr!");
+        return kDIErrBadDirectory;
     }
 
+    long newBlock = AllocBlock();
+    if (newBlock < 0)
+        return kDIErrDiskFull;
+    NoteBlockPurpose(newBlock, VolumeUsage::kChunkPurposeSubdir);
+
+    PutShortLE(&pBlock[0x02], (uint16_t) newBlock);     // set "next"
+
     /*
-     * Flush updated block usage map.
+     * Extend our memory buffer to hold the new block.  Double it, so a
+     * directory with thousands of files doesn't get copied thousands of
+     * times.
      */
-    dierr = SaveVolBitmap();
-    if (dierr != kDIErrNone)
-        goto bail;
+    if (pBatchDir->len + kBlkSize > pBatchDir->bufSize) {
+        long newSize = pBatchDir->bufSize * 2;
+        uint8_t* newSpace = new uint8_t[newSize];
+        memcpy(newSpace, buf, pBatchDir->len);
+        delete[] buf;
+        pBatchDir->buf = buf = newSpace;
+        pBatchDir->bufSize = newSize;
+    }
 
     /*
-     * Success!
-     *
-     * Create an A2File entry for this, and add it to the list.  The calls
-     * below will re-process some of what we just created, which is slightly
-     * inefficient but helps guarantee that we aren't creating bogus data
-     * structures that won't match what we see when the disk is reloaded.
-     *
-     * - Regen or update internal VolumeUsage map??  Throw it away or mark
-     * it as invalid?
+     * Set the "prev" pointer in the new block to point at the last
+     * block of the existing directory structure.
      */
-    pNewFile = new A2FileProDOS(this);
+    pBlock = buf + pBatchDir->len;
+    memset(pBlock, 0, kBlkSize);
+    PutShortLE(&pBlock[0x00], pBatchDir->blocks.back());    // set "prev"
+
+    long offset = pBatchDir->len + 4;
+    for (int i = 0; i < kEntriesPerBlock; i++, offset += kEntryLength)
+        pBatchDir->freeSlots.push_back(offset);
+    pBatchDir->blocks.push_back((uint16_t) newBlock);
+    pBatchDir->len += kBlkSize;
+    pBatchDir->dirty = true;
+
+    *pOffset = pBatchDir->freeSlots[pBatchDir->nextFree++];
+    return kDIErrNone;
+}
 
-    A2FileProDOS::DirEntry* pEntry;
-    pEntry = &pNewFile->fDirEntry;
+/*
+ * Write the batch's directories and the volume bitmap, then add the new
+ * files to the DiskFS file list.
+ *
+ * If a directory write fails partway through, we might have a corrupted
+ * disk.  Assuming this isn't a nibble image with I/O errors, the only way
+ * we can really fail is by running out of disk space, and the blocks have
+ * been pre-allocated, so this should always work.
+ */
+DIError DiskFSProDOS::BatchCommit(CreateBatch* pBatch)
+{
+    DIError dierr = kDIErrNone;
+    bool anyDirty = false;
+    size_t i;
 
-    A2FileProDOS::InitDirEntry(pEntry, dirEntryPtr);
+    /*
+     * Write all of the directories before closing any of them.  Closing
+     * an extended directory updates its entry in the parent, which may
+     * be one of the directories we're writing.
+     */
+    for (i = 0; i < pBatch->dirs.size(); i++) {
+        BatchDir* pBatchDir = pBatch->dirs[i];
+        if (!pBatchDir->dirty)
+            continue;
 
-    pNewFile->fParentDirBlock = dirBlock;
-    pNewFile->fParentDirIdx = (dirEntrySlot-1) % kEntriesPerBlock;
-    pNewFile->fSparseDataEof = 0;
-    pNewFile->fSparseRsrcEof = 0;
+        anyDirty = true;
+        dierr = pBatchDir->pOpenDir->Write(pBatchDir->buf, pBatchDir->len);
+        if (dierr != kDIErrNone) {
+            LOGI(" ProDOS directory write failed (dirLen=%ld)",
+                pBatchDir->len);
+            return dierr;
+        }
+    }
 
     /*
-     * Get the properly-cased filename for the file list.  We already have
-     * a name in "lowerName", but it doesn't take AppleWorks aux type
-     * case stuff into account.  If necessary, deal with it now.
+     * Flush updated block usage map.
      */
-    if (A2FileProDOS::UsesAppleWorksAuxType(pNewFile->fDirEntry.fileType)) {
-        DiskFSProDOS::GenerateLowerCaseName(pNewFile->fDirEntry.fileName,
-            lowerName, pNewFile->fDirEntry.auxType, true);
+    if (anyDirty) {
+        dierr = SaveVolBitmap();
+        if (dierr != kDIErrNone)
+            return dierr;
     }
-    pNewFile->SetPathName(basePath == NULL ? "" : basePath, lowerName);
 
-    if (pEntry->storageType == A2FileProDOS::kStorageExtended) {
-        dierr = ReadExtendedInfo(pNewFile);
-        if (dierr != kDIErrNone) {
-            LOGI(" ProDOS GLITCH: readback of extended block failed!");
-            delete pNewFile;
-            goto bail;
+    for (i = 0; i < pBatch->dirs.size(); i++) {
+        BatchDir* pBatchDir = pBatch->dirs[i];
+        DIError closeErr = pBatchDir->pOpenDir->Close();
+        pBatchDir->pOpenDir = NULL;
+        if (closeErr != kDIErrNone) {
+            LOGI(" ProDOS failed closing dir '%s'",
+                pBatchDir->pDir->GetPathName());
+            if (dierr == kDIErrNone)
+                dierr = closeErr;
         }
     }
 
-    pNewFile->SetParent(pSubdir);
-    //pNewFile->Dump();
-
     /*
+     * Success!  Add the files to the list.
+     *
      * Because we're hierarchical, and we guarantee that the contents of
-     * subdirectories are grouped together, we must insert the file into an
+     * subdirectories are grouped together, we must insert each file into an
      * appropriate place in the list rather than just throwing it onto the
      * end.
      *
      * The proper location for the new file in the linear list is after the
      * previous file in our subdir.  If we're the first item in the subdir,
-     * we get added right after the parent.  If not, we need to scan, starting
-     * from the parent, for an entry in the file list whose key block pointer
-     * matches that of the previous item in the list.
-     *
-     * We wouldn't be this far if the disk were damaged, so we don't have to
-     * worry too much about weirdness.  The directory entry allocator always
-     * returns the first available, so we know the previous entry is valid.
+     * we get added right after the parent.  If not, we need to find the
+     * file whose key block pointer matches that of the previous entry.
+     * That's either something we created in this batch (and have already
+     * added, since entries are handed out in order), or something that was
+     * there before, in which case we scan for it starting from the parent.
      */
-    uint8_t* prevDirEntryPtr;
-    prevDirEntryPtr = GetPrevDirEntry(subdirBuf, dirEntryPtr);
-    if (prevDirEntryPtr == NULL) {
-        /* previous entry is volume or subdir header */
-        InsertFileInList(pNewFile, pNewFile->GetParent());
-        LOGI("Inserted '%s' after '%s'",
-            pNewFile->GetPathName(), pNewFile->GetParent()->GetPathName());
-    } else {
-        /* dig out the key block pointer and find the matching file */
-        uint16_t prevKeyBlock;
-        assert((prevDirEntryPtr[0x00] & 0xf0) != 0);        // verify storage type
-        prevKeyBlock = GetShortLE(&prevDirEntryPtr[0x11]);
-        A2File* pPrev;
-        pPrev = FindFileByKeyBlock(pNewFile->GetParent(), prevKeyBlock);
-        if (pPrev == NULL) {
-            /* should be impossible! */
-            assert(false);
-            AddFileToList(pNewFile);
+    std::unordered_map<uint16_t, A2File*> newByKeyBlock;
+    for (i = 0; i < pBatch->newFiles.size(); i++) {
+        A2FileProDOS* pNewFile = pBatch->newFiles[i];
+        uint16_t prevKeyBlock = pBatch->prevKeyBlocks[i];
+
+        if (prevKeyBlock == 0) {
+            /* previous entry is volume or subdir header */
+            InsertFileInList(pNewFile, pNewFile->GetParent());
         } else {
-            /* insert the new file in the list after the previous file */
-            InsertFileInList(pNewFile, pPrev);
+            A2File* pPrev;
+            std::unordered_map<uint16_t, A2File*>::const_iterator iter =
+                newByKeyBlock.find(prevKeyBlock);
+            if (iter != newByKeyBlock.end())
+                pPrev = iter->second;
+            else
+                pPrev = FindFileByKeyBlock(pNewFile->GetParent(), prevKeyBlock);
+            if (pPrev == NULL) {
+                /* should be impossible! */
+                assert(false);
+                AddFileToList(pNewFile);
+            } else {
+                /* insert the new file in the list after the previous file */
+                InsertFileInList(pNewFile, pPrev);
+            }
         }
+        newByKeyBlock[pNewFile->fDirEntry.keyPointer] = pNewFile;
     }
-//  LOGI("LIST NOW:");
-//  DumpFileList();
+    LOGI(" ProDOS added %d files", (int) pBatch->newFiles.size());
 
-    *ppNewFile = pNewFile;
-    pNewFile = NULL;
+    /* remember where the new and expanded directories live */
+    DirBlockMap* pDirBlocks = GetDirBlockMap();
+    for (i = 0; i < pBatch->newFiles.size(); i++) {
+        A2FileProDOS* pNewFile = pBatch->newFiles[i];
+        if (pNewFile->fDirEntry.storageType == A2FileProDOS::kStorageDirectory) {
+            pDirBlocks->dirs[pNewFile].assign(1,
+                pNewFile->fDirEntry.keyPointer);
+        }
+    }
+    for (i = 0; i < pBatch->dirs.size(); i++) {
+        BatchDir* pBatchDir = pBatch->dirs[i];
+        if (pBatchDir->dirty)
+            pDirBlocks->dirs[pBatchDir->pDir] = pBatchDir->blocks;
+    }
+    pBatch->newFiles.clear();
 
-bail:
-    delete pNewFile;
-    if (pOpenSubdir != NULL)
-        pOpenSubdir->Close();   // writes updated dir entry in parent dir
-    FreeVolBitmap();
-    delete[] normalizedPath;
-    delete[] subdirBuf;
-    delete[] fileName;
-    delete[] basePath;
-    LOGI(" ProDOS ---^--- CreateFile '%s' DONE", pParms->pathName);
     return dierr;
 }
 
+/*
+ * Get the directory block map, creating it if necessary.
+ */
+DiskFSProDOS::DirBlockMap* DiskFSProDOS::GetDirBlockMap(void)
+{
+    if (fpDirBlocks == NULL)
+        fpDirBlocks = new DirBlockMap;
+    return fpDirBlocks;
+}
+
 /*
  * Run through the DiskFS file list, looking for an entry with a matching
  * key block.
@@ -2207,12 +4001,12 @@ DIError DiskFSProDOS::AllocInitialFileStorage(const CreateParms* pParms,
 {
     DIError dierr = kDIErrNone;
     uint8_t blkBuf[kBlkSize];
-    long keyBlock;
+    long keyBlock, dataBlock, rsrcBlock;
     int blocksUsed;
     int newEOF;
 
     blocksUsed = -1;
-    keyBlock = -1;
+    keyBlock = dataBlock = rsrcBlock = -1;
     newEOF = 0;
     memset(blkBuf, 0, sizeof(blkBuf));
 
@@ -2229,8 +4023,6 @@ DIError DiskFSProDOS::AllocInitialFileStorage(const CreateParms* pParms,
         if (dierr != kDIErrNone)
             goto bail;
     } else if (pParms->storageType == A2FileProDOS::kStorageExtended) {
-        long dataBlock, rsrcBlock;
-
         dataBlock = AllocBlock();
         rsrcBlock = AllocBlock();
         keyBlock = AllocBlock();
@@ -2259,6 +4051,7 @@ DIError DiskFSProDOS::AllocInitialFileStorage(const CreateParms* pParms,
         dierr = fpImg->WriteBlock(keyBlock, blkBuf);
         if (dierr != kDIErrNone)
             goto bail;
+        NoteBlockPurpose(keyBlock, VolumeUsage::kChunkPurposeFileStruct);
     } else if (pParms->storageType == A2FileProDOS::kStorageDirectory) {
         keyBlock = AllocBlock();
         if (keyBlock == -1) {
@@ -2288,6 +4081,7 @@ DIError DiskFSProDOS::AllocInitialFileStorage(const CreateParms* pParms,
         dierr = fpImg->WriteBlock(keyBlock, blkBuf);
         if (dierr != kDIErrNone)
             goto bail;
+        NoteBlockPurpose(keyBlock, VolumeUsage::kChunkPurposeSubdir);
     } else {
         assert(false);
         dierr = kDIErrInternal;
@@ -2299,6 +4093,15 @@ DIError DiskFSProDOS::AllocInitialFileStorage(const CreateParms* pParms,
     *pNewEOF = newEOF;
 
 bail:
+    if (dierr != kDIErrNone) {
+        /* give back whatever we got, so the caller can keep going */
+        if (keyBlock > 0)
+            SetBlockUseEntry(keyBlock, false);
+        if (dataBlock > 0)
+            SetBlockUseEntry(dataBlock, false);
+        if (rsrcBlock > 0)
+            SetBlockUseEntry(rsrcBlock, false);
+    }
     return dierr;
 }
 
@@ -2787,205 +4590,6 @@ void DiskFSProDOS::UpperCaseName(char* upperName, const char* name)
         upperName[i] = '\0';
 }
 
-/*
- * Allocate a new directory entry.  We start by reading the entire thing
- * into memory.  If the current set of allocated directory blocks is full,
- * and we're not operating on the volume dir, we extend the directory.
- *
- * This just allocates the space; it does not fill in any details, except
- * for the prev/next block pointers and the file count in the header.  (One
- * small exception: if we have to extend the directory, the "prev/next" fields
- * of the new block will be filled in.)
- *
- * The volume in-use block map must be loaded before this is called.  If
- * this needs to extend the directory, a new block will be allocated.
- *
- * Returns a pointer to the new entry, and a whole bunch of other stuff:
- *  "ppDir" gets a pointer to newly-allocated memory with the whole directory
- *  "pDirLen" is the size of the *ppDir buffer
- *  "ppDirEntry" gets a memory pointer to the start of the created entry
- *  "pDirKeyBlock" gets the key block of the directory as a whole
- *  "pDirEntrySlot" gets the slot number within the directory block (first is 1)
- *  "pDirBlock" gets the actual block in which the created entry resides
- *
- * The caller should Write the entire thing to "pOpenSubdir" after filling
- * in the new details for the entry.
- *
- * Possible reasons for failure: disk is out of space, volume dir is out
- * of space, pOpenSubdir is screwy.
- *
- * We guarantee that we will return the first available entry in the current
- * directory.
- */
-DIError DiskFSProDOS::AllocDirEntry(A2FileDescr* pOpenSubdir, uint8_t** ppDir,
-    long* pDirLen, uint8_t** ppDirEntry, uint16_t* pDirKeyBlock,
-    int* pDirEntrySlot, uint16_t* pDirBlock)
-{
-    assert(pOpenSubdir != NULL);
-    *ppDirEntry = NULL;
-    *pDirLen = -1;
-    *pDirKeyBlock = 0;
-    *pDirEntrySlot = -1;
-    *pDirBlock = 0;
-
-    DIError dierr = kDIErrNone;
-    uint8_t* dirBuf = NULL;
-    long dirLen;
-    A2FileProDOS* pFile;
-    long newBlock = -1;
-
-    /*
-     * Load the subdir into memory.
-     */
-    pFile = (A2FileProDOS*) pOpenSubdir->GetFile();
-    dirLen = (long) pFile->GetDataLength();
-    if (dirLen < 512 || (dirLen % 512) != 0) {
-        LOGI(" ProDOS GLITCH: funky dir EOF %ld (quality=%d)",
-            dirLen, pFile->GetQuality());
-        dierr = kDIErrBadFile;
-        goto bail;
-    }
-    dirBuf = new uint8_t[dirLen];
-    if (dirBuf == NULL) {
-        dierr = kDIErrMalloc;
-        goto bail;
-    }
-
-    dierr = pOpenSubdir->Read(dirBuf, dirLen);
-    if (dierr != kDIErrNone)
-        goto bail;
-
-    if (dirBuf[0x23] != kEntryLength ||
-        dirBuf[0x24] != kEntriesPerBlock)
-    {
-        LOGI(" ProDOS GLITCH: funky entries per block %d", dirBuf[0x24]);
-        dierr = kDIErrBadDirectory;
-        goto bail;
-    }
-
-    /*
-     * Find the first available entry (storage_type is zero).  We need to
-     * step through this by blocks, because the data is block-oriented.
-     * If we run off the end of the last block, (re)alloc a new one.
-     */
-    uint8_t* pDirEntry;
-    int blockIdx;
-    int entryIdx;
-
-    pDirEntry = NULL;    // make the compiler happy
-    entryIdx = -1;      // make the compiler happy
-
-    for (blockIdx = 0; blockIdx < dirLen / 512; blockIdx++) {
-        pDirEntry = dirBuf + 512*blockIdx + 4;  // skip 4 bytes of prev/next
-
-        for (entryIdx = 0; entryIdx < kEntriesPerBlock;
-                                        entryIdx++, pDirEntry += kEntryLength)
-        {
-            if ((pDirEntry[0x00] & 0xf0) == 0) {
-                LOGI(" ProDOS  Found empty dir entry in slot %d", entryIdx);
-                break;      // found one; break out of inner loop
-            }
-        }
-        if (entryIdx < kEntriesPerBlock)
-            break;      // out of outer loop
-    }
-    if (blockIdx == dirLen / 512) {
-        if (((dirBuf[0x04] & 0xf0) >> 4) == A2FileProDOS::kStorageVolumeDirHeader)
-        {
-            /* can't extend the volume dir */
-            dierr = kDIErrVolumeDirFull;
-            goto bail;
-        }
-
-        LOGI(" ProDOS ran out of directory space, adding another block");
-
-        /*
-         * Request an unused block from the system.  Point the "next" pointer
-         * in the last block at it, so that when we go to write this dir
-         * we will know where to put it.
-         */
-        uint8_t* pBlock;
-        pBlock = dirBuf + 512 * (blockIdx-1);
-        if (pBlock[0x02] != 0) {
-            LOGI(" ProDOS GLITCH: adding to block with nonzero next ptr!");
-            dierr = kDIErrBadDirectory;
-            goto bail;
-        }
-
-        newBlock = AllocBlock();
-        if (newBlock < 0) {
-            dierr = kDIErrDiskFull;
-            goto bail;
-        }
-
-        PutShortLE(&pBlock[0x02], (uint16_t) newBlock);   // set "next"
-
-        /*
-         * Extend our memory buffer to hold the new entry.
-         */
-        uint8_t* newSpace = new uint8_t[dirLen + 512];
-        if (newSpace == NULL) {
-            dierr = kDIErrMalloc;
-            goto bail;
-        }
-        memcpy(newSpace, dirBuf, dirLen);
-        memset(newSpace + dirLen, 0, 512);
-        delete[] dirBuf;
-        dirBuf = newSpace;
-        dirLen += 512;
-
-        /*
-         * Set the "prev" pointer in the new block to point at the last
-         * block of the existing directory structure.
-         */
-        long lastBlock;
-        dierr = pOpenSubdir->GetStorage(blockIdx-1, &lastBlock);
-        if (dierr != kDIErrNone)
-            goto bail;
-        pBlock = dirBuf + 512 * blockIdx;
-        PutShortLE(&pBlock[0x00], (uint16_t) lastBlock);    // set "prev"
-        assert(GetShortLE(&pBlock[0x02]) == 0);             // "next" pointer
-
-        /*
-         * Finally, point pDirEntry at the first entry in the new area.
-         */
-        pDirEntry = pBlock + 4;
-        entryIdx = 0;
-        assert(pDirEntry[0x00] == 0x00);
-    }
-
-    /*
-     * Success.  Update the file count in the header.
-     */
-    uint16_t count;
-    count = GetShortLE(&dirBuf[0x25]);
-    count++;
-    PutShortLE(&dirBuf[0x25], count);
-
-    long whichBlock;
-
-    *ppDir = dirBuf;
-    *pDirLen = dirLen;
-    *ppDirEntry = pDirEntry;
-    *pDirKeyBlock = pFile->fDirEntry.keyPointer;
-    *pDirEntrySlot = entryIdx +1;
-    if (blockIdx == ((A2FDProDOS*)pOpenSubdir)->GetBlockCount()) {
-        /* not yet added to block list, so can't use GetStorage */
-        assert(newBlock > 0);
-        *pDirBlock = (uint16_t) newBlock;
-    } else {
-        assert(newBlock < 0);
-        dierr = pOpenSubdir->GetStorage(blockIdx, &whichBlock);
-        assert(dierr == kDIErrNone);
-        *pDirBlock = (uint16_t) whichBlock;
-    }
-    dirBuf = NULL;
-
-bail:
-    delete[] dirBuf;
-    return dierr;
-}
-
 /*
  * Given a pointer to a directory buffer and a pointer to an entry, find the
  * previous entry.  (This is handy when trying to figure out where to insert
@@ -3025,24 +4629,22 @@ uint8_t* DiskFSProDOS::GetPrevDirEntry(uint8_t* buf, uint8_t* ptr)
 }
 
 /*
- * Make the name pointed to by "fileName" unique within the directory
- * loaded in "subdirBuf".  The name should already be trimmed to 15 chars
- * or less and converted to upper-case only, and be in a buffer that can
- * hold at least kMaxFileName+1 bytes.
+ * Make the name pointed to by "fileName" unique within the batch directory
+ * "pBatchDir".  The name should already be trimmed to 15 chars or less and
+ * converted to upper-case only, and be in a buffer that can hold at least
+ * kMaxFileName+1 bytes.
  *
  * Returns an error on failure, which should only happen if there are a
  * large number of files with similar names.
  */
-DIError DiskFSProDOS::MakeFileNameUnique(const uint8_t* dirBuf, long dirLen,
+DIError DiskFSProDOS::MakeFileNameUnique(const BatchDir* pBatchDir,
     char* fileName)
 {
-    assert(dirBuf != NULL);
-    assert(dirLen > 0);
-    assert((dirLen % 512) == 0);
+    assert(pBatchDir != NULL);
     assert(fileName != NULL);
     assert(strlen(fileName) <= A2FileProDOS::kMaxFileName);
 
-    if (!NameExistsInDir(dirBuf, dirLen, fileName))
+    if (pBatchDir->names.count(fileName) == 0)
         return kDIErrNone;
 
     LOGI(" ProDOS   found duplicate of '%s', making unique", fileName);
@@ -3095,51 +4697,13 @@ DIError DiskFSProDOS::MakeFileNameUnique(const uint8_t* dirBuf, long dirLen,
         memcpy(fileName + copyOffset, digitBuf, digitLen);
         if (dotLen != 0)
             memcpy(fileName + copyOffset + digitLen, dotBuf, dotLen);
-    } while (NameExistsInDir(dirBuf, dirLen, fileName));
+    } while (pBatchDir->names.count(fileName) != 0);
 
     LOGI(" ProDOS  converted to unique name: %s", fileName);
 
     return kDIErrNone;
 }
 
-/*
- * Determine whether the specified file name exists in the raw directory
- * buffer.
- *
- * This should be called with the upper-case-only version of the filename.
- */
-bool DiskFSProDOS::NameExistsInDir(const uint8_t* dirBuf, long dirLen,
-    const char* fileName)
-{
-    const uint8_t* pDirEntry;
-    int blockIdx;
-    int entryIdx;
-    int nameLen = strlen(fileName);
-
-    assert(nameLen <= A2FileProDOS::kMaxFileName);
-
-    for (blockIdx = 0; blockIdx < dirLen / 512; blockIdx++) {
-        pDirEntry = dirBuf + 512*blockIdx + 4;      // skip 4 bytes of prev/next
-
-        for (entryIdx = 0; entryIdx < kEntriesPerBlock;
-                                        entryIdx++, pDirEntry += kEntryLength)
-        {
-            /* skip directory header */
-            if (blockIdx == 0 && entryIdx == 0)
-                continue;
-
-            if ((pDirEntry[0x00] & 0xf0) != 0 &&
-                (pDirEntry[0x00] & 0x0f) == nameLen &&
-                strncmp((char*) &pDirEntry[0x01], fileName, nameLen) == 0)
-            {
-                return true;
-            }
-        }
-    }
-
-    return false;
-}
-
 /*
  * Delete a file.
  *
@@ -3165,7 +4729,7 @@ DIError DiskFSProDOS::DeleteFile(A2File* pGenericFile)
 
     if (fpImg->GetReadOnly())
         return kDIErrAccessDenied;
-    if (!fDiskIsGood)
+    if (GetFSDamaged())
         return kDIErrBadDiskImage;
     if (pGenericFile->IsFileOpen())
         return kDIErrFileOpen;
@@ -3253,6 +4817,14 @@ DIError DiskFSProDOS::DeleteFile(A2File* pGenericFile)
     if (indexList != NULL)
         FreeBlocks(indexCount, indexList);
 
+    /* the blocks are going back to the pool, so drop the cached lists */
+    if (pFile->fDirEntry.storageType == A2FileProDOS::kStorageExtended) {
+        ForgetBlockList(pFile->fExtRsrc.keyBlock);
+        ForgetBlockList(pFile->fExtData.keyBlock);
+    } else {
+        ForgetBlockList(pFile->fDirEntry.keyPointer);
+    }
+
     /*
      * Update the directory entry.  After this point, failure gets ugly.
      *
@@ -3345,6 +4917,8 @@ DIError DiskFSProDOS::DeleteFile(A2File* pGenericFile)
     /*
      * Remove the A2File* from the list.
      */
+    if (fpDirBlocks != NULL)
+        fpDirBlocks->dirs.erase(pFile);
     DeleteFileFromList(pFile);
 
 bail:
@@ -3422,7 +4996,7 @@ DIError DiskFSProDOS::RenameFile(A2File* pGenericFile, const char* newName)
         return kDIErrInvalidArg;
     if (fpImg->GetReadOnly())
         return kDIErrAccessDenied;
-    if (!fDiskIsGood)
+    if (GetFSDamaged())
         return kDIErrBadDiskImage;
 
     LOGI(" ProDOS renaming '%s' to '%s'", pFile->GetPathName(), newName);
@@ -3546,6 +5120,14 @@ DIError DiskFSProDOS::RenameFile(A2File* pGenericFile, const char* newName)
      * At this point the ProDOS filesystem is back in a consistent state.
      * Everything we do from here on is self-inflicted.
      *
+     * The lower-case flags went into the entry, so update our copy.
+     */
+    pFile->fDirEntry.version = (uint8_t) lcFlags;
+    pFile->fDirEntry.minVersion = (uint8_t) (lcFlags >> 8);
+    if (isAW)
+        pFile->fDirEntry.auxType = lcAuxType;
+
+    /*
      * We need to update this entry's A2FileProDOS::fDirEntry.fileName,
      * as well as the A2FileProDOS::fPathName.  If this was a subdir, then
      * we need to update A2FileProDOS::fPathName for all files inside the
@@ -3714,6 +5296,22 @@ DIError DiskFSProDOS::SetFileInfo(A2File* pGenericFile, uint32_t fileType,
     pFile->fDirEntry.auxType = (uint16_t) auxType;
     pFile->fDirEntry.access = (uint8_t) accessFlags;
 
+    /*
+     * The AppleWorks types keep the lower-case flags in the aux type, so
+     * changing either one can change the displayed name.
+     */
+    A2FileProDOS::DirEntry newEntry;
+    A2FileProDOS::InitDirEntry(&newEntry, ptr);
+    if (strcmp(newEntry.fileName, pFile->fDirEntry.fileName) != 0) {
+        strcpy(pFile->fDirEntry.fileName, newEntry.fileName);
+        if (pFile->IsDirectory()) {
+            for (A2File* pCur = pFile; pCur != NULL; pCur = GetNextFile(pCur))
+                RegeneratePathName((A2FileProDOS*) pCur);
+        } else {
+            RegeneratePathName(pFile);
+        }
+    }
+
 bail:
     return dierr;
 }
@@ -3855,7 +5453,7 @@ bail:
     tmbuf.tm_wday = 0;
     tmbuf.tm_yday = 0;
     tmbuf.tm_isdst = -1;        // let it figure DST and time zone
-    when = mktime(&tmbuf);
+    when = MakeTime(&tmbuf);
 
     if (when == (time_t) -1)
         when = 0;
@@ -3872,13 +5470,14 @@ bail:
 {
     ProDate proDate;
     uint32_t prodosDate, prodosTime;
+    struct tm tmbuf;
     struct tm* ptm;
     int year;
 
     if (unixDate == 0 || unixDate == -1 || unixDate == -2)
         return 0;
 
-    ptm = localtime(&unixDate);
+    ptm = LocalTime(&unixDate, &tmbuf);
     if (ptm == NULL)
         return 0;       // must've been invalid or unspecified
 
@@ -3928,11 +5527,9 @@ time_t A2FileProDOS::GetModWhen(void) const
 void A2FileProDOS::SetPathName(const char* basePath, const char* fileName)
 {
     assert(basePath != NULL && fileName != NULL);
-    if (fPathName != NULL)
-        delete[] fPathName;
 
     int baseLen = strlen(basePath);
-    fPathName = new char[baseLen + 1 + strlen(fileName)+1];
+    fPathName = AllocPathName(fPathName, baseLen + 1 + strlen(fileName)+1);
     strcpy(fPathName, basePath);
     if (baseLen != 0 &&
         !(baseLen == 1 && basePath[0] == ':'))
@@ -4140,6 +5737,13 @@ DIError A2FileProDOS::LoadBlockList(int storageType, uint16_t keyBlock,
         return kDIErrNotSupported;
     }
 
+    /* if the volume scan saved the lists, use those */
+    if (((DiskFSProDOS*) fpDiskFS)->GetCachedBlockList(storageType, keyBlock,
+            eof, pBlockCount, pBlockList, pIndexBlockCount, pIndexBlockList))
+    {
+        return kDIErrNone;
+    }
+
     DIError dierr = kDIErrNone;
     uint16_t* list = NULL;
     long count;
@@ -4515,36 +6119,65 @@ DIError A2FDProDOS::Read(void* buf, size_t len, size_t* pActual)
     return dierr;
 }
 
+/*
+ * State for a file that's being filled in by a series of Write calls.
+ *
+ * A block isn't written until we know more data follows it, because the
+ * last block is handled specially: a file that fits in one block is a
+ * seedling, and stores its data in the key block.  We also hold off on
+ * allocating anything while the file is nothing but zeroes, so that an
+ * empty file of any length can be stored as a seedling.
+ */
+struct A2FDProDOS::WriteState {
+    WriteState(void) : partialLen(0), allZero(true), zeroBlocks(0),
+        reserveNext(0), reserveEnd(0), progressCounter(0), failed(false)
+        {}
+
+    uint8_t     partial[kBlkSize];      // data not yet written to disk
+    int         partialLen;
+    bool        allZero;                // nothing but zeroes so far?
+    long        zeroBlocks;             // #of full blocks seen while allZero
+
+    std::vector<uint16_t> blocks;       // data blocks; 0 means sparse
+    std::vector<uint16_t> indexBlocks;  // index blocks, one per 256 data blks
+
+    long        reserveNext;            // blocks set aside from the size hint
+    long        reserveEnd;
+    int         progressCounter;
+    bool        failed;                 // give the blocks back on Close
+};
+
+A2FDProDOS::~A2FDProDOS(void)
+{
+    delete fpWriteState;
+    delete[] fBlockList;
+    fBlockList = NULL;
+}
+
 /*
  * Write data at the current offset.
  *
- * For simplicity, we assume that there can only be one of two situations:
- *  (1) We're writing a directory, which might expand by one block; or
- *  (2) We're writing all of a brand-new file in one shot.
+ * There are two situations we handle:
+ *  (1) We're writing a directory, which might expand; or
+ *  (2) We're appending to a brand-new file.  This may be done with any
+ *      number of calls.  Data blocks (and, for tree files, index blocks)
+ *      are allocated and written as the data arrives; the key block and
+ *      the directory entry are updated by Close.
  *
- * Modifies fOpenEOF, fOpenBlocksUsed, fStorageType, and sets fModified.
+ * The volume bitmap is saved at the end of every call, so it always
+ * accounts for the blocks we've written.  If a call fails or is cancelled,
+ * the file is left empty, and the blocks are released when it's closed.
  *
- * HEY: ProSel-16 describes these as fragmented, and it's probably right.
- * The correct way to do this is to allocate index blocks before allocating
- * the blocks they refer to, so that we don't have to jump all over the disk
- * to read the indexes (which, at the moment, appear at the end of the file).
- * A bit tricky, but doable.
+ * Modifies fOpenEOF, fOpenBlocksUsed, and fOffset.  Close sets the storage
+ * type and fModified.
  */
 DIError A2FDProDOS::Write(const void* buf, size_t len, size_t* pActual)
 {
     DIError dierr = kDIErrNone;
     A2FileProDOS* pFile = (A2FileProDOS*) fpFile;
     DiskFSProDOS* pDiskFS = (DiskFSProDOS*) fpFile->GetDiskFS();
-    bool allocSparse = (pDiskFS->GetParameter(DiskFS::kParmProDOS_AllocSparse) != 0);
-    uint8_t blkBuf[kBlkSize];
-    uint16_t keyBlock;
-    bool allZero = true;
-    const uint8_t* scanPtr = (const uint8_t*)buf;
-
-    if (len >= 0x01000000) {    // 16MB
-        assert(false);
-        return kDIErrInvalidArg;
-    }
+    const uint8_t* ptr = (const uint8_t*) buf;
+    size_t remaining = len;
 
     /* use separate function for directories */
     if (pFile->fDirEntry.storageType == A2FileProDOS::kStorageDirectory ||
@@ -4553,272 +6186,427 @@ DIError A2FDProDOS::Write(const void* buf, size_t len, size_t* pActual)
         return WriteDirectory(buf, len, pActual);
     }
 
-    dierr = pDiskFS->LoadVolBitmap();
-    if (dierr != kDIErrNone)
-        goto bail;
-
-    assert(fOffset == 0);       // big simplifying assumption
-    assert(fOpenEOF == 0);      // another one
-    assert(fOpenBlocksUsed == 1);
-    assert(buf != NULL);
+    if (fOpenEOF + (di_off_t) len >= 0x01000000) {  // 16MB
+        LOGW("ProDOS Write would exceed max file size");
+        return kDIErrInvalidArg;
+    }
+    assert(buf != NULL || len == 0);
 
     /* nothing to do for zero-length write; don't even set fModified */
     if (len == 0)
+        return kDIErrNone;
+
+    if (fpWriteState == NULL) {
+        /* we only append to new files */
+        if (fOffset != 0 || fOpenEOF != 0 || fOpenBlocksUsed != 1) {
+            assert(false);
+            return kDIErrInvalidArg;
+        }
+        fpWriteState = new WriteState;
+    } else if (fpWriteState->failed) {
+        return kDIErrNotReady;
+    }
+    if (fOffset != fOpenEOF) {
+        assert(false);      // no seeking around while writing
+        return kDIErrInvalidArg;
+    }
+
+    dierr = pDiskFS->LoadVolBitmap();
+    if (dierr != kDIErrNone)
         goto bail;
 
-    if (pFile->fDirEntry.storageType != A2FileProDOS::kStorageExtended)
-        keyBlock = pFile->fDirEntry.keyPointer;
-    else {
-        if (fOpenRsrcFork)
-            keyBlock = pFile->fExtRsrc.keyBlock;
-        else
-            keyBlock = pFile->fExtData.keyBlock;
+    if (fOpenEOF == 0) {
+        dierr = StartWrite();
+        if (dierr != kDIErrNone)
+            goto bail;
     }
 
-    /*
-     * See if the file is completely empty.  This lets us do an optimization
-     * where we store it as a seedling.  (GS/OS seems to do this, ProDOS 8
-     * v2.0.3 tends to allocate the first block.)
-     */
-    for (unsigned int i = 0; i < len; ++i, ++scanPtr) {
-        if (*scanPtr != 0x00) {
-            allZero = false;
-            break;
+    while (remaining > 0) {
+        WriteState* pState = fpWriteState;
+
+        /*
+         * A full block followed by more data gets written.  If we don't
+         * have anything buffered, write straight from the caller's data.
+         */
+        if (pState->partialLen == kBlkSize) {
+            dierr = PutDataBlock(pState->partial);
+            if (dierr != kDIErrNone)
+                goto bail;
+            pState->partialLen = 0;
+        } else if (pState->partialLen == 0 && remaining > (size_t) kBlkSize) {
+            dierr = PutDataBlock(ptr);
+            if (dierr != kDIErrNone)
+                goto bail;
+            ptr += kBlkSize;
+            remaining -= kBlkSize;
+        } else {
+            size_t copyLen = kBlkSize - pState->partialLen;
+            if (copyLen > remaining)
+                copyLen = remaining;
+            memcpy(pState->partial + pState->partialLen, ptr, copyLen);
+            pState->partialLen += (int) copyLen;
+            ptr += copyLen;
+            remaining -= copyLen;
+            continue;
+        }
+
+        /* check for cancellation every so often */
+        if (++pState->progressCounter > 100) {
+            pState->progressCounter = 0;
+            if (!UpdateProgress(fOffset + (len - remaining))) {
+                dierr = kDIErrCancelled;
+                goto bail;
+            }
         }
     }
-    if (allZero) {
-        LOGI("+++ found file filled with %zd zeroes", len);
+
+    dierr = pDiskFS->SaveVolBitmap();
+    if (dierr != kDIErrNone)
+        goto bail;
+
+    fOpenEOF += len;
+    fOffset += len;
+    if (pActual != NULL)
+        *pActual = len;
+
+    if (!UpdateProgress(fOffset))
+        dierr = kDIErrCancelled;
+
+bail:
+    pDiskFS->FreeVolBitmap();
+    if (dierr != kDIErrNone)
+        fpWriteState->failed = true;
+    return dierr;
+}
+
+/*
+ * Get ready for the first Write.  If we've been given a size hint, set
+ * aside a contiguous run of blocks for the data and index blocks.
+ *
+ * The volume bitmap must be loaded.
+ */
+DIError A2FDProDOS::StartWrite(void)
+{
+    DiskFSProDOS* pDiskFS = (DiskFSProDOS*) fpFile->GetDiskFS();
+    WriteState* pState = fpWriteState;
+
+    if (fSizeHint <= kBlkSize)
+        return kDIErrNone;      // seedling or unknown, nothing to reserve
+
+    long dataBlocks = (long) ((fSizeHint + kBlkSize-1) / kBlkSize);
+    long count = dataBlocks;
+    if (dataBlocks > 256)
+        count += (dataBlocks + 255) / 256;
+
+    long start = pDiskFS->AllocBlockRun(count);
+    if (start < 0) {
+        LOGD(" ProDOS no run of %ld free blocks, allocating as we go", count);
+    } else {
+        pState->reserveNext = start;
+        pState->reserveEnd = start + count;
     }
+    return kDIErrNone;
+}
 
-    /*
-     * Special-case seedling files.  Just write the data into the key block
-     * and we're done.
-     */
-    if (allZero || len <= (size_t)kBlkSize) {
-        memset(blkBuf, 0, sizeof(blkBuf));
-        if (!allZero) {
-            memcpy(blkBuf, buf, len);
-        } else {
-            LOGI("+++ ProDOS storing large but empty file as seedling");
+/*
+ * Get a block for the file, from the reserved run if there's anything
+ * left in it.
+ *
+ * Returns the block number, or -1 if the disk is full.
+ */
+long A2FDProDOS::AllocWriteBlock(void)
+{
+    WriteState* pState = fpWriteState;
+
+    if (pState->reserveNext < pState->reserveEnd)
+        return pState->reserveNext++;
+    return ((DiskFSProDOS*) fpFile->GetDiskFS())->AllocBlock();
+}
+
+/*
+ * Add the next block of data to the file.
+ *
+ * While the file is all zeroes we just count blocks.  When the first
+ * non-empty block shows up, we catch up on the blocks we skipped.
+ */
+DIError A2FDProDOS::PutDataBlock(const uint8_t* blk)
+{
+    WriteState* pState = fpWriteState;
+    DIError dierr;
+    bool empty = IsEmptyBlock(blk);
+
+    if (pState->allZero) {
+        if (empty) {
+            pState->zeroBlocks++;
+            return kDIErrNone;
         }
-        dierr = pDiskFS->GetDiskImg()->WriteBlock(keyBlock, blkBuf);
-        if (dierr != kDIErrNone)
-            goto bail;
+        pState->allZero = false;
 
-        fOpenEOF = len;
-        fOpenBlocksUsed = 1;
-        assert(fOpenStorageType == A2FileProDOS::kStorageSeedling);
-        fOffset += len;
-        fModified = true;
-        goto bail;
+        uint8_t zeroBuf[kBlkSize];
+        memset(zeroBuf, 0, sizeof(zeroBuf));
+        for (long i = 0; i < pState->zeroBlocks; i++) {
+            dierr = AddDataBlock(zeroBuf, true);
+            if (dierr != kDIErrNone)
+                return dierr;
+        }
     }
 
-    /*
-     * Start by allocating space for the block list.  The list is always the
-     * same size, regardless of sparse allocations.
-     *
-     * We over-alloc by one so we can have an overrun detection entry.
-     */
-    fBlockCount = (len + kBlkSize-1) / kBlkSize;
-    assert(fBlockCount > 0);
-    delete[] fBlockList;
-    fBlockList = new uint16_t[fBlockCount+1];
-    if (fBlockList == NULL) {
-        dierr = kDIErrMalloc;
-        goto bail;
+    return AddDataBlock(blk, empty);
+}
+
+/*
+ * Allocate a block for the next piece of the file and write "blk" into it,
+ * or leave a hole if it's empty and we're allowed to.
+ *
+ * For tree files, the index block for each run of 256 data blocks is
+ * allocated just ahead of the data it describes.  We don't know a file
+ * is a tree until we hit block 256 (unless we got a size hint), so the
+ * first index block may end up after the first 256 data blocks.
+ */
+DIError A2FDProDOS::AddDataBlock(const uint8_t* blk, bool empty)
+{
+    DIError dierr;
+    DiskFSProDOS* pDiskFS = (DiskFSProDOS*) fpFile->GetDiskFS();
+    WriteState* pState = fpWriteState;
+    bool allocSparse = (pDiskFS->GetParameter(DiskFS::kParmProDOS_AllocSparse) != 0);
+    size_t blockIdx = pState->blocks.size();
+    long newBlock;
+
+    if (blockIdx >= 256 * 128) {
+        assert(false);      // caught by the EOF check in Write
+        return kDIErrInvalidArg;
     }
-    fBlockList[fBlockCount] = A2FileProDOS::kInvalidBlockNum;
 
-    /*
-     * Write the data blocks to disk, allocating as we go.  We have to treat
-     * the last entry specially because it might not fill an entire block.
-     */
-    const uint8_t* blkPtr;
-    long blockIdx;
-    long progressCounter;
-
-    progressCounter = 0;
-    blkPtr = (const uint8_t*) buf;
-    for (blockIdx = 0; blockIdx < fBlockCount; blockIdx++) {
-        long newBlock;
-
-        if (blockIdx == fBlockCount-1) {
-            /* for last block, copy partial and move blkPtr */
-            int copyLen = len - (blockIdx * kBlkSize);
-            assert(copyLen > 0 && copyLen <= kBlkSize);
-            memset(blkBuf, 0, sizeof(blkBuf));
-            memcpy(blkBuf, blkPtr, copyLen);
-            blkPtr = blkBuf;
-        }
-
-        if (allocSparse && IsEmptyBlock(blkPtr)) {
-            if (blockIdx == 0) {
-                // Fix for issues #18 and #49.  GS/OS appears to get confused
-                // if the first entry in the master index block for a "tree"
-                // file is zero.  We can avoid the problem by always allocating
-                // the first data block, which causes allocation of the first
-                // index block.  (The "all zeroes" case was handled earlier,
-                // so if we got here we know this won't be an empty seedling.)
-                LOGI("+++ allocating storage for empty first block");
-                newBlock = pDiskFS->AllocBlock();
-                fOpenBlocksUsed++;
-            } else {
-                // Sparse.
-                newBlock = 0;
+    if ((blockIdx % 256) == 0 &&
+        (blockIdx != 0 || fSizeHint > 256 * kBlkSize))
+    {
+        while (pState->indexBlocks.size() <= blockIdx / 256) {
+            newBlock = AllocWriteBlock();
+            if (newBlock < 0) {
+                LOGI(" ProDOS disk full during write!");
+                return kDIErrDiskFull;
             }
-        } else {
-            newBlock = pDiskFS->AllocBlock();
+            pState->indexBlocks.push_back((uint16_t) newBlock);
             fOpenBlocksUsed++;
         }
+    }
 
+    if (empty && allocSparse && blockIdx != 0) {
+        // Sparse.  We always allocate the first block; see the note about
+        // issues #18 and #49 in FinishWrite.
+        newBlock = 0;
+    } else {
+        newBlock = AllocWriteBlock();
         if (newBlock < 0) {
             LOGI(" ProDOS disk full during write!");
-            dierr = kDIErrDiskFull;
-            goto bail;
+            return kDIErrDiskFull;
         }
+        fOpenBlocksUsed++;
 
-        fBlockList[blockIdx] = (uint16_t) newBlock;
-
-        if (newBlock != 0) {
-            dierr = pDiskFS->GetDiskImg()->WriteBlock(newBlock, blkPtr);
-            if (dierr != kDIErrNone)
-                goto bail;
+        dierr = pDiskFS->GetDiskImg()->WriteBlock(newBlock, blk);
+        if (dierr != kDIErrNone) {
+            pDiskFS->SetBlockUseEntry(newBlock, false);
+            fOpenBlocksUsed--;
+            return dierr;
         }
+    }
 
-        blkPtr += kBlkSize;
+    pState->blocks.push_back((uint16_t) newBlock);
+    return kDIErrNone;
+}
 
-        /*
-         * Update the progress counter and check to see if the "cancel" button
-         * has been hit.  We don't call UpdateProgress on the last block
-         * because we could be passing an offset value larger than "len".
-         * Also, we don't want the progress bar to hit 100% until we've
-         * actually finished.
-         *
-         * We do NOT want to check this after we start writing index blocks.
-         * If we do, we need to make sure that whatever index blocks the file
-         * has match up with what we've allocated in the disk block map.
-         *
-         * We don't want to save the disk block map if the user cancels here,
-         * because then the blocks will be marked as "used" even though the
-         * index blocks for this file haven't been written yet.
-         *
-         * It's tricky to get this right, which is why we allocate space
-         * for the index blocks now -- running out of disk space and
-         * user cancellation are handled the same way.  Once we get to the
-         * point where we're updating the file structure, we can neither be
-         * cancelled nor run out of space.  (We can still hit a bad block,
-         * though, which we currently don't handle.)
-         */
-        progressCounter++;  // update every N blocks
-        if (progressCounter > 100 && blockIdx != fBlockCount) {
-            progressCounter = 0;
-            if (!UpdateProgress(blockIdx * kBlkSize)) {
-                dierr = kDIErrCancelled;
-                goto bail;
-            }
-        }
+/*
+ * Finish a file that was written with Write: write the last block, fill
+ * out the key block and any index blocks, and give back any reserved
+ * blocks we didn't use.
+ *
+ * Sets fOpenStorageType and fModified; Close takes it from there.
+ */
+DIError A2FDProDOS::FinishWrite(void)
+{
+    DIError dierr;
+    A2FileProDOS* pFile = (A2FileProDOS*) fpFile;
+    DiskFSProDOS* pDiskFS = (DiskFSProDOS*) fpFile->GetDiskFS();
+    bool allocSparse = (pDiskFS->GetParameter(DiskFS::kParmProDOS_AllocSparse) != 0);
+    WriteState* pState = fpWriteState;
+    uint8_t blkBuf[kBlkSize];
+    uint16_t keyBlock;
+
+    if (pFile->fDirEntry.storageType != A2FileProDOS::kStorageExtended)
+        keyBlock = pFile->fDirEntry.keyPointer;
+    else {
+        if (fOpenRsrcFork)
+            keyBlock = pFile->fExtRsrc.keyBlock;
+        else
+            keyBlock = pFile->fExtData.keyBlock;
     }
 
-    assert(fBlockList[fBlockCount] == A2FileProDOS::kInvalidBlockNum);
+    dierr = pDiskFS->LoadVolBitmap();
+    if (dierr != kDIErrNone)
+        return dierr;
+
+    assert(pState->partialLen > 0 && pState->partialLen <= kBlkSize);
+    memset(pState->partial + pState->partialLen, 0,
+        kBlkSize - pState->partialLen);
 
-    /*
-     * Now we have a full block map.  Allocate any needed index blocks and
-     * write them.
-     */
-#if 0  // now done earlier
-     /*
-     * If our block map is empty, i.e. the entire file is sparse, then
-     * there's no need to create a sapling.  We just leave the file in
-     * seedling form.  This can only happen for a completely empty file.
-     */
-    if (allZero) {
-        LOGI("+++ ProDOS storing large but empty file as seedling");
-        /* make sure key block is empty */
+    if (pState->allZero && IsEmptyBlock(pState->partial)) {
+        /*
+         * The file is completely empty, so we store it as a seedling with
+         * a long EOF.  (GS/OS seems to do this, ProDOS 8 v2.0.3 tends to
+         * allocate the first block.)
+         */
+        LOGI("+++ ProDOS storing empty file (%ld bytes) as seedling",
+            (long) fOpenEOF);
         memset(blkBuf, 0, sizeof(blkBuf));
         dierr = pDiskFS->GetDiskImg()->WriteBlock(keyBlock, blkBuf);
         if (dierr != kDIErrNone)
             goto bail;
-        fOpenStorageType = A2FileProDOS::kStorageSeedling;
-        fBlockList[0] = keyBlock;
-    } else
-#endif
-    if (fBlockCount <= 256) {
-        /* sapling file, write an index block into the key block */
-        //bool allzero = true;  <-- should this be getting used?
-        assert(fBlockCount > 1);
-        memset(blkBuf, 0, sizeof(blkBuf));
-        int i;
-        for (i = 0; i < fBlockCount; i++) {
-            //if (fBlockList[i] != 0)
-            //    allzero = false;
-            blkBuf[i] = fBlockList[i] & 0xff;
-            blkBuf[256 + i] = (fBlockList[i] >> 8) & 0xff;
-        }
-
-        dierr = pDiskFS->GetDiskImg()->WriteBlock(keyBlock, blkBuf);
+        assert(fOpenStorageType == A2FileProDOS::kStorageSeedling);
+    } else if (fOpenEOF <= kBlkSize) {
+        /* seedling, data goes in the key block */
+        assert(pState->blocks.empty() && pState->zeroBlocks == 0);
+        dierr = pDiskFS->GetDiskImg()->WriteBlock(keyBlock, pState->partial);
         if (dierr != kDIErrNone)
             goto bail;
-        fOpenStorageType = A2FileProDOS::kStorageSapling;
+        assert(fOpenStorageType == A2FileProDOS::kStorageSeedling);
     } else {
-        /* tree file, write two or more indexes and write master into key */
-        uint8_t masterBlk[kBlkSize];
-        int idx;
-
-        memset(masterBlk, 0, sizeof(masterBlk));
+        // Fix for issues #18 and #49.  GS/OS appears to get confused
+        // if the first entry in the master index block for a "tree"
+        // file is zero.  We can avoid the problem by always allocating
+        // the first data block, which causes allocation of the first
+        // index block.  (AddDataBlock takes care of that.)
+        dierr = PutDataBlock(pState->partial);
+        if (dierr != kDIErrNone)
+            goto bail;
+        pState->partialLen = 0;
 
-        for (idx = 0; idx < fBlockCount; ) {
-            long newBlock;
-            int i;
+        long blockCount = (long) pState->blocks.size();
+        assert(blockCount > 1);
 
+        if (blockCount <= 256) {
+            /* sapling file, write an index block into the key block */
             memset(blkBuf, 0, sizeof(blkBuf));
-            for (i = 0; i < 256 && idx < fBlockCount; i++, idx++) {
-                blkBuf[i] = fBlockList[idx] & 0xff;
-                blkBuf[256+i] = (fBlockList[idx] >> 8) & 0xff;
+            for (int i = 0; i < blockCount; i++) {
+                blkBuf[i] = pState->blocks[i] & 0xff;
+                blkBuf[256 + i] = (pState->blocks[i] >> 8) & 0xff;
             }
+            dierr = pDiskFS->GetDiskImg()->WriteBlock(keyBlock, blkBuf);
+            if (dierr != kDIErrNone)
+                goto bail;
 
-            /* allocate a new index block, if needed */
-            if (allocSparse && IsEmptyBlock(blkBuf))
-                newBlock = 0;
-            else {
-                newBlock = pDiskFS->AllocBlock();
-                fOpenBlocksUsed++;
+            /* a size hint may have made us think this was a tree */
+            for (size_t i = 0; i < pState->indexBlocks.size(); i++) {
+                pDiskFS->SetBlockUseEntry(pState->indexBlocks[i], false);
+                fOpenBlocksUsed--;
             }
-            if (newBlock != 0) {
-                dierr = pDiskFS->GetDiskImg()->WriteBlock(newBlock, blkBuf);
-                if (dierr != kDIErrNone)
-                    goto bail;
+            pState->indexBlocks.clear();
+            fOpenStorageType = A2FileProDOS::kStorageSapling;
+        } else {
+            /* tree file, write the indexes and put the master in the key */
+            uint8_t masterBlk[kBlkSize];
+
+            memset(masterBlk, 0, sizeof(masterBlk));
+            assert(pState->indexBlocks.size() ==
+                (size_t) (blockCount + 255) / 256);
+
+            for (size_t idx = 0; idx < pState->indexBlocks.size(); idx++) {
+                uint16_t indexBlock = pState->indexBlocks[idx];
+                long first = idx * 256;
+
+                memset(blkBuf, 0, sizeof(blkBuf));
+                for (int i = 0; i < 256 && first + i < blockCount; i++) {
+                    blkBuf[i] = pState->blocks[first + i] & 0xff;
+                    blkBuf[256+i] = (pState->blocks[first + i] >> 8) & 0xff;
+                }
+
+                /* all holes, no need for an index block */
+                if (allocSparse && IsEmptyBlock(blkBuf)) {
+                    pDiskFS->SetBlockUseEntry(indexBlock, false);
+                    pState->indexBlocks[idx] = indexBlock = 0;
+                    fOpenBlocksUsed--;
+                } else {
+                    dierr = pDiskFS->GetDiskImg()->WriteBlock(indexBlock,
+                                blkBuf);
+                    if (dierr != kDIErrNone)
+                        goto bail;
+                }
+
+                masterBlk[idx] = (uint8_t) indexBlock;
+                masterBlk[256 + idx] = (uint8_t) (indexBlock >> 8);
             }
 
-            masterBlk[(idx-1) / 256] = (uint8_t) newBlock;
-            masterBlk[256 + (idx-1)/256] = (uint8_t) (newBlock >> 8);
+            dierr = pDiskFS->GetDiskImg()->WriteBlock(keyBlock, masterBlk);
+            if (dierr != kDIErrNone)
+                goto bail;
+            fOpenStorageType = A2FileProDOS::kStorageTree;
         }
 
-        dierr = pDiskFS->GetDiskImg()->WriteBlock(keyBlock, masterBlk);
-        if (dierr != kDIErrNone)
-            goto bail;
-        fOpenStorageType = A2FileProDOS::kStorageTree;
+        /* Close uses the block list to count the holes */
+        delete[] fBlockList;
+        fBlockCount = blockCount;
+        fBlockList = new uint16_t[fBlockCount+1];
+        memcpy(fBlockList, &pState->blocks[0], fBlockCount * sizeof(uint16_t));
+        fBlockList[fBlockCount] = A2FileProDOS::kInvalidBlockNum;
+    }
+
+    /* give back whatever we didn't use from the reserved run */
+    while (pState->reserveNext < pState->reserveEnd)
+        pDiskFS->SetBlockUseEntry(pState->reserveNext++, false);
+
+    dierr = pDiskFS->SaveVolBitmap();
+    if (dierr != kDIErrNone)
+        goto bail;
+
+    /* the key block became an index block, if it wasn't one already */
+    if (fOpenStorageType != A2FileProDOS::kStorageSeedling) {
+        pDiskFS->NoteBlockPurpose(keyBlock,
+            DiskFS::VolumeUsage::kChunkPurposeFileStruct);
+        for (size_t i = 0; i < pState->indexBlocks.size(); i++) {
+            if (pState->indexBlocks[i] != 0) {
+                pDiskFS->NoteBlockPurpose(pState->indexBlocks[i],
+                    DiskFS::VolumeUsage::kChunkPurposeFileStruct);
+            }
+        }
     }
 
-    fOpenEOF = len;
-    fOffset += len;
     fModified = true;
 
 bail:
-    if (dierr == kDIErrNone)
-        dierr = pDiskFS->SaveVolBitmap();
+    pDiskFS->FreeVolBitmap();
+    return dierr;
+}
 
-    /*
-     * We need to check UpdateProgress *after* the volume bitmap has been
-     * saved.  Otherwise we'll have blocks allocated in the file's structure
-     * but not marked in-use in the map when the "dierr" check above fails.
-     */
-    if (dierr == kDIErrNone) {
-        if (!UpdateProgress(fOffset))
-            dierr = kDIErrCancelled;
+/*
+ * Release the blocks allocated by a series of Write calls that didn't
+ * work out.  The file's directory entry hasn't been touched, so it's
+ * still an empty seedling.
+ */
+void A2FDProDOS::AbandonWrite(void)
+{
+    DiskFSProDOS* pDiskFS = (DiskFSProDOS*) fpFile->GetDiskFS();
+    WriteState* pState = fpWriteState;
+
+    LOGI(" ProDOS releasing blocks from incomplete write of '%s'",
+        fpFile->GetPathName());
+    if (pDiskFS->LoadVolBitmap() != kDIErrNone)
+        return;
+
+    for (size_t i = 0; i < pState->blocks.size(); i++) {
+        if (pState->blocks[i] != 0)
+            pDiskFS->SetBlockUseEntry(pState->blocks[i], false);
+    }
+    for (size_t i = 0; i < pState->indexBlocks.size(); i++) {
+        if (pState->indexBlocks[i] != 0)
+            pDiskFS->SetBlockUseEntry(pState->indexBlocks[i], false);
     }
+    while (pState->reserveNext < pState->reserveEnd)
+        pDiskFS->SetBlockUseEntry(pState->reserveNext++, false);
 
+    (void) pDiskFS->SaveVolBitmap();
     pDiskFS->FreeVolBitmap();
-    return dierr;
+
+    fOpenEOF = fOffset = 0;
+    fOpenBlocksUsed = 1;
 }
 
 /*
@@ -4837,10 +6625,10 @@ bool A2FDProDOS::IsEmptyBlock(const uint8_t* blk)
 }
 
 /*
- * Write a directory, possibly extending it by one block.
+ * Write a directory, possibly extending it.
  *
- * If we're growing, the extra block will already have been allocated, and is
- * pointed to by the "next" pointer in the next-to-last block.  (This
+ * If we're growing, the extra blocks will already have been allocated, and
+ * are chained from the "next" pointer in the last existing block.  (This
  * pre-allocation makes our lives easier, and avoids a situation where we
  * would have to update the volume bitmap when another function is already
  * making lots of changes to it.)
@@ -4854,29 +6642,30 @@ DIError A2FDProDOS::WriteDirectory(const void* buf, size_t len, size_t* pActual)
 
     assert(len >= (size_t)kBlkSize);
     assert((len % kBlkSize) == 0);
-    assert(len == (size_t)fOpenEOF || len == (size_t)fOpenEOF + kBlkSize);
+    assert(len >= (size_t)fOpenEOF);
 
     if (len > (size_t)fOpenEOF) {
         /*
          * Extend the block list, remembering that we add an extra item
          * on the end to check for overruns.
          */
+        long newBlockCount = (long) (len / kBlkSize);
         uint16_t* newBlockList;
 
-        fBlockCount++;
-        newBlockList = new uint16_t[fBlockCount+1];
+        newBlockList = new uint16_t[newBlockCount+1];
         memcpy(newBlockList, fBlockList,
             sizeof(uint16_t) * fBlockCount);
-        newBlockList[fBlockCount] = A2FileProDOS::kInvalidBlockNum;
-
-        uint8_t* blkPtr;
-        blkPtr = (uint8_t*)buf + fOpenEOF - kBlkSize;
-        assert(blkPtr >= buf);
-        assert(GetShortLE(&blkPtr[0x02]) != 0);
-        newBlockList[fBlockCount-1] = GetShortLE(&blkPtr[0x02]);
+        for (long ll = fBlockCount; ll < newBlockCount; ll++) {
+            const uint8_t* blkPtr;
+            blkPtr = (const uint8_t*)buf + (ll-1) * kBlkSize;
+            assert(GetShortLE(&blkPtr[0x02]) != 0);
+            newBlockList[ll] = GetShortLE(&blkPtr[0x02]);
+        }
+        newBlockList[newBlockCount] = A2FileProDOS::kInvalidBlockNum;
 
         delete[] fBlockList;
         fBlockList = newBlockList;
+        fBlockCount = newBlockCount;
 
         LOGI(" ProDOS updated block list for subdir:");
         DumpBlockList();
@@ -4955,6 +6744,9 @@ di_off_t A2FDProDOS::Tell(void)
 /*
  * Release file state.
  *
+ * If the file was being written, this is where the key block and the
+ * directory entry get their final values.
+ *
  * Most applications don't check the value of "Close", or call it from a
  * destructor, so we call CloseDescr whether we succeed or not.
  */
@@ -4962,8 +6754,20 @@ DIError A2FDProDOS::Close(void)
 {
     DIError dierr = kDIErrNone;
 
+    if (fpWriteState != NULL) {
+        if (!fpWriteState->failed)
+            dierr = FinishWrite();
+        if (fpWriteState->failed || dierr != kDIErrNone)
+            AbandonWrite();
+        delete fpWriteState;
+        fpWriteState = NULL;
+        if (dierr != kDIErrNone)
+            goto bail;
+    }
+
     if (fModified) {
         A2FileProDOS* pFile = (A2FileProDOS*) fpFile;
+        DiskFSProDOS* pDiskFS = (DiskFSProDOS*) fpFile->GetDiskFS();
         uint8_t blkBuf[kBlkSize];
         uint8_t newStorageType = fOpenStorageType;
         uint16_t newBlocksUsed = fOpenBlocksUsed;
@@ -4971,6 +6775,14 @@ DIError A2FDProDOS::Close(void)
         uint16_t combinedBlocksUsed;
         uint32_t combinedEOF;
 
+        /* the fork's storage changed, so any saved block list is stale */
+        if (pFile->fDirEntry.storageType == A2FileProDOS::kStorageExtended) {
+            pDiskFS->ForgetBlockList(fOpenRsrcFork ?
+                pFile->fExtRsrc.keyBlock : pFile->fExtData.keyBlock);
+        } else {
+            pDiskFS->ForgetBlockList(pFile->fDirEntry.keyPointer);
+        }
+
         /*
          * If this is an extended file, fix the entries in the extended
          * key block, and adjust the values to be stored in the directory.
@@ -5098,7 +6910,8 @@ DIError A2FDProDOS::Close(void)
                 if (pFile->fSparseRsrcEof < 0)
                     pFile->fSparseRsrcEof = 0;
             }
-        } else {
+        } else if (!pFile->IsDirectory()) {
+            /* (the scan doesn't set this for directories, so neither do we) */
             pFile->fSparseDataEof = (di_off_t) newEOF - (sparseBlocks * kBlkSize);
             if (pFile->fSparseDataEof < 0)
                 pFile->fSparseDataEof = 0;
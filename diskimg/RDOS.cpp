@@ -342,7 +342,7 @@ DIError DiskFSRDOS::ReadCatalog(void)
         if (dirPtr[24] == 0x00)     // unused entry; must be at end of catalog
             break;
 
-        pFile = new A2FileRDOS(this);
+        pFile = new (this) A2FileRDOS(this);
 
         memcpy(pFile->fRawFileName, dirPtr, A2FileRDOS::kMaxFileName);
         pFile->fRawFileName[A2FileRDOS::kMaxFileName] = '\0';
@@ -28,6 +28,22 @@
 #define HAVE_VSNPRINTF
 #define HAVE_FSEEKO
 #define HAVE_FTRUNCATE
+#define HAVE_PREAD
+
+#ifdef __linux__
+# include <sys/stat.h>
+# include <sys/ioctl.h>
+# include <linux/fs.h>
+# define HAVE_BLOCK_DEVICE      // GFDBlockDevice, for CF and SD cards
+# define HAVE_POSIX_FADVISE
+# include <sys/sendfile.h>
+# define HAVE_SENDFILE          // A2FileDescr::ExtractTo
+# if __GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 27)
+#  define HAVE_COPY_FILE_RANGE
+# endif
+# include <sys/xattr.h>
+# define HAVE_XATTR             // VolumeExtractor file types
+#endif
 
 // gcc wants special compile options; just ignore this for now
 #define override
@@ -0,0 +1,230 @@
+/*
+ * CiderPress
+ * Copyright (C) 2009 by CiderPress authors.  All Rights Reserved.
+ * See the file LICENSE for distribution terms.
+ */
+/*
+ * Entry points for the test programs.  These just unwrap the arguments
+ * and call the private code; see TestHooks.h.
+ */
+#include "StdAfx.h"
+#include "DiskImgPriv.h"
+#include "TestHooks.h"
+
+/*static*/ void TestHooks::EncodeNibble(bool useRef, uint8_t* trackBuf,
+    int trackLen, int idx, const uint8_t* sctBuf,
+    const DiskImg::NibbleDescr* pDescr)
+{
+    CircularBufferAccess buffer(trackBuf, trackLen);
+
+    if (pDescr->encoding == DiskImg::kNibbleEnc62) {
+        if (useRef)
+            DiskImg::EncodeNibble62Ref(buffer, idx, sctBuf, pDescr);
+        else
+            DiskImg::EncodeNibble62(buffer, idx, sctBuf, pDescr);
+    } else {
+        assert(pDescr->encoding == DiskImg::kNibbleEnc53);
+        if (useRef)
+            DiskImg::EncodeNibble53Ref(buffer, idx, sctBuf, pDescr);
+        else
+            DiskImg::EncodeNibble53(buffer, idx, sctBuf, pDescr);
+    }
+}
+
+/*static*/ DIError TestHooks::DecodeNibble(bool useRef,
+    const uint8_t* trackBuf, int trackLen, int idx, uint8_t* sctBuf,
+    const DiskImg::NibbleDescr* pDescr)
+{
+    CircularBufferAccess buffer(trackBuf, trackLen);
+
+    if (pDescr->encoding == DiskImg::kNibbleEnc62) {
+        if (useRef)
+            return DiskImg::DecodeNibble62Ref(buffer, idx, sctBuf, pDescr);
+        else
+            return DiskImg::DecodeNibble62(buffer, idx, sctBuf, pDescr);
+    } else {
+        assert(pDescr->encoding == DiskImg::kNibbleEnc53);
+        if (useRef)
+            return DiskImg::DecodeNibble53Ref(buffer, idx, sctBuf, pDescr);
+        else
+            return DiskImg::DecodeNibble53(buffer, idx, sctBuf, pDescr);
+    }
+}
+
+/*static*/ int TestHooks::GetNibbleDataSize(DiskImg::NibbleEnc encoding)
+{
+    if (encoding == DiskImg::kNibbleEnc62)
+        return DiskImg::kDataSize62;
+    assert(encoding == DiskImg::kNibbleEnc53);
+    return DiskImg::kDataSize53;
+}
+
+/*static*/ uint8_t TestHooks::GetDiskByte(DiskImg::NibbleEnc encoding, int val)
+{
+    if (encoding == DiskImg::kNibbleEnc62)
+        return DiskImg::kDiskBytes62[val & 0x3f];
+    assert(encoding == DiskImg::kNibbleEnc53);
+    return DiskImg::kDiskBytes53[val & 0x1f];
+}
+
+/*
+ * Copy a bad block map out for the caller.
+ */
+static void CopyBadBlocks(const LinearBitmap& map, bool* badBlocks,
+    long numBlocks)
+{
+    for (long i = 0; i < numBlocks; i++)
+        badBlocks[i] = map.IsSet(i);
+}
+
+/*static*/ DIError TestHooks::UnpackNibbleTrack35(bool useRef,
+    const uint8_t* nibbleBuf, long nibbleLen, uint8_t* outputBuf, int cyl,
+    int head, bool* badBlocks, long numBlocks)
+{
+    LinearBitmap badMap(numBlocks);
+    DIError dierr;
+
+    if (useRef) {
+        dierr = DiskImg::UnpackNibbleTrack35Ref(nibbleBuf, nibbleLen,
+                    outputBuf, cyl, head, &badMap);
+    } else {
+        dierr = DiskImg::UnpackNibbleTrack35(nibbleBuf, nibbleLen,
+                    outputBuf, cyl, head, &badMap);
+    }
+    CopyBadBlocks(badMap, badBlocks, numBlocks);
+    return dierr;
+}
+
+/*static*/ DIError TestHooks::UnpackNibbleTracks35(const uint8_t* nibbleBufs,
+    const long* nibbleLens, long bufStride, int numTracks,
+    uint8_t* outputBuf, bool* badBlocks, long numBlocks, int numThreads)
+{
+    LinearBitmap badMap(numBlocks);
+    DIError dierr;
+
+    dierr = DiskImg::UnpackNibbleTracks35(nibbleBufs, nibbleLens, bufStride,
+                numTracks, outputBuf, &badMap, numThreads);
+    CopyBadBlocks(badMap, badBlocks, numBlocks);
+    return dierr;
+}
+
+/*static*/ void TestHooks::EncodeNibbleSector35(const uint8_t* sectorData,
+    uint8_t* outBuf)
+{
+    DiskImg::EncodeNibbleSector35(sectorData, outBuf);
+}
+
+#ifdef HAVE_BLOCK_DEVICE
+
+TestHooks::BlockDevice::~BlockDevice(void)
+{
+    delete fpDev;
+}
+
+DIError TestHooks::BlockDevice::Open(const char* pathName, bool readOnly)
+{
+    DIError dierr;
+
+    if (fpDev != NULL)
+        return kDIErrAlreadyOpen;
+    fpDev = new GFDBlockDevice;
+    dierr = fpDev->Open(pathName, readOnly);
+    if (dierr != kDIErrNone) {
+        delete fpDev;
+        fpDev = NULL;
+    }
+    return dierr;
+}
+
+DIError TestHooks::BlockDevice::Close(void)
+{
+    DIError dierr;
+
+    if (fpDev == NULL)
+        return kDIErrNotReady;
+    dierr = fpDev->Close();
+    delete fpDev;
+    fpDev = NULL;
+    return dierr;
+}
+
+DIError TestHooks::BlockDevice::Read(void* buf, size_t length,
+    size_t* pActual)
+{
+    return fpDev != NULL ? fpDev->Read(buf, length, pActual) : kDIErrNotReady;
+}
+
+DIError TestHooks::BlockDevice::Write(const void* buf, size_t length,
+    size_t* pActual)
+{
+    return fpDev != NULL ? fpDev->Write(buf, length, pActual) : kDIErrNotReady;
+}
+
+DIError TestHooks::BlockDevice::Seek(di_off_t offset, DIWhence whence)
+{
+    return fpDev != NULL ? fpDev->Seek(offset, whence) : kDIErrNotReady;
+}
+
+di_off_t TestHooks::BlockDevice::Tell(void)
+{
+    return fpDev != NULL ? fpDev->Tell() : -1;
+}
+
+DIError TestHooks::BlockDevice::ReadAt(di_off_t offset, void* buf,
+    size_t length)
+{
+    return fpDev != NULL ? fpDev->ReadAt(offset, buf, length) : kDIErrNotReady;
+}
+
+DIError TestHooks::BlockDevice::WriteAt(di_off_t offset, const void* buf,
+    size_t length)
+{
+    return fpDev != NULL ? fpDev->WriteAt(offset, buf, length) : kDIErrNotReady;
+}
+
+DIError TestHooks::BlockDevice::Flush(void)
+{
+    return fpDev != NULL ? fpDev->Flush() : kDIErrNotReady;
+}
+
+void TestHooks::BlockDevice::Prefetch(di_off_t offset, di_off_t length)
+{
+    if (fpDev != NULL)
+        fpDev->Prefetch(offset, length);
+}
+
+bool TestHooks::BlockDevice::GetDirectIO(void) const
+{
+    return fpDev != NULL && fpDev->GetDirectIO();
+}
+
+#else /*HAVE_BLOCK_DEVICE*/
+
+TestHooks::BlockDevice::~BlockDevice(void) {}
+DIError TestHooks::BlockDevice::Open(const char* pathName, bool readOnly)
+    { return kDIErrNotSupported; }
+DIError TestHooks::BlockDevice::Close(void)
+    { return kDIErrNotReady; }
+DIError TestHooks::BlockDevice::Read(void* buf, size_t length,
+    size_t* pActual)
+    { return kDIErrNotReady; }
+DIError TestHooks::BlockDevice::Write(const void* buf, size_t length,
+    size_t* pActual)
+    { return kDIErrNotReady; }
+DIError TestHooks::BlockDevice::Seek(di_off_t offset, DIWhence whence)
+    { return kDIErrNotReady; }
+di_off_t TestHooks::BlockDevice::Tell(void)
+    { return -1; }
+DIError TestHooks::BlockDevice::ReadAt(di_off_t offset, void* buf,
+    size_t length)
+    { return kDIErrNotReady; }
+DIError TestHooks::BlockDevice::WriteAt(di_off_t offset, const void* buf,
+    size_t length)
+    { return kDIErrNotReady; }
+DIError TestHooks::BlockDevice::Flush(void)
+    { return kDIErrNotReady; }
+void TestHooks::BlockDevice::Prefetch(di_off_t offset, di_off_t length) {}
+bool TestHooks::BlockDevice::GetDirectIO(void) const
+    { return false; }
+
+#endif /*HAVE_BLOCK_DEVICE*/
@@ -0,0 +1,92 @@
+/*
+ * CiderPress
+ * Copyright (C) 2009 by CiderPress authors.  All Rights Reserved.
+ * See the file LICENSE for distribution terms.
+ */
+/*
+ * Entry points into library internals, for the test programs in linux/.
+ *
+ * The tests live with the programs; all we provide here is a way to reach
+ * the private kernels they compare.  Applications should not use this,
+ * and DiskImg.h doesn't include it.
+ */
+#ifndef DISKIMG_TESTHOOKS_H
+#define DISKIMG_TESTHOOKS_H
+
+#include "DiskImg.h"
+
+namespace DiskImgLib {
+
+class GFDBlockDevice;
+
+class DISKIMG_API TestHooks {
+public:
+    /*
+     * Encode or decode a 5&3 or 6&2 data field, as chosen by
+     * pDescr->encoding, with the fast kernels or the byte-at-a-time
+     * reference versions.  The field starts at "idx" in a circular track
+     * buffer of "trackLen" bytes.
+     */
+    static void EncodeNibble(bool useRef, uint8_t* trackBuf, int trackLen,
+        int idx, const uint8_t* sctBuf, const DiskImg::NibbleDescr* pDescr);
+    static DIError DecodeNibble(bool useRef, const uint8_t* trackBuf,
+        int trackLen, int idx, uint8_t* sctBuf,
+        const DiskImg::NibbleDescr* pDescr);
+
+    // size of an encoded data field, including the checksum byte
+    static int GetNibbleDataSize(DiskImg::NibbleEnc encoding);
+    // disk byte for a 6-bit (6&2) or 5-bit (5&3) value
+    static uint8_t GetDiskByte(DiskImg::NibbleEnc encoding, int val);
+
+    /*
+     * Unpack a 3.5" track with DiskImg::UnpackNibbleTrack35 or the
+     * reference version, or a whole disk with UnpackNibbleTracks35.  Bad
+     * blocks are reported in "badBlocks", one entry per block on a disk
+     * of "numBlocks" blocks.
+     */
+    static DIError UnpackNibbleTrack35(bool useRef, const uint8_t* nibbleBuf,
+        long nibbleLen, uint8_t* outputBuf, int cyl, int head,
+        bool* badBlocks, long numBlocks);
+    static DIError UnpackNibbleTracks35(const uint8_t* nibbleBufs,
+        const long* nibbleLens, long bufStride, int numTracks,
+        uint8_t* outputBuf, bool* badBlocks, long numBlocks, int numThreads);
+    // nibblize a 524-byte 3.5" sector (tags first) into a data field body
+    static void EncodeNibbleSector35(const uint8_t* sectorData,
+        uint8_t* outBuf);
+
+    /*
+     * The Linux block-device GFD (direct I/O with a write-back track
+     * cache), for blkdevtest.  This just forwards to a GFDBlockDevice;
+     * Open returns kDIErrNotSupported where there isn't one.
+     */
+    class DISKIMG_API BlockDevice {
+    public:
+        BlockDevice(void) : fpDev(NULL) {}
+        ~BlockDevice(void);
+
+        DIError Open(const char* pathName, bool readOnly);
+        DIError Close(void);
+        DIError Read(void* buf, size_t length, size_t* pActual);
+        DIError Write(const void* buf, size_t length, size_t* pActual);
+        DIError Seek(di_off_t offset, DIWhence whence);
+        di_off_t Tell(void);
+        DIError ReadAt(di_off_t offset, void* buf, size_t length);
+        DIError WriteAt(di_off_t offset, const void* buf, size_t length);
+        DIError Flush(void);
+        void Prefetch(di_off_t offset, di_off_t length);
+        bool GetDirectIO(void) const;
+
+    private:
+        BlockDevice& operator=(const BlockDevice&);
+        BlockDevice(const BlockDevice&);
+
+        GFDBlockDevice* fpDev;
+    };
+
+private:
+    TestHooks(void);                // static members only
+};
+
+}   // namespace DiskImgLib
+
+#endif /*DISKIMG_TESTHOOKS_H*/
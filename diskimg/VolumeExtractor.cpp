@@ -0,0 +1,857 @@
+/*
+ * CiderPress
+ * Copyright (C) 2009 by CiderPress authors.  All Rights Reserved.
+ * See the file LICENSE for distribution terms.
+ */
+/*
+ * Extract a whole volume to a directory tree on the host.
+ *
+ * The calling thread plans the extraction, then reads every fork in the
+ * order it appears on the disk.  Forks are handed whole to the worker
+ * threads, which convert text and write the host files.  Host file
+ * creation (and, on most filesystems, the writes themselves) costs more
+ * than reading the image, so that's the part we spread out.
+ */
+#include "StdAfx.h"
+#include "DiskImgPriv.h"
+#include <thread>
+#include <string>
+#include <vector>
+#include <deque>
+#include <set>
+#include <algorithm>
+#include <limits.h>
+#include <sys/stat.h>
+#ifdef _WIN32
+# include <direct.h>
+# include <sys/utime.h>
+#else
+# include <utime.h>
+#endif
+
+#ifdef _WIN32
+static const char kHostEOL[] = "\r\n";
+static const char kHostInvalid[] = "\\/:*?\"<>|";
+#else
+static const char kHostEOL[] = "\n";
+static const char kHostInvalid[] = "/";
+#endif
+static const int kHostEOLLen = sizeof(kHostEOL) - 1;
+
+static const char kHostSep = '/';
+static const char kForeignIndic = '%';      // "%xx" for unsafe chars
+static const char kPreserveIndic = '#';     // "#xxyyyy" type suffix
+static const char kResourceFlag = 'r';
+static const char kResourceStr[] = "_rsrc_";
+
+#ifdef HAVE_XATTR
+static const char kFinderInfoAttr[] = "user.com.apple.FinderInfo";
+static const char kRsrcForkAttr[] = "user.com.apple.ResourceFork";
+static const int kFinderInfoLen = 32;
+static const uint32_t kPdosCreator = 0x70646f73;    // 'pdos'
+#endif
+
+/* how many entries we look through for a block that isn't sparse */
+static const long kMaxSparseSkip = 16;
+
+/* HFS 'TEXT' */
+static const uint32_t kTypeTEXT = 0x54455854;
+
+
+/*
+ * One fork to extract.  The workers don't call into the A2File, so
+ * everything they need is copied out of it first.
+ */
+struct VolumeExtractor::Job {
+    A2File*     pFile;
+    bool        rsrcFork;
+    bool        toXattr;        // resource fork goes in an xattr
+    bool        convert;        // EOL conversion
+    uint32_t    fileType;
+    uint32_t    auxType;
+    time_t      modWhen;
+    long        firstBlock;     // for sorting; LONG_MAX if unknown
+    std::string hostPath;       // for "toXattr", the data fork's file
+    uint8_t*    buf;            // contents, once read
+    size_t      len;
+};
+
+struct VolumeExtractor::JobList {
+    ~JobList(void) {
+        for (size_t i = 0; i < jobs.size(); i++)
+            delete jobs[i];
+    }
+    std::vector<Job*>   jobs;
+};
+
+/*
+ * Directories get their dates after everything in them has been written.
+ */
+struct VolumeExtractor::DirList {
+    std::vector<std::string>    paths;
+    std::vector<time_t>         modWhens;
+};
+
+/*
+ * Forks waiting for the workers.  "queuedBytes" counts everything that's
+ * been read and not yet written, including forks the workers are busy
+ * with.
+ */
+struct VolumeExtractor::WorkQueue {
+    std::mutex              lock;
+    std::condition_variable workCond;   // job added, or we're done
+    std::condition_variable roomCond;   // queuedBytes went down
+    std::deque<Job*>        jobs;
+    size_t                  queuedBytes;
+    bool                    done;
+
+    std::mutex              statsLock;  // for the counts and callback
+};
+
+
+/*
+ * ===========================================================================
+ *      Host helpers
+ * ===========================================================================
+ */
+
+static int MakeHostDir(const char* path)
+{
+#ifdef _WIN32
+    return _mkdir(path);
+#else
+    return mkdir(path, 0777);
+#endif
+}
+
+/*
+ * Create the directories leading up to "path", starting after the first
+ * "skip" characters (which are known to exist).
+ */
+static void MakeHostParents(const std::string& path, size_t skip)
+{
+    size_t pos = skip;
+
+    while ((pos = path.find(kHostSep, pos + 1)) != std::string::npos) {
+        std::string dir(path, 0, pos);
+        if (MakeHostDir(dir.c_str()) != 0 && errno != EEXIST)
+            LOGI(" VE unable to create '%s' (errno=%d)", dir.c_str(), errno);
+    }
+}
+
+static void SetHostTime(const char* path, time_t when)
+{
+    struct utimbuf times;
+
+    if (when <= 0)
+        return;
+    times.actime = times.modtime = when;
+    if (utime(path, &times) != 0)
+        LOGI(" VE unable to set date on '%s' (errno=%d)", path, errno);
+}
+
+/*
+ * Append one filename component, escaping anything the host won't take
+ * in a name (and '%' itself) as "%xx".
+ */
+static void AppendHostName(std::string* pPath, const char* name, size_t len)
+{
+    static const char kHexDigits[] = "0123456789ABCDEF";
+    size_t start = pPath->length();
+
+    for (size_t i = 0; i < len; i++) {
+        uint8_t uch = (uint8_t) name[i];
+
+        if (uch == kForeignIndic) {
+            *pPath += kForeignIndic;
+            *pPath += kForeignIndic;
+        } else if (uch < 0x20 || uch >= 0x7f ||
+            strchr(kHostInvalid, uch) != NULL)
+        {
+            *pPath += kForeignIndic;
+            *pPath += kHexDigits[uch >> 4];
+            *pPath += kHexDigits[uch & 0x0f];
+        } else {
+            *pPath += (char) uch;
+        }
+    }
+
+    /* "", ".", and ".." mean something else on the host */
+    std::string added(*pPath, start);
+    if (added.empty())
+        *pPath += "%00";
+    else if (added == "." || added == "..")
+        pPath->replace(start, 1, "%2E");
+}
+
+/*
+ * Build the host path for a file on the volume.
+ */
+static std::string HostPathFor(const char* hostDir, const A2File* pFile)
+{
+    std::string path(hostDir);
+    const char* start = pFile->GetPathName();
+    char fssep = pFile->GetFssep();
+
+    while (true) {
+        const char* end = (fssep == '\0') ? NULL : strchr(start, fssep);
+        size_t len = (end == NULL) ? strlen(start) : end - start;
+
+        path += kHostSep;
+        AppendHostName(&path, start, len);
+        if (end == NULL)
+            break;
+        start = end + 1;
+    }
+
+    return path;
+}
+
+/*
+ * Add a NuLib2-style "#xxyyyy" suffix.
+ */
+static void AppendPreservation(std::string* pPath, uint32_t fileType,
+    uint32_t auxType, bool rsrcFork)
+{
+    char buf[20];
+
+    if (fileType < 0x100 && auxType < 0x10000) {
+        snprintf(buf, sizeof(buf), "%c%02x%04x", kPreserveIndic,
+            fileType, auxType);
+    } else {
+        snprintf(buf, sizeof(buf), "%c%08x%08x", kPreserveIndic,
+            fileType, auxType);
+    }
+    *pPath += buf;
+    if (rsrcFork)
+        *pPath += kResourceFlag;
+}
+
+/*
+ * Find the first block of a fork, so we can read the forks in the order
+ * they're stored.  Returns LONG_MAX if we can't tell.  "*pSupported" is
+ * cleared if the filesystem doesn't report block numbers at all.
+ */
+static long FindFirstBlock(A2File* pFile, bool rsrcFork, bool* pSupported)
+{
+    A2FileDescr* pOpenFile = NULL;
+    long firstBlock = LONG_MAX;
+
+    if (pFile->Open(&pOpenFile, true, rsrcFork) != kDIErrNone)
+        return firstBlock;
+
+    long count = pOpenFile->GetBlockCount();
+    for (long idx = 0; idx < count && idx < kMaxSparseSkip; idx++) {
+        long block;
+        DIError dierr = pOpenFile->GetStorage(idx, &block);
+        if (dierr == kDIErrNotSupported) {
+            *pSupported = false;
+            break;
+        }
+        if (dierr != kDIErrNone)
+            break;
+        if (block != 0) {
+            firstBlock = block;
+            break;
+        }
+    }
+
+    pOpenFile->Close();
+    return firstBlock;
+}
+
+/*
+ * Same test as NufxLib: every character has the high bit set, except
+ * spaces and nulls.
+ */
+static bool IsHighASCII(const uint8_t* buf, size_t len)
+{
+    while (len--) {
+        if ((*buf & 0x80) == 0 && *buf != 0x20 && *buf != 0x00)
+            return false;
+        buf++;
+    }
+    return true;
+}
+
+/*
+ * Convert CR, LF, and CRLF to the host EOL.  "dst" must have room for
+ * len * kHostEOLLen bytes.  Returns the converted length.
+ */
+static size_t ConvertText(uint8_t* dst, const uint8_t* src, size_t len,
+    bool stripHigh)
+{
+    uint8_t* start = dst;
+    uint8_t mask = stripHigh ? 0x7f : 0xff;
+    bool lastCR = false;
+
+    while (len--) {
+        uint8_t uch = *src++ & mask;
+
+        if (uch == '\r') {
+            memcpy(dst, kHostEOL, kHostEOLLen);
+            dst += kHostEOLLen;
+            lastCR = true;
+        } else if (uch == '\n') {
+            if (!lastCR) {
+                memcpy(dst, kHostEOL, kHostEOLLen);
+                dst += kHostEOLLen;
+            }
+            lastCR = false;
+        } else {
+            *dst++ = uch;
+            lastCR = false;
+        }
+    }
+
+    return dst - start;
+}
+
+/*
+ * Create or overwrite a host file, and fill it.
+ */
+static DIError WriteWholeFile(const char* path, const uint8_t* buf,
+    size_t len, time_t modWhen)
+{
+    DIError dierr;
+    int fd;
+
+    fd = open(path, O_WRONLY|O_CREAT|O_TRUNC|O_BINARY, 0666);
+    if (fd < 0)
+        return ErrnoOrGeneric();
+    dierr = WriteHostFd(fd, buf, len);
+    if (close(fd) != 0 && dierr == kDIErrNone)
+        dierr = ErrnoOrGeneric();
+    if (dierr == kDIErrNone)
+        SetHostTime(path, modWhen);
+    return dierr;
+}
+
+
+/*
+ * ===========================================================================
+ *      VolumeExtractor
+ * ===========================================================================
+ */
+
+VolumeExtractor::VolumeExtractor(void) :
+    fNumThreads(0),
+    fConvertEOL(kConvertEOLOff),
+    fConvertHA(kConvertHAAuto),
+    fPreserve(kPreserveNone),
+    fDiskOrder(true),
+    fSubVolumes(true),
+    fQueueLimit(kDefaultQueueLimit),
+    fErrorFunc(NULL),
+    fErrorCookie(NULL),
+    fpQueue(NULL),
+    fpDirs(NULL),
+    fNumForks(0),
+    fNumDirs(0),
+    fNumFailed(0),
+    fNumBytes(0)
+{
+}
+
+VolumeExtractor::~VolumeExtractor(void)
+{
+    assert(fpQueue == NULL);
+}
+
+/*
+ * Extract everything.
+ */
+DIError VolumeExtractor::Extract(DiskFS* pDiskFS, const char* hostDir)
+{
+    DIError dierr = kDIErrNone;
+    WorkQueue queue;
+    DirList dirs;
+    std::thread* threads = NULL;
+    int numThreads, i;
+
+    fNumForks = fNumDirs = fNumFailed = 0;
+    fNumBytes = 0;
+
+    if (MakeHostDir(hostDir) != 0 && errno != EEXIST) {
+        dierr = ErrnoOrGeneric();
+        LOGI(" VE unable to create '%s' (err=%d)", hostDir, dierr);
+        return dierr;
+    }
+
+    numThreads = fNumThreads;
+    if (numThreads <= 0) {
+        numThreads = (int) std::thread::hardware_concurrency();
+        if (numThreads > kMaxThreads)
+            numThreads = kMaxThreads;
+    }
+
+    fpDirs = &dirs;
+    if (numThreads > 1) {
+        LOGI(" VE extracting '%s' with %d workers",
+            pDiskFS->GetVolumeID(), numThreads);
+        queue.queuedBytes = 0;
+        queue.done = false;
+        fpQueue = &queue;
+        threads = new std::thread[numThreads];
+        for (i = 0; i < numThreads; i++)
+            threads[i] = std::thread(Worker, this);
+    }
+
+    dierr = ExtractVolume(pDiskFS, hostDir);
+
+    if (fpQueue != NULL) {
+        {
+            std::unique_lock<std::mutex> lock(queue.lock);
+            queue.done = true;
+            queue.workCond.notify_all();
+        }
+        for (i = 0; i < numThreads; i++)
+            threads[i].join();
+        delete[] threads;
+        fpQueue = NULL;
+    }
+
+    /* writing files changes the directory dates, so do these last */
+    for (size_t idx = 0; idx < dirs.paths.size(); idx++)
+        SetHostTime(dirs.paths[idx].c_str(), dirs.modWhens[idx]);
+    fpDirs = NULL;
+
+    LOGI(" VE done: %ld forks, %ld dirs, %ld failed, %lld bytes",
+        fNumForks, fNumDirs, fNumFailed, (long long) fNumBytes);
+    return dierr;
+}
+
+/*
+ * Extract one volume, then its sub-volumes.
+ */
+DIError VolumeExtractor::ExtractVolume(DiskFS* pDiskFS, const char* hostDir)
+{
+    JobList plan;
+
+    PlanVolume(pDiskFS, hostDir, &plan);
+    if (fDiskOrder) {
+        std::stable_sort(plan.jobs.begin(), plan.jobs.end(),
+            CompareJobs);
+    }
+
+    /* ReadJob takes ownership */
+    for (size_t i = 0; i < plan.jobs.size(); i++) {
+        Job* pJob = plan.jobs[i];
+        plan.jobs[i] = NULL;
+        ReadJob(pJob);
+    }
+
+    if (!fSubVolumes)
+        return kDIErrNone;
+
+    std::set<std::string> usedNames;
+    DiskFS::SubVolume* pSubVol = pDiskFS->GetNextSubVolume(NULL);
+    while (pSubVol != NULL) {
+        DiskFS* pSubFS = pSubVol->GetDiskFS();
+        const char* volName = pSubFS->GetVolumeName();
+        std::string subDir(hostDir);
+        std::string name;
+
+        subDir += kHostSep;
+        if (volName == NULL || volName[0] == '\0')
+            volName = "volume";
+        AppendHostName(&name, volName, strlen(volName));
+        for (int dup = 2; usedNames.count(name) != 0; dup++) {
+            char suffix[16];
+            snprintf(suffix, sizeof(suffix), "_%d", dup);
+            if (dup == 2)
+                name += suffix;
+            else
+                name.replace(name.rfind('_'), std::string::npos, suffix);
+        }
+        usedNames.insert(name);
+        subDir += name;
+
+        if (MakeHostDir(subDir.c_str()) != 0 && errno != EEXIST) {
+            LOGI(" VE unable to create '%s' (errno=%d)", subDir.c_str(),
+                errno);
+        } else {
+            DIError dierr = ExtractVolume(pSubFS, subDir.c_str());
+            if (dierr != kDIErrNone)
+                return dierr;
+        }
+
+        pSubVol = pDiskFS->GetNextSubVolume(pSubVol);
+    }
+
+    return kDIErrNone;
+}
+
+/*
+ * Walk through the file list.  Directories are created now, so the
+ * workers don't have to worry about them; everything else becomes one
+ * job per fork.
+ */
+void VolumeExtractor::PlanVolume(DiskFS* pDiskFS, const char* hostDir,
+    JobList* pJobs)
+{
+    bool useXattr, blocksSupported = true;
+    size_t hostDirLen = strlen(hostDir);
+    std::string lastParent;
+
+#ifdef HAVE_XATTR
+    useXattr = (fPreserve == kPreserveXattr);
+#else
+    useXattr = false;
+#endif
+
+    A2File* pFile = pDiskFS->GetNextFile(NULL);
+    for ( ; pFile != NULL; pFile = pDiskFS->GetNextFile(pFile)) {
+        if (pFile->IsVolumeDirectory())
+            continue;
+
+        std::string path = HostPathFor(hostDir, pFile);
+
+        /* the filesystems don't all list directories */
+        size_t sepPos = path.rfind(kHostSep);
+        if (sepPos > hostDirLen && path.compare(0, sepPos, lastParent) != 0) {
+            MakeHostParents(path, hostDirLen);
+            lastParent.assign(path, 0, sepPos);
+        }
+
+        if (pFile->IsDirectory()) {
+            if (MakeHostDir(path.c_str()) != 0 && errno != EEXIST) {
+                ReportFailure(pFile, false, path.c_str(), ErrnoOrGeneric());
+                continue;
+            }
+            fpDirs->paths.push_back(path);
+            fpDirs->modWhens.push_back(pFile->GetModWhen());
+            fNumDirs++;
+            continue;
+        }
+
+        for (int fork = 0; fork < 2; fork++) {
+            bool rsrcFork = (fork != 0);
+            di_off_t length;
+
+            length = rsrcFork ? pFile->GetRsrcLength() : pFile->GetDataLength();
+            if (rsrcFork && length <= 0)
+                continue;       // no resource fork, or nothing in it
+
+            Job* pJob = new Job;
+            pJob->pFile = pFile;
+            pJob->rsrcFork = rsrcFork;
+            pJob->toXattr = rsrcFork && useXattr;
+            pJob->convert = WantEOLConversion(pFile, rsrcFork);
+            pJob->fileType = pFile->GetFileType();
+            pJob->auxType = pFile->GetAuxType();
+            pJob->modWhen = pFile->GetModWhen();
+            pJob->buf = NULL;
+            pJob->len = 0;
+            pJob->hostPath = path;
+            if (fPreserve == kPreserveSuffix ||
+                (fPreserve == kPreserveXattr && !useXattr))
+            {
+                AppendPreservation(&pJob->hostPath, pJob->fileType,
+                    pJob->auxType, rsrcFork);
+            } else if (rsrcFork && !useXattr) {
+                pJob->hostPath += kResourceStr;
+            }
+
+            if (length == 0)
+                pJob->firstBlock = 0;       // nothing to read
+            else if (fDiskOrder && blocksSupported)
+                pJob->firstBlock = FindFirstBlock(pFile, rsrcFork,
+                                        &blocksSupported);
+            else
+                pJob->firstBlock = LONG_MAX;
+
+            pJobs->jobs.push_back(pJob);
+        }
+    }
+}
+
+/*
+ * Sort by where the data starts.  Empty forks come first, and forks we
+ * couldn't place come last.
+ */
+/*static*/ bool VolumeExtractor::CompareJobs(const Job* pJob1, const Job* pJob2)
+{
+    return pJob1->firstBlock < pJob2->firstBlock;
+}
+
+/*
+ * Read one fork, and pass it to a worker.  We own "pJob".
+ */
+void VolumeExtractor::ReadJob(Job* pJob)
+{
+    A2FileDescr* pOpenFile = NULL;
+    A2File* pFile = pJob->pFile;
+    di_off_t length = 0;
+    DIError dierr = kDIErrNone;
+
+    if (!pJob->rsrcFork && pFile->GetDataLength() == 0)
+        goto queue;     // no need to open it
+
+    dierr = pFile->Open(&pOpenFile, true, pJob->rsrcFork);
+    if (dierr != kDIErrNone)
+        goto bail;
+
+    /* the lengths in the file list are estimates on some filesystems */
+    dierr = pOpenFile->Seek(0, kSeekEnd);
+    if (dierr != kDIErrNone)
+        goto bail;
+    length = pOpenFile->Tell();
+    dierr = pOpenFile->Rewind();
+    if (dierr != kDIErrNone)
+        goto bail;
+
+    /*
+     * If nobody needs to look at the data, and the workers can't take it
+     * (or there aren't any), copy it from here.
+     */
+    if (!pJob->convert && !pJob->toXattr &&
+        (fpQueue == NULL || (size_t) length > fQueueLimit / 4))
+    {
+        dierr = StreamJob(pJob, pOpenFile);
+        fNumBytes += length;
+        goto bail;
+    }
+
+    pJob->len = (size_t) length;
+    pJob->buf = new uint8_t[pJob->len + 1];
+    dierr = pOpenFile->Read(pJob->buf, pJob->len);
+    if (dierr != kDIErrNone)
+        goto bail;
+    pOpenFile->Close();
+    pOpenFile = NULL;
+    fNumBytes += length;
+
+queue:
+    if (fpQueue == NULL) {
+        WriteJob(pJob);
+    } else {
+        std::unique_lock<std::mutex> lock(fpQueue->lock);
+        while (fpQueue->queuedBytes > 0 &&
+            fpQueue->queuedBytes + pJob->len > fQueueLimit)
+        {
+            fpQueue->roomCond.wait(lock);
+        }
+        fpQueue->queuedBytes += pJob->len;
+        fpQueue->jobs.push_back(pJob);
+        fpQueue->workCond.notify_one();
+        return;     // it's the worker's now
+    }
+
+bail:
+    if (pOpenFile != NULL)
+        pOpenFile->Close();
+    if (dierr != kDIErrNone)
+        FinishJob(pJob, dierr);
+    delete[] pJob->buf;
+    delete pJob;
+}
+
+/*
+ * Copy an open fork straight to its host file.  Only used when there's
+ * no conversion to do.
+ */
+DIError VolumeExtractor::StreamJob(Job* pJob, A2FileDescr* pOpenFile)
+{
+    const char* path = pJob->hostPath.c_str();
+    DIError dierr;
+    int fd;
+
+    fd = open(path, O_WRONLY|O_CREAT|O_TRUNC|O_BINARY, 0666);
+    if (fd < 0)
+        return ErrnoOrGeneric();
+    dierr = pOpenFile->ExtractTo(fd);
+    if (close(fd) != 0 && dierr == kDIErrNone)
+        dierr = ErrnoOrGeneric();
+    if (dierr != kDIErrNone)
+        return dierr;
+
+    SetHostTime(path, pJob->modWhen);
+    if (!pJob->rsrcFork)
+        dierr = SetFinderInfo(pJob);
+    if (dierr == kDIErrNone)
+        FinishJob(pJob, dierr);
+    return dierr;
+}
+
+/*
+ * Convert and write one fork that's been read into memory.  Runs on the
+ * worker threads.
+ */
+void VolumeExtractor::WriteJob(Job* pJob)
+{
+    const uint8_t* data = pJob->buf;
+    size_t len = pJob->len;
+    uint8_t* convBuf = NULL;
+    DIError dierr;
+
+    if (len > 0 && pJob->convert) {
+        bool stripHigh = (fConvertHA == kConvertHAOn ||
+            (fConvertHA == kConvertHAAuto && IsHighASCII(data, len)));
+
+        convBuf = new uint8_t[len * kHostEOLLen];
+        len = ConvertText(convBuf, data, len, stripHigh);
+        data = convBuf;
+    }
+
+    dierr = WriteHostFile(pJob, data, len);
+    if (dierr == kDIErrNone && !pJob->rsrcFork)
+        dierr = SetFinderInfo(pJob);
+
+    delete[] convBuf;
+    FinishJob(pJob, dierr);
+}
+
+/*
+ * Write the converted data to the host.
+ */
+DIError VolumeExtractor::WriteHostFile(const Job* pJob, const uint8_t* buf,
+    size_t len)
+{
+#ifdef HAVE_XATTR
+    if (pJob->toXattr) {
+        const char* path = pJob->hostPath.c_str();
+
+        /*
+         * The data fork's job might not have run yet.  Opening the file
+         * doesn't change its date, and the data fork's O_TRUNC won't
+         * touch the attribute.
+         */
+        int fd = open(path, O_WRONLY|O_CREAT|O_BINARY, 0666);
+        if (fd < 0)
+            return ErrnoOrGeneric();
+        close(fd);
+
+        if (setxattr(path, kRsrcForkAttr, buf, len, 0) == 0)
+            return kDIErrNone;
+        if (errno != E2BIG && errno != ENOSPC && errno != ERANGE)
+            return ErrnoOrGeneric();
+
+        /* too big for this filesystem's attributes; use a file */
+        std::string rsrcPath(pJob->hostPath);
+        AppendPreservation(&rsrcPath, pJob->fileType, pJob->auxType, true);
+        LOGI(" VE resource fork (%lu) won't fit in xattr, writing '%s'",
+            (unsigned long) len, rsrcPath.c_str());
+        return WriteWholeFile(rsrcPath.c_str(), buf, len, pJob->modWhen);
+    }
+#endif
+
+    return WriteWholeFile(pJob->hostPath.c_str(), buf, len, pJob->modWhen);
+}
+
+/*
+ * Store the file and creator types in the FinderInfo attribute.  ProDOS
+ * types are encoded the way ProDOS File Exchange does it.
+ */
+DIError VolumeExtractor::SetFinderInfo(const Job* pJob)
+{
+#ifdef HAVE_XATTR
+    uint8_t info[kFinderInfoLen];
+    uint32_t fileType = pJob->fileType;
+    uint32_t auxType = pJob->auxType;
+
+    if (fPreserve != kPreserveXattr)
+        return kDIErrNone;
+
+    memset(info, 0, sizeof(info));
+    if (fileType > 0xff) {
+        /* HFS file with real type and creator */
+        PutLongBE(info, fileType);
+        PutLongBE(info + 4, auxType);
+    } else {
+        info[0] = 'p';
+        info[1] = (uint8_t) fileType;
+        info[2] = (uint8_t) (auxType >> 8);
+        info[3] = (uint8_t) auxType;
+        PutLongBE(info + 4, kPdosCreator);
+    }
+
+    if (setxattr(pJob->hostPath.c_str(), kFinderInfoAttr, info,
+            sizeof(info), 0) != 0)
+    {
+        return ErrnoOrGeneric();
+    }
+#endif
+    return kDIErrNone;
+}
+
+/*
+ * Decide whether a fork gets EOL conversion.
+ */
+bool VolumeExtractor::WantEOLConversion(const A2File* pFile,
+    bool rsrcFork) const
+{
+    if (rsrcFork || fConvertEOL == kConvertEOLOff)
+        return false;
+    if (fConvertEOL == kConvertEOLOn)
+        return true;
+
+    uint32_t fileType = pFile->GetFileType();
+    return (fileType == 0x04 || fileType == 0xb0 || fileType == kTypeTEXT);
+}
+
+/*
+ * Count a finished fork, and report it if it failed.
+ */
+void VolumeExtractor::FinishJob(const Job* pJob, DIError dierr)
+{
+    if (dierr != kDIErrNone) {
+        ReportFailure(pJob->pFile, pJob->rsrcFork, pJob->hostPath.c_str(),
+            dierr);
+        return;
+    }
+
+    if (fpQueue != NULL) {
+        std::unique_lock<std::mutex> lock(fpQueue->statsLock);
+        fNumForks++;
+    } else {
+        fNumForks++;
+    }
+}
+
+void VolumeExtractor::ReportFailure(const A2File* pFile, bool rsrcFork,
+    const char* hostPath, DIError dierr)
+{
+    std::unique_lock<std::mutex> lock;
+
+    if (fpQueue != NULL)
+        lock = std::unique_lock<std::mutex>(fpQueue->statsLock);
+
+    LOGI(" VE failed on '%s' %s -> '%s': %s", pFile->GetPathName(),
+        rsrcFork ? "rsrc" : "data", hostPath, DIStrError(dierr));
+    fNumFailed++;
+    if (fErrorFunc != NULL)
+        (*fErrorFunc)(pFile, rsrcFork, hostPath, dierr, fErrorCookie);
+}
+
+/*
+ * Worker thread.  Writes forks until the queue is empty and the reader
+ * says it's done.
+ */
+/*static*/ void VolumeExtractor::Worker(VolumeExtractor* pExtractor)
+{
+    WorkQueue* pQueue = pExtractor->fpQueue;
+    std::unique_lock<std::mutex> lock(pQueue->lock);
+
+    while (true) {
+        if (pQueue->jobs.empty()) {
+            if (pQueue->done)
+                break;
+            pQueue->workCond.wait(lock);
+            continue;
+        }
+
+        Job* pJob = pQueue->jobs.front();
+        pQueue->jobs.pop_front();
+        lock.unlock();
+
+        size_t len = pJob->len;
+        pExtractor->WriteJob(pJob);
+        delete[] pJob->buf;
+        delete pJob;
+
+        lock.lock();
+        pQueue->queuedBytes -= len;
+        pQueue->roomCond.notify_one();
+    }
+}
@@ -22,6 +22,7 @@ DIError DiskFS::VolumeUsage::Create(long numBlocks)
     fNumSectors = -1;
     fTotalChunks = numBlocks;
     fListSize = numBlocks;
+    delete[] fList;     // in case we're starting over
     fList = new unsigned char[fListSize];
     if (fList == NULL)
         return kDIErrMalloc;
@@ -44,6 +45,7 @@ DIError DiskFS::VolumeUsage::Create(long numTracks, long numSectors)
     fNumSectors = numSectors;
     fTotalChunks = count;
     fListSize = count;
+    delete[] fList;     // in case we're starting over
     fList = new unsigned char[fListSize];
     if (fList == NULL)
         return kDIErrMalloc;
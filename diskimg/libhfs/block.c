@@ -35,30 +35,66 @@
 # define INUSE(b)	((b)->flags & HFS_BUCKET_INUSE)
 # define DIRTY(b)	((b)->flags & HFS_BUCKET_DIRTY)
 
+/*
+ * NAME:	freecache()
+ * DESCRIPTION:	release the memory held by a block cache
+ */
+static
+void freecache(bcache *cache)
+{
+  FREE(cache->chain);
+  FREE(cache->hash);
+  FREE(cache->sorted);
+  FREE(cache->pool);
+  FREE(cache);
+}
+
 /*
  * NAME:	block->init()
- * DESCRIPTION:	initialize a volume's block cache
+ * DESCRIPTION:	initialize a volume's block cache, holding "size" blocks
  */
-int b_init(hfsvol *vol)
+int b_init(hfsvol *vol, unsigned int size)
 {
   bcache *cache;
-  int i;
+  unsigned int i;
 
   ASSERT(vol->cache == 0);
 
+  /* reuse() and getbucket() work on runs of up to HFS_BLOCKBUFSZ buckets */
+  if (size < HFS_BLOCKBUFSZ)
+    size = HFS_BLOCKBUFSZ;
+
   cache = ALLOC(bcache, 1);
   if (cache == 0)
     ERROR(ENOMEM, 0);
 
+  cache->size   = size;
+  for (cache->hashsz = HFS_HASHSZ; cache->hashsz < size / 4; )
+    cache->hashsz <<= 1;
+
+  cache->chain  = ALLOC(bucket, size);
+  cache->hash   = ALLOC(bucket *, cache->hashsz);
+  cache->sorted = ALLOC(bucket *, size);
+  cache->pool   = ALLOC(block, size);
+
+  if (cache->chain == 0 || cache->hash == 0 ||
+      cache->sorted == 0 || cache->pool == 0)
+    {
+      freecache(cache);
+      ERROR(ENOMEM, 0);
+    }
+
   vol->cache = cache;
 
   cache->vol    = vol;
-  cache->tail   = &cache->chain[HFS_CACHESZ - 1];
+  cache->tail   = &cache->chain[size - 1];
 
-  cache->hits   = 0;
-  cache->misses = 0;
+  cache->hits      = 0;
+  cache->misses    = 0;
+  cache->evictions = 0;
+  cache->bypassed  = 0;
 
-  for (i = 0; i < HFS_CACHESZ; ++i)
+  for (i = 0; i < size; ++i)
     {
       bucket *b = &cache->chain[i];
 
@@ -78,7 +114,7 @@ int b_init(hfsvol *vol)
   cache->chain[0].cprev = cache->tail;
   cache->tail->cnext    = &cache->chain[0];
 
-  for (i = 0; i < HFS_HASHSZ; ++i)
+  for (i = 0; i < cache->hashsz; ++i)
     cache->hash[i] = 0;
 
   return 0;
@@ -94,9 +130,11 @@ fail:
  */
 void b_showstats(const bcache *cache)
 {
-  fprintf(stderr, "BLOCK: CACHE vol 0x%lx \"%s\" hit/miss ratio = %.3f\n",
+  fprintf(stderr, "BLOCK: CACHE vol 0x%lx \"%s\" hit/miss ratio = %.3f"
+	  " (%lu evictions, %lu bypassed)\n",
 	  (unsigned long) cache->vol, cache->vol->mdb.drVN,
-	  (float) cache->hits / (float) cache->misses);
+	  (float) cache->hits / (float) cache->misses,
+	  cache->evictions, cache->bypassed);
 }
 
 /*
@@ -110,7 +148,7 @@ void b_dumpcache(const bcache *cache)
 
   fprintf(stderr, "BLOCK CACHE DUMP:\n");
 
-  for (i = 0, b = cache->tail->cnext; i < HFS_CACHESZ; ++i, b = b->cnext)
+  for (i = 0, b = cache->tail->cnext; i < cache->size; ++i, b = b->cnext)
     {
       if (INUSE(b))
 	{
@@ -126,7 +164,7 @@ void b_dumpcache(const bcache *cache)
 
   fprintf(stderr, "BLOCK HASH DUMP:\n");
 
-  for (i = 0; i < HFS_HASHSZ; ++i)
+  for (i = 0; i < cache->hashsz; ++i)
     {
       int seen = 0;
 
@@ -319,16 +357,15 @@ int dobuckets(hfsvol *vol, bucket **chain, unsigned int len,
 int b_flush(hfsvol *vol)
 {
   bcache *cache = vol->cache;
-  bucket *chain[HFS_CACHESZ];
-  int i;
+  unsigned int i;
 
   if (cache == 0 || (vol->flags & HFS_VOL_READONLY))
     goto done;
 
-  for (i = 0; i < HFS_CACHESZ; ++i)
-    chain[i] = &cache->chain[i];
+  for (i = 0; i < cache->size; ++i)
+    cache->sorted[i] = &cache->chain[i];
 
-  if (flushbuckets(vol, chain, HFS_CACHESZ) == -1)
+  if (flushbuckets(vol, cache->sorted, cache->size) == -1)
     goto fail;
 
 done:
@@ -360,7 +397,7 @@ int b_finish(hfsvol *vol)
 
   result = b_flush(vol);
 
-  FREE(vol->cache);
+  freecache(vol->cache);
   vol->cache = 0;
 
 done:
@@ -376,7 +413,7 @@ bucket *findbucket(bcache *cache, unsigned long bnum, bucket ***hslot)
 {
   bucket *b;
 
-  *hslot = &cache->hash[bnum & (HFS_HASHSZ - 1)];
+  *hslot = &cache->hash[bnum & (cache->hashsz - 1)];
 
   for (b = **hslot; b; b = b->hnext)
     {
@@ -418,6 +455,9 @@ int reuse(bcache *cache, bucket *b, unsigned long bnum)
 	goto fail;
     }
 
+  if (INUSE(b))
+    ++cache->evictions;
+
   b->flags &= ~HFS_BUCKET_INUSE;
   b->count  = 1;
   b->bnum   = bnum;
@@ -678,6 +718,45 @@ fail:
   return -1;
 }
 
+/*
+ * NAME:	block->readrun()
+ * DESCRIPTION:	read consecutive logical blocks, mostly bypassing the cache
+ *
+ * This is for bulk file reads, which would otherwise push the catalog and
+ * extents tree nodes out of the cache with blocks that won't be read again.
+ * Blocks are read straight from the medium, then any dirty copies in the
+ * cache are laid over the top so we never return stale data.
+ */
+int b_readrun(hfsvol *vol, unsigned long bnum, unsigned int blen, block *bp)
+{
+  bcache *cache = vol->cache;
+  bucket **hslot, *b;
+  unsigned int i;
+
+  if (vol->vlen > 0 && bnum + blen > vol->vlen)
+    ERROR(EIO, "read nonexistent logical block");
+
+  if (b_readpb(vol, vol->vstart + bnum, bp, blen) == -1)
+    goto fail;
+
+  if (cache)
+    {
+      for (i = 0; i < blen; ++i)
+	{
+	  b = findbucket(cache, bnum + i, &hslot);
+	  if (b && DIRTY(b))
+	    memcpy(bp[i], b->data, HFS_BLOCKSZ);
+	}
+
+      cache->bypassed += blen;
+    }
+
+  return 0;
+
+fail:
+  return -1;
+}
+
 /*
  * NAME:	block->writelb()
  * DESCRIPTION:	write a logical block to a volume (or to the cache)
@@ -19,7 +19,7 @@
  * $Id$
  */
 
-int b_init(hfsvol *);
+int b_init(hfsvol *, unsigned int);
 int b_flush(hfsvol *);
 int b_finish(hfsvol *);
 
@@ -29,6 +29,8 @@ int b_writepb(hfsvol *, unsigned long, const block *, unsigned int);
 int b_readlb(hfsvol *, unsigned long, block *);
 int b_writelb(hfsvol *, unsigned long, const block *);
 
+int b_readrun(hfsvol *, unsigned long, unsigned int, block *);
+
 int b_readab(hfsvol *, unsigned int, unsigned int, block *);
 int b_writeab(hfsvol *, unsigned int, unsigned int, const block *);
 
@@ -30,11 +30,25 @@
 #  include <sys/time.h>
 # endif
 
+# include "hfs.h"
 # include "data.h"
 
 # define TIMEDIFF  2082844800UL
 
+# ifdef _WIN32
+#  define LOCALTIME_R(t, tm)	(localtime_s((tm), (t)) == 0)
+#  define GMTIME_R(t, tm)	(gmtime_s((tm), (t)) == 0)
+# else
+#  define LOCALTIME_R(t, tm)	(localtime_r((t), (tm)) != 0)
+#  define GMTIME_R(t, tm)	(gmtime_r((t), (tm)) != 0)
+# endif
+
+/* supplied once by the host before any threads start, or -1 */
 static
+time_t hosttzdiff = -1;
+
+/* otherwise computed once per thread, so there's nothing to lock */
+static HFS_THREAD
 time_t tzdiff = -1;
 
 const
@@ -437,15 +451,12 @@ void calctzdiff(void)
   time_t t;
   int isdst;
   struct tm tm;
-  const struct tm *tmp;
 
   time(&t);
-  isdst = localtime(&t)->tm_isdst;
+  isdst = LOCALTIME_R(&t, &tm) ? tm.tm_isdst : -1;
 
-  tmp = gmtime(&t);
-  if (tmp)
+  if (GMTIME_R(&t, &tm))
     {
-      tm = *tmp;
       tm.tm_isdst = isdst;
 
       tzdiff = t - mktime(&tm);
@@ -461,15 +472,37 @@ void calctzdiff(void)
 }
 
 /*
- * NAME:	data->ltime()
- * DESCRIPTION:	convert MacOS time to local time
+ * NAME:	gettzdiff()
+ * DESCRIPTION:	return the host's timezone difference, or our own
  */
-time_t d_ltime(unsigned long mtime)
+static
+time_t gettzdiff(void)
 {
+  if (hosttzdiff != -1)
+    return hosttzdiff;
+
   if (tzdiff == -1)
     calctzdiff();
 
-  return (time_t) (mtime - TIMEDIFF) - tzdiff;
+  return tzdiff;
+}
+
+/*
+ * NAME:	hfs->settzdiff()
+ * DESCRIPTION:	supply the timezone difference between local time and UTC
+ */
+void hfs_settzdiff(long diff)
+{
+  hosttzdiff = diff;
+}
+
+/*
+ * NAME:	data->ltime()
+ * DESCRIPTION:	convert MacOS time to local time
+ */
+time_t d_ltime(unsigned long mtime)
+{
+  return (time_t) (mtime - TIMEDIFF) - gettzdiff();
 }
 
 /*
@@ -478,8 +511,5 @@ time_t d_ltime(unsigned long mtime)
  */
 unsigned long d_mtime(time_t ltime)
 {
-  if (tzdiff == -1)
-    calctzdiff();
-
-  return (unsigned long) (ltime + tzdiff) + TIMEDIFF;
+  return (unsigned long) (ltime + gettzdiff()) + TIMEDIFF;
 }
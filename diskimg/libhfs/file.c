@@ -140,20 +140,16 @@ void f_getptrs(hfsfile *file, ExtDataRec **extrec,
 }
 
 /*
- * NAME:	file->doblock()
- * DESCRIPTION:	read or write a numbered block from a file
+ * NAME:	findextent()
+ * DESCRIPTION:	locate the extent holding a file's Nth allocation block
  */
-int f_doblock(hfsfile *file, unsigned long num, block *bp,
-	      int (*func)(hfsvol *, unsigned int, unsigned int, block *))
+static
+ExtDescriptor *findextent(hfsfile *file, unsigned int abnum,
+			  unsigned int *offs)
 {
-  unsigned int abnum;
-  unsigned int blnum;
   unsigned int fabn;
   int i;
 
-  abnum = num / file->vol->lpa;
-  blnum = num % file->vol->lpa;
-
   /* locate the appropriate extent record */
 
   fabn = file->fabn;
@@ -179,7 +175,10 @@ int f_doblock(hfsfile *file, unsigned long num, block *bp,
 	  n = file->ext[i].xdrNumABlks;
 
 	  if (abnum < n)
-	    return func(file->vol, file->ext[i].xdrStABN + abnum, blnum, bp);
+	    {
+	      *offs = abnum;
+	      return &file->ext[i];
+	    }
 
 	  fabn  += n;
 	  abnum -= n;
@@ -191,6 +190,74 @@ int f_doblock(hfsfile *file, unsigned long num, block *bp,
       file->fabn = fabn;
     }
 
+fail:
+  return 0;
+}
+
+/*
+ * NAME:	file->doblock()
+ * DESCRIPTION:	read or write a numbered block from a file
+ */
+int f_doblock(hfsfile *file, unsigned long num, block *bp,
+	      int (*func)(hfsvol *, unsigned int, unsigned int, block *))
+{
+  ExtDescriptor *ext;
+  unsigned int offs;
+
+  ext = findextent(file, num / file->vol->lpa, &offs);
+  if (ext == 0)
+    goto fail;
+
+  return func(file->vol, ext->xdrStABN + offs, num % file->vol->lpa, bp);
+
+fail:
+  return -1;
+}
+
+/*
+ * NAME:	file->getrun()
+ * DESCRIPTION:	map a numbered file block to a run of contiguous volume blocks
+ *
+ * Sets *lbnum to the logical block holding file block "num", and returns
+ * the number of file blocks from there, up to "max", that follow it on
+ * the volume without a break.  Returns -1 on error.
+ */
+long f_getrun(hfsfile *file, unsigned long num, unsigned long max,
+	      unsigned long *lbnum)
+{
+  hfsvol *vol = file->vol;
+  ExtDescriptor *ext;
+  unsigned int offs, blnum, anum, alast;
+  unsigned long run;
+
+  ext = findextent(file, num / vol->lpa, &offs);
+  if (ext == 0)
+    goto fail;
+
+  blnum = num % vol->lpa;
+  run   = (unsigned long) (ext->xdrNumABlks - offs) * vol->lpa - blnum;
+  if (run > max)
+    run = max;
+
+  /* same checks as b_readab(), for every allocation block in the run */
+
+  anum  = ext->xdrStABN + offs;
+  alast = anum + (blnum + run - 1) / vol->lpa;
+
+  if (alast >= vol->mdb.drNmAlBlks)
+    ERROR(EIO, "read nonexistent allocation block");
+
+  for ( ; vol->vbm && anum <= alast; ++anum)
+    {
+      if (! BMTST(vol->vbm, anum))
+	ERROR(EIO, "read unallocated block");
+    }
+
+  *lbnum = vol->mdb.drAlBlSt +
+    (unsigned long) (ext->xdrStABN + offs) * vol->lpa + blnum;
+
+  return run;
+
 fail:
   return -1;
 }
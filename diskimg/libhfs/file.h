@@ -30,6 +30,7 @@ void f_getptrs(hfsfile *, ExtDataRec **, unsigned long **, unsigned long **);
 
 int f_doblock(hfsfile *, unsigned long, block *,
 	      int (*)(hfsvol *, unsigned int, unsigned int, block *));
+long f_getrun(hfsfile *, unsigned long, unsigned long, unsigned long *);
 
 # define f_getblock(file, num, bp)  \
     f_doblock((file), (num), (bp), b_readab)
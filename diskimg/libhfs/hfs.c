@@ -40,8 +40,8 @@
 # include "record.h"
 # include "volume.h"
 
-/* should be CP_NO_STATIC, but it's harmless (albeit useless with MT) */
-const char *hfs_error = "no error";	/* static error string */
+HFS_THREAD
+const char *hfs_error = "no error";	/* per-thread error string */
 
 #ifdef CP_NO_STATIC
 hfsvol *hfs_mounts;			/* linked list of mounted volumes */
@@ -461,6 +461,64 @@ fail:
   return -1;
 }
 
+/*
+ * NAME:	hfs->setcachesize()
+ * DESCRIPTION:	replace a volume's block cache with one of a different size
+ *
+ * The old cache is flushed and discarded, so this is best done right after
+ * the volume is opened.  A size of zero turns caching off.
+ */
+int hfs_setcachesize(hfsvol *vol, unsigned int nblocks)
+{
+  if (getvol(&vol) == -1)
+    goto fail;
+
+  if (vol->flags & HFS_VOL_USINGCACHE)
+    {
+      vol->flags &= ~HFS_VOL_USINGCACHE;
+      if (b_finish(vol) == -1)
+	goto fail;
+    }
+
+  if (nblocks > 0)
+    {
+      if (b_init(vol, nblocks) == -1)
+	goto fail;
+      vol->flags |= HFS_VOL_USINGCACHE;
+    }
+
+  return 0;
+
+fail:
+  return -1;
+}
+
+/*
+ * NAME:	hfs->cachestats()
+ * DESCRIPTION:	return block cache statistics
+ */
+int hfs_cachestats(hfsvol *vol, hfscachestats *stats)
+{
+  if (getvol(&vol) == -1)
+    goto fail;
+
+  memset(stats, 0, sizeof(*stats));
+
+  if (vol->cache)
+    {
+      stats->size      = vol->cache->size;
+      stats->hits      = vol->cache->hits;
+      stats->misses    = vol->cache->misses;
+      stats->evictions = vol->cache->evictions;
+      stats->bypassed  = vol->cache->bypassed;
+    }
+
+  return 0;
+
+fail:
+  return -1;
+}
+
 /*
  * NAME:	hfs->vsetattr()
  * DESCRIPTION:	change volume attributes
@@ -748,6 +806,79 @@ fail:
   return -1;
 }
 
+/*
+ * NAME:	hfs->sweepcat()
+ * DESCRIPTION:	call a function for every file and directory on the volume
+ *
+ * This reads the catalog file once, front to back, rather than opening
+ * each directory by name.  Following the leaf chain would give key order,
+ * but on a well-used volume the chain jumps all over the file, and every
+ * backward jump restarts the extent walk in f_doblock().  So we visit the
+ * in-use leaf nodes in node number order instead.  Entries therefore
+ * arrive in no particular order; callers that care must sort them by
+ * (parent CNID, name) themselves.  If the function returns nonzero, the
+ * sweep stops and -1 is returned.
+ */
+int hfs_sweepcat(hfsvol *vol, hfssweepfunc func, void *arg)
+{
+  node n;
+  unsigned long nnum;
+  CatKeyRec key;
+  CatDataRec data;
+  hfsdirent ent;
+  const byte *ptr;
+
+  if (getvol(&vol) == -1)
+    goto fail;
+
+  if (vol->cat.map == 0)
+    ERROR(EIO, "catalog node map not loaded");
+
+  /* node 0 is the header node */
+  for (nnum = 1; nnum < vol->cat.hdr.bthNNodes &&
+	 nnum < vol->cat.mapsz * 8; ++nnum)
+    {
+      if (! BMTST(vol->cat.map, nnum))
+	continue;
+
+      if (bt_getnode(&n, &vol->cat, nnum) == -1)
+	goto fail;
+
+      if (n.nd.ndType != ndLeafNode)
+	continue;
+
+      for (n.rnum = 0; n.rnum < n.nd.ndNRecs; ++n.rnum)
+	{
+	  ptr = HFS_NODEREC(n, n.rnum);
+
+	  r_unpackcatkey(ptr, &key);
+	  r_unpackcatdata(HFS_RECDATA(ptr), &data);
+
+	  switch (data.cdrType)
+	    {
+	    case cdrDirRec:
+	    case cdrFilRec:
+	      r_unpackdirent(key.ckrParID, key.ckrCName, &data, &ent);
+	      if (func(arg, &ent) != 0)
+		ERROR(EINTR, "catalog sweep stopped");
+	      break;
+
+	    case cdrThdRec:
+	    case cdrFThdRec:
+	      break;
+
+	    default:
+	      ERROR(EIO, "unexpected catalog record found");
+	    }
+	}
+    }
+
+  return 0;
+
+fail:
+  return -1;
+}
+
 /*
  * NAME:	hfs->closedir()
  * DESCRIPTION:	stop reading a directory
@@ -891,6 +1022,76 @@ fail:
   return 0;
 }
 
+/*
+ * NAME:	hfs->openbyid()
+ * DESCRIPTION:	prepare a file for I/O, given its CNID
+ *
+ * The parent CNID and name are used to find the catalog record with a
+ * single B*-tree search.  If they're stale, we try the file thread record,
+ * which most files don't have.
+ */
+hfsfile *hfs_openbyid(hfsvol *vol, unsigned long cnid, unsigned long parid,
+		      const char *name)
+{
+  hfsfile *file = 0;
+  CatDataRec thread;
+  int found;
+
+  if (getvol(&vol) == -1)
+    goto fail;
+
+  file = ALLOC(hfsfile, 1);
+  if (file == 0)
+    ERROR(ENOMEM, 0);
+
+  found = v_catsearch(vol, parid, name, &file->cat, file->name, 0);
+  if (found == -1)
+    goto fail;
+
+  if (found == 0 || file->cat.cdrType != cdrFilRec ||
+      file->cat.u.fil.filFlNum != cnid)
+    {
+      found = v_getfthread(vol, cnid, &thread, 0);
+      if (found == -1)
+	goto fail;
+      else if (found == 0)
+	ERROR(ENOENT, "no such file");
+
+      parid = thread.u.fthd.fthdParID;
+      found = v_catsearch(vol, parid, thread.u.fthd.fthdCName,
+			  &file->cat, file->name, 0);
+      if (found == -1)
+	goto fail;
+      else if (found == 0)
+	ERROR(ENOENT, "no such file");
+
+      if (file->cat.cdrType != cdrFilRec || file->cat.u.fil.filFlNum != cnid)
+	ERROR(ENOENT, "no such file");
+    }
+
+  /* package file handle for user */
+
+  file->vol   = vol;
+  file->parid = parid;
+  file->flags = 0;
+
+  f_selectfork(file, fkData);
+
+  file->prev = 0;
+  file->next = vol->files;
+
+  if (vol->files)
+    vol->files->prev = file;
+
+  vol->files = file;
+
+  return file;
+
+fail:
+  FREE(file);
+  return 0;
+}
+
 /*
  * NAME:	hfs->setfork()
  * DESCRIPTION:	select file fork for I/O operations
@@ -933,7 +1134,8 @@ unsigned long hfs_read(hfsfile *file, void *buf, unsigned long len)
   count = len;
   while (count)
     {
-      unsigned long bnum, offs, chunk;
+      unsigned long bnum, offs, chunk, lbnum;
+      long run;
 
       bnum  = file->pos >> HFS_BLOCKSZ_BITS;
       offs  = file->pos & (HFS_BLOCKSZ - 1);
@@ -942,7 +1144,18 @@ unsigned long hfs_read(hfsfile *file, void *buf, unsigned long len)
       if (chunk > count)
 	chunk = count;
 
-      if (offs == 0 && chunk == HFS_BLOCKSZ)
+      /* read runs of whole blocks straight from the extent */
+
+      if (offs == 0 && count >= 2 * HFS_BLOCKSZ &&
+	  (run = f_getrun(file, bnum, count >> HFS_BLOCKSZ_BITS,
+			  &lbnum)) > 1)
+	{
+	  if (b_readrun(file->vol, lbnum, run, (block *) ptr) == -1)
+	    goto fail;
+
+	  chunk = run << HFS_BLOCKSZ_BITS;
+	}
+      else if (offs == 0 && chunk == HFS_BLOCKSZ)
 	{
 	  if (f_getblock(file, bnum, (block *) ptr) == -1)
 	    goto fail;
@@ -94,6 +94,15 @@ typedef struct {
   } u;
 } hfsdirent;
 
+typedef struct {
+  unsigned int size;		/* cache size in blocks (0 if no cache) */
+
+  unsigned long hits;		/* blocks found in the cache */
+  unsigned long misses;		/* blocks that had to be read */
+  unsigned long evictions;	/* cached blocks dropped to make room */
+  unsigned long bypassed;	/* blocks read around the cache */
+} hfscachestats;
+
 # define HFS_ISDIR		0x0001
 # define HFS_ISLOCKED		0x0002
 
@@ -118,7 +127,18 @@ typedef struct {
 # define HFS_FNDR_ISINVISIBLE		(1 << 14)
 # define HFS_FNDR_ISALIAS		(1 << 15)
 
-extern const char *hfs_error;
+/*
+ * hfs_error describes the most recent failure on the calling thread, the
+ * same way errno does.  Everything else lives in the hfsvol, so different
+ * threads may work on different volumes at the same time.
+ */
+# ifdef _MSC_VER
+#  define HFS_THREAD		__declspec(thread)
+# else
+#  define HFS_THREAD		__thread
+# endif
+
+extern HFS_THREAD const char *hfs_error;
 extern const unsigned char hfs_charorder[];
 
 # define HFS_MODE_RDONLY	0
@@ -150,6 +170,9 @@ void hfs_setvol(hfsvol *);
 int hfs_vstat(hfsvol *, hfsvolent *);
 int hfs_vsetattr(hfsvol *, hfsvolent *);
 
+int hfs_setcachesize(hfsvol *, unsigned int);
+int hfs_cachestats(hfsvol *, hfscachestats *);
+
 int hfs_chdir(hfsvol *, const char *);
 unsigned long hfs_getcwd(hfsvol *);
 int hfs_setcwd(hfsvol *, unsigned long);
@@ -159,8 +182,12 @@ hfsdir *hfs_opendir(hfsvol *, const char *);
 int hfs_readdir(hfsdir *, hfsdirent *);
 int hfs_closedir(hfsdir *);
 
+typedef int (*hfssweepfunc)(void *, const hfsdirent *);
+int hfs_sweepcat(hfsvol *, hfssweepfunc, void *);
+
 hfsfile *hfs_create(hfsvol *, const char *, const char *, const char *);
 hfsfile *hfs_open(hfsvol *, const char *);
+hfsfile *hfs_openbyid(hfsvol *, unsigned long, unsigned long, const char *);
 int hfs_setfork(hfsfile *, int);
 int hfs_getfork(hfsfile *);
 unsigned long hfs_read(hfsfile *, void *, unsigned long);
@@ -196,6 +223,13 @@ int  hfs_callback_close(hfsvol* vol);
 int hfs_callback_format(oscallback func, void* cookie, int mode,
 	const char* vname);
 
+/*
+ * Supply the local time zone's offset from UTC, in seconds, instead of
+ * having libhfs work it out with localtime_r() and mktime() on every
+ * thread.  Call it once, before any threads start using libhfs.
+ */
+void hfs_settzdiff(long diff);
+
 #ifdef __cplusplus
 };
 #endif
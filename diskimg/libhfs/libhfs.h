@@ -74,21 +74,29 @@ typedef struct _bucket_ {
 # define HFS_BUCKET_INUSE	0x01
 # define HFS_BUCKET_DIRTY	0x02
 
-# define HFS_CACHESZ		128
-# define HFS_HASHSZ		32
+# ifndef HFS_CACHESZ
+#  define HFS_CACHESZ		128	/* default; see hfs_setcachesize() */
+# endif
+# define HFS_HASHSZ		32	/* minimum; grows with the cache */
 # define HFS_BLOCKBUFSZ		16
 
 typedef struct {
   struct _hfsvol_ *vol;		/* volume to which cache belongs */
   bucket *tail;			/* end of bucket chain */
 
-  unsigned int hits;		/* number of cache hits */
-  unsigned int misses;		/* number of cache misses */
+  unsigned int size;		/* number of buckets */
+  unsigned int hashsz;		/* number of hash slots (power of 2) */
+
+  unsigned long hits;		/* number of cache hits */
+  unsigned long misses;		/* number of cache misses */
+  unsigned long evictions;	/* in-use buckets reused for other blocks */
+  unsigned long bypassed;	/* blocks read around the cache */
 
-  bucket chain[HFS_CACHESZ];	/* cache bucket chain */
-  bucket *hash[HFS_HASHSZ];	/* hash table for bucket chain */
+  bucket *chain;		/* cache bucket chain */
+  bucket **hash;		/* hash table for bucket chain */
+  bucket **sorted;		/* scratch space for b_flush() */
 
-  block pool[HFS_CACHESZ];	/* physical blocks in cache */
+  block *pool;			/* physical blocks in cache */
 } bcache;
 
 # define HFS_MAP1SZ  256
@@ -224,4 +232,6 @@ struct _hfsvol_ {
 
 # define HFS_VOL_OPT_MASK	0xff00
 
+#ifdef CP_NO_STATIC
 extern hfsvol *hfs_mounts;
+#endif
@@ -109,7 +109,7 @@ int v_open(hfsvol *vol, const char *path, int mode)
   /* initialize volume block cache (OK to fail) */
 
   if (! (vol->flags & HFS_OPT_NOCACHE) &&
-      b_init(vol) != -1)
+      b_init(vol, HFS_CACHESZ) != -1)
     vol->flags |= HFS_VOL_USINGCACHE;
 
   return 0;
@@ -136,7 +136,7 @@ int v_callback_open(hfsvol* vol, oscallback func, void* cookie)
   /* initialize volume block cache (OK to fail) */
 
   if (! (vol->flags & HFS_OPT_NOCACHE) &&
-      b_init(vol) != -1)
+      b_init(vol, HFS_CACHESZ) != -1)
     vol->flags |= HFS_VOL_USINGCACHE;
 
   return 0;
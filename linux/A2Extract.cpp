@@ -0,0 +1,234 @@
+/*
+ * CiderPress
+ * Copyright (C) 2009 by CiderPress authors.  All Rights Reserved.
+ * See the file LICENSE for distribution terms.
+ */
+/*
+ * Extract everything from one or more disk images into directory trees.
+ */
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include "../diskimg/DiskImg.h"
+#include "../nufxlib/NufxLib.h"
+
+using namespace DiskImgLib;
+
+#define nil NULL
+#define MAX_PATH_LEN 1024
+
+bool gVerbose = false;
+
+/*
+ * Show library messages if we were asked to.
+ */
+void
+MsgHandler(const char* file, int line, const char* msg)
+{
+    assert(file != nil);
+    assert(msg != nil);
+
+    if (gVerbose)
+        fprintf(stderr, "%s\n", msg);
+}
+
+void
+Usage(const char* argv0)
+{
+    fprintf(stderr, "Usage: %s [-j threads] [-d dir] [-p none|suffix|xattr] "
+                    "[-t | -T] [-H] [-c] [-q] [-v] image ...\n", argv0);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Each image is extracted into a directory named after it.\n");
+    fprintf(stderr, "  -j  worker threads; 0 picks a number, 1 uses no workers (default 0)\n");
+    fprintf(stderr, "  -d  where to put the directories (default .)\n");
+    fprintf(stderr, "  -p  how to keep file types: not at all, \"#xxyyyy\" on the\n");
+    fprintf(stderr, "      name, or extended attributes (default none)\n");
+    fprintf(stderr, "  -t  convert EOL in text files;  -T  convert EOL in all files\n");
+    fprintf(stderr, "  -H  don't strip the high bit from converted high-ASCII text\n");
+    fprintf(stderr, "  -c  read files in catalog order instead of disk order\n");
+    fprintf(stderr, "  -q  don't show the totals\n");
+    fprintf(stderr, "  -v  show library messages\n");
+}
+
+/*
+ * Report a file we couldn't extract.
+ */
+void
+ErrorCallback(const A2File* pFile, bool rsrcFork, const char* hostPath,
+    DIError dierr, void* cookie)
+{
+    const char* imageName = (const char*) cookie;
+
+    fprintf(stderr, "%s: '%s'%s -> '%s': %s\n", imageName,
+        pFile->GetPathName(), rsrcFork ? " (rsrc)" : "", hostPath,
+        DIStrError(dierr));
+}
+
+/*
+ * Figure out the directory for an image: the file name without the
+ * directory or the last extension.
+ */
+void
+MakeOutputDir(const char* outDir, const char* imageName, char* buf)
+{
+    const char* name = strrchr(imageName, '/');
+    name = (name == nil) ? imageName : name + 1;
+
+    snprintf(buf, MAX_PATH_LEN, "%s/%s", outDir, name);
+    char* dot = strrchr(buf + strlen(outDir) + 1, '.');
+    if (dot != nil && dot != buf + strlen(outDir) + 1)
+        *dot = '\0';
+    else
+        strncat(buf, ".d", MAX_PATH_LEN - strlen(buf) - 1);  // no extension
+}
+
+/*
+ * Extract one image.
+ *
+ * Returns 0 on success, 1 if some files couldn't be extracted, -1 if
+ * the image couldn't be read at all.
+ */
+int
+Process(const char* imageName, const char* outDir,
+    VolumeExtractor* pExtractor, bool quiet)
+{
+    DIError dierr;
+    DiskImg diskImg;
+    DiskFS* pDiskFS = nil;
+    char hostDir[MAX_PATH_LEN];
+    uint64_t startWhen, endWhen;
+    int result = -1;
+
+    startWhen = DiskImgStats::GetMonotonicMicros();
+
+    dierr = diskImg.OpenImage(imageName, '/', true);
+    if (dierr == kDIErrNone)
+        dierr = diskImg.AnalyzeImage();
+    if (dierr != kDIErrNone) {
+        fprintf(stderr, "%s: unable to open: %s\n", imageName,
+            DIStrError(dierr));
+        goto bail;
+    }
+    if (diskImg.GetFSFormat() == DiskImg::kFormatUnknown ||
+        diskImg.GetSectorOrder() == DiskImg::kSectorOrderUnknown)
+    {
+        fprintf(stderr, "%s: unable to identify filesystem\n", imageName);
+        goto bail;
+    }
+
+    pDiskFS = diskImg.OpenAppropriateDiskFS();
+    if (pDiskFS == nil) {
+        fprintf(stderr, "%s: format not recognized\n", imageName);
+        goto bail;
+    }
+    pDiskFS->SetScanForSubVolumes(DiskFS::kScanSubEnabled);
+    dierr = pDiskFS->Initialize(&diskImg, DiskFS::kInitFull);
+    if (dierr != kDIErrNone) {
+        fprintf(stderr, "%s: unable to read file list: %s\n", imageName,
+            DIStrError(dierr));
+        goto bail;
+    }
+
+    MakeOutputDir(outDir, imageName, hostDir);
+    pExtractor->SetErrorCallback(ErrorCallback, (void*) imageName);
+    dierr = pExtractor->Extract(pDiskFS, hostDir);
+    if (dierr != kDIErrNone) {
+        fprintf(stderr, "%s: extraction into '%s' failed: %s\n", imageName,
+            hostDir, DIStrError(dierr));
+        goto bail;
+    }
+    endWhen = DiskImgStats::GetMonotonicMicros();
+
+    if (!quiet) {
+        double secs = (endWhen - startWhen) / 1000000.0;
+        double megs = pExtractor->GetNumBytes() / (1024.0 * 1024.0);
+        printf("%s -> %s: %ld forks, %ld dirs, %.1f MB in %.3fs "
+               "(%.1f MB/s, %.0f forks/s)",
+            imageName, hostDir, pExtractor->GetNumForks(),
+            pExtractor->GetNumDirs(), megs, secs,
+            secs > 0 ? megs / secs : 0.0,
+            secs > 0 ? pExtractor->GetNumForks() / secs : 0.0);
+        if (pExtractor->GetNumFailed() != 0)
+            printf(", %ld FAILED", pExtractor->GetNumFailed());
+        printf("\n");
+    }
+
+    result = (pExtractor->GetNumFailed() != 0) ? 1 : 0;
+
+bail:
+    delete pDiskFS;
+    return result;
+}
+
+int
+main(int argc, char** argv)
+{
+    VolumeExtractor extractor;
+    const char* outDir = ".";
+    bool quiet = false;
+    int result = 0;
+    int ic;
+
+    while ((ic = getopt(argc, argv, "j:d:p:tTHcqv")) != -1) {
+        switch (ic) {
+        case 'j':
+            extractor.SetNumThreads((int) strtol(optarg, nil, 0));
+            break;
+        case 'd':
+            outDir = optarg;
+            break;
+        case 'p':
+            if (strcmp(optarg, "none") == 0)
+                extractor.SetPreserve(VolumeExtractor::kPreserveNone);
+            else if (strcmp(optarg, "suffix") == 0)
+                extractor.SetPreserve(VolumeExtractor::kPreserveSuffix);
+            else if (strcmp(optarg, "xattr") == 0)
+                extractor.SetPreserve(VolumeExtractor::kPreserveXattr);
+            else {
+                Usage(argv[0]);
+                exit(2);
+            }
+            break;
+        case 't':
+            extractor.SetConvertEOL(VolumeExtractor::kConvertEOLAuto);
+            break;
+        case 'T':
+            extractor.SetConvertEOL(VolumeExtractor::kConvertEOLOn);
+            break;
+        case 'H':
+            extractor.SetConvertHighASCII(VolumeExtractor::kConvertHAOff);
+            break;
+        case 'c':
+            extractor.SetDiskOrder(false);
+            break;
+        case 'q':
+            quiet = true;
+            break;
+        case 'v':
+            gVerbose = true;
+            break;
+        default:
+            Usage(argv[0]);
+            exit(2);
+        }
+    }
+    if (optind == argc) {
+        Usage(argv[0]);
+        exit(2);
+    }
+
+    Global::SetDebugMsgHandler(MsgHandler);
+    Global::AppInit();
+
+    for (int i = optind; i < argc; i++) {
+        if (Process(argv[i], outDir, &extractor, quiet) != 0)
+            result = 1;
+    }
+
+    Global::AppCleanup();
+
+    exit(result);
+}
@@ -0,0 +1,333 @@
+/*
+ * CiderPress
+ * Copyright (C) 2009 by CiderPress authors.  All Rights Reserved.
+ * See the file LICENSE for distribution terms.
+ */
+/*
+ * List or extract the contents of Binary II, ACU, and AppleSingle files.
+ *
+ * Archives are read in a single pass, so "-" reads from stdin.  Resource
+ * forks are written next to the data fork, with "_rsrc_" appended, the
+ * way CiderPress does it.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <assert.h>
+#include <sys/stat.h>
+#include "../diskimg/DiskImg.h"
+
+using namespace DiskImgLib;
+
+#define nil NULL
+
+const char* kRsrcSuffix = "_rsrc_";
+
+enum Mode { kModeList, kModeExtract, kModePipe };
+
+Mode gMode = kModeList;
+const char* gOutputDir = ".";
+bool gUseIndex = false;
+bool gVerbose = false;
+
+/*
+ * Show library messages if we were asked to.
+ */
+void
+MsgHandler(const char* file, int line, const char* msg)
+{
+    assert(file != nil);
+    assert(msg != nil);
+
+    if (gVerbose)
+        fprintf(stderr, "%s\n", msg);
+}
+
+void
+Usage(const char* argv0)
+{
+    fprintf(stderr, "Usage: %s [-l | -x | -p] [-d dir] [-i] [-v] archive ...\n",
+        argv0);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "  -l  list contents (default)\n");
+    fprintf(stderr, "  -x  extract files\n");
+    fprintf(stderr, "  -p  write data forks to stdout\n");
+    fprintf(stderr, "  -d  directory to extract into (default .)\n");
+    fprintf(stderr, "  -i  index the archive first, then read from the index\n");
+    fprintf(stderr, "  -v  show library messages\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Use \"-\" to read an archive from stdin.\n");
+}
+
+/*
+ * Write fork data to a FILE*.
+ */
+DIError
+WriteCallback(const uint8_t* buf, size_t len, void* cookie)
+{
+    FILE* fp = (FILE*) cookie;
+
+    if (fwrite(buf, 1, len, fp) != len)
+        return kDIErrWriteFailed;
+    return kDIErrNone;
+}
+
+/*
+ * Print one line of the listing.
+ */
+void
+ListEntry(const FileArchive::Entry* pEntry)
+{
+    char dateBuf[32];
+    struct tm tmbuf;
+    char lenBuf[24];
+
+    if (pEntry->modWhen != 0 && localtime_r(&pEntry->modWhen, &tmbuf) != nil)
+        strftime(dateBuf, sizeof(dateBuf), "%d-%b-%y %H:%M", &tmbuf);
+    else
+        strcpy(dateBuf, "[no date]");
+
+    if (pEntry->dataLen >= 0)
+        sprintf(lenBuf, "%lld", (long long) pEntry->dataLen);
+    else
+        strcpy(lenBuf, "?");
+
+    printf("%-36s %c $%02x/%04x %-15s %9s",
+        pEntry->pathName, pEntry->isDirectory ? 'd' : '-',
+        pEntry->fileType, pEntry->auxType, dateBuf, lenBuf);
+    if (pEntry->rsrcOffset >= 0)
+        printf(" +%lld", (long long) pEntry->rsrcLen);
+    if (pEntry->compression == FileArchive::kCompressionSqueeze)
+        printf(" (sq %lld)", (long long) pEntry->dataStoredLen);
+    else if (pEntry->compression == FileArchive::kCompressionUnknown)
+        printf(" (unknown compression)");
+    printf("\n");
+}
+
+/*
+ * Turn an archive path into something safe to create under the output
+ * directory: no absolute paths, no "..", no empty components.  Creates
+ * the intermediate directories.
+ */
+bool
+MakeOutputPath(const FileArchive::Entry* pEntry, char* pathBuf,
+    size_t pathBufLen)
+{
+    const char* src = pEntry->pathName;
+    size_t len;
+
+    len = snprintf(pathBuf, pathBufLen, "%s/", gOutputDir);
+    while (*src != '\0') {
+        const char* end = src;
+        while (*end != '\0' && *end != pEntry->fssep)
+            end++;
+
+        size_t compLen = end - src;
+        if (compLen != 0) {
+            if (len + compLen + 2 >= pathBufLen)
+                return false;
+            for (size_t i = 0; i < compLen; i++) {
+                char ch = src[i];
+                pathBuf[len++] = (ch == '/' || ch == '\0') ? '_' : ch;
+            }
+            pathBuf[len] = '\0';
+            if ((compLen == 1 && src[0] == '.') ||
+                (compLen == 2 && src[0] == '.' && src[1] == '.'))
+            {
+                pathBuf[len - 1] = '_';
+            }
+
+            /* intermediate directory */
+            if (*end != '\0') {
+                if (mkdir(pathBuf, 0755) != 0 && errno != EEXIST)
+                    return false;
+                pathBuf[len++] = '/';
+                pathBuf[len] = '\0';
+            }
+        }
+        src = (*end != '\0') ? end + 1 : end;
+    }
+
+    /* strip any trailing '/' */
+    while (len > 0 && pathBuf[len - 1] == '/')
+        pathBuf[--len] = '\0';
+    return len > strlen(gOutputDir) + 1;
+}
+
+/*
+ * Extract one fork to a file.  "index" is the index position when
+ * reading from the index, or -1 when called from inside Iterate().
+ */
+DIError
+ExtractFork(FileArchive* pArchive, long index, bool rsrcFork,
+    const char* pathName)
+{
+    DIError dierr;
+    FILE* fp;
+
+    fp = fopen(pathName, "wb");
+    if (fp == nil) {
+        fprintf(stderr, "Unable to create '%s': %s\n", pathName,
+            strerror(errno));
+        return kDIErrWriteFailed;
+    }
+
+    if (index < 0)
+        dierr = pArchive->ReadFork(rsrcFork, WriteCallback, fp);
+    else
+        dierr = pArchive->ReadIndexedFork(index, rsrcFork, WriteCallback, fp);
+
+    if (fclose(fp) != 0 && dierr == kDIErrNone)
+        dierr = kDIErrWriteFailed;
+    return dierr;
+}
+
+/*
+ * Do whatever we've been asked to do with one entry.
+ */
+DIError
+HandleEntry(FileArchive* pArchive, long index, const FileArchive::Entry* pEntry)
+{
+    char pathBuf[4096];
+    DIError dierr = kDIErrNone;
+
+    switch (gMode) {
+    case kModeList:
+        ListEntry(pEntry);
+        break;
+    case kModePipe:
+        if (pEntry->isDirectory || pEntry->dataOffset < 0)
+            break;
+        if (index < 0)
+            dierr = pArchive->ReadFork(false, WriteCallback, stdout);
+        else
+            dierr = pArchive->ReadIndexedFork(index, false, WriteCallback,
+                        stdout);
+        break;
+    case kModeExtract:
+        if (!MakeOutputPath(pEntry, pathBuf, sizeof(pathBuf) - 8)) {
+            fprintf(stderr, "Unable to make an output path for '%s'\n",
+                pEntry->pathName);
+            return kDIErrInvalidFileName;
+        }
+        printf("%s\n", pathBuf);
+        if (pEntry->isDirectory) {
+            if (mkdir(pathBuf, 0755) != 0 && errno != EEXIST)
+                dierr = kDIErrWriteFailed;
+            break;
+        }
+        if (pEntry->dataOffset >= 0)
+            dierr = ExtractFork(pArchive, index, false, pathBuf);
+        if (dierr == kDIErrNone && pEntry->rsrcOffset >= 0) {
+            strcat(pathBuf, kRsrcSuffix);
+            dierr = ExtractFork(pArchive, index, true, pathBuf);
+        }
+        break;
+    }
+
+    if (dierr != kDIErrNone) {
+        fprintf(stderr, "Failed on '%s': %s\n", pEntry->pathName,
+            DIStrError(dierr));
+    }
+    return dierr;
+}
+
+DIError
+EntryCallback(FileArchive* pArchive, const FileArchive::Entry* pEntry,
+    void* cookie)
+{
+    return HandleEntry(pArchive, -1, pEntry);
+}
+
+/*
+ * Process one archive.
+ */
+int
+Process(const char* archiveName)
+{
+    FileArchive archive;
+    DIError dierr;
+
+    if (strcmp(archiveName, "-") == 0)
+        dierr = archive.OpenStream(stdin, nil);
+    else
+        dierr = archive.Open(archiveName);
+    if (dierr != kDIErrNone) {
+        fprintf(stderr, "%s: %s\n", archiveName, DIStrError(dierr));
+        return -1;
+    }
+
+    if (gMode == kModeList) {
+        printf("%s: %s\n", archiveName,
+            FileArchive::GetFormatName(archive.GetFormat()));
+    }
+
+    if (gUseIndex) {
+        dierr = archive.BuildIndex();
+        for (long i = 0; dierr == kDIErrNone && i < archive.GetEntryCount();
+            i++)
+        {
+            dierr = HandleEntry(&archive, i, archive.GetEntry(i));
+        }
+    } else {
+        dierr = archive.Iterate(EntryCallback, nil);
+    }
+
+    if (dierr != kDIErrNone) {
+        fprintf(stderr, "%s: %s\n", archiveName, DIStrError(dierr));
+        return -1;
+    }
+    return 0;
+}
+
+int
+main(int argc, char** argv)
+{
+    int result = 0;
+    int ic;
+
+    while ((ic = getopt(argc, argv, "lxpd:iv")) != -1) {
+        switch (ic) {
+        case 'l':
+            gMode = kModeList;
+            break;
+        case 'x':
+            gMode = kModeExtract;
+            break;
+        case 'p':
+            gMode = kModePipe;
+            break;
+        case 'd':
+            gOutputDir = optarg;
+            break;
+        case 'i':
+            gUseIndex = true;
+            break;
+        case 'v':
+            gVerbose = true;
+            break;
+        default:
+            Usage(argv[0]);
+            exit(2);
+        }
+    }
+    if (optind == argc) {
+        Usage(argv[0]);
+        exit(2);
+    }
+
+    Global::SetDebugMsgHandler(MsgHandler);
+    Global::AppInit();
+
+    for (int i = optind; i < argc; i++) {
+        if (Process(argv[i]) != 0)
+            result = 1;
+    }
+
+    Global::AppCleanup();
+
+    exit(result);
+}
@@ -0,0 +1,530 @@
+/*
+ * CiderPress
+ * Copyright (C) 2009 by CiderPress authors.  All Rights Reserved.
+ * See the file LICENSE for distribution terms.
+ */
+/*
+ * Test for the Linux block-device GFD (direct I/O, readahead, and the
+ * write-back cache).
+ *
+ * With no arguments, this creates a couple of scratch files in the current
+ * directory, one that ends on a sector boundary (so O_DIRECT is used, if
+ * the filesystem has it) and one that doesn't.  Don't run it in /tmp if
+ * that's tmpfs, or you won't be testing O_DIRECT.
+ *
+ * You can also name a file or a block device, such as a loop device set
+ * up with "losetup", if you add -w.  Its contents are overwritten during
+ * the test, and put back afterward.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <assert.h>
+#include <sys/time.h>
+#include <atomic>
+#include <thread>
+#include "../diskimg/DiskImg.h"
+#include "../diskimg/TestHooks.h"
+#include "../nufxlib/NufxLib.h"
+
+using namespace DiskImgLib;
+
+#define nil NULL
+
+FILE* gLog = nil;
+pid_t gPid = getpid();
+bool gVerbose = false;
+
+/*
+ * Show library messages if we were asked to.
+ */
+void
+MsgHandler(const char* file, int line, const char* msg)
+{
+    assert(file != nil);
+    assert(msg != nil);
+
+    if (gVerbose)
+        fprintf(stderr, "%s\n", msg);
+}
+
+void
+Usage(const char* argv0)
+{
+    fprintf(stderr,
+        "Usage: %s [-v] [-n iterations] [-s seed] [-m megs] [-w file-or-device]\n",
+        argv0);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "  -n  number of random reads and writes (default 20000)\n");
+    fprintf(stderr, "  -s  random seed (default: based on the time)\n");
+    fprintf(stderr, "  -m  size of the scratch files in MB (default 3)\n");
+    fprintf(stderr, "  -v  show library messages\n");
+    fprintf(stderr, "  -w  test the named file or device (it's put back afterward)\n");
+}
+
+/*
+ * Create a scratch file full of junk.
+ */
+bool
+CreateScratch(const char* name, long length, uint32_t seed)
+{
+    FILE* fp = fopen(name, "wb");
+    uint32_t state = seed | 1;
+
+    if (fp == nil) {
+        perror(name);
+        return false;
+    }
+    for (long i = 0; i < length; i++) {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        putc((int) (state & 0xff), fp);
+    }
+    if (fclose(fp) != 0) {
+        perror(name);
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Simple xorshift generator, so the test is repeatable for a given seed.
+ */
+uint32_t
+NextRand(uint32_t* pState)
+{
+    uint32_t val = *pState;
+    val ^= val << 13;
+    val ^= val >> 17;
+    val ^= val << 5;
+    *pState = val;
+    return val;
+}
+
+/*
+ * Pick an offset and length for a random transfer.  We like to land on
+ * track boundaries and the end of the device, since that's where the
+ * bugs are.
+ */
+void
+PickTransfer(uint32_t* pState, di_off_t devLen, size_t maxLen,
+    di_off_t* pOffset, size_t* pLength)
+{
+    const int kTrack = 64 * 1024;       // same as GFDBlockDevice::kTrackSize
+    di_off_t offset;
+    size_t length;
+
+    switch (NextRand(pState) % 4) {
+    case 0:
+        length = 1 + NextRand(pState) % 600;
+        break;
+    case 1:
+        length = 512 * (1 + NextRand(pState) % 8);
+        break;
+    default:
+        length = 1 + NextRand(pState) % maxLen;
+        break;
+    }
+
+    switch (NextRand(pState) % 4) {
+    case 0:
+        offset = devLen - (di_off_t) (NextRand(pState) % (maxLen + 1));
+        break;
+    case 1:
+        offset = (di_off_t) (NextRand(pState) % (devLen / kTrack + 1))
+                    * kTrack;
+        offset += (di_off_t) (NextRand(pState) % 1024) - 512;
+        break;
+    default:
+        offset = (((di_off_t) NextRand(pState) << 32) |
+                    NextRand(pState)) % (devLen + 1);
+        break;
+    }
+    if (offset < 0)
+        offset = 0;
+    if (offset > devLen)
+        offset = devLen;
+
+    *pOffset = offset;
+    *pLength = length;
+}
+
+/*
+ * Read or write all of a file or device the simple way, without going
+ * through the library.  If "buf" is nil, just get the length.
+ */
+DIError
+PlainTransfer(const char* pathName, bool doWrite, uint8_t* buf,
+    di_off_t* pLength)
+{
+    DIError dierr = kDIErrNone;
+    int fd;
+
+    fd = open(pathName, doWrite ? O_WRONLY : O_RDONLY);
+    if (fd < 0) {
+        perror(pathName);
+        return kDIErrGenericIO;
+    }
+    if (buf == nil) {
+        *pLength = lseek(fd, 0, SEEK_END);
+        if (*pLength < 0)
+            dierr = kDIErrGenericIO;
+    } else {
+        for (di_off_t offset = 0; offset < *pLength; ) {
+            ssize_t actual;
+            if (doWrite)
+                actual = pwrite(fd, buf + offset, *pLength - offset, offset);
+            else
+                actual = pread(fd, buf + offset, *pLength - offset, offset);
+            if (actual <= 0) {
+                perror(pathName);
+                dierr = doWrite ? kDIErrWriteFailed : kDIErrReadFailed;
+                break;
+            }
+            offset += actual;
+        }
+        if (dierr == kDIErrNone && doWrite && fsync(fd) != 0)
+            dierr = kDIErrWriteFailed;
+    }
+    close(fd);
+    return dierr;
+}
+
+/*
+ * Exercise the block-device GFD on "pathName", which may be a regular file
+ * or a block device (e.g. a loop device).
+ *
+ * We keep a copy of the device in memory and apply every write to both.
+ * Reads must match the copy, both during the test and after the device
+ * is closed and read back the plain way.  Part of the test reads from
+ * several threads at once.  Prefetch requests are mixed in, so the
+ * prefetch threads race with the reads and writes.
+ *
+ * The original contents are written back at the end, pass or fail.
+ */
+DIError
+TestBlockDevice(const char* pathName, long iterations, uint32_t seed)
+{
+    const size_t kMaxXfer = 3 * 64 * 1024 + 1000;
+    const di_off_t kMaxDevLen = 256 * 1024 * 1024;
+    const int kNumThreads = 4;
+    TestHooks::BlockDevice dev;
+    uint8_t* original = nil;
+    uint8_t* shadow = nil;
+    uint8_t* xferBuf = nil;
+    uint8_t* readBuf = nil;
+    uint32_t state = seed != 0 ? seed : 1;
+    di_off_t devLen;
+    DIError dierr, restoreErr;
+    long iter;
+
+    /* read the original contents the simple way */
+    dierr = PlainTransfer(pathName, false, nil, &devLen);
+    if (dierr != kDIErrNone)
+        return dierr;
+    if (devLen <= 0 || devLen > kMaxDevLen) {
+        printf("  '%s' has unsuitable length %lld\n", pathName,
+            (long long) devLen);
+        return kDIErrInvalidArg;
+    }
+    original = new uint8_t[(size_t) devLen];
+    dierr = PlainTransfer(pathName, false, original, &devLen);
+    if (dierr != kDIErrNone) {
+        delete[] original;
+        return dierr;
+    }
+    shadow = new uint8_t[(size_t) devLen];
+    memcpy(shadow, original, (size_t) devLen);
+
+    xferBuf = new uint8_t[kMaxXfer];
+    readBuf = new uint8_t[kMaxXfer];
+
+    dierr = dev.Open(pathName, false);
+    if (dierr != kDIErrNone)
+        goto bail;
+    if (dev.Seek(0, kSeekEnd) != kDIErrNone || dev.Tell() != devLen) {
+        printf("  length mismatch (%lld vs. %lld)\n",
+            (long long) dev.Tell(), (long long) devLen);
+        dierr = kDIErrInternal;
+        goto bail;
+    }
+    if (gVerbose) {
+        printf("  '%s' len=%lld direct=%d\n", pathName, (long long) devLen,
+            dev.GetDirectIO());
+    }
+
+    for (iter = 0; iter < iterations; iter++) {
+        di_off_t offset;
+        size_t length, actual, expectLen;
+        bool fits;
+        int op = NextRand(&state) % 9;
+
+        PickTransfer(&state, devLen, kMaxXfer, &offset, &length);
+        fits = (offset + (di_off_t) length <= devLen);
+        expectLen = fits ? length : (size_t) (devLen - offset);
+
+        switch (op) {
+        case 0:
+        case 1:
+        case 2:
+            /* exact read */
+            dierr = dev.ReadAt(offset, readBuf, length);
+            if (!fits) {
+                if (dierr != kDIErrDataUnderrun) {
+                    printf("  read past end gave %d (iter=%ld)\n",
+                        dierr, iter);
+                    dierr = kDIErrInternal;
+                    goto bail;
+                }
+                break;
+            }
+            if (dierr != kDIErrNone)
+                goto bail;
+            if (memcmp(readBuf, shadow + offset, length) != 0) {
+                printf("  read mismatch at %lld+%lu (iter=%ld)\n",
+                    (long long) offset, (unsigned long) length, iter);
+                dierr = kDIErrInternal;
+                goto bail;
+            }
+            break;
+        case 3:
+            /* partial read through the file position */
+            dierr = dev.Seek(offset, kSeekSet);
+            if (dierr == kDIErrNone)
+                dierr = dev.Read(readBuf, length, &actual);
+            if (dierr != kDIErrNone)
+                goto bail;
+            if (actual != expectLen || dev.Tell() != offset + (di_off_t) actual ||
+                memcmp(readBuf, shadow + offset, actual) != 0)
+            {
+                printf("  partial read mismatch at %lld+%lu (iter=%ld)\n",
+                    (long long) offset, (unsigned long) length, iter);
+                dierr = kDIErrInternal;
+                goto bail;
+            }
+            break;
+        case 4:
+        case 5:
+        case 6:
+            /* write, sometimes through the file position */
+            for (size_t i = 0; i < length; i++)
+                xferBuf[i] = (uint8_t) NextRand(&state);
+            if (op == 6) {
+                dierr = dev.Seek(offset, kSeekSet);
+                if (dierr == kDIErrNone)
+                    dierr = dev.Write(xferBuf, length, &actual);
+            } else {
+                dierr = dev.WriteAt(offset, xferBuf, length);
+                actual = length;
+            }
+            if (!fits && op != 6) {
+                if (dierr != kDIErrDataOverrun) {
+                    printf("  write past end gave %d (iter=%ld)\n",
+                        dierr, iter);
+                    dierr = kDIErrInternal;
+                    goto bail;
+                }
+                break;
+            }
+            if (dierr != kDIErrNone)
+                goto bail;
+            if (actual != expectLen) {
+                printf("  partial write mismatch (iter=%ld)\n", iter);
+                dierr = kDIErrInternal;
+                goto bail;
+            }
+            memcpy(shadow + offset, xferBuf, actual);
+            break;
+        case 7:
+            if ((NextRand(&state) & 0x07) == 0) {
+                dierr = dev.Flush();
+                if (dierr != kDIErrNone)
+                    goto bail;
+            }
+            break;
+        case 8:
+            /* let the prefetch threads race with what comes next */
+            dev.Prefetch(offset, (di_off_t) length * 4);
+            break;
+        }
+    }
+
+    /*
+     * Read the whole thing from several threads at once, each in its own
+     * order, so they fight over the cache.
+     */
+    {
+        std::atomic<bool> threadFailed(false);
+        std::thread threads[kNumThreads];
+        for (int t = 0; t < kNumThreads; t++) {
+            uint32_t threadSeed = NextRand(&state) | 1;
+            threads[t] = std::thread([=, &dev, &threadFailed]() {
+                uint32_t tstate = threadSeed;
+                uint8_t* tbuf = new uint8_t[kMaxXfer];
+                long count = iterations / kNumThreads + 1;
+                for (long i = 0; i < count && !threadFailed; i++) {
+                    di_off_t toff;
+                    size_t tlen;
+                    PickTransfer(&tstate, devLen, kMaxXfer, &toff, &tlen);
+                    if ((NextRand(&tstate) & 0x03) == 0)
+                        dev.Prefetch(toff, (di_off_t) tlen * 4);
+                    if (toff + (di_off_t) tlen > devLen)
+                        tlen = (size_t) (devLen - toff);
+                    if (dev.ReadAt(toff, tbuf, tlen) != kDIErrNone ||
+                        memcmp(tbuf, shadow + toff, tlen) != 0)
+                    {
+                        printf("  threaded read mismatch at %lld+%lu\n",
+                            (long long) toff, (unsigned long) tlen);
+                        threadFailed = true;
+                    }
+                }
+                delete[] tbuf;
+            });
+        }
+        for (int t = 0; t < kNumThreads; t++)
+            threads[t].join();
+        if (threadFailed) {
+            dierr = kDIErrInternal;
+            goto bail;
+        }
+    }
+
+    /*
+     * Flush, and check that another reader sees everything.  Then close,
+     * and check again.
+     */
+    for (int pass = 0; pass < 2; pass++) {
+        if (pass == 0)
+            dierr = dev.Flush();
+        else
+            dierr = dev.Close();
+        if (dierr != kDIErrNone)
+            goto bail;
+
+        uint8_t* check = new uint8_t[(size_t) devLen];
+        dierr = PlainTransfer(pathName, false, check, &devLen);
+        if (dierr == kDIErrNone) {
+            for (di_off_t offset = 0; offset < devLen; offset++) {
+                if (check[offset] != shadow[offset]) {
+                    printf("  %s data mismatch at %lld\n",
+                        pass == 0 ? "flushed" : "closed", (long long) offset);
+                    dierr = kDIErrInternal;
+                    break;
+                }
+            }
+        }
+        delete[] check;
+        if (dierr != kDIErrNone)
+            goto bail;
+    }
+
+bail:
+    dev.Close();
+    restoreErr = PlainTransfer(pathName, true, original, &devLen);
+    if (restoreErr != kDIErrNone) {
+        printf("  unable to restore original contents of '%s'\n", pathName);
+        if (dierr == kDIErrNone)
+            dierr = restoreErr;
+    }
+    delete[] original;
+    delete[] shadow;
+    delete[] xferBuf;
+    delete[] readBuf;
+    return dierr;
+}
+
+/*
+ * Run the test on one file or device, and show how long it took.
+ */
+DIError
+RunTest(const char* pathName, long iterations, uint32_t seed)
+{
+    struct timeval start, end;
+    DIError dierr;
+
+    gettimeofday(&start, nil);
+    dierr = TestBlockDevice(pathName, iterations, seed);
+    gettimeofday(&end, nil);
+
+    printf("  %-24s %s (%.3f sec)\n", pathName,
+        dierr == kDIErrNone ? "okay" : DIStrError(dierr),
+        (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6);
+    return dierr;
+}
+
+int
+main(int argc, char** argv)
+{
+    const char* kScratchAligned = "blkdevtest-a.tmp";
+    const char* kScratchOdd = "blkdevtest-b.tmp";
+    const char* target = nil;
+    long iterations = 20000;
+    long megs = 3;
+    uint32_t seed = (uint32_t) time(nil) ^ (uint32_t) gPid;
+    DIError dierr;
+    int ic;
+
+    while ((ic = getopt(argc, argv, "m:n:s:vw:")) != -1) {
+        switch (ic) {
+        case 'm':
+            megs = strtol(optarg, nil, 0);
+            break;
+        case 'n':
+            iterations = strtol(optarg, nil, 0);
+            break;
+        case 's':
+            seed = (uint32_t) strtoul(optarg, nil, 0);
+            break;
+        case 'v':
+            gVerbose = true;
+            break;
+        case 'w':
+            target = optarg;
+            break;
+        default:
+            Usage(argv[0]);
+            exit(2);
+        }
+    }
+    if (optind != argc || iterations <= 0 || megs <= 0 || megs > 256) {
+        Usage(argv[0]);
+        exit(2);
+    }
+
+    Global::SetDebugMsgHandler(MsgHandler);
+    Global::AppInit();
+
+    printf("Testing %ld reads and writes, seed=%u\n", iterations, seed);
+    if (target != nil) {
+        dierr = RunTest(target, iterations, seed);
+    } else {
+        long length = megs * 1024 * 1024;
+
+        /* the odd-sized one also leaves a short track at the end */
+        if (!CreateScratch(kScratchAligned, length, seed) ||
+            !CreateScratch(kScratchOdd, length + 1234, seed + 1))
+        {
+            dierr = kDIErrWriteFailed;
+        } else {
+            dierr = RunTest(kScratchAligned, iterations, seed);
+            if (dierr == kDIErrNone)
+                dierr = RunTest(kScratchOdd, iterations, seed);
+        }
+        unlink(kScratchAligned);
+        unlink(kScratchOdd);
+    }
+
+    if (dierr == kDIErrNone)
+        printf("All results match\n");
+    else
+        printf("FAILED: %s (rerun with -s %u to repeat)\n",
+            DIStrError(dierr), seed);
+
+    Global::AppCleanup();
+
+    exit(dierr == kDIErrNone ? 0 : 1);
+}
@@ -0,0 +1,304 @@
+/*
+ * CiderPress
+ * Copyright (C) 2009 by CiderPress authors.  All Rights Reserved.
+ * See the file LICENSE for distribution terms.
+ */
+/*
+ * Check that a kInitCatalogOnly scan agrees with a kInitFull scan.
+ *
+ * Each image is opened twice.  The catalog attributes of every file (name,
+ * types, access, dates, lengths) are compared first; reading them must not
+ * make the catalog-only DiskFS finish its deferred work.  Then everything
+ * the deferred work fills in is compared too: file quality, sparse
+ * lengths, the free block count, the damage flag, the volume usage map,
+ * and the sub-volumes.
+ *
+ * Files the full scan finds damaged are shown with a length of zero, but
+ * the catalog can't know that yet, so their lengths are only compared
+ * once the deferred work is done.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <assert.h>
+#include <string>
+#include <vector>
+#include <set>
+#include "../diskimg/DiskImg.h"
+#include "../nufxlib/NufxLib.h"
+
+using namespace DiskImgLib;
+
+#define nil NULL
+
+bool gVerbose = false;
+
+/*
+ * Show library messages if we were asked to.
+ */
+void
+MsgHandler(const char* file, int line, const char* msg)
+{
+    assert(file != nil);
+    assert(msg != nil);
+
+    if (gVerbose)
+        fprintf(stderr, "%s\n", msg);
+}
+
+void
+Usage(const char* argv0)
+{
+    fprintf(stderr, "Usage: %s [-v] image ...\n", argv0);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "  -v  show library messages\n");
+}
+
+/*
+ * Describe the catalog entries: what a listing shows.  The lengths of
+ * files in "pSkipLengths" are left out.
+ */
+void
+DescribeCatalog(DiskFS* pDiskFS, std::vector<std::string>* pLines,
+    const std::set<std::string>* pSkipLengths = nil)
+{
+    char buf[512];
+
+    pLines->clear();
+    snprintf(buf, sizeof(buf), "vol '%s' blocks=%ld", pDiskFS->GetVolumeID(),
+        pDiskFS->GetFSNumBlocks());
+    pLines->push_back(buf);
+
+    A2File* pFile = pDiskFS->GetNextFile(nil);
+    for ( ; pFile != nil; pFile = pDiskFS->GetNextFile(pFile)) {
+        snprintf(buf, sizeof(buf),
+            "'%s' dir=%d type=%08x aux=%08x acc=%02x create=%ld mod=%ld",
+            pFile->GetPathName(), pFile->IsDirectory(),
+            pFile->GetFileType(), pFile->GetAuxType(), pFile->GetAccess(),
+            (long) pFile->GetCreateWhen(), (long) pFile->GetModWhen());
+        std::string line(buf);
+        if (pSkipLengths == nil ||
+            pSkipLengths->count(pFile->GetPathName()) == 0)
+        {
+            snprintf(buf, sizeof(buf), " data=%ld rsrc=%ld",
+                (long) pFile->GetDataLength(), (long) pFile->GetRsrcLength());
+            line += buf;
+        }
+        pLines->push_back(line);
+    }
+}
+
+/*
+ * Describe the things the deferred work figures out.  Sub-volumes are
+ * described recursively, catalog and all.
+ */
+void
+DescribeDeferred(DiskFS* pDiskFS, std::vector<std::string>* pLines)
+{
+    char buf[512];
+    long totalUnits, freeUnits;
+    int unitSize;
+
+    pLines->clear();
+    if (pDiskFS->GetFreeSpaceCount(&totalUnits, &freeUnits, &unitSize) !=
+        kDIErrNone)
+    {
+        totalUnits = freeUnits = -1;
+        unitSize = 0;
+    }
+    snprintf(buf, sizeof(buf), "damaged=%d free=%ld/%ld*%d",
+        pDiskFS->GetFSDamaged(), freeUnits, totalUnits, unitSize);
+    pLines->push_back(buf);
+
+    A2File* pFile = pDiskFS->GetNextFile(nil);
+    for ( ; pFile != nil; pFile = pDiskFS->GetNextFile(pFile)) {
+        snprintf(buf, sizeof(buf), "'%s' q=%d sparse=%ld/%ld",
+            pFile->GetPathName(), pFile->GetQuality(),
+            (long) pFile->GetDataSparseLength(),
+            (long) pFile->GetRsrcSparseLength());
+        pLines->push_back(buf);
+    }
+
+    const DiskFS::VolumeUsage* pUsage = pDiskFS->GetVolumeUsageMap();
+    if (pUsage != nil) {
+        std::string map;
+        for (long chunk = 0; chunk < pUsage->GetNumChunks(); chunk++) {
+            DiskFS::VolumeUsage::ChunkState cstate;
+            if (pUsage->GetChunkState(chunk, &cstate) != kDIErrNone)
+                break;
+            snprintf(buf, sizeof(buf), "%d%d%d ", cstate.isUsed,
+                cstate.isMarkedUsed, cstate.isUsed ? (int) cstate.purpose : 0);
+            map += buf;
+        }
+        pLines->push_back("usage " + map);
+    }
+
+    DiskFS::SubVolume* pSubVol = pDiskFS->GetNextSubVolume(nil);
+    for ( ; pSubVol != nil; pSubVol = pDiskFS->GetNextSubVolume(pSubVol)) {
+        std::vector<std::string> subCatalog, subDeferred;
+        DescribeCatalog(pSubVol->GetDiskFS(), &subCatalog);
+        DescribeDeferred(pSubVol->GetDiskFS(), &subDeferred);
+        pLines->push_back("subvol:");
+        pLines->insert(pLines->end(), subCatalog.begin(), subCatalog.end());
+        pLines->insert(pLines->end(), subDeferred.begin(), subDeferred.end());
+    }
+}
+
+/*
+ * Open an image and scan it.  Returns nil on failure.
+ */
+DiskFS*
+OpenVolume(const char* imageName, DiskImg* pDiskImg, DiskFS::InitMode mode)
+{
+    DiskFS* pDiskFS;
+    DIError dierr;
+
+    dierr = pDiskImg->OpenImage(imageName, '/', true);
+    if (dierr == kDIErrNone)
+        dierr = pDiskImg->AnalyzeImage();
+    if (dierr != kDIErrNone ||
+        pDiskImg->GetFSFormat() == DiskImg::kFormatUnknown ||
+        pDiskImg->GetSectorOrder() == DiskImg::kSectorOrderUnknown)
+    {
+        fprintf(stderr, "ERROR: unable to identify '%s'\n", imageName);
+        return nil;
+    }
+
+    pDiskFS = pDiskImg->OpenAppropriateDiskFS();
+    if (pDiskFS == nil)
+        return nil;
+    pDiskFS->SetScanForSubVolumes(DiskFS::kScanSubEnabled);
+    dierr = pDiskFS->Initialize(pDiskImg, mode);
+    if (dierr != kDIErrNone) {
+        fprintf(stderr, "ERROR: unable to read '%s': %s\n", imageName,
+            DIStrError(dierr));
+        delete pDiskFS;
+        return nil;
+    }
+    return pDiskFS;
+}
+
+/*
+ * Report the first difference between two descriptions.  Returns false
+ * if there was one.
+ */
+bool
+Compare(const char* imageName, const char* what,
+    const std::vector<std::string>& full,
+    const std::vector<std::string>& catalog)
+{
+    for (size_t i = 0; i < full.size() || i < catalog.size(); i++) {
+        const char* want = i < full.size() ? full[i].c_str() : "(none)";
+        const char* have = i < catalog.size() ? catalog[i].c_str() : "(none)";
+        if (strcmp(want, have) != 0) {
+            printf("FAILED: %s: %s differs\n", imageName, what);
+            printf("   full:    %.200s\n   catalog: %.200s\n", want, have);
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * Compare the two kinds of scan on one image.
+ *
+ * Returns 0 on success.
+ */
+int
+CheckImage(const char* imageName)
+{
+    DiskImg fullImg, catalogImg;
+    DiskFS* pFullFS;
+    DiskFS* pCatalogFS = nil;
+    std::vector<std::string> fullLines, catalogLines;
+    std::set<std::string> damaged;
+    bool deferred;
+    int result = -1;
+
+    pFullFS = OpenVolume(imageName, &fullImg, DiskFS::kInitFull);
+    if (pFullFS == nil)
+        goto bail;
+    pCatalogFS = OpenVolume(imageName, &catalogImg, DiskFS::kInitCatalogOnly);
+    if (pCatalogFS == nil)
+        goto bail;
+
+    /* filesystems that don't support it just do a full scan */
+    deferred = pCatalogFS->GetInitDeferred();
+
+    for (A2File* pFile = pFullFS->GetNextFile(nil); pFile != nil;
+        pFile = pFullFS->GetNextFile(pFile))
+    {
+        if (pFile->GetQuality() == A2File::kQualityDamaged)
+            damaged.insert(pFile->GetPathName());
+    }
+
+    DescribeCatalog(pFullFS, &fullLines, &damaged);
+    DescribeCatalog(pCatalogFS, &catalogLines, &damaged);
+    if (!Compare(imageName, "catalog", fullLines, catalogLines))
+        goto bail;
+    if (deferred && !pCatalogFS->GetInitDeferred()) {
+        printf("FAILED: %s: reading the catalog did the deferred work\n",
+            imageName);
+        goto bail;
+    }
+
+    DescribeDeferred(pFullFS, &fullLines);
+    DescribeDeferred(pCatalogFS, &catalogLines);
+    if (!Compare(imageName, "deferred info", fullLines, catalogLines))
+        goto bail;
+    if (pCatalogFS->GetInitDeferred()) {
+        printf("FAILED: %s: deferred work never done\n", imageName);
+        goto bail;
+    }
+
+    /* now everything in the catalog should agree */
+    DescribeCatalog(pFullFS, &fullLines);
+    DescribeCatalog(pCatalogFS, &catalogLines);
+    if (!Compare(imageName, "completed catalog", fullLines, catalogLines))
+        goto bail;
+
+    printf("OK: %s: %ld files, %ld damaged%s\n", imageName,
+        pFullFS->GetFileCount(), (long) damaged.size(),
+        deferred ? "" : " (full scan only)");
+    result = 0;
+
+bail:
+    delete pCatalogFS;
+    delete pFullFS;
+    return result;
+}
+
+int
+main(int argc, char** argv)
+{
+    int result = 0;
+    int ic;
+
+    while ((ic = getopt(argc, argv, "v")) != -1) {
+        switch (ic) {
+        case 'v':
+            gVerbose = true;
+            break;
+        default:
+            Usage(argv[0]);
+            exit(2);
+        }
+    }
+    if (optind == argc) {
+        Usage(argv[0]);
+        exit(2);
+    }
+
+    Global::SetDebugMsgHandler(MsgHandler);
+    Global::AppInit();
+
+    for (int i = optind; i < argc; i++) {
+        if (CheckImage(argv[i]) != 0)
+            result = 1;
+    }
+
+    Global::AppCleanup();
+
+    exit(result);
+}
@@ -0,0 +1,1207 @@
+/*
+ * CiderPress
+ * Copyright (C) 2009 by CiderPress authors.  All Rights Reserved.
+ * See the file LICENSE for distribution terms.
+ */
+/*
+ * Build a content-addressed index of the blocks and files in a collection
+ * of disk images, and report duplicate images, shared-block ratios, and
+ * duplicate files.
+ *
+ * Images are hashed in logical (filesystem) order by a pool of worker
+ * threads.  The resulting block and file records are collected by a
+ * memory-bounded sorter that spills sorted runs to temp files, and the
+ * runs are merged once at the end.  The merged output can be saved as an
+ * index file, which can be handed back in on a later run so that images
+ * that haven't changed are not hashed again.
+ */
+#include <stdlib.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <limits.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+#include "../diskimg/DiskImg.h"
+#include "../nufxlib/NufxLib.h"
+#include "StringArray.h"
+
+using namespace DiskImgLib;
+
+#define nil NULL
+#define NELEM(x) (sizeof(x) / sizeof((x)[0]))
+#define MAX_PATH_LEN 1024
+
+/*
+ * One block or sector.
+ */
+struct BlockRec {
+    uint64_t    hash;
+    uint32_t    image;
+    uint32_t    chunk;
+
+    bool operator<(const BlockRec& rhs) const {
+        if (hash != rhs.hash)
+            return hash < rhs.hash;
+        if (image != rhs.image)
+            return image < rhs.image;
+        return chunk < rhs.chunk;
+    }
+};
+
+/*
+ * One fork of one file.  The high bit of "file" is set for resource forks.
+ */
+struct FileRec {
+    uint64_t    hash;
+    uint64_t    length;
+    uint32_t    image;
+    uint32_t    file;
+
+    bool operator<(const FileRec& rhs) const {
+        if (hash != rhs.hash)
+            return hash < rhs.hash;
+        if (length != rhs.length)
+            return length < rhs.length;
+        if (image != rhs.image)
+            return image < rhs.image;
+        return file < rhs.file;
+    }
+};
+static const uint32_t kRsrcForkFlag = 0x80000000;
+
+/*
+ * Per-image state.
+ */
+struct ImageInfo {
+    enum {
+        kFlagHashed     = 0x01,     // hashed successfully
+        kFlagFromIndex  = 0x02,     // loaded from previous index
+        kFlagStale      = 0x04,     // from index, but file has changed
+    };
+
+    char*       pathName;
+    uint64_t    fileSize;
+    int64_t     modWhen;
+    uint64_t    imageHash;
+    uint32_t    numChunks;
+    uint32_t    numUnreadable;
+    uint32_t    numFiles;
+    uint16_t    chunkSize;
+    uint16_t    flags;
+    FILE*       namesFp;            // where the file names live
+    uint64_t    namesOffset;        // start of names in namesFp
+    uint32_t    sharedChunks;       // computed while merging
+    uint32_t    emptyChunks;        // computed while merging
+};
+
+/*
+ * On-disk index layout.  Everything is stored in host byte order; the
+ * byte order marker lets us reject an index written on a different host.
+ */
+static const char kIndexMagic[8] = { 'C','P','D','E','D','U','P','1' };
+static const uint32_t kIndexVersion = 1;
+static const uint32_t kIndexByteOrder = 0x01020304;
+
+struct IndexHeader {
+    char        magic[8];
+    uint32_t    version;
+    uint32_t    byteOrder;
+    uint32_t    numImages;
+    uint32_t    reserved;
+    uint64_t    numBlockRecs;
+    uint64_t    blockOffset;
+    uint64_t    numFileRecs;
+    uint64_t    fileOffset;
+    uint64_t    imageOffset;
+    uint64_t    namesOffset;
+};
+
+struct IndexImageEntry {
+    uint64_t    imageHash;
+    uint64_t    fileSize;
+    int64_t     modWhen;
+    uint64_t    namesOffset;        // relative to start of names section
+    uint32_t    numChunks;
+    uint32_t    numUnreadable;
+    uint32_t    numFiles;
+    uint16_t    chunkSize;
+    uint16_t    pathLen;            // path bytes follow the entry
+};
+
+/*
+ * Options.
+ */
+struct Options {
+    int         numThreads;
+    long        memLimitMB;
+    bool        hashFiles;
+    bool        verbose;
+    double      sharedThreshold;
+    const char* inIndex;
+    const char* outIndex;
+} gOpts = { 0, 256, true, false, 0.5, nil, nil };
+
+/*
+ * Globals.
+ */
+std::vector<ImageInfo> gImages;
+std::map<std::string, uint32_t> gIndexPaths;    // path --> image, from index
+uint32_t gFirstNewImage = 0;
+
+FILE* gNamesFp = nil;               // temp file with names of hashed files
+FILE* gInIndexFp = nil;
+IndexHeader gInHeader;
+
+pthread_mutex_t gJobLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t gSortLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t gNamesLock = PTHREAD_MUTEX_INITIALIZER;
+uint32_t gNextJob = 0;
+
+struct Stats {
+    long    numImages;
+    long    numReused;
+    long    numFailed;
+} gStats = { 0, 0, 0 };
+
+
+/*
+ * Memory-bounded external sorter.
+ *
+ * Records are accumulated in memory until the budget is reached, then
+ * sorted and written to a temp file as a "run".  At the end we do a k-way
+ * merge across all runs (plus whatever is still in memory, plus any
+ * pre-sorted runs from an existing index file).
+ */
+template <typename Rec>
+class RunSorter {
+public:
+    RunSorter(size_t maxRecs) : fMaxRecs(maxRecs), fNumSpilled(0) {
+        if (fMaxRecs < kRunBufRecs)
+            fMaxRecs = kRunBufRecs;
+    }
+    ~RunSorter(void) {
+        for (size_t i = 0; i < fRuns.size(); i++) {
+            if (fRuns[i].ownsFp && fRuns[i].fp != nil)
+                fclose(fRuns[i].fp);
+            delete[] fRuns[i].buf;
+        }
+    }
+
+    /* add records; caller is responsible for locking */
+    bool Add(const Rec* recs, size_t count) {
+        for (size_t i = 0; i < count; i++) {
+            if (fMem.size() >= fMaxRecs) {
+                if (!Spill())
+                    return false;
+            }
+            fMem.push_back(recs[i]);
+        }
+        return true;
+    }
+
+    /* add a run that's already sorted and sitting in a file */
+    void AddSortedRun(FILE* fp, uint64_t offset, uint64_t count) {
+        Run run;
+        run.fp = fp;
+        run.ownsFp = false;
+        run.offset = offset;
+        run.remaining = count;
+        run.buf = nil;
+        fRuns.push_back(run);
+    }
+
+    long GetNumSpilled(void) const { return fNumSpilled; }
+
+    /* prepare for calls to Next() */
+    bool StartMerge(void) {
+        std::sort(fMem.begin(), fMem.end());
+        fMemIdx = 0;
+        for (size_t i = 0; i < fRuns.size(); i++) {
+            fRuns[i].buf = new Rec[kRunBufRecs];
+            fRuns[i].bufCount = fRuns[i].bufIdx = 0;
+            if (Refill(&fRuns[i]))
+                fHeap.push_back(HeapEnt(fRuns[i].buf[0], (int) i));
+        }
+        if (!fMem.empty())
+            fHeap.push_back(HeapEnt(fMem[0], -1));
+        std::make_heap(fHeap.begin(), fHeap.end());
+        return true;
+    }
+
+    /* get the next record in sorted order; returns false at the end */
+    bool Next(Rec* pRec) {
+        if (fHeap.empty())
+            return false;
+        std::pop_heap(fHeap.begin(), fHeap.end());
+        HeapEnt ent = fHeap.back();
+        fHeap.pop_back();
+        *pRec = ent.rec;
+
+        if (ent.run < 0) {
+            if (++fMemIdx < fMem.size()) {
+                fHeap.push_back(HeapEnt(fMem[fMemIdx], -1));
+                std::push_heap(fHeap.begin(), fHeap.end());
+            }
+        } else {
+            Run* pRun = &fRuns[ent.run];
+            pRun->bufIdx++;
+            if (pRun->bufIdx < pRun->bufCount || Refill(pRun)) {
+                fHeap.push_back(HeapEnt(pRun->buf[pRun->bufIdx], ent.run));
+                std::push_heap(fHeap.begin(), fHeap.end());
+            }
+        }
+        return true;
+    }
+
+private:
+    enum { kRunBufRecs = 8192 };
+
+    struct Run {
+        FILE*       fp;
+        bool        ownsFp;
+        uint64_t    offset;         // file offset of next unread record
+        uint64_t    remaining;      // #of records not yet read from file
+        Rec*        buf;
+        size_t      bufCount;
+        size_t      bufIdx;
+    };
+    /* heap entries are inverted so std::make_heap gives us a min-heap */
+    struct HeapEnt {
+        HeapEnt(const Rec& r, int n) : rec(r), run(n) {}
+        bool operator<(const HeapEnt& rhs) const { return rhs.rec < rec; }
+        Rec     rec;
+        int     run;                // -1 for in-memory records
+    };
+
+    bool Spill(void) {
+        std::sort(fMem.begin(), fMem.end());
+        FILE* fp = tmpfile();
+        if (fp == nil) {
+            fprintf(stderr, "ERROR: unable to create temp file: %s\n",
+                strerror(errno));
+            return false;
+        }
+        if (fwrite(&fMem[0], sizeof(Rec), fMem.size(), fp) != fMem.size()) {
+            fprintf(stderr, "ERROR: failed writing temp file: %s\n",
+                strerror(errno));
+            fclose(fp);
+            return false;
+        }
+        Run run;
+        run.fp = fp;
+        run.ownsFp = true;
+        run.offset = 0;
+        run.remaining = fMem.size();
+        run.buf = nil;
+        fRuns.push_back(run);
+        fNumSpilled += fMem.size();
+        fMem.clear();
+        return true;
+    }
+
+    bool Refill(Run* pRun) {
+        if (pRun->remaining == 0)
+            return false;
+        size_t want = kRunBufRecs;
+        if (want > pRun->remaining)
+            want = (size_t) pRun->remaining;
+        if (fseeko(pRun->fp, pRun->offset, SEEK_SET) != 0 ||
+            fread(pRun->buf, sizeof(Rec), want, pRun->fp) != want)
+        {
+            fprintf(stderr, "ERROR: failed reading sorted run\n");
+            pRun->remaining = 0;
+            return false;
+        }
+        pRun->offset += want * sizeof(Rec);
+        pRun->remaining -= want;
+        pRun->bufCount = want;
+        pRun->bufIdx = 0;
+        return true;
+    }
+
+    size_t              fMaxRecs;
+    long                fNumSpilled;
+    std::vector<Rec>    fMem;
+    size_t              fMemIdx;
+    std::vector<Run>    fRuns;
+    std::vector<HeapEnt> fHeap;
+};
+
+RunSorter<BlockRec>* gpBlockSorter = nil;
+RunSorter<FileRec>* gpFileSorter = nil;
+
+
+/*
+ * Show usage info.
+ */
+void
+Usage(const char* argv0)
+{
+    fprintf(stderr,
+        "Usage: %s [-j threads] [-m megabytes] [-i old.idx] [-o new.idx]\n"
+        "          [-r ratio] [-n] [-v] file-or-dir ...\n", argv0);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "  -j  number of hashing threads (default: #of CPUs)\n");
+    fprintf(stderr, "  -m  memory budget for index records (default 256MB)\n");
+    fprintf(stderr, "  -i  previous index; unchanged images are not re-read\n");
+    fprintf(stderr, "  -o  write the index to this file\n");
+    fprintf(stderr, "  -r  report images sharing at least this fraction of\n");
+    fprintf(stderr, "      their blocks with other images (default 0.5)\n");
+    fprintf(stderr, "  -n  don't hash individual files\n");
+    fprintf(stderr, "  -v  verbose; show per-image details\n");
+}
+
+/*
+ * Handle a debug message from the DiskImg library.
+ */
+/*static*/ void
+MsgHandler(const char* file, int line, const char* msg)
+{
+    assert(file != nil);
+    assert(msg != nil);
+}
+
+/*
+ * Handle a global error message from the NufxLib library by shoving it
+ * through the DiskImgLib message function.
+ */
+NuResult
+NufxErrorMsgHandler(NuArchive* /*pArchive*/, void* vErrorMessage)
+{
+    const NuErrorMessage* pErrorMessage = (const NuErrorMessage*) vErrorMessage;
+
+    if (pErrorMessage->isDebug) {
+        Global::PrintDebugMsg(pErrorMessage->file, pErrorMessage->line,
+            "<nufxlib> [D] %s\n", pErrorMessage->message);
+    } else {
+        Global::PrintDebugMsg(pErrorMessage->file, pErrorMessage->line,
+            "<nufxlib> %s\n", pErrorMessage->message);
+    }
+
+    return kNuOK;
+}
+
+
+/*
+ * ===========================================================================
+ *      Previous index
+ * ===========================================================================
+ */
+
+/*
+ * Open an existing index and load the image table.  The block and file
+ * sections are left in the file, and fed to the sorters as pre-sorted runs.
+ *
+ * Returns 0 on success.
+ */
+int
+LoadIndex(const char* fileName)
+{
+    gInIndexFp = fopen(fileName, "rb");
+    if (gInIndexFp == nil) {
+        fprintf(stderr, "ERROR: unable to open index '%s': %s\n",
+            fileName, strerror(errno));
+        return -1;
+    }
+
+    if (fread(&gInHeader, sizeof(gInHeader), 1, gInIndexFp) != 1 ||
+        memcmp(gInHeader.magic, kIndexMagic, sizeof(kIndexMagic)) != 0 ||
+        gInHeader.version != kIndexVersion ||
+        gInHeader.byteOrder != kIndexByteOrder)
+    {
+        fprintf(stderr, "ERROR: '%s' is not a compatible index\n", fileName);
+        return -1;
+    }
+
+    if (fseeko(gInIndexFp, gInHeader.imageOffset, SEEK_SET) != 0)
+        return -1;
+
+    for (uint32_t i = 0; i < gInHeader.numImages; i++) {
+        IndexImageEntry ent;
+        ImageInfo info;
+
+        if (fread(&ent, sizeof(ent), 1, gInIndexFp) != 1) {
+            fprintf(stderr, "ERROR: truncated index '%s'\n", fileName);
+            return -1;
+        }
+        memset(&info, 0, sizeof(info));
+        info.pathName = new char[ent.pathLen + 1];
+        if (fread(info.pathName, ent.pathLen, 1, gInIndexFp) != 1) {
+            fprintf(stderr, "ERROR: truncated index '%s'\n", fileName);
+            delete[] info.pathName;
+            return -1;
+        }
+        info.pathName[ent.pathLen] = '\0';
+        info.fileSize = ent.fileSize;
+        info.modWhen = ent.modWhen;
+        info.imageHash = ent.imageHash;
+        info.numChunks = ent.numChunks;
+        info.numUnreadable = ent.numUnreadable;
+        info.numFiles = ent.numFiles;
+        info.chunkSize = ent.chunkSize;
+        info.flags = ImageInfo::kFlagHashed | ImageInfo::kFlagFromIndex;
+        info.namesFp = gInIndexFp;
+        info.namesOffset = gInHeader.namesOffset + ent.namesOffset;
+
+        gIndexPaths[info.pathName] = (uint32_t) gImages.size();
+        gImages.push_back(info);
+    }
+
+    gpBlockSorter->AddSortedRun(gInIndexFp, gInHeader.blockOffset,
+        gInHeader.numBlockRecs);
+    gpFileSorter->AddSortedRun(gInIndexFp, gInHeader.fileOffset,
+        gInHeader.numFileRecs);
+
+    printf("Loaded %u images from '%s'\n", gInHeader.numImages, fileName);
+    return 0;
+}
+
+
+/*
+ * ===========================================================================
+ *      Gather the list of images
+ * ===========================================================================
+ */
+
+/* forward decl */
+int AddPath(const char* pathName);
+
+/*
+ * Add the contents of a directory, in sorted order.
+ */
+int
+AddDirectory(const char* dirName)
+{
+    StringArray strArray;
+    DIR* dirp;
+    struct dirent* entry;
+    char nbuf[MAX_PATH_LEN];
+    int len;
+
+    dirp = opendir(dirName);
+    if (dirp == nil) {
+        fprintf(stderr, "ERROR: unable to open directory '%s'\n", dirName);
+        return -1;
+    }
+
+    while ((entry = readdir(dirp)) != nil) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+            continue;
+
+        len = strlen(dirName);
+        if (len + (int) strlen(entry->d_name) + 2 > MAX_PATH_LEN) {
+            fprintf(stderr, "ERROR: Filename exceeds %d bytes: %s/%s\n",
+                MAX_PATH_LEN, dirName, entry->d_name);
+            continue;
+        }
+
+        strcpy(nbuf, dirName);
+        if (dirName[len-1] != '/')
+            nbuf[len++] = '/';
+        strcpy(nbuf+len, entry->d_name);
+        strArray.Add(nbuf);
+    }
+    closedir(dirp);
+
+    strArray.Sort(StringArray::CmpAscendingAlpha);
+    for (int i = 0; i < strArray.GetCount(); i++)
+        (void) AddPath(strArray.GetEntry(i));
+
+    return 0;
+}
+
+/*
+ * Add a file or directory to the job list.  Files that match an entry in
+ * the previous index (same path, size, and modification date) are skipped.
+ */
+int
+AddPath(const char* pathName)
+{
+    struct stat sb;
+
+    if (stat(pathName, &sb) != 0) {
+        fprintf(stderr, "ERROR: couldn't stat '%s': %s\n", pathName,
+            strerror(errno));
+        return -1;
+    }
+    if (S_ISDIR(sb.st_mode))
+        return AddDirectory(pathName);
+    if (!S_ISREG(sb.st_mode))
+        return 0;
+
+    std::map<std::string, uint32_t>::iterator it = gIndexPaths.find(pathName);
+    if (it != gIndexPaths.end()) {
+        ImageInfo* pOld = &gImages[it->second];
+        if (pOld->fileSize == (uint64_t) sb.st_size &&
+            pOld->modWhen == (int64_t) sb.st_mtime)
+        {
+            gStats.numReused++;
+            return 0;
+        }
+        pOld->flags |= ImageInfo::kFlagStale;
+    }
+
+    ImageInfo info;
+    memset(&info, 0, sizeof(info));
+    info.pathName = new char[strlen(pathName) + 1];
+    strcpy(info.pathName, pathName);
+    info.fileSize = sb.st_size;
+    info.modWhen = sb.st_mtime;
+    gImages.push_back(info);
+    return 0;
+}
+
+
+/*
+ * ===========================================================================
+ *      Hashing
+ * ===========================================================================
+ */
+
+/*
+ * Per-thread scratch state.
+ */
+struct WorkerState {
+    std::vector<BlockRec>   blockRecs;
+    std::vector<FileRec>    fileRecs;
+    std::string             names;      // null-terminated names, back to back
+    uint32_t                numFiles;
+};
+
+/*
+ * Hash all files in a DiskFS, recursing into sub-volumes.
+ */
+void
+HashDiskFSFiles(DiskFS* pDiskFS, const char* volName, uint32_t imageIdx,
+    WorkerState* pState)
+{
+    A2File* pFile;
+
+    for (pFile = pDiskFS->GetNextFile(nil); pFile != nil;
+        pFile = pDiskFS->GetNextFile(pFile))
+    {
+        if (pFile->IsDirectory() || pFile->IsVolumeDirectory())
+            continue;
+        if (pFile->GetQuality() == A2File::kQualityDamaged)
+            continue;
+
+        uint32_t fileIdx = pState->numFiles++;
+        if (volName[0] != '\0') {
+            pState->names += '_';
+            pState->names += volName;
+            pState->names += ':';
+        }
+        pState->names += pFile->GetPathName();
+        pState->names += '\0';
+
+        FileRec rec;
+        rec.image = imageIdx;
+        if (ContentHash::HashFile(pFile, false, &rec.hash,
+                (di_off_t*) &rec.length) == kDIErrNone)
+        {
+            rec.file = fileIdx;
+            pState->fileRecs.push_back(rec);
+        }
+        if (pFile->GetRsrcLength() >= 0 &&
+            ContentHash::HashFile(pFile, true, &rec.hash,
+                (di_off_t*) &rec.length) == kDIErrNone)
+        {
+            rec.file = fileIdx | kRsrcForkFlag;
+            pState->fileRecs.push_back(rec);
+        }
+    }
+
+    DiskFS::SubVolume* pSubVol = pDiskFS->GetNextSubVolume(nil);
+    while (pSubVol != nil) {
+        const char* subVolName = pSubVol->GetDiskFS()->GetVolumeName();
+        if (subVolName == nil)
+            subVolName = "+++";
+        HashDiskFSFiles(pSubVol->GetDiskFS(), subVolName, imageIdx, pState);
+        pSubVol = pDiskFS->GetNextSubVolume(pSubVol);
+    }
+}
+
+/*
+ * Open one image, hash its blocks or sectors, and optionally its files.
+ *
+ * Returns 0 on success.
+ */
+int
+HashOneImage(uint32_t imageIdx, WorkerState* pState)
+{
+    ImageInfo* pInfo = &gImages[imageIdx];
+    DIError dierr;
+    DiskImg diskImg;
+    DiskFS* pDiskFS = nil;
+    uint64_t* hashes = nil;
+    int chunkSize;
+    long numChunks, unreadable;
+    int result = -1;
+
+    pState->blockRecs.clear();
+    pState->fileRecs.clear();
+    pState->names.clear();
+    pState->numFiles = 0;
+
+    dierr = diskImg.OpenImage(pInfo->pathName, '/', true);
+    if (dierr != kDIErrNone)
+        goto bail;
+    dierr = diskImg.AnalyzeImage();
+    if (dierr != kDIErrNone)
+        goto bail;
+
+    numChunks = ContentHash::GetChunkCount(&diskImg, &chunkSize);
+    if (numChunks == 0)
+        goto bail;
+
+    hashes = new uint64_t[numChunks];
+    dierr = ContentHash::HashChunks(&diskImg, hashes, numChunks, &unreadable);
+    if (dierr != kDIErrNone)
+        goto bail;
+
+    pInfo->numChunks = numChunks;
+    pInfo->numUnreadable = unreadable;
+    pInfo->chunkSize = chunkSize;
+    pInfo->imageHash = ContentHash::HashImage(hashes, numChunks);
+
+    pState->blockRecs.resize(numChunks);
+    for (long i = 0; i < numChunks; i++) {
+        pState->blockRecs[i].hash = hashes[i];
+        pState->blockRecs[i].image = imageIdx;
+        pState->blockRecs[i].chunk = i;
+    }
+
+    if (gOpts.hashFiles && diskImg.GetFSFormat() != DiskImg::kFormatUnknown) {
+        pDiskFS = diskImg.OpenAppropriateDiskFS();
+        if (pDiskFS != nil) {
+            pDiskFS->SetScanForSubVolumes(DiskFS::kScanSubEnabled);
+            if (pDiskFS->Initialize(&diskImg, DiskFS::kInitFull) == kDIErrNone)
+                HashDiskFSFiles(pDiskFS, "", imageIdx, pState);
+        }
+    }
+    pInfo->numFiles = pState->numFiles;
+
+    pthread_mutex_lock(&gNamesLock);
+    if (fseeko(gNamesFp, 0, SEEK_END) == 0) {
+        pInfo->namesFp = gNamesFp;
+        pInfo->namesOffset = ftello(gNamesFp);
+        fwrite(pState->names.data(), 1, pState->names.size(), gNamesFp);
+    }
+    pthread_mutex_unlock(&gNamesLock);
+
+    pthread_mutex_lock(&gSortLock);
+    if (gpBlockSorter->Add(&pState->blockRecs[0], pState->blockRecs.size()) &&
+        (pState->fileRecs.empty() ||
+         gpFileSorter->Add(&pState->fileRecs[0], pState->fileRecs.size())))
+    {
+        pInfo->flags |= ImageInfo::kFlagHashed;
+        result = 0;
+    }
+    pthread_mutex_unlock(&gSortLock);
+
+bail:
+    delete pDiskFS;
+    delete[] hashes;
+    return result;
+}
+
+/*
+ * Worker thread main loop.  Grab the next image off the list until
+ * they're all gone.
+ */
+void*
+WorkerThread(void* /*arg*/)
+{
+    WorkerState state;
+
+    while (true) {
+        uint32_t idx;
+
+        pthread_mutex_lock(&gJobLock);
+        idx = gNextJob++;
+        pthread_mutex_unlock(&gJobLock);
+
+        if (idx >= gImages.size())
+            break;
+
+        if (HashOneImage(idx, &state) != 0) {
+            pthread_mutex_lock(&gJobLock);
+            gStats.numFailed++;
+            pthread_mutex_unlock(&gJobLock);
+            if (gOpts.verbose)
+                fprintf(stderr, "Unable to hash '%s'\n", gImages[idx].pathName);
+        }
+    }
+
+    return nil;
+}
+
+
+/*
+ * ===========================================================================
+ *      Reporting and index output
+ * ===========================================================================
+ */
+
+/*
+ * Returns "true" if records for this image should be kept.
+ */
+static inline bool
+IsLive(uint32_t image)
+{
+    return image < gImages.size() &&
+        (gImages[image].flags & (ImageInfo::kFlagHashed|ImageInfo::kFlagStale))
+            == ImageInfo::kFlagHashed;
+}
+
+/*
+ * Find the name of file N in an image.
+ */
+std::string
+GetFileName(const ImageInfo* pInfo, uint32_t fileIdx)
+{
+    std::string name;
+    int ch;
+
+    if (pInfo->namesFp == nil ||
+        fseeko(pInfo->namesFp, pInfo->namesOffset, SEEK_SET) != 0)
+    {
+        return "<unknown>";
+    }
+    while (fileIdx != 0 && (ch = getc(pInfo->namesFp)) != EOF) {
+        if (ch == '\0')
+            fileIdx--;
+    }
+    while ((ch = getc(pInfo->namesFp)) != EOF && ch != '\0')
+        name += (char) ch;
+    return name;
+}
+
+/*
+ * Merge the block records, tallying up shared blocks, and optionally
+ * write them to the new index.  "newIds" maps image numbers to their
+ * position in the new index.
+ */
+void
+MergeBlocks(FILE* outFp, const std::vector<uint32_t>& newIds,
+    uint64_t* pNumWritten)
+{
+    const uint64_t zeroHash256 = ContentHash::GetZeroChunkHash(kSectorSize);
+    const uint64_t zeroHash512 = ContentHash::GetZeroChunkHash(kBlockSize);
+    std::vector<BlockRec> group;
+    uint64_t totalChunks = 0, uniqueChunks = 0, zeroChunks = 0;
+    uint64_t unreadableChunks = 0, sharedChunks = 0;
+    BlockRec rec;
+    bool more;
+
+    *pNumWritten = 0;
+    gpBlockSorter->StartMerge();
+    more = gpBlockSorter->Next(&rec);
+    while (more) {
+        group.clear();
+        uint64_t hash = rec.hash;
+        while (more && rec.hash == hash) {
+            if (IsLive(rec.image))
+                group.push_back(rec);
+            more = gpBlockSorter->Next(&rec);
+        }
+        if (group.empty())
+            continue;
+
+        if (outFp != nil) {
+            for (size_t i = 0; i < group.size(); i++) {
+                BlockRec outRec = group[i];
+                outRec.image = newIds[outRec.image];
+                fwrite(&outRec, sizeof(outRec), 1, outFp);
+            }
+            *pNumWritten += group.size();
+        }
+
+        totalChunks += group.size();
+        if (hash == ContentHash::kUnreadableChunk ||
+            hash == zeroHash256 || hash == zeroHash512)
+        {
+            if (hash == ContentHash::kUnreadableChunk)
+                unreadableChunks += group.size();
+            else
+                zeroChunks += group.size();
+            for (size_t i = 0; i < group.size(); i++)
+                gImages[group[i].image].emptyChunks++;
+            continue;
+        }
+        uniqueChunks++;
+
+        /* records are sorted by image, so distinct images are adjacent */
+        if (group.front().image != group.back().image) {
+            sharedChunks += group.size();
+            for (size_t i = 0; i < group.size(); i++)
+                gImages[group[i].image].sharedChunks++;
+        }
+    }
+
+    uint64_t dataChunks = totalChunks - zeroChunks - unreadableChunks;
+    printf("Blocks/sectors: %llu total, %llu empty, %llu unreadable\n",
+        (unsigned long long) totalChunks, (unsigned long long) zeroChunks,
+        (unsigned long long) unreadableChunks);
+    printf("  %llu non-empty, %llu unique (%.1f%%), %llu shared across images\n",
+        (unsigned long long) dataChunks, (unsigned long long) uniqueChunks,
+        dataChunks == 0 ? 0.0 : uniqueChunks * 100.0 / dataChunks,
+        (unsigned long long) sharedChunks);
+}
+
+/*
+ * Report images with identical contents, and images that share most of
+ * their blocks with other images.
+ */
+void
+ReportImages(void)
+{
+    std::vector<uint32_t> order;
+
+    for (uint32_t i = 0; i < gImages.size(); i++) {
+        if (IsLive(i))
+            order.push_back(i);
+    }
+
+    struct ByHash {
+        bool operator()(uint32_t a, uint32_t b) const {
+            const ImageInfo& ia = gImages[a];
+            const ImageInfo& ib = gImages[b];
+            if (ia.imageHash != ib.imageHash)
+                return ia.imageHash < ib.imageHash;
+            if (ia.chunkSize != ib.chunkSize)
+                return ia.chunkSize < ib.chunkSize;
+            return a < b;
+        }
+    };
+    std::sort(order.begin(), order.end(), ByHash());
+
+    long numGroups = 0, numDupImages = 0;
+    printf("\nDuplicate images:\n");
+    for (size_t i = 0; i < order.size(); ) {
+        size_t j = i + 1;
+        while (j < order.size() &&
+            gImages[order[j]].imageHash == gImages[order[i]].imageHash &&
+            gImages[order[j]].chunkSize == gImages[order[i]].chunkSize)
+        {
+            j++;
+        }
+        if (j - i > 1) {
+            numGroups++;
+            numDupImages += j - i - 1;
+            printf("  %016llx (%u x %u bytes)\n",
+                (unsigned long long) gImages[order[i]].imageHash,
+                gImages[order[i]].numChunks, gImages[order[i]].chunkSize);
+            for (size_t k = i; k < j; k++)
+                printf("    %s\n", gImages[order[k]].pathName);
+        }
+        i = j;
+    }
+    printf("  %ld groups, %ld redundant images\n", numGroups, numDupImages);
+
+    printf("\nImages sharing %.0f%% or more of their blocks:\n",
+        gOpts.sharedThreshold * 100.0);
+    for (uint32_t i = 0; i < gImages.size(); i++) {
+        /* empty and unreadable blocks don't count either way */
+        uint32_t dataChunks = gImages[i].numChunks - gImages[i].emptyChunks;
+        if (!IsLive(i) || dataChunks == 0)
+            continue;
+        double ratio = (double) gImages[i].sharedChunks / dataChunks;
+        if (ratio >= gOpts.sharedThreshold || gOpts.verbose) {
+            printf("  %5.1f%%  %s\n", ratio * 100.0, gImages[i].pathName);
+        }
+    }
+}
+
+/*
+ * Merge the file records, reporting groups of identical files, and
+ * optionally write them to the new index.
+ */
+void
+MergeFiles(FILE* outFp, const std::vector<uint32_t>& newIds,
+    uint64_t* pNumWritten)
+{
+    std::vector<FileRec> group;
+    long numGroups = 0, numDupFiles = 0;
+    uint64_t wastedBytes = 0;
+    FileRec rec;
+    bool more;
+
+    *pNumWritten = 0;
+    printf("\nDuplicate files:\n");
+
+    gpFileSorter->StartMerge();
+    more = gpFileSorter->Next(&rec);
+    while (more) {
+        group.clear();
+        uint64_t hash = rec.hash;
+        uint64_t length = rec.length;
+        while (more && rec.hash == hash && rec.length == length) {
+            if (IsLive(rec.image))
+                group.push_back(rec);
+            more = gpFileSorter->Next(&rec);
+        }
+        if (group.empty())
+            continue;
+
+        if (outFp != nil) {
+            for (size_t i = 0; i < group.size(); i++) {
+                FileRec outRec = group[i];
+                outRec.image = newIds[outRec.image];
+                fwrite(&outRec, sizeof(outRec), 1, outFp);
+            }
+            *pNumWritten += group.size();
+        }
+
+        if (group.size() < 2 || length == 0)
+            continue;
+
+        numGroups++;
+        numDupFiles += group.size() - 1;
+        wastedBytes += length * (group.size() - 1);
+        if (!gOpts.verbose && numGroups > 1000)
+            continue;
+
+        printf("  %016llx %llu bytes, %d copies\n",
+            (unsigned long long) hash, (unsigned long long) length,
+            (int) group.size());
+        for (size_t i = 0; i < group.size(); i++) {
+            const ImageInfo* pInfo = &gImages[group[i].image];
+            std::string name = GetFileName(pInfo,
+                                    group[i].file & ~kRsrcForkFlag);
+            printf("    %s: %s%s\n", pInfo->pathName, name.c_str(),
+                (group[i].file & kRsrcForkFlag) ? " (rsrc)" : "");
+        }
+    }
+    if (!gOpts.verbose && numGroups > 1000)
+        printf("  (only the first 1000 groups shown; use -v to see all)\n");
+    printf("  %ld groups, %ld redundant copies, %llu bytes\n",
+        numGroups, numDupFiles, (unsigned long long) wastedBytes);
+}
+
+/*
+ * Copy the names for one image into the output file.
+ */
+static bool
+CopyNames(const ImageInfo* pInfo, FILE* outFp)
+{
+    uint32_t remaining = pInfo->numFiles;
+    int ch;
+
+    if (remaining == 0)
+        return true;
+    if (fseeko(pInfo->namesFp, pInfo->namesOffset, SEEK_SET) != 0)
+        return false;
+    while (remaining != 0 && (ch = getc(pInfo->namesFp)) != EOF) {
+        putc(ch, outFp);
+        if (ch == '\0')
+            remaining--;
+    }
+    return remaining == 0;
+}
+
+/*
+ * Merge everything, print the report, and write the new index.
+ *
+ * Returns 0 on success.
+ */
+int
+MergeAndReport(void)
+{
+    IndexHeader hdr;
+    std::vector<uint32_t> newIds(gImages.size(), 0);
+    FILE* outFp = nil;
+    uint32_t numLive = 0;
+
+    for (uint32_t i = 0; i < gImages.size(); i++) {
+        if (IsLive(i))
+            newIds[i] = numLive++;
+    }
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, kIndexMagic, sizeof(hdr.magic));
+    hdr.version = kIndexVersion;
+    hdr.byteOrder = kIndexByteOrder;
+    hdr.numImages = numLive;
+
+    if (gOpts.outIndex != nil) {
+        outFp = fopen(gOpts.outIndex, "wb");
+        if (outFp == nil) {
+            fprintf(stderr, "ERROR: unable to create '%s': %s\n",
+                gOpts.outIndex, strerror(errno));
+            return -1;
+        }
+        fwrite(&hdr, sizeof(hdr), 1, outFp);    // placeholder
+        hdr.blockOffset = ftello(outFp);
+    }
+
+    printf("\n");
+    MergeBlocks(outFp, newIds, &hdr.numBlockRecs);
+    ReportImages();
+
+    if (outFp != nil)
+        hdr.fileOffset = ftello(outFp);
+    MergeFiles(outFp, newIds, &hdr.numFileRecs);
+
+    if (outFp == nil)
+        return 0;
+
+    /* image table, with names offsets relative to the names section */
+    hdr.imageOffset = ftello(outFp);
+    for (uint32_t i = 0; i < gImages.size(); i++) {
+        if (!IsLive(i))
+            continue;
+        const ImageInfo* pInfo = &gImages[i];
+        IndexImageEntry ent;
+
+        memset(&ent, 0, sizeof(ent));
+        ent.imageHash = pInfo->imageHash;
+        ent.fileSize = pInfo->fileSize;
+        ent.modWhen = pInfo->modWhen;
+        ent.namesOffset = 0;        // filled in below
+        ent.numChunks = pInfo->numChunks;
+        ent.numUnreadable = pInfo->numUnreadable;
+        ent.numFiles = pInfo->numFiles;
+        ent.chunkSize = pInfo->chunkSize;
+        ent.pathLen = (uint16_t) strlen(pInfo->pathName);
+        fwrite(&ent, sizeof(ent), 1, outFp);
+        fwrite(pInfo->pathName, ent.pathLen, 1, outFp);
+    }
+
+    /*
+     * Write the names section.  We didn't know the sizes in advance, so
+     * go back and fix up the image table afterward.
+     */
+    hdr.namesOffset = ftello(outFp);
+    std::vector<uint64_t> nameStarts;
+    for (uint32_t i = 0; i < gImages.size(); i++) {
+        if (!IsLive(i))
+            continue;
+        nameStarts.push_back(ftello(outFp) - hdr.namesOffset);
+        if (!CopyNames(&gImages[i], outFp)) {
+            fprintf(stderr, "ERROR: lost file names for '%s'\n",
+                gImages[i].pathName);
+        }
+    }
+
+    uint64_t entOffset = hdr.imageOffset;
+    size_t liveIdx = 0;
+    for (uint32_t i = 0; i < gImages.size(); i++) {
+        if (!IsLive(i))
+            continue;
+        uint64_t val = nameStarts[liveIdx++];
+        fseeko(outFp, entOffset + offsetof(IndexImageEntry, namesOffset),
+            SEEK_SET);
+        fwrite(&val, sizeof(val), 1, outFp);
+        entOffset += sizeof(IndexImageEntry) + strlen(gImages[i].pathName);
+    }
+
+    fseeko(outFp, 0, SEEK_SET);
+    fwrite(&hdr, sizeof(hdr), 1, outFp);
+    if (fclose(outFp) != 0) {
+        fprintf(stderr, "ERROR: failed writing '%s': %s\n",
+            gOpts.outIndex, strerror(errno));
+        return -1;
+    }
+    printf("\nWrote index with %u images to '%s'\n", numLive, gOpts.outIndex);
+    return 0;
+}
+
+
+/*
+ * Process args.
+ */
+int
+main(int argc, char** argv)
+{
+    const char* argv0 = argv[0];
+    int ch;
+
+    while ((ch = getopt(argc, argv, "j:m:i:o:r:nv")) != -1) {
+        switch (ch) {
+        case 'j':   gOpts.numThreads = atoi(optarg);        break;
+        case 'm':   gOpts.memLimitMB = atol(optarg);        break;
+        case 'i':   gOpts.inIndex = optarg;                 break;
+        case 'o':   gOpts.outIndex = optarg;                break;
+        case 'r':   gOpts.sharedThreshold = atof(optarg);   break;
+        case 'n':   gOpts.hashFiles = false;                break;
+        case 'v':   gOpts.verbose = true;                   break;
+        default:
+            Usage(argv0);
+            exit(2);
+        }
+    }
+    argc -= optind;
+    argv += optind;
+    if (argc < 1 || gOpts.memLimitMB <= 0) {
+        Usage(argv0);
+        exit(2);
+    }
+    if (gOpts.numThreads <= 0) {
+        gOpts.numThreads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+        if (gOpts.numThreads <= 0)
+            gOpts.numThreads = 1;
+    }
+
+    Global::SetDebugMsgHandler(MsgHandler);
+    Global::AppInit();
+
+    NuSetGlobalErrorMessageHandler(NufxErrorMsgHandler);
+
+    /* three quarters of the budget for blocks, the rest for files */
+    size_t budget = (size_t) gOpts.memLimitMB * 1024 * 1024;
+    gpBlockSorter = new RunSorter<BlockRec>(budget / 4 * 3 / sizeof(BlockRec));
+    gpFileSorter = new RunSorter<FileRec>(budget / 4 / sizeof(FileRec));
+
+    gNamesFp = tmpfile();
+    if (gNamesFp == nil) {
+        fprintf(stderr, "ERROR: unable to create temp file: %s\n",
+            strerror(errno));
+        exit(1);
+    }
+
+    if (gOpts.inIndex != nil && LoadIndex(gOpts.inIndex) != 0)
+        exit(1);
+    gFirstNewImage = gNextJob = (uint32_t) gImages.size();
+
+    while (argc--)
+        AddPath(*argv++);
+
+    gStats.numImages = gImages.size() - gFirstNewImage;
+    printf("Hashing %ld images with %d threads (%ld unchanged)\n",
+        gStats.numImages, gOpts.numThreads, gStats.numReused);
+
+    time_t start = time(NULL);
+    std::vector<pthread_t> threads(gOpts.numThreads);
+    for (int i = 0; i < gOpts.numThreads; i++)
+        pthread_create(&threads[i], nil, WorkerThread, nil);
+    for (int i = 0; i < gOpts.numThreads; i++)
+        pthread_join(threads[i], nil);
+
+    printf("Hashed in %ld seconds; %ld not hashed, %ld records spilled\n",
+        (long) (time(NULL) - start), gStats.numFailed,
+        gpBlockSorter->GetNumSpilled() + gpFileSorter->GetNumSpilled());
+
+    int result = MergeAndReport();
+
+    delete gpBlockSorter;
+    delete gpFileSorter;
+    fclose(gNamesFp);
+    if (gInIndexFp != nil)
+        fclose(gInIndexFp);
+    for (size_t i = 0; i < gImages.size(); i++)
+        delete[] gImages[i].pathName;
+
+    Global::AppCleanup();
+    exit(result == 0 ? 0 : 1);
+}
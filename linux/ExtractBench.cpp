@@ -0,0 +1,318 @@
+/*
+ * CiderPress
+ * Copyright (C) 2009 by CiderPress authors.  All Rights Reserved.
+ * See the file LICENSE for distribution terms.
+ */
+/*
+ * Benchmark for VolumeExtractor.
+ *
+ * Extracts each image over and over into a scratch directory, with
+ * different numbers of worker threads, reading in catalog order and in
+ * disk order.  The best time for each setup is shown.  The extracted
+ * tree is hashed each time, so we can tell that every setup produced the
+ * same files.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <ftw.h>
+#include <sys/stat.h>
+#include <assert.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include "../diskimg/DiskImg.h"
+#include "../nufxlib/NufxLib.h"
+
+using namespace DiskImgLib;
+
+#define nil NULL
+#define MAX_PATH_LEN 1024
+
+bool gVerbose = false;
+
+/* nftw callbacks can't take an argument */
+std::vector<std::string>* gTreeEntries = nil;
+size_t gTreeRootLen = 0;
+
+/*
+ * Show library messages if we were asked to.
+ */
+void
+MsgHandler(const char* file, int line, const char* msg)
+{
+    assert(file != nil);
+    assert(msg != nil);
+
+    if (gVerbose)
+        fprintf(stderr, "%s\n", msg);
+}
+
+void
+Usage(const char* argv0)
+{
+    fprintf(stderr, "Usage: %s [-v] [-t] [-n passes] [-j threads] [-d dir] image ...\n",
+        argv0);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "  -n  runs of each setup; the best is shown (default 3)\n");
+    fprintf(stderr, "  -j  comma-separated thread counts (default 1,2,4,8)\n");
+    fprintf(stderr, "  -d  where to make the scratch directory (default .)\n");
+    fprintf(stderr, "  -t  convert EOL in text files\n");
+    fprintf(stderr, "  -v  show library messages\n");
+}
+
+/*
+ * Remove one entry of the scratch tree.  Called children-first.
+ */
+int
+RemoveEntry(const char* path, const struct stat* pSb, int flag,
+    struct FTW* pFtw)
+{
+    if (pFtw->level == 0)
+        return 0;       // keep the scratch directory itself
+    if (remove(path) != 0) {
+        perror(path);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Add one entry of the extracted tree to gTreeEntries: the path relative
+ * to the root, the size, and a hash of the contents.
+ */
+int
+HashEntry(const char* path, const struct stat* pSb, int flag,
+    struct FTW* pFtw)
+{
+    char buf[64];
+    uint64_t hash = 0;
+
+    if (flag == FTW_F) {
+        FILE* fp = fopen(path, "rb");
+        if (fp == nil) {
+            perror(path);
+            return -1;
+        }
+        uint8_t data[65536];
+        size_t actual;
+        while ((actual = fread(data, 1, sizeof(data), fp)) > 0)
+            hash = ContentHash::Hash64(data, actual, hash);
+        fclose(fp);
+    }
+
+    snprintf(buf, sizeof(buf), " %lld %016llx", (long long) pSb->st_size,
+        (unsigned long long) hash);
+    gTreeEntries->push_back(std::string(path + gTreeRootLen) +
+        (flag == FTW_D ? "/" : buf));
+    return 0;
+}
+
+/*
+ * Hash everything under "root".
+ */
+uint64_t
+HashTree(const char* root)
+{
+    std::vector<std::string> entries;
+    uint64_t hash = 0;
+
+    gTreeEntries = &entries;
+    gTreeRootLen = strlen(root);
+    if (nftw(root, HashEntry, 16, FTW_PHYS) != 0)
+        return 0;
+    gTreeEntries = nil;
+
+    std::sort(entries.begin(), entries.end());
+    for (size_t i = 0; i < entries.size(); i++) {
+        hash = ContentHash::Hash64(entries[i].c_str(),
+                    entries[i].length() + 1, hash);
+    }
+    return hash;
+}
+
+/*
+ * Open an image and its filesystem.  Returns nil on failure.
+ */
+DiskFS*
+OpenVolume(const char* imageName, DiskImg* pDiskImg)
+{
+    DiskFS* pDiskFS;
+    DIError dierr;
+
+    dierr = pDiskImg->OpenImage(imageName, '/', true);
+    if (dierr == kDIErrNone)
+        dierr = pDiskImg->AnalyzeImage();
+    if (dierr != kDIErrNone ||
+        pDiskImg->GetFSFormat() == DiskImg::kFormatUnknown ||
+        pDiskImg->GetSectorOrder() == DiskImg::kSectorOrderUnknown)
+    {
+        fprintf(stderr, "ERROR: unable to identify '%s'\n", imageName);
+        return nil;
+    }
+
+    pDiskFS = pDiskImg->OpenAppropriateDiskFS();
+    if (pDiskFS == nil)
+        return nil;
+    pDiskFS->SetScanForSubVolumes(DiskFS::kScanSubEnabled);
+    dierr = pDiskFS->Initialize(pDiskImg, DiskFS::kInitFull);
+    if (dierr != kDIErrNone) {
+        fprintf(stderr, "ERROR: unable to read '%s': %s\n", imageName,
+            DIStrError(dierr));
+        delete pDiskFS;
+        return nil;
+    }
+    return pDiskFS;
+}
+
+/*
+ * Run every setup on one image.
+ *
+ * Returns 0 on success.
+ */
+int
+BenchImage(const char* imageName, const char* scratchDir, int passes,
+    const std::vector<int>& threadCounts, bool convert)
+{
+    DiskImg diskImg;
+    DiskFS* pDiskFS;
+    uint64_t firstHash = 0;
+    bool first = true;
+    int result = 0;
+
+    pDiskFS = OpenVolume(imageName, &diskImg);
+    if (pDiskFS == nil)
+        return -1;
+
+    printf("%s\n", imageName);
+    printf(" threads  order    forks      MB    best-ms     MB/s   forks/s\n");
+
+    for (size_t ti = 0; ti < threadCounts.size(); ti++) {
+        for (int diskOrder = 0; diskOrder < 2; diskOrder++) {
+            VolumeExtractor extractor;
+            uint64_t best = 0;
+            uint64_t hash = 0;
+
+            extractor.SetNumThreads(threadCounts[ti]);
+            extractor.SetDiskOrder(diskOrder != 0);
+            if (convert)
+                extractor.SetConvertEOL(VolumeExtractor::kConvertEOLAuto);
+
+            for (int pass = 0; pass < passes; pass++) {
+                uint64_t startWhen, elapsed;
+
+                startWhen = DiskImgStats::GetMonotonicMicros();
+                DIError dierr = extractor.Extract(pDiskFS, scratchDir);
+                elapsed = DiskImgStats::GetMonotonicMicros() - startWhen;
+                if (dierr != kDIErrNone || extractor.GetNumFailed() != 0) {
+                    fprintf(stderr, "ERROR: extraction failed (%s, %ld files)\n",
+                        DIStrError(dierr), extractor.GetNumFailed());
+                    result = -1;
+                }
+                if (pass == 0 || elapsed < best)
+                    best = elapsed;
+
+                if (pass == 0)
+                    hash = HashTree(scratchDir);
+                nftw(scratchDir, RemoveEntry, 16, FTW_DEPTH | FTW_PHYS);
+            }
+
+            double megs = extractor.GetNumBytes() / (1024.0 * 1024.0);
+            double secs = best / 1000000.0;
+            printf(" %7d  %-7s %6ld %7.1f %10.1f %8.1f %9.0f\n",
+                threadCounts[ti], diskOrder ? "disk" : "catalog",
+                extractor.GetNumForks(), megs, best / 1000.0,
+                secs > 0 ? megs / secs : 0.0,
+                secs > 0 ? extractor.GetNumForks() / secs : 0.0);
+
+            if (first) {
+                firstHash = hash;
+                first = false;
+            } else if (hash != firstHash) {
+                printf("FAILED: extracted files differ\n");
+                result = -1;
+            }
+        }
+    }
+
+    delete pDiskFS;
+    return result;
+}
+
+int
+main(int argc, char** argv)
+{
+    const char* threadList = "1,2,4,8";
+    const char* parentDir = ".";
+    std::vector<int> threadCounts;
+    char scratchDir[MAX_PATH_LEN];
+    bool convert = false;
+    int passes = 3;
+    int result = 0;
+    int ic;
+
+    while ((ic = getopt(argc, argv, "n:j:d:tv")) != -1) {
+        switch (ic) {
+        case 'n':
+            passes = (int) strtol(optarg, nil, 0);
+            break;
+        case 'j':
+            threadList = optarg;
+            break;
+        case 'd':
+            parentDir = optarg;
+            break;
+        case 't':
+            convert = true;
+            break;
+        case 'v':
+            gVerbose = true;
+            break;
+        default:
+            Usage(argv[0]);
+            exit(2);
+        }
+    }
+    if (optind == argc || passes <= 0) {
+        Usage(argv[0]);
+        exit(2);
+    }
+
+    const char* cp = threadList;
+    while (*cp != '\0') {
+        char* endp;
+        long count = strtol(cp, &endp, 0);
+        if (endp == cp || count < 0) {
+            Usage(argv[0]);
+            exit(2);
+        }
+        threadCounts.push_back((int) count);
+        cp = endp;
+        if (*cp == ',')
+            cp++;
+    }
+
+    snprintf(scratchDir, sizeof(scratchDir), "%s/extractbench.XXXXXX",
+        parentDir);
+    if (mkdtemp(scratchDir) == nil) {
+        perror(scratchDir);
+        exit(1);
+    }
+
+    Global::SetDebugMsgHandler(MsgHandler);
+    Global::AppInit();
+
+    for (int i = optind; i < argc; i++) {
+        if (BenchImage(argv[i], scratchDir, passes, threadCounts,
+                convert) != 0)
+        {
+            result = 1;
+        }
+    }
+
+    Global::AppCleanup();
+    rmdir(scratchDir);
+
+    exit(result);
+}
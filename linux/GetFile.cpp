@@ -39,26 +39,19 @@ Usage(const char* argv0)
 }
 
 /*
- * Copy a file from "src" to "dst".
+ * Copy a file from "src" to "dst".  When it can, ExtractTo has the kernel
+ * copy the data straight out of the image file.
  */
 int
 CopyFile(A2FileDescr* src, FILE* dst)
 {
     DIError dierr;
-    size_t actual;
-    char buf[4096];
 
-    while (1) {
-        dierr = src->Read(buf, sizeof(buf), &actual);
-        if (dierr != kDIErrNone) {
-            fprintf(stderr, "Error: read failed: %s\n", DIStrError(dierr));
-            return -1;
-        }
-
-        if (actual == 0)    // EOF hit
-            break;
-
-        fwrite(buf, 1, actual, dst);
+    fflush(dst);
+    dierr = src->ExtractTo(fileno(dst));
+    if (dierr != kDIErrNone) {
+        fprintf(stderr, "Error: copy failed: %s\n", DIStrError(dierr));
+        return -1;
     }
 
     return 0;
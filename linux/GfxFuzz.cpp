@@ -0,0 +1,866 @@
+/*
+ * CiderPress
+ * Copyright (C) 2009 by CiderPress authors.  All Rights Reserved.
+ * See the file LICENSE for distribution terms.
+ */
+/*
+ * Check the graphics pixel conversion against the original code.
+ *
+ * The reformatters' inner loops live in reformat/PixelConv.cpp.  This
+ * feeds random PackBytes streams and random hi-res, double-hi-res, and
+ * super-hi-res lines through both PixelConv and copies of the loops it
+ * replaced, and complains if the output differs by a single byte.  Each
+ * test runs with and without the SIMD code, and prints how long it took.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <stdint.h>
+#include "../reformat/PixelConv.h"
+
+#define nil NULL
+
+#define NELEM(x) ((int) (sizeof(x) / sizeof(x[0])))
+
+void
+Usage(const char* argv0)
+{
+    fprintf(stderr, "Usage: %s [-n iterations] [-s seed]\n", argv0);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "  -n  iterations per test (default 20000)\n");
+    fprintf(stderr, "  -s  random seed (default 1)\n");
+}
+
+/*
+ * Get the time in seconds.
+ */
+double
+Now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+/*
+ * Small LCG, so the data is the same everywhere.
+ */
+uint32_t
+NextRand(uint32_t* pSeed)
+{
+    *pSeed = *pSeed * 1103515245 + 12345;
+    return *pSeed >> 8;
+}
+
+void
+FillRandom(uint8_t* buf, long len, uint32_t* pSeed)
+{
+    while (len--)
+        *buf++ = (uint8_t) NextRand(pSeed);
+}
+
+/*
+ * Report the first difference between two buffers.
+ */
+bool
+Compare(const char* label, long iter, const uint8_t* expected,
+    const uint8_t* actual, long len)
+{
+    for (long i = 0; i < len; i++) {
+        if (expected[i] != actual[i]) {
+            fprintf(stderr, "%s: iteration %ld: mismatch at +%ld "
+                            "(expected 0x%02x, got 0x%02x)\n",
+                label, iter, i, expected[i], actual[i]);
+            return false;
+        }
+    }
+    return true;
+}
+
+
+/*
+ * ===========================================================================
+ *      Original code
+ * ===========================================================================
+ */
+
+/*
+ * ReformatGraphics::UnpackBytes, minus the log messages.
+ */
+long
+RefUnpackBytes(uint8_t* dst, const uint8_t* src, long dstRem, long srcLen)
+{
+    const uint8_t* origDst = dst;
+
+    while (srcLen > 0) {
+        uint8_t flag = *src++;
+        int count = (flag & 0x3f) +1;
+        uint8_t val;
+        uint8_t valSet[4];
+        int i;
+
+        srcLen--;
+
+        switch (flag & 0xc0) {
+        case 0x00:
+            for (i = 0; i < count; i++) {
+                if (srcLen == 0 || dstRem == 0)
+                    return -1;
+                *dst++ = *src++;
+                srcLen--;
+                dstRem--;
+            }
+            break;
+        case 0x40:
+            if (srcLen == 0)
+                return -1;
+            val = *src++;
+            srcLen--;
+            for (i = 0; i < count; i++) {
+                if (dstRem == 0)
+                    return -1;
+                *dst++ = val;
+                dstRem--;
+            }
+            break;
+        case 0x80:
+            if (srcLen < 4)
+                return -1;
+            valSet[0] = *src++;
+            valSet[1] = *src++;
+            valSet[2] = *src++;
+            valSet[3] = *src++;
+            srcLen -= 4;
+            for (i = 0; i < count; i++) {
+                if (dstRem < 4)
+                    return -1;
+                *dst++ = valSet[0];
+                *dst++ = valSet[1];
+                *dst++ = valSet[2];
+                *dst++ = valSet[3];
+                dstRem -= 4;
+            }
+            break;
+        case 0xc0:
+            if (srcLen == 0)
+                return -1;
+            val = *src++;
+            srcLen--;
+            for (i = 0; i < count; i++) {
+                if (dstRem < 4)
+                    return -1;
+                *dst++ = val;
+                *dst++ = val;
+                *dst++ = val;
+                *dst++ = val;
+                dstRem -= 4;
+            }
+            break;
+        }
+    }
+
+    return dst - origDst;
+}
+
+/*
+ * One line of ReformatSHR::SHRDataToBitmap8.
+ */
+void
+RefSHRLine(uint8_t* out, const uint8_t* pPixels, unsigned int bytesPerLine,
+    unsigned int outputWidthPix, bool mode640, int colorTableOffset)
+{
+    unsigned int byteCount;
+    uint8_t pixelVal;
+    uint8_t colorIndex;
+    int x = 0;
+
+#define SetPix(x, colridx) out[(x)] = colridx
+
+    if (mode640) {
+        unsigned int fullBytesPerLine = outputWidthPix / 4;
+
+        for (byteCount = 0; byteCount < fullBytesPerLine; byteCount++) {
+            uint8_t pixelByte = *pPixels++;
+
+            pixelVal = (pixelByte >> 6) & 0x03;
+            colorIndex = colorTableOffset + pixelVal + 8;
+            SetPix(x++, colorIndex);
+
+            pixelVal = (pixelByte >> 4) & 0x03;
+            colorIndex = colorTableOffset + pixelVal + 12;
+            SetPix(x++, colorIndex);
+
+            pixelVal = (pixelByte >> 2) & 0x03;
+            colorIndex = colorTableOffset + pixelVal + 0;
+            SetPix(x++, colorIndex);
+
+            pixelVal = pixelByte & 0x03;
+            colorIndex = colorTableOffset + pixelVal + 4;
+            SetPix(x++, colorIndex);
+        }
+        if (byteCount != bytesPerLine) {
+            uint8_t pixelByte = *pPixels++;
+            int rem = outputWidthPix - fullBytesPerLine * 4;
+            if (rem >= 3) {
+                pixelVal = (pixelByte >> 6) & 0x03;
+                colorIndex = colorTableOffset + pixelVal + 8;
+                SetPix(x++, colorIndex);
+            }
+            if (rem >= 2) {
+                pixelVal = (pixelByte >> 4) & 0x03;
+                colorIndex = colorTableOffset + pixelVal + 12;
+                SetPix(x++, colorIndex);
+            }
+            if (rem >= 1) {
+                pixelVal = (pixelByte >> 2) & 0x03;
+                colorIndex = colorTableOffset + pixelVal + 0;
+                SetPix(x++, colorIndex);
+            }
+        }
+    } else {
+        unsigned int fullBytesPerLine = outputWidthPix / 4;
+
+        for (byteCount = 0; byteCount < fullBytesPerLine; byteCount++) {
+            uint8_t pixelByte = *pPixels++;
+
+            pixelVal = (pixelByte >> 4) & 0x0f;
+            colorIndex = colorTableOffset + pixelVal;
+            SetPix(x++, colorIndex);
+            SetPix(x++, colorIndex);
+
+            pixelVal = pixelByte & 0x0f;
+            colorIndex = colorTableOffset + pixelVal;
+            SetPix(x++, colorIndex);
+            SetPix(x++, colorIndex);
+        }
+        if (byteCount != bytesPerLine) {
+            uint8_t pixelByte = *pPixels++;
+            pixelVal = (pixelByte >> 4) & 0x0f;
+            colorIndex = colorTableOffset + pixelVal;
+            SetPix(x++, colorIndex);
+            SetPix(x++, colorIndex);
+        }
+    }
+#undef SetPix
+}
+
+/*
+ * One line of Reformat3200SHR::SHR3200ToBitmap24.
+ */
+void
+RefSHR3200Line(uint8_t* out, const uint8_t* pPixels, int bytesPerLine,
+    const uint8_t* palette)
+{
+    for (int byteCount = 0; byteCount < bytesPerLine; byteCount++) {
+        int pixelByte = *pPixels++;
+        const uint8_t* rgb;
+
+        rgb = palette + ((pixelByte >> 4) & 0x0f) * 3;
+        memcpy(out, rgb, 3);
+        memcpy(out + 3, rgb, 3);
+        rgb = palette + (pixelByte & 0x0f) * 3;
+        memcpy(out + 6, rgb, 3);
+        memcpy(out + 9, rgb, 3);
+        out += 12;
+    }
+}
+
+/*
+ * One line of ReformatHiRes::HiResScreenToBitmap.
+ */
+void
+RefHiResLine(uint8_t* out, const uint8_t* lineData, bool blackWhite)
+{
+    enum {
+        kPixelsPerLine = 280,
+        kOutputWidth = 560,
+    };
+    enum {
+        kColorBlack0 = 0,
+        kColorGreen,
+        kColorPurple,
+        kColorWhite0,
+        kColorBlack1,
+        kColorOrange,
+        kColorBlue,
+        kColorWhite1,
+        kColorNone,
+        kNumColors
+    };
+    const int kLeadIn = 4;
+    unsigned int colorBuf[kLeadIn+kOutputWidth +1];
+    int pixelBits[kPixelsPerLine];
+    int shiftBits[kPixelsPerLine];
+    int* bitPtr = pixelBits;
+    int* shiftPtr = shiftBits;
+
+    for (int byt = 0; byt < kPixelsPerLine / 7; byt++) {
+        uint8_t val = *lineData;
+        int shifted = (val & 0x80) != 0;
+
+        for (int bit = 0; bit < 7; bit++) {
+            *bitPtr++ = val & 0x01;
+            *shiftPtr++ = shifted;
+            val >>= 1;
+        }
+        lineData++;
+    }
+
+    int idx;
+    for (idx = 0; idx < NELEM(colorBuf); idx++)
+        colorBuf[idx] = kColorNone;
+    if (blackWhite) {
+        for (idx = 0; idx < kPixelsPerLine; idx ++) {
+            int bufShift = (int) shiftBits[idx];
+            int bufTarget = kLeadIn + idx * 2 + bufShift;
+
+            if (!pixelBits[idx]) {
+                colorBuf[bufTarget] = kColorBlack0;
+                colorBuf[bufTarget+1] = kColorBlack0;
+            } else {
+                colorBuf[bufTarget] = kColorWhite0;
+                colorBuf[bufTarget+1] = kColorWhite0;
+            }
+        }
+    } else {
+        for (idx = 0; idx < kPixelsPerLine; idx ++) {
+            int bufShift = (int) shiftBits[idx];
+            int colorShift = 4 * bufShift;
+            int bufTarget = kLeadIn + idx * 2 + bufShift;
+
+            if (!pixelBits[idx]) {
+                colorBuf[bufTarget] = kColorBlack0 + colorShift;
+                colorBuf[bufTarget+1] = kColorBlack0 + colorShift;
+            } else {
+                if (colorBuf[bufTarget-2] != kColorBlack0 &&
+                    colorBuf[bufTarget-2] != kColorBlack1 &&
+                    colorBuf[bufTarget-2] != kColorNone)
+                {
+                    colorBuf[bufTarget] = kColorWhite0 + colorShift;
+                    colorBuf[bufTarget+1] = kColorWhite0 + colorShift;
+                    colorBuf[bufTarget-2] = kColorWhite0 + colorShift;
+                    colorBuf[bufTarget-1] = kColorWhite0 + colorShift;
+                } else {
+                    if (idx & 0x01) {
+                        colorBuf[bufTarget] = kColorGreen + colorShift;
+                        colorBuf[bufTarget+1] = kColorGreen + colorShift;
+                    } else {
+                        colorBuf[bufTarget] = kColorPurple + colorShift;
+                        colorBuf[bufTarget+1] = kColorPurple + colorShift;
+                    }
+
+                    if (colorBuf[bufTarget-4] == colorBuf[bufTarget] ||
+                        colorBuf[bufTarget-4] == kColorWhite0 ||
+                        colorBuf[bufTarget-4] == kColorWhite1)
+                    {
+                        colorBuf[bufTarget-2] = colorBuf[bufTarget];
+                        colorBuf[bufTarget-1] = colorBuf[bufTarget];
+                    }
+                }
+            }
+        }
+    }
+
+    for (int pix = 0; pix < kPixelsPerLine; pix++) {
+        int bufPosn = kLeadIn + pix * 2;
+        out[pix] = colorBuf[bufPosn] << 4 | colorBuf[bufPosn+1];
+    }
+}
+
+/*
+ * ReformatDHR::InitColorLookup.
+ */
+int gDHRColorLookup[4][16];
+
+void
+RefInitColorLookup(void)
+{
+    for (int ii = 0; ii < 4; ii++) {
+        for (int jj = 0; jj < 16; jj++) {
+            int num = jj;
+            for (int kk = 0; kk < ii; kk++) {
+                if (num & 0x01)
+                    num |= 0x10;
+                num >>= 1;
+                num &= 0x0f;
+            }
+            gDHRColorLookup[ii][jj] = num;
+        }
+    }
+}
+
+/*
+ * One line of ReformatDHR::DHRScreenToBitmap.
+ */
+void
+RefDHRLine(uint8_t* out, const uint8_t* lineData,
+    PixelConv::DHRAlgorithm algorithm)
+{
+    enum {
+        kPixelsPerLine = 560,
+        kOutputWidth = 560,
+        kPageSize = PixelConv::kDHRPageSize,
+        kColorBlack = 0,
+        kColorWhite = 15,
+    };
+    const int kMaxLook = 4;
+    int pixelBits[kMaxLook+kPixelsPerLine+kMaxLook];
+    unsigned int colorBuf[kOutputWidth];
+    int* bitPtr = pixelBits + kMaxLook;
+    int idx;
+
+    memset(pixelBits, 0, sizeof(pixelBits));
+
+    for (int byt = 0; byt < kPixelsPerLine / 7; byt++) {
+        uint8_t val;
+
+        if (byt & 0x01) {
+            val = *(lineData+kPageSize);
+            lineData++;
+        } else {
+            val = *lineData;
+        }
+
+        for (int bit = 0; bit < 7; bit++) {
+            *bitPtr++ = val & 0x01;
+            val >>= 1;
+        }
+    }
+
+    if (algorithm == PixelConv::kDHRBlackWhite) {
+        for (idx = 0; idx < kPixelsPerLine; idx ++) {
+            if (!pixelBits[idx])
+                colorBuf[idx] = kColorBlack;
+            else
+                colorBuf[idx] = kColorWhite;
+        }
+    } else if (algorithm == PixelConv::kDHRPlain140) {
+        int pixVal = 0;
+        bitPtr = pixelBits + kMaxLook;
+
+        for (idx = 0; idx < kPixelsPerLine/4; idx++) {
+            pixVal = *bitPtr++;
+            pixVal = (pixVal << 1) | (*bitPtr++);
+            pixVal = (pixVal << 1) | (*bitPtr++);
+            pixVal = (pixVal << 1) | (*bitPtr++);
+            colorBuf[idx*4] = pixVal;
+            colorBuf[idx*4+1] = pixVal;
+            colorBuf[idx*4+2] = pixVal;
+            colorBuf[idx*4+3] = pixVal;
+        }
+    } else if (algorithm == PixelConv::kDHRWindow) {
+        int pixVal = 0;
+        bitPtr = pixelBits + kMaxLook;
+
+        for (idx = 0; idx < kPixelsPerLine; idx++) {
+            pixVal = (pixVal << 1) & 0x0f;
+            if (*bitPtr++)
+                pixVal |= 1;
+            colorBuf[idx] = gDHRColorLookup[(idx+1) & 0x03][pixVal];
+        }
+    } else {
+        unsigned int whole;
+        int newColor, oldColor;
+
+        bitPtr = pixelBits;
+
+        whole = 0;
+        for (idx = 0; idx < 8; idx++) {
+            whole <<= 1;
+            if (*bitPtr++)
+                whole |= 1;
+        }
+
+        oldColor = gDHRColorLookup[idx & 0x03][whole & 0x0f];
+
+        for (idx = 0; idx < kPixelsPerLine; idx++, bitPtr++) {
+            whole = (whole << 1) | *bitPtr;
+            whole &= 0xff;
+
+            newColor = gDHRColorLookup[(idx+1) & 0x03][(whole & 0xf0) >> 4];
+
+            if (newColor != oldColor) {
+                int shift1, shift2, shift3;
+                shift1 = (whole >> 3) & 0x0f;
+                shift2 = (whole >> 2) & 0x0f;
+                shift3 = (whole >> 1) & 0x0f;
+
+                if (shift1 == 0x0f || shift2 == 0x0f || shift3 == 0x0f)
+                    newColor = kColorWhite;
+                else if (shift1 == 0 || shift2 == 0 || shift3 == 0)
+                    newColor = kColorBlack;
+            }
+
+            colorBuf[idx] = newColor;
+            oldColor = newColor;
+        }
+    }
+
+    for (int pix = 0; pix < kPixelsPerLine/2; pix++) {
+        int bufPosn = pix * 2;
+        out[pix] = colorBuf[bufPosn] << 4 | colorBuf[bufPosn+1];
+    }
+}
+
+
+/*
+ * ===========================================================================
+ *      Tests
+ * ===========================================================================
+ */
+
+/*
+ * Generate a PackBytes stream.  Most are well-formed, but some are cut
+ * short in the middle of a run, and some unpack to more than fits.
+ */
+long
+MakePacked(uint8_t* buf, long maxLen, long* pDstRem, uint32_t* pSeed)
+{
+    long len = 0;
+    long unpacked = 0;
+    long wanted = 32 + NextRand(pSeed) % 32768;
+
+    while (unpacked < wanted && len < maxLen - 65) {
+        uint8_t flag = (uint8_t) NextRand(pSeed);
+        int count = (flag & 0x3f) +1;
+
+        buf[len++] = flag;
+        switch (flag & 0xc0) {
+        case 0x00:
+            FillRandom(buf + len, count, pSeed);
+            len += count;
+            unpacked += count;
+            break;
+        case 0x40:
+            buf[len++] = (uint8_t) NextRand(pSeed);
+            unpacked += count;
+            break;
+        case 0x80:
+            FillRandom(buf + len, 4, pSeed);
+            len += 4;
+            unpacked += count * 4;
+            break;
+        case 0xc0:
+            buf[len++] = (uint8_t) NextRand(pSeed);
+            unpacked += count * 4;
+            break;
+        }
+    }
+
+    switch (NextRand(pSeed) % 8) {
+    case 0:
+        /* truncate the input */
+        len -= 1 + NextRand(pSeed) % 5;
+        if (len < 0)
+            len = 0;
+        *pDstRem = unpacked + 16;
+        break;
+    case 1:
+        /* overfill the output */
+        *pDstRem = unpacked - 1 - NextRand(pSeed) % 16;
+        if (*pDstRem < 0)
+            *pDstRem = 0;
+        break;
+    case 2:
+        *pDstRem = unpacked;
+        break;
+    default:
+        *pDstRem = unpacked + NextRand(pSeed) % 64;
+        break;
+    }
+    return len;
+}
+
+bool
+TestUnpack(long numIter, uint32_t seed, double* pElapsed)
+{
+    const long kMaxPacked = 40000;
+    const long kMaxOut = 32768 + 64*4 + 64;
+    uint8_t* packed = new uint8_t[kMaxPacked];
+    uint8_t* expected = new uint8_t[kMaxOut];
+    uint8_t* actual = new uint8_t[kMaxOut];
+    bool result = true;
+    double elapsed = 0.0;
+
+    for (long iter = 0; iter < numIter; iter++) {
+        long dstRem;
+        long srcLen = MakePacked(packed, kMaxPacked, &dstRem, &seed);
+
+        memset(expected, 0xcc, kMaxOut);
+        memset(actual, 0xcc, kMaxOut);
+        long expectedLen = RefUnpackBytes(expected, packed, dstRem, srcLen);
+        double start = Now();
+        long actualLen = PixelConv::UnpackBytes(actual, packed, dstRem, srcLen);
+        elapsed += Now() - start;
+
+        if (expectedLen != actualLen) {
+            fprintf(stderr, "unpack: iteration %ld: expected %ld, got %ld\n",
+                iter, expectedLen, actualLen);
+            result = false;
+            break;
+        }
+        if (!Compare("unpack", iter, expected, actual, kMaxOut)) {
+            result = false;
+            break;
+        }
+    }
+
+    delete[] packed;
+    delete[] expected;
+    delete[] actual;
+    *pElapsed = elapsed;
+    return result;
+}
+
+bool
+TestSHR(long numIter, uint32_t seed, double* pElapsed)
+{
+    const int kMaxBytesPerLine = 320;
+    const int kMaxOut = kMaxBytesPerLine * 4 + 16;
+    uint8_t pixels[kMaxBytesPerLine];
+    uint8_t expected[kMaxOut];
+    uint8_t actual[kMaxOut];
+    double elapsed = 0.0;
+
+    for (long iter = 0; iter < numIter; iter++) {
+        unsigned int bytesPerLine;
+        if (iter & 1)
+            bytesPerLine = 160;     // the usual screen
+        else
+            bytesPerLine = 1 + NextRand(&seed) % kMaxBytesPerLine;
+        unsigned int outputWidthPix = bytesPerLine * 4 - NextRand(&seed) % 4;
+        if (outputWidthPix == 0)
+            outputWidthPix = bytesPerLine * 4;
+        bool mode640 = (NextRand(&seed) & 1) != 0;
+        uint8_t tableOffset = (uint8_t) ((NextRand(&seed) % 16) * 16);
+
+        FillRandom(pixels, bytesPerLine, &seed);
+        memset(expected, 0xcc, kMaxOut);
+        memset(actual, 0xcc, kMaxOut);
+        RefSHRLine(expected, pixels, bytesPerLine, outputWidthPix, mode640,
+            tableOffset);
+        double start = Now();
+        PixelConv::SHRLineToIndex8(actual, pixels, bytesPerLine,
+            outputWidthPix, mode640, tableOffset);
+        elapsed += Now() - start;
+
+        if (!Compare(mode640 ? "SHR 640" : "SHR 320", iter, expected, actual,
+                kMaxOut))
+        {
+            fprintf(stderr, "  (bytesPerLine=%u outputWidthPix=%u)\n",
+                bytesPerLine, outputWidthPix);
+            return false;
+        }
+    }
+
+    *pElapsed = elapsed;
+    return true;
+}
+
+bool
+TestSHR3200(long numIter, uint32_t seed, double* pElapsed)
+{
+    const int kBytesPerLine = 160;
+    const int kOutBytes = kBytesPerLine * 4 * 3;
+    uint8_t pixels[kBytesPerLine];
+    uint8_t palette[16 * 3];
+    uint8_t expected[kOutBytes];
+    uint8_t actual[kOutBytes];
+    double elapsed = 0.0;
+
+    for (long iter = 0; iter < numIter; iter++) {
+        FillRandom(pixels, sizeof(pixels), &seed);
+        FillRandom(palette, sizeof(palette), &seed);
+        RefSHR3200Line(expected, pixels, kBytesPerLine, palette);
+        double start = Now();
+        PixelConv::SHR3200LineToRGB24(actual, pixels, kBytesPerLine, palette);
+        elapsed += Now() - start;
+
+        if (!Compare("SHR 3200", iter, expected, actual, kOutBytes))
+            return false;
+    }
+
+    *pElapsed = elapsed;
+    return true;
+}
+
+/*
+ * Random bytes make for noisy pictures, so sometimes use long runs of a
+ * repeated byte instead, which is more like real artwork and exercises
+ * the color smoothing.
+ */
+void
+FillLine(uint8_t* buf, int len, uint32_t* pSeed)
+{
+    if (NextRand(pSeed) & 1) {
+        FillRandom(buf, len, pSeed);
+    } else {
+        int i = 0;
+        while (i < len) {
+            uint8_t val = (uint8_t) NextRand(pSeed);
+            int run = 1 + NextRand(pSeed) % 12;
+            while (run-- && i < len)
+                buf[i++] = val;
+        }
+    }
+}
+
+bool
+TestHiRes(long numIter, uint32_t seed, double* pElapsed)
+{
+    uint8_t lineData[PixelConv::kHiResBytesPerLine];
+    uint8_t expected[PixelConv::kHiResOutputBytes];
+    uint8_t actual[PixelConv::kHiResOutputBytes];
+    double elapsed = 0.0;
+
+    for (long iter = 0; iter < numIter; iter++) {
+        bool blackWhite = (iter % 4) == 0;
+
+        FillLine(lineData, sizeof(lineData), &seed);
+        RefHiResLine(expected, lineData, blackWhite);
+        double start = Now();
+        PixelConv::HiResLineToPix4(actual, lineData, blackWhite);
+        elapsed += Now() - start;
+
+        if (!Compare(blackWhite ? "HGR B&W" : "HGR color", iter, expected,
+                actual, sizeof(actual)))
+        {
+            return false;
+        }
+    }
+
+    *pElapsed = elapsed;
+    return true;
+}
+
+/* indexed by PixelConv::DHRAlgorithm */
+static const char* gDHRNames[] = {
+    "DHR B&W", "DHR latched", "DHR plain140", "DHR window"
+};
+
+bool
+TestDHR(long numIter, uint32_t seed, PixelConv::DHRAlgorithm algorithm,
+    double* pElapsed)
+{
+    /* only the first 40 bytes of each page are used */
+    uint8_t* pages = new uint8_t[PixelConv::kDHRPageSize * 2];
+    uint8_t expected[PixelConv::kDHROutputBytes];
+    uint8_t actual[PixelConv::kDHROutputBytes];
+    bool result = true;
+    double elapsed = 0.0;
+
+    for (long iter = 0; iter < numIter; iter++) {
+        FillLine(pages, 40, &seed);
+        FillLine(pages + PixelConv::kDHRPageSize, 40, &seed);
+        RefDHRLine(expected, pages, algorithm);
+        double start = Now();
+        PixelConv::DHRLineToPix4(actual, pages, algorithm);
+        elapsed += Now() - start;
+
+        if (!Compare(gDHRNames[algorithm], iter, expected, actual,
+                sizeof(actual)))
+        {
+            result = false;
+            break;
+        }
+    }
+
+    delete[] pages;
+    *pElapsed = elapsed;
+    return result;
+}
+
+/*
+ * Run all the tests once.  Returns the number that failed.
+ */
+int
+RunTests(long numIter, uint32_t seed)
+{
+    static const PixelConv::DHRAlgorithm kAlgorithms[] = {
+        PixelConv::kDHRBlackWhite, PixelConv::kDHRLatched,
+        PixelConv::kDHRPlain140, PixelConv::kDHRWindow
+    };
+    int failed = 0;
+    double elapsed;
+
+    if (TestUnpack(numIter / 10 + 1, seed, &elapsed))
+        printf("  %-14s %8.1f us/stream\n", "unpack",
+            elapsed * 1000000.0 / (numIter / 10 + 1));
+    else
+        failed++;
+
+    if (TestSHR(numIter, seed, &elapsed))
+        printf("  %-14s %8.1f ns/line\n", "SHR", elapsed * 1e9 / numIter);
+    else
+        failed++;
+
+    if (TestSHR3200(numIter, seed, &elapsed))
+        printf("  %-14s %8.1f ns/line\n", "SHR 3200", elapsed * 1e9 / numIter);
+    else
+        failed++;
+
+    if (TestHiRes(numIter, seed, &elapsed))
+        printf("  %-14s %8.1f ns/line\n", "HGR", elapsed * 1e9 / numIter);
+    else
+        failed++;
+
+    for (int i = 0; i < NELEM(kAlgorithms); i++) {
+        if (TestDHR(numIter, seed, kAlgorithms[i], &elapsed))
+            printf("  %-14s %8.1f ns/line\n", gDHRNames[kAlgorithms[i]],
+                elapsed * 1e9 / numIter);
+        else
+            failed++;
+    }
+
+    return failed;
+}
+
+int
+main(int argc, char** argv)
+{
+    long numIter = 20000;
+    uint32_t seed = 1;
+    int failed = 0;
+    int ic;
+
+    while ((ic = getopt(argc, argv, "n:s:")) != -1) {
+        switch (ic) {
+        case 'n':
+            numIter = strtol(optarg, nil, 0);
+            break;
+        case 's':
+            seed = (uint32_t) strtoul(optarg, nil, 0);
+            break;
+        default:
+            Usage(argv[0]);
+            exit(2);
+        }
+    }
+    if (optind != argc || numIter <= 0) {
+        Usage(argv[0]);
+        exit(2);
+    }
+
+    RefInitColorLookup();
+
+    if (PixelConv::HaveSIMD()) {
+        printf("SIMD:\n");
+        PixelConv::SetSIMDEnabled(true);
+        failed += RunTests(numIter, seed);
+    } else {
+        printf("(no SIMD in this build)\n");
+    }
+
+    printf("Plain:\n");
+    PixelConv::SetSIMDEnabled(false);
+    failed += RunTests(numIter, seed);
+
+    if (failed) {
+        printf("%d test%s FAILED\n", failed, failed == 1 ? "" : "s");
+        exit(1);
+    }
+    printf("All tests passed\n");
+    exit(0);
+}
@@ -0,0 +1,380 @@
+/*
+ * CiderPress
+ * Copyright (C) 2009 by CiderPress authors.  All Rights Reserved.
+ * See the file LICENSE for distribution terms.
+ */
+/*
+ * Benchmark for the libhfs block cache.
+ *
+ * Builds a large HFS volume full of fragmented files (so the extents
+ * overflow tree gets a workout), then opens it with several different
+ * cache sizes, timing the catalog scan and a full read of every file.
+ * The image is kept, so later runs can skip the slow creation step.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <assert.h>
+#include "../diskimg/DiskImg.h"
+#include "../nufxlib/NufxLib.h"
+
+using namespace DiskImgLib;
+
+#define nil NULL
+
+const int kWriteGroup = 8;          // files written at the same time
+const int kWriteChunk = 1536;       // bytes written per file per round
+
+bool gVerbose = false;
+
+/*
+ * Show library messages if we were asked to.
+ */
+void
+MsgHandler(const char* file, int line, const char* msg)
+{
+    assert(file != nil);
+    assert(msg != nil);
+
+    if (gVerbose)
+        fprintf(stderr, "%s\n", msg);
+}
+
+void
+Usage(const char* argv0)
+{
+    fprintf(stderr, "Usage: %s [-v] [-n files] [-m megs] [-c sizes] image.po\n",
+        argv0);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "  -n  files to create, if image doesn't exist (default 4000)\n");
+    fprintf(stderr, "  -m  volume size in MB, if image doesn't exist (default 128)\n");
+    fprintf(stderr, "  -c  comma-separated cache sizes in blocks; -1 disables\n");
+    fprintf(stderr, "      the cache, 0 is the libhfs default (default -1,0,1024,8192)\n");
+    fprintf(stderr, "  -v  show library messages\n");
+}
+
+/*
+ * Simple hash, so we can tell that every cache size read the same data.
+ */
+uint32_t
+HashBuf(uint32_t hash, const uint8_t* buf, size_t len)
+{
+    while (len--)
+        hash = (hash * 31) + *buf++;
+    return hash;
+}
+
+/*
+ * Create an HFS volume with "numFiles" files spread across a few dozen
+ * directories.  Files are written a chunk at a time, several at once, so
+ * that each one ends up in lots of little extents.
+ *
+ * Returns 0 on success.
+ */
+int
+CreateVolume(const char* fileName, long numFiles, long megs)
+{
+    DiskImg diskImg;
+    DiskFS* pDiskFS = nil;
+    DiskFS::CreateParms parms;
+    A2File* newFiles[kWriteGroup];
+    A2FileDescr* openFiles[kWriteGroup];
+    long fileLens[kWriteGroup];
+    uint8_t buf[kWriteChunk];
+    char pathName[64];
+    long numDirs, idx;
+    DIError dierr;
+    int result = -1;
+    int i;
+
+    printf("Creating %ldMB volume with %ld files...\n", megs, numFiles);
+
+    dierr = diskImg.CreateImage(fileName, nil,
+                DiskImg::kOuterFormatNone, DiskImg::kFileFormatUnadorned,
+                DiskImg::kPhysicalFormatSectors, nil,
+                DiskImg::kSectorOrderProDOS, DiskImg::kFormatGenericProDOSOrd,
+                megs * 2048, true);
+    if (dierr != kDIErrNone) {
+        fprintf(stderr, "ERROR: CreateImage failed: %s\n", DIStrError(dierr));
+        return -1;
+    }
+    dierr = diskImg.FormatImage(DiskImg::kFormatMacHFS, "Bench");
+    if (dierr != kDIErrNone) {
+        fprintf(stderr, "ERROR: format failed: %s\n", DIStrError(dierr));
+        goto bail;
+    }
+    pDiskFS = diskImg.OpenAppropriateDiskFS(false);
+    if (pDiskFS == nil) {
+        fprintf(stderr, "ERROR: unable to open DiskFS\n");
+        goto bail;
+    }
+    dierr = pDiskFS->Initialize(&diskImg, DiskFS::kInitFull);
+    if (dierr != kDIErrNone) {
+        fprintf(stderr, "ERROR: DiskFS init failed: %s\n", DIStrError(dierr));
+        goto bail;
+    }
+
+    memset(&parms, 0, sizeof(parms));
+    parms.fssep = ':';
+    parms.fileType = 0;
+    parms.auxType = 0;
+    parms.access = DiskFS::kFileAccessUnlocked;
+    parms.createWhen = parms.modWhen = time(nil);
+
+    numDirs = numFiles / 100 + 1;
+    for (idx = 0; idx < numDirs; idx++) {
+        sprintf(pathName, "Dir%03ld", idx);
+        parms.pathName = pathName;
+        parms.storageType = DiskFS::kStorageDirectory;
+        dierr = pDiskFS->CreateFile(&parms, &newFiles[0]);
+        if (dierr != kDIErrNone) {
+            fprintf(stderr, "ERROR: unable to create '%s': %s\n",
+                pathName, DIStrError(dierr));
+            goto bail;
+        }
+    }
+
+    srandom(1);
+    parms.storageType = DiskFS::kStorageSeedling;
+    for (idx = 0; idx < numFiles; idx += kWriteGroup) {
+        int groupSize = kWriteGroup;
+        if (idx + groupSize > numFiles)
+            groupSize = numFiles - idx;
+
+        for (i = 0; i < groupSize; i++) {
+            sprintf(pathName, "Dir%03ld:File%05ld", (idx + i) % numDirs,
+                idx + i);
+            parms.pathName = pathName;
+            dierr = pDiskFS->CreateFile(&parms, &newFiles[i]);
+            if (dierr == kDIErrNone)
+                dierr = newFiles[i]->Open(&openFiles[i], false);
+            if (dierr != kDIErrNone) {
+                fprintf(stderr, "ERROR: unable to create '%s': %s\n",
+                    pathName, DIStrError(dierr));
+                goto bail;
+            }
+            fileLens[i] = 512 + random() % (48 * 1024);
+        }
+
+        /* write a chunk to each file in turn until they're all full */
+        bool more = true;
+        while (more) {
+            more = false;
+            for (i = 0; i < groupSize; i++) {
+                long chunk = fileLens[i];
+                if (chunk == 0)
+                    continue;
+                if (chunk > kWriteChunk)
+                    chunk = kWriteChunk;
+                for (int j = 0; j < chunk; j++)
+                    buf[j] = (uint8_t) random();
+                dierr = openFiles[i]->Write(buf, chunk);
+                if (dierr != kDIErrNone) {
+                    fprintf(stderr, "ERROR: write failed: %s\n",
+                        DIStrError(dierr));
+                    goto bail;
+                }
+                fileLens[i] -= chunk;
+                if (fileLens[i] != 0)
+                    more = true;
+            }
+        }
+
+        for (i = 0; i < groupSize; i++)
+            openFiles[i]->Close();
+
+        if (((idx + kWriteGroup) % 1000) < kWriteGroup)
+            printf("  %ld files\n", idx + groupSize);
+    }
+
+    result = 0;
+
+bail:
+    delete pDiskFS;
+    if (diskImg.CloseImage() != kDIErrNone)
+        result = -1;
+    return result;
+}
+
+/*
+ * Open the volume with the specified cache size, and read everything.
+ *
+ * Returns 0 on success.
+ */
+int
+RunOne(const char* fileName, long cacheSize, uint32_t* pHash)
+{
+    DiskImg diskImg;
+    DiskFS* pDiskFS = nil;
+    A2File* pFile;
+    A2FileDescr* pFD;
+    DiskFS::CacheStats cacheStats;
+    uint8_t buf[65536];
+    uint64_t startWhen, listWhen, readWhen;
+    uint64_t listBlocks;
+    long numFiles = 0;
+    uint32_t hash = 0;
+    DIError dierr;
+    int result = -1;
+
+    diskImg.SetStatsEnabled(true);
+    startWhen = DiskImgStats::GetMonotonicMicros();
+
+    dierr = diskImg.OpenImage(fileName, '/', true);
+    if (dierr == kDIErrNone)
+        dierr = diskImg.AnalyzeImage();
+    if (dierr != kDIErrNone || diskImg.GetFSFormat() != DiskImg::kFormatMacHFS) {
+        fprintf(stderr, "ERROR: '%s' is not an HFS volume\n", fileName);
+        return -1;
+    }
+
+    pDiskFS = diskImg.OpenAppropriateDiskFS(false);
+    if (pDiskFS == nil)
+        goto bail;
+    pDiskFS->SetParameter(DiskFS::kParmHFS_CacheSize, cacheSize);
+    dierr = pDiskFS->Initialize(&diskImg, DiskFS::kInitFull);
+    if (dierr != kDIErrNone) {
+        fprintf(stderr, "ERROR: DiskFS init failed: %s\n", DIStrError(dierr));
+        goto bail;
+    }
+
+    listWhen = DiskImgStats::GetMonotonicMicros();
+    listBlocks = diskImg.GetStats()->GetCounter(DiskImgStats::kCounterBlocksRead);
+
+    pFile = pDiskFS->GetNextFile(nil);
+    for ( ; pFile != nil; pFile = pDiskFS->GetNextFile(pFile)) {
+        if (pFile->IsDirectory() || pFile->IsVolumeDirectory())
+            continue;
+
+        dierr = pFile->Open(&pFD, true);
+        if (dierr != kDIErrNone) {
+            fprintf(stderr, "ERROR: unable to open '%s': %s\n",
+                pFile->GetPathName(), DIStrError(dierr));
+            goto bail;
+        }
+        while (true) {
+            size_t actual;
+            dierr = pFD->Read(buf, sizeof(buf), &actual);
+            if (dierr != kDIErrNone || actual == 0)
+                break;
+            hash = HashBuf(hash, buf, actual);
+        }
+        pFD->Close();
+        if (dierr != kDIErrNone && dierr != kDIErrEOF) {
+            fprintf(stderr, "ERROR: read failed on '%s': %s\n",
+                pFile->GetPathName(), DIStrError(dierr));
+            goto bail;
+        }
+        numFiles++;
+    }
+
+    readWhen = DiskImgStats::GetMonotonicMicros();
+
+    if (pDiskFS->GetCacheStats(&cacheStats) != kDIErrNone)
+        memset(&cacheStats, 0, sizeof(cacheStats));
+
+    printf("%6ld  %8.1f %8.1f  %8llu %8llu  %9llu %9llu %9llu %9llu\n",
+        cacheSize,
+        (listWhen - startWhen) / 1000.0, (readWhen - listWhen) / 1000.0,
+        (unsigned long long) listBlocks,
+        (unsigned long long) diskImg.GetStats()->GetCounter(
+            DiskImgStats::kCounterBlocksRead) - listBlocks,
+        (unsigned long long) cacheStats.hits,
+        (unsigned long long) cacheStats.misses,
+        (unsigned long long) cacheStats.evictions,
+        (unsigned long long) cacheStats.bypassed);
+
+    if (numFiles == 0)
+        fprintf(stderr, "WARNING: no files found\n");
+    *pHash = hash;
+    result = 0;
+
+bail:
+    delete pDiskFS;
+    return result;
+}
+
+int
+main(int argc, char** argv)
+{
+    const char* cacheSizes = "-1,0,1024,8192";
+    long numFiles = 4000;
+    long megs = 128;
+    uint32_t hash, firstHash = 0;
+    bool first = true;
+    int result = 0;
+    int ic;
+
+    while ((ic = getopt(argc, argv, "n:m:c:v")) != -1) {
+        switch (ic) {
+        case 'n':
+            numFiles = strtol(optarg, nil, 0);
+            break;
+        case 'm':
+            megs = strtol(optarg, nil, 0);
+            break;
+        case 'c':
+            cacheSizes = optarg;
+            break;
+        case 'v':
+            gVerbose = true;
+            break;
+        default:
+            Usage(argv[0]);
+            exit(2);
+        }
+    }
+    if (optind != argc - 1 || numFiles <= 0 || megs <= 0 || megs > 2047) {
+        Usage(argv[0]);
+        exit(2);
+    }
+    const char* fileName = argv[optind];
+
+    Global::SetDebugMsgHandler(MsgHandler);
+    Global::AppInit();
+
+    struct stat sb;
+    if (stat(fileName, &sb) != 0) {
+        if (CreateVolume(fileName, numFiles, megs) != 0) {
+            Global::AppCleanup();
+            exit(1);
+        }
+    }
+
+    printf(" cache   list-ms  read-ms  list-blk read-blk       hits"
+           "    misses evictions  bypassed\n");
+
+    const char* cp = cacheSizes;
+    while (*cp != '\0') {
+        char* endp;
+        long cacheSize = strtol(cp, &endp, 0);
+        if (endp == cp) {
+            Usage(argv[0]);
+            exit(2);
+        }
+
+        if (RunOne(fileName, cacheSize, &hash) != 0) {
+            result = 1;
+            break;
+        }
+        if (first) {
+            firstHash = hash;
+            first = false;
+        } else if (hash != firstHash) {
+            printf("FAILED: file contents differ with cache size %ld\n",
+                cacheSize);
+            result = 1;
+        }
+
+        cp = endp;
+        if (*cp == ',')
+            cp++;
+    }
+
+    Global::AppCleanup();
+
+    exit(result);
+}
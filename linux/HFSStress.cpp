@@ -0,0 +1,333 @@
+/*
+ * CiderPress
+ * Copyright (C) 2009 by CiderPress authors.  All Rights Reserved.
+ * See the file LICENSE for distribution terms.
+ */
+/*
+ * Stress test for scanning HFS volumes from several threads at once.
+ *
+ * Every image is first scanned on the main thread to get a reference
+ * hash of its file list and contents.  Then a pile of threads scan the
+ * same images over and over, in different orders and with different
+ * cache sizes, and must come up with the same answers.  Each thread also
+ * provokes libhfs errors and checks that it gets its own error back.
+ *
+ * This is most useful when everything is built with -fsanitize=thread.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <assert.h>
+#include <pthread.h>
+#include "../diskimg/DiskImg.h"
+#include "../diskimg/DiskImgDetail.h"
+#include "../nufxlib/NufxLib.h"
+
+using namespace DiskImgLib;
+
+#define nil NULL
+
+struct ImageInfo {
+    const char* pathName;
+    uint32_t    hash;
+    long        numFiles;
+};
+
+ImageInfo* gImages = nil;
+int gNumImages = 0;
+int gNumPasses = 4;
+bool gVerbose = false;
+
+pthread_mutex_t gOutputLock = PTHREAD_MUTEX_INITIALIZER;
+long gNumFailures = 0;
+
+/*
+ * Show library messages if we were asked to.
+ */
+void
+MsgHandler(const char* file, int line, const char* msg)
+{
+    assert(file != nil);
+    assert(msg != nil);
+
+    if (gVerbose)
+        fprintf(stderr, "%s\n", msg);
+}
+
+void
+Usage(const char* argv0)
+{
+    fprintf(stderr, "Usage: %s [-v] [-j threads] [-n passes] image ...\n",
+        argv0);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "  -j  number of threads (default 8)\n");
+    fprintf(stderr, "  -n  times each thread scans each image (default 4)\n");
+    fprintf(stderr, "  -v  show library messages\n");
+}
+
+/*
+ * Report a failure.
+ */
+void
+Fail(const char* pathName, const char* msg, const char* detail)
+{
+    pthread_mutex_lock(&gOutputLock);
+    printf("FAILED: %s: %s%s%s\n", pathName, msg,
+        detail != nil ? ": " : "", detail != nil ? detail : "");
+    gNumFailures++;
+    pthread_mutex_unlock(&gOutputLock);
+}
+
+/*
+ * Simple hash, for comparing results.
+ */
+uint32_t
+HashBuf(uint32_t hash, const void* vbuf, size_t len)
+{
+    const uint8_t* buf = (const uint8_t*) vbuf;
+    while (len--)
+        hash = (hash * 31) + *buf++;
+    return hash;
+}
+
+/*
+ * Hash the names and contents of every file on a volume, including
+ * anything in sub-volumes.
+ */
+DIError
+HashDiskFS(DiskFS* pDiskFS, uint32_t* pHash, long* pNumFiles)
+{
+    A2File* pFile;
+    A2FileDescr* pFD;
+    uint8_t buf[16384];
+    DIError dierr = kDIErrNone;
+
+    pFile = pDiskFS->GetNextFile(nil);
+    for ( ; pFile != nil; pFile = pDiskFS->GetNextFile(pFile)) {
+        *pHash = HashBuf(*pHash, pFile->GetPathName(),
+                    strlen(pFile->GetPathName()));
+        (*pNumFiles)++;
+        if (pFile->IsDirectory() || pFile->IsVolumeDirectory())
+            continue;
+
+        dierr = pFile->Open(&pFD, true);
+        if (dierr != kDIErrNone)
+            return dierr;
+        while (true) {
+            size_t actual;
+            dierr = pFD->Read(buf, sizeof(buf), &actual);
+            if (dierr != kDIErrNone || actual == 0)
+                break;
+            *pHash = HashBuf(*pHash, buf, actual);
+        }
+        pFD->Close();
+        if (dierr != kDIErrNone && dierr != kDIErrEOF)
+            return dierr;
+        dierr = kDIErrNone;
+    }
+
+    DiskFS::SubVolume* pSubVol = pDiskFS->GetNextSubVolume(nil);
+    while (pSubVol != nil) {
+        dierr = HashDiskFS(pSubVol->GetDiskFS(), pHash, pNumFiles);
+        if (dierr != kDIErrNone)
+            break;
+        pSubVol = pDiskFS->GetNextSubVolume(pSubVol);
+    }
+
+    return dierr;
+}
+
+/*
+ * Ask libhfs for files that don't exist, and make sure the errors we get
+ * back are ours.  Returns false on failure.
+ */
+bool
+CheckHFSError(DiskFS* pDiskFS, long threadNum)
+{
+    DiskFSHFS* pHFS = dynamic_cast<DiskFSHFS*>(pDiskFS);
+    hfsdirent dirEntry;
+    char pathName[64];
+
+    if (pHFS != nil) {
+        /* libhfs sets hfs_error to a message for this one... */
+        sprintf(pathName, "NoSuchFile%ld", threadNum);
+        errno = 0;
+        if (hfs_openbyid(pHFS->GetHfsVol(), 0x7fffff00 + threadNum,
+                HFS_CNID_ROOTDIR, pathName) != nil ||
+            errno != ENOENT || hfs_error == nil)
+        {
+            return false;
+        }
+
+        /* ...and to NULL for this one */
+        sprintf(pathName, ":%040ld", threadNum);
+        errno = 0;
+        if (hfs_stat(pHFS->GetHfsVol(), pathName, &dirEntry) == 0 ||
+            errno != ENAMETOOLONG || hfs_error != nil)
+        {
+            return false;
+        }
+    }
+
+    DiskFS::SubVolume* pSubVol = pDiskFS->GetNextSubVolume(nil);
+    while (pSubVol != nil) {
+        if (!CheckHFSError(pSubVol->GetDiskFS(), threadNum))
+            return false;
+        pSubVol = pDiskFS->GetNextSubVolume(pSubVol);
+    }
+    return true;
+}
+
+/*
+ * Open an image and hash everything on it.
+ */
+DIError
+ScanImage(const char* pathName, long cacheSize, long threadNum,
+    uint32_t* pHash, long* pNumFiles)
+{
+    DiskImg diskImg;
+    DiskFS* pDiskFS = nil;
+    DIError dierr;
+
+    *pHash = 0;
+    *pNumFiles = 0;
+
+    dierr = diskImg.OpenImage(pathName, '/', true);
+    if (dierr != kDIErrNone)
+        goto bail;
+    dierr = diskImg.AnalyzeImage();
+    if (dierr != kDIErrNone)
+        goto bail;
+    if (diskImg.GetFSFormat() == DiskImg::kFormatUnknown) {
+        dierr = kDIErrFilesystemNotFound;
+        goto bail;
+    }
+
+    pDiskFS = diskImg.OpenAppropriateDiskFS();
+    if (pDiskFS == nil) {
+        dierr = kDIErrInternal;
+        goto bail;
+    }
+    pDiskFS->SetScanForSubVolumes(DiskFS::kScanSubEnabled);
+    pDiskFS->SetParameter(DiskFS::kParmHFS_CacheSize, cacheSize);
+    dierr = pDiskFS->Initialize(&diskImg, DiskFS::kInitFull);
+    if (dierr != kDIErrNone)
+        goto bail;
+
+    dierr = HashDiskFS(pDiskFS, pHash, pNumFiles);
+    if (dierr != kDIErrNone)
+        goto bail;
+
+    if (threadNum >= 0 && !CheckHFSError(pDiskFS, threadNum))
+        Fail(pathName, "libhfs error was not ours", nil);
+
+bail:
+    delete pDiskFS;
+    return dierr;
+}
+
+/*
+ * Thread entry point.  Scan every image several times, starting at a
+ * different place in the list for each thread.
+ */
+void*
+StressThread(void* vThreadNum)
+{
+    long threadNum = (long) vThreadNum;
+    static const long kCacheSizes[] = { 0, -1, 16, 4096 };
+    const int kNumCacheSizes = sizeof(kCacheSizes) / sizeof(kCacheSizes[0]);
+
+    for (int pass = 0; pass < gNumPasses; pass++) {
+        for (int i = 0; i < gNumImages; i++) {
+            const ImageInfo* pInfo =
+                &gImages[(i + threadNum + pass) % gNumImages];
+            long cacheSize = kCacheSizes[(threadNum + pass) % kNumCacheSizes];
+            uint32_t hash;
+            long numFiles;
+            DIError dierr;
+
+            dierr = ScanImage(pInfo->pathName, cacheSize, threadNum,
+                        &hash, &numFiles);
+            if (dierr != kDIErrNone)
+                Fail(pInfo->pathName, "scan failed", DIStrError(dierr));
+            else if (hash != pInfo->hash || numFiles != pInfo->numFiles)
+                Fail(pInfo->pathName, "results differ", nil);
+        }
+    }
+
+    return nil;
+}
+
+int
+main(int argc, char** argv)
+{
+    pthread_t* threads;
+    long numThreads = 8;
+    int ic;
+
+    while ((ic = getopt(argc, argv, "j:n:v")) != -1) {
+        switch (ic) {
+        case 'j':
+            numThreads = strtol(optarg, nil, 0);
+            break;
+        case 'n':
+            gNumPasses = (int) strtol(optarg, nil, 0);
+            break;
+        case 'v':
+            gVerbose = true;
+            break;
+        default:
+            Usage(argv[0]);
+            exit(2);
+        }
+    }
+    if (optind == argc || numThreads <= 0 || gNumPasses <= 0) {
+        Usage(argv[0]);
+        exit(2);
+    }
+
+    Global::SetDebugMsgHandler(MsgHandler);
+    Global::AppInit();
+
+    gNumImages = argc - optind;
+    gImages = new ImageInfo[gNumImages];
+    for (int i = 0; i < gNumImages; i++) {
+        DIError dierr;
+
+        gImages[i].pathName = argv[optind + i];
+        dierr = ScanImage(gImages[i].pathName, 0, -1, &gImages[i].hash,
+                    &gImages[i].numFiles);
+        if (dierr != kDIErrNone) {
+            fprintf(stderr, "%s: %s\n", gImages[i].pathName,
+                DIStrError(dierr));
+            exit(1);
+        }
+        printf("%s: %ld files\n", gImages[i].pathName, gImages[i].numFiles);
+    }
+
+    printf("Scanning %d images %d times each on %ld threads\n",
+        gNumImages, gNumPasses, numThreads);
+
+    threads = new pthread_t[numThreads];
+    for (long i = 0; i < numThreads; i++) {
+        if (pthread_create(&threads[i], nil, StressThread, (void*) i) != 0) {
+            fprintf(stderr, "ERROR: unable to create thread\n");
+            exit(1);
+        }
+    }
+    for (long i = 0; i < numThreads; i++)
+        pthread_join(threads[i], nil);
+    delete[] threads;
+
+    if (gNumFailures == 0)
+        printf("All results match\n");
+    else
+        printf("%ld failures\n", gNumFailures);
+
+    delete[] gImages;
+    Global::AppCleanup();
+
+    exit(gNumFailures == 0 ? 0 : 1);
+}
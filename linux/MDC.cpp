@@ -64,6 +64,10 @@ struct Stats {
 
 typedef struct ScanOpts {
     FILE*   outfp;
+    FILE*   statsfp;        // JSON stats go here, if non-nil
+    long    numStats;       // #of entries written to statsfp
+    long    numThreads;     // partitions opened at once; 0=auto
+    bool    catalogOnly;    // just the catalog; no damage or sparse info
 } ScanOpts;
 
 typedef enum RecordKind {
@@ -198,9 +202,12 @@ FindExtension(const char* pathname, char fssep)
 
 /*
  * Analyze a file's characteristics.
+ *
+ * If "catalogOnly" is set, the sparse lengths aren't looked at, since
+ * they would force the full volume scan.
  */
 void
-AnalyzeFile(const A2File* pFile, RecordKind* pRecordKind,
+AnalyzeFile(const A2File* pFile, bool catalogOnly, RecordKind* pRecordKind,
     unsigned long* pTotalLen, unsigned long* pTotalCompLen)
 {
     if (pFile->IsVolumeDirectory()) {
@@ -219,13 +226,20 @@ AnalyzeFile(const A2File* pFile, RecordKind* pRecordKind,
         /* has resource fork */
         *pRecordKind = kRecordKindForkedFile;
         *pTotalLen = pFile->GetDataLength() + pFile->GetRsrcLength();
-        *pTotalCompLen =
-            pFile->GetDataSparseLength() + pFile->GetRsrcSparseLength();
+        if (catalogOnly) {
+            *pTotalCompLen = *pTotalLen;
+        } else {
+            *pTotalCompLen =
+                pFile->GetDataSparseLength() + pFile->GetRsrcSparseLength();
+        }
     } else {
         /* just data fork */
         *pRecordKind = kRecordKindFile;
         *pTotalLen = pFile->GetDataLength();
-        *pTotalCompLen = pFile->GetDataSparseLength();
+        if (catalogOnly)
+            *pTotalCompLen = *pTotalLen;
+        else
+            *pTotalCompLen = pFile->GetDataSparseLength();
     }
 }
 
@@ -332,7 +346,8 @@ LoadDiskFSContents(DiskFS* pDiskFS, const char* volName,
         unsigned long totalLen, totalCompLen;
         char tmpbuf[16];
 
-        AnalyzeFile(pFile, &recordKind, &totalLen, &totalCompLen);
+        AnalyzeFile(pFile, pScanOpts->catalogOnly, &recordKind, &totalLen,
+            &totalCompLen);
         if (recordKind == kRecordKindVolumeDirectory) {
             /* skip these */
             pFile = pDiskFS->GetNextFile(pFile);
@@ -478,8 +493,12 @@ LoadDiskFSContents(DiskFS* pDiskFS, const char* volName,
             fmtStr = "???   ";
             break;
         }
-        if (pFile->GetQuality() == A2File::kQualityDamaged)
+        /* in catalog mode, only show what the catalog scan found */
+        if ((pScanOpts->catalogOnly ? pFile->GetKnownQuality() :
+                pFile->GetQuality()) == A2File::kQualityDamaged)
+        {
             fmtStr = "BROKEN";
+        }
 
         fprintf(pScanOpts->outfp, "%s ", fmtStr);
 
@@ -527,6 +546,132 @@ LoadDiskFSContents(DiskFS* pDiskFS, const char* volName,
     return 0;
 }
 
+/*
+ * Write a string as a JSON string literal.
+ */
+void
+PrintJSONString(FILE* fp, const char* str)
+{
+    putc('"', fp);
+    for ( ; *str != '\0'; str++) {
+        unsigned char uch = (unsigned char) *str;
+        if (uch == '"' || uch == '\\')
+            fprintf(fp, "\\%c", uch);
+        else if (uch < 0x20)
+            fprintf(fp, "\\u%04x", uch);
+        else
+            putc(uch, fp);
+    }
+    putc('"', fp);
+}
+
+/*
+ * Add the counters from all sub-volumes of a DiskFS into "counters".
+ * Phase times aren't included, because the sub-volume phases happen
+ * inside the parent's DiskFS init.
+ */
+void
+SumSubVolumeCounters(const DiskFS* pDiskFS, uint64_t* counters)
+{
+    DiskFS::SubVolume* pSubVol = pDiskFS->GetNextSubVolume(nil);
+    while (pSubVol != nil) {
+        const DiskImgStats* pStats = pSubVol->GetDiskImg()->GetStats();
+        if (pStats != nil) {
+            for (int i = 0; i < DiskImgStats::kCounterMAX; i++)
+                counters[i] += pStats->GetCounter((DiskImgStats::Counter) i);
+        }
+        SumSubVolumeCounters(pSubVol->GetDiskFS(), counters);
+        pSubVol = pDiskFS->GetNextSubVolume(pSubVol);
+    }
+}
+
+/*
+ * Add up the block cache stats for a DiskFS and all of its sub-volumes.
+ * Returns false if none of them have a cache.
+ */
+bool
+SumCacheStats(const DiskFS* pDiskFS, DiskFS::CacheStats* pTotal)
+{
+    DiskFS::CacheStats stats;
+    bool found = false;
+
+    if (pDiskFS->GetCacheStats(&stats) == kDIErrNone) {
+        pTotal->size += stats.size;
+        pTotal->hits += stats.hits;
+        pTotal->misses += stats.misses;
+        pTotal->evictions += stats.evictions;
+        pTotal->bypassed += stats.bypassed;
+        found = true;
+    }
+
+    DiskFS::SubVolume* pSubVol = pDiskFS->GetNextSubVolume(nil);
+    while (pSubVol != nil) {
+        if (SumCacheStats(pSubVol->GetDiskFS(), pTotal))
+            found = true;
+        pSubVol = pDiskFS->GetNextSubVolume(pSubVol);
+    }
+    return found;
+}
+
+/*
+ * Write the stats for one disk image as a JSON object.
+ */
+void
+PrintImageStats(ScanOpts* pScanOpts, const char* pathName,
+    const DiskImg* pDiskImg, const DiskFS* pDiskFS, uint64_t totalMicros,
+    bool success)
+{
+    FILE* fp = pScanOpts->statsfp;
+    const DiskImgStats* pStats = pDiskImg->GetStats();
+    uint64_t counters[DiskImgStats::kCounterMAX];
+    int i;
+
+    if (pStats == nil)
+        return;
+
+    for (i = 0; i < DiskImgStats::kCounterMAX; i++)
+        counters[i] = pStats->GetCounter((DiskImgStats::Counter) i);
+    if (pDiskFS != nil)
+        SumSubVolumeCounters(pDiskFS, counters);
+
+    fprintf(fp, "%s\n  { \"path\": ", pScanOpts->numStats == 0 ? "" : ",");
+    PrintJSONString(fp, pathName);
+    fprintf(fp, ", \"success\": %s, \"format\": ",
+        success ? "true" : "false");
+    PrintJSONString(fp, DiskImg::ToString(pDiskImg->GetFSFormat()));
+    fprintf(fp, ",\n    \"totalMicros\": %llu,\n    \"phases\": {",
+        (unsigned long long) totalMicros);
+    for (i = 0; i < DiskImgStats::kPhaseMAX; i++) {
+        DiskImgStats::Phase phase = (DiskImgStats::Phase) i;
+        fprintf(fp, "%s\n      \"%s\": { \"micros\": %llu, \"count\": %ld }",
+            i == 0 ? "" : ",", DiskImgStats::ToString(phase),
+            (unsigned long long) pStats->GetPhaseMicros(phase),
+            pStats->GetPhaseCount(phase));
+    }
+    fprintf(fp, "\n    },\n    \"counters\": {");
+    for (i = 0; i < DiskImgStats::kCounterMAX; i++) {
+        fprintf(fp, "%s\n      \"%s\": %llu", i == 0 ? "" : ",",
+            DiskImgStats::ToString((DiskImgStats::Counter) i),
+            (unsigned long long) counters[i]);
+    }
+    fprintf(fp, "\n    }");
+
+    DiskFS::CacheStats cacheStats;
+    memset(&cacheStats, 0, sizeof(cacheStats));
+    if (pDiskFS != nil && SumCacheStats(pDiskFS, &cacheStats)) {
+        fprintf(fp, ",\n    \"cache\": { \"size\": %ld, \"hits\": %llu,"
+                    " \"misses\": %llu, \"evictions\": %llu,"
+                    " \"bypassed\": %llu }",
+            cacheStats.size,
+            (unsigned long long) cacheStats.hits,
+            (unsigned long long) cacheStats.misses,
+            (unsigned long long) cacheStats.evictions,
+            (unsigned long long) cacheStats.bypassed);
+    }
+    fprintf(fp, "\n  }");
+    pScanOpts->numStats++;
+}
+
 /*
  * Open a disk image and dump the contents.
  *
@@ -543,7 +688,9 @@ ScanDiskImage(const char* pathName, ScanOpts* pScanOpts)
     char errMsg[256] = "";
     DiskImg diskImg;
     DiskFS* pDiskFS = nil;
+    uint64_t startWhen = DiskImgStats::GetMonotonicMicros();
 
+    diskImg.SetStatsEnabled(pScanOpts->statsfp != nil);
     dierr = diskImg.OpenImage(pathName, '/', true);
     if (dierr != kDIErrNone) {
         snprintf(errMsg, sizeof(errMsg), "Unable to open '%s': %s",
@@ -577,9 +724,16 @@ ScanDiskImage(const char* pathName, ScanOpts* pScanOpts)
     }
 
     pDiskFS->SetScanForSubVolumes(DiskFS::kScanSubEnabled);
+    pDiskFS->SetParameter(DiskFS::kParm_SubVolumeThreads,
+        pScanOpts->numThreads);
 
-    /* object created; prep it */
-    dierr = pDiskFS->Initialize(&diskImg, DiskFS::kInitFull);
+    /*
+     * Object created; prep it.  A catalog-only scan skips the sub-volume
+     * scan, the damage checks, and the volume usage map, which is most of
+     * the work on a big volume.
+     */
+    dierr = pDiskFS->Initialize(&diskImg,
+        pScanOpts->catalogOnly ? DiskFS::kInitCatalogOnly : DiskFS::kInitFull);
     if (dierr != kDIErrNone) {
         snprintf(errMsg, sizeof(errMsg),
             "Error reading list of files from disk: %s", DIStrError(dierr));
@@ -597,7 +751,8 @@ ScanDiskImage(const char* pathName, ScanOpts* pScanOpts)
     else
         kbytes = 0;
     fprintf(pScanOpts->outfp, "Disk: %s%s (%dKB)\n", pDiskFS->GetVolumeID(),
-        pDiskFS->GetFSDamaged() ? " [*]" : "", kbytes);
+        !pScanOpts->catalogOnly && pDiskFS->GetFSDamaged() ? " [*]" : "",
+        kbytes);
 
     fprintf(pScanOpts->outfp,
         " Name                             Type Auxtyp Modified"
@@ -617,6 +772,10 @@ ScanDiskImage(const char* pathName, ScanOpts* pScanOpts)
     gStats.goodDiskImages++;
 
 bail:
+    if (pScanOpts->statsfp != nil) {
+        PrintImageStats(pScanOpts, pathName, &diskImg, pDiskFS,
+            DiskImgStats::GetMonotonicMicros() - startWhen, errMsg[0] == '\0');
+    }
     delete pDiskFS;
 
     if (errMsg[0] != '\0') {
@@ -833,6 +992,10 @@ main(int argc, char** argv)
 {
     ScanOpts scanOpts;
     scanOpts.outfp = stdout;
+    scanOpts.statsfp = nil;
+    scanOpts.numStats = 0;
+    scanOpts.numThreads = 0;
+    scanOpts.catalogOnly = false;
 
 #ifdef _DEBUG
     const char* kLogFile = "mdc-log.txt";
@@ -854,8 +1017,36 @@ main(int argc, char** argv)
     printf("Linked against NufxLib v%d.%d.%d and zlib version %s.\n",
         major, minor, bug, zlibVersion());
 
-    if (argc == 1) {
-        fprintf(stderr, "\nUsage: mdc file ...\n");
+    while (argc > 2 && strncmp(argv[1], "--", 2) == 0) {
+        if (strcmp(argv[1], "--catalog") == 0) {
+            scanOpts.catalogOnly = true;
+            argc--;
+            argv++;
+            continue;
+        }
+        if (strcmp(argv[1], "--stats") == 0 && scanOpts.statsfp == nil) {
+            if (strcmp(argv[2], "-") == 0)
+                scanOpts.statsfp = stdout;
+            else
+                scanOpts.statsfp = fopen(argv[2], "w");
+            if (scanOpts.statsfp == nil) {
+                fprintf(stderr, "ERROR: unable to create '%s': %s\n",
+                    argv[2], strerror(errno));
+                goto done;
+            }
+        } else if (strcmp(argv[1], "--threads") == 0) {
+            scanOpts.numThreads = strtol(argv[2], nil, 0);
+        } else {
+            break;
+        }
+        argc -= 2;
+        argv += 2;
+    }
+
+    if (argc == 1 || strncmp(argv[1], "--", 2) == 0) {
+        fprintf(stderr,
+            "\nUsage: mdc [--catalog] [--stats file.json] [--threads N] "
+            "file ...\n");
         goto done;
     }
 
@@ -873,10 +1064,19 @@ main(int argc, char** argv)
     start = time(NULL);
     printf("Run started at %.24s\n\n", ctime(&start));
 
+    if (scanOpts.statsfp != nil)
+        fprintf(scanOpts.statsfp, "[");
+
     while (--argc) {
         ProcessFile(*++argv, &scanOpts);
     }
 
+    if (scanOpts.statsfp != nil) {
+        fprintf(scanOpts.statsfp, "\n]\n");
+        if (scanOpts.statsfp != stdout)
+            fclose(scanOpts.statsfp);
+    }
+
     printf("Scan completed in %ld seconds:\n", time(NULL) - start);
     printf("  Directories : %ld\n", gStats.numDirectories);
     printf("  Files       : %ld (%ld good disk images)\n", gStats.numFiles,
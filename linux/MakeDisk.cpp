@@ -78,151 +78,175 @@ CreateDisk(const char* fileName, long blockCount)
 }
 
 /*
- * Copy files to the disk.
+ * Copy the contents of a host file into an open file on the disk image.
+ *
+ * The data is passed through in pieces, so large files don't need to be
+ * loaded into memory.
+ *
+ * Returns 0 on success, -1 on failure.
  */
 int
-CopyFiles(DiskFS* pDiskFS, int argc, char** argv)
+CopyFileData(const char* fileName, A2FileDescr* pFD)
 {
     DIError dierr;
-    DiskFS::CreateParms parms;
-    A2File* pNewFile;
+    struct stat sb;
+    FILE* fp;
+    char buf[65536];
+    size_t count;
+
+    fp = fopen(fileName, "r");
+    if (fp == nil) {
+        fprintf(stderr, "ERROR: unable to open input file '%s': %s\n",
+            fileName, strerror(errno));
+        return -1;
+    }
 
-    struct CreateParms {
-        const char*     pathName;       // full pathname
-        char            fssep;
-        int             storageType;    // determines normal, subdir, or forked
-        long            fileType;
-        long            auxType;
-        int             access;
-        time_t          createWhen;
-        time_t          modWhen;
-    };
+    if (fstat(fileno(fp), &sb) == 0)
+        pFD->SetSizeHint(sb.st_size);
 
+    while ((count = fread(buf, 1, sizeof(buf), fp)) != 0) {
+        dierr = pFD->Write(buf, count);
+        if (dierr != kDIErrNone) {
+            fprintf(stderr, "ERROR: failed writing to '%s': %s\n",
+                pFD->GetFile()->GetPathName(), DIStrError(dierr));
+            fclose(fp);
+            return -1;
+        }
+    }
+    if (ferror(fp)) {
+        fprintf(stderr, "ERROR: read from '%s' failed: %s\n",
+            fileName, strerror(errno));
+        fclose(fp);
+        return -1;
+    }
 
-    argv--;
-    while (argc--) {
-        argv++;
+    fclose(fp);
+    return 0;
+}
 
+/*
+ * Copy files to the disk.
+ *
+ * All of the files are created in one CreateFiles call, which is a lot
+ * faster than creating them one at a time when there are thousands of
+ * them.  Then we go back and fill them in.
+ *
+ * If CreateFiles stops partway (e.g. the directory is full), the files it
+ * did create are still filled in before we report the error.  If filling
+ * a file fails, it and every created file after it are deleted, so we
+ * never leave empty files behind.
+ */
+int
+CopyFiles(DiskFS* pDiskFS, int argc, char** argv)
+{
+    DIError dierr;
+    DiskFS::CreateParms* parmsList;
+    const char** inputNames;
+    A2File** newFiles;
+    int count = 0;
+    int created = 0;
+    int filled = 0;
+    int result = -1;
+
+    parmsList = new DiskFS::CreateParms[argc];
+    inputNames = new const char*[argc];
+    newFiles = new A2File*[argc];
+
+    for (int i = 0; i < argc; i++) {
         // Confirm this is a regular file, and not a directory.
         struct stat sb;
-        if (stat(*argv, &sb) != 0) {
-            fprintf(stderr, "Warning: unable to stat '%s'\n", *argv);
+        if (stat(argv[i], &sb) != 0) {
+            fprintf(stderr, "Warning: unable to stat '%s'\n", argv[i]);
             continue;
         }
         if ((sb.st_mode & S_IFREG) == 0) {
-            printf("--- Skipping '%s'\n", *argv);
+            printf("--- Skipping '%s'\n", argv[i]);
             continue;
         }
 
-        printf("+++ Adding '%s'\n", *argv);
-
         /*
          * Use external pathname as internal pathname.  This isn't quite
          * right, since things like "../" will end up getting converted
          * to something we don't want, but it'll do for now.
          */
-        parms.pathName = *argv;
-        parms.fssep = '/';      // UNIX fssep
-        parms.storageType = DiskFS::kStorageSeedling;   // not forked, not dir
-        parms.fileType = 0;     // NON
-        parms.auxType = 0;      // $0000
-        parms.access = DiskFS::kFileAccessUnlocked;
-        parms.createWhen = time(nil);
-        parms.modWhen = time(nil);
-
-        /*
-         * Create a new, empty file.  The "pNewFile" pointer does not belong
-         * to us, so we should not delete it later, or try to access it
-         * after the underlying file is deleted.
-         */
-        dierr = pDiskFS->CreateFile(&parms, &pNewFile);
-        if (dierr != kDIErrNone) {
-            fprintf(stderr, "ERROR: unable to create '%s': %s\n",
-                *argv, DIStrError(dierr));
-            return -1;
-        }
-
-        /*
-         * Load the input file into memory.
-         */
-        FILE* fp;
-        char* buf;
-        long len;
-
-        fp = fopen(*argv, "r");
-        if (fp == nil) {
-            fprintf(stderr, "ERROR: unable to open input file '%s': %s\n",
-                *argv, strerror(errno));
-            return -1;
-        }
+        DiskFS::CreateParms* pParms = &parmsList[count];
+        pParms->pathName = argv[i];
+        pParms->fssep = '/';    // UNIX fssep
+        pParms->storageType = DiskFS::kStorageSeedling; // not forked, not dir
+        pParms->fileType = 0;   // NON
+        pParms->auxType = 0;    // $0000
+        pParms->access = DiskFS::kFileAccessUnlocked;
+        pParms->createWhen = time(nil);
+        pParms->modWhen = time(nil);
+        inputNames[count] = argv[i];
+        count++;
+    }
 
-        if (fseek(fp, 0, SEEK_END) != 0) {
-            fprintf(stderr, "ERROR: unable to seek input file '%s': %s\n",
-                *argv, strerror(errno));
-            fclose(fp);
-            return -1;
-        }
+    /*
+     * Create new, empty files.  The "newFiles" pointers do not belong
+     * to us, so we should not delete them later, or try to access them
+     * after the underlying files are deleted.
+     */
+    dierr = pDiskFS->CreateFiles(parmsList, count, newFiles);
+    while (created < count && newFiles[created] != nil)
+        created++;
 
-        len = ftell(fp);
-        if (len >= 1L<<31) {    // 2GB
-            fprintf(stderr, "Warning: file '%s' too large, skipping\n", *argv);
-            fclose(fp);
-            continue;
-        }
-        rewind(fp);
+    for (filled = 0; filled < created; filled++) {
+        A2File* pNewFile = newFiles[filled];
+        DIError copyErr;
 
-        buf = new char[len];
-        if (buf == nil) {
-            fprintf(stderr, "ERROR: unable to alloc %ld bytes\n", len);
-            fclose(fp);
-            return -1;
-        }
-
-        if (fread(buf, len, 1, fp) != 1) {
-            fprintf(stderr, "ERROR: fread of %ld bytes from '%s' failed: %s\n",
-                len, *argv, strerror(errno));
-            fclose(fp);
-            delete[] buf;
-            return -1;
-        }
-        fclose(fp);
+        printf("+++ Adding '%s'\n", inputNames[filled]);
 
         /*
-         * Write the buffer to the disk image.
+         * Copy the file's contents to the disk image.
          *
          * The A2FileDescr object is created by "Open" and deleted by
          * "Close".
          */
         A2FileDescr* pFD;
 
-        dierr = pNewFile->Open(&pFD, true);
-        if (dierr != kDIErrNone) {
+        copyErr = pNewFile->Open(&pFD, true);
+        if (copyErr != kDIErrNone) {
             fprintf(stderr, "ERROR: unable to open new file '%s': %s\n",
-                pNewFile->GetPathName(), DIStrError(dierr));
-            delete[] buf;
-            return -1;
+                pNewFile->GetPathName(), DIStrError(copyErr));
+            goto bail;
         }
 
-        dierr = pFD->Write(buf, len);
-        if (dierr != kDIErrNone) {
-            fprintf(stderr, "ERROR: failed writing to '%s': %s\n",
-                pNewFile->GetPathName(), DIStrError(dierr));
+        if (CopyFileData(inputNames[filled], pFD) != 0) {
             pFD->Close();
-            pDiskFS->DeleteFile(pNewFile);
-            delete[] buf;
-            return -1;
+            goto bail;
         }
-        delete[] buf;
 
-        dierr = pFD->Close();
-        if (dierr != kDIErrNone) {
+        copyErr = pFD->Close();
+        if (copyErr != kDIErrNone) {
             fprintf(stderr, "ERROR: failed while closing '%s': %s\n",
-                pNewFile->GetPathName(), DIStrError(dierr));
-            return -1;
+                pNewFile->GetPathName(), DIStrError(copyErr));
+            goto bail;
         }
     }
 
-    return 0;
+    if (dierr != kDIErrNone) {
+        fprintf(stderr, "ERROR: unable to create '%s': %s\n",
+            created < count ? inputNames[created] : "(unknown)",
+            DIStrError(dierr));
+        goto bail;
+    }
+
+    result = 0;
+
+bail:
+    /* don't leave empty files behind */
+    for (int i = created - 1; i >= filled; i--) {
+        DIError delErr = pDiskFS->DeleteFile(newFiles[i]);
+        if (delErr != kDIErrNone) {
+            fprintf(stderr, "ERROR: unable to remove partial file '%s': %s\n",
+                inputNames[i], DIStrError(delErr));
+        }
+    }
+    delete[] parmsList;
+    delete[] inputNames;
+    delete[] newFiles;
+    return result;
 }
 
 /*
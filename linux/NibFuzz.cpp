@@ -0,0 +1,480 @@
+/*
+ * CiderPress
+ * Copyright (C) 2009 by CiderPress authors.  All Rights Reserved.
+ * See the file LICENSE for distribution terms.
+ */
+/*
+ * Fuzz test for the nibble encoders and decoders.
+ *
+ * The fast 6&2 and 5&3 kernels are run side by side with the byte-at-a-time
+ * reference versions on random data, and must agree bit for bit.  The same
+ * goes for the 3.5" track decoder, which is also run on whole disks with
+ * several threads.  Run it with a few different seeds after changing
+ * anything in Nibble.cpp or Nibble35.cpp.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <assert.h>
+#include "../diskimg/DiskImg.h"
+#include "../diskimg/TestHooks.h"
+#include "../nufxlib/NufxLib.h"
+
+using namespace DiskImgLib;
+
+#define nil NULL
+
+FILE* gLog = nil;
+pid_t gPid = getpid();
+bool gVerbose = false;
+
+/*
+ * Show library messages if we were asked to.  The reference decoders
+ * complain about every bad checksum, so this is noisy.
+ */
+void
+MsgHandler(const char* file, int line, const char* msg)
+{
+    assert(file != nil);
+    assert(msg != nil);
+
+    if (gVerbose)
+        fprintf(stderr, "%s\n", msg);
+}
+
+void
+Usage(const char* argv0)
+{
+    fprintf(stderr, "Usage: %s [-v] [-n iterations] [-s seed]\n", argv0);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "  -n  number of sectors and tracks to test (default 100000)\n");
+    fprintf(stderr, "  -s  random seed (default: based on the time)\n");
+    fprintf(stderr, "  -v  show library messages\n");
+}
+
+/*
+ * Simple xorshift generator, so the test is repeatable for a given seed.
+ */
+uint32_t
+NextRand(uint32_t* pState)
+{
+    uint32_t val = *pState;
+    val ^= val << 13;
+    val ^= val >> 17;
+    val ^= val << 5;
+    *pState = val;
+    return val;
+}
+
+/*
+ * Run the 6&2 and 5&3 encoders and decoders against the reference
+ * versions with random sector data, checksum seeds, track lengths, and
+ * starting offsets (so the field frequently wraps around the end of the
+ * track).  Each encoded field is then damaged in a few places and decoded
+ * again, which exercises the bad-checksum and invalid-byte paths.
+ *
+ * Returns kDIErrNone if everything matched bit for bit.
+ */
+DIError
+TestNibbleCodecs(long iterations, uint32_t seed)
+{
+    const int kMaxTrackLen = kTrackLenNb2525;
+    uint8_t* fastTrack = nil;
+    uint8_t* refTrack = nil;
+    uint8_t sector[256], fastSct[256], refSct[256];
+    DiskImg::NibbleDescr descr;
+    DIError dierr = kDIErrNone;
+    uint32_t state = seed != 0 ? seed : 1;
+    long iter;
+
+    fastTrack = new uint8_t[kMaxTrackLen];
+    refTrack = new uint8_t[kMaxTrackLen];
+
+    descr = *DiskImg::GetStdNibbleDescr(DiskImg::kNibbleDescrDOS33Std);
+
+    for (iter = 0; iter < iterations; iter++) {
+        bool is62 = (iter & 0x01) == 0;
+        const char* encName = is62 ? "6&2" : "5&3";
+        int dataSize, trackLen, idx, i;
+        DIError fastErr, refErr;
+
+        descr.encoding = is62 ? DiskImg::kNibbleEnc62 : DiskImg::kNibbleEnc53;
+        dataSize = TestHooks::GetNibbleDataSize(descr.encoding);
+        descr.dataChecksumSeed = NextRand(&state) & (is62 ? 0x3f : 0x1f);
+        if ((NextRand(&state) & 0x07) == 0)
+            descr.dataChecksumSeed = 0;
+        descr.dataVerifyChecksum = (NextRand(&state) & 0x03) != 0;
+
+        trackLen = dataSize + NextRand(&state) % (kMaxTrackLen - dataSize + 1);
+        idx = NextRand(&state) % trackLen;
+        if ((NextRand(&state) & 0x03) == 0)
+            idx = trackLen - 1 - NextRand(&state) % dataSize;  // force a wrap
+
+        for (i = 0; i < 256; i++)
+            sector[i] = (uint8_t) NextRand(&state);
+        for (i = 0; i < trackLen; i++)
+            fastTrack[i] = refTrack[i] = (uint8_t) NextRand(&state);
+
+        TestHooks::EncodeNibble(false, fastTrack, trackLen, idx, sector, &descr);
+        TestHooks::EncodeNibble(true, refTrack, trackLen, idx, sector, &descr);
+        if (memcmp(fastTrack, refTrack, trackLen) != 0) {
+            printf("  encode mismatch (iter=%ld enc=%s)\n", iter, encName);
+            dierr = kDIErrInternal;
+            goto bail;
+        }
+
+        /*
+         * Decode the clean field, then decode it again after stomping on
+         * 0-3 bytes.  The replacement is usually a valid disk byte, which
+         * yields a checksum error rather than an invalid byte.
+         */
+        for (int pass = 0; pass < 2; pass++) {
+            if (pass == 1) {
+                int numBad = NextRand(&state) % 4;
+                for (i = 0; i < numBad; i++) {
+                    uint8_t val;
+                    if ((NextRand(&state) & 0x03) == 0)
+                        val = (uint8_t) NextRand(&state);
+                    else
+                        val = TestHooks::GetDiskByte(descr.encoding,
+                                NextRand(&state));
+                    fastTrack[(idx + NextRand(&state) % dataSize) % trackLen] =
+                        val;
+                }
+            }
+
+            memset(fastSct, 0xe5, sizeof(fastSct));
+            memset(refSct, 0xe5, sizeof(refSct));
+            fastErr = TestHooks::DecodeNibble(false, fastTrack, trackLen, idx,
+                        fastSct, &descr);
+            refErr = TestHooks::DecodeNibble(true, fastTrack, trackLen, idx,
+                        refSct, &descr);
+            if (fastErr != refErr ||
+                memcmp(fastSct, refSct, sizeof(fastSct)) != 0)
+            {
+                printf("  decode mismatch (iter=%ld enc=%s pass=%d "
+                       "err=%d/%d)\n", iter, encName, pass, fastErr, refErr);
+                dierr = kDIErrInternal;
+                goto bail;
+            }
+            if (pass == 0 && (fastErr != kDIErrNone ||
+                memcmp(fastSct, sector, sizeof(sector)) != 0))
+            {
+                printf("  round trip failed (iter=%ld enc=%s)\n",
+                    iter, encName);
+                dierr = kDIErrInternal;
+                goto bail;
+            }
+        }
+    }
+
+bail:
+    delete[] fastTrack;
+    delete[] refTrack;
+    return dierr;
+}
+
+/*
+ * 3.5" disk geometry and GCR format, for building test tracks.
+ */
+const int kCylindersPerDisk = 80;
+const int kHeadsPerCylinder = 2;
+const int kNumTracks35 = kCylindersPerDisk * kHeadsPerCylinder;
+const int kNumBlocks35 = 1600;
+const int kMaxSectorsPerTrack = 12;
+const int kSectorSize35 = 524;      // 512 data bytes + 12 tag bytes
+const int kTagBytesLen = 12;
+const int kNibblizedOutputLen = 703;    // 699 data + 4 checksum
+const int kAddrFieldLen = 10;       // prolog through epilog
+const int kMaxDataReach = 48;       // how far the decoders look for data
+const int kMaxTrackLen35 = 10240;   // same as WrapperFDI's buffers
+
+/*
+ * Append a sector, address field through data epilog, to a 3.5" track.
+ */
+long
+AddSector35(uint8_t* track, long len, int cyl, int head, int sect,
+    const uint8_t* sectorData, int gap1, int gap2)
+{
+    int side = (head * 0x20) | (cyl >> 6);
+    const DiskImg::NibbleEnc enc = DiskImg::kNibbleEnc62;
+
+    memset(track + len, 0xff, gap1);
+    len += gap1;
+    track[len++] = 0xd5;
+    track[len++] = 0xaa;
+    track[len++] = 0x96;
+    track[len++] = TestHooks::GetDiskByte(enc, cyl & 0x3f);
+    track[len++] = TestHooks::GetDiskByte(enc, sect);
+    track[len++] = TestHooks::GetDiskByte(enc, side);
+    track[len++] = TestHooks::GetDiskByte(enc, 0x22);
+    track[len++] = TestHooks::GetDiskByte(enc,
+                    (cyl & 0x3f) ^ sect ^ side ^ 0x22);
+    track[len++] = 0xde;
+    track[len++] = 0xaa;
+    memset(track + len, 0xff, gap2);
+    len += gap2;
+    track[len++] = 0xd5;
+    track[len++] = 0xaa;
+    track[len++] = 0xad;
+    track[len++] = TestHooks::GetDiskByte(enc, sect);
+    TestHooks::EncodeNibbleSector35(sectorData, track + len);
+    len += kNibblizedOutputLen;
+    track[len++] = 0xde;
+    track[len++] = 0xaa;
+    track[len++] = 0xff;
+    return len;
+}
+
+/*
+ * Run the 3.5" track decoder against the reference version on randomly
+ * generated tracks.  The sectors are written in a random order with random
+ * gaps, and the track is rotated so they often wrap around the end.  Most
+ * tracks are then damaged: sectors go missing or appear twice, the gap
+ * before the data field grows too long, and random bytes are stomped on.
+ * Now and then the track is just a short run of junk.
+ *
+ * Track N of the test goes on cylinder (N % 160) / 2.  Every 160 tracks
+ * the whole "disk" is run through the parallel decoder with a random
+ * number of threads and compared against the per-track results.
+ *
+ * Returns kDIErrNone if everything matched bit for bit.
+ */
+DIError
+TestNibbleTracks35(long iterations, uint32_t seed)
+{
+    const int kTrackOutLen = kMaxSectorsPerTrack * kBlockSize;
+    uint8_t* diskNibbles = nil;
+    long* diskLens = nil;
+    uint8_t* diskRefOut = nil;
+    uint8_t* diskFastOut = nil;
+    uint8_t* tmpTrack = nil;
+    bool* diskRefBad = nil;
+    bool* diskFastBad = nil;
+    bool* fastBad = nil;
+    bool* refBad = nil;
+    uint8_t expected[kTrackOutLen];
+    uint8_t fastOut[kTrackOutLen];
+    uint8_t sectorData[kSectorSize35];
+    DIError dierr = kDIErrNone;
+    uint32_t state = seed != 0 ? seed : 1;
+    long iter;
+
+    diskNibbles = new uint8_t[kNumTracks35 * kMaxTrackLen35];
+    diskLens = new long[kNumTracks35];
+    diskRefOut = new uint8_t[kNumBlocks35 * kBlockSize];
+    diskFastOut = new uint8_t[kNumBlocks35 * kBlockSize];
+    tmpTrack = new uint8_t[kMaxTrackLen35];
+    diskRefBad = new bool[kNumBlocks35];
+    diskFastBad = new bool[kNumBlocks35];
+    fastBad = new bool[kNumBlocks35];
+    refBad = new bool[kNumBlocks35];
+
+    for (iter = 0; iter < iterations; iter++) {
+        int trk = (int) (iter % kNumTracks35);
+        int cyl = trk / kHeadsPerCylinder;
+        int head = trk % kHeadsPerCylinder;
+        int numSect = DiskImg::SectorsPerTrack35(cyl);
+        int firstBlock = DiskImg::CylHeadSect35ToBlock(cyl, head, 0);
+        uint8_t* track = diskNibbles + trk * kMaxTrackLen35;
+        uint8_t* refOut = diskRefOut + firstBlock * kBlockSize;
+        bool damage = (NextRand(&state) & 0x01) != 0;
+        bool junk = (NextRand(&state) & 0x1f) == 0;
+        int order[kMaxSectorsPerTrack];
+        long len = 0;
+        int i, j;
+
+        if (trk == 0)
+            memset(diskRefBad, 0, kNumBlocks35 * sizeof(bool));
+
+        if (junk) {
+            /* a short run of junk, with some address prologs mixed in */
+            len = 1 + NextRand(&state) % 1500;
+            for (i = 0; i < len; i++) {
+                if ((NextRand(&state) & 0x0f) == 0 && i + 3 <= len) {
+                    track[i++] = 0xd5;
+                    track[i++] = 0xaa;
+                    track[i] = 0x96;
+                } else {
+                    track[i] = (uint8_t) NextRand(&state);
+                }
+            }
+        } else {
+            for (i = 0; i < numSect; i++)
+                order[i] = i;
+            for (i = numSect - 1; i > 0; i--) {
+                j = NextRand(&state) % (i + 1);
+                int tmp = order[i];
+                order[i] = order[j];
+                order[j] = tmp;
+            }
+
+            for (i = 0; i < numSect; i++) {
+                int sect = order[i];
+                int copies = 1;
+                int gap1 = 5 + NextRand(&state) % 40;
+                int gap2 = 5 + NextRand(&state) % 8;
+
+                if (damage && (NextRand(&state) & 0x0f) == 0)
+                    continue;           // missing sector
+                if (damage && (NextRand(&state) & 0x0f) == 0)
+                    copies = 2;
+                if (damage && (NextRand(&state) & 0x1f) == 0)
+                    gap2 = kMaxDataReach + 4;   // data field out of reach
+
+                for (j = 0; j < kSectorSize35; j++)
+                    sectorData[j] = (uint8_t) NextRand(&state);
+                memcpy(expected + sect * kBlockSize,
+                    sectorData + kTagBytesLen, kBlockSize);
+
+                while (copies--) {
+                    if (len + gap1 + kAddrFieldLen + gap2 + 4 +
+                        kNibblizedOutputLen + 3 > kMaxTrackLen35)
+                    {
+                        break;
+                    }
+                    len = AddSector35(track, len, cyl, head, sect, sectorData,
+                            gap1, gap2);
+                }
+            }
+            while (len < kMaxTrackLen35 && (len == 0 ||
+                (NextRand(&state) & 0x03) != 0))
+            {
+                track[len++] = 0xff;
+            }
+
+            if (damage) {
+                int numBad = NextRand(&state) % 5;
+                for (i = 0; i < numBad; i++) {
+                    uint8_t val;
+                    if ((NextRand(&state) & 0x03) == 0)
+                        val = (uint8_t) NextRand(&state);
+                    else
+                        val = TestHooks::GetDiskByte(DiskImg::kNibbleEnc62,
+                                NextRand(&state));
+                    track[NextRand(&state) % len] = val;
+                }
+            }
+
+            /* rotate it, so sectors wrap around the end */
+            long rot = NextRand(&state) % len;
+            memcpy(tmpTrack, track + rot, len - rot);
+            memcpy(tmpTrack + len - rot, track, rot);
+            memcpy(track, tmpTrack, len);
+        }
+        diskLens[trk] = len;
+
+        memset(fastOut, 0xe5, sizeof(fastOut));
+        memset(refOut, 0xe5, numSect * kBlockSize);
+        DIError fastErr = TestHooks::UnpackNibbleTrack35(false, track, len,
+                            fastOut, cyl, head, fastBad, kNumBlocks35);
+        DIError refErr = TestHooks::UnpackNibbleTrack35(true, track, len,
+                            refOut, cyl, head, refBad, kNumBlocks35);
+
+        bool same = (fastErr == refErr &&
+            memcmp(fastOut, refOut, numSect * kBlockSize) == 0 &&
+            memcmp(fastBad, refBad, kNumBlocks35 * sizeof(bool)) == 0);
+        if (!same) {
+            printf("  3.5\" mismatch (iter=%ld cyl=%d head=%d)\n",
+                iter, cyl, head);
+            dierr = kDIErrInternal;
+            goto bail;
+        }
+        if (!damage && !junk) {
+            bool good = memcmp(fastOut, expected, numSect * kBlockSize) == 0;
+            for (i = 0; i < numSect && good; i++) {
+                if (fastBad[firstBlock + i])
+                    good = false;
+            }
+            if (!good) {
+                printf("  3.5\" round trip failed (iter=%ld)\n", iter);
+                dierr = kDIErrInternal;
+                goto bail;
+            }
+        }
+        for (i = 0; i < numSect; i++) {
+            if (refBad[firstBlock + i])
+                diskRefBad[firstBlock + i] = true;
+        }
+
+        if (trk == kNumTracks35 - 1) {
+            int numThreads = 1 + NextRand(&state) % 6;
+
+            memset(diskFastOut, 0xe5, kNumBlocks35 * kBlockSize);
+            fastErr = TestHooks::UnpackNibbleTracks35(diskNibbles, diskLens,
+                        kMaxTrackLen35, kNumTracks35, diskFastOut, diskFastBad,
+                        kNumBlocks35, numThreads);
+            same = (fastErr == kDIErrNone &&
+                memcmp(diskFastOut, diskRefOut, kNumBlocks35 * kBlockSize) == 0 &&
+                memcmp(diskFastBad, diskRefBad, kNumBlocks35 * sizeof(bool)) == 0);
+            if (!same) {
+                printf("  3.5\" whole-disk mismatch (iter=%ld threads=%d)\n",
+                    iter, numThreads);
+                dierr = kDIErrInternal;
+                goto bail;
+            }
+        }
+    }
+
+bail:
+    delete[] diskNibbles;
+    delete[] diskLens;
+    delete[] diskRefOut;
+    delete[] diskFastOut;
+    delete[] tmpTrack;
+    delete[] diskRefBad;
+    delete[] diskFastBad;
+    delete[] fastBad;
+    delete[] refBad;
+    return dierr;
+}
+
+int
+main(int argc, char** argv)
+{
+    long iterations = 100000;
+    uint32_t seed = (uint32_t) time(nil) ^ (uint32_t) gPid;
+    DIError dierr;
+    int ic;
+
+    while ((ic = getopt(argc, argv, "n:s:v")) != -1) {
+        switch (ic) {
+        case 'n':
+            iterations = strtol(optarg, nil, 0);
+            break;
+        case 's':
+            seed = (uint32_t) strtoul(optarg, nil, 0);
+            break;
+        case 'v':
+            gVerbose = true;
+            break;
+        default:
+            Usage(argv[0]);
+            exit(2);
+        }
+    }
+    if (optind != argc || iterations <= 0) {
+        Usage(argv[0]);
+        exit(2);
+    }
+
+    Global::SetDebugMsgHandler(MsgHandler);
+    Global::AppInit();
+
+    printf("Testing %ld sectors and %ld 3.5\" tracks, seed=%u\n",
+        iterations, iterations, seed);
+    dierr = TestNibbleCodecs(iterations, seed);
+    if (dierr == kDIErrNone)
+        dierr = TestNibbleTracks35(iterations, seed);
+    if (dierr == kDIErrNone)
+        printf("All results match\n");
+    else
+        printf("FAILED: %s (rerun with -s %u to repeat)\n",
+            DIStrError(dierr), seed);
+
+    Global::AppCleanup();
+
+    exit(dierr == kDIErrNone ? 0 : 1);
+}
@@ -0,0 +1,695 @@
+/*
+ * CiderPress
+ * Copyright (C) 2009 by CiderPress authors.  All Rights Reserved.
+ * See the file LICENSE for distribution terms.
+ */
+/*
+ * Check that a ProDOS DiskFS stays current as files are changed, and that
+ * DiskFS::Refresh can catch up with changes made by somebody else.
+ *
+ * A blank volume is held in memory.  Random creates, writes, deletes,
+ * renames, and attribute changes are made through one DiskFS.  After every
+ * one, its file list, volume usage map, and free block count must match
+ * what a fresh scan of the volume finds.
+ *
+ * Three more DiskFS never change anything.  Two share the writer's
+ * DiskImg, so they know which blocks were written; they refresh at
+ * different rates, so each has to keep its own place in the image's
+ * record of writes.  The last has a DiskImg of its own, and is told that
+ * anything could have changed.  Every few operations they call Refresh,
+ * and must then match a fresh scan too.  The writer calls Refresh now and
+ * then as well, which must not hide its writes from the others.
+ *
+ * Now and then a directory is broken before the last one refreshes.  The
+ * refresh must fail, and leave the DiskFS exactly as it was.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <assert.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <iterator>
+#include "../diskimg/DiskImg.h"
+#include "../diskimg/DiskImgDetail.h"
+#include "../nufxlib/NufxLib.h"
+
+using namespace DiskImgLib;
+
+#define nil NULL
+#define NELEM(x) ((long) (sizeof(x) / sizeof(x[0])))
+
+const long kNumBlocks = 1600;       // 800K
+const long kMaxFileLen = 160 * 1024;    // big enough for tree files
+
+bool gVerbose = false;
+
+/*
+ * Show library messages if we were asked to.
+ */
+void
+MsgHandler(const char* file, int line, const char* msg)
+{
+    assert(file != nil);
+    assert(msg != nil);
+
+    if (gVerbose)
+        fprintf(stderr, "%s\n", msg);
+}
+
+void
+Usage(const char* argv0)
+{
+    fprintf(stderr,
+        "Usage: %s [-v] [-n ops] [-r interval] [-s seed]\n", argv0);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "  -n  number of operations (default 2000)\n");
+    fprintf(stderr, "  -r  operations between refreshes (default 7)\n");
+    fprintf(stderr, "  -s  random number seed (default 1)\n");
+    fprintf(stderr, "  -v  show library messages\n");
+}
+
+/*
+ * Pick a number from 0 to max-1.
+ */
+long
+Pick(long max)
+{
+    return (long) (((double) rand() / ((double) RAND_MAX + 1.0)) * max);
+}
+
+/*
+ * Describe everything about a volume that a fresh scan would find.  The
+ * files go in "pFiles", one line each in list order; the free count and
+ * the usage map go in "pUsage".
+ */
+DIError
+DescribeVolume(DiskFS* pDiskFS, std::vector<std::string>* pFiles,
+    std::string* pUsage)
+{
+    char buf[512];
+    long totalUnits, freeUnits;
+    int unitSize;
+    long idx = 0;
+    DIError dierr;
+
+    pFiles->clear();
+    pUsage->clear();
+
+    sprintf(buf, "vol '%s'", pDiskFS->GetVolumeName());
+    pFiles->push_back(buf);
+
+    A2File* pFile = pDiskFS->GetNextFile(nil);
+    for ( ; pFile != nil; pFile = pDiskFS->GetNextFile(pFile)) {
+        A2File* pParent = pFile->GetParent();
+        sprintf(buf,
+            "'%s' in '%s' type=%02x aux=%04x acc=%02x mod=%ld "
+            "data=%ld/%ld rsrc=%ld/%ld q=%d",
+            pFile->GetPathName(),
+            pParent != nil ? pParent->GetPathName() : "-",
+            pFile->GetFileType(), pFile->GetAuxType(), pFile->GetAccess(),
+            (long) pFile->GetModWhen(),
+            (long) pFile->GetDataLength(), (long) pFile->GetDataSparseLength(),
+            (long) pFile->GetRsrcLength(), (long) pFile->GetRsrcSparseLength(),
+            pFile->GetQuality());
+        pFiles->push_back(buf);
+
+        /* the index has to keep up with the list */
+        if (pDiskFS->GetFileByIndex(idx++) != pFile) {
+            fprintf(stderr, "ERROR: index entry %ld isn't '%s'\n",
+                idx - 1, pFile->GetPathName());
+            return kDIErrInternal;
+        }
+    }
+    if (pDiskFS->GetFileCount() != idx) {
+        fprintf(stderr, "ERROR: index has %ld entries, list has %ld\n",
+            pDiskFS->GetFileCount(), idx);
+        return kDIErrInternal;
+    }
+
+    dierr = pDiskFS->GetFreeSpaceCount(&totalUnits, &freeUnits, &unitSize);
+    if (dierr != kDIErrNone)
+        return dierr;
+    sprintf(buf, "free=%ld/%ld\n", freeUnits, totalUnits);
+    *pUsage += buf;
+
+    const DiskFS::VolumeUsage* pUsageMap = pDiskFS->GetVolumeUsageMap();
+    if (pUsageMap == nil)
+        return kDIErrNotReady;
+    for (long block = 0; block < pUsageMap->GetNumChunks(); block++) {
+        DiskFS::VolumeUsage::ChunkState cstate;
+
+        dierr = pUsageMap->GetChunkState(block, &cstate);
+        if (dierr != kDIErrNone)
+            return dierr;
+        sprintf(buf, "%ld:%d%d%d\n", block, cstate.isUsed, cstate.isMarkedUsed,
+            cstate.isUsed ? (int) cstate.purpose : 0);
+        *pUsage += buf;
+    }
+
+    return kDIErrNone;
+}
+
+/*
+ * Open a DiskFS on the volume.
+ */
+DiskFS*
+OpenVolume(DiskImg* pDiskImg, uint8_t* buffer, long length)
+{
+    DIError dierr;
+
+    dierr = pDiskImg->OpenImageFromBufferRW(buffer, length);
+    if (dierr == kDIErrNone)
+        dierr = pDiskImg->AnalyzeImage();
+    if (dierr != kDIErrNone) {
+        fprintf(stderr, "ERROR: unable to open image: %s\n",
+            DIStrError(dierr));
+        return nil;
+    }
+
+    DiskFS* pDiskFS = pDiskImg->OpenAppropriateDiskFS(false);
+    if (pDiskFS == nil) {
+        fprintf(stderr, "ERROR: no DiskFS for image\n");
+        return nil;
+    }
+    dierr = pDiskFS->Initialize(pDiskImg, DiskFS::kInitFull);
+    if (dierr != kDIErrNone) {
+        fprintf(stderr, "ERROR: initialize failed: %s\n", DIStrError(dierr));
+        delete pDiskFS;
+        return nil;
+    }
+    return pDiskFS;
+}
+
+/*
+ * Compare a DiskFS against a fresh scan.  If "anyOrder" is set, the file
+ * list is compared without regard to order.  Returns false on mismatch.
+ */
+bool
+CheckVolume(const char* label, long opNum, DiskFS* pDiskFS, uint8_t* buffer,
+    long length, bool anyOrder)
+{
+    std::vector<std::string> files, freshFiles;
+    std::string usage, freshUsage;
+    DiskImg freshImg;
+    DiskFS* pFreshFS;
+    bool result = true;
+
+    pFreshFS = OpenVolume(&freshImg, buffer, length);
+    if (pFreshFS == nil)
+        return false;
+
+    if (DescribeVolume(pDiskFS, &files, &usage) != kDIErrNone ||
+        DescribeVolume(pFreshFS, &freshFiles, &freshUsage) != kDIErrNone)
+    {
+        printf("FAILED: op %ld: %s: unable to describe volume\n",
+            opNum, label);
+        result = false;
+        goto bail;
+    }
+
+    if (anyOrder) {
+        std::vector<std::string> extra, missing;
+
+        std::sort(files.begin(), files.end());
+        std::sort(freshFiles.begin(), freshFiles.end());
+        std::set_difference(files.begin(), files.end(),
+            freshFiles.begin(), freshFiles.end(), std::back_inserter(extra));
+        std::set_difference(freshFiles.begin(), freshFiles.end(),
+            files.begin(), files.end(), std::back_inserter(missing));
+        if (!extra.empty() || !missing.empty()) {
+            printf("FAILED: op %ld: %s: file list differs\n", opNum, label);
+            for (size_t i = 0; i < extra.size(); i++)
+                printf("   have: %s\n", extra[i].c_str());
+            for (size_t i = 0; i < missing.size(); i++)
+                printf("   want: %s\n", missing[i].c_str());
+            result = false;
+            goto bail;
+        }
+    }
+    for (size_t i = 0; i < files.size() || i < freshFiles.size(); i++) {
+        const char* have = i < files.size() ? files[i].c_str() : "(none)";
+        const char* want =
+            i < freshFiles.size() ? freshFiles[i].c_str() : "(none)";
+        if (strcmp(have, want) != 0) {
+            printf("FAILED: op %ld: %s: file list differs\n", opNum, label);
+            printf("   have: %s\n   want: %s\n", have, want);
+            result = false;
+            goto bail;
+        }
+    }
+
+    if (usage != freshUsage) {
+        size_t start = 0;
+        while (start < usage.size() && usage[start] == freshUsage[start])
+            start++;
+        while (start > 0 && usage[start-1] != '\n')
+            start--;
+        printf("FAILED: op %ld: %s: usage differs\n", opNum, label);
+        printf("   have: %s\n", usage.substr(start,
+            usage.find('\n', start) - start).c_str());
+        printf("   want: %s\n", freshUsage.substr(start,
+            freshUsage.find('\n', start) - start).c_str());
+        result = false;
+    }
+
+bail:
+    delete pFreshFS;
+    return result;
+}
+
+/*
+ * Catch up with the changes, and compare against a fresh scan.  Returns
+ * false on failure.
+ */
+bool
+RefreshAndCheck(const char* label, long opNum, DiskFS* pDiskFS,
+    uint8_t* buffer, long length)
+{
+    DIError dierr = pDiskFS->Refresh();
+    if (dierr != kDIErrNone) {
+        printf("FAILED: op %ld: %s: refresh: %s\n", opNum, label,
+            DIStrError(dierr));
+        return false;
+    }
+    return CheckVolume(label, opNum, pDiskFS, buffer, length, false);
+}
+
+/*
+ * Write "len" bytes of noise to one fork of a new file.  Some blocks are
+ * left zeroed, so they come out sparse.
+ */
+DIError
+FillFork(A2File* pFile, bool rsrcFork, long len)
+{
+    A2FileDescr* pFD;
+    DIError dierr;
+
+    dierr = pFile->Open(&pFD, false, rsrcFork);
+    if (dierr != kDIErrNone)
+        return dierr;
+
+    std::vector<uint8_t> data(len);
+    for (long offset = 0; offset < len; offset += 512) {
+        if (Pick(4) == 0)
+            continue;
+        long end = std::min(offset + 512, len);
+        for (long i = offset; i < end; i++)
+            data[i] = (uint8_t) rand();
+    }
+    if (len > 0)
+        dierr = pFD->Write(&data[0], len);
+    DIError closeErr = pFD->Close();
+    if (dierr == kDIErrNone)
+        dierr = closeErr;
+    return dierr;
+}
+
+/*
+ * Pick a random file, or a random directory if "wantDir" is set.  Returns
+ * nil if there aren't any.
+ */
+A2File*
+PickFile(DiskFS* pDiskFS, bool wantDir)
+{
+    std::vector<A2File*> candidates;
+
+    A2File* pFile = pDiskFS->GetNextFile(nil);
+    for ( ; pFile != nil; pFile = pDiskFS->GetNextFile(pFile)) {
+        if (pFile->IsDirectory() == wantDir && !pFile->IsVolumeDirectory())
+            candidates.push_back(pFile);
+    }
+    if (candidates.empty())
+        return nil;
+    return candidates[Pick((long) candidates.size())];
+}
+
+/*
+ * See if a directory has anything in it.
+ */
+bool
+HasChildren(DiskFS* pDiskFS, A2File* pDir)
+{
+    A2File* pFile = pDiskFS->GetNextFile(nil);
+    for ( ; pFile != nil; pFile = pDiskFS->GetNextFile(pFile)) {
+        if (pFile->GetParent() == pDir)
+            return true;
+    }
+    return false;
+}
+
+/*
+ * Make a name that might or might not be in use already.
+ */
+void
+PickName(char* nameBuf)
+{
+    static const char* kNames[] = {
+        "ALPHA", "Beta", "GAMMA.TXT", "delta.s", "EPSILON", "Zeta.Bin",
+        "ETA", "THETA.SHK", "iota", "KAPPA.2",
+    };
+    sprintf(nameBuf, "%s%ld", kNames[Pick(NELEM(kNames))], Pick(40));
+}
+
+/*
+ * Do one random thing to the volume.  Failures like "disk full" or
+ * "file exists" are fine; they're part of the test.
+ */
+DIError
+DoRandomOp(DiskFS* pDiskFS, long opNum)
+{
+    char nameBuf[64];
+    char pathBuf[A2FileProDOS::kMaxFileName * 8];
+    A2File* pFile;
+    DIError dierr = kDIErrNone;
+    long totalUnits, freeUnits;
+    int unitSize;
+    long op;
+
+    (void) pDiskFS->GetFreeSpaceCount(&totalUnits, &freeUnits, &unitSize);
+    if (freeUnits < 200)
+        op = 5;     // delete something
+    else
+        op = Pick(10);
+
+    switch (op) {
+    case 0:
+    case 1:
+    case 2:
+    case 3:
+        {
+            /* create a file, in a random directory */
+            DiskFS::CreateParms parms;
+            A2File* pDir = PickFile(pDiskFS, true);
+            bool extended = Pick(6) == 0;
+            bool isDir = !extended && Pick(6) == 0;
+
+            PickName(nameBuf);
+            if (pDir != nil && Pick(3) != 0)
+                sprintf(pathBuf, "%s:%s", pDir->GetPathName(), nameBuf);
+            else
+                strcpy(pathBuf, nameBuf);
+
+            memset(&parms, 0, sizeof(parms));
+            parms.pathName = pathBuf;
+            parms.fssep = ':';
+            parms.storageType = extended ? A2FileProDOS::kStorageExtended :
+                isDir ? A2FileProDOS::kStorageDirectory :
+                A2FileProDOS::kStorageSeedling;
+            parms.fileType = isDir ? 0x0f : Pick(256);
+            parms.auxType = Pick(65536);
+            parms.access = 0xe3;
+            parms.createWhen = parms.modWhen = 1000000000 + opNum * 60;
+
+            dierr = pDiskFS->CreateFile(&parms, &pFile);
+            if (gVerbose)
+                printf("op %ld: create '%s' err=%d\n", opNum, pathBuf, dierr);
+            if (dierr != kDIErrNone || isDir)
+                break;
+
+            long len = Pick(8) == 0 ? Pick(kMaxFileLen) : Pick(4096);
+            dierr = FillFork(pFile, false, len);
+            if (dierr == kDIErrNone && extended)
+                dierr = FillFork(pFile, true, Pick(2048));
+        }
+        break;
+    case 4:
+    case 5:
+        /* delete a file, or an empty directory */
+        pFile = PickFile(pDiskFS, Pick(4) == 0);
+        if (pFile != nil && pFile->IsDirectory() && HasChildren(pDiskFS, pFile))
+            pFile = nil;    // DeleteFile leaves that to the caller
+        if (pFile != nil) {
+            if (gVerbose)
+                printf("op %ld: delete '%s'\n", opNum, pFile->GetPathName());
+            dierr = pDiskFS->DeleteFile(pFile);
+        }
+        break;
+    case 6:
+    case 7:
+        pFile = PickFile(pDiskFS, Pick(3) == 0);
+        if (pFile != nil) {
+            PickName(nameBuf);
+            if (gVerbose) {
+                printf("op %ld: rename '%s' to '%s'\n", opNum,
+                    pFile->GetPathName(), nameBuf);
+            }
+            dierr = pDiskFS->RenameFile(pFile, nameBuf);
+        }
+        break;
+    case 8:
+        pFile = PickFile(pDiskFS, false);
+        if (pFile != nil) {
+            if (gVerbose)
+                printf("op %ld: setinfo '%s'\n", opNum, pFile->GetPathName());
+            dierr = pDiskFS->SetFileInfo(pFile, Pick(256), Pick(65536),
+                        Pick(2) ? 0xe3 : 0x01);
+        }
+        break;
+    case 9:
+        sprintf(nameBuf, "VOL%ld", Pick(1000));
+        if (gVerbose)
+            printf("op %ld: rename volume to '%s'\n", opNum, nameBuf);
+        dierr = pDiskFS->RenameVolume(nameBuf);
+        break;
+    }
+
+    return dierr;
+}
+
+/*
+ * Break a directory that "pDiskFS" already knows about, and check that a
+ * refresh fails without changing anything.  The directory is put back
+ * afterward.  Returns false on failure.
+ */
+bool
+FailedRefreshCheck(long opNum, DiskFS* pWriterFS, DiskImg* pDiskImg,
+    DiskFS* pDiskFS, uint8_t* buffer)
+{
+    std::vector<std::string> files, afterFiles;
+    std::string usage, afterUsage;
+    A2FileProDOS* pDir;
+    A2FileProDOS* pOldDir;
+    bool result = true;
+
+    pDir = (A2FileProDOS*) PickFile(pWriterFS, true);
+    if (pDir == nil)
+        return true;
+    pOldDir = (A2FileProDOS*) pDiskFS->GetFileByName(pDir->GetPathName());
+    if (pOldDir == nil ||
+        pOldDir->fDirEntry.keyPointer != pDir->fDirEntry.keyPointer)
+    {
+        return true;        // new to this DiskFS, would just be "damaged"
+    }
+
+    if (DescribeVolume(pDiskFS, &files, &usage) != kDIErrNone)
+        return false;
+
+    /* point the directory's next-block link off the end of the volume */
+    long offset = (long) pDir->fDirEntry.keyPointer * 512 + 0x02;
+    uint8_t saved[2] = { buffer[offset], buffer[offset+1] };
+    buffer[offset] = buffer[offset+1] = 0xff;
+
+    pDiskImg->SetUntrackedWrites();
+    DIError dierr = pDiskFS->Refresh();
+    if (dierr != kDIErrNotSupported) {
+        printf("FAILED: op %ld: broken '%s': refresh: %s\n", opNum,
+            pDir->GetPathName(), DIStrError(dierr));
+        result = false;
+    } else if (DescribeVolume(pDiskFS, &afterFiles, &afterUsage) !=
+        kDIErrNone || afterFiles != files || afterUsage != usage)
+    {
+        printf("FAILED: op %ld: broken '%s': failed refresh changed things\n",
+            opNum, pDir->GetPathName());
+        result = false;
+    }
+
+    buffer[offset] = saved[0];
+    buffer[offset+1] = saved[1];
+    return result;
+}
+
+/*
+ * Create a blank ProDOS volume, and read it into memory.
+ */
+uint8_t*
+CreateVolume(long* pLength)
+{
+    char tmpPath[] = "/tmp/refreshtest.XXXXXX";
+    DiskImg diskImg;
+    uint8_t* buffer = nil;
+    FILE* fp = nil;
+    DIError dierr;
+    int fd;
+
+    /* CreateImage wants to create the file itself */
+    fd = mkstemp(tmpPath);
+    if (fd < 0) {
+        perror("mkstemp");
+        return nil;
+    }
+    close(fd);
+    unlink(tmpPath);
+
+    dierr = diskImg.CreateImage(tmpPath, nil, DiskImg::kOuterFormatNone,
+                DiskImg::kFileFormatUnadorned,
+                DiskImg::kPhysicalFormatSectors, nil,
+                DiskImg::kSectorOrderProDOS, DiskImg::kFormatGenericProDOSOrd,
+                kNumBlocks, true);
+    if (dierr == kDIErrNone)
+        dierr = diskImg.FormatImage(DiskImg::kFormatProDOS, "REFRESH");
+    if (dierr == kDIErrNone)
+        dierr = diskImg.CloseImage();
+    if (dierr != kDIErrNone) {
+        fprintf(stderr, "ERROR: unable to create volume: %s\n",
+            DIStrError(dierr));
+        goto bail;
+    }
+
+    *pLength = kNumBlocks * 512;
+    buffer = new uint8_t[*pLength];
+    fp = fopen(tmpPath, "rb");
+    if (fp == nil || fread(buffer, *pLength, 1, fp) != 1) {
+        perror(tmpPath);
+        delete[] buffer;
+        buffer = nil;
+    }
+
+bail:
+    if (fp != nil)
+        fclose(fp);
+    unlink(tmpPath);
+    return buffer;
+}
+
+/*
+ * Open another DiskFS on the writer's DiskImg.
+ */
+DiskFS*
+OpenSharedVolume(DiskImg* pDiskImg)
+{
+    DiskFS* pDiskFS = pDiskImg->OpenAppropriateDiskFS(false);
+    if (pDiskFS != nil &&
+        pDiskFS->Initialize(pDiskImg, DiskFS::kInitFull) != kDIErrNone)
+    {
+        delete pDiskFS;
+        pDiskFS = nil;
+    }
+    return pDiskFS;
+}
+
+/*
+ * Run the test.
+ */
+int
+main(int argc, char** argv)
+{
+    long numOps = 2000;
+    long interval = 7;
+    long seed = 1;
+    long numFailures = 0;
+    long numRefreshes = 0;
+    int cc;
+
+    while ((cc = getopt(argc, argv, "vn:r:s:")) != -1) {
+        switch (cc) {
+        case 'v':
+            gVerbose = true;
+            break;
+        case 'n':
+            numOps = atol(optarg);
+            break;
+        case 'r':
+            interval = atol(optarg);
+            break;
+        case 's':
+            seed = atol(optarg);
+            break;
+        default:
+            Usage(argv[0]);
+            exit(2);
+        }
+    }
+    if (optind != argc || numOps <= 0 || interval <= 0) {
+        Usage(argv[0]);
+        exit(2);
+    }
+
+    Global::SetDebugMsgHandler(MsgHandler);
+    Global::AppInit();
+    srand((unsigned int) seed);
+
+    long length;
+    uint8_t* buffer = CreateVolume(&length);
+    if (buffer == nil)
+        exit(1);
+
+    DiskImg writerImg, watcherImg;
+    DiskFS* pWriterFS = OpenVolume(&writerImg, buffer, length);
+    DiskFS* pWatcherFS = OpenVolume(&watcherImg, buffer, length);
+    DiskFS* pSharedFS = nil;
+    DiskFS* pSlowFS = nil;
+    if (pWriterFS != nil) {
+        pSharedFS = OpenSharedVolume(&writerImg);
+        pSlowFS = OpenSharedVolume(&writerImg);
+    }
+    if (pWriterFS == nil || pWatcherFS == nil || pSharedFS == nil ||
+        pSlowFS == nil)
+    {
+        exit(1);
+    }
+
+    for (long opNum = 1; opNum <= numOps && numFailures < 10; opNum++) {
+        DIError dierr = DoRandomOp(pWriterFS, opNum);
+        if (dierr != kDIErrNone && gVerbose)
+            printf("  (%s)\n", DIStrError(dierr));
+
+        if (!CheckVolume("writer", opNum, pWriterFS, buffer, length, true))
+            numFailures++;
+
+        /* sometimes right before the others, like DiskArchive::Reload */
+        if ((opNum % 5) == 0) {
+            if (!RefreshAndCheck("writer", opNum, pWriterFS, buffer, length))
+                numFailures++;
+        }
+
+        if ((opNum % interval) == 0 || opNum == numOps) {
+            if (!RefreshAndCheck("shared", opNum, pSharedFS, buffer, length))
+                numFailures++;
+            if ((opNum % (interval * 3)) == 0 || opNum == numOps) {
+                if (!RefreshAndCheck("slow", opNum, pSlowFS, buffer, length))
+                    numFailures++;
+            }
+
+            if ((opNum % (interval * 5)) == 0) {
+                if (!FailedRefreshCheck(opNum, pWriterFS, &watcherImg,
+                        pWatcherFS, buffer))
+                {
+                    numFailures++;
+                }
+            }
+
+            /* the watcher can't see the writes, so it has to look at all */
+            watcherImg.SetUntrackedWrites();
+            if (!RefreshAndCheck("watcher", opNum, pWatcherFS, buffer, length))
+                numFailures++;
+            numRefreshes++;
+        }
+    }
+
+    printf("%ld ops, %ld refreshes, %ld failures\n", numOps, numRefreshes,
+        numFailures);
+
+    delete pWriterFS;
+    delete pSharedFS;
+    delete pSlowFS;
+    delete pWatcherFS;
+    writerImg.CloseImage();
+    watcherImg.CloseImage();
+    delete[] buffer;
+    Global::AppCleanup();
+
+    return numFailures == 0 ? 0 : 1;
+}
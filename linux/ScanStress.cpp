@@ -0,0 +1,362 @@
+/*
+ * CiderPress
+ * Copyright (C) 2009 by CiderPress authors.  All Rights Reserved.
+ * See the file LICENSE for distribution terms.
+ */
+/*
+ * Stress test for the library's thread-safety contract.
+ *
+ * Every image is scanned once on the main thread to get a reference hash
+ * of its file list, dates, and contents.  Then a pile of threads pull
+ * images off a shared queue, each one opened, analyzed, and read from
+ * start to finish, until thousands of scans have been done.  The threads
+ * also call Global::AppInit and swap the debug message handler while
+ * they work, since both are supposed to be safe to do at any time.
+ *
+ * Named directories are searched for images.  Files the library can't
+ * identify are skipped.
+ *
+ * This is most useful when everything is built with -fsanitize=thread.
+ * Run it with TZ unset to exercise the C library's time zone handling.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <assert.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <atomic>
+#include <string>
+#include <vector>
+#include "../diskimg/DiskImg.h"
+#include "../nufxlib/NufxLib.h"
+
+using namespace DiskImgLib;
+
+#define nil NULL
+
+struct ImageInfo {
+    std::string pathName;
+    uint32_t    hash;
+    long        numFiles;
+};
+
+std::vector<ImageInfo> gImages;
+long gNumScans = 2000;
+std::atomic<long> gNextScan(0);
+std::atomic<bool> gVerbose(false);
+
+pthread_mutex_t gOutputLock = PTHREAD_MUTEX_INITIALIZER;
+long gNumFailures = 0;
+
+/*
+ * Return the filename part of a path.
+ */
+const char*
+FilenameOnly(const char* pathName)
+{
+    const char* cp = strrchr(pathName, '/');
+    return cp != nil ? cp + 1 : pathName;
+}
+
+/*
+ * Show library messages if we were asked to.  There are two of these so
+ * the threads have something to switch between.
+ */
+void
+MsgHandler(const char* file, int line, const char* msg)
+{
+    assert(file != nil);
+    assert(msg != nil);
+
+    if (gVerbose.load())
+        fprintf(stderr, "%s\n", msg);
+}
+
+void
+AltMsgHandler(const char* file, int line, const char* msg)
+{
+    assert(file != nil);
+    assert(msg != nil);
+
+    if (gVerbose.load())
+        fprintf(stderr, "%s:%d: %s\n", FilenameOnly(file), line, msg);
+}
+
+void
+Usage(const char* argv0)
+{
+    fprintf(stderr,
+        "Usage: %s [-v] [-j threads] [-n scans] image-or-dir ...\n", argv0);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "  -j  number of threads (default 8)\n");
+    fprintf(stderr, "  -n  total number of image scans (default 2000)\n");
+    fprintf(stderr, "  -v  show library messages\n");
+}
+
+/*
+ * Report a failure.
+ */
+void
+Fail(const char* pathName, const char* msg, const char* detail)
+{
+    pthread_mutex_lock(&gOutputLock);
+    printf("FAILED: %s: %s%s%s\n", pathName, msg,
+        detail != nil ? ": " : "", detail != nil ? detail : "");
+    gNumFailures++;
+    pthread_mutex_unlock(&gOutputLock);
+}
+
+/*
+ * Simple hash, for comparing results.
+ */
+uint32_t
+HashBuf(uint32_t hash, const void* vbuf, size_t len)
+{
+    const uint8_t* buf = (const uint8_t*) vbuf;
+    while (len--)
+        hash = (hash * 31) + *buf++;
+    return hash;
+}
+
+/*
+ * Hash the names, dates, and contents of every file on a volume,
+ * including anything in sub-volumes.
+ */
+DIError
+HashDiskFS(DiskFS* pDiskFS, uint32_t* pHash, long* pNumFiles)
+{
+    A2File* pFile;
+    A2FileDescr* pFD;
+    uint8_t buf[16384];
+    DIError dierr = kDIErrNone;
+
+    pFile = pDiskFS->GetNextFile(nil);
+    for ( ; pFile != nil; pFile = pDiskFS->GetNextFile(pFile)) {
+        time_t when[2];
+
+        *pHash = HashBuf(*pHash, pFile->GetPathName(),
+                    strlen(pFile->GetPathName()));
+        when[0] = pFile->GetCreateWhen();
+        when[1] = pFile->GetModWhen();
+        *pHash = HashBuf(*pHash, when, sizeof(when));
+        (*pNumFiles)++;
+        if (pFile->IsDirectory() || pFile->IsVolumeDirectory())
+            continue;
+
+        dierr = pFile->Open(&pFD, true);
+        if (dierr != kDIErrNone) {
+            /* damaged files can't be opened; that's part of the answer */
+            *pHash = HashBuf(*pHash, &dierr, sizeof(dierr));
+            dierr = kDIErrNone;
+            continue;
+        }
+        while (true) {
+            size_t actual;
+            dierr = pFD->Read(buf, sizeof(buf), &actual);
+            if (dierr != kDIErrNone || actual == 0)
+                break;
+            *pHash = HashBuf(*pHash, buf, actual);
+        }
+        pFD->Close();
+        if (dierr != kDIErrNone && dierr != kDIErrEOF)
+            *pHash = HashBuf(*pHash, &dierr, sizeof(dierr));
+        dierr = kDIErrNone;
+    }
+
+    DiskFS::SubVolume* pSubVol = pDiskFS->GetNextSubVolume(nil);
+    while (pSubVol != nil) {
+        dierr = HashDiskFS(pSubVol->GetDiskFS(), pHash, pNumFiles);
+        if (dierr != kDIErrNone)
+            break;
+        pSubVol = pDiskFS->GetNextSubVolume(pSubVol);
+    }
+
+    return dierr;
+}
+
+/*
+ * Open an image and hash everything on it.
+ */
+DIError
+ScanImage(const char* pathName, uint32_t* pHash, long* pNumFiles)
+{
+    DiskImg diskImg;
+    DiskFS* pDiskFS = nil;
+    DIError dierr;
+
+    *pHash = 0;
+    *pNumFiles = 0;
+
+    dierr = diskImg.OpenImage(pathName, '/', true);
+    if (dierr != kDIErrNone)
+        goto bail;
+    dierr = diskImg.AnalyzeImage();
+    if (dierr != kDIErrNone)
+        goto bail;
+    if (diskImg.GetFSFormat() == DiskImg::kFormatUnknown ||
+        diskImg.GetSectorOrder() == DiskImg::kSectorOrderUnknown)
+    {
+        dierr = kDIErrFilesystemNotFound;
+        goto bail;
+    }
+
+    pDiskFS = diskImg.OpenAppropriateDiskFS();
+    if (pDiskFS == nil) {
+        dierr = kDIErrInternal;
+        goto bail;
+    }
+    pDiskFS->SetScanForSubVolumes(DiskFS::kScanSubEnabled);
+    dierr = pDiskFS->Initialize(&diskImg, DiskFS::kInitFull);
+    if (dierr != kDIErrNone)
+        goto bail;
+
+    dierr = HashDiskFS(pDiskFS, pHash, pNumFiles);
+
+bail:
+    delete pDiskFS;
+    return dierr;
+}
+
+/*
+ * Add an image to the list, or every image in a directory.
+ */
+void
+AddImages(const char* pathName)
+{
+    struct stat sb;
+
+    if (stat(pathName, &sb) != 0) {
+        perror(pathName);
+        return;
+    }
+
+    if (S_ISDIR(sb.st_mode)) {
+        DIR* dirp = opendir(pathName);
+        struct dirent* entry;
+
+        if (dirp == nil) {
+            perror(pathName);
+            return;
+        }
+        while ((entry = readdir(dirp)) != nil) {
+            if (entry->d_name[0] == '.')
+                continue;
+            std::string subPath(pathName);
+            subPath += '/';
+            subPath += entry->d_name;
+            AddImages(subPath.c_str());
+        }
+        closedir(dirp);
+    } else if (S_ISREG(sb.st_mode)) {
+        ImageInfo info;
+        DIError dierr;
+
+        info.pathName = pathName;
+        dierr = ScanImage(pathName, &info.hash, &info.numFiles);
+        if (dierr != kDIErrNone) {
+            if (gVerbose.load())
+                printf("Skipping %s: %s\n", pathName, DIStrError(dierr));
+            return;
+        }
+        gImages.push_back(info);
+    }
+}
+
+/*
+ * Thread entry point.  Take scans off the queue until they're all done.
+ */
+void*
+StressThread(void* vThreadNum)
+{
+    long threadNum = (long) vThreadNum;
+    long scanNum;
+
+    /* any thread may do this, at any time */
+    if (Global::AppInit() != kDIErrNone)
+        Fail("(none)", "AppInit failed in thread", nil);
+
+    while ((scanNum = gNextScan.fetch_add(1)) < gNumScans) {
+        const ImageInfo* pInfo = &gImages[scanNum % gImages.size()];
+        uint32_t hash;
+        long numFiles;
+        DIError dierr;
+
+        if ((scanNum + threadNum) % 64 == 0) {
+            Global::SetDebugMsgHandler(
+                (scanNum & 64) ? AltMsgHandler : MsgHandler);
+        }
+
+        dierr = ScanImage(pInfo->pathName.c_str(), &hash, &numFiles);
+        if (dierr != kDIErrNone)
+            Fail(pInfo->pathName.c_str(), "scan failed", DIStrError(dierr));
+        else if (hash != pInfo->hash || numFiles != pInfo->numFiles)
+            Fail(pInfo->pathName.c_str(), "results differ", nil);
+    }
+
+    return nil;
+}
+
+int
+main(int argc, char** argv)
+{
+    pthread_t* threads;
+    long numThreads = 8;
+    int ic;
+
+    while ((ic = getopt(argc, argv, "j:n:v")) != -1) {
+        switch (ic) {
+        case 'j':
+            numThreads = strtol(optarg, nil, 0);
+            break;
+        case 'n':
+            gNumScans = strtol(optarg, nil, 0);
+            break;
+        case 'v':
+            gVerbose.store(true);
+            break;
+        default:
+            Usage(argv[0]);
+            exit(2);
+        }
+    }
+    if (optind == argc || numThreads <= 0 || gNumScans <= 0) {
+        Usage(argv[0]);
+        exit(2);
+    }
+
+    Global::SetDebugMsgHandler(MsgHandler);
+    Global::AppInit();
+
+    for (int i = optind; i < argc; i++)
+        AddImages(argv[i]);
+    if (gImages.empty()) {
+        fprintf(stderr, "No disk images found\n");
+        exit(1);
+    }
+
+    printf("Scanning %zu images %ld times in all on %ld threads\n",
+        gImages.size(), gNumScans, numThreads);
+
+    threads = new pthread_t[numThreads];
+    for (long i = 0; i < numThreads; i++) {
+        if (pthread_create(&threads[i], nil, StressThread, (void*) i) != 0) {
+            fprintf(stderr, "ERROR: unable to create thread\n");
+            exit(1);
+        }
+    }
+    for (long i = 0; i < numThreads; i++)
+        pthread_join(threads[i], nil);
+    delete[] threads;
+
+    if (gNumFailures == 0)
+        printf("All results match\n");
+    else
+        printf("%ld failures\n", gNumFailures);
+
+    Global::AppCleanup();
+
+    exit(gNumFailures == 0 ? 0 : 1);
+}
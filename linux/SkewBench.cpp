@@ -0,0 +1,249 @@
+/*
+ * CiderPress
+ * Copyright (C) 2009 by CiderPress authors.  All Rights Reserved.
+ * See the file LICENSE for distribution terms.
+ */
+/*
+ * Benchmark for block and sector access with sector order translation.
+ *
+ * Fills a 5.25" disk image in memory with random data, then does random
+ * block and sector reads on it with several combinations of image order
+ * and filesystem order, e.g. a DOS-ordered image read as ProDOS blocks.
+ * Because the image lives in memory, this mostly measures the cost of the
+ * translation rather than the I/O.
+ *
+ * Each test prints a hash of everything it read, so the results can be
+ * compared across builds.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <assert.h>
+#include "../diskimg/DiskImg.h"
+
+using namespace DiskImgLib;
+
+#define nil NULL
+
+bool gVerbose = false;
+
+/*
+ * Show library messages if we were asked to.
+ */
+void
+MsgHandler(const char* file, int line, const char* msg)
+{
+    assert(file != nil);
+    assert(msg != nil);
+
+    if (gVerbose)
+        fprintf(stderr, "%s\n", msg);
+}
+
+void
+Usage(const char* argv0)
+{
+    fprintf(stderr, "Usage: %s [-v] [-n reads] [-t tracks] [-s seed]\n",
+        argv0);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "  -n  reads per test (default 2000000)\n");
+    fprintf(stderr, "  -t  tracks in the image (default 35)\n");
+    fprintf(stderr, "  -s  random seed (default 1)\n");
+    fprintf(stderr, "  -v  show library messages\n");
+}
+
+/*
+ * Simple hash, so different builds can be checked against each other.
+ */
+uint32_t
+HashBuf(uint32_t hash, const uint8_t* buf, size_t len)
+{
+    while (len--)
+        hash = (hash * 31) + *buf++;
+    return hash;
+}
+
+/*
+ * Get the time in seconds.
+ */
+double
+Now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+/*
+ * Small LCG, so the access pattern is the same everywhere.
+ */
+uint32_t
+NextRand(uint32_t* pSeed)
+{
+    *pSeed = *pSeed * 1103515245 + 12345;
+    return *pSeed >> 8;
+}
+
+/*
+ * Open the in-memory image with the given image and filesystem orders.
+ */
+DIError
+OpenBuffer(DiskImg* pDiskImg, const uint8_t* buffer, long length,
+    DiskImg::SectorOrder order, DiskImg::FSFormat format)
+{
+    DIError dierr;
+
+    dierr = pDiskImg->OpenImageFromBufferRO(buffer, length);
+    if (dierr != kDIErrNone)
+        return dierr;
+    dierr = pDiskImg->AnalyzeImage();
+    if (dierr != kDIErrNone)
+        return dierr;
+    return pDiskImg->OverrideFormat(DiskImg::kPhysicalFormatSectors, format,
+                order);
+}
+
+/*
+ * Run the block and sector tests for one combination.
+ *
+ * Returns 0 on success.
+ */
+int
+RunTest(const char* label, const uint8_t* buffer, long length,
+    DiskImg::SectorOrder order, DiskImg::FSFormat format, long numReads,
+    uint32_t seed)
+{
+    DiskImg diskImg;
+    uint8_t buf[512];
+    uint32_t hash, rand;
+    double start, elapsed;
+    DIError dierr;
+
+    dierr = OpenBuffer(&diskImg, buffer, length, order, format);
+    if (dierr != kDIErrNone) {
+        fprintf(stderr, "%s: open failed: %s\n", label, DIStrError(dierr));
+        return -1;
+    }
+
+    long numBlocks = diskImg.GetNumBlocks();
+    long numTracks = diskImg.GetNumTracks();
+    int numSects = diskImg.GetNumSectPerTrack();
+
+    hash = 0;
+    rand = seed;
+    start = Now();
+    for (long i = 0; i < numReads; i++) {
+        dierr = diskImg.ReadBlock(NextRand(&rand) % numBlocks, buf);
+        if (dierr != kDIErrNone)
+            break;
+        hash = HashBuf(hash, buf, 4);           // enough to tell sectors
+        hash = HashBuf(hash, buf + 256, 4);     //  apart in random data
+    }
+    elapsed = Now() - start;
+    if (dierr != kDIErrNone) {
+        fprintf(stderr, "%s: block read failed: %s\n", label,
+            DIStrError(dierr));
+        return -1;
+    }
+    printf("%-28s blocks  %7.1f ns/read  hash=%08x\n", label,
+        elapsed * 1000000000.0 / numReads, hash);
+
+    hash = 0;
+    rand = seed;
+    start = Now();
+    for (long i = 0; i < numReads; i++) {
+        uint32_t val = NextRand(&rand);
+        dierr = diskImg.ReadTrackSector((val / numSects) % numTracks,
+                    val % numSects, buf);
+        if (dierr != kDIErrNone)
+            break;
+        hash = HashBuf(hash, buf, 4);
+    }
+    elapsed = Now() - start;
+    if (dierr != kDIErrNone) {
+        fprintf(stderr, "%s: sector read failed: %s\n", label,
+            DIStrError(dierr));
+        return -1;
+    }
+    printf("%-28s sectors %7.1f ns/read  hash=%08x\n", label,
+        elapsed * 1000000000.0 / numReads, hash);
+
+    return 0;
+}
+
+int
+main(int argc, char** argv)
+{
+    static const struct {
+        const char*             label;
+        DiskImg::SectorOrder    order;
+        DiskImg::FSFormat       format;
+    } kTests[] = {
+        { "ProDOS image as ProDOS", DiskImg::kSectorOrderProDOS,
+            DiskImg::kFormatGenericProDOSOrd },
+        { "DOS image as ProDOS", DiskImg::kSectorOrderDOS,
+            DiskImg::kFormatGenericProDOSOrd },
+        { "ProDOS image as DOS", DiskImg::kSectorOrderProDOS,
+            DiskImg::kFormatGenericDOSOrd },
+        { "DOS image as DOS", DiskImg::kSectorOrderDOS,
+            DiskImg::kFormatGenericDOSOrd },
+        { "Physical image as CP/M", DiskImg::kSectorOrderPhysical,
+            DiskImg::kFormatGenericCPMOrd },
+    };
+    long numReads = 2000000;
+    long numTracks = 35;
+    uint32_t seed = 1;
+    uint8_t* buffer;
+    long length;
+    int result = 0;
+    int ic;
+
+    while ((ic = getopt(argc, argv, "n:t:s:v")) != -1) {
+        switch (ic) {
+        case 'n':
+            numReads = strtol(optarg, nil, 0);
+            break;
+        case 't':
+            numTracks = strtol(optarg, nil, 0);
+            break;
+        case 's':
+            seed = (uint32_t) strtoul(optarg, nil, 0);
+            break;
+        case 'v':
+            gVerbose = true;
+            break;
+        default:
+            Usage(argv[0]);
+            exit(2);
+        }
+    }
+    if (optind != argc || numReads <= 0 || numTracks <= 0) {
+        Usage(argv[0]);
+        exit(2);
+    }
+
+    Global::SetDebugMsgHandler(MsgHandler);
+    Global::AppInit();
+
+    length = numTracks * 16 * 256;
+    buffer = new uint8_t[length];
+    uint32_t rand = seed;
+    for (long i = 0; i < length; i++)
+        buffer[i] = (uint8_t) NextRand(&rand);
+
+    printf("%ld tracks, %ld reads per test\n", numTracks, numReads);
+    for (int i = 0; i < (int) (sizeof(kTests) / sizeof(kTests[0])); i++) {
+        if (RunTest(kTests[i].label, buffer, length, kTests[i].order,
+                kTests[i].format, numReads, seed) != 0)
+        {
+            result = 1;
+        }
+    }
+
+    delete[] buffer;
+    Global::AppCleanup();
+
+    exit(result);
+}
@@ -95,6 +95,8 @@ static NuError Nu_NuArchiveNew(NuArchive** ppArchive)
     (*ppArchive)->valJunkSkipMax = kDefaultJunkSkipMax;
     (*ppArchive)->valIgnoreLZW2Len = false;
     (*ppArchive)->valHandleBadMac = false;
+    (*ppArchive)->valCompressThreads = 1;
+    (*ppArchive)->valCompressMemLimit = kNuDefaultCompressMemLimit;
 
     (*ppArchive)->messageHandlerFunc = gNuGlobalErrorMessageHandler;
 
@@ -854,14 +854,22 @@ static NuError Nu_HandleAddThreadMods(NuArchive* pArchive, NuRecord* pRecord,
                 /* fall through with err */
 
             } else {
+                Boolean handled;
+
+                /* use the compression workers' output, if they have it */
+                err = Nu_PipelineWriteThread(pArchive, pThreadMod,
+                        pProgressData, dstFp, pNewThread, &handled);
+
                 /* compress (possibly by just copying) the source to dstFp */
-                err = Nu_CompressToArchive(pArchive,
-                        pThreadMod->entry.add.pDataSource,
-                        pThreadMod->entry.add.threadID,
-                        Nu_DataSourceGetThreadFormat(
-                            pThreadMod->entry.add.pDataSource),
-                        pThreadMod->entry.add.threadFormat,
-                        pProgressData, dstFp, pNewThread);
+                if (err == kNuErrNone && !handled) {
+                    err = Nu_CompressToArchive(pArchive,
+                            pThreadMod->entry.add.pDataSource,
+                            pThreadMod->entry.add.threadID,
+                            Nu_DataSourceGetThreadFormat(
+                                pThreadMod->entry.add.pDataSource),
+                            pThreadMod->entry.add.threadFormat,
+                            pProgressData, dstFp, pNewThread);
+                }
                 /* fall through with err */
             }
 
@@ -1707,6 +1715,10 @@ static NuError Nu_CreateNewRecords(NuArchive* pArchive, FILE* fp)
     NuError err = kNuErrNone;
     NuRecord* pRecord;
 
+    /* start compressing ahead, if we've been asked to */
+    err = Nu_PipelineStart(pArchive);
+    BailError(err);
+
     pRecord = Nu_RecordSet_GetListHead(&pArchive->newRecordSet);
     while (pRecord != NULL) {
         err = Nu_ConstructNewRecord(pArchive, pRecord, fp);
@@ -1720,6 +1732,7 @@ static NuError Nu_CreateNewRecords(NuArchive* pArchive, FILE* fp)
             NuRecord* pNextRecord = pRecord->pNext;
 
             DBUG(("--- Skipping, deleting new %ld\n", pRecord->recordIdx));
+            Nu_PipelineSkipRecord(pArchive, pRecord);
             err = Nu_RecordSet_DeleteRecord(pArchive, &pArchive->newRecordSet,
                     pRecord);
             Assert(err == kNuErrNone);
@@ -1732,6 +1745,7 @@ static NuError Nu_CreateNewRecords(NuArchive* pArchive, FILE* fp)
     }
 
 bail:
+    Nu_PipelineFinish(pArchive);
     return err;
 }
 
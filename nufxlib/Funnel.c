@@ -8,6 +8,26 @@
  */
 #include "NufxLibPriv.h"
 
+/*
+ * Pick a vector instruction set for the text scanning functions.  This is
+ * decided at compile time; without any of these we fall back on treating
+ * 8 bytes as a 64-bit integer.
+ */
+#if defined(__AVX2__)
+# include <immintrin.h>
+# define NU_SCAN_AVX2
+#elif defined(__SSE2__) || defined(_M_X64) || \
+        (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+# include <emmintrin.h>
+# define NU_SCAN_SSE2
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+# include <arm_neon.h>
+# define NU_SCAN_NEON
+#endif
+#if (defined(NU_SCAN_AVX2) || defined(NU_SCAN_SSE2)) && defined(_MSC_VER)
+# include <intrin.h>
+#endif
+
 
 /*
  * ===========================================================================
@@ -244,6 +264,10 @@ NuError Nu_FunnelNew(NuArchive* pArchive, NuDataSink* pDataSink,
     BailAlloc(pFunnel);
     pFunnel->buffer = Nu_Malloc(pArchive, kNuFunnelBufSize);
     BailAlloc(pFunnel->buffer);
+    if (convertEOL != kNuConvertOff) {
+        pFunnel->convBuf = Nu_Malloc(pArchive, kNuFunnelConvBufSize);
+        BailAlloc(pFunnel->convBuf);
+    }
 
     pFunnel->pDataSink = pDataSink;
     pFunnel->convertEOL = convertEOL;
@@ -283,6 +307,7 @@ NuError Nu_FunnelFree(NuArchive* pArchive, NuFunnel* pFunnel)
 #endif
 
     Nu_Free(pArchive, pFunnel->buffer);
+    Nu_Free(pArchive, pFunnel->convBuf);
     Nu_Free(pArchive, pFunnel);
 
     return kNuErrNone;
@@ -310,6 +335,299 @@ void Nu_FunnelSetMaxOutput(NuFunnel* pFunnel, uint32_t maxBytes)
 #endif
 
 
+/*
+ * ===========================================================================
+ *      Text scanning
+ * ===========================================================================
+ */
+
+/*
+ * Text conversion spends nearly all of its time looking for the few bytes
+ * that need special handling, so these functions examine 16 or 32 bytes
+ * at a time when they can.  The vector loops only have to find the block
+ * with the interesting byte in it; the byte loop at the end of each
+ * function handles the rest.  The results are always identical to what a
+ * plain byte-at-a-time loop would produce.
+ */
+
+#define kNuOnes64   0x0101010101010101ULL
+#define kNuHigh64   0x8080808080808080ULL
+#define kNuLow64    0x7f7f7f7f7f7f7f7fULL
+
+#if !defined(NU_SCAN_AVX2) && !defined(NU_SCAN_SSE2) && !defined(NU_SCAN_NEON)
+/*
+ * Load 8 bytes as an integer.  Byte order doesn't matter, since we only
+ * want to know if any of the bytes are interesting.
+ */
+static inline uint64_t Nu_Load64(const uint8_t* buf)
+{
+    uint64_t val;
+
+    memcpy(&val, buf, sizeof(val));
+    return val;
+}
+
+/*
+ * Return a value with the high bit set in every byte of "val" that is
+ * zero.  Unlike the usual one-line version of this, the carries can't
+ * spill from one byte into the next, so the result is exact.
+ */
+static inline uint64_t Nu_ZeroBytes64(uint64_t val)
+{
+    return ~(((val & kNuLow64) + kNuLow64) | val) & kNuHigh64;
+}
+#endif
+
+#if defined(NU_SCAN_AVX2) || defined(NU_SCAN_SSE2)
+/*
+ * Return the index of the lowest set bit.  "bits" must not be zero.
+ */
+static inline uint32_t Nu_LowestBit(uint32_t bits)
+{
+# if defined(_MSC_VER)
+    unsigned long idx;
+
+    _BitScanForward(&idx, bits);
+    return (uint32_t) idx;
+# else
+    return (uint32_t) __builtin_ctz(bits);
+# endif
+}
+#endif
+
+/*
+ * Return the number of bytes at the start of the buffer that aren't CR or
+ * LF after being ANDed with "mask".
+ */
+static uint32_t Nu_SpanNonEOL(const uint8_t* buf, uint32_t count, uint8_t mask)
+{
+    uint32_t idx = 0;
+    uint8_t uch;
+
+#if defined(NU_SCAN_AVX2)
+    const __m256i vmask = _mm256_set1_epi8((char) mask);
+    const __m256i vcr = _mm256_set1_epi8(kNuCharCR);
+    const __m256i vlf = _mm256_set1_epi8(kNuCharLF);
+
+    for ( ; idx + 32 <= count; idx += 32) {
+        __m256i val = _mm256_and_si256(vmask,
+                        _mm256_loadu_si256((const __m256i*) (buf + idx)));
+        uint32_t bits = (uint32_t) _mm256_movemask_epi8(_mm256_or_si256(
+                        _mm256_cmpeq_epi8(val, vcr),
+                        _mm256_cmpeq_epi8(val, vlf)));
+        if (bits != 0)
+            return idx + Nu_LowestBit(bits);
+    }
+#elif defined(NU_SCAN_SSE2)
+    const __m128i vmask = _mm_set1_epi8((char) mask);
+    const __m128i vcr = _mm_set1_epi8(kNuCharCR);
+    const __m128i vlf = _mm_set1_epi8(kNuCharLF);
+
+    for ( ; idx + 16 <= count; idx += 16) {
+        __m128i val = _mm_and_si128(vmask,
+                        _mm_loadu_si128((const __m128i*) (buf + idx)));
+        uint32_t bits = (uint32_t) _mm_movemask_epi8(_mm_or_si128(
+                        _mm_cmpeq_epi8(val, vcr), _mm_cmpeq_epi8(val, vlf)));
+        if (bits != 0)
+            return idx + Nu_LowestBit(bits);
+    }
+#elif defined(NU_SCAN_NEON)
+    const uint8x16_t vmask = vdupq_n_u8(mask);
+    const uint8x16_t vcr = vdupq_n_u8(kNuCharCR);
+    const uint8x16_t vlf = vdupq_n_u8(kNuCharLF);
+
+    for ( ; idx + 16 <= count; idx += 16) {
+        uint8x16_t val = vandq_u8(vld1q_u8(buf + idx), vmask);
+        uint8x16_t hit = vorrq_u8(vceqq_u8(val, vcr), vceqq_u8(val, vlf));
+        if (vmaxvq_u8(hit) != 0)
+            break;
+    }
+#else
+    const uint64_t wmask = kNuOnes64 * mask;
+
+    for ( ; idx + 8 <= count; idx += 8) {
+        uint64_t val = Nu_Load64(buf + idx) & wmask;
+        if (Nu_ZeroBytes64(val ^ (kNuOnes64 * kNuCharCR)) |
+            Nu_ZeroBytes64(val ^ (kNuOnes64 * kNuCharLF)))
+        {
+            break;
+        }
+    }
+#endif
+
+    for ( ; idx < count; idx++) {
+        uch = buf[idx] & mask;
+        if (uch == kNuCharCR || uch == kNuCharLF)
+            break;
+    }
+    return idx;
+}
+
+/*
+ * Return the number of bytes at the start of the buffer that are plain
+ * printable characters (0x20-0x7e) after being ANDed with "mask".  None
+ * of these are binary or EOL characters.
+ */
+static uint32_t Nu_SpanPrintable(const uint8_t* buf, uint32_t count,
+    uint8_t mask)
+{
+    uint32_t idx = 0;
+    uint8_t uch;
+
+#if defined(NU_SCAN_AVX2)
+    const __m256i vmask = _mm256_set1_epi8((char) mask);
+    const __m256i vlow = _mm256_set1_epi8(0x1f);
+    const __m256i vhigh = _mm256_set1_epi8(0x7f);
+
+    for ( ; idx + 32 <= count; idx += 32) {
+        __m256i val = _mm256_and_si256(vmask,
+                        _mm256_loadu_si256((const __m256i*) (buf + idx)));
+        uint32_t bits = (uint32_t) _mm256_movemask_epi8(_mm256_or_si256(
+                        _mm256_cmpeq_epi8(_mm256_min_epu8(val, vlow), val),
+                        _mm256_cmpeq_epi8(_mm256_max_epu8(val, vhigh), val)));
+        if (bits != 0)
+            return idx + Nu_LowestBit(bits);
+    }
+#elif defined(NU_SCAN_SSE2)
+    const __m128i vmask = _mm_set1_epi8((char) mask);
+    const __m128i vlow = _mm_set1_epi8(0x1f);
+    const __m128i vhigh = _mm_set1_epi8(0x7f);
+
+    for ( ; idx + 16 <= count; idx += 16) {
+        __m128i val = _mm_and_si128(vmask,
+                        _mm_loadu_si128((const __m128i*) (buf + idx)));
+        uint32_t bits = (uint32_t) _mm_movemask_epi8(_mm_or_si128(
+                        _mm_cmpeq_epi8(_mm_min_epu8(val, vlow), val),
+                        _mm_cmpeq_epi8(_mm_max_epu8(val, vhigh), val)));
+        if (bits != 0)
+            return idx + Nu_LowestBit(bits);
+    }
+#elif defined(NU_SCAN_NEON)
+    const uint8x16_t vmask = vdupq_n_u8(mask);
+    const uint8x16_t vlow = vdupq_n_u8(0x20);
+    const uint8x16_t vhigh = vdupq_n_u8(0x7f);
+
+    for ( ; idx + 16 <= count; idx += 16) {
+        uint8x16_t val = vandq_u8(vld1q_u8(buf + idx), vmask);
+        uint8x16_t hit = vorrq_u8(vcltq_u8(val, vlow), vcgeq_u8(val, vhigh));
+        if (vmaxvq_u8(hit) != 0)
+            break;
+    }
+#else
+    const uint64_t wmask = kNuOnes64 * mask;
+
+    for ( ; idx + 8 <= count; idx += 8) {
+        uint64_t val = Nu_Load64(buf + idx) & wmask;
+        /* bytes < 0x20, and bytes >= 0x7f */
+        uint64_t low = ~(((val & kNuLow64) + kNuOnes64 * 0x60) | val) &
+                        kNuHigh64;
+        uint64_t high = (((val & kNuLow64) + kNuOnes64) | val) & kNuHigh64;
+        if (low | high)
+            break;
+    }
+#endif
+
+    for ( ; idx < count; idx++) {
+        uch = buf[idx] & mask;
+        if (uch < 0x20 || uch >= 0x7f)
+            break;
+    }
+    return idx;
+}
+
+/*
+ * Copy "count" bytes from "src" to "dst", stripping the high bit.
+ */
+static void Nu_CopyStripHigh(uint8_t* dst, const uint8_t* src,
+    uint32_t count)
+{
+    uint32_t idx = 0;
+
+#if defined(NU_SCAN_AVX2)
+    const __m256i vmask = _mm256_set1_epi8(0x7f);
+
+    for ( ; idx + 32 <= count; idx += 32) {
+        _mm256_storeu_si256((__m256i*) (dst + idx), _mm256_and_si256(vmask,
+                        _mm256_loadu_si256((const __m256i*) (src + idx))));
+    }
+#elif defined(NU_SCAN_SSE2)
+    const __m128i vmask = _mm_set1_epi8(0x7f);
+
+    for ( ; idx + 16 <= count; idx += 16) {
+        _mm_storeu_si128((__m128i*) (dst + idx), _mm_and_si128(vmask,
+                        _mm_loadu_si128((const __m128i*) (src + idx))));
+    }
+#elif defined(NU_SCAN_NEON)
+    const uint8x16_t vmask = vdupq_n_u8(0x7f);
+
+    for ( ; idx + 16 <= count; idx += 16)
+        vst1q_u8(dst + idx, vandq_u8(vld1q_u8(src + idx), vmask));
+#else
+    for ( ; idx + 8 <= count; idx += 8) {
+        uint64_t val = Nu_Load64(src + idx) & kNuLow64;
+        memcpy(dst + idx, &val, sizeof(val));
+    }
+#endif
+
+    for ( ; idx < count; idx++)
+        dst[idx] = src[idx] & 0x7f;
+}
+
+
+/*
+ * Return the number of bytes at the start of the buffer that either have
+ * the high bit set or are spaces.
+ */
+static uint32_t Nu_SpanHighASCII(const uint8_t* buffer, uint32_t count)
+{
+    uint32_t idx = 0;
+
+#if defined(NU_SCAN_AVX2)
+    const __m256i vspace = _mm256_set1_epi8(0x20);
+
+    for ( ; idx + 32 <= count; idx += 32) {
+        __m256i val = _mm256_loadu_si256((const __m256i*) (buffer + idx));
+        uint32_t bits = (uint32_t) _mm256_movemask_epi8(val) |
+                (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(val, vspace));
+        if (bits != 0xffffffff)
+            break;
+    }
+#elif defined(NU_SCAN_SSE2)
+    const __m128i vspace = _mm_set1_epi8(0x20);
+
+    for ( ; idx + 16 <= count; idx += 16) {
+        __m128i val = _mm_loadu_si128((const __m128i*) (buffer + idx));
+        uint32_t bits = (uint32_t) _mm_movemask_epi8(val) |
+                (uint32_t) _mm_movemask_epi8(_mm_cmpeq_epi8(val, vspace));
+        if (bits != 0xffff)
+            break;
+    }
+#elif defined(NU_SCAN_NEON)
+    const uint8x16_t vspace = vdupq_n_u8(0x20);
+    const uint8x16_t vhigh = vdupq_n_u8(0x80);
+
+    for ( ; idx + 16 <= count; idx += 16) {
+        uint8x16_t val = vld1q_u8(buffer + idx);
+        uint8x16_t okay = vorrq_u8(vcgeq_u8(val, vhigh), vceqq_u8(val, vspace));
+        if (vminvq_u8(okay) == 0)
+            break;
+    }
+#else
+    for ( ; idx + 8 <= count; idx += 8) {
+        uint64_t val = Nu_Load64(buffer + idx);
+        if (~val & kNuHigh64 & ~Nu_ZeroBytes64(val ^ (kNuOnes64 * 0x20)))
+            break;
+    }
+#endif
+
+    for ( ; idx < count; idx++) {
+        if ((buffer[idx] & 0x80) == 0 && buffer[idx] != 0x20)
+            break;
+    }
+    return idx;
+}
+
+
 /*
  * Check to see if this is a high-ASCII file.  To qualify, EVERY
  * character must have its high bit set, except for spaces (0x20).
@@ -318,23 +636,11 @@ void Nu_FunnelSetMaxOutput(NuFunnel* pFunnel, uint32_t maxBytes)
 static Boolean Nu_CheckHighASCII(const NuFunnel* pFunnel, const uint8_t* buffer,
     uint32_t count)
 {
-    Boolean isHighASCII;
-
     Assert(buffer != NULL);
     Assert(count != 0);
     Assert(pFunnel->checkStripHighASCII);
 
-    isHighASCII = true;
-    while (count--) {
-        if ((*buffer & 0x80) == 0 && *buffer != 0x20) {
-            isHighASCII = false;
-            break;
-        }
-        
-        buffer++;
-    }
-
-    return isHighASCII;
+    return Nu_SpanHighASCII(buffer, count) == count;
 }
 
 /*
@@ -398,9 +704,9 @@ static const char gNuIsBinary[256] = {
 static NuValue Nu_DetermineConversion(NuFunnel* pFunnel, const uint8_t* buffer,
     uint32_t count)
 {
-    uint32_t bufCount, numBinary, numLF, numCR;
+    uint32_t bufCount, numBinary, numLF, numCR, span;
     Boolean isHighASCII;
-    uint8_t val;
+    uint8_t val, mask;
 
     if (count < kNuMinConvThreshold)
         return kNuConvertOff;
@@ -419,10 +725,17 @@ static NuValue Nu_DetermineConversion(NuFunnel* pFunnel, const uint8_t* buffer,
 
     bufCount = count;
     numBinary = numLF = numCR = 0;
-    while (bufCount--) {
-        val = *buffer++;
-        if (isHighASCII)
-            val &= 0x7f;
+    mask = isHighASCII ? 0x7f : 0xff;
+    while (bufCount) {
+        /* printable chars don't affect any of the counts, so skip them */
+        span = Nu_SpanPrintable(buffer, bufCount, mask);
+        buffer += span;
+        bufCount -= span;
+        if (!bufCount)
+            break;
+
+        val = *buffer++ & mask;
+        bufCount--;
         if (gNuIsBinary[val])
             numBinary++;
         if (val == kNuCharLF)
@@ -498,24 +811,72 @@ static inline void Nu_FunnelPutBlock(NuFunnel* pFunnel, const uint8_t* buf,
 }
 
 
+/*
+ * Write out whatever has accumulated in the conversion buffer.
+ */
+static inline void Nu_FunnelFlushConv(NuFunnel* pFunnel, uint32_t* pConvCount)
+{
+    if (*pConvCount) {
+        Nu_FunnelPutBlock(pFunnel, pFunnel->convBuf, *pConvCount);
+        *pConvCount = 0;
+    }
+}
+
+/*
+ * Output a run of non-EOL characters, stripping the high bit if "mask"
+ * is 0x7f.  Output is collected in the conversion buffer so we don't
+ * have to call the data sink for every line.
+ */
+static void Nu_FunnelPutText(NuFunnel* pFunnel, uint32_t* pConvCount,
+    const uint8_t* buf, uint32_t len, uint8_t mask)
+{
+    uint32_t chunk;
+
+    if (mask == 0xff && len >= kNuFunnelConvBufSize / 2) {
+        /* not worth copying; send it straight through */
+        Nu_FunnelFlushConv(pFunnel, pConvCount);
+        Nu_FunnelPutBlock(pFunnel, buf, len);
+        return;
+    }
+
+    while (len) {
+        chunk = kNuFunnelConvBufSize - *pConvCount;
+        if (chunk > len)
+            chunk = len;
+        if (mask == 0xff)
+            memcpy(pFunnel->convBuf + *pConvCount, buf, chunk);
+        else
+            Nu_CopyStripHigh(pFunnel->convBuf + *pConvCount, buf, chunk);
+        *pConvCount += chunk;
+        buf += chunk;
+        len -= chunk;
+
+        if (*pConvCount == kNuFunnelConvBufSize)
+            Nu_FunnelFlushConv(pFunnel, pConvCount);
+    }
+}
+
 /*
  * Output the EOL marker requested for this system.
  */
-static inline void Nu_PutEOL(NuFunnel* pFunnel)
+static inline void Nu_PutEOL(NuFunnel* pFunnel, uint32_t* pConvCount)
 {
-    uint8_t ch;
+    uint8_t* convBuf;
+
+    if (*pConvCount + 2 > kNuFunnelConvBufSize)
+        Nu_FunnelFlushConv(pFunnel, pConvCount);
+    convBuf = pFunnel->convBuf + *pConvCount;
 
     if (pFunnel->convertEOLTo == kNuEOLCR) {
-        ch = kNuCharCR;
-        Nu_FunnelPutBlock(pFunnel, &ch, 1);
+        convBuf[0] = kNuCharCR;
+        *pConvCount += 1;
     } else if (pFunnel->convertEOLTo == kNuEOLLF) {
-        ch = kNuCharLF;
-        Nu_FunnelPutBlock(pFunnel, &ch, 1);
+        convBuf[0] = kNuCharLF;
+        *pConvCount += 1;
     } else if (pFunnel->convertEOLTo == kNuEOLCRLF) {
-        ch = kNuCharCR;
-        Nu_FunnelPutBlock(pFunnel, &ch, 1);
-        ch = kNuCharLF;
-        Nu_FunnelPutBlock(pFunnel, &ch, 1);
+        convBuf[0] = kNuCharCR;
+        convBuf[1] = kNuCharLF;
+        *pConvCount += 2;
     } else {
         Assert(0);
     }
@@ -578,8 +939,12 @@ static NuError Nu_FunnelWriteConvert(NuFunnel* pFunnel, const uint8_t* buffer,
     } else {
         /* do the EOL conversion and optional high-bit stripping */
         Boolean lastCR = pFunnel->lastCR;   /* make local copy */
+        uint32_t convCount = 0;
+        uint32_t span;
         uint8_t uch;
-        int mask;
+        uint8_t mask;
+
+        Assert(pFunnel->convBuf != NULL);
 
         if (pFunnel->doStripHighASCII)
             mask = 0x7f;
@@ -587,25 +952,34 @@ static NuError Nu_FunnelWriteConvert(NuFunnel* pFunnel, const uint8_t* buffer,
             mask = 0xff;
 
         /*
-         * We could get a significant speed improvement here by writing
-         * non-EOL chars as a larger block instead of single bytes.
+         * Find the next CR or LF, and write everything before it as a
+         * single block.  Then handle the EOL char itself.
          */
-        while (count--) {
-            uch = (*buffer) & mask;
+        while (count) {
+            span = Nu_SpanNonEOL(buffer, count, mask);
+            if (span) {
+                Nu_FunnelPutText(pFunnel, &convCount, buffer, span, mask);
+                lastCR = false;
+                buffer += span;
+                count -= span;
+                if (!count)
+                    break;
+            }
 
+            uch = (*buffer) & mask;
             if (uch == kNuCharCR) {
-                Nu_PutEOL(pFunnel);
+                Nu_PutEOL(pFunnel, &convCount);
                 lastCR = true;
-            } else if (uch == kNuCharLF) {
-                if (!lastCR)
-                    Nu_PutEOL(pFunnel);
-                lastCR = false;
             } else {
-                Nu_FunnelPutBlock(pFunnel, &uch, 1);
+                Assert(uch == kNuCharLF);
+                if (!lastCR)
+                    Nu_PutEOL(pFunnel, &convCount);
                 lastCR = false;
             }
             buffer++;
+            count--;
         }
+        Nu_FunnelFlushConv(pFunnel, &convCount);
         pFunnel->lastCR = lastCR;   /* save copy */
 
     }
@@ -803,8 +1177,9 @@ NuError Nu_StrawFree(NuArchive* pArchive, NuStraw* pStraw)
 NuError Nu_StrawSetProgressState(NuStraw* pStraw, NuProgressState state)
 {
     Assert(pStraw != NULL);
-    Assert(pStraw->pProgress != NULL);
 
+    if (pStraw->pProgress == NULL)
+        return kNuErrNone;      /* no progress meter attached */
     pStraw->pProgress->state = state;
 
     return kNuErrNone;
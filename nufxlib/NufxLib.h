@@ -285,6 +285,11 @@ typedef NuResult (*NuCallback)(NuArchive* pArchive, void* args);
 
 /*
  * Parameters that affect archive operations.
+ *
+ * kNuValueCompressThreads sets how many threads NuFlush compresses new
+ * threads on (1 = just the caller's, 0 = one per CPU), and
+ * kNuValueCompressMemLimit is how many bytes of compressed output it may
+ * hold in memory before spilling to temp files.
  */
 typedef enum NuValueID {
     kNuValueInvalid             = 0,
@@ -302,7 +307,9 @@ typedef enum NuValueID {
     kNuValueStripHighASCII      = 12,
     kNuValueJunkSkipMax         = 13,
     kNuValueIgnoreLZW2Len       = 14,
-    kNuValueHandleBadMac        = 15
+    kNuValueHandleBadMac        = 15,
+    kNuValueCompressThreads     = 16,
+    kNuValueCompressMemLimit    = 17
 } NuValueID;
 typedef uint32_t NuValue;
 
@@ -70,6 +70,10 @@ typedef enum NuOpenMode {
 /* size of general-purpose compression buffer */
 #define kNuGenCompBufSize       32768
 
+/* limits for the compression workers used during a flush */
+#define kNuMaxCompressThreads       64
+#define kNuDefaultCompressMemLimit  (64 * 1024 * 1024)
+
 #define kNuCharLF   0x0a
 #define kNuCharCR   0x0d
 
@@ -91,6 +95,9 @@ typedef struct NuRecordSet {
     NuRecord*       nuRecordTail;
 } NuRecordSet;
 
+/* compression workers, only present during a flush; see Pipeline.c */
+typedef struct NuPipeline NuPipeline;
+
 /*
  * Archive state.
  */
@@ -138,6 +145,7 @@ struct NuArchive {
     uint8_t*        compBuf;                /* large general-purpose buffer */
     void*           lzwCompressState;       /* state for LZW/1 and LZW/2 */
     void*           lzwExpandState;         /* state for LZW/1 and LZW/2 */
+    NuPipeline*     pPipeline;              /* compress ahead during flush */
 
     /* options and attributes that the user can set */
     /* (these can be changed by a callback, so don't cache them internally) */
@@ -158,6 +166,8 @@ struct NuArchive {
     NuValue         valJunkSkipMax;         /* scan this far for header */
     NuValue         valIgnoreLZW2Len;       /* don't verify LZW/II len field */
     NuValue         valHandleBadMac;        /* handle "bad Mac" archives */
+    NuValue         valCompressThreads;     /* #of threads to compress on */
+    NuValue         valCompressMemLimit;    /* max bytes to compress ahead */
 
     /* callback functions */
     NuCallback      selectionFilterFunc;
@@ -237,6 +247,7 @@ struct NuThreadMod {
  */
 
 #define kNuFunnelBufSize    16384
+#define kNuFunnelConvBufSize 4096
 
 /*
  * File funnel definition.  This is used for writing output to files
@@ -258,6 +269,7 @@ typedef struct NuFunnel {
     /* data storage */
     uint8_t*        buffer;         /* kNuFunnelBufSize worth of storage */
     long            bufCount;       /* #of bytes in buffer */
+    uint8_t*        convBuf;        /* kNuFunnelConvBufSize, for EOL conv */
 
     /* text conversion; if "auto", on first flush we convert to "on" or "off" */
     NuValue         convertEOL;     /* on/off/auto */
@@ -810,6 +822,14 @@ NuError Nu_DataSinkPutBlock(NuDataSink* pDataSink, const uint8_t* buf,
     uint32_t len);
 NuError Nu_DataSinkGetError(NuDataSink* pDataSink);
 
+/* Pipeline.c */
+NuError Nu_PipelineStart(NuArchive* pArchive);
+void Nu_PipelineFinish(NuArchive* pArchive);
+NuError Nu_PipelineWriteThread(NuArchive* pArchive,
+    const NuThreadMod* pThreadMod, NuProgressData* pProgressData,
+    FILE* dstFp, NuThread* pThread, Boolean* pHandled);
+void Nu_PipelineSkipRecord(NuArchive* pArchive, const NuRecord* pRecord);
+
 /* Squeeze.c */
 NuError Nu_CompressHuffmanSQ(NuArchive* pArchive, NuStraw* pStraw, FILE* fp,
     uint32_t srcLen, uint32_t* pDstLen, uint16_t* pCrc);
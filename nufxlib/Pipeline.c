@@ -0,0 +1,822 @@
+/*
+ * NuFX archive manipulation library
+ * Copyright (C) 2000-2007 by Andy McFadden, All Rights Reserved.
+ * This is free software; you can redistribute it and/or modify it under the
+ * terms of the BSD License, see the file COPYING-LIB.
+ *
+ * Compress new threads ahead of time, on several threads at once.
+ *
+ * Nu_Flush writes new records one at a time, and compressing the data is
+ * usually the slow part.  When kNuValueCompressThreads allows it, we walk
+ * through the "new" record set before anything is written and make a job
+ * for every thread that will need compressing.  Worker threads take jobs
+ * in order and compress them into memory, or into a temp file once the
+ * kNuValueCompressMemLimit budget is used up.  Meanwhile the records are
+ * constructed as usual, and Nu_HandleAddThreadMods copies each finished
+ * job into the archive instead of compressing it again.  The output is
+ * identical to what you'd get without the workers.
+ *
+ * Only "file" and "buffer" sources are handled, and the workers use their
+ * own copy of the data source.  FP sources (which may share a FILE*) and
+ * anything the workers trip over go through the usual path, so the error
+ * handler and progress updater are only ever called on the application's
+ * thread.  If the writer gets to a job before any worker has, it takes the
+ * job back and does it the usual way rather than waiting.
+ */
+#include "NufxLibPriv.h"
+
+#if defined(HAVE_PTHREAD_H)
+# include <pthread.h>
+# define NU_HAVE_THREADS
+#elif defined(WINDOWS_LIKE)
+# include <windows.h>
+# include <process.h>
+# define NU_HAVE_THREADS
+#endif
+
+#ifdef NU_HAVE_THREADS
+
+/*
+ * Minimal wrappers around the system's threads.
+ */
+#if defined(HAVE_PTHREAD_H)
+typedef pthread_t           NuWorkerHandle;
+typedef pthread_mutex_t     NuLock;
+typedef pthread_cond_t      NuCond;
+# define Nu_LockInit(pLock)     pthread_mutex_init(pLock, NULL)
+# define Nu_LockFree(pLock)     pthread_mutex_destroy(pLock)
+# define Nu_Lock(pLock)         pthread_mutex_lock(pLock)
+# define Nu_Unlock(pLock)       pthread_mutex_unlock(pLock)
+# define Nu_CondInit(pCond)     pthread_cond_init(pCond, NULL)
+# define Nu_CondFree(pCond)     pthread_cond_destroy(pCond)
+# define Nu_CondWait(pCond, pLock)  pthread_cond_wait(pCond, pLock)
+# define Nu_CondBroadcast(pCond)    pthread_cond_broadcast(pCond)
+#else
+typedef HANDLE              NuWorkerHandle;
+typedef CRITICAL_SECTION    NuLock;
+typedef CONDITION_VARIABLE  NuCond;
+# define Nu_LockInit(pLock)     InitializeCriticalSection(pLock)
+# define Nu_LockFree(pLock)     DeleteCriticalSection(pLock)
+# define Nu_Lock(pLock)         EnterCriticalSection(pLock)
+# define Nu_Unlock(pLock)       LeaveCriticalSection(pLock)
+# define Nu_CondInit(pCond)     InitializeConditionVariable(pCond)
+# define Nu_CondFree(pCond)     ((void) 0)
+# define Nu_CondWait(pCond, pLock) \
+                                SleepConditionVariableCS(pCond, pLock, INFINITE)
+# define Nu_CondBroadcast(pCond)    WakeAllConditionVariable(pCond)
+#endif
+
+/* threads may be added in this order; matches Nu_ConstructNewRecord */
+static const NuThreadID kNuPipelineOrder[] = {
+    kNuThreadIDDataFork, kNuThreadIDDiskImage, kNuThreadIDRsrcFork,
+    kNuThreadIDWildcard
+};
+#define kNuPipelineOrderCount \
+    (int) (sizeof(kNuPipelineOrder) / sizeof(kNuPipelineOrder[0]))
+
+typedef enum NuJobState {
+    kNuJobPending = 0,      /* waiting for a worker */
+    kNuJobRunning,          /* a worker is compressing it */
+    kNuJobCompressed,       /* compressed output is ready */
+    kNuJobStore,            /* didn't get smaller; store it instead */
+    kNuJobFailed,           /* couldn't do it; use the usual path */
+    kNuJobTaken             /* writer took it back, or the record was skipped */
+} NuJobState;
+
+typedef struct NuPipelineJob {
+    const NuRecord*     pRecord;        /* record the thread is added to */
+    const NuThreadMod*  pThreadMod;     /* the "add" threadMod */
+    NuDataSource*       pDataSource;    /* worker's copy of the source */
+    NuThreadFormat      targetFormat;
+    NuJobState          state;
+
+    /* results, valid when state is kNuJobCompressed */
+    NuThread            thread;         /* CRC, lengths, and format */
+    char*               outBuf;         /* output, if kept in memory */
+    FILE*               outFp;          /* output, if spilled to a temp file */
+    uint32_t            memCharge;      /* bytes counted against the limit */
+} NuPipelineJob;
+
+struct NuPipeline {
+    NuPipelineJob*      jobs;
+    long                numJobs;
+    long                nextJob;        /* next job for a worker */
+    long                nextResult;     /* next job the writer expects */
+
+    uint32_t            memLimit;       /* max output to hold in memory */
+    uint32_t            memUsed;
+    int                 numSpilled;     /* unclaimed output in temp files */
+    int                 maxSpilled;     /* workers wait when we hit this */
+    Boolean             cancel;         /* tells the workers to stop */
+    NuValue             valMimicSHK;
+
+    int                 numWorkers;
+    NuWorkerHandle*     workers;
+    NuLock              lock;
+    NuCond              cond;           /* broadcast on every state change */
+};
+
+
+/*
+ * Figure out how many threads "0" means.
+ */
+static int Nu_PipelineGetCPUCount(void)
+{
+#if defined(WINDOWS_LIKE)
+    SYSTEM_INFO sysInfo;
+
+    GetSystemInfo(&sysInfo);
+    return (int) sysInfo.dwNumberOfProcessors;
+#elif defined(_SC_NPROCESSORS_ONLN)
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return count > 0 ? (int) count : 1;
+#else
+    return 1;
+#endif
+}
+
+/*
+ * Error messages from the workers are not interesting, because anything
+ * that fails gets redone by the usual path, which will report it properly.
+ * This also keeps the application's message handler on its own thread.
+ */
+static NuResult Nu_PipelineQuietHandler(NuArchive* pArchive, void* args)
+{
+    return kNuOK;
+}
+
+/*
+ * Decide if a threadMod is something the workers can compress.
+ */
+static Boolean Nu_PipelineCanHandle(const NuPipeline* pPipeline,
+    const NuThreadMod* pThreadMod)
+{
+    const NuDataSource* pDataSource = pThreadMod->entry.add.pDataSource;
+
+    if (pThreadMod->entry.kind != kNuThreadModAdd ||
+        pThreadMod->entry.add.isPresized ||
+        pThreadMod->entry.add.threadID == kNuThreadIDFilename ||
+        pThreadMod->entry.add.threadFormat == kNuThreadFormatUncompressed ||
+        Nu_DataSourceGetThreadFormat(pDataSource) !=
+                                            kNuThreadFormatUncompressed)
+    {
+        return false;
+    }
+
+    switch (Nu_DataSourceGetType(pDataSource)) {
+    case kNuDataSourceFromFile:
+        return !pDataSource->fromFile.fromRsrcFork;
+    case kNuDataSourceFromBuffer:
+        /* tiny ones would just be stored */
+        if (Nu_DataSourceGetDataLen(pDataSource) == 0)
+            return false;
+        if (pPipeline->valMimicSHK &&
+            Nu_DataSourceGetDataLen(pDataSource) < 512)
+        {
+            return false;
+        }
+        return true;
+    default:
+        return false;
+    }
+}
+
+/*
+ * Decide if a threadMod is added in the pass for "orderIdx".
+ */
+static Boolean Nu_PipelineInPass(const NuThreadMod* pThreadMod, int orderIdx)
+{
+    NuThreadID threadID = pThreadMod->entry.add.threadID;
+    int i;
+
+    if (kNuPipelineOrder[orderIdx] != kNuThreadIDWildcard)
+        return threadID == kNuPipelineOrder[orderIdx];
+
+    for (i = 0; i < orderIdx; i++) {
+        if (threadID == kNuPipelineOrder[i])
+            return false;
+    }
+    return true;
+}
+
+/*
+ * Make a private copy of a data source, so a worker can read from it
+ * without disturbing the original.
+ */
+static NuError Nu_PipelineCopySource(const NuDataSource* pDataSource,
+    NuDataSource** ppCopy)
+{
+    if (Nu_DataSourceGetType(pDataSource) == kNuDataSourceFromFile) {
+        return Nu_DataSourceFile_New(kNuThreadFormatUncompressed, 0,
+                pDataSource->fromFile.pathnameUNI, false, ppCopy);
+    } else {
+        Assert(Nu_DataSourceGetType(pDataSource) == kNuDataSourceFromBuffer);
+        return Nu_DataSourceBuffer_New(kNuThreadFormatUncompressed, 0,
+                pDataSource->fromBuffer.buffer, pDataSource->fromBuffer.offset,
+                Nu_DataSourceGetDataLen(pDataSource), NULL, ppCopy);
+    }
+}
+
+/*
+ * Give back any memory charged to a job.  Call with the lock held.
+ */
+static void Nu_PipelineUncharge(NuPipeline* pPipeline, NuPipelineJob* pJob,
+    uint32_t newCharge)
+{
+    Assert(newCharge <= pJob->memCharge);
+    Assert(pPipeline->memUsed >= pJob->memCharge);
+    pPipeline->memUsed -= pJob->memCharge - newCharge;
+    pJob->memCharge = newCharge;
+}
+
+/*
+ * Compress one job.  Runs on a worker thread, without the lock held.
+ *
+ * "pShadow" is the worker's private archive struct, which has its own
+ * compression buffers and a copy of the settings the compressors use.
+ */
+static NuJobState Nu_PipelineRunJob(NuPipeline* pPipeline, NuArchive* pShadow,
+    NuPipelineJob* pJob)
+{
+    NuJobState result = kNuJobFailed;
+    NuError err;
+    FILE* fp = NULL;
+    char* memBuf = NULL;
+    size_t memSize = 0;
+    Boolean inMemory = false;
+    uint32_t srcLen;
+
+    err = Nu_DataSourcePrepareInput(pShadow, pJob->pDataSource);
+    if (err != kNuErrNone)
+        goto bail;
+
+    srcLen = Nu_DataSourceGetDataLen(pJob->pDataSource);
+    if (srcLen == 0 || (pPipeline->valMimicSHK && srcLen < 512)) {
+        result = kNuJobStore;
+        goto bail;
+    }
+
+    /*
+     * Keep the output in memory if the input fits in what's left of the
+     * budget.  If the output ends up bigger than the input, we don't keep
+     * it at all.
+     */
+#ifdef HAVE_OPEN_MEMSTREAM
+    Nu_Lock(&pPipeline->lock);
+    if (srcLen <= pPipeline->memLimit - pPipeline->memUsed) {
+        pPipeline->memUsed += srcLen;
+        pJob->memCharge = srcLen;
+    }
+    Nu_Unlock(&pPipeline->lock);
+
+    if (pJob->memCharge != 0) {
+        fp = open_memstream(&memBuf, &memSize);
+        inMemory = (fp != NULL);
+    }
+#endif
+    if (fp == NULL)
+        fp = tmpfile();
+    if (fp == NULL)
+        goto bail;
+
+    pJob->thread.fileOffset = 0;
+    err = Nu_CompressToArchive(pShadow, pJob->pDataSource,
+            pJob->pThreadMod->entry.add.threadID, kNuThreadFormatUncompressed,
+            pJob->targetFormat, NULL, fp, &pJob->thread);
+    if (err != kNuErrNone)
+        goto bail;
+
+    if (pJob->thread.thThreadFormat == kNuThreadFormatUncompressed) {
+        /* the writer can copy it from the source just as easily */
+        result = kNuJobStore;
+        goto bail;
+    }
+
+    if (inMemory) {
+        /* closing a memory stream finalizes the buffer */
+        if (fclose(fp) != 0) {
+            fp = NULL;
+            goto bail;
+        }
+        fp = NULL;
+        Assert(memSize >= pJob->thread.thCompThreadEOF);
+        pJob->outBuf = memBuf;
+        memBuf = NULL;
+    } else {
+        pJob->outFp = fp;
+        fp = NULL;
+    }
+    result = kNuJobCompressed;
+
+bail:
+    Nu_DataSourceUnPrepareInput(pShadow, pJob->pDataSource);
+    if (fp != NULL)
+        fclose(fp);
+    free(memBuf);
+
+    Nu_Lock(&pPipeline->lock);
+    if (pJob->outBuf != NULL)
+        Nu_PipelineUncharge(pPipeline, pJob, pJob->thread.thCompThreadEOF);
+    else
+        Nu_PipelineUncharge(pPipeline, pJob, 0);
+    Nu_Unlock(&pPipeline->lock);
+
+    return result;
+}
+
+/*
+ * Worker thread body.  Takes jobs in order until they run out or we're
+ * told to stop.
+ *
+ * We don't let the workers get too far ahead with output in temp files,
+ * since every one is an open file.  Memory is limited by the budget.
+ */
+static void Nu_PipelineWorker(NuPipeline* pPipeline)
+{
+    NuArchive* pShadow;
+    NuPipelineJob* pJob;
+    NuJobState result;
+
+    pShadow = Nu_Calloc(NULL, sizeof(*pShadow));
+    if (pShadow == NULL)
+        return;     /* the writer will pick up the slack */
+    pShadow->structMagic = kNuArchiveStructMagic;
+    pShadow->valMimicSHK = pPipeline->valMimicSHK;
+    pShadow->messageHandlerFunc = Nu_PipelineQuietHandler;
+
+    Nu_Lock(&pPipeline->lock);
+    while (true) {
+        while (!pPipeline->cancel &&
+            pPipeline->nextJob < pPipeline->numJobs &&
+            pPipeline->numSpilled >= pPipeline->maxSpilled)
+        {
+            Nu_CondWait(&pPipeline->cond, &pPipeline->lock);
+        }
+        if (pPipeline->cancel || pPipeline->nextJob >= pPipeline->numJobs)
+            break;
+
+        pJob = &pPipeline->jobs[pPipeline->nextJob++];
+        if (pJob->state != kNuJobPending)
+            continue;
+        pJob->state = kNuJobRunning;
+        Nu_Unlock(&pPipeline->lock);
+
+        result = Nu_PipelineRunJob(pPipeline, pShadow, pJob);
+
+        Nu_Lock(&pPipeline->lock);
+        pJob->state = result;
+        if (pJob->outFp != NULL)
+            pPipeline->numSpilled++;
+        Nu_CondBroadcast(&pPipeline->cond);
+    }
+    Nu_Unlock(&pPipeline->lock);
+
+    Nu_Free(NULL, pShadow->compBuf);
+    Nu_Free(NULL, pShadow->lzwCompressState);
+    Nu_Free(NULL, pShadow);
+}
+
+#if defined(HAVE_PTHREAD_H)
+static void* Nu_PipelineWorkerEntry(void* vpPipeline)
+{
+    Nu_PipelineWorker((NuPipeline*) vpPipeline);
+    return NULL;
+}
+#else
+static unsigned __stdcall Nu_PipelineWorkerEntry(void* vpPipeline)
+{
+    Nu_PipelineWorker((NuPipeline*) vpPipeline);
+    return 0;
+}
+#endif
+
+/*
+ * Start a worker thread.  Returns "false" if it couldn't be created.
+ */
+static Boolean Nu_PipelineStartWorker(NuPipeline* pPipeline,
+    NuWorkerHandle* pHandle)
+{
+#if defined(HAVE_PTHREAD_H)
+    return pthread_create(pHandle, NULL, Nu_PipelineWorkerEntry,
+                pPipeline) == 0;
+#else
+    *pHandle = (HANDLE) _beginthreadex(NULL, 0, Nu_PipelineWorkerEntry,
+                pPipeline, 0, NULL);
+    return *pHandle != NULL;
+#endif
+}
+
+/*
+ * Wait for a worker thread to exit.
+ */
+static void Nu_PipelineJoinWorker(NuWorkerHandle handle)
+{
+#if defined(HAVE_PTHREAD_H)
+    (void) pthread_join(handle, NULL);
+#else
+    (void) WaitForSingleObject(handle, INFINITE);
+    CloseHandle(handle);
+#endif
+}
+
+/*
+ * Throw away a job's output.  Call with the lock held.
+ */
+static void Nu_PipelineDiscardOutput(NuPipeline* pPipeline,
+    NuPipelineJob* pJob)
+{
+    if (pJob->outFp != NULL) {
+        fclose(pJob->outFp);
+        pJob->outFp = NULL;
+        Assert(pPipeline->numSpilled > 0);
+        pPipeline->numSpilled--;
+    }
+    free(pJob->outBuf);
+    pJob->outBuf = NULL;
+    Nu_PipelineUncharge(pPipeline, pJob, 0);
+}
+
+/*
+ * Claim a job for the writer.  If a worker is busy with it, wait for it
+ * to finish.  If no worker has started it, take it back so nobody does.
+ *
+ * Returns the state the job was in.
+ */
+static NuJobState Nu_PipelineClaimJob(NuPipeline* pPipeline,
+    NuPipelineJob* pJob)
+{
+    NuJobState state;
+
+    Nu_Lock(&pPipeline->lock);
+    while (pJob->state == kNuJobRunning)
+        Nu_CondWait(&pPipeline->cond, &pPipeline->lock);
+    state = pJob->state;
+    if (state == kNuJobPending)
+        pJob->state = kNuJobTaken;
+    Nu_Unlock(&pPipeline->lock);
+
+    return state;
+}
+
+/*
+ * Release a job the writer is done with.
+ */
+static void Nu_PipelineReleaseJob(NuPipeline* pPipeline, NuPipelineJob* pJob)
+{
+    Nu_Lock(&pPipeline->lock);
+    Nu_PipelineDiscardOutput(pPipeline, pJob);
+    pJob->state = kNuJobTaken;
+    Nu_CondBroadcast(&pPipeline->cond);
+    Nu_Unlock(&pPipeline->lock);
+}
+
+/*
+ * Copy a job's compressed output to the archive, sending progress updates
+ * as we go.
+ */
+static NuError Nu_PipelineCopyOutput(NuArchive* pArchive, NuPipelineJob* pJob,
+    NuProgressData* pProgressData, FILE* dstFp)
+{
+    NuError err = kNuErrNone;
+    uint32_t srcLen = pJob->thread.thThreadEOF;
+    uint32_t compLen = pJob->thread.thCompThreadEOF;
+    uint32_t count, getsize;
+
+    if (pJob->outFp != NULL) {
+        err = Nu_AllocCompressionBufferIFN(pArchive);
+        BailError(err);
+        err = Nu_FSeek(pJob->outFp, 0, SEEK_SET);
+        BailError(err);
+    }
+
+    if (pProgressData != NULL) {
+        pProgressData->state = kNuProgressCompressing;
+        pProgressData->uncompressedLength = srcLen;
+        pProgressData->uncompressedProgress = 0;
+        pProgressData->compress.threadFormat = pJob->targetFormat;
+    }
+
+    for (count = 0; count < compLen; count += getsize) {
+        getsize = compLen - count;
+        if (getsize > kNuGenCompBufSize)
+            getsize = kNuGenCompBufSize;
+
+        if (pJob->outFp != NULL) {
+            err = Nu_FRead(pJob->outFp, pArchive->compBuf, getsize);
+            BailError(err);
+            err = Nu_FWrite(dstFp, pArchive->compBuf, getsize);
+        } else {
+            err = Nu_FWrite(dstFp, pJob->outBuf + count, getsize);
+        }
+        BailError(err);
+
+        if (pProgressData != NULL) {
+            /* show it in terms of the uncompressed data */
+            pProgressData->uncompressedProgress =
+                (uint32_t) (((double) srcLen * count) / compLen);
+            err = Nu_SendInitialProgress(pArchive, pProgressData);
+            BailError(err);
+        }
+    }
+
+    /* make sure we send a final "success" progress message at 100% */
+    if (pProgressData != NULL) {
+        pProgressData->state = kNuProgressDone;
+        pProgressData->uncompressedProgress = srcLen;
+        err = Nu_SendInitialProgress(pArchive, pProgressData);
+        BailError(err);
+    }
+
+bail:
+    return err;
+}
+
+
+/*
+ * ===========================================================================
+ *      Flush interface
+ * ===========================================================================
+ */
+
+/*
+ * Get the workers going on the records in the "new" set.  Does nothing if
+ * kNuValueCompressThreads says not to, or if there's nothing worth doing.
+ *
+ * Call this after the "new" set is final, i.e. right before the records
+ * are constructed.
+ */
+NuError Nu_PipelineStart(NuArchive* pArchive)
+{
+    NuError err = kNuErrNone;
+    NuPipeline* pPipeline = NULL;
+    NuRecord* pRecord;
+    const NuThreadMod* pThreadMod;
+    long numJobs;
+    int numThreads, orderIdx, i;
+
+    Assert(pArchive->pPipeline == NULL);
+
+    numThreads = (int) pArchive->valCompressThreads;
+    if (numThreads == 0)
+        numThreads = Nu_PipelineGetCPUCount();
+    if (numThreads <= 1)
+        goto bail;
+
+    pPipeline = Nu_Calloc(pArchive, sizeof(*pPipeline));
+    BailAlloc(pPipeline);
+    pPipeline->memLimit = pArchive->valCompressMemLimit;
+    pPipeline->valMimicSHK = pArchive->valMimicSHK;
+
+    /* count them up */
+    numJobs = 0;
+    pRecord = Nu_RecordSet_GetListHead(&pArchive->newRecordSet);
+    for ( ; pRecord != NULL; pRecord = pRecord->pNext) {
+        pThreadMod = pRecord->pThreadMods;
+        for ( ; pThreadMod != NULL; pThreadMod = pThreadMod->pNext) {
+            if (Nu_PipelineCanHandle(pPipeline, pThreadMod))
+                numJobs++;
+        }
+    }
+    if (numJobs < 2) {
+        DBUG(("--- only %ld threads to compress, not starting workers\n",
+            numJobs));
+        goto bail;
+    }
+
+    pPipeline->jobs = Nu_Calloc(pArchive, numJobs * sizeof(NuPipelineJob));
+    BailAlloc(pPipeline->jobs);
+
+    /*
+     * Create the jobs in the order in which the threads will be written.
+     */
+    pRecord = Nu_RecordSet_GetListHead(&pArchive->newRecordSet);
+    for ( ; pRecord != NULL; pRecord = pRecord->pNext) {
+        for (orderIdx = 0; orderIdx < kNuPipelineOrderCount; orderIdx++) {
+            pThreadMod = pRecord->pThreadMods;
+            for ( ; pThreadMod != NULL; pThreadMod = pThreadMod->pNext) {
+                NuPipelineJob* pJob;
+
+                if (!Nu_PipelineCanHandle(pPipeline, pThreadMod) ||
+                    !Nu_PipelineInPass(pThreadMod, orderIdx))
+                {
+                    continue;
+                }
+
+                Assert(pPipeline->numJobs < numJobs);
+                pJob = &pPipeline->jobs[pPipeline->numJobs];
+                err = Nu_PipelineCopySource(pThreadMod->entry.add.pDataSource,
+                        &pJob->pDataSource);
+                BailError(err);
+                pJob->pRecord = pRecord;
+                pJob->pThreadMod = pThreadMod;
+                pJob->targetFormat = pThreadMod->entry.add.threadFormat;
+                pJob->state = kNuJobPending;
+                pPipeline->numJobs++;
+            }
+        }
+    }
+    Assert(pPipeline->numJobs == numJobs);
+
+    /* the application's thread is one of them */
+    pPipeline->numWorkers = numThreads - 1;
+    if (pPipeline->numWorkers > numJobs)
+        pPipeline->numWorkers = (int) numJobs;
+    pPipeline->workers =
+        Nu_Calloc(pArchive, pPipeline->numWorkers * sizeof(NuWorkerHandle));
+    BailAlloc(pPipeline->workers);
+    pPipeline->maxSpilled = pPipeline->numWorkers;
+
+    Nu_LockInit(&pPipeline->lock);
+    Nu_CondInit(&pPipeline->cond);
+    pArchive->pPipeline = pPipeline;
+
+    for (i = 0; i < pPipeline->numWorkers; i++) {
+        if (!Nu_PipelineStartWorker(pPipeline, &pPipeline->workers[i])) {
+            DBUG(("--- unable to start worker %d\n", i));
+            break;
+        }
+    }
+    pPipeline->numWorkers = i;      /* whatever we got is fine */
+    DBUG(("--- started %d workers for %ld threads\n", i, numJobs));
+    pPipeline = NULL;
+
+bail:
+    if (pPipeline != NULL) {
+        for (i = 0; i < pPipeline->numJobs; i++)
+            Nu_DataSourceFree(pPipeline->jobs[i].pDataSource);
+        Nu_Free(pArchive, pPipeline->jobs);
+        Nu_Free(pArchive, pPipeline);
+    }
+    return err;
+}
+
+/*
+ * Stop the workers and throw away anything left over.  Safe to call when
+ * the workers weren't started.
+ */
+void Nu_PipelineFinish(NuArchive* pArchive)
+{
+    NuPipeline* pPipeline = pArchive->pPipeline;
+    long i;
+
+    if (pPipeline == NULL)
+        return;
+
+    Nu_Lock(&pPipeline->lock);
+    pPipeline->cancel = true;
+    Nu_CondBroadcast(&pPipeline->cond);
+    Nu_Unlock(&pPipeline->lock);
+
+    for (i = 0; i < pPipeline->numWorkers; i++)
+        Nu_PipelineJoinWorker(pPipeline->workers[i]);
+
+    for (i = 0; i < pPipeline->numJobs; i++) {
+        Nu_PipelineDiscardOutput(pPipeline, &pPipeline->jobs[i]);
+        Nu_DataSourceFree(pPipeline->jobs[i].pDataSource);
+    }
+    Assert(pPipeline->memUsed == 0);
+    Assert(pPipeline->numSpilled == 0);
+
+    Nu_CondFree(&pPipeline->cond);
+    Nu_LockFree(&pPipeline->lock);
+    Nu_Free(pArchive, pPipeline->workers);
+    Nu_Free(pArchive, pPipeline->jobs);
+    Nu_Free(pArchive, pPipeline);
+    pArchive->pPipeline = NULL;
+}
+
+/*
+ * Write a thread from the output of a worker, if there is any.
+ *
+ * This is called in place of Nu_CompressToArchive, with the data source
+ * already prepared.  Sets "*pHandled" to false if the caller should do it
+ * the usual way; otherwise, "pThread" has been filled in just as
+ * Nu_CompressToArchive would have done it.
+ */
+NuError Nu_PipelineWriteThread(NuArchive* pArchive,
+    const NuThreadMod* pThreadMod, NuProgressData* pProgressData,
+    FILE* dstFp, NuThread* pThread, Boolean* pHandled)
+{
+    NuError err = kNuErrNone;
+    NuPipeline* pPipeline = pArchive->pPipeline;
+    NuDataSource* pDataSource = pThreadMod->entry.add.pDataSource;
+    NuPipelineJob* pJob;
+    long idx;
+
+    *pHandled = false;
+    if (pPipeline == NULL)
+        return kNuErrNone;
+
+    /* normally it's the very next one */
+    for (idx = pPipeline->nextResult; idx < pPipeline->numJobs; idx++) {
+        if (pPipeline->jobs[idx].pThreadMod == pThreadMod)
+            break;
+    }
+    if (idx == pPipeline->numJobs)
+        return kNuErrNone;
+
+    /* anything we passed over isn't going to be used */
+    for ( ; pPipeline->nextResult < idx; pPipeline->nextResult++) {
+        pJob = &pPipeline->jobs[pPipeline->nextResult];
+        (void) Nu_PipelineClaimJob(pPipeline, pJob);
+        Nu_PipelineReleaseJob(pPipeline, pJob);
+    }
+    pPipeline->nextResult = idx + 1;
+
+    pJob = &pPipeline->jobs[idx];
+    switch (Nu_PipelineClaimJob(pPipeline, pJob)) {
+    case kNuJobCompressed:
+        /* make sure the file didn't change under us */
+        if (pJob->thread.thThreadEOF != Nu_DataSourceGetDataLen(pDataSource)) {
+            DBUG(("--- source length changed, compressing again\n"));
+            break;
+        }
+
+        err = Nu_PipelineCopyOutput(pArchive, pJob, pProgressData, dstFp);
+        BailError(err);
+
+        pThread->thThreadClass = pJob->thread.thThreadClass;
+        pThread->thThreadFormat = pJob->thread.thThreadFormat;
+        pThread->thThreadKind = pJob->thread.thThreadKind;
+        pThread->thThreadCRC = pJob->thread.thThreadCRC;
+        pThread->thThreadEOF = pJob->thread.thThreadEOF;
+        pThread->thCompThreadEOF = pJob->thread.thCompThreadEOF;
+        pThread->actualThreadEOF = pJob->thread.actualThreadEOF;
+        *pHandled = true;
+        break;
+
+    case kNuJobStore:
+        err = Nu_CompressToArchive(pArchive, pDataSource,
+                pThreadMod->entry.add.threadID, kNuThreadFormatUncompressed,
+                kNuThreadFormatUncompressed, pProgressData, dstFp, pThread);
+        BailError(err);
+        *pHandled = true;
+        break;
+
+    default:
+        /* failed or never started; do it the usual way */
+        break;
+    }
+
+bail:
+    Nu_PipelineReleaseJob(pPipeline, pJob);
+    return err;
+}
+
+/*
+ * A record is being skipped.  Make sure none of the workers are still
+ * reading its data sources, which are about to be freed.
+ */
+void Nu_PipelineSkipRecord(NuArchive* pArchive, const NuRecord* pRecord)
+{
+    NuPipeline* pPipeline = pArchive->pPipeline;
+    NuPipelineJob* pJob;
+    long start, idx;
+
+    if (pPipeline == NULL)
+        return;
+
+    for (start = pPipeline->nextResult; start < pPipeline->numJobs; start++) {
+        if (pPipeline->jobs[start].pRecord == pRecord)
+            break;
+    }
+    for (idx = start; idx < pPipeline->numJobs; idx++) {
+        pJob = &pPipeline->jobs[idx];
+        if (pJob->pRecord != pRecord)
+            break;
+        (void) Nu_PipelineClaimJob(pPipeline, pJob);
+        Nu_PipelineReleaseJob(pPipeline, pJob);
+    }
+
+    /* its threadMods are about to go away, so don't look at them again */
+    if (start == pPipeline->nextResult)
+        pPipeline->nextResult = idx;
+}
+
+#else /*NU_HAVE_THREADS*/
+
+/*
+ * No threads on this system, so everything goes through the usual path.
+ */
+NuError Nu_PipelineStart(NuArchive* pArchive)
+{
+    return kNuErrNone;
+}
+
+void Nu_PipelineFinish(NuArchive* pArchive)
+{
+}
+
+NuError Nu_PipelineWriteThread(NuArchive* pArchive,
+    const NuThreadMod* pThreadMod, NuProgressData* pProgressData,
+    FILE* dstFp, NuThread* pThread, Boolean* pHandled)
+{
+    *pHandled = false;
+    return kNuErrNone;
+}
+
+void Nu_PipelineSkipRecord(NuArchive* pArchive, const NuRecord* pRecord)
+{
+}
+
+#endif /*NU_HAVE_THREADS*/
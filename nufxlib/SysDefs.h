@@ -45,6 +45,8 @@
 #  define HAVE_MEMMOVE
 #  undef HAVE_MKSTEMP
 #  define HAVE_MKTIME
+#  undef HAVE_OPEN_MEMSTREAM
+#  undef HAVE_PTHREAD_H
 #  define HAVE_SNPRINTF
 #  undef HAVE_STRCASECMP
 #  undef HAVE_STRNCASECMP
@@ -67,6 +67,12 @@ NuError Nu_GetValue(NuArchive* pArchive, NuValueID ident, NuValue* pValue)
     case kNuValueHandleBadMac:
         *pValue = pArchive->valHandleBadMac;
         break;
+    case kNuValueCompressThreads:
+        *pValue = pArchive->valCompressThreads;
+        break;
+    case kNuValueCompressMemLimit:
+        *pValue = pArchive->valCompressMemLimit;
+        break;
     default:
         err = kNuErrInvalidArg;
         Nu_ReportError(NU_BLOB, err, "Unknown ValueID %d requested", ident);
@@ -206,6 +212,17 @@ NuError Nu_SetValue(NuArchive* pArchive, NuValueID ident, NuValue value)
         }
         pArchive->valHandleBadMac = value;
         break;
+    case kNuValueCompressThreads:
+        if (value > kNuMaxCompressThreads) {
+            Nu_ReportError(NU_BLOB, err,
+                "Invalid kNuValueCompressThreads value %u", value);
+            goto bail;
+        }
+        pArchive->valCompressThreads = value;
+        break;
+    case kNuValueCompressMemLimit:
+        pArchive->valCompressMemLimit = value;
+        break;
     default:
         Nu_ReportError(NU_BLOB, err, "Unknown ValueID %d requested", ident);
         goto bail;
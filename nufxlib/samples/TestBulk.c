@@ -0,0 +1,784 @@
+/*
+ * NuFX archive manipulation library
+ * Copyright (C) 2000-2007 by Andy McFadden, All Rights Reserved.
+ * This is free software; you can redistribute it and/or modify it under the
+ * terms of the BSD License, see the file COPYING.LIB.
+ *
+ * Test adding a large batch of records with several compression threads.
+ *
+ * The same set of files is added to three archives: one compressed the
+ * usual way, one with several threads, and one with several threads and a
+ * memory limit small enough to push most of the output into temp files.
+ * Apart from the dates in the master header, the archives must be
+ * identical, and everything in them must extract correctly.
+ *
+ * One of the files is removed before the flush, and the error handler
+ * asks to skip it, so the skip path gets exercised too.
+ *
+ * Run this without arguments, or pass a random seed to repeat a run.
+ */
+#include <stdio.h>
+#include <ctype.h>
+#include <time.h>
+#include "NufxLib.h"
+#include "Common.h"
+
+#define kTestArchive1   "nlbk1.shk"
+#define kTestArchive2   "nlbk2.shk"
+#define kTestArchive3   "nlbk3.shk"
+#define kTestTempFile   "nlbk.tmp"
+#define kTestDataFmt    "nlbk%02d.dat"
+
+#define kNumEntries     48      /* number of records to add */
+#define kMissingEntry   17      /* this one gets removed before the flush */
+#define kMaxFileLen     300000
+#define kNumThreads     4
+#define kSmallMemLimit  100000
+#define kMasterHeaderLen 48     /* has the archive dates; not compared */
+#define kLocalFssep     '|'
+
+/*
+ * Kinds of test data.
+ */
+typedef enum DataKind {
+    kKindRuns = 0,      /* long runs, like a mostly-empty disk image */
+    kKindText,          /* words and line endings */
+    kKindRandom,        /* doesn't compress */
+    kKindTiny,          /* less than 512 bytes */
+    kKindEmpty,         /* zero bytes */
+    kKindBig,           /* large and compressible */
+    kKindMAX
+} DataKind;
+
+/*
+ * One record's worth of test data.
+ */
+typedef struct TestEntry {
+    char        name[32];
+    char        pathname[32];   /* on disk, if added from a file */
+    int         fromFile;
+    NuValue     compression;
+    uint8_t*    dataBuf;
+    uint32_t    dataLen;
+    uint8_t*    rsrcBuf;        /* NULL if there's no resource fork */
+    uint32_t    rsrcLen;
+} TestEntry;
+
+/*
+ * Globals.
+ */
+char gSuppressError = false;
+uint32_t gRandState;
+TestEntry gEntries[kNumEntries];
+
+
+/*
+ * ===========================================================================
+ *      Helper functions
+ * ===========================================================================
+ */
+
+/*
+ * Get a single character of input from the user.
+ */
+static char TGetReplyChar(char defaultReply)
+{
+    char tmpBuf[32];
+
+    if (fgets(tmpBuf, sizeof(tmpBuf), stdin) == NULL)
+        return defaultReply;
+    if (tmpBuf[0] == '\n' || tmpBuf[0] == '\r')
+        return defaultReply;
+
+    return tmpBuf[0];
+}
+
+/*
+ * Display error messages... or not.
+ */
+NuResult ErrorMessageHandler(NuArchive* pArchive, void* vErrorMessage)
+{
+    const NuErrorMessage* pErrorMessage = (const NuErrorMessage*) vErrorMessage;
+
+    if (gSuppressError)
+        return kNuOK;
+
+    if (pErrorMessage->isDebug) {
+        fprintf(stderr, "%sNufxLib says: [%s:%d %s] %s\n",
+            pArchive == NULL ? "GLOBAL>" : "",
+            pErrorMessage->file, pErrorMessage->line, pErrorMessage->function,
+            pErrorMessage->message);
+    } else {
+        fprintf(stderr, "%sNufxLib says: %s\n",
+            pArchive == NULL ? "GLOBAL>" : "",
+            pErrorMessage->message);
+    }
+
+    return kNuOK;
+}
+
+/*
+ * Skip the file we removed; abort on anything else.
+ */
+NuResult ErrorHandler(NuArchive* pArchive, void* vErrorStatus)
+{
+    const NuErrorStatus* pErrorStatus = (const NuErrorStatus*) vErrorStatus;
+
+    if (pErrorStatus->operation == kNuOpAdd &&
+        pErrorStatus->pathnameUNI != NULL &&
+        strcmp(pErrorStatus->pathnameUNI,
+            gEntries[kMissingEntry].pathname) == 0)
+    {
+        return kNuSkip;
+    }
+
+    fprintf(stderr, "ERROR: unexpected error handler call (op=%d err=%d)\n",
+        pErrorStatus->operation, pErrorStatus->err);
+    return kNuAbort;
+}
+
+/*
+ * If the test file currently exists, ask the user if it's okay to remove
+ * it.
+ *
+ * Returns 0 if the file was successfully removed, -1 if the file could not
+ * be removed (because the unlink failed, or the user refused).
+ */
+int RemoveTestFile(const char* title, const char* fileName)
+{
+    char answer;
+
+    if (access(fileName, F_OK) == 0) {
+        printf("%s '%s' exists, remove (y/n)? ", title, fileName);
+        fflush(stdout);
+        answer = TGetReplyChar('n');
+        if (tolower(answer) != 'y')
+            return -1;
+        if (unlink(fileName) < 0) {
+            perror("unlink");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Simple xorshift random number generator.  We don't use rand() because
+ * we want a given seed to produce the same files everywhere.
+ */
+static uint32_t NextRand(void)
+{
+    gRandState ^= gRandState << 13;
+    gRandState ^= gRandState >> 17;
+    gRandState ^= gRandState << 5;
+    return gRandState;
+}
+
+/*
+ * Return a random value from 0 to max-1.
+ */
+static uint32_t RandRange(uint32_t max)
+{
+    return NextRand() % max;
+}
+
+
+/*
+ * ===========================================================================
+ *      Test data
+ * ===========================================================================
+ */
+
+/*
+ * Generate "len" bytes of test data of the specified kind.
+ */
+static void GenerateData(DataKind kind, uint8_t* buf, uint32_t len)
+{
+    static const char* kWords[] = {
+        "the ", "apple ", "disk ", "block ", "volume ", "file ", "ProDOS ",
+        "catalog ", "\r", "sector ", "track ", "a ", "of ", "\r\r"
+    };
+    uint32_t i, runLen;
+    uint8_t val;
+    const char* word;
+
+    switch (kind) {
+    case kKindRuns:
+    case kKindBig:
+        for (i = 0; i < len; ) {
+            val = RandRange(4) ? 0 : NextRand() & 0xff;
+            runLen = 1 + RandRange(600);
+            while (runLen-- && i < len)
+                buf[i++] = val;
+            runLen = RandRange(64);
+            while (runLen-- && i < len)
+                buf[i++] = NextRand() & 0x0f;
+        }
+        break;
+    case kKindText:
+        for (i = 0; i < len; ) {
+            word = kWords[RandRange(NELEM(kWords))];
+            while (*word != '\0' && i < len)
+                buf[i++] = *word++;
+        }
+        break;
+    case kKindRandom:
+    case kKindTiny:
+    case kKindEmpty:
+    default:
+        for (i = 0; i < len; i++)
+            buf[i] = NextRand() & 0xff;
+        break;
+    }
+}
+
+/*
+ * Pick a length for a kind of data.
+ */
+static uint32_t PickLength(DataKind kind)
+{
+    switch (kind) {
+    case kKindTiny:     return 1 + RandRange(511);
+    case kKindEmpty:    return 0;
+    case kKindBig:      return kMaxFileLen / 2 + RandRange(kMaxFileLen / 2);
+    default:            return RandRange(kMaxFileLen / 4);
+    }
+}
+
+/*
+ * Write a buffer to a file.
+ */
+static int WriteDataFile(const char* pathname, const uint8_t* buf,
+    uint32_t len)
+{
+    FILE* fp;
+
+    fp = fopen(pathname, kNuFileOpenWriteTrunc);
+    if (fp == NULL) {
+        perror(pathname);
+        return -1;
+    }
+    if (len != 0 && fwrite(buf, len, 1, fp) != 1) {
+        perror(pathname);
+        fclose(fp);
+        return -1;
+    }
+    if (fclose(fp) != 0) {
+        perror(pathname);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Create the test data, and write the files that are added from disk.
+ */
+static int CreateEntries(void)
+{
+    NuValue compressions[8];
+    int numCompressions = 0;
+    TestEntry* pEntry;
+    DataKind kind;
+    int i;
+
+    compressions[numCompressions++] = kNuCompressLZW2;
+    compressions[numCompressions++] = kNuCompressLZW1;
+    compressions[numCompressions++] = kNuCompressSQ;
+    compressions[numCompressions++] = kNuCompressLZC16;
+    compressions[numCompressions++] = kNuCompressNone;
+    compressions[numCompressions++] = kNuCompressLZC12;
+    if (NuTestFeature(kNuFeatureCompressDeflate) == kNuErrNone)
+        compressions[numCompressions++] = kNuCompressDeflate;
+    if (NuTestFeature(kNuFeatureCompressBzip2) == kNuErrNone)
+        compressions[numCompressions++] = kNuCompressBzip2;
+
+    for (i = 0; i < kNumEntries; i++) {
+        pEntry = &gEntries[i];
+        kind = (DataKind) (i % kKindMAX);
+
+        sprintf(pEntry->name, "file%02d", i);
+        sprintf(pEntry->pathname, kTestDataFmt, i);
+        pEntry->fromFile = (i % 3) == 1 || i == kMissingEntry;
+        pEntry->compression = compressions[(i / 2) % numCompressions];
+
+        pEntry->dataLen = PickLength(kind);
+        pEntry->dataBuf = malloc(pEntry->dataLen + 1);
+        if (pEntry->dataBuf == NULL)
+            return -1;
+        GenerateData(kind, pEntry->dataBuf, pEntry->dataLen);
+
+        if ((i % 4) == 2) {
+            kind = (DataKind) ((i / 4) % kKindMAX);
+            pEntry->rsrcLen = PickLength(kind);
+            pEntry->rsrcBuf = malloc(pEntry->rsrcLen + 1);
+            if (pEntry->rsrcBuf == NULL)
+                return -1;
+            GenerateData(kind, pEntry->rsrcBuf, pEntry->rsrcLen);
+        }
+
+        if (pEntry->fromFile) {
+            if (RemoveTestFile("Test data file", pEntry->pathname) != 0)
+                return -1;
+            if (WriteDataFile(pEntry->pathname, pEntry->dataBuf,
+                    pEntry->dataLen) != 0)
+            {
+                return -1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Remove the files created by CreateEntries, and free the buffers.
+ */
+static void FreeEntries(void)
+{
+    int i;
+
+    for (i = 0; i < kNumEntries; i++) {
+        if (gEntries[i].fromFile)
+            (void) unlink(gEntries[i].pathname);
+        free(gEntries[i].dataBuf);
+        free(gEntries[i].rsrcBuf);
+    }
+    memset(gEntries, 0, sizeof(gEntries));
+}
+
+
+/*
+ * ===========================================================================
+ *      Tests
+ * ===========================================================================
+ */
+
+/*
+ * Add one record, with a data fork and maybe a resource fork.
+ */
+int AddEntry(NuArchive* pArchive, const TestEntry* pEntry)
+{
+    NuError err;
+    NuFileDetails fileDetails;
+    NuDataSource* pDataSource = NULL;
+    NuRecordIdx recordIdx;
+
+    err = NuSetValue(pArchive, kNuValueDataCompression, pEntry->compression);
+    if (err != kNuErrNone) {
+        fprintf(stderr, "ERROR: couldn't set compression (err=%d)\n", err);
+        goto failed;
+    }
+
+    /* fixed dates, so the archives can be compared */
+    memset(&fileDetails, 0, sizeof(fileDetails));
+    fileDetails.storageNameMOR = pEntry->name;
+    fileDetails.fileSysInfo = kLocalFssep;
+    fileDetails.access = kNuAccessUnlocked;
+    fileDetails.createWhen.year = 100;
+    fileDetails.createWhen.month = 4;
+    fileDetails.createWhen.day = 12;
+    fileDetails.modWhen = fileDetails.createWhen;
+    fileDetails.archiveWhen = fileDetails.createWhen;
+    err = NuAddRecord(pArchive, &fileDetails, &recordIdx);
+    if (err != kNuErrNone) {
+        fprintf(stderr, "ERROR: couldn't add record '%s' (err=%d)\n",
+            pEntry->name, err);
+        goto failed;
+    }
+
+    if (pEntry->fromFile) {
+        err = NuCreateDataSourceForFile(kNuThreadFormatUncompressed, 0,
+                pEntry->pathname, false, &pDataSource);
+    } else {
+        err = NuCreateDataSourceForBuffer(kNuThreadFormatUncompressed, 0,
+                pEntry->dataBuf, 0, pEntry->dataLen, NULL, &pDataSource);
+    }
+    if (err != kNuErrNone) {
+        fprintf(stderr, "ERROR: source create failed (err=%d)\n", err);
+        goto failed;
+    }
+    err = NuAddThread(pArchive, recordIdx, kNuThreadIDDataFork, pDataSource,
+            NULL);
+    if (err != kNuErrNone) {
+        fprintf(stderr, "ERROR: couldn't add data fork to '%s' (err=%d)\n",
+            pEntry->name, err);
+        goto failed;
+    }
+    pDataSource = NULL;     /* now owned by the library */
+
+    if (pEntry->rsrcBuf != NULL) {
+        err = NuCreateDataSourceForBuffer(kNuThreadFormatUncompressed, 0,
+                pEntry->rsrcBuf, 0, pEntry->rsrcLen, NULL, &pDataSource);
+        if (err != kNuErrNone) {
+            fprintf(stderr, "ERROR: source create failed (err=%d)\n", err);
+            goto failed;
+        }
+        err = NuAddThread(pArchive, recordIdx, kNuThreadIDRsrcFork,
+                pDataSource, NULL);
+        if (err != kNuErrNone) {
+            fprintf(stderr, "ERROR: couldn't add rsrc fork to '%s' (err=%d)\n",
+                pEntry->name, err);
+            goto failed;
+        }
+        pDataSource = NULL;
+    }
+
+    return 0;
+
+failed:
+    NuFreeDataSource(pDataSource);
+    return -1;
+}
+
+/*
+ * Create an archive with everything in it, using the specified number of
+ * compression threads and memory limit.  All of the records are added
+ * before a single flush.
+ */
+int BuildArchive(const char* archiveName, NuValue numThreads,
+    NuValue memLimit)
+{
+    NuError err;
+    NuArchive* pArchive = NULL;
+    uint32_t status;
+    clock_t start;
+    int i;
+
+    if (RemoveTestFile("Test archive", archiveName) != 0)
+        return -1;
+    if (RemoveTestFile("Test temp file", kTestTempFile) != 0)
+        return -1;
+
+    err = NuOpenRW(archiveName, kTestTempFile, kNuOpenCreat, &pArchive);
+    if (err != kNuErrNone) {
+        fprintf(stderr, "ERROR: unable to create archive (err=%d)\n", err);
+        goto failed;
+    }
+    err = NuSetValue(pArchive, kNuValueCompressThreads, numThreads);
+    if (err == kNuErrNone)
+        err = NuSetValue(pArchive, kNuValueCompressMemLimit, memLimit);
+    if (err != kNuErrNone) {
+        fprintf(stderr, "ERROR: couldn't set values (err=%d)\n", err);
+        goto failed;
+    }
+    if (NuSetErrorHandler(pArchive, ErrorHandler) == kNuInvalidCallback) {
+        fprintf(stderr, "ERROR: couldn't set error handler\n");
+        goto failed;
+    }
+
+    for (i = 0; i < kNumEntries; i++) {
+        if (AddEntry(pArchive, &gEntries[i]) != 0)
+            goto failed;
+    }
+
+    /* make one of them fail when it's opened */
+    if (unlink(gEntries[kMissingEntry].pathname) < 0) {
+        perror("unlink missing entry");
+        goto failed;
+    }
+
+    start = clock();
+    err = NuFlush(pArchive, &status);
+    if (err != kNuErrNone) {
+        fprintf(stderr, "ERROR: flush failed (err=%d, status=%u)\n",
+            err, status);
+        goto failed;
+    }
+    printf("... '%s' built with threads=%u memLimit=%u (%.2fs cpu)\n",
+        archiveName, numThreads, memLimit,
+        (double) (clock() - start) / CLOCKS_PER_SEC);
+
+    err = NuClose(pArchive);
+    pArchive = NULL;
+    if (err != kNuErrNone) {
+        fprintf(stderr, "ERROR: close failed (err=%d)\n", err);
+        goto failed;
+    }
+
+    /* put it back for the next one */
+    if (WriteDataFile(gEntries[kMissingEntry].pathname,
+            gEntries[kMissingEntry].dataBuf,
+            gEntries[kMissingEntry].dataLen) != 0)
+    {
+        goto failed;
+    }
+
+    return 0;
+
+failed:
+    if (pArchive != NULL) {
+        NuAbort(pArchive);
+        NuClose(pArchive);
+    }
+    return -1;
+}
+
+/*
+ * Compare two archives, ignoring the master header.
+ */
+int CompareArchives(const char* name1, const char* name2)
+{
+    FILE* fp1 = NULL;
+    FILE* fp2 = NULL;
+    long offset = 0;
+    int ch1, ch2;
+    int result = -1;
+
+    fp1 = fopen(name1, kNuFileOpenReadOnly);
+    fp2 = fopen(name2, kNuFileOpenReadOnly);
+    if (fp1 == NULL || fp2 == NULL) {
+        fprintf(stderr, "ERROR: couldn't open archives to compare\n");
+        goto bail;
+    }
+
+    while (true) {
+        ch1 = getc(fp1);
+        ch2 = getc(fp2);
+        if (ch1 != ch2 && offset >= kMasterHeaderLen) {
+            fprintf(stderr, "ERROR: '%s' and '%s' differ at offset %ld\n",
+                name1, name2, offset);
+            goto bail;
+        }
+        if (ch1 == EOF || ch2 == EOF)
+            break;
+        offset++;
+    }
+    if (ch1 != ch2) {
+        fprintf(stderr, "ERROR: '%s' and '%s' have different lengths\n",
+            name1, name2);
+        goto bail;
+    }
+
+    result = 0;
+
+bail:
+    if (fp1 != NULL)
+        fclose(fp1);
+    if (fp2 != NULL)
+        fclose(fp2);
+    return result;
+}
+
+/*
+ * Extract one thread and compare it to the original.
+ */
+int CheckThread(NuArchive* pArchive, const NuThread* pThread,
+    const char* name, const uint8_t* orig, uint32_t len)
+{
+    NuError err;
+    NuDataSink* pDataSink = NULL;
+    uint8_t* outBuf = NULL;
+    uint32_t outLen;
+    int result = -1;
+
+    outBuf = malloc(len + 1);
+    if (outBuf == NULL) {
+        fprintf(stderr, "ERROR: malloc failed\n");
+        goto bail;
+    }
+
+    err = NuCreateDataSinkForBuffer(true, kNuConvertOff, outBuf, len + 1,
+            &pDataSink);
+    if (err != kNuErrNone) {
+        fprintf(stderr, "ERROR: couldn't create data sink (err=%d)\n", err);
+        goto bail;
+    }
+    err = NuExtractThread(pArchive, pThread->threadIdx, pDataSink);
+    if (err != kNuErrNone) {
+        fprintf(stderr, "ERROR: couldn't extract '%s' (err=%d)\n", name, err);
+        goto bail;
+    }
+    (void) NuDataSinkGetOutCount(pDataSink, &outLen);
+
+    if (outLen != len || memcmp(outBuf, orig, len) != 0) {
+        fprintf(stderr, "ERROR: '%s' mismatch: got %u bytes, expected %u\n",
+            name, outLen, len);
+        goto bail;
+    }
+
+    result = 0;
+
+bail:
+    NuFreeDataSink(pDataSink);
+    free(outBuf);
+    return result;
+}
+
+/*
+ * Open an archive, test it, and check every record against the test data.
+ */
+int CheckArchive(const char* archiveName)
+{
+    NuError err;
+    NuArchive* pArchive = NULL;
+    NuRecordIdx recordIdx;
+    const NuRecord* pRecord;
+    const NuThread* pThread;
+    const TestEntry* pEntry;
+    int result = -1;
+    int i, j, found;
+
+    err = NuOpenRO(archiveName, &pArchive);
+    if (err != kNuErrNone) {
+        fprintf(stderr, "ERROR: couldn't open '%s' (err=%d)\n",
+            archiveName, err);
+        goto bail;
+    }
+
+    err = NuTest(pArchive);
+    if (err != kNuErrNone) {
+        fprintf(stderr, "ERROR: '%s' failed NuTest (err=%d)\n",
+            archiveName, err);
+        goto bail;
+    }
+
+    for (i = 0; i < kNumEntries; i++) {
+        pEntry = &gEntries[i];
+
+        gSuppressError = true;
+        err = NuGetRecordIdxByName(pArchive, pEntry->name, &recordIdx);
+        gSuppressError = false;
+        if (i == kMissingEntry) {
+            if (err != kNuErrRecNameNotFound) {
+                fprintf(stderr, "ERROR: skipped record '%s' is present\n",
+                    pEntry->name);
+                goto bail;
+            }
+            continue;
+        }
+        if (err == kNuErrNone)
+            err = NuGetRecord(pArchive, recordIdx, &pRecord);
+        if (err != kNuErrNone) {
+            fprintf(stderr, "ERROR: couldn't find '%s' (err=%d)\n",
+                pEntry->name, err);
+            goto bail;
+        }
+
+        found = 0;
+        for (j = 0; j < (int) NuRecordGetNumThreads(pRecord); j++) {
+            pThread = NuGetThread(pRecord, j);
+            if (NuGetThreadID(pThread) == kNuThreadIDDataFork) {
+                if (CheckThread(pArchive, pThread, pEntry->name,
+                        pEntry->dataBuf, pEntry->dataLen) != 0)
+                {
+                    goto bail;
+                }
+                found++;
+            } else if (NuGetThreadID(pThread) == kNuThreadIDRsrcFork) {
+                if (pEntry->rsrcBuf == NULL ||
+                    CheckThread(pArchive, pThread, pEntry->name,
+                        pEntry->rsrcBuf, pEntry->rsrcLen) != 0)
+                {
+                    goto bail;
+                }
+                found++;
+            }
+        }
+        if (found != (pEntry->rsrcBuf != NULL ? 2 : 1)) {
+            fprintf(stderr, "ERROR: '%s' has the wrong threads\n",
+                pEntry->name);
+            goto bail;
+        }
+    }
+
+    result = 0;
+
+bail:
+    if (pArchive != NULL)
+        NuClose(pArchive);
+    return result;
+}
+
+/*
+ * Build the archives and check them.
+ */
+int DoTests(void)
+{
+    static const char* kArchives[] = {
+        kTestArchive1, kTestArchive2, kTestArchive3
+    };
+    int result = -1;
+    int i;
+
+    printf("... creating %d entries\n", kNumEntries);
+    if (CreateEntries() != 0) {
+        fprintf(stderr, "ERROR: couldn't create test data\n");
+        goto bail;
+    }
+
+    if (BuildArchive(kTestArchive1, 1, kSmallMemLimit) != 0)
+        goto bail;
+    if (BuildArchive(kTestArchive2, kNumThreads, 64 * 1024 * 1024) != 0)
+        goto bail;
+    if (BuildArchive(kTestArchive3, kNumThreads, kSmallMemLimit) != 0)
+        goto bail;
+
+    printf("... comparing archives\n");
+    if (CompareArchives(kTestArchive1, kTestArchive2) != 0 ||
+        CompareArchives(kTestArchive1, kTestArchive3) != 0)
+    {
+        goto bail;
+    }
+
+    printf("... extracting and comparing\n");
+    for (i = 0; i < (int) NELEM(kArchives); i++) {
+        if (CheckArchive(kArchives[i]) != 0)
+            goto bail;
+    }
+
+    for (i = 0; i < (int) NELEM(kArchives); i++) {
+        printf("... removing '%s'\n", kArchives[i]);
+        if (unlink(kArchives[i]) < 0) {
+            perror("unlink archive");
+            goto bail;
+        }
+    }
+
+    result = 0;
+
+bail:
+    FreeEntries();
+    return result;
+}
+
+
+/*
+ * Crank away.
+ */
+int main(int argc, char** argv)
+{
+    int32_t major, minor, bug;
+    const char* pBuildDate;
+    const char* pBuildFlags;
+    int cc;
+
+    (void) NuGetVersion(&major, &minor, &bug, &pBuildDate, &pBuildFlags);
+    printf("Using NuFX library v%d.%d.%d, built on or after\n"
+           "  %s with [%s]\n\n",
+        major, minor, bug, pBuildDate, pBuildFlags);
+
+    if (argc > 2) {
+        fprintf(stderr, "Usage: %s [seed]\n", argv[0]);
+        exit(2);
+    }
+    if (argc == 2)
+        gRandState = (uint32_t) strtoul(argv[1], NULL, 0);
+    else
+        gRandState = (uint32_t) time(NULL);
+    if (gRandState == 0)
+        gRandState = 1;     /* xorshift gets stuck on zero */
+
+    if (NuSetGlobalErrorMessageHandler(ErrorMessageHandler) ==
+        kNuInvalidCallback)
+    {
+        fprintf(stderr, "ERROR: can't set the global message handler");
+        exit(1);
+    }
+
+    printf("... starting tests, seed=%u\n", gRandState);
+
+    cc = DoTests();
+
+    printf("... tests ended, %s\n", cc == 0 ? "SUCCESS" : "FAILURE");
+    exit(cc != 0);
+}
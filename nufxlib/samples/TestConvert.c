@@ -0,0 +1,672 @@
+/*
+ * NuFX archive manipulation library
+ * Copyright (C) 2000-2007 by Andy McFadden, All Rights Reserved.
+ * This is free software; you can redistribute it and/or modify it under the
+ * terms of the BSD License, see the file COPYING.LIB.
+ *
+ * Test the EOL conversion and high-ASCII stripping done during extraction.
+ *
+ * Random text in a variety of styles is stored in an archive, then
+ * extracted with every combination of conversion settings.  The output is
+ * compared against a simple byte-at-a-time conversion done here.  The
+ * files are big enough to span several funnel buffers, so a CRLF that
+ * straddles a buffer boundary gets exercised too.
+ *
+ * Run this without arguments, or pass a random seed to repeat a run.
+ */
+#include <stdio.h>
+#include <ctype.h>
+#include <time.h>
+#include "NufxLib.h"
+#include "Common.h"
+
+#define kTestArchive    "nlcv.shk"
+#define kTestTempFile   "nlcv.tmp"
+
+#define kNumEntries     40      /* number of files to test with */
+#define kMaxFileLen     70000   /* a bit more than four funnel buffers */
+#define kMinAutoLen     40      /* matches the library's auto threshold */
+#define kLocalFssep     '|'
+
+/*
+ * Kinds of test data.
+ */
+typedef enum TextKind {
+    kKindLF = 0,        /* text with LF line endings */
+    kKindCR,            /* text with CR line endings */
+    kKindCRLF,          /* text with CRLF line endings */
+    kKindMixed,         /* any mix of CR and LF */
+    kKindEOLOnly,       /* nothing but CR and LF */
+    kKindHighASCII,     /* DOS 3.3 style text, with 0x8d line endings */
+    kKindLongLines,     /* LF text with some very long lines */
+    kKindBinary,        /* random bytes */
+    kKindMAX
+} TextKind;
+
+/*
+ * Globals.
+ */
+char gSuppressError = false;
+uint32_t gRandState;
+
+
+/*
+ * ===========================================================================
+ *      Helper functions
+ * ===========================================================================
+ */
+
+/*
+ * Get a single character of input from the user.
+ */
+static char TGetReplyChar(char defaultReply)
+{
+    char tmpBuf[32];
+
+    if (fgets(tmpBuf, sizeof(tmpBuf), stdin) == NULL)
+        return defaultReply;
+    if (tmpBuf[0] == '\n' || tmpBuf[0] == '\r')
+        return defaultReply;
+
+    return tmpBuf[0];
+}
+
+/*
+ * Display error messages... or not.
+ */
+NuResult ErrorMessageHandler(NuArchive* pArchive, void* vErrorMessage)
+{
+    const NuErrorMessage* pErrorMessage = (const NuErrorMessage*) vErrorMessage;
+
+    if (gSuppressError)
+        return kNuOK;
+
+    if (pErrorMessage->isDebug) {
+        fprintf(stderr, "%sNufxLib says: [%s:%d %s] %s\n",
+            pArchive == NULL ? "GLOBAL>" : "",
+            pErrorMessage->file, pErrorMessage->line, pErrorMessage->function,
+            pErrorMessage->message);
+    } else {
+        fprintf(stderr, "%sNufxLib says: %s\n",
+            pArchive == NULL ? "GLOBAL>" : "",
+            pErrorMessage->message);
+    }
+
+    return kNuOK;
+}
+
+/*
+ * This gets called when a buffer DataSource is no longer needed.
+ */
+NuResult FreeCallback(NuArchive* pArchive, void* args)
+{
+    free(args);
+    return kNuOK;
+}
+
+/*
+ * If the test file currently exists, ask the user if it's okay to remove
+ * it.
+ *
+ * Returns 0 if the file was successfully removed, -1 if the file could not
+ * be removed (because the unlink failed, or the user refused).
+ */
+int RemoveTestFile(const char* title, const char* fileName)
+{
+    char answer;
+
+    if (access(fileName, F_OK) == 0) {
+        printf("%s '%s' exists, remove (y/n)? ", title, fileName);
+        fflush(stdout);
+        answer = TGetReplyChar('n');
+        if (tolower(answer) != 'y')
+            return -1;
+        if (unlink(fileName) < 0) {
+            perror("unlink");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Simple xorshift random number generator.  We don't use rand() because
+ * we want a given seed to produce the same files everywhere.
+ */
+static uint32_t NextRand(void)
+{
+    gRandState ^= gRandState << 13;
+    gRandState ^= gRandState >> 17;
+    gRandState ^= gRandState << 5;
+    return gRandState;
+}
+
+/*
+ * Return a random value from 0 to max-1.
+ */
+static uint32_t RandRange(uint32_t max)
+{
+    return NextRand() % max;
+}
+
+
+/*
+ * ===========================================================================
+ *      Test data and reference conversion
+ * ===========================================================================
+ */
+
+/*
+ * Generate "len" bytes of test data of the specified kind.
+ *
+ * The first byte is always low ASCII (and not a space) unless we're
+ * generating high-ASCII text, so that the library's decision about
+ * stripping the high bit doesn't depend on how the data gets split up
+ * into funnel buffers.  For the same reason, the high-ASCII lines are
+ * kept short, so every 40-byte stretch has at least two line endings.
+ */
+static void GenerateData(TextKind kind, uint8_t* buf, uint32_t len)
+{
+    uint32_t lineLen = 0;
+    uint32_t maxLine;
+    uint32_t i;
+    uint8_t ch;
+
+    maxLine = (kind == kKindLongLines) ? 10000 : 80;
+    if (kind == kKindHighASCII)
+        maxLine = 15;
+    lineLen = RandRange(maxLine);
+
+    for (i = 0; i < len; i++) {
+        switch (kind) {
+        case kKindLF:
+        case kKindCR:
+        case kKindCRLF:
+        case kKindLongLines:
+        case kKindHighASCII:
+            if (lineLen == 0) {
+                lineLen = 1 + RandRange(maxLine);
+                if (kind == kKindCR) {
+                    buf[i] = 0x0d;
+                } else if (kind == kKindCRLF) {
+                    buf[i++] = 0x0d;
+                    if (i < len)
+                        buf[i] = 0x0a;
+                } else if (kind == kKindHighASCII) {
+                    buf[i] = 0x8d;
+                } else {
+                    buf[i] = 0x0a;
+                }
+            } else {
+                lineLen--;
+                if (RandRange(8) == 0)
+                    ch = ' ';
+                else if (RandRange(50) == 0)
+                    ch = '\t';
+                else
+                    ch = 0x21 + RandRange(0x7f - 0x21);
+                if (kind == kKindHighASCII && (ch != ' ' || RandRange(2)))
+                    ch |= 0x80;
+                buf[i] = ch;
+            }
+            break;
+        case kKindMixed:
+            switch (RandRange(12)) {
+            case 0:     buf[i] = 0x0d;  break;
+            case 1:     buf[i] = 0x0a;  break;
+            case 2:     buf[i] = 0x8d;  break;
+            case 3:     buf[i] = 0x8a;  break;
+            default:    buf[i] = NextRand() & 0xff;  break;
+            }
+            break;
+        case kKindEOLOnly:
+            buf[i] = RandRange(2) ? 0x0d : 0x0a;
+            break;
+        case kKindBinary:
+        default:
+            buf[i] = NextRand() & 0xff;
+            break;
+        }
+    }
+
+    if (len > 0 && kind != kKindHighASCII &&
+        ((buf[0] & 0x80) != 0 || buf[0] == ' '))
+    {
+        buf[0] = 'A';
+    }
+}
+
+/*
+ * Return the number of characters that the library considers "binary" when
+ * deciding whether to convert a file.  This is every control character
+ * except BS, TAB, LF, FF, and CR, plus DEL and 0x80-0x9f.
+ */
+static int IsBinaryChar(uint8_t ch)
+{
+    if (ch < 0x20)
+        return !(ch == 0x08 || ch == 0x09 || ch == 0x0a || ch == 0x0c ||
+                 ch == 0x0d);
+    return (ch >= 0x7f && ch < 0xa0);
+}
+
+/*
+ * Returns true if every byte is high ASCII or a space.
+ */
+static int IsHighASCII(const uint8_t* buf, uint32_t len)
+{
+    while (len--) {
+        if ((*buf & 0x80) == 0 && *buf != ' ')
+            return false;
+        buf++;
+    }
+    return true;
+}
+
+/*
+ * Output an EOL marker.
+ */
+static uint32_t PutRefEOL(uint8_t* out, NuValue eol)
+{
+    switch (eol) {
+    case kNuEOLCR:      out[0] = 0x0d;  return 1;
+    case kNuEOLLF:      out[0] = 0x0a;  return 1;
+    case kNuEOLCRLF:    out[0] = 0x0d;  out[1] = 0x0a;  return 2;
+    default:            assert(false);  return 0;
+    }
+}
+
+/*
+ * Convert a buffer the slow and obvious way.  This is what the library
+ * is expected to produce for the whole file.
+ *
+ * For kNuConvertAuto, we only handle files whose type is obvious no matter
+ * which part of the file the library looks at.  Binary files are left
+ * alone, and text files are converted.  (The library may decide that the
+ * conversion isn't necessary because the file already has the right EOL
+ * marker, but that produces the same output.)
+ *
+ * Returns the length of the output.
+ */
+static uint32_t RefConvert(const uint8_t* in, uint32_t len, uint8_t* out,
+    NuValue convertEOL, NuValue eol, int stripHigh)
+{
+    int doStrip = false;
+    int lastCR = false;
+    uint32_t outLen = 0;
+    uint32_t numBinary = 0;
+    uint32_t i;
+    uint8_t mask, ch;
+
+    if (len == 0)
+        return 0;
+
+    if (stripHigh)
+        doStrip = IsHighASCII(in, len);
+    mask = doStrip ? 0x7f : 0xff;
+
+    if (convertEOL == kNuConvertAuto) {
+        if (len < kMinAutoLen)
+            convertEOL = kNuConvertOff;
+        else {
+            for (i = 0; i < len; i++) {
+                if (IsBinaryChar(in[i] & mask))
+                    numBinary++;
+            }
+            if ((len < 100 && numBinary > 1) ||
+                (len >= 100 && numBinary > len / 100))
+            {
+                convertEOL = kNuConvertOff;
+            }
+        }
+    }
+    if (convertEOL == kNuConvertOff) {
+        memcpy(out, in, len);
+        return len;
+    }
+
+    for (i = 0; i < len; i++) {
+        ch = in[i] & mask;
+        if (ch == 0x0d) {
+            outLen += PutRefEOL(out + outLen, eol);
+            lastCR = true;
+        } else if (ch == 0x0a) {
+            if (!lastCR)
+                outLen += PutRefEOL(out + outLen, eol);
+            lastCR = false;
+        } else {
+            out[outLen++] = ch;
+            lastCR = false;
+        }
+    }
+    return outLen;
+}
+
+
+/*
+ * ===========================================================================
+ *      Tests
+ * ===========================================================================
+ */
+
+/*
+ * Pick a length for a test file.  We want a few very short files, a few
+ * right around the funnel buffer size, and the rest spread out.
+ */
+static uint32_t PickLength(int idx)
+{
+    switch (idx % 5) {
+    case 0:     return RandRange(kMinAutoLen * 3);
+    case 1:     return 16384 - 8 + RandRange(16);
+    default:    return RandRange(kMaxFileLen);
+    }
+}
+
+/*
+ * Add a file with the given contents, using the specified compression.
+ */
+int AddTestFile(NuArchive* pArchive, const char* name, uint8_t* buf,
+    uint32_t len, NuValue compression)
+{
+    NuError err;
+    NuFileDetails fileDetails;
+    NuDataSource* pDataSource = NULL;
+    NuRecordIdx recordIdx;
+    uint32_t status;
+
+    err = NuSetValue(pArchive, kNuValueDataCompression, compression);
+    if (err != kNuErrNone) {
+        fprintf(stderr, "ERROR: couldn't set compression (err=%d)\n", err);
+        goto failed;
+    }
+
+    memset(&fileDetails, 0, sizeof(fileDetails));
+    fileDetails.storageNameMOR = name;
+    fileDetails.fileSysInfo = kLocalFssep;
+    fileDetails.access = kNuAccessUnlocked;
+    err = NuAddRecord(pArchive, &fileDetails, &recordIdx);
+    if (err != kNuErrNone) {
+        fprintf(stderr, "ERROR: couldn't add record '%s' (err=%d)\n",
+            name, err);
+        goto failed;
+    }
+
+    err = NuCreateDataSourceForBuffer(kNuThreadFormatUncompressed, 0, buf,
+            0, len, FreeCallback, &pDataSource);
+    if (err != kNuErrNone) {
+        fprintf(stderr, "ERROR: source create failed (err=%d)\n", err);
+        goto failed;
+    }
+    buf = NULL;     /* now owned by the data source */
+
+    err = NuAddThread(pArchive, recordIdx, kNuThreadIDDataFork, pDataSource,
+            NULL);
+    if (err != kNuErrNone) {
+        fprintf(stderr, "ERROR: couldn't add thread to '%s' (err=%d)\n",
+            name, err);
+        goto failed;
+    }
+    pDataSource = NULL;     /* now owned by the library */
+
+    /* flush now, so the compression setting applies to this file only */
+    err = NuFlush(pArchive, &status);
+    if (err != kNuErrNone) {
+        fprintf(stderr, "ERROR: flush failed (err=%d, status=%u)\n",
+            err, status);
+        goto failed;
+    }
+
+    return 0;
+
+failed:
+    free(buf);
+    NuFreeDataSource(pDataSource);
+    return -1;
+}
+
+/*
+ * Extract a file with the given settings, and compare it to what the
+ * reference conversion produced.
+ */
+int CheckOneExtract(NuArchive* pArchive, const NuThread* pThread,
+    const char* name, const uint8_t* orig, uint32_t len, uint8_t* outBuf,
+    uint8_t* refBuf, NuValue convertEOL, NuValue eol, int stripHigh)
+{
+    NuError err;
+    NuDataSink* pDataSink = NULL;
+    uint32_t outLen, refLen, i;
+
+    refLen = RefConvert(orig, len, refBuf, convertEOL, eol, stripHigh);
+
+    err = NuSetValue(pArchive, kNuValueEOL, eol);
+    if (err == kNuErrNone)
+        err = NuSetValue(pArchive, kNuValueStripHighASCII, stripHigh);
+    if (err != kNuErrNone) {
+        fprintf(stderr, "ERROR: couldn't set values (err=%d)\n", err);
+        goto failed;
+    }
+
+    err = NuCreateDataSinkForBuffer(true, convertEOL, outBuf, len * 2 + 1,
+            &pDataSink);
+    if (err != kNuErrNone) {
+        fprintf(stderr, "ERROR: couldn't create data sink (err=%d)\n", err);
+        goto failed;
+    }
+
+    err = NuExtractThread(pArchive, pThread->threadIdx, pDataSink);
+    if (err != kNuErrNone) {
+        fprintf(stderr, "ERROR: couldn't extract '%s' (err=%d)\n", name, err);
+        goto failed;
+    }
+    (void) NuDataSinkGetOutCount(pDataSink, &outLen);
+
+    if (outLen != refLen || memcmp(outBuf, refBuf, refLen) != 0) {
+        for (i = 0; i < outLen && i < refLen; i++) {
+            if (outBuf[i] != refBuf[i])
+                break;
+        }
+        fprintf(stderr,
+            "ERROR: '%s' (len=%u) mismatch with convert=%d eol=%d strip=%d:"
+            " got %u bytes, expected %u, first difference at %u\n",
+            name, len, convertEOL, eol, stripHigh, outLen, refLen, i);
+        goto failed;
+    }
+
+    NuFreeDataSink(pDataSink);
+    return 0;
+
+failed:
+    NuFreeDataSink(pDataSink);
+    return -1;
+}
+
+/*
+ * Extract a file with every combination of settings.
+ */
+int CheckFile(NuArchive* pArchive, const char* name, TextKind kind,
+    const uint8_t* orig, uint32_t len)
+{
+    static const NuValue kEOLs[] = { kNuEOLCR, kNuEOLLF, kNuEOLCRLF };
+    NuError err;
+    NuRecordIdx recordIdx;
+    const NuRecord* pRecord;
+    const NuThread* pThread = NULL;
+    uint8_t* outBuf = NULL;
+    uint8_t* refBuf = NULL;
+    int result = -1;
+    int i, eolIdx, stripHigh;
+
+    err = NuGetRecordIdxByName(pArchive, name, &recordIdx);
+    if (err == kNuErrNone)
+        err = NuGetRecord(pArchive, recordIdx, &pRecord);
+    if (err != kNuErrNone) {
+        fprintf(stderr, "ERROR: couldn't find '%s' (err=%d)\n", name, err);
+        goto bail;
+    }
+    for (i = 0; i < (int) NuRecordGetNumThreads(pRecord); i++) {
+        pThread = NuGetThread(pRecord, i);
+        if (NuGetThreadID(pThread) == kNuThreadIDDataFork)
+            break;
+        pThread = NULL;
+    }
+    if (pThread == NULL) {
+        fprintf(stderr, "ERROR: no data fork in '%s'\n", name);
+        goto bail;
+    }
+
+    outBuf = malloc(len * 2 + 1);
+    refBuf = malloc(len * 2 + 1);
+    if (outBuf == NULL || refBuf == NULL) {
+        fprintf(stderr, "ERROR: malloc failed\n");
+        goto bail;
+    }
+
+    for (eolIdx = 0; eolIdx < (int) NELEM(kEOLs); eolIdx++) {
+        for (stripHigh = 0; stripHigh <= 1; stripHigh++) {
+            if (CheckOneExtract(pArchive, pThread, name, orig, len, outBuf,
+                    refBuf, kNuConvertOn, kEOLs[eolIdx], stripHigh) != 0)
+            {
+                goto bail;
+            }
+
+            /* see RefConvert() for why some kinds can't be checked here */
+            if (kind == kKindMixed || kind == kKindEOLOnly)
+                continue;
+            if (CheckOneExtract(pArchive, pThread, name, orig, len, outBuf,
+                    refBuf, kNuConvertAuto, kEOLs[eolIdx], stripHigh) != 0)
+            {
+                goto bail;
+            }
+        }
+    }
+
+    result = 0;
+
+bail:
+    free(outBuf);
+    free(refBuf);
+    return result;
+}
+
+/*
+ * Create the archive, add the files, and check them.
+ */
+int DoTests(void)
+{
+    NuError err;
+    NuArchive* pArchive = NULL;
+    uint8_t* dataBufs[kNumEntries];
+    uint32_t dataLens[kNumEntries];
+    char name[32];
+    int result = 0;
+    int i;
+
+    memset(dataBufs, 0, sizeof(dataBufs));
+
+    if (RemoveTestFile("Test archive", kTestArchive) != 0)
+        return -1;
+    if (RemoveTestFile("Test temp file", kTestTempFile) != 0)
+        return -1;
+
+    err = NuOpenRW(kTestArchive, kTestTempFile, kNuOpenCreat, &pArchive);
+    if (err != kNuErrNone) {
+        fprintf(stderr, "ERROR: unable to create archive (err=%d)\n", err);
+        goto failed;
+    }
+
+    printf("... adding %d files\n", kNumEntries);
+    for (i = 0; i < kNumEntries; i++) {
+        uint8_t* buf;
+
+        dataLens[i] = PickLength(i);
+        dataBufs[i] = malloc(dataLens[i] + 1);
+        buf = malloc(dataLens[i] + 1);
+        if (dataBufs[i] == NULL || buf == NULL) {
+            fprintf(stderr, "ERROR: malloc failed\n");
+            free(buf);
+            goto failed;
+        }
+        GenerateData((TextKind) (i % kKindMAX), dataBufs[i], dataLens[i]);
+        memcpy(buf, dataBufs[i], dataLens[i]);
+
+        sprintf(name, "file%02d", i);
+        if (AddTestFile(pArchive, name, buf, dataLens[i],
+                (i & 1) ? kNuCompressLZW2 : kNuCompressNone) != 0)
+        {
+            goto failed;
+        }
+    }
+
+    printf("... extracting and comparing\n");
+    for (i = 0; i < kNumEntries; i++) {
+        sprintf(name, "file%02d", i);
+        if (CheckFile(pArchive, name, (TextKind) (i % kKindMAX),
+                dataBufs[i], dataLens[i]) != 0)
+        {
+            goto failed;
+        }
+    }
+
+    NuClose(pArchive);
+    pArchive = NULL;
+
+    printf("... removing '%s'\n", kTestArchive);
+    if (unlink(kTestArchive) < 0) {
+        perror("unlink kTestArchive");
+        goto failed;
+    }
+
+leave:
+    if (pArchive != NULL) {
+        NuAbort(pArchive);
+        NuClose(pArchive);
+    }
+    for (i = 0; i < kNumEntries; i++)
+        free(dataBufs[i]);
+    return result;
+
+failed:
+    result = -1;
+    goto leave;
+}
+
+
+/*
+ * Crank away.
+ */
+int main(int argc, char** argv)
+{
+    int32_t major, minor, bug;
+    const char* pBuildDate;
+    const char* pBuildFlags;
+    int cc;
+
+    (void) NuGetVersion(&major, &minor, &bug, &pBuildDate, &pBuildFlags);
+    printf("Using NuFX library v%d.%d.%d, built on or after\n"
+           "  %s with [%s]\n\n",
+        major, minor, bug, pBuildDate, pBuildFlags);
+
+    if (argc > 2) {
+        fprintf(stderr, "Usage: %s [seed]\n", argv[0]);
+        exit(2);
+    }
+    if (argc == 2)
+        gRandState = (uint32_t) strtoul(argv[1], NULL, 0);
+    else
+        gRandState = (uint32_t) time(NULL);
+    if (gRandState == 0)
+        gRandState = 1;     /* xorshift gets stuck on zero */
+
+    if (NuSetGlobalErrorMessageHandler(ErrorMessageHandler) ==
+        kNuInvalidCallback)
+    {
+        fprintf(stderr, "ERROR: can't set the global message handler");
+        exit(1);
+    }
+
+    printf("... starting tests, seed=%u\n", gRandState);
+
+    cc = DoTests();
+
+    printf("... tests ended, %s\n", cc == 0 ? "SUCCESS" : "FAILURE");
+    exit(cc != 0);
+}
@@ -35,7 +35,10 @@ public:
         kNumDHRColors = 16,
     };
 
-    /* this MUST match up with prefs ctrl indices (IDC_DHR_CONV_COMBO) */
+    /*
+     * This MUST match up with prefs ctrl indices (IDC_DHR_CONV_COMBO),
+     * and with PixelConv::DHRAlgorithm.
+     */
     typedef enum {
         kDHRBlackWhite = 0,
         kDHRLatched = 1,
@@ -43,12 +46,10 @@ public:
         kDHRWindow = 3,
     } Algorithms;
 
-    void InitColorLookup(void);
     MyDIBitmap* DHRScreenToBitmap(const uint8_t* buf);
 
     Algorithms  fAlgorithm;
     int         fLineOffset[kNumLines];
-    unsigned int fColorLookup[4][kNumDHRColors];
 };
 
 #endif /*REFORMAT_DOUBLEHIRES_H*/
@@ -8,6 +8,7 @@
  */
 #include "StdAfx.h"
 #include "HiRes.h"
+#include "PixelConv.h"
 
 /*
  * Hi-Res image format:
@@ -384,10 +385,8 @@ MyDIBitmap* ReformatHiRes::HiResScreenToBitmap(const uint8_t* buf)
 {
     MyDIBitmap* pDib = new MyDIBitmap;
     uint8_t* outBuf;
-    const int kLeadIn = 4;
-    unsigned int colorBuf[kLeadIn+kOutputWidth +1];     // 560 half-pixels 
-    int pixelBits[kPixelsPerLine];
-    int shiftBits[kPixelsPerLine];
+    const int kBytesPerLine = kPixelsPerLine / 7;
+    const int kOutputStride = kOutputWidth / 2;     // 4bpp
     int line;
 
     /* color map */
@@ -429,124 +428,17 @@ MyDIBitmap* ReformatHiRes::HiResScreenToBitmap(const uint8_t* buf)
     pDib->SetColorTable(colorConv);
 
     /*
-     * Run through the lines.
+     * Run through the lines.  See PixelConv::HiResLineToPix4 for the
+     * conversion; each line is doubled.
      */
     for (line = 0; line < kNumLines; line++) {
-        const uint8_t* lineData = buf + fLineOffset[line];
-        int* bitPtr = pixelBits;
-        int* shiftPtr = shiftBits;
-
-        /* unravel the bits */
-        for (int byt = 0; byt < kPixelsPerLine / 7; byt++) {
-            uint8_t val = *lineData;
-            int shifted = (val & 0x80) != 0;
-
-            for (int bit = 0; bit < 7; bit++) {
-                *bitPtr++ = val & 0x01;
-                *shiftPtr++ = shifted;
-                val >>= 1;
-            }
-            lineData++;
-        }
-        ASSERT(lineData <= buf + kExpectedSize);
-        ASSERT((char*)bitPtr == (char*)pixelBits + sizeof(pixelBits));
-        ASSERT((char*)shiftPtr == (char*)shiftBits + sizeof(shiftBits));
-
-        /*
-         * Convert the bits to colors, taking half-pixel shifts into account.
-         */
-        int idx;
-        for (idx = 0; idx < NELEM(colorBuf); idx++)
-            colorBuf[idx] = kColorNone;
-        if (fBlackWhite) {
-            for (idx = 0; idx < kPixelsPerLine; idx ++) {
-                int bufShift = (int) shiftBits[idx];
-                // simulate GS RGB by setting bufShift=0
-                ASSERT(bufShift == 0 || bufShift == 1);
-                int bufTarget = kLeadIn + idx * 2 + bufShift;
-
-                if (!pixelBits[idx]) {
-                    colorBuf[bufTarget] = kColorBlack0;
-                    colorBuf[bufTarget+1] = kColorBlack0;
-                } else {
-                    colorBuf[bufTarget] = kColorWhite0;
-                    colorBuf[bufTarget+1] = kColorWhite0;
-                }
-            }
-        } else {
-            for (idx = 0; idx < kPixelsPerLine; idx ++) {
-                int bufShift = (int) shiftBits[idx];
-                ASSERT(bufShift == 0 || bufShift == 1);
-                int colorShift = 4 * bufShift;
-                int bufTarget = kLeadIn + idx * 2 + bufShift;
-
-                if (!pixelBits[idx]) {
-                    colorBuf[bufTarget] = kColorBlack0 + colorShift;
-                    colorBuf[bufTarget+1] = kColorBlack0 + colorShift;
-                } else {
-                    if (colorBuf[bufTarget-2] != kColorBlack0 &&
-                        colorBuf[bufTarget-2] != kColorBlack1 &&
-                        colorBuf[bufTarget-2] != kColorNone)
-                    {
-                        /* previous bit was set, this is white */
-                        colorBuf[bufTarget] = kColorWhite0 + colorShift;
-                        colorBuf[bufTarget+1] = kColorWhite0 + colorShift;
-
-                        /* make sure the previous bit is in with us */
-                        colorBuf[bufTarget-2] = kColorWhite0 + colorShift;
-                        colorBuf[bufTarget-1] = kColorWhite0 + colorShift;
-                    } else {
-                        /* previous bit was zero, this is color */
-                        if (idx & 0x01) {
-                            colorBuf[bufTarget] = kColorGreen + colorShift;
-                            colorBuf[bufTarget+1] = kColorGreen + colorShift;
-                        } else {
-                            colorBuf[bufTarget] = kColorPurple + colorShift;
-                            colorBuf[bufTarget+1] = kColorPurple + colorShift;
-                        }
-
-                        /*
-                         * Do we have a run of the same color?  If so, smooth
-                         * the color out.  Note that white blends smoothly
-                         * with everything.
-                         */
-                        if (colorBuf[bufTarget-4] == colorBuf[bufTarget] ||
-                            colorBuf[bufTarget-4] == kColorWhite0 ||
-                            colorBuf[bufTarget-4] == kColorWhite1)
-                        {
-                            /* back-fill previous gap with color */
-                            ASSERT(colorBuf[bufTarget-2] == kColorBlack0 ||
-                                   colorBuf[bufTarget-2] == kColorBlack1);
-                            colorBuf[bufTarget-2] = colorBuf[bufTarget];
-                            colorBuf[bufTarget-1] = colorBuf[bufTarget];
-                        }
-                    }
-                }
-            } /*for boolean pixels*/
-        } /*!black&white*/
-
-        /* convert colors to 4-bit bitmap pixels */
-        /* (NOTE: should advance by GetPitch(), not assume it's equal to width) */
-#define SetPix(x, y, twoval) \
-        outBuf[((kOutputHeight-1) - (y)) * (kOutputWidth/2) + (x)] = twoval
-
-        uint8_t pix4;
-        for (int pix = 0; pix < kPixelsPerLine; pix++) {
-            int bufPosn = kLeadIn + pix * 2;
-            ASSERT(colorBuf[bufPosn] < kNumColors);
-            ASSERT(colorBuf[bufPosn+1] < kNumColors);
-
-            pix4 = colorBuf[bufPosn] << 4 | colorBuf[bufPosn+1];
-            SetPix(pix, line*2, pix4);
-            SetPix(pix, line*2+1, pix4);
-
-            //SetPix(pix*2, line*2, colorBuf[bufPosn]);
-            //SetPix(pix*2, line*2+1, colorBuf[bufPosn]);
-            //SetPix(pix*2+1, line*2, colorBuf[bufPosn+1]);
-            //SetPix(pix*2+1, line*2+1, colorBuf[bufPosn+1]);
-        }
-    } /*for each line*/
-#undef SetPix
+        uint8_t* outRow = outBuf + ((kOutputHeight-1) - line*2) * kOutputStride;
+
+        ASSERT(fLineOffset[line] + kBytesPerLine <= kExpectedSize);
+        PixelConv::HiResLineToPix4(outRow, buf + fLineOffset[line],
+            fBlackWhite);
+        memcpy(outRow - kOutputStride, outRow, kOutputStride);
+    }
 
 bail:
     return pDib;
@@ -0,0 +1,506 @@
+/*
+ * CiderPress
+ * Copyright (C) 2009 by CiderPress authors.  All Rights Reserved.
+ * See the file LICENSE for distribution terms.
+ */
+/*
+ * Pixel conversion for the Apple II and IIgs graphics formats.
+ *
+ * The output must match what the reformatters produced when they did this
+ * a bit (or a pixel) at a time, down to the quirks.  linux/GfxFuzz.cpp has
+ * copies of the old loops and checks these against them.
+ *
+ * This file doesn't use the precompiled header, so it has no MFC
+ * dependencies.
+ */
+#include <string.h>
+#include "PixelConv.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+# define PIXELCONV_SSE2
+# include <emmintrin.h>
+#endif
+
+/*static*/ bool PixelConv::fSIMDEnabled = true;
+
+/*static*/ bool PixelConv::HaveSIMD(void)
+{
+#ifdef PIXELCONV_SSE2
+    return true;
+#else
+    return false;
+#endif
+}
+
+/*
+ * Rotate a 4-bit DHR color right by 0-3 bits, so the color can be looked
+ * up no matter where in the 4-pixel cycle the window starts.
+ */
+static const uint8_t kDHRColorLookup[4][16] = {
+    {  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15 },
+    {  0,  8,  1,  9,  2, 10,  3, 11,  4, 12,  5, 13,  6, 14,  7, 15 },
+    {  0,  4,  8, 12,  1,  5,  9, 13,  2,  6, 10, 14,  3,  7, 11, 15 },
+    {  0,  2,  4,  6,  8, 10, 12, 14,  1,  3,  5,  7,  9, 11, 13, 15 },
+};
+
+/*
+ * Lookup tables, filled in at startup.
+ *
+ * gSHR640 and gSHR320 hold the four palette indices each SHR pixel byte
+ * turns into (before the color table offset is added).  gBitExpand holds
+ * the seven pixels in a hi-res byte, low bit first, plus a zero so we can
+ * copy eight at a time.
+ */
+static uint8_t gSHR640[256][4];
+static uint8_t gSHR320[256][4];
+static uint8_t gBitExpand[128][8];
+
+static struct PixelConvTables {
+    PixelConvTables(void) {
+        for (int val = 0; val < 256; val++) {
+            gSHR640[val][0] = ((val >> 6) & 0x03) + 8;
+            gSHR640[val][1] = ((val >> 4) & 0x03) + 12;
+            gSHR640[val][2] = ((val >> 2) & 0x03) + 0;
+            gSHR640[val][3] = (val & 0x03) + 4;
+
+            gSHR320[val][0] = gSHR320[val][1] = val >> 4;
+            gSHR320[val][2] = gSHR320[val][3] = val & 0x0f;
+        }
+        for (int val = 0; val < 128; val++) {
+            for (int bit = 0; bit < 7; bit++)
+                gBitExpand[val][bit] = (val >> bit) & 0x01;
+            gBitExpand[val][7] = 0;
+        }
+    }
+} gPixelConvTables;
+
+
+/*
+ * ===========================================================================
+ *      PackBytes
+ * ===========================================================================
+ */
+
+/*static*/ long PixelConv::UnpackBytes(uint8_t* dst, const uint8_t* src,
+    long dstRem, long srcLen)
+{
+    const uint8_t* origDst = dst;
+    uint8_t pattern[4];
+    long count, len;
+
+    while (srcLen > 0) {
+        uint8_t flag = *src++;
+        srcLen--;
+        count = (flag & 0x3f) + 1;
+
+        switch (flag & 0xc0) {
+        case 0x00:
+            /* 1-64 literal bytes */
+            len = count;
+            if (len > srcLen)
+                len = srcLen;
+            if (len > dstRem)
+                len = dstRem;
+            memcpy(dst, src, len);
+            dst += len;
+            dstRem -= len;
+            src += len;
+            srcLen -= len;
+            if (len != count)
+                return -1;
+            break;
+        case 0x40:
+            /* 1-64 repeats of one byte */
+            if (srcLen == 0)
+                return -1;
+            len = (count < dstRem) ? count : dstRem;
+            memset(dst, *src, len);
+            dst += len;
+            dstRem -= len;
+            src++;
+            srcLen--;
+            if (len != count)
+                return -1;
+            break;
+        case 0x80:
+        case 0xc0:
+            /* 1-64 repeats of four bytes, or of one byte taken as four */
+            if (flag & 0x40) {
+                if (srcLen == 0)
+                    return -1;
+                memset(pattern, *src, 4);
+                src++;
+                srcLen--;
+            } else {
+                if (srcLen < 4)
+                    return -1;
+                memcpy(pattern, src, 4);
+                src += 4;
+                srcLen -= 4;
+            }
+            len = (count < dstRem / 4) ? count : dstRem / 4;
+            for (long i = 0; i < len; i++) {
+                memcpy(dst, pattern, 4);
+                dst += 4;
+            }
+            dstRem -= len * 4;
+            if (len != count)
+                return -1;
+            break;
+        }
+    }
+
+    return (long) (dst - origDst);
+}
+
+
+/*
+ * ===========================================================================
+ *      Super hi-res
+ * ===========================================================================
+ */
+
+#ifdef PIXELCONV_SSE2
+/*
+ * 320 mode, 16 bytes at a time.  Each byte becomes its high nibble twice,
+ * then its low nibble twice.
+ */
+static void SHRLine320SSE2(uint8_t* out, const uint8_t* pixels,
+    unsigned int numBytes, uint8_t tableOffset)
+{
+    const __m128i nibbleMask = _mm_set1_epi8(0x0f);
+    const __m128i offset = _mm_set1_epi8((char) tableOffset);
+
+    for (unsigned int i = 0; i < numBytes; i += 16, out += 64) {
+        __m128i val = _mm_loadu_si128((const __m128i*) (pixels + i));
+        __m128i hi = _mm_and_si128(_mm_srli_epi16(val, 4), nibbleMask);
+        __m128i lo = _mm_and_si128(val, nibbleMask);
+        hi = _mm_add_epi8(hi, offset);
+        lo = _mm_add_epi8(lo, offset);
+
+        __m128i pairs = _mm_unpacklo_epi8(hi, lo);
+        _mm_storeu_si128((__m128i*) (out + 0), _mm_unpacklo_epi8(pairs, pairs));
+        _mm_storeu_si128((__m128i*) (out + 16), _mm_unpackhi_epi8(pairs, pairs));
+        pairs = _mm_unpackhi_epi8(hi, lo);
+        _mm_storeu_si128((__m128i*) (out + 32), _mm_unpacklo_epi8(pairs, pairs));
+        _mm_storeu_si128((__m128i*) (out + 48), _mm_unpackhi_epi8(pairs, pairs));
+    }
+}
+
+/*
+ * 640 mode, 16 bytes at a time.  Each byte becomes four 2-bit pixels, high
+ * bits first, offset by 8, 12, 0, and 4.
+ */
+static void SHRLine640SSE2(uint8_t* out, const uint8_t* pixels,
+    unsigned int numBytes, uint8_t tableOffset)
+{
+    const __m128i mask = _mm_set1_epi8(0x03);
+    const __m128i offset3 = _mm_set1_epi8((char) (tableOffset + 8));
+    const __m128i offset2 = _mm_set1_epi8((char) (tableOffset + 12));
+    const __m128i offset1 = _mm_set1_epi8((char) (tableOffset + 0));
+    const __m128i offset0 = _mm_set1_epi8((char) (tableOffset + 4));
+
+    for (unsigned int i = 0; i < numBytes; i += 16, out += 64) {
+        __m128i val = _mm_loadu_si128((const __m128i*) (pixels + i));
+        __m128i pix3 = _mm_add_epi8(
+                    _mm_and_si128(_mm_srli_epi16(val, 6), mask), offset3);
+        __m128i pix2 = _mm_add_epi8(
+                    _mm_and_si128(_mm_srli_epi16(val, 4), mask), offset2);
+        __m128i pix1 = _mm_add_epi8(
+                    _mm_and_si128(_mm_srli_epi16(val, 2), mask), offset1);
+        __m128i pix0 = _mm_add_epi8(_mm_and_si128(val, mask), offset0);
+
+        __m128i front = _mm_unpacklo_epi8(pix3, pix2);
+        __m128i back = _mm_unpacklo_epi8(pix1, pix0);
+        _mm_storeu_si128((__m128i*) (out + 0), _mm_unpacklo_epi16(front, back));
+        _mm_storeu_si128((__m128i*) (out + 16), _mm_unpackhi_epi16(front, back));
+        front = _mm_unpackhi_epi8(pix3, pix2);
+        back = _mm_unpackhi_epi8(pix1, pix0);
+        _mm_storeu_si128((__m128i*) (out + 32), _mm_unpacklo_epi16(front, back));
+        _mm_storeu_si128((__m128i*) (out + 48), _mm_unpackhi_epi16(front, back));
+    }
+}
+#endif /*PIXELCONV_SSE2*/
+
+/*static*/ void PixelConv::SHRLineToIndex8(uint8_t* out,
+    const uint8_t* pixels, unsigned int bytesPerLine,
+    unsigned int outputWidthPix, bool mode640, uint8_t tableOffset)
+{
+    const uint8_t (*table)[4] = mode640 ? gSHR640 : gSHR320;
+    const uint32_t offset4 = tableOffset * 0x01010101U;
+    unsigned int fullBytesPerLine = outputWidthPix / 4;
+    unsigned int byteCount = 0;
+
+#ifdef PIXELCONV_SSE2
+    if (fSIMDEnabled) {
+        byteCount = fullBytesPerLine & ~15;
+        if (mode640)
+            SHRLine640SSE2(out, pixels, byteCount, tableOffset);
+        else
+            SHRLine320SSE2(out, pixels, byteCount, tableOffset);
+    }
+#endif
+
+    /* the offset can't carry from one byte into the next */
+    for ( ; byteCount < fullBytesPerLine; byteCount++) {
+        uint32_t quad;
+        memcpy(&quad, table[pixels[byteCount]], 4);
+        quad += offset4;
+        memcpy(out + byteCount * 4, &quad, 4);
+    }
+
+    if (byteCount != bytesPerLine) {
+        const uint8_t* entry = table[pixels[byteCount]];
+        uint8_t* outPtr = out + byteCount * 4;
+
+        if (mode640) {
+            /*
+             * 1-3 pixels in the last byte.  These have always been taken
+             * from the end of the first three, i.e. with one leftover
+             * pixel we output the third one.
+             */
+            int rem = outputWidthPix - fullBytesPerLine * 4;
+            for (int i = 0; i < rem; i++)
+                outPtr[i] = entry[3 - rem + i] + tableOffset;
+        } else {
+            /* one doubled pixel in the last byte */
+            outPtr[0] = outPtr[1] = entry[0] + tableOffset;
+        }
+    }
+}
+
+/*static*/ void PixelConv::SHR3200LineToRGB24(uint8_t* out,
+    const uint8_t* pixels, unsigned int bytesPerLine, const uint8_t* palette)
+{
+    uint8_t doubled[16][6];
+
+    for (int i = 0; i < 16; i++) {
+        memcpy(&doubled[i][0], palette + i * 3, 3);
+        memcpy(&doubled[i][3], palette + i * 3, 3);
+    }
+
+    for (unsigned int byteCount = 0; byteCount < bytesPerLine; byteCount++) {
+        uint8_t pixelByte = pixels[byteCount];
+        memcpy(out, doubled[pixelByte >> 4], 6);
+        memcpy(out + 6, doubled[pixelByte & 0x0f], 6);
+        out += 12;
+    }
+}
+
+
+/*
+ * ===========================================================================
+ *      Hi-res and double hi-res
+ * ===========================================================================
+ */
+
+/*
+ * Pack pairs of color values (0-15) into 4bpp pixels, first one in the
+ * high nibble.
+ */
+/*static*/ void PixelConv::PackPix4(uint8_t* out, const uint8_t* colors,
+    int numPairs)
+{
+    int pair = 0;
+
+#ifdef PIXELCONV_SSE2
+    if (fSIMDEnabled) {
+        const __m128i lowMask = _mm_set1_epi16(0x00ff);
+
+        for ( ; pair + 16 <= numPairs; pair += 16) {
+            __m128i val0 = _mm_loadu_si128((const __m128i*) (colors + pair * 2));
+            __m128i val1 =
+                _mm_loadu_si128((const __m128i*) (colors + pair * 2 + 16));
+
+            /* each 16-bit lane holds (second << 8) | first */
+            val0 = _mm_or_si128(
+                    _mm_slli_epi16(_mm_and_si128(val0, lowMask), 4),
+                    _mm_srli_epi16(val0, 8));
+            val1 = _mm_or_si128(
+                    _mm_slli_epi16(_mm_and_si128(val1, lowMask), 4),
+                    _mm_srli_epi16(val1, 8));
+            _mm_storeu_si128((__m128i*) (out + pair),
+                _mm_packus_epi16(val0, val1));
+        }
+    }
+#endif
+
+    for ( ; pair < numPairs; pair++)
+        out[pair] = colors[pair * 2] << 4 | colors[pair * 2 + 1];
+}
+
+/*static*/ void PixelConv::HiResLineToPix4(uint8_t* out,
+    const uint8_t* lineData, bool blackWhite)
+{
+    /* color numbers; see ReformatHiRes::HiResScreenToBitmap */
+    enum {
+        kColorBlack0 = 0, kColorGreen, kColorPurple, kColorWhite0,
+        kColorBlack1, kColorOrange, kColorBlue, kColorWhite1,
+        kColorNone
+    };
+    const int kLeadIn = 4;
+    uint8_t colorBuf[kLeadIn + kHiResOutputBytes * 2 + 1];   // half-pixels
+    int idx = 0;
+
+    memset(colorBuf, kColorNone, sizeof(colorBuf));
+
+    for (int byt = 0; byt < kHiResBytesPerLine; byt++) {
+        unsigned int val = lineData[byt];
+        int bufShift = val >> 7;
+        int colorShift = 4 * bufShift;
+        uint8_t* target = colorBuf + kLeadIn + byt * 14 + bufShift;
+
+        if (blackWhite) {
+            for (int bit = 0; bit < 7; bit++, target += 2, val >>= 1) {
+                target[0] = target[1] =
+                    (val & 0x01) ? kColorWhite0 : kColorBlack0;
+            }
+            continue;
+        }
+
+        for (int bit = 0; bit < 7; bit++, target += 2, val >>= 1, idx++) {
+            if (!(val & 0x01)) {
+                target[0] = target[1] = kColorBlack0 + colorShift;
+            } else if (target[-2] != kColorBlack0 &&
+                target[-2] != kColorBlack1 && target[-2] != kColorNone)
+            {
+                /* previous bit was set, so both are white */
+                target[-2] = target[-1] = target[0] = target[1] =
+                    kColorWhite0 + colorShift;
+            } else {
+                /* previous bit was zero, this is color */
+                uint8_t color = ((idx & 0x01) ? kColorGreen : kColorPurple) +
+                                colorShift;
+                target[0] = target[1] = color;
+
+                /* fill the gap in a run of the same color, or after white */
+                if (target[-4] == color || target[-4] == kColorWhite0 ||
+                    target[-4] == kColorWhite1)
+                {
+                    target[-2] = target[-1] = color;
+                }
+            }
+        }
+    }
+
+    PackPix4(out, colorBuf + kLeadIn, kHiResOutputBytes);
+}
+
+/*static*/ void PixelConv::DHRLineToPix4(uint8_t* out,
+    const uint8_t* lineData, DHRAlgorithm algorithm)
+{
+    enum { kColorBlack = 0, kColorWhite = 15 };
+    const int kMaxLook = 4;     // padding for lookbehind/lookahead
+    const int kNumPixels = kDHROutputBytes * 2;
+    uint8_t pixelBits[kMaxLook + kNumPixels + kMaxLook];
+    uint8_t colorBuf[kNumPixels];
+    uint8_t* bitPtr;
+    int idx;
+
+    /*
+     * Unravel the bits.  Even bytes come from aux memory, odd bytes from
+     * main.  We copy eight bytes for every seven pixels; the extra one is
+     * zero, and is overwritten by the next byte or left as padding.
+     */
+    memset(pixelBits, 0, kMaxLook);
+    bitPtr = pixelBits + kMaxLook;
+    for (int byt = 0; byt < kNumPixels / 7; byt++) {
+        uint8_t val = (byt & 0x01) ?
+            lineData[kDHRPageSize + byt / 2] : lineData[byt / 2];
+        memcpy(bitPtr, gBitExpand[val & 0x7f], 8);
+        bitPtr += 7;
+    }
+    memset(bitPtr, 0, kMaxLook);
+
+    switch (algorithm) {
+    case kDHRBlackWhite:
+        /*
+         * This starts in the lookbehind padding, so the image is shifted
+         * four pixels to the right.  It has always worked this way.
+         */
+        for (idx = 0; idx < kNumPixels; idx++)
+            colorBuf[idx] = pixelBits[idx] ? kColorWhite : kColorBlack;
+        break;
+
+    case kDHRPlain140:
+        /*
+         * Very simple: every four pixels is a solid color.  Not too close
+         * to reality, but easy to implement.
+         */
+        bitPtr = pixelBits + kMaxLook;
+        for (idx = 0; idx < kNumPixels; idx += 4, bitPtr += 4) {
+            uint8_t pixVal =
+                bitPtr[0] << 3 | bitPtr[1] << 2 | bitPtr[2] << 1 | bitPtr[3];
+            colorBuf[idx] = colorBuf[idx+1] = colorBuf[idx+2] =
+                colorBuf[idx+3] = pixVal;
+        }
+        break;
+
+    case kDHRWindow:
+        {
+            /*
+             * The color at pixel N comes from the pixels at N-3, N-2, N-1,
+             * and N, with a continuously shifting 4-bit-wide window.
+             */
+            unsigned int pixVal = 0;
+            bitPtr = pixelBits + kMaxLook;
+            for (idx = 0; idx < kNumPixels; idx++) {
+                pixVal = ((pixVal << 1) & 0x0f) | *bitPtr++;
+                colorBuf[idx] = kDHRColorLookup[(idx+1) & 0x03][pixVal];
+            }
+        }
+        break;
+
+    case kDHRLatched:
+    default:
+        {
+            /*
+             * The color at pixel N comes from the pixels at N-3 through N.
+             * When we see a color transition, we also look at N+1 through
+             * N+4 to special-case white/black transitions, which reduces
+             * the color fringes around sharply defined objects.
+             *
+             * Once a color is "latched", we keep outputting that color
+             * until we find a new one that we like more.  We manage this
+             * with a continuously shifting 8-bit-wide window.
+             */
+            unsigned int whole = 0;
+            uint8_t newColor, oldColor;
+
+            bitPtr = pixelBits;
+            for (idx = 0; idx < 8; idx++)
+                whole = (whole << 1) | *bitPtr++;
+            oldColor = kDHRColorLookup[idx & 0x03][whole & 0x0f];
+
+            for (idx = 0; idx < kNumPixels; idx++) {
+                /* looks like PPPCNNNN */
+                whole = ((whole << 1) | *bitPtr++) & 0xff;
+                newColor = kDHRColorLookup[(idx+1) & 0x03][whole >> 4];
+
+                if (newColor != oldColor) {
+                    unsigned int shift1 = (whole >> 3) & 0x0f;  // PPCN
+                    unsigned int shift2 = (whole >> 2) & 0x0f;  // PCNN
+                    unsigned int shift3 = (whole >> 1) & 0x0f;  // CNNN
+
+                    if (shift1 == 0x0f || shift2 == 0x0f || shift3 == 0x0f)
+                        newColor = kColorWhite;
+                    else if (shift1 == 0 || shift2 == 0 || shift3 == 0)
+                        newColor = kColorBlack;
+                }
+
+                /*
+                 * Use the new color as the old color for the next pixel.
+                 * This is *NOT* the same as getting the color from PPPP,
+                 * because we might have overridden it with white or black
+                 * above.
+                 */
+                colorBuf[idx] = newColor;
+                oldColor = newColor;        // latch it
+            }
+        }
+        break;
+    }
+
+    PackPix4(out, colorBuf, kDHROutputBytes);
+}
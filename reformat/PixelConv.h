@@ -0,0 +1,94 @@
+/*
+ * CiderPress
+ * Copyright (C) 2009 by CiderPress authors.  All Rights Reserved.
+ * See the file LICENSE for distribution terms.
+ */
+/*
+ * Pixel conversion for the Apple II and IIgs graphics formats.
+ *
+ * These are the inner loops of the hi-res, double-hi-res, and super-hi-res
+ * reformatters.  They don't depend on MFC or anything else in the app, so
+ * they can be built and checked on other systems (see linux/GfxFuzz.cpp).
+ *
+ * Each function converts one scan line into one row of a bottom-up DIB.
+ * The reformatters double the lines by copying the row.
+ */
+#ifndef REFORMAT_PIXELCONV_H
+#define REFORMAT_PIXELCONV_H
+
+#include <stdint.h>
+
+class PixelConv {
+public:
+    /* must match ReformatDHR::Algorithms */
+    typedef enum {
+        kDHRBlackWhite = 0,
+        kDHRLatched = 1,
+        kDHRPlain140 = 2,
+        kDHRWindow = 3,
+    } DHRAlgorithm;
+
+    enum {
+        kHiResBytesPerLine = 40,
+        kHiResOutputBytes = 280,    // 560 4bpp pixels
+        kDHRPageSize = 8192,
+        kDHROutputBytes = 280,      // 560 4bpp pixels
+    };
+
+    /*
+     * Unpack Apple PackBytes data.  Returns the number of bytes written,
+     * or -1 if the output filled up or the input ran out in the middle of
+     * a run.  On failure, the output holds everything that fit.
+     */
+    static long UnpackBytes(uint8_t* dst, const uint8_t* src, long dstRem,
+        long srcLen);
+
+    /*
+     * Convert one line of SHR pixel data to 8bpp palette indices.
+     *
+     * "outputWidthPix" must be from bytesPerLine*4-3 to bytesPerLine*4.
+     * 320-mode pixels are doubled.  The palette index is "tableOffset" plus
+     * the pixel value; in 640 mode, the value is also offset by 8, 12, 0,
+     * or 4 depending on its position in the byte, so the dithered colors
+     * come out right.
+     */
+    static void SHRLineToIndex8(uint8_t* out, const uint8_t* pixels,
+        unsigned int bytesPerLine, unsigned int outputWidthPix, bool mode640,
+        uint8_t tableOffset);
+
+    /*
+     * Convert one line of 320-mode SHR pixel data to 24-bit pixels, each
+     * one doubled.  "palette" holds 16 entries of 3 bytes, already in the
+     * output byte order.
+     */
+    static void SHR3200LineToRGB24(uint8_t* out, const uint8_t* pixels,
+        unsigned int bytesPerLine, const uint8_t* palette);
+
+    /*
+     * Convert one 40-byte line of hi-res data to 4bpp pixels, using the
+     * color numbering in ReformatHiRes::HiResScreenToBitmap.
+     */
+    static void HiResLineToPix4(uint8_t* out, const uint8_t* lineData,
+        bool blackWhite);
+
+    /*
+     * Convert one line of double-hi-res data to 4bpp pixels.  "lineData"
+     * points into the aux page; the main page follows kDHRPageSize later.
+     */
+    static void DHRLineToPix4(uint8_t* out, const uint8_t* lineData,
+        DHRAlgorithm algorithm);
+
+    /*
+     * The SIMD versions are used when the CPU has them.  This turns them
+     * off, so the plain versions can be tested and timed.
+     */
+    static void SetSIMDEnabled(bool enabled) { fSIMDEnabled = enabled; }
+    static bool HaveSIMD(void);
+
+private:
+    static void PackPix4(uint8_t* out, const uint8_t* colors, int numPairs);
+
+    static bool fSIMDEnabled;
+};
+
+#endif /*REFORMAT_PIXELCONV_H*/
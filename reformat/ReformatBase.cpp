@@ -8,6 +8,7 @@
  */
 #include "StdAfx.h"
 #include "ReformatBase.h"
+#include "PixelConv.h"
 #include <math.h>
 
 
@@ -864,115 +865,18 @@ void ReformatGraphics::SetResultBuffer(ReformatOutput* pOutput, MyDIBitmap* pDib
  * length in "srcLen", and expected sizes of output in "dstRem".
  *
  * Returns the number of bytes unpacked on success, negative if the buffer is
- * overfilled.
+ * overfilled.  On failure, the buffer holds whatever fit.
  */
 int ReformatGraphics::UnpackBytes(uint8_t* dst, const uint8_t* src,
     long dstRem, long srcLen)
 {
-    const uint8_t* origDst = dst;
+    long result = PixelConv::UnpackBytes(dst, src, dstRem, srcLen);
 
-    while (srcLen > 0) {
-        uint8_t flag = *src++;
-        int count = (flag & 0x3f) +1;
-        uint8_t val;
-        uint8_t valSet[4];
-        int i;
-
-        srcLen--;
-    
-        switch (flag & 0xc0) {
-        case 0x00:
-            for (i = 0; i < count; i++) {
-                if (srcLen == 0 || dstRem == 0) {
-                    LOGI(" SHR unpack overrun1 (srcLen=%ld dstRem=%ld)",
-                        srcLen, dstRem);
-                    return -1;
-                }
-                *dst++ = *src++;
-                srcLen--;
-                dstRem--;
-            }
-            break;
-        case 0x40:
-            //if (count != 3 || count != 5 || count != 6 || count != 7) {
-            //  LOGI(" SHR unpack funky len %d?", count);
-            //}
-            if (srcLen == 0) {
-                LOGI(" SHR unpack underrun2");
-                return -1;
-            }
-            val = *src++;
-            srcLen--;
-            for (i = 0; i < count; i++) {
-                if (dstRem == 0) {
-                    LOGI(" SHR unpack overrun2 (srcLen=%d, i=%d of %d)",
-                        srcLen, i, count);
-                    return -1;
-                }
-                *dst++ = val;
-                dstRem--;
-            }
-            break;
-        case 0x80:
-            if (srcLen < 4) {
-                LOGI(" SHR unpack underrun3");
-                return -1;
-            }
-            valSet[0] = *src++;
-            valSet[1] = *src++;
-            valSet[2] = *src++;
-            valSet[3] = *src++;
-            srcLen -= 4;
-            for (i = 0; i < count; i++) {
-                if (dstRem < 4) {
-                    LOGI(" SHR unpack overrun3 (srcLen=%ld dstRem=%ld)",
-                        srcLen, dstRem);
-                    return -1;
-                }
-                *dst++ = valSet[0];
-                *dst++ = valSet[1];
-                *dst++ = valSet[2];
-                *dst++ = valSet[3];
-                dstRem -= 4;
-            }
-            break;
-        case 0xc0:
-            if (srcLen == 0) {
-                LOGI(" SHR unpack underrun4");
-                return -1;
-            }
-            val = *src++;
-            srcLen--;
-            for (i = 0; i < count; i++) {
-                if (dstRem < 4) {
-                    LOGI(" SHR unpack overrun4 (srcLen=%ld dstRem=%ld count=%d)",
-                        srcLen, dstRem, count);
-                    return -1;
-                }
-                *dst++ = val;
-                *dst++ = val;
-                *dst++ = val;
-                *dst++ = val;
-                dstRem -= 4;
-            }
-            break;
-        default:
-            ASSERT(false);
-            break;
-        }
+    if (result < 0) {
+        LOGI(" SHR unpack failed (dstRem=%ld srcLen=%ld)", dstRem, srcLen);
+        return -1;
     }
-
-    ASSERT(srcLen == 0);
-
-    if (false) {
-        /* require that we completely fill the buffer */
-        if (dstRem != 0) {
-            LOGI(" SHR unpack dstRem at %d", dstRem);
-            return -1;
-        }
-    }
-
-    return dst - origDst;
+    return (int) result;
 }
 
 /*
@@ -8,6 +8,7 @@
  */
 #include "StdAfx.h"
 #include "SuperHiRes.h"
+#include "PixelConv.h"
 
 /*
  * ==========================================================================
@@ -107,16 +108,13 @@ MyDIBitmap* ReformatSHR::SHRDataToBitmap8(const uint8_t* pPixels,
     }
 
     /*
-     * Set the pixels to palette indices.
+     * Set the pixels to palette indices.  Each line is converted into the
+     * upper of its two output rows, then copied into the lower.
      */
     unsigned int line;
     for (line = 0; line < numScanLines; line++) {
         bool mode640, fillMode;
         int colorTableOffset;
-        unsigned int byteCount;
-        uint8_t pixelVal;
-        uint8_t colorIndex;
-        int x = 0;
 
         mode640 = (*pSCB & kSCBNumPixels) != 0;
         fillMode = (*pSCB & kSCBFillMode) != 0;
@@ -131,98 +129,12 @@ MyDIBitmap* ReformatSHR::SHRDataToBitmap8(const uint8_t* pPixels,
             DebugBreak();
         }
 
-#define SetPix(x, y, colridx) \
-        outBuf[((outputHeightPix-1) - (y)) * outputStride + (x)] = colridx
-
-        if (mode640) {
-            /* 640 mode, one byte becomes four non-doubled pixels (1:4) */
-            unsigned int fullBytesPerLine = outputWidthPix / 4;
-            ASSERT(fullBytesPerLine <= bytesPerLine);
-
-            for (byteCount = 0; byteCount < fullBytesPerLine; byteCount++) {
-                uint8_t pixelByte = *pPixels++;
-
-                pixelVal = (pixelByte >> 6) & 0x03;
-                colorIndex = colorTableOffset + pixelVal + 8;
-                SetPix(x, line*2, colorIndex);
-                SetPix(x++, line*2+1, colorIndex);
-
-                pixelVal = (pixelByte >> 4) & 0x03;
-                colorIndex = colorTableOffset + pixelVal + 12;
-                SetPix(x, line*2, colorIndex);
-                SetPix(x++, line*2+1, colorIndex);
-
-                pixelVal = (pixelByte >> 2) & 0x03;
-                colorIndex = colorTableOffset + pixelVal + 0;
-                SetPix(x, line*2, colorIndex);
-                SetPix(x++, line*2+1, colorIndex);
-
-                pixelVal = pixelByte & 0x03;
-                //rgbval = fColorLookup[colorTable][pixelVal];
-                colorIndex = colorTableOffset + pixelVal + 4;
-                SetPix(x, line*2, colorIndex);
-                SetPix(x++, line*2+1, colorIndex);
-            }
-            if (byteCount != bytesPerLine) {
-                // 1-3 pixels in last byte
-                uint8_t pixelByte = *pPixels++;
-                int rem = outputWidthPix - fullBytesPerLine * 4;
-                if (rem >= 3) {
-                    pixelVal = (pixelByte >> 6) & 0x03;
-                    colorIndex = colorTableOffset + pixelVal + 8;
-                    SetPix(x, line * 2, colorIndex);
-                    SetPix(x++, line * 2 + 1, colorIndex);
-                }
-                if (rem >= 2) {
-                    pixelVal = (pixelByte >> 4) & 0x03;
-                    colorIndex = colorTableOffset + pixelVal + 12;
-                    SetPix(x, line * 2, colorIndex);
-                    SetPix(x++, line * 2 + 1, colorIndex);
-                }
-                if (rem >= 1) {
-                    pixelVal = (pixelByte >> 2) & 0x03;
-                    colorIndex = colorTableOffset + pixelVal + 0;
-                    SetPix(x, line * 2, colorIndex);
-                    SetPix(x++, line * 2 + 1, colorIndex);
-                }
-            }
-        } else {
-            /* 320 mode, one byte becomes two doubled pixels (1:4) */
-            unsigned int fullBytesPerLine = outputWidthPix / 4;
-            ASSERT(fullBytesPerLine <= bytesPerLine);
-
-            for (byteCount = 0; byteCount < fullBytesPerLine; byteCount++) {
-                uint8_t pixelByte = *pPixels++;
-
-                pixelVal = (pixelByte >> 4) & 0x0f;
-                colorIndex = colorTableOffset + pixelVal;
-                SetPix(x, line*2, colorIndex);
-                SetPix(x++, line*2+1, colorIndex);
-                SetPix(x, line*2, colorIndex);
-                SetPix(x++, line*2+1, colorIndex);
-
-                pixelVal = pixelByte & 0x0f;
-                colorIndex = colorTableOffset + pixelVal;
-                SetPix(x, line*2, colorIndex);
-                SetPix(x++, line*2+1, colorIndex);
-                SetPix(x, line*2, colorIndex);
-                SetPix(x++, line*2+1, colorIndex);
-            }
-            if (byteCount != bytesPerLine) {
-                // 1 pixel in last byte
-                uint8_t pixelByte = *pPixels++;
-                pixelVal = (pixelByte >> 4) & 0x0f;
-                colorIndex = colorTableOffset + pixelVal;
-                SetPix(x, line * 2, colorIndex);
-                SetPix(x++, line * 2 + 1, colorIndex);
-                SetPix(x, line * 2, colorIndex);
-                SetPix(x++, line * 2 + 1, colorIndex);
-            }
-        }
-#undef SetPix
-
-        ASSERT(x == outputWidthPix);
+        uint8_t* outRow = outBuf + ((outputHeightPix-1) - line*2) * outputStride;
+        PixelConv::SHRLineToIndex8(outRow, pPixels, bytesPerLine,
+            outputWidthPix, mode640, colorTableOffset);
+        memcpy(outRow - outputStride, outRow, outputStride);
 
+        pPixels += bytesPerLine;
         pSCB++;
     }
 
@@ -1094,38 +1006,18 @@ MyDIBitmap* Reformat3200SHR::SHR3200ToBitmap24(void)
     }
 
     /*
-     * Set the pixels in our private RGB buffer.
+     * Set the pixels in our private RGB buffer, one line at a time, and
+     * double them up.
      */
     int line;
     for (line = 0; line < kNumLines; line++) {
-        int byteCount, pixelByte;
-        uint8_t pixelVal;
-        RGBTRIPLE rgbval;
-        int x = 0;
-
-#define SetPix(x, y, rgbval) \
-        rgbBuf[((kOutputHeight-1) - (y)) * kOutputWidth + (x)] = rgbval
-
-        for (byteCount = 0; byteCount < kPixelBytesPerLine; byteCount++) {
-            pixelByte = *pPixels++;
-
-            pixelVal = (pixelByte >> 4) & 0x0f;
-            rgbval = colorLookup[line][pixelVal];
-            SetPix(x, line*2, rgbval);
-            SetPix(x++, line*2+1, rgbval);
-            SetPix(x, line*2, rgbval);
-            SetPix(x++, line*2+1, rgbval);
-
-            pixelVal = pixelByte & 0x0f;
-            rgbval = colorLookup[line][pixelVal];
-            SetPix(x, line*2, rgbval);
-            SetPix(x++, line*2+1, rgbval);
-            SetPix(x, line*2, rgbval);
-            SetPix(x++, line*2+1, rgbval);
-        }
-#undef SetPix
+        RGBTRIPLE* outRow = rgbBuf + ((kOutputHeight-1) - line*2) * kOutputWidth;
+
+        PixelConv::SHR3200LineToRGB24((uint8_t*) outRow, pPixels,
+            kPixelBytesPerLine, (const uint8_t*) colorLookup[line]);
+        memcpy(outRow - kOutputWidth, outRow, kOutputWidth * sizeof(RGBTRIPLE));
 
-        ASSERT(x == kOutputWidth);
+        pPixels += kPixelBytesPerLine;
     }
     ASSERT(line == kOutputHeight/2);
 